@@ -0,0 +1,135 @@
+#pragma once
+
+//======================================================================
+
+#include <upl/common.hpp>
+#include <upl/heap.hpp>
+#include <upl/vm.hpp>
+
+//======================================================================
+
+namespace UPL {
+	namespace VM {
+
+//======================================================================
+//  Bulk operations over packed ints, reals and bytes: the elements of
+// Vector (and Array) objects of those, which are laid out one after the
+// other, unboxed. Each one is a loop over all of the elements, done with
+// SIMD kernels for the instruction sets the CPU has (SSE2, which every
+// x86-64 has, and AVX2, picked at run time), or with plain loops where
+// there's neither.
+//
+//  The Bulk instruction runs them on objects; the code generator turns
+// the loops that do the same thing an element at a time into it (see
+// LowerBulkLoops, in ir_passes.hpp.) The results are exactly what those
+// loops would compute (ints and bytes wrap around the same way), except
+// for reducing reals, whose lanes are combined in a different order than
+// one at a time; so sums and products of reals may differ in the last
+// bits, and which NaN (if any) a Min or Max ends up with may differ.
+//======================================================================
+
+// Of the elements: int64, double and uint8
+enum class BulkElement : uint8_t
+{
+	Int,
+	Real,
+	Byte,
+};
+
+int const BulkElementCount = 3;
+
+//----------------------------------------------------------------------
+// The operands, for the instruction (out and a are objects, k and init
+// are scalars of the elements' register kind; bytes and ints are Ints):
+//   Map     (out, a, k)      out[i] = a[i] op k
+//   Zip     (out, a, b)      out[i] = a[i] op b[i]
+//   Reduce  (init, a)        init op a[0] op a[1] ...; an Int for bytes
+//   Filter  (out, a, k)      the a[i] for which "a[i] op k" (or, negated,
+//                            its opposite) holds, packed at the start of
+//                            out, in order; the result is how many
+// For Map and Zip, out must have as many elements as a (or more; the
+// rest are left alone), and for Filter, at least as many as are kept; it
+// must be of the same kind, and may be a itself. b must have at least as
+// many as a.
+
+enum class BulkForm : uint8_t
+{
+	Map,
+	Zip,
+	Reduce,
+	Filter,
+};
+
+enum class BulkOp : uint8_t
+{
+	Add,		// Map, Zip and Reduce
+	Sub,		// Map and Zip
+	Mul,		// Map, Zip and Reduce
+	Min,		// Map, Zip and Reduce
+	Max,		// Map, Zip and Reduce
+	Eq,			// Filter: a[i] == k
+	Lt,			// Filter: a[i] < k
+	Le,			// Filter: a[i] <= k
+	Gt,			// Filter: a[i] > k
+	Ge,			// Filter: a[i] >= k
+};
+
+int const BulkOpCount = 10;
+
+//----------------------------------------------------------------------
+// The instruction's C operand: the form in bits 0-1, the operation in
+// bits 2-5, and whether a Filter's test is negated in bit 7.
+
+inline uint8_t BulkCode (BulkForm form, BulkOp op, bool negate = false)
+{
+	return uint8_t(unsigned(form) | (unsigned(op) << 2) | (negate ? 0x80U : 0U));
+}
+
+inline BulkForm BulkFormOf (uint8_t code) {return BulkForm(code & 3);}
+inline BulkOp BulkOpOf (uint8_t code) {return BulkOp((code >> 2) & 15);}
+inline bool BulkNegated (uint8_t code) {return 0 != (code & 0x80);}
+
+int BulkOperands (BulkForm form);
+bool IsValidBulk (uint8_t code);	// A form and an operation that go together
+char const * BulkName (uint8_t code);	// e.g. "map-add", "filter-not-lt"
+
+//----------------------------------------------------------------------
+
+enum class BulkIsa : uint8_t
+{
+	Scalar,
+	SSE2,
+	AVX2,
+};
+
+char const * BulkIsaName (BulkIsa isa);
+BulkIsa BulkBestIsa ();		// The best one this CPU (and build) can run
+BulkIsa BulkCurrentIsa ();
+// For tests and benchmarks: the kernels of "isa" from now on (for all
+// threads.) False, and nothing changes, if it's better than the best.
+bool BulkUseIsa (BulkIsa isa);
+
+//----------------------------------------------------------------------
+// The kernels themselves, on "n" packed elements of kind "e". "op" must
+// go with the form (see above.)
+
+void BulkMap (BulkElement e, BulkOp op, void * out, void const * a, Reg k, size_t n);
+void BulkZip (BulkElement e, BulkOp op, void * out, void const * a, void const * b, size_t n);
+Reg BulkReduce (BulkElement e, BulkOp op, Reg init, void const * a, size_t n);
+size_t BulkFilter (BulkElement e, BulkOp op, bool negate, void * out, void const * a, Reg k, size_t n);
+
+//----------------------------------------------------------------------
+// What the Bulk instruction does: operation "code" on the "count"
+// operands in args[1], args[2], ...; the result goes in args[0] (out, for
+// Map and Zip.) Adds the number of elements done to "out_elements".
+// Nothing is written unless the operands are all good (but a Filter that
+// runs out of room fails with what fitted stored, as the loop would.)
+
+RunError RunBulk (Heap & heap, uint8_t code, unsigned count, Reg * args, uint64_t & out_elements);
+
+//======================================================================
+
+	}	// namespace VM
+}	// namespace UPL
+
+//======================================================================
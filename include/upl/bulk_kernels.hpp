@@ -0,0 +1,334 @@
+#pragma once
+
+//======================================================================
+
+#include <upl/bulk.hpp>
+
+#include <cstddef>
+#include <cstdint>
+
+//======================================================================
+
+namespace UPL {
+	namespace VM {
+
+//======================================================================
+//  The insides of bulk.hpp, shared by the translation units that build
+// its kernels for each instruction set: bulk.cpp the plain and the SSE2
+// ones, and bulk_avx2.cpp (compiled for AVX2) the AVX2 ones.
+//
+//  The loops are written once, over a "lanes" class L that does each
+// operation on a vector of L::N elements of type L::T:
+//
+//    typedef T (an element), V (a vector of them), M (a mask of lanes)
+//    static int const N
+//    static V Load (T const *), Splat (T); static void Store (T *, V)
+//    static V Add (V, V), Sub, Mul, Min, Max
+//    static M Eq (V, V), Lt, Le
+//    static unsigned Bits (M)             the lanes that are set, as bits
+//
+// and bytes' also add them up, into a wider W:
+//
+//    static W Zero (); static W AddUp (W, V); static int64_t Total (W)
+//
+// What doesn't fill a vector at the end is done with Scalar<T>, which is
+// the same with N = 1 (and also the kernels for when there's no SIMD.)
+//
+//  All of it is in an unnamed namespace, separately in each translation
+// unit, so that no instantiation compiled for AVX2 is ever shared with
+// (and run by) the code for CPUs without it.
+//======================================================================
+
+struct BulkKernels
+{
+	typedef void (*Map) (void * out, void const * a, void const * k, size_t n);
+	typedef void (*Zip) (void * out, void const * a, void const * b, size_t n);
+	typedef void (*Reduce) (void * acc, void const * a, size_t n);	// acc: an int64_t (ints, bytes) or a double
+	typedef size_t (*Filter) (void * out, void const * a, void const * k, size_t n, bool negate);
+
+	// By BulkElement, then BulkOp; nullptr where the two don't go together
+	Map map [BulkElementCount][BulkOpCount];
+	Zip zip [BulkElementCount][BulkOpCount];
+	Reduce reduce [BulkElementCount][BulkOpCount];
+	Filter filter [BulkElementCount][BulkOpCount];
+};
+
+BulkKernels const * BulkAvx2Kernels ();	// nullptr if this build can't do AVX2
+
+//======================================================================
+
+namespace {
+
+//----------------------------------------------------------------------
+
+inline unsigned LowestBit (unsigned m)
+{
+#if defined(__GNUC__)
+	return unsigned(__builtin_ctz(m));
+#else
+	unsigned ret = 0;
+	for (; 0 == (m & 1); m >>= 1)
+		++ret;
+	return ret;
+#endif
+}
+
+//----------------------------------------------------------------------
+// "U" is what the arithmetic is done in, so that ints and bytes wrap.
+
+template <typename T_, typename U>
+struct Scalar
+{
+	typedef T_ T;
+	typedef T_ V;
+	typedef bool M;
+	typedef int64_t W;
+	static int const N = 1;
+
+	static V Load (T const * p) {return *p;}
+	static void Store (T * p, V v) {*p = v;}
+	static V Splat (T k) {return k;}
+
+	static V Add (V a, V b) {return T(U(a) + U(b));}
+	static V Sub (V a, V b) {return T(U(a) - U(b));}
+	static V Mul (V a, V b) {return T(U(a) * U(b));}
+	static V Min (V a, V b) {return (a < b) ? a : b;}	// As SSE's minpd and maxpd, for NaNs
+	static V Max (V a, V b) {return (a > b) ? a : b;}
+
+	static M Eq (V a, V b) {return a == b;}
+	static M Lt (V a, V b) {return a < b;}
+	static M Le (V a, V b) {return a <= b;}
+	static unsigned Bits (M m) {return m ? 1U : 0U;}
+
+	static W Zero () {return 0;}
+	static W AddUp (W w, V v) {return w + W(v);}
+	static int64_t Total (W w) {return w;}
+};
+
+typedef Scalar<int64_t, uint64_t> ScalarInt;
+typedef Scalar<double, double> ScalarReal;
+typedef Scalar<uint8_t, unsigned> ScalarByte;
+
+//----------------------------------------------------------------------
+
+template <typename L> struct AddOp {static typename L::V Do (typename L::V a, typename L::V b) {return L::Add(a, b);}};
+template <typename L> struct SubOp {static typename L::V Do (typename L::V a, typename L::V b) {return L::Sub(a, b);}};
+template <typename L> struct MulOp {static typename L::V Do (typename L::V a, typename L::V b) {return L::Mul(a, b);}};
+template <typename L> struct MinOp {static typename L::V Do (typename L::V a, typename L::V b) {return L::Min(a, b);}};
+template <typename L> struct MaxOp {static typename L::V Do (typename L::V a, typename L::V b) {return L::Max(a, b);}};
+template <typename L> struct EqOp {static typename L::M Do (typename L::V a, typename L::V b) {return L::Eq(a, b);}};
+template <typename L> struct LtOp {static typename L::M Do (typename L::V a, typename L::V b) {return L::Lt(a, b);}};
+template <typename L> struct LeOp {static typename L::M Do (typename L::V a, typename L::V b) {return L::Le(a, b);}};
+template <typename L> struct GtOp {static typename L::M Do (typename L::V a, typename L::V b) {return L::Lt(b, a);}};
+template <typename L> struct GeOp {static typename L::M Do (typename L::V a, typename L::V b) {return L::Le(b, a);}};
+
+//----------------------------------------------------------------------
+
+template <typename L, typename S, template <typename> class F>
+void MapLoop (void * out, void const * a, void const * k, size_t n)
+{
+	typedef typename L::T T;
+	auto const o = static_cast<T *>(out);
+	auto const p = static_cast<T const *>(a);
+	auto const kk = *static_cast<T const *>(k);
+	auto const kv = L::Splat(kk);
+
+	size_t i = 0;
+	for (; i + L::N <= n; i += L::N)
+		L::Store (o + i, F<L>::Do(L::Load(p + i), kv));
+	for (; i < n; ++i)
+		o[i] = F<S>::Do(p[i], kk);
+}
+
+//----------------------------------------------------------------------
+
+template <typename L, typename S, template <typename> class F>
+void ZipLoop (void * out, void const * a, void const * b, size_t n)
+{
+	typedef typename L::T T;
+	auto const o = static_cast<T *>(out);
+	auto const p = static_cast<T const *>(a);
+	auto const q = static_cast<T const *>(b);
+
+	size_t i = 0;
+	for (; i + L::N <= n; i += L::N)
+		L::Store (o + i, F<L>::Do(L::Load(p + i), L::Load(q + i)));
+	for (; i < n; ++i)
+		o[i] = F<S>::Do(p[i], q[i]);
+}
+
+//----------------------------------------------------------------------
+// Two vectors at a time, so as not to wait on each one; the lanes are
+// folded into the initial value at the end. (Straight through, one at a
+// time, with Scalar.)
+
+template <typename L, typename S, template <typename> class F>
+typename L::T Fold (typename L::T init, typename L::T const * p, size_t n)
+{
+	typedef typename L::T T;
+	auto r = init;
+	size_t i = 0;
+	if (L::N > 1 && n >= 2 * size_t(L::N))
+	{
+		auto v0 = L::Load(p), v1 = L::Load(p + L::N);
+		for (i = 2 * L::N; i + 2 * L::N <= n; i += 2 * L::N)
+		{
+			v0 = F<L>::Do(v0, L::Load(p + i));
+			v1 = F<L>::Do(v1, L::Load(p + i + L::N));
+		}
+		T lanes [L::N];
+		L::Store (lanes, F<L>::Do(v0, v1));
+		for (int j = 0; j < L::N; ++j)
+			r = F<S>::Do(r, lanes[j]);
+	}
+	for (; i < n; ++i)
+		r = F<S>::Do(r, p[i]);
+	return r;
+}
+
+//----------------------------------------------------------------------
+
+template <typename L, typename S, template <typename> class F>
+void ReduceLoop (void * acc, void const * a, size_t n)
+{
+	typedef typename L::T T;
+	auto const r = static_cast<T *>(acc);
+	*r = Fold<L, S, F>(*r, static_cast<T const *>(a), n);
+}
+
+//----------------------------------------------------------------------
+// Bytes are reduced into an Int: Min and Max of the bytes first, then
+// with it; a sum through the lanes' own adding up; a product one at a
+// time (there's nothing to gain.)
+
+template <typename L, typename S, template <typename> class F>
+void ByteReduceLoop (void * acc, void const * a, size_t n)
+{
+	auto const p = static_cast<uint8_t const *>(a);
+	if (n > 0)
+	{
+		auto const r = static_cast<int64_t *>(acc);
+		*r = F<ScalarInt>::Do(*r, Fold<L, S, F>(p[0], p + 1, n - 1));
+	}
+}
+
+template <typename L>
+void ByteSumLoop (void * acc, void const * a, size_t n)
+{
+	auto const p = static_cast<uint8_t const *>(a);
+	auto w = L::Zero();
+	size_t i = 0;
+	for (; i + L::N <= n; i += L::N)
+		w = L::AddUp(w, L::Load(p + i));
+
+	auto sum = uint64_t(L::Total(w));
+	for (; i < n; ++i)
+		sum += p[i];
+	auto const r = static_cast<int64_t *>(acc);
+	*r = int64_t(uint64_t(*r) + sum);
+}
+
+inline void ByteProductLoop (void * acc, void const * a, size_t n)
+{
+	auto const p = static_cast<uint8_t const *>(a);
+	auto r = uint64_t(*static_cast<int64_t *>(acc));
+	for (size_t i = 0; i < n; ++i)
+		r *= p[i];
+	*static_cast<int64_t *>(acc) = int64_t(r);
+}
+
+//----------------------------------------------------------------------
+// A whole vector's worth is stored at once when all of it stays.
+
+template <typename L, typename S, template <typename> class F>
+size_t FilterLoop (void * out, void const * a, void const * k, size_t n, bool negate)
+{
+	typedef typename L::T T;
+	auto const o = static_cast<T *>(out);
+	auto const p = static_cast<T const *>(a);
+	auto const kk = *static_cast<T const *>(k);
+	auto const kv = L::Splat(kk);
+	unsigned const all = ~0U >> (32 - L::N);
+	unsigned const flip = negate ? all : 0U;
+
+	size_t i = 0, j = 0;
+	for (; i + L::N <= n; i += L::N)
+	{
+		auto const v = L::Load(p + i);
+		auto m = L::Bits(F<L>::Do(v, kv)) ^ flip;
+		if (m == all)
+		{
+			L::Store (o + j, v);
+			j += L::N;
+			continue;
+		}
+		for (; 0 != m; m &= m - 1)
+			o[j++] = p[i + LowestBit(m)];
+	}
+	for (; i < n; ++i)
+		if (F<S>::Do(p[i], kk) != negate)
+			o[j++] = p[i];
+	return j;
+}
+
+//----------------------------------------------------------------------
+
+template <typename L, typename S>
+void FillElement (BulkKernels & k, BulkElement e)
+{
+	auto const i = int(e);
+	k.map[i][int(BulkOp::Add)] = MapLoop<L, S, AddOp>;
+	k.map[i][int(BulkOp::Sub)] = MapLoop<L, S, SubOp>;
+	k.map[i][int(BulkOp::Mul)] = MapLoop<L, S, MulOp>;
+	k.map[i][int(BulkOp::Min)] = MapLoop<L, S, MinOp>;
+	k.map[i][int(BulkOp::Max)] = MapLoop<L, S, MaxOp>;
+
+	k.zip[i][int(BulkOp::Add)] = ZipLoop<L, S, AddOp>;
+	k.zip[i][int(BulkOp::Sub)] = ZipLoop<L, S, SubOp>;
+	k.zip[i][int(BulkOp::Mul)] = ZipLoop<L, S, MulOp>;
+	k.zip[i][int(BulkOp::Min)] = ZipLoop<L, S, MinOp>;
+	k.zip[i][int(BulkOp::Max)] = ZipLoop<L, S, MaxOp>;
+
+	k.filter[i][int(BulkOp::Eq)] = FilterLoop<L, S, EqOp>;
+	k.filter[i][int(BulkOp::Lt)] = FilterLoop<L, S, LtOp>;
+	k.filter[i][int(BulkOp::Le)] = FilterLoop<L, S, LeOp>;
+	k.filter[i][int(BulkOp::Gt)] = FilterLoop<L, S, GtOp>;
+	k.filter[i][int(BulkOp::Ge)] = FilterLoop<L, S, GeOp>;
+}
+
+//----------------------------------------------------------------------
+
+template <typename IntL, typename RealL, typename ByteL>
+BulkKernels MakeKernels ()
+{
+	BulkKernels ret = {};
+	FillElement<IntL, ScalarInt> (ret, BulkElement::Int);
+	FillElement<RealL, ScalarReal> (ret, BulkElement::Real);
+	FillElement<ByteL, ScalarByte> (ret, BulkElement::Byte);
+
+	auto const i = int(BulkElement::Int), r = int(BulkElement::Real), b = int(BulkElement::Byte);
+	ret.reduce[i][int(BulkOp::Add)] = ReduceLoop<IntL, ScalarInt, AddOp>;
+	ret.reduce[i][int(BulkOp::Mul)] = ReduceLoop<IntL, ScalarInt, MulOp>;
+	ret.reduce[i][int(BulkOp::Min)] = ReduceLoop<IntL, ScalarInt, MinOp>;
+	ret.reduce[i][int(BulkOp::Max)] = ReduceLoop<IntL, ScalarInt, MaxOp>;
+	ret.reduce[r][int(BulkOp::Add)] = ReduceLoop<RealL, ScalarReal, AddOp>;
+	ret.reduce[r][int(BulkOp::Mul)] = ReduceLoop<RealL, ScalarReal, MulOp>;
+	ret.reduce[r][int(BulkOp::Min)] = ReduceLoop<RealL, ScalarReal, MinOp>;
+	ret.reduce[r][int(BulkOp::Max)] = ReduceLoop<RealL, ScalarReal, MaxOp>;
+	ret.reduce[b][int(BulkOp::Add)] = ByteSumLoop<ByteL>;
+	ret.reduce[b][int(BulkOp::Mul)] = ByteProductLoop;
+	ret.reduce[b][int(BulkOp::Min)] = ByteReduceLoop<ByteL, ScalarByte, MinOp>;
+	ret.reduce[b][int(BulkOp::Max)] = ByteReduceLoop<ByteL, ScalarByte, MaxOp>;
+	return ret;
+}
+
+//----------------------------------------------------------------------
+
+}	// namespace
+
+//======================================================================
+
+	}	// namespace VM
+}	// namespace UPL
+
+//======================================================================
@@ -3,16 +3,95 @@
 //======================================================================
 
 #include <upl/common.hpp>
+#include <upl/st_code.hpp>
+#include <upl/vm.hpp>
+
+#include <string>
 
 //======================================================================
 
 namespace UPL {
+	namespace CodeGen {
 
 //======================================================================
+
+enum class BinaryOp
+{
+	Add,
+	Sub,
+	Mul,
+	Div,
+	Mod,
+	Eq,
+	Lt,
+	Le,
+};
+
+//----------------------------------------------------------------------
+// Which register representation a value of this type uses, as far as
+// the type-specialized instructions are concerned.
+enum class RegKind
+{
+	None,		// Not something the arithmetic instructions handle
+	Int,		// Int, and also Bool, Byte and Char
+	Real,
+};
+
+RegKind RegKindOf (Type::STContainer const & types, Type::ID type);
+
 //----------------------------------------------------------------------
+// Picks the type-specialized instruction for "op" on two operands of the
+// given type (e.g. AddI for ints, AddR for reals.) Returns false if there
+// isn't one (e.g. Mod on reals, or anything on strings.)
+bool SelectBinaryOp (Type::STContainer const & types, Type::ID operand_type, BinaryOp op, VM::Op & out_op);
+bool SelectNegateOp (Type::STContainer const & types, Type::ID operand_type, VM::Op & out_op);
+
+// Whether a register holding this type holds a Value (and so maybe a
+// heap reference, to be listed in the stack maps.)
+bool HoldsValue (Type::STContainer const & types, Type::ID type);
+
 //======================================================================
+// Bytecode emission from the SSA form (see ir.hpp.) Phis become moves at
+// the ends of the predecessors (with any cycles among them broken through
+// a scratch register), registers are assigned by a linear scan over live
+// intervals, calls go through an area above all the other registers, and
+// every safepoint gets a stack map of exactly the Values live across it.
 
-}	// namespace UPL
+class IRFunction;
+struct IRModule;
+
+struct EmitStats
+{
+	uint32_t functions = 0;
+	uint32_t instructions = 0;
+	uint32_t moves = 0;				// Of those, the ones for phis and calls
+	uint32_t tail_calls = 0;
+	uint32_t superinstructions = 0;
+	uint32_t max_registers = 0;
+};
+
+struct EmitOptions
+{
+	bool superinstructions = true;	// See VM::FuseSuperinstructions
+};
+
+// Defines function "index" of "module" (already declared) from "f".
+// "first_function" is the module index of the IR module's function 0,
+// which Func instructions are relative to, and "first_global" that of its
+// global 0, for Global instructions. A call whose value is all
+// that's left to return (in any function, and whatever it calls) becomes
+// a TailCall, which runs the callee in the caller's frame.
+bool EmitFunction (IRFunction const & f, VM::Module & module, uint32_t index, uint32_t first_function, uint32_t first_global,
+	std::string & out_error, EmitStats * out_stats = nullptr, EmitOptions const & options = EmitOptions());
+
+// Declares all of the functions (after whatever the module already has),
+// adds the globals and then emits the functions.
+bool EmitModule (IRModule const & ir, VM::Module & module, std::string & out_error, EmitStats * out_stats = nullptr,
+	EmitOptions const & options = EmitOptions());
 
 //======================================================================
 
+	}	// namespace CodeGen
+}	// namespace UPL
+
+//======================================================================
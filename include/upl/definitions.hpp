@@ -92,6 +92,125 @@
 	action (14, Package , "package" ,false,false, true,false,false)				\
 	action (15, Function, "function",false, true,false,false, true)
 
+//----------------------------------------------------------------------
+//
+// VM instructions are 32 bits: the opcode in the low byte, then operand
+// bytes A, B and C; or A and a 16-bit Bx (unsigned) / sBx (signed) made
+// of B and C. Registers are untyped 64-bit words; the opcodes say how to
+// interpret them (bools are ints holding 0 or 1.) Jumps are relative to
+// the following instruction. References to heap objects are held in
+// registers as Values; a field or element is converted to or from a
+// register according to its declared type.
+//
+#define UPL_PRIVATE__VM_OPCODES(action)									\
+/*Enum,Name,Format    Semantics */										\
+	action (Nop     , "nop"     , None)	/*                         */	\
+	action (Move    , "move"    , AB  )	/* R[A] = R[B]             */	\
+	action (LoadK   , "loadk"   , ABx )	/* R[A] = K[Bx]            */	\
+	action (LoadI   , "loadi"   , AsBx)	/* R[A].i = sBx            */	\
+	action (LoadNil , "loadnil" , A   )	/* R[A] = 0                */	\
+	action (LoadF   , "loadf"   , ABx )	/* R[A] = &Functions[Bx]   */	\
+	action (GetG    , "getg"    , ABx )	/* R[A] = Globals[Bx], forced on first use (see globals.hpp) */	\
+	action (AddI    , "addi"    , ABC )	/* R[A].i = R[B].i + R[C].i */	\
+	action (SubI    , "subi"    , ABC )									\
+	action (MulI    , "muli"    , ABC )									\
+	action (DivI    , "divi"    , ABC )									\
+	action (ModI    , "modi"    , ABC )									\
+	action (NegI    , "negi"    , AB  )									\
+	action (AddR    , "addr"    , ABC )	/* R[A].r = R[B].r + R[C].r */	\
+	action (SubR    , "subr"    , ABC )									\
+	action (MulR    , "mulr"    , ABC )									\
+	action (DivR    , "divr"    , ABC )									\
+	action (NegR    , "negr"    , AB  )									\
+	action (EqI     , "eqi"     , ABC )	/* R[A].i = R[B].i == R[C].i */	\
+	action (LtI     , "lti"     , ABC )									\
+	action (LeI     , "lei"     , ABC )									\
+	action (EqR     , "eqr"     , ABC )	/* R[A].i = R[B].r == R[C].r */	\
+	action (LtR     , "ltr"     , ABC )									\
+	action (LeR     , "ler"     , ABC )									\
+	action (Not     , "not"     , AB  )	/* R[A].i = !R[B].i        */	\
+	action (IToR    , "itor"    , AB  )	/* R[A].r = Real(R[B].i)   */	\
+	action (RToI    , "rtoi"    , AB  )	/* R[A].i = Int(R[B].r)    */	\
+	action (BoxB    , "boxb"    , AB  )	/* R[A] = Value(bool R[B]) */	\
+	action (BoxI    , "boxi"    , AB  )	/* R[A] = Value(int R[B])  */	\
+	action (BoxR    , "boxr"    , AB  )	/* R[A] = Value(real R[B]) */	\
+	action (BoxY    , "boxy"    , AB  )	/* R[A] = Value(byte R[B]) */	\
+	action (BoxC    , "boxc"    , AB  )	/* R[A] = Value(char R[B]) */	\
+	action (UnboxB  , "unboxb"  , AB  )	/* R[A].i = Value(R[B]).asBool() */	\
+	action (UnboxI  , "unboxi"  , AB  )	/* R[A].i = Value(R[B]).asInt()  */	\
+	action (UnboxR  , "unboxr"  , AB  )	/* R[A].r = Value(R[B]).asReal() */	\
+	action (UnboxY  , "unboxy"  , AB  )	/* R[A].i = Value(R[B]).asByte() */	\
+	action (UnboxC  , "unboxc"  , AB  )	/* R[A].i = Value(R[B]).asChar() */	\
+	action (TypeOf  , "typeof"  , AB  )	/* R[A].i = Value(R[B]).typeID() */	\
+	action (New     , "new"     , ABx )	/* R[A] = new object of type K[Bx].i */	\
+	action (NewN    , "newn"    , ABC )	/* R[A] = new object of type R[B].i, R[C].i elements */	\
+	action (GetF    , "getf"    , ABN )	/* R[A] = R[B].field[C]    */	\
+	action (SetF    , "setf"    , ABN )	/* R[A].field[C] = R[B]    */	\
+	action (GetE    , "gete"    , ABC )	/* R[A] = R[B][R[C].i]     */	\
+	action (SetE    , "sete"    , ABC )	/* R[A][R[B].i] = R[C]     */	\
+	action (Len     , "len"     , AB  )	/* R[A].i = R[B].count     */	\
+	action (Bulk    , "bulk"    , ANN )	/* R[A] = bulk operation C on R[A+1], ..., R[A+B] (see bulk.hpp) */	\
+	action (PMap    , "pmap"    , ANN )	/* R[A] = new vector of type R[A+1].i of R[A+2](e) for each e of R[A+3]; in parallel if C (see parallel.hpp) */	\
+	action (PReduce , "preduce" , ANN )	/* R[A] = R[A+2] folded with R[A+1] over R[A+3]; in parallel if C */	\
+	action (Io      , "io"      , ANN )	/* R[A] = I/O operation C on R[A+1], ..., R[A+B] (see scheduler.hpp) */	\
+	action (Jmp     , "jmp"     , sBx )	/* pc += sBx               */	\
+	action (JmpT    , "jmpt"    , AsBx)	/* if (R[A].i) pc += sBx   */	\
+	action (JmpF    , "jmpf"    , AsBx)	/* if (!R[A].i) pc += sBx  */	\
+	action (Call    , "call"    , AN  )	/* R[A] = R[A](R[A+1], ..., R[A+B]) */	\
+	action (TailCall, "tcall"   , AN  )	/* return R[A](R[A+1], ..., R[A+B]), in this frame */	\
+	action (Ret     , "ret"     , A   )	/* return R[A]             */	\
+	action (RetNil  , "retnil"  , None)	/* return nil              */
+
+//----------------------------------------------------------------------
+//
+// The code generator's SSA instructions (see ir.hpp.) Each one defines
+// (at most) one value, of the instruction's type. "Operands" is -1 where
+// the count varies. The kinds say what the optimizer may do with them:
+//   Pure    no effects and can't fail; may be shared or dropped
+//   Traps   can fail (e.g. division by zero), but does nothing else
+//   Reads   reads the heap (and can fail); neither shared nor dropped
+//   Effect  writes, allocates or calls
+//   Jump    terminates its block
+//
+#define UPL_PRIVATE__IR_OPCODES(action)									\
+/*Enum,Name,Operands,Kind    Semantics */								\
+	action (Const  , "const"  , 0, Pure  )	/* the number in the instruction */	\
+	action (Param  , "param"  , 0, Pure  )	/* parameter #aux          */	\
+	action (Func   , "func"   , 0, Pure  )	/* function #aux of the module */	\
+	action (Global , "global" , 0, Effect)	/* global #aux of the module; its first use runs its initializer */	\
+	action (Copy   , "copy"   , 1, Pure  )	/* o0                      */	\
+	action (Phi    , "phi"    ,-1, Pure  )	/* oi, coming from pred i  */	\
+	action (Add    , "add"    , 2, Pure  )	/* o0 + o1                 */	\
+	action (Sub    , "sub"    , 2, Pure  )									\
+	action (Mul    , "mul"    , 2, Pure  )									\
+	action (Div    , "div"    , 2, Traps )									\
+	action (Mod    , "mod"    , 2, Traps )									\
+	action (Eq     , "eq"     , 2, Pure  )	/* bool: o0 == o1          */	\
+	action (Lt     , "lt"     , 2, Pure  )									\
+	action (Le     , "le"     , 2, Pure  )									\
+	action (Neg    , "neg"    , 1, Pure  )	/* -o0, or !o0 for bools   */	\
+	action (Not    , "not"    , 1, Pure  )									\
+	action (IToR   , "itor"   , 1, Pure  )									\
+	action (RToI   , "rtoi"   , 1, Pure  )									\
+	action (Box    , "box"    , 1, Pure  )	/* Value(o0)               */	\
+	action (Unbox  , "unbox"  , 1, Pure  )	/* o0 as the instruction's type */	\
+	action (TypeOf , "typeof" , 1, Pure  )									\
+	action (New    , "new"    , 0, Effect)	/* new object of type #aux */	\
+	action (NewN   , "newn"   , 2, Effect)	/* type o0, o1 elements    */	\
+	action (GetF   , "getf"   , 1, Reads )	/* o0.field[aux]           */	\
+	action (SetF   , "setf"   , 2, Effect)	/* o0.field[aux] = o1      */	\
+	action (GetE   , "gete"   , 2, Reads )	/* o0[o1]                  */	\
+	action (SetE   , "sete"   , 3, Effect)	/* o0[o1] = o2             */	\
+	action (Len    , "len"    , 1, Reads )									\
+	action (Bulk   , "bulk"   ,-1, Effect)	/* bulk operation #aux on the operands (see bulk.hpp) */	\
+	action (PMap   , "pmap"   , 3, Effect)	/* vector of type o0 of o1(e) for each e of o2; in parallel if aux */	\
+	action (PReduce, "preduce", 3, Effect)	/* o1 folded with o0 over o2: o0(...o0(o1, o2[0])...); the same */	\
+	action (Io     , "io"     ,-1, Effect)	/* I/O operation #aux on the operands (see scheduler.hpp) */	\
+	action (Call   , "call"   ,-1, Effect)	/* o0(o1, ...)             */	\
+	action (Ret    , "ret"    ,-1, Jump  )	/* return o0, or nil       */	\
+	action (Jmp    , "jmp"    , 0, Jump  )	/* goto target 0           */	\
+	action (Br     , "br"     , 1, Jump  )	/* goto o0 ? target 0 : target 1 */
+
 //======================================================================
 
 namespace UPL {
@@ -0,0 +1,139 @@
+#pragma once
+
+//======================================================================
+
+#include <upl/common.hpp>
+#include <upl/errors.hpp>
+
+#include <chrono>
+#include <string>
+
+//======================================================================
+
+namespace UPL {
+	namespace Error {
+
+//======================================================================
+//  Sinks that stream reports out as they are made (see Reporter::setSink)
+// instead of holding on to them until the end. All of them encode each
+// record into a byte buffer and write the buffer out in batches: when it
+// holds "batch_records" records or "batch_bytes" bytes, whenever a fatal
+// record arrives, and on flush() and destruction. An error goes out at
+// once too, unless an error did less than "error_interval" ago; so the
+// first error after a quiet spell shows right away, but a flood of them
+// is still batched (with at most one early write per interval.) An error
+// held back goes out no later than "error_interval" after it came, as
+// the next record comes or on poll(), so the end of a flood shows too.
+//======================================================================
+
+class BufferedSink
+	: public Sink
+{
+public:
+	static int const msc_DefaultBatchRecords = 64;
+	static size_t const msc_DefaultBatchBytes = 16 * 1024;
+	static int const msc_DefaultErrorIntervalMS = 50;
+
+public:
+	// Note: the sink does NOT own (or close) the FILE.
+	explicit BufferedSink (FILE * out, int batch_records = msc_DefaultBatchRecords, size_t batch_bytes = msc_DefaultBatchBytes,
+		int error_interval_ms = msc_DefaultErrorIntervalMS);
+	virtual ~BufferedSink ();
+
+	BufferedSink (BufferedSink const &) = delete;
+	BufferedSink & operator = (BufferedSink const &) = delete;
+
+	void consume (Record const & record) override;
+	void flush () override;
+	void poll () override;
+
+	size_t recordsWritten () const {return m_records_written;}
+	size_t bytesWritten () const {return m_bytes_written;}
+	size_t writeCount () const {return m_write_count;}
+
+protected:
+	virtual void encode (Record const & record, std::string & out) = 0;
+
+	// For headers and such; goes out with the next batch
+	std::string & buffer () {return m_buffer;}
+
+private:
+	FILE * m_out;
+	int m_batch_records;
+	size_t m_batch_bytes;
+	std::chrono::steady_clock::duration m_error_interval;
+	std::chrono::steady_clock::time_point m_last_error_write;
+	std::chrono::steady_clock::time_point m_held_since;	// Of the first error in the buffer, if m_holding_error
+	bool m_holding_error;
+	std::string m_buffer;
+	int m_pending_records;
+	size_t m_records_written;
+	size_t m_bytes_written;
+	size_t m_write_count;
+};
+
+//----------------------------------------------------------------------
+// file:line:column: severity: message [category number]
+
+class TextSink
+	: public BufferedSink
+{
+public:
+	using BufferedSink::BufferedSink;
+
+protected:
+	void encode (Record const & record, std::string & out) override;
+};
+
+//----------------------------------------------------------------------
+// One JSON object per line:
+// {"file":"...","line":1,"column":2,"severity":"error","category":"lexer","number":3,"message":"..."}
+
+class JSONLinesSink
+	: public BufferedSink
+{
+public:
+	using BufferedSink::BufferedSink;
+
+protected:
+	void encode (Record const & record, std::string & out) override;
+};
+
+//----------------------------------------------------------------------
+//  A compact binary stream: the header "UPLD" plus a version byte, then
+// entries, each starting with a kind byte:
+//   1 (file):   varint length, UTF-8 bytes. Files get indices 0, 1, ...
+//               in the order they appear, and are sent once.
+//   2 (record): byte (severity << 4 | category), varint file index,
+//               varint line, varint column, zigzag varint number,
+//               varint length, UTF-8 message.
+// Varints are unsigned LEB128.
+
+class BinarySink
+	: public BufferedSink
+{
+public:
+	static uint8_t const msc_Version = 1;
+
+public:
+	explicit BinarySink (FILE * out, int batch_records = msc_DefaultBatchRecords, size_t batch_bytes = msc_DefaultBatchBytes,
+		int error_interval_ms = msc_DefaultErrorIntervalMS);
+
+protected:
+	void encode (Record const & record, std::string & out) override;
+
+private:
+	std::vector<Path> m_files;	// Few enough to search linearly
+};
+
+//----------------------------------------------------------------------
+// Reads back what a BinarySink wrote. Returns false on a malformed
+// stream (the records read so far are still appended.)
+bool ReadBinaryDiagnostics (FILE * in, std::vector<Record> & out);
+
+//======================================================================
+
+	}	// namespace Error
+}	// namespace UPL
+
+//======================================================================
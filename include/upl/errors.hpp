@@ -4,6 +4,11 @@
 
 #include <upl/common.hpp>
 
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <thread>
+
 //======================================================================
 
 namespace UPL {
@@ -38,6 +43,11 @@ enum class Severity
 
 typedef int Number;
 
+//----------------------------------------------------------------------
+
+char const * CategoryName (Category cat);
+char const * SeverityName (Severity sev);
+
 //======================================================================
 
 class Record
@@ -68,6 +78,21 @@ private:
 	String m_message;
 };
 
+//======================================================================
+// Receives each report as soon as it is made. See error_sinks.hpp.
+
+class Sink
+{
+public:
+	virtual ~Sink () {}
+
+	virtual void consume (Record const & record) = 0;
+	virtual void flush () {}
+	// Now and then, between reports (see Reporter::poll): a sink that
+	// holds records back writes out those that have waited long enough.
+	virtual void poll () {}
+};
+
 //======================================================================
 
 class Reporter
@@ -76,9 +101,16 @@ public:
 	Reporter ();
 
 	Path const & currentFile () const {return m_file_name_stack.back();}
-	int count () const {return int(m_reports.size());}
+	int count () const {return m_count;}
 	std::vector<Record> const & reports () const {return m_reports;}
 
+	// Note: Reporter does NOT own the sink. With "keep_reports" false,
+	// records only go to the sink and reports() stays empty.
+	void setSink (Sink * sink, bool keep_reports = true);
+	Sink * sink () const {return m_sink;}
+	// For a long stretch without reports, now and then (see Sink::poll)
+	void poll () {if (nullptr != m_sink) m_sink->poll ();}
+
 	void pushFileName (Path new_file_name);
 	void popFileName ();
 
@@ -110,6 +142,125 @@ public:
 private:
 	std::vector<Record> m_reports;
 	std::vector<Path> m_file_name_stack;
+	Sink * m_sink;
+	bool m_keep_reports;
+	int m_count;
+};
+
+//======================================================================
+//  A reporter for lexing/parsing/checking on several threads at once.
+// Each thread appends to its own Local buffer without any locking; the
+// buffers are merged (in an order that doesn't depend on thread timing)
+// into ordinary Records at the end. Records are kept compact: the file is
+// an interned FileID and the message is kept as its arguments, to be
+// formatted only when (and if) it is merged. Each thread keeps its first
+// "cap" reports, and only counts the rest; the cap is applied once more
+// to all of them at the merge, in merge order, so which reports are kept
+// doesn't depend on thread timing either.
+//======================================================================
+
+typedef uint32_t FileID;
+
+//----------------------------------------------------------------------
+
+class ConcurrentReporter
+{
+public:
+	// Formats the message of a report from its number and arguments.
+	typedef String (* Formatter) (Number num, String const * args, int arg_count);
+
+	static String DefaultFormatter (Number num, String const * args, int arg_count);
+
+private:
+	struct CompactRecord
+	{
+		FileID file;
+		Location location;
+		Severity severity;
+		Category category;
+		Number number;
+		uint32_t first_arg;
+		uint32_t arg_count;
+	};
+
+public:
+	class Local
+	{
+	public:
+		FileID currentFile () const {return m_file_stack.back();}
+
+		void pushFileName (Path const & new_file_name);
+		void popFileName ();
+
+		void newReport (Location const & loc, Severity sev, Category cat, Number num);
+		void newReport (Location const & loc, Severity sev, Category cat, Number num, String const & arg0);
+		void newReport (Location const & loc, Severity sev, Category cat, Number num, String const & arg0, String const & arg1);
+		void newReport (Location const & loc, Severity sev, Category cat, Number num, String const * args, int arg_count);
+
+	private:
+		friend class ConcurrentReporter;
+		Local (ConcurrentReporter & owner, std::thread::id thread);
+		bool admit (Severity sev);
+		void addArg (String const & arg);
+
+	private:
+		ConcurrentReporter & m_owner;
+		std::thread::id m_thread;
+		std::vector<FileID> m_file_stack;
+		std::vector<CompactRecord> m_records;
+		String m_arg_pool;				// All the arguments, back to back...
+		std::vector<uint32_t> m_arg_ends;	// ...and where each one ends.
+		size_t m_submitted;
+		size_t m_dropped [4];			// Per Severity, past this thread's cap
+	};
+
+public:
+	explicit ConcurrentReporter (size_t cap = size_t(-1));
+	~ConcurrentReporter ();
+
+	ConcurrentReporter (ConcurrentReporter const &) = delete;
+	ConcurrentReporter & operator = (ConcurrentReporter const &) = delete;
+
+	// The calling thread's buffer. Only the first call on each thread takes a lock.
+	Local & local ();
+
+	FileID internPath (Path const & path);
+	Path path (FileID file) const;
+
+	// May change while threads report; their reports from then on are
+	// admitted against the new cap (and the merge applies the last one.)
+	size_t cap () const {return m_cap.load(std::memory_order_relaxed);}
+	void setCap (size_t new_cap) {m_cap.store (new_cap, std::memory_order_relaxed);}
+
+	// Only meaningful once the reporting threads are done:
+	size_t count () const;
+	size_t keptCount () const;
+	size_t droppedCount () const;
+	size_t droppedCount (Severity sev) const;
+
+	// Sorted by file path, location, severity, category, number and message.
+	std::vector<Record> merge (Formatter formatter = DefaultFormatter) const;
+	void mergeInto (Reporter & reporter, Formatter formatter = DefaultFormatter) const;
+
+private:
+	struct Ranked
+	{
+		Local const * local;
+		CompactRecord const * rec;
+		FileID file_rank;		// Of its file's path, among all of them
+	};
+
+	// All the threads' records, sorted in merge order (but for the
+	// message, which isn't formatted yet.) The caller holds m_mutex.
+	std::vector<Ranked> ranked () const;
+
+private:
+	uint64_t const m_serial;
+	std::atomic<size_t> m_cap;		// Read by the reporting threads without the lock
+
+	mutable std::mutex m_mutex;	// Guards the two below
+	std::vector<std::unique_ptr<Local>> m_locals;
+	std::vector<Path> m_paths;	// By FileID
 };
 
 //----------------------------------------------------------------------
@@ -0,0 +1,93 @@
+#pragma once
+
+//======================================================================
+
+#include <upl/common.hpp>
+
+#include <cstddef>
+
+//======================================================================
+
+#if !defined(UPL_FIBERS_AVAILABLE)
+	#if defined(__x86_64__) && defined(__linux__)
+		#define UPL_FIBERS_AVAILABLE	1
+	#else
+		#define UPL_FIBERS_AVAILABLE	0
+	#endif
+#endif
+
+//======================================================================
+
+namespace UPL {
+	namespace VM {
+
+//======================================================================
+//  A stackful coroutine: a function that runs on a stack of its own, and
+// can suspend itself anywhere (however deep in calls it is) for whoever
+// resumed it to carry on; the next resume picks up where it left off.
+//
+//  Switching saves just what the ABI has a call preserve (the callee-saved
+// registers, the stack pointer and the floating-point control words) on
+// the stack being left, and loads them from the one being entered, so it
+// costs about as much as a couple of calls; there's no system call in it.
+// The stack is mapped with a guard page below it, so running off its end
+// faults instead of trampling whatever is there; only the pages it has
+// actually used take memory.
+//
+//  A fiber that has finished can be started again, with the same stack,
+// which is what its owner should do rather than make a new one. Fibers
+// are only available on x86-64 Linux (UPL_FIBERS_AVAILABLE); elsewhere,
+// valid() is false.
+//======================================================================
+
+class Fiber
+{
+public:
+	typedef void (*Entry) (void * arg);
+
+	static size_t const msc_DefaultStackSize = 128 << 10;
+
+public:
+	explicit Fiber (size_t stack_size = msc_DefaultStackSize);
+	~Fiber ();
+
+	Fiber (Fiber const &) = delete;
+	Fiber & operator = (Fiber const &) = delete;
+
+	// Whether it has its stack.
+	bool valid () const {return nullptr != m_stack;}
+	size_t stackSize () const {return m_stack_size;}
+	bool running () const {return m_running;}
+	bool finished () const {return m_finished;}
+
+	// entry (arg) is to run on the next resume. Not while it's running, or
+	// suspended half way.
+	void start (Entry entry, void * arg);
+
+	// Runs the fiber until it suspends itself or its entry returns; returns
+	// whether it has finished. Not from inside the fiber itself.
+	bool resume ();
+
+	// From inside the fiber: back to whoever resumed it.
+	void suspend ();
+
+private:
+	static void Main (Fiber * fiber);
+
+private:
+	void * m_stack;			// The lowest address mapped, guard page included
+	size_t m_stack_size;	// Not counting the guard page
+	void * m_sp;			// Of the fiber, while it isn't running
+	void * m_resumer_sp;	// Of whoever resumed it, while it is
+	Entry m_entry;
+	void * m_arg;
+	bool m_running;
+	bool m_finished;
+};
+
+//======================================================================
+
+	}	// namespace VM
+}	// namespace UPL
+
+//======================================================================
@@ -0,0 +1,182 @@
+#pragma once
+
+//======================================================================
+
+#include <upl/common.hpp>
+#include <upl/heap.hpp>
+#include <upl/vm.hpp>
+
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+//======================================================================
+
+namespace UPL {
+	namespace VM {
+
+//======================================================================
+//  The values of a module's globals (its top-level "def"s), each of which
+// is a thunk: nothing is evaluated up front, and the first GetG of a
+// global runs its initializer, whose result every later one reads. So
+// what a program costs to start is in proportion to the globals it
+// actually uses, not to how many the module has.
+//
+//  A global is forced at most once, even with several threads reading it
+// (each with its own interpreter): the first to get to it claims it, and
+// the others wait for its value. Who forces or waits is an OS thread,
+// which blocks while it waits; or a green thread (see GlobalsWaiter and
+// Scheduler), which is suspended instead, so that its OS thread can run
+// the others meanwhile (one of which may be forcing the global, and may
+// itself be suspended while it does.) A global that is being forced is a
+// "black hole": needing it again before it has a value, by the same
+// thread (or green thread) or through a chain of them waiting on each
+// other, is a cycle, and fails with RunError::CyclicGlobal. A failed
+// initializer leaves its global as it was, to be forced again by the next
+// use. (A thread waiting for a Parallel's workers doesn't count as
+// waiting on a global, so an initializer that maps a function reading its
+// own global in parallel hangs instead.)
+//
+//  Values that are heap references live on "heap" (and are roots of it);
+// only interpreters over that heap can read those. Globals of the other
+// types (numbers, functions) can be shared with interpreters over other
+// heaps, e.g. the workers of a Parallel.
+//======================================================================
+
+struct GlobalsStats
+{
+	uint64_t forced = 0;	// Initializers run to completion
+	uint64_t failed = 0;	// Initializers that failed (including on cycles)
+	uint64_t waits = 0;		// For another (thread or green thread) to force a global
+	uint64_t cycles = 0;
+};
+
+//----------------------------------------------------------------------
+// A green thread, as what forces a global or waits for one; it stands
+// for itself, whichever OS thread it's on.
+
+class GlobalsWaiter
+{
+public:
+	// Returns once woken; called without the globals' lock.
+	virtual void suspendForGlobal () = 0;
+	// From any thread, with the globals' lock held, once the global it
+	// waits on is forced or abandoned; maybe before it has suspended.
+	virtual void wakeForGlobal () = 0;
+
+protected:
+	~GlobalsWaiter () {}
+};
+
+//----------------------------------------------------------------------
+
+class Globals
+	: public RootSource
+{
+public:
+	// What claim() found
+	enum class Claim
+	{
+		Forced,		// The value is there
+		Mine,		// The caller is to force it, and then settle or abandon it
+		Cycle,
+	};
+
+public:
+	// Note: Globals does NOT own the module or the heap. The heap must be
+	// over the module's types.
+	Globals (Module const & module, Heap & heap);
+	~Globals ();
+
+	Globals (Globals const &) = delete;
+	Globals & operator = (Globals const &) = delete;
+
+	Module const & module () const {return m_module;}
+	Heap & heap () {return m_heap;}
+	uint32_t count () const {return uint32_t(m_cells.size());}
+	bool isForced (uint32_t index) const {return Forced == m_cells[index].state.load(std::memory_order_acquire);}
+	uint32_t forcedCount () const;
+	// Whether the global's values are heap references, only to be read on
+	// the globals' own heap.
+	bool isHeapBound (uint32_t index) const {return m_cells[index].heap_bound;}
+
+	// The value, if the global has been forced.
+	inline bool get (uint32_t index, Reg & out_value) const;
+
+	// For the interpreter: see Claim. Waits while another is forcing the
+	// global: suspending "waiter", if there is one (the caller is then
+	// that green thread), or else blocking the calling thread.
+	Claim claim (uint32_t index, Reg & out_value, GlobalsWaiter * waiter = nullptr);
+	void settle (uint32_t index, Reg value, GlobalsWaiter * waiter = nullptr);
+	void abandon (uint32_t index, GlobalsWaiter * waiter = nullptr);
+
+	// Forces every global with "interpreter" (over the same heap), in
+	// order, as an eager evaluation would. Returns false on the first
+	// failure, which the interpreter will have reported.
+	bool forceAll (Interpreter & interpreter);
+
+	GlobalsStats stats () const;
+	void resetStats ();
+
+	void visitRoots (RootVisitor & visitor) override;
+
+private:
+	enum : uint8_t
+	{
+		Unforced,
+		Forcing,
+		Forced,
+	};
+
+	// Who forces or waits: a GlobalsWaiter, or a thread (see Me)
+	typedef void const * Who;
+
+	struct Cell
+	{
+		std::atomic<uint8_t> state;
+		bool heap_bound;
+		Reg value;					// Once Forced
+		Who owner;					// While Forcing
+	};
+
+	struct Waiting
+	{
+		Who who;
+		uint32_t index;				// Of the global it waits on
+		GlobalsWaiter * waiter;		// If it's a green thread
+	};
+
+	static Who Me (GlobalsWaiter * waiter);
+	void wakeWaiters (uint32_t index);
+
+private:
+	Module const & m_module;
+	Heap & m_heap;
+	std::vector<Cell> m_cells;
+	mutable std::mutex m_mutex;					// For everything but reading a forced value
+	std::condition_variable m_settled;
+	std::vector<Waiting> m_waiting;
+	GlobalsStats m_stats;
+};
+
+//----------------------------------------------------------------------
+
+inline bool Globals::get (uint32_t index, Reg & out_value) const
+{
+	if (index >= m_cells.size())
+		return false;
+	auto const & cell = m_cells[index];
+	if (Forced != cell.state.load(std::memory_order_acquire))
+		return false;
+	out_value = cell.value;
+	return true;
+}
+
+//======================================================================
+
+	}	// namespace VM
+}	// namespace UPL
+
+//======================================================================
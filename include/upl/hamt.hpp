@@ -0,0 +1,174 @@
+#pragma once
+
+//======================================================================
+
+#include <upl/common.hpp>
+#include <upl/heap.hpp>
+#include <upl/value.hpp>
+
+#include <vector>
+
+//======================================================================
+
+namespace UPL {
+	namespace VM {
+
+//======================================================================
+//  Maps are persistent: "changing" one makes a new version and leaves
+// the old one as it was. They are hash array mapped tries (the CHAMP
+// flavour), every node of which is a heap object of the map's own type
+// (see MapNode):
+//
+//  - A node covers 5 bits of the keys' 32-bit hashes. "datamap" has a
+//    bit for each of its slots that holds an entry (key and value,
+//    inline), "nodemap" for each that holds a child node. Entries come
+//    first, then the children, both in slot order; so where one is is
+//    the popcount of the bits below its own.
+//  - Keys whose hashes are all the same end up in a collision node,
+//    below the last level, which is just a list of entries.
+//  - A new version copies the nodes on the path to the key (at most
+//    eight) and shares all the others with the old one. Removing keeps
+//    the trie canonical: a child left with a single entry is pulled up
+//    into its parent.
+//  - Keys and values are held as Values. How keys are hashed and
+//    compared depends on the map's key type (getMapKeyType): ints, reals
+//    and strings by value, "any" by what each key turns out to be, and
+//    everything else by identity.
+//
+//  Transients: between beginEdit() and endEdit(), set() and remove()
+// given that edit change the nodes made during it in place (and leave
+// them room to grow), as nothing outside the edit can have seen those:
+// each version passed in is dead once the next is returned. Nodes from
+// before the edit are never changed, and the version returned last is
+// an ordinary persistent map once the edit is over.
+//======================================================================
+
+class Hamt
+{
+public:
+	typedef uint32_t Edit;					// 0 is none
+
+	static int const msc_Bits = 5;
+	static int const msc_MaxShift = 30;		// Of the last level with slots; collision nodes are below it
+	static uint32_t const msc_Slack = 4;	// Values of room, in nodes made by an edit
+
+public:
+	// Note: the Hamt does NOT own the heap.
+	explicit Hamt (Heap & heap);
+
+	// These may collect garbage (see Heap::allocate), and return nullptr
+	// if the heap is exhausted.
+	Object * newMap (Type::ID type);		// Empty; nullptr if "type" isn't a Map type as well
+	Object * set (Object * map, Value key, Value value, Edit edit = 0);
+	Object * remove (Object * map, Value key, Edit edit = 0);
+
+	uint32_t size (Object const * map) const {return static_cast<MapNode const *>(map)->size;}
+	bool find (Object const * map, Value key, Value & out_value);
+
+	// Calls f(Value key, Value value) for each entry, in no particular
+	// order. f mustn't allocate.
+	template <typename F> void forEach (Object const * map, F && f) const;
+
+	Edit beginEdit ();
+	void endEdit (Edit edit);
+
+	static uint32_t PopCount (uint32_t x);
+	static uint32_t Used (MapNode const * node);	// Values in use
+
+private:
+	enum class KeyKind : uint8_t
+	{
+		Unknown,
+		Bits,		// Identity
+		Int,
+		Real,
+		String,
+		Dynamic,	// By the kind of each value
+	};
+
+	struct Change
+	{
+		KeyKind kind;
+		uint32_t hash;
+		Value key;
+		Value value;
+		Edit edit;
+		bool done;	// Added or removed a key
+	};
+
+	KeyKind keyKind (Type::ID type);
+	KeyKind dynamicKind (Value v) const;
+	uint32_t hashOf (KeyKind kind, Value key) const;
+	bool equal (KeyKind kind, Value a, Value b) const;
+	bool bytesOf (Value v, char * buffer, char const * & out_bytes, uint32_t & out_size) const;
+
+	size_t bytesToChange (MapNode const * root, uint32_t hash) const;
+	bool reserve (size_t bytes, Value * values, int count);
+
+	MapNode * newNode (Type::ID type, uint32_t used, Edit edit);
+	MapNode * reshape (MapNode * node, uint32_t remove_at, uint32_t remove, uint32_t insert_at, uint32_t insert, Edit edit);
+	void put (MapNode * node, uint32_t index, Value v);
+
+	MapNode * insert (MapNode * node, int shift, Change & c);
+	MapNode * erase (MapNode * node, int shift, Change & c);
+	MapNode * pair (Type::ID type, int shift, Value key, Value value, uint32_t hash, Change const & c);
+	MapNode * setValue (MapNode * node, uint32_t index, Change const & c);
+
+	template <typename F> void forEachIn (MapNode const * node, F & f) const;
+
+private:
+	Heap & m_heap;
+	std::vector<KeyKind> m_key_kinds;		// By map type
+	std::vector<Edit> m_open_edits;
+	Edit m_next_edit;
+};
+
+//======================================================================
+
+inline uint32_t Hamt::PopCount (uint32_t x)
+{
+#if defined(__GNUC__)
+	return uint32_t(__builtin_popcount(x));
+#else
+	x = x - ((x >> 1) & 0x55555555U);
+	x = (x & 0x33333333U) + ((x >> 2) & 0x33333333U);
+	return (((x + (x >> 4)) & 0x0F0F0F0FU) * 0x01010101U) >> 24;
+#endif
+}
+
+//----------------------------------------------------------------------
+
+inline uint32_t Hamt::Used (MapNode const * node)
+{
+	if (0 == (node->datamap | node->nodemap))
+		return 2 * node->size;		// A collision node (or the empty map)
+	return 2 * PopCount(node->datamap) + PopCount(node->nodemap);
+}
+
+//----------------------------------------------------------------------
+
+template <typename F>
+void Hamt::forEach (Object const * map, F && f) const
+{
+	forEachIn (static_cast<MapNode const *>(map), f);
+}
+
+//----------------------------------------------------------------------
+
+template <typename F>
+void Hamt::forEachIn (MapNode const * node, F & f) const
+{
+	auto const v = node->values();
+	auto const entries = (0 == (node->datamap | node->nodemap)) ? node->size : PopCount(node->datamap);
+	for (uint32_t i = 0; i < entries; ++i)
+		f (v[2 * i], v[2 * i + 1]);
+	for (uint32_t i = 2 * entries, n = Used(node); i < n; ++i)
+		forEachIn (static_cast<MapNode const *>(v[i].asObject()), f);
+}
+
+//======================================================================
+
+	}	// namespace VM
+}	// namespace UPL
+
+//======================================================================
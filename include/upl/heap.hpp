@@ -0,0 +1,325 @@
+#pragma once
+
+//======================================================================
+
+#include <upl/common.hpp>
+#include <upl/layout.hpp>
+#include <upl/st_code.hpp>
+#include <upl/value.hpp>
+
+#include <deque>
+
+//======================================================================
+
+namespace UPL {
+	namespace VM {
+
+//======================================================================
+//  This file implements the heap for VM objects: a precise, generational
+// garbage collector.
+//
+//  - New objects are bump-allocated in the nursery. A minor collection
+//    copies the survivors out of it into the old generation (everything
+//    that survives one minor collection is promoted) and resets it.
+//  - The old generation is one contiguous region, allocated by bumping
+//    and from size-segregated free lists, and collected by a (full)
+//    non-moving mark-sweep.
+//  - Old-to-young references are found through a card table: every
+//    store of a reference into an old object must go through
+//    writeBarrier(), which dirties the card (512 bytes) of the slot.
+//  - Which words of an object are references comes from its type's
+//    Layout (see LayoutEngine); roots are host-registered Values and
+//    RootSources, e.g. an Interpreter walking its stack maps.
+//
+//  The heap objects, by the tag of their type:
+//    String:          uint32 byte count, then the UTF-8 bytes
+//    Vector:          uint32 count, then the elements, at their stride
+//    Map:             a MapNode (of a HAMT, see hamt.hpp), then its
+//                     Values
+//    (internal):      a VectorNode (of a persistent vector, see
+//                     pvector.hpp), then its children; or a RopeNode
+//                     (of a string, see rope.hpp), then its two halves
+//    Function:        uint32 function index, uint32 count, then the
+//                     captured Values (a closure)
+//    everything else: the type's inline layout (a boxed Int is a
+//                     BoxedInt, a big tuple its fields, etc.)
+//======================================================================
+
+struct HeapConfig
+{
+	size_t nursery_size = 4 << 20;
+	size_t old_capacity = size_t(512) << 20;	// Address space; pages are touched as needed
+	size_t min_major_threshold = 8 << 20;		// No major collection until the old generation holds this much
+	double major_growth_factor = 2.0;			// Next major collection at (live bytes after this one) * factor
+	size_t pretenure_size = 64 << 10;			// Objects at least this big go straight to the old generation
+};
+
+//----------------------------------------------------------------------
+// Pause times, in power-of-two buckets of microseconds: bucket 0 counts
+// pauses under 2us, bucket i pauses in [2^i, 2^(i+1)) us, and the last
+// bucket everything longer.
+
+struct PauseHistogram
+{
+	static int const msc_BucketCount = 24;
+
+	uint64_t buckets [msc_BucketCount] = {};
+	uint64_t count = 0;
+	uint64_t total_ns = 0;
+	uint64_t max_ns = 0;
+
+	void add (uint64_t ns);
+	double averageMicroseconds () const {return count ? total_ns / 1000.0 / count : 0.0;}
+};
+
+//----------------------------------------------------------------------
+
+struct HeapStats
+{
+	uint64_t objects_allocated = 0;
+	uint64_t bytes_allocated = 0;
+	uint64_t bytes_pretenured = 0;		// Of bytes_allocated
+	uint64_t bytes_promoted = 0;
+	uint64_t bytes_freed = 0;			// By major collections
+	uint64_t minor_collections = 0;
+	uint64_t major_collections = 0;
+	uint64_t dirty_cards_scanned = 0;
+
+	size_t nursery_size = 0;
+	size_t nursery_used = 0;
+	size_t old_capacity = 0;
+	size_t old_used = 0;				// Bytes in live (or not yet collected) old objects
+	size_t old_free = 0;				// Bytes on the free lists
+	size_t old_top = 0;					// High-water mark of the old region
+
+	PauseHistogram minor_pauses;
+	PauseHistogram major_pauses;
+};
+
+//======================================================================
+
+class RootVisitor
+{
+public:
+	virtual ~RootVisitor () {}
+
+	// May update the value (objects move.)
+	virtual void visit (Value & v) = 0;
+};
+
+//----------------------------------------------------------------------
+
+class RootSource
+{
+public:
+	virtual ~RootSource () {}
+
+	virtual void visitRoots (RootVisitor & visitor) = 0;
+};
+
+//======================================================================
+
+class Heap
+{
+public:
+	static size_t const msc_CardSize = 512;
+	static int const msc_CardShift = 9;
+	static size_t const msc_MinObjectSize = 16;
+
+	// The VectorNodes inside persistent vectors and the RopeNodes of
+	// strings are objects of these types, which aren't the STContainer's.
+	static Type::ID const msc_VectorNodeType = 0xFFFFFFFEU;
+	static Type::ID const msc_RopeNodeType = 0xFFFFFFFDU;
+
+	enum Flags : uint32_t
+	{
+		Marked = 1,
+		Forwarded = 2,
+	};
+
+public:
+	// Note: the heap does NOT own the STContainer; objects' types are IDs
+	// in it, and it may keep growing.
+	explicit Heap (Type::STContainer const & types, HeapConfig const & config = HeapConfig());
+	~Heap ();
+
+	Heap (Heap const &) = delete;
+	Heap & operator = (Heap const &) = delete;
+
+	// A zeroed object. "count" is the element count for Strings, Vectors,
+	// Maps and closures, and is ignored otherwise. May collect garbage,
+	// so any Value not in a root can be stale afterwards. Returns nullptr
+	// if the heap is exhausted. A "pinned" object goes straight into the
+	// old generation, which never moves anything, so pointers into it
+	// stay good for as long as it lives.
+	Object * allocate (Type::ID type, uint32_t count = 0, bool pinned = false);
+	// Makes sure that the next allocations, of up to "bytes" in all and
+	// each small enough for the nursery, won't collect garbage; collects
+	// now if it must. False if they couldn't fit in the nursery anyway.
+	bool reserve (size_t bytes);
+
+	Value newInt (Int v);		// Inline if it fits, else a BoxedInt
+	Value newString (char const * utf8, size_t size);	// Inline if it's short enough
+	Object * newClosure (Type::ID type, uint32_t function_index, uint32_t capture_count);
+
+	// Must be called after storing "new_value" into "slot" inside "holder".
+	inline void writeBarrier (Object const * holder, void const * slot, Value new_value);
+	inline void writeBarrier (Object const * holder, void const * slot, Object const * new_ref);
+
+	bool isYoung (void const * p) const {return p >= m_nursery && p < m_nursery_end;}
+	bool isOld (void const * p) const {return p >= m_old && p < m_old + m_config.old_capacity;}
+
+	void collect (bool major = true);
+	bool resizeNursery (size_t new_size);	// Collects first
+
+	void addRoot (Value * root);
+	void removeRoot (Value * root);
+	void addRootSource (RootSource * source);
+	void removeRootSource (RootSource * source);
+
+	HeapStats stats () const;
+	HeapConfig const & config () const {return m_config;}
+	void setMajorThreshold (size_t min_bytes, double growth_factor);
+
+	// Object inspection
+	size_t sizeOf (Object const * obj);			// Total, including the header
+	uint32_t countOf (Object const * obj);		// Elements, for the variable-sized ones
+	void * payload (Object * obj) {return reinterpret_cast<uint8_t *>(obj) + sizeof(Object);}
+	Type::STContainer const & types () const {return m_types;}
+	Type::LayoutEngine & layouts () {return m_layouts;}
+
+	// Where field "index" of a Tuple (or Package) object lives, and its type.
+	bool fieldInfo (Object const * obj, int index, Type::Size & out_offset, Type::ID & out_type);
+	// Where the elements of a Vector (or String) object start, and their type and stride
+	// (and, optionally, where in the payload their count is.)
+	bool elementInfo (Object const * obj, Type::Size & out_offset, Type::ID & out_type, Type::Size & out_stride,
+		Type::Size * out_count_offset = nullptr);
+	// The same, for any object of "type".
+	bool elementInfo (Type::ID type, Type::Size & out_offset, Type::ID & out_type, Type::Size & out_stride,
+		Type::Size * out_count_offset = nullptr);
+	// Where the elements of a Vector or an Array object start, their type
+	// and stride, and how many there are. False for anything else.
+	bool packedElements (Object * obj, uint8_t * & out_first, Type::ID & out_type, Type::Size & out_stride,
+		uint32_t & out_count);
+
+private:
+	// How to find the references inside one type of object.
+	enum class SlotKind : uint8_t
+	{
+		Ref,		// Object *, may be null
+		Value,		// NaN-boxed
+		Any,		// Type ID, then a word that is a reference unless the type is a scalar
+		Variant,	// Discriminator, then one of the alternatives (see VariantMap)
+	};
+
+	struct Slot
+	{
+		Type::Size offset;
+		SlotKind kind;
+		uint32_t aux;	// Any: offset of the payload word; Variant: index into the shape's variants
+	};
+
+	struct VariantMap
+	{
+		Type::Size discriminator_size;
+		Type::Size payload_offset;
+		std::vector<std::vector<Slot>> alternatives;	// Offsets relative to the payload
+	};
+
+	struct Shape
+	{
+		bool valid = false;
+		bool allocatable = false;
+		bool is_array = false;
+		Type::Size fixed_size = 0;			// Payload bytes before the elements (or all of them)
+		Type::Size count_offset = 0;
+		Type::Size element_offset = 0;
+		Type::Size element_stride = 0;
+		Type::ID element_type = 0;		// For Vectors and Strings
+		std::vector<Type::Size> field_offsets;	// For Tuples and Packages
+		std::vector<Type::ID> field_types;
+		std::vector<Slot> slots;			// Relative to the payload
+		std::vector<Slot> element_slots;	// Relative to each element
+		std::vector<VariantMap> variants;
+	};
+
+	// A free chunk of the old generation is an Object of this type, with
+	// its size (in bytes) in "flags".
+	static Type::ID const msc_FreeType = 0xFFFFFFFFU;
+
+	class Marker;
+	class Evacuator;
+
+	Shape const & shape (Type::ID type);
+	void buildSlots (Type::ID type, Type::Size base, Shape & shape, std::vector<Slot> & out);
+	static size_t ObjectSize (Shape const & s, uint32_t count);
+	size_t chunkSize (Object const * chunk);
+
+	// Calls f(uint8_t * slot, bool is_value) for each reference slot of the
+	// object; only those in [lo, hi) if lo isn't null.
+	template <typename F> void forEachSlot (Object * obj, uint8_t const * lo, uint8_t const * hi, F && f);
+	template <typename F> void forEachSlotIn (Shape const & s, std::vector<Slot> const & slots, uint8_t * base, uint8_t const * lo, uint8_t const * hi, F && f);
+
+	uint8_t * allocateOld (size_t size);
+	void makeFree (uint8_t * start, size_t size);
+	void coverCards (uint8_t const * start, size_t size);
+	void markCard (void const * slot);
+
+	void collectGarbage (bool force_major);
+	void minor ();
+	void major ();
+	void visitAllRoots (RootVisitor & visitor);
+	void sweep ();
+
+private:
+	Type::STContainer const & m_types;
+	Type::LayoutEngine m_layouts;
+	HeapConfig m_config;
+
+	uint8_t * m_nursery;
+	uint8_t * m_nursery_end;
+	uint8_t * m_nursery_top;
+
+	uint8_t * m_old;
+	uint8_t * m_old_top;
+	uint8_t * m_cards;			// One byte per card; non-zero is dirty
+	uint32_t * m_crossing;		// Per card, offset (in the old region) of the chunk covering its first byte
+	std::vector<uint32_t> m_dirty_cards;
+
+	static int const msc_SmallBins = 32;			// Exact sizes 8, 16, ... 256
+	std::vector<Object *> m_free_small [msc_SmallBins + 1];
+	std::vector<Object *> m_free_large;
+	size_t m_old_used;
+	size_t m_old_free;
+	size_t m_next_major;
+
+	std::deque<Shape> m_shapes;		// deque, so references survive growth
+	Shape m_vector_node_shape;
+	Shape m_rope_node_shape;
+	std::vector<Value *> m_roots;
+	std::vector<RootSource *> m_root_sources;
+	HeapStats m_stats;
+};
+
+//======================================================================
+
+inline void Heap::writeBarrier (Object const * holder, void const * slot, Value new_value)
+{
+	if (new_value.isObject())
+		writeBarrier (holder, slot, new_value.asObject());
+}
+
+//----------------------------------------------------------------------
+
+inline void Heap::writeBarrier (Object const * holder, void const * slot, Object const * new_ref)
+{
+	if (isYoung(new_ref) && !isYoung(holder))
+		markCard (slot);
+}
+
+//======================================================================
+
+	}	// namespace VM
+}	// namespace UPL
+
+//======================================================================
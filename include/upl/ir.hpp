@@ -0,0 +1,276 @@
+#pragma once
+
+//======================================================================
+
+#include <upl/code_gen.hpp>
+#include <upl/common.hpp>
+#include <upl/definitions.hpp>
+#include <upl/st_code.hpp>
+#include <upl/vm.hpp>
+
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+//======================================================================
+
+namespace UPL {
+	namespace CodeGen {
+
+//======================================================================
+//  This file implements the code generator's mid-level representation:
+// functions as control flow graphs of basic blocks holding instructions
+// in SSA form, each typed with an ID from the module's STContainer. The
+// front end lowers into it (through IRBuilder), the optimizer works on it
+// (ir_passes.hpp) and EmitFunction (code_gen.hpp) turns it into bytecode.
+//
+//  - A value is the instruction that defines it; both are named by a
+//    ValueID, which is the instruction's index in its function. 0 is no
+//    value. Removed instructions are only marked dead, so IDs are stable.
+//  - A block holds its phis first and ends in exactly one Jump-kind
+//    instruction (Ret, Jmp or Br.) The operands of a phi are in the same
+//    order as the block's predecessors.
+//  - Block 0 is the entry; it has no predecessors.
+//======================================================================
+
+typedef uint32_t ValueID;
+typedef uint32_t BlockID;
+
+ValueID const NoValue = 0;
+BlockID const NoBlock = 0xFFFFFFFFU;
+
+//----------------------------------------------------------------------
+
+#define IR_OPCODE_ENUM(e,s,n,k)		e,
+enum class IROp : uint8_t { UPL_PRIVATE__IR_OPCODES(IR_OPCODE_ENUM) };
+#undef  IR_OPCODE_ENUM
+
+#define IR_OPCODE_COUNT(e,s,n,k)	+1
+int const IROpCount = UPL_PRIVATE__IR_OPCODES(IR_OPCODE_COUNT);
+#undef  IR_OPCODE_COUNT
+
+//----------------------------------------------------------------------
+
+enum class IRKind : uint8_t
+{
+	Pure,
+	Traps,
+	Reads,
+	Effect,
+	Jump,
+};
+
+char const * IROpName (IROp op);
+int IROpOperands (IROp op);		// -1 if it varies
+IRKind IROpKind (IROp op);
+
+//----------------------------------------------------------------------
+
+struct IRInstr
+{
+	IROp op = IROp::Const;
+	bool dead = false;
+	Type::ID type = 0;				// Of the value defined; 0 if there's none
+	BlockID block = NoBlock;
+	uint32_t aux = 0;				// Param index, function index, field index or type, by op
+	VM::Reg number = VM::Reg::Nil();	// For Const, in its register representation
+	std::vector<ValueID> operands;
+	BlockID targets [2] = {NoBlock, NoBlock};	// For Jmp and Br
+};
+
+//----------------------------------------------------------------------
+
+struct IRBlock
+{
+	bool dead = false;
+	std::vector<ValueID> code;		// Phis first, the terminator last
+	std::vector<BlockID> preds;
+};
+
+//----------------------------------------------------------------------
+
+class IRFunction
+{
+public:
+	IRFunction (std::string name, Type::ID type, std::vector<Type::ID> param_types);
+
+	std::string const & name () const {return m_name;}
+	Type::ID type () const {return m_type;}
+	std::vector<Type::ID> const & paramTypes () const {return m_param_types;}
+
+	// VM::Function::msc_... flags; the function has them in the module too.
+	// msc_Memoize is for the source to ask for, and msc_Pure for
+	// MarkPureFunctions (in ir_passes.hpp) to find.
+	uint16_t flags () const {return m_flags;}
+	void setFlags (uint16_t flags) {m_flags = flags;}
+
+	// Indexed by ValueID; entry 0 is a placeholder.
+	std::vector<IRInstr> & values () {return m_values;}
+	std::vector<IRInstr> const & values () const {return m_values;}
+	IRInstr & operator [] (ValueID v) {return m_values[v];}
+	IRInstr const & operator [] (ValueID v) const {return m_values[v];}
+
+	std::vector<IRBlock> & blocks () {return m_blocks;}
+	std::vector<IRBlock> const & blocks () const {return m_blocks;}
+	IRBlock & block (BlockID b) {return m_blocks[b];}
+	IRBlock const & block (BlockID b) const {return m_blocks[b];}
+
+	BlockID addBlock ();
+	ValueID addInstr (IRInstr instr);	// Not placed in any block; the caller does that
+	ValueID terminator (BlockID b) const {return m_blocks[b].code.empty() ? NoValue : m_blocks[b].code.back();}
+	int successors (BlockID b, BlockID out [2]) const;
+
+	// The instructions that are still alive, phis included.
+	uint32_t instructionCount () const;
+
+	// Drops the dead instructions from the blocks' code.
+	void compact ();
+
+	// Forgets that "pred" jumps to "b" (after the jump has been changed),
+	// along with the matching phi operands.
+	void removePred (BlockID b, BlockID pred);
+
+	// Replaces each operand v with map[v] (following chains) wherever
+	// map[v] isn't NoValue. Returns the number of operands changed.
+	uint32_t rewriteOperands (std::vector<ValueID> const & map);
+
+	// The reachable blocks in reverse postorder, and each one's immediate
+	// dominator (NoBlock for the entry and unreachable ones.)
+	void computeDominators (std::vector<BlockID> & out_rpo, std::vector<BlockID> & out_idom) const;
+
+	// Checks the invariants above; on failure, says what's wrong.
+	bool verify (std::string & out_error) const;
+
+	String print (Type::STContainer const & types) const;
+
+private:
+	std::string m_name;
+	Type::ID m_type;
+	std::vector<Type::ID> m_param_types;
+	uint16_t m_flags;
+	std::vector<IRInstr> m_values;
+	std::vector<IRBlock> m_blocks;
+};
+
+//----------------------------------------------------------------------
+// The functions of one compilation, in the order they will have in the
+// VM module; Func and direct calls refer to them by index. Likewise its
+// globals, for Global; each one's initializer is one of the functions,
+// taking no parameters.
+
+struct IRGlobal
+{
+	std::string name;
+	Type::ID type;
+	uint32_t initializer;
+};
+
+struct IRModule
+{
+	std::vector<IRFunction> functions;
+	std::vector<IRGlobal> globals;
+};
+
+//======================================================================
+// Builds a function in SSA form straight from the source's local
+// variables, with the on-the-fly construction of Braun et al.: reading a
+// variable looks for its definition in the current block, then (through
+// phis where paths join) in the predecessors. A block must be sealed once
+// all of its predecessors are known; until then, reads from it get
+// placeholder phis that are completed on sealing. Phis that turn out to
+// be trivial become copies, which the optimizer removes.
+
+class IRBuilder
+{
+public:
+	typedef uint32_t Variable;
+
+public:
+	// Note: the builder does NOT own the function or the types.
+	IRBuilder (IRFunction & function, Type::STContainer const & types);
+
+	IRFunction & function () {return m_function;}
+	Type::STContainer const & types () const {return m_types;}
+
+	BlockID newBlock () {return m_function.addBlock();}
+	void setBlock (BlockID b) {m_block = b;}
+	BlockID currentBlock () const {return m_block;}
+	bool isTerminated () const;		// The current block already ends in a jump
+	void seal (BlockID b);
+
+	Variable newVariable (Type::ID type);
+	void assign (Variable var, ValueID v) {writeVariable (var, m_block, v);}
+	ValueID use (Variable var) {return readVariable(var, m_block);}
+
+	ValueID param (uint32_t index);
+	ValueID constInt (Int v, Type::ID type = 0);		// An Int, unless given another int-like type
+	ValueID constReal (Real v);
+	ValueID constBool (Bool v);
+	ValueID constNil ();
+	ValueID functionRef (uint32_t index, Type::ID type);
+	ValueID global (uint32_t index, Type::ID type);
+	ValueID copy (ValueID v);
+
+	ValueID binary (BinaryOp op, ValueID a, ValueID b);
+	ValueID negate (ValueID a);
+	ValueID logicalNot (ValueID a);
+	ValueID toReal (ValueID a);
+	ValueID toInt (ValueID a);
+	ValueID box (ValueID a);
+	ValueID unbox (ValueID a, Type::ID type);
+	ValueID typeOf (ValueID a);
+
+	ValueID newObject (Type::ID type);
+	ValueID newArray (Type::ID type, ValueID count);
+	ValueID getField (ValueID obj, uint32_t index, Type::ID type);
+	void setField (ValueID obj, uint32_t index, ValueID v);
+	ValueID getElement (ValueID obj, ValueID index, Type::ID type);
+	void setElement (ValueID obj, ValueID index, ValueID v);
+	ValueID length (ValueID obj);
+
+	ValueID call (ValueID callee, std::vector<ValueID> const & args, Type::ID result_type);
+	// A bulk operation (see bulk.hpp); Map and Zip have no result, Reduce
+	// an Int or a Real, Filter an Int.
+	ValueID bulk (uint8_t code, std::vector<ValueID> operands, Type::ID result_type = 0);
+	// An I/O operation (see scheduler.hpp); its result is an Int.
+	ValueID io (uint8_t code, std::vector<ValueID> operands, Type::ID result_type);
+	// A vector of type "type" of func(e) for each element e of "vec", and
+	// func(...func(func(init, vec[0]), vec[1])...); on a Parallel when
+	// PlanParallelOps (ir_passes.hpp) finds that they can be.
+	ValueID parallelMap (Type::ID type, ValueID func, ValueID vec);
+	ValueID parallelReduce (ValueID func, ValueID init, ValueID vec, Type::ID result_type);
+
+	void ret (ValueID v = NoValue);
+	void jump (BlockID target);
+	void branch (ValueID cond, BlockID if_true, BlockID if_false);
+
+private:
+	ValueID emit (IROp op, Type::ID type, std::vector<ValueID> operands, uint32_t aux = 0);
+	ValueID constant (Type::ID type, VM::Reg number);
+	void addEdge (BlockID from, BlockID to);
+
+	void writeVariable (Variable var, BlockID b, ValueID v);
+	ValueID readVariable (Variable var, BlockID b);
+	ValueID newPhi (BlockID b, Type::ID type);
+	ValueID addPhiOperands (Variable var, ValueID phi);
+	ValueID tryRemoveTrivialPhi (ValueID phi);
+
+	static uint64_t Key (Variable var, BlockID b) {return (uint64_t(var) << 32) | b;}
+
+private:
+	IRFunction & m_function;
+	Type::STContainer const & m_types;
+	BlockID m_block;
+	std::vector<Type::ID> m_variable_types;
+	std::unordered_map<uint64_t, ValueID> m_current_def;
+	std::vector<bool> m_sealed;
+	std::unordered_map<BlockID, std::vector<std::pair<Variable, ValueID>>> m_incomplete_phis;
+	std::vector<ValueID> m_params;
+};
+
+//======================================================================
+
+	}	// namespace CodeGen
+}	// namespace UPL
+
+//======================================================================
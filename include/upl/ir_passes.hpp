@@ -0,0 +1,140 @@
+#pragma once
+
+//======================================================================
+
+#include <upl/common.hpp>
+#include <upl/ir.hpp>
+#include <upl/st_code.hpp>
+
+#include <vector>
+
+//======================================================================
+
+namespace UPL {
+	namespace CodeGen {
+
+//======================================================================
+//  The optimization passes over the SSA form. Each one returns how many
+// changes it made (0 when there was nothing to do), leaves the function
+// valid (see IRFunction::verify) and only marks what it removes as dead;
+// Optimize compacts between passes.
+//======================================================================
+
+// Replaces uses of copies with what they copy, and of phis whose
+// operands are all the same value (or the phi itself) with that value.
+uint32_t PropagateCopies (IRFunction & f);
+
+// Evaluates instructions whose operands are all constants (the same way
+// the VM would), simplifies the trivial identities (x + 0, x * 1, an
+// unbox of a box, ...), turns branches on constants into jumps and drops
+// the blocks that are no longer reachable. Anything that would fail at
+// run time (e.g. division by zero) is left for run time.
+uint32_t FoldConstants (IRFunction & f, Type::STContainer const & types);
+
+// Shares identical Pure (and Traps) instructions: one that is dominated
+// by an identical one is replaced by it.
+uint32_t EliminateCommonSubexpressions (IRFunction & f);
+
+// Drops instructions whose values are never used, unless they have
+// effects (or might fail.)
+uint32_t EliminateDeadCode (IRFunction & f);
+
+// Escape analysis: an object (a tuple, a package, or a vector of a
+// constant length) that is only ever read from and written to, with
+// constant indices, can't outlive the call, so its fields become plain
+// values and it is never allocated. Returns the number of allocations
+// removed.
+uint32_t ReplaceObjectsWithScalars (IRFunction & f, Type::STContainer const & types, uint32_t max_fields = 16);
+
+uint32_t RemoveUnreachableBlocks (IRFunction & f);
+
+// Appends a block to its only predecessor when that one just jumps to it
+// (as inlining and folded branches leave them); its phis become copies.
+uint32_t MergeBlocks (IRFunction & f);
+
+// Replaces the loops over all of a vector of ints, reals or bytes that
+// do what one bulk operation does (see bulk.hpp) with it: "out[i] = a[i]
+// op k" (or "op b[i]"), "acc = acc op a[i]" and "if (a[i] cmp k) {out[j]
+// = a[i]; j += 1}", with i (and j) from 0. Sums and products of reals are
+// only done that way if "reassociate_reals" (their lanes add up in a
+// different order.) Returns the number of loops replaced.
+uint32_t LowerBulkLoops (IRFunction & f, Type::STContainer const & types, bool reassociate_reals = false);
+
+//----------------------------------------------------------------------
+// What a pass did in one call to Optimize, summed over its runs.
+
+struct PassReport
+{
+	char const * pass = nullptr;
+	uint32_t runs = 0;
+	uint32_t changes = 0;
+	int64_t instructions_removed = 0;	// Net (negative if they grew), as counted by IRFunction::instructionCount
+	uint64_t nanoseconds = 0;
+};
+
+//----------------------------------------------------------------------
+// Runs the passes in order, again and again until nothing changes (or
+// max_rounds.) If "out_reports" is given, adds to the report of each pass
+// (or appends one.)
+void Optimize (IRFunction & f, Type::STContainer const & types, std::vector<PassReport> * out_reports = nullptr, int max_rounds = 4);
+
+//======================================================================
+// Module-wide passes. Direct calls (through a Func instruction) are only
+// made to functions bound with "def", which can't be rebound; anything
+// else is called through a value and left alone.
+//======================================================================
+
+struct InlineOptions
+{
+	uint32_t max_callee_size = 32;		// IR instructions, not counting parameters and returns
+	uint32_t max_caller_size = 2000;	// Stop growing a function past this
+	uint32_t constant_arg_bonus = 6;	// Allowance per constant argument (it will likely fold)
+	int max_rounds = 3;					// Inlining what was inlined, that many levels deep
+};
+
+// Replaces direct calls to small functions that aren't (even mutually)
+// recursive, or marked to be memoized, with their bodies.
+uint32_t InlineCalls (IRModule & m, InlineOptions const & options = InlineOptions());
+
+// Where a direct call passes a boxed bool, int or real for an Any (or
+// Variant) parameter, calls a copy of the callee specialized for it
+// instead; in the copy, the parameter is the unboxed value, boxed again
+// where needed, so its type tests and unboxing fold away. Copies are
+// appended to the module (and shared by call sites that agree.) Returns
+// the number of call sites changed.
+uint32_t SpecializeCalls (IRModule & m, Type::STContainer & types);
+
+// Which functions are pure: they write to no object but those they
+// allocate themselves, and call (or map or fold with) nothing but pure
+// functions, directly. Functions in the IR capture nothing, so that is all
+// there is to it; what's called through a value could be anything.
+// Reading a global counts as calling its initializer. Recursive functions
+// are pure unless something they call isn't.
+std::vector<uint8_t> FindPureFunctions (IRModule const & m);
+
+// Decides how each PMap and PReduce runs. Those whose function is a
+// direct reference to a pure one taking and returning scalars (bools,
+// bytes, chars, ints or reals, as the elements must be too) are marked to
+// run in parallel (see parallel.hpp), unless it reads globals holding
+// heap references, even indirectly. The rest run an element at a time;
+// those over Vectors become the loops that do that, for the other passes
+// to work on. Returns the number of loops made.
+uint32_t PlanParallelOps (IRModule & m, Type::STContainer const & types);
+
+// Marks the functions FindPureFunctions finds pure with
+// VM::Function::msc_Pure (and unmarks the rest), so the VM may memoize
+// their calls (see memo.hpp). Returns the number marked.
+uint32_t MarkPureFunctions (IRModule & m);
+
+// Optimize on every function, then the planning of parallel operations,
+// specialization and inlining, then Optimize again, and the marking of
+// pure functions.
+void OptimizeModule (IRModule & m, Type::STContainer & types, std::vector<PassReport> * out_reports = nullptr,
+	InlineOptions const & options = InlineOptions());
+
+//======================================================================
+
+	}	// namespace CodeGen
+}	// namespace UPL
+
+//======================================================================
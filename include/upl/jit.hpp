@@ -0,0 +1,151 @@
+#pragma once
+
+//======================================================================
+
+#include <upl/common.hpp>
+#include <upl/vm.hpp>
+
+#include <cstddef>
+#include <vector>
+
+//======================================================================
+
+#if !defined(UPL_JIT_AVAILABLE)
+	#if defined(__x86_64__) && defined(__linux__)
+		#define UPL_JIT_AVAILABLE	1
+	#else
+		#define UPL_JIT_AVAILABLE	0
+	#endif
+#endif
+
+//======================================================================
+
+namespace UPL {
+	namespace VM {
+
+//======================================================================
+//  A baseline JIT compiler: each bytecode instruction of a hot function
+// is translated by a fixed template into x86-64 code that works on the
+// same register file as the interpreter, so the interpreter and the
+// compiled code can hand a running function back and forth at any
+// instruction boundary:
+//
+//  - The interpreter counts entries to each function (calls, and
+//    backward jumps taken); past the threshold, the function is compiled
+//    and from then on entered in native code, at whatever pc it's at.
+//  - Native code returns either the function's result or the pc of the
+//    instruction it can't do (anything that allocates, calls, or touches
+//    the heap), or of a guard that failed (division by zero, a real that
+//    doesn't fit an int, ...). The interpreter carries on from there.
+//
+// Compiled code is written into fresh pages that are only made
+// executable (and no longer writable) once complete. The cache has a
+// fixed capacity; what's been entered least recently is evicted to make
+// room. Instructions run natively aren't counted in the interpreter's
+// Stats; its native_entries and native_exits are.
+//======================================================================
+
+enum class JitMode : uint8_t
+{
+	Off,
+	Baseline,
+};
+
+char const * JitModeName (JitMode mode);
+bool ParseJitMode (char const * name, JitMode & out_mode);	// "off" or "baseline"
+
+//----------------------------------------------------------------------
+
+struct JitOptions
+{
+	JitMode mode = UPL_JIT_AVAILABLE ? JitMode::Baseline : JitMode::Off;
+	uint32_t threshold = 1000;				// Entries (calls and loop iterations) before compiling
+	size_t cache_capacity = 1 << 20;		// Bytes of native code
+	double min_coverage = 0.5;				// Of the instructions that have templates, to bother
+};
+
+//----------------------------------------------------------------------
+
+struct JitStats
+{
+	uint64_t compiled = 0;
+	uint64_t rejected = 0;					// Functions not worth compiling
+	uint64_t evicted = 0;
+	size_t code_bytes = 0;					// Currently in the cache
+	double compile_seconds = 0;
+};
+
+//----------------------------------------------------------------------
+
+class Jit
+{
+public:
+	// Runs the function's code, starting at "pc" (relative to the
+	// function), on the registers R. Returns msc_Returned with the result
+	// in "out_result", or the pc at which the interpreter must go on.
+	typedef uint32_t (*NativeCode) (Reg * R, uint32_t pc, Reg * out_result);
+	static uint32_t const msc_Returned = 0xFFFFFFFFU;
+
+public:
+	// Note: the JIT does NOT own the module.
+	Jit (Module const & module, JitOptions const & options = JitOptions());
+	~Jit ();
+
+	Jit (Jit const &) = delete;
+	Jit & operator = (Jit const &) = delete;
+
+	JitOptions const & options () const {return m_options;}
+	JitStats const & stats () const {return m_stats;}
+
+	// Called by the interpreter on entering function "index" (or going
+	// round one of its loops.) Returns its native code, if it has (or
+	// now gets) any.
+	NativeCode enter (uint32_t index)
+	{
+		auto & e = m_entries[index];
+		e.last_entered = ++m_clock;
+		if (nullptr != e.code)
+			return e.code;
+		if (e.count < e.threshold)
+		{
+			++e.count;
+			return nullptr;
+		}
+		return compile(index);
+	}
+
+	// Compiles "index" now, regardless of the counters. Returns nullptr if
+	// it can't (or isn't worth it.)
+	NativeCode compile (uint32_t index);
+
+	// Drops all the compiled code (and counts.)
+	void flush ();
+
+private:
+	struct Entry
+	{
+		NativeCode code = nullptr;
+		void * pages = nullptr;
+		size_t size = 0;					// Of the pages
+		uint64_t last_entered = 0;
+		uint32_t count = 0;
+		uint32_t threshold = 0;				// Never, if it was rejected
+	};
+
+	void evict (uint32_t index);
+	bool makeRoom (size_t size);
+
+private:
+	Module const & m_module;
+	JitOptions m_options;
+	JitStats m_stats;
+	std::vector<Entry> m_entries;
+	uint64_t m_clock;
+};
+
+//======================================================================
+
+	}	// namespace VM
+}	// namespace UPL
+
+//======================================================================
@@ -0,0 +1,89 @@
+#pragma once
+
+//======================================================================
+
+#include <upl/common.hpp>
+#include <upl/definitions.hpp>
+#include <upl/st_code.hpp>
+
+#include <deque>
+
+//======================================================================
+
+namespace UPL {
+	namespace Type {
+
+//======================================================================
+//  This file implements the physical layout of values of each type:
+// size, alignment, where the fields go and whether the GC needs to look
+// inside. Scalars are stored unboxed; composites are stored inline
+// (fields reordered to minimize padding) unless they are too big, in
+// which case they are boxed like strings, vectors, maps and closures.
+//======================================================================
+
+struct Layout
+{
+	Size size = 0;
+	Size alignment = 1;
+	bool is_boxed = false;		// The value is a single reference to a heap object
+	bool has_pointers = false;	// The value contains (or may contain) heap references
+	Size discriminator_size = 0;	// For Variant and Any: bytes used by the run-time type tag
+	Size heap_size = 0;			// For boxed aggregates: size of the heap object's payload
+
+	// Tuple, Package: the offset of each field, in declaration order.
+	// Variant, Any: {offset of the discriminator, offset of the payload}.
+	// Everything else: empty.
+	std::vector<Size> field_offsets;
+};
+
+//----------------------------------------------------------------------
+
+class LayoutEngine
+{
+public:
+	static Size const msc_PointerSize = UPL_PRIVATE__POINTER_SIZE;
+	static Size const msc_DefaultMaxInlineSize = 4096;
+
+public:
+	// Note: LayoutEngine does NOT own the STContainer. The container may
+	// keep growing; layouts for new types are computed on demand.
+	explicit LayoutEngine (STContainer const & types, Size max_inline_size = msc_DefaultMaxInlineSize);
+
+	// The returned reference stays valid for the lifetime of the engine.
+	Layout const & layout (ID id);
+
+	Size sizeOf (ID id) {return layout(id).size;}
+	Size alignOf (ID id) {return layout(id).alignment;}
+	Size strideOf (ID id) {auto const & l = layout(id); return RoundUp(l.size, l.alignment);}
+	bool isBoxed (ID id) {return layout(id).is_boxed;}
+	bool hasPointers (ID id) {return layout(id).has_pointers;}
+	Size fieldOffset (ID id, int field_index) {return layout(id).field_offsets[field_index];}
+
+	size_t computedCount () const {return m_computed_count;}
+
+	static Size RoundUp (Size v, Size alignment) {return (v + alignment - 1) / alignment * alignment;}
+
+private:
+	Layout compute (ID id);
+	Layout computeVariant (std::vector<ID> const & alternatives);
+	Layout computeAny ();
+	Layout computeArray (Size count, ID elem_type);
+	Layout computeFields (std::vector<ID> const & field_types);
+	Layout boxed () const;
+	Layout unboxed (Size size) const;
+	Layout boxedIfTooBig (Layout l, uint64_t inline_size) const;
+
+private:
+	STContainer const & m_types;
+	Size m_max_inline_size;
+	std::deque<Layout> m_layouts;	// deque, so references survive growth
+	std::vector<bool> m_valid;
+	size_t m_computed_count;
+};
+
+//======================================================================
+
+	}	// namespace Type
+}	// namespace UPL
+
+//======================================================================
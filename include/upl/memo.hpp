@@ -0,0 +1,199 @@
+#pragma once
+
+//======================================================================
+
+#include <upl/common.hpp>
+#include <upl/vm.hpp>
+
+#include <memory>
+#include <vector>
+
+//======================================================================
+
+namespace UPL {
+	namespace VM {
+
+//======================================================================
+//  The results of one function's calls, keyed on its arguments: at most
+// "capacity" of them, and when it's full, the one to go is picked by
+// CLOCK (the hand passes over the entries that were found since it last
+// came by, and takes the first that wasn't.) Arguments and results are
+// register contents, compared bit for bit, so only scalars may go in
+// (nothing here is a root, and a reference compares by address anyway.)
+//
+//  A call's entry is reserved before the callee runs, and filled in when
+// it returns; an entry is found only once it's filled in. Whoever holds a
+// reservation (the callee's frame) also holds its stamp, as the entry
+// may have gone to another call in the meantime, and then the result is
+// just dropped. Tables aren't freed while their Memo lives, since
+// frames may still hold reservations. An entry also remembers how many
+// calls its result took (the callee's and those it made), as what each
+// hit on it saves.
+//======================================================================
+
+class MemoTable
+{
+public:
+	struct Counts
+	{
+		uint64_t hits = 0;
+		uint64_t misses = 0;
+		uint64_t evictions = 0;
+		uint64_t saved = 0;		// Calls the hits didn't make
+	};
+
+public:
+	MemoTable (unsigned arity, uint32_t capacity);
+
+	unsigned arity () const {return m_arity;}
+	uint32_t capacity () const {return m_capacity;}
+	uint32_t size () const {return m_used;}
+	Counts const & counts () const {return m_counts;}
+
+	// On a hit, "out_result" is the result; on a miss, "out_reservation"
+	// (if any) is where it goes once there is one. "calls" is Stats::calls
+	// once the call has returned (see MemoReservation).
+	bool find (Reg const * args, Reg & out_result, MemoReservation * out_reservation);
+	void fill (MemoReservation const & reservation, Reg result, uint64_t calls);
+
+	// Forgets all the results; "release" gives up the memory too, until
+	// the next "clear". Reservations made before are ignored.
+	void clear ();
+	void release ();
+
+private:
+	struct Entry
+	{
+		uint64_t hash;
+		Reg result;
+		uint32_t stamp;		// Of the reservation it was last taken for
+		uint32_t cost;		// In calls, once filled
+		bool filled;
+		bool referenced;	// Found since the hand last passed
+	};
+
+	static uint64_t Hash (Reg const * args, unsigned arity);
+
+	uint32_t evict ();
+	void unindex (uint32_t slot);
+
+private:
+	unsigned m_arity;
+	uint32_t m_capacity;
+	std::vector<Entry> m_entries;
+	std::vector<Reg> m_keys;			// m_arity per entry
+	std::vector<uint32_t> m_index;		// Open addressing, from the hashes: an entry + 1, or 0 for none
+	uint32_t m_used;
+	uint32_t m_hand;
+	uint32_t m_stamp;					// Of the last reservation; never goes back
+	Counts m_counts;
+};
+
+//======================================================================
+//  Which calls an interpreter memoizes (see Interpreter::setMemo), and the
+// tables it keeps for them. Only the calls of Call and TailCall
+// instructions to pure functions (Function::msc_Pure) that take and
+// return scalars are considered; those marked Function::msc_Memoize
+// get a table straight away. The rest, in Profile mode, get one on trial
+// once they have been called often enough, and keep it only if enough of
+// the calls on trial found their result there; and then only for as long
+// as enough of them still do, checked again every so many calls (a
+// function whose arguments stop repeating, or repeat too far apart for
+// the table to hold, is switched off.) A hit counts for the calls it
+// saved, so that a recursive function whose hits cut its chains of calls
+// short stays on with fewer of them. Each interpreter must have a Memo of
+// its own.
+//======================================================================
+
+struct MemoConfig
+{
+	enum class Mode
+	{
+		Off,
+		Marked,		// Only the functions marked msc_Memoize
+		Profile,	// And the others that turn out to be worth it
+	};
+
+	Mode mode = Mode::Marked;
+	uint32_t capacity = 4096;			// Entries per function
+	uint32_t profile_calls = 1000;		// Before a function's table goes on trial
+	uint32_t trial_calls = 4000;		// That the trial lasts
+	uint32_t min_hits_per_mille = 250;	// Of the calls on trial (or since the last check; each hit counting
+										// for the calls it saved), for the table to stay
+	uint32_t recheck_calls = 20000;		// Between the checks of a table that passed its trial
+};
+
+//----------------------------------------------------------------------
+
+class Memo
+{
+public:
+	// Note: Memo does NOT own the module.
+	Memo (Module const & module, MemoConfig const & config = MemoConfig());
+	~Memo ();
+
+	Memo (Memo const &) = delete;
+	Memo & operator = (Memo const &) = delete;
+
+	MemoConfig const & config () const {return m_config;}
+
+	// The table for a call to "f", which must be pure, or nullptr if the
+	// call isn't to be memoized.
+	inline MemoTable * tableFor (Function const * f);
+
+	// The table function "index" has now, if any.
+	MemoTable const * table (uint32_t index) const;
+
+	// Forgets all the results (and how the trials went.)
+	void clear ();
+
+private:
+	enum class Status : uint8_t
+	{
+		Unknown,	// Not called yet
+		Never,		// Doesn't take or return scalars, or didn't pass its trial
+		Counting,
+		Trial,
+		Kept,		// Passed its trial; checked again every recheck_calls
+		On,
+	};
+
+	struct State
+	{
+		Status status = Status::Unknown;
+		uint32_t calls = 0;		// While Counting, on Trial and Kept
+		MemoTable::Counts checked;	// The table's, as of the last check
+		std::unique_ptr<MemoTable> table;
+	};
+
+	MemoTable * decide (uint32_t index);
+	bool worthIt (MemoTable::Counts const & counts, MemoTable::Counts const & since) const;
+
+private:
+	Module const & m_module;
+	MemoConfig m_config;
+	std::vector<State> m_states;	// By function index
+};
+
+//----------------------------------------------------------------------
+
+inline MemoTable * Memo::tableFor (Function const * f)
+{
+	auto const index = m_module.functionIndex(f);
+	if (index < m_states.size())
+	{
+		auto const & s = m_states[index];
+		if (Status::On == s.status)
+			return s.table.get();
+		if (Status::Never == s.status)
+			return nullptr;
+	}
+	return decide(index);
+}
+
+//======================================================================
+
+	}	// namespace VM
+}	// namespace UPL
+
+//======================================================================
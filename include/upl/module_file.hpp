@@ -0,0 +1,121 @@
+#pragma once
+
+//======================================================================
+
+#include <upl/common.hpp>
+#include <upl/vm.hpp>
+
+#include <memory>
+#include <string>
+
+//======================================================================
+
+namespace UPL {
+	namespace VM {
+
+//======================================================================
+//  The module file format ("UPLM"), as written by uplc. Everything is in
+// the writer's byte order (checked on load) and at its natural alignment,
+// so a mapped file is used in place: the function table, code, constants
+// and stack maps are pointed into, never copied or fixed up, and loading
+// a module costs a few page faults instead of a compilation. Only the
+// types are rebuilt (into the module's STContainer), at a cost in
+// proportion to their count rather than to the size of the code.
+//
+//   header       ModuleFileHeader
+//   types        for each type, from ID 1 up: varint length, packed ST-code
+//   functions    Function [functions.size / sizeof(Function)]
+//   code         Instruction [...]
+//   constants    Reg [...]
+//   stack maps   StackMap [...]
+//   names        the function and global names, each NUL-terminated
+//   globals      Global [...]
+//
+// Each section starts at a multiple of msc_SectionAlignment. Constants
+// are plain numbers (no pointers), so there is nothing to relocate.
+//======================================================================
+
+struct ModuleFileSection
+{
+	uint64_t offset;	// From the start of the file
+	uint64_t size;		// In bytes
+};
+
+//----------------------------------------------------------------------
+
+struct ModuleFileHeader
+{
+	static uint32_t const msc_Version = 6;
+	static uint32_t const msc_ByteOrderMark = 0x01020304;
+	static uint64_t const msc_SectionAlignment = 16;
+
+	char magic [4];			// "UPLM"
+	uint32_t version;
+	uint32_t byte_order;	// msc_ByteOrderMark, as the writer saw it
+	uint32_t header_size;
+	uint64_t file_size;
+	uint32_t opcode_set;	// OpcodeSetID() of the writer (superinstructions differ between builds)
+	uint32_t reserved;
+
+	ModuleFileSection types;
+	ModuleFileSection functions;
+	ModuleFileSection code;
+	ModuleFileSection constants;
+	ModuleFileSection stack_maps;
+	ModuleFileSection names;
+	ModuleFileSection globals;
+};
+
+//----------------------------------------------------------------------
+
+enum class ModuleFileError
+{
+	None,
+	CantOpen,
+	CantWrite,
+	CantMap,
+	NotEmpty,		// Loading into a module that already has something in it
+	BadMagic,
+	BadVersion,
+	OtherOpcodes,	// Written by a build with other superinstructions
+	WrongByteOrder,
+	Truncated,		// Or a section is outside the file, or misaligned
+	BadTypes,
+	BadTables,		// Function, global, stack map or name references out of range
+	BadCode,		// Only checked on request; see VerifyCode
+};
+
+char const * ModuleFileErrorName (ModuleFileError err);
+
+//======================================================================
+
+void SerializeModule (Module const & module, std::string & out_bytes);
+ModuleFileError SaveModule (Module const & module, char const * path);
+
+// Loads into an empty (just constructed) module. The file is mapped
+// read-only and stays mapped for as long as the module lives. Where
+// there is no mmap, it's read into memory instead.
+ModuleFileError LoadModule (char const * path, Module & out_module, bool verify_code = false);
+
+// The same, from an image already in memory (8-byte aligned); the module
+// keeps "image" alive.
+ModuleFileError LoadModuleImage (std::shared_ptr<void const> image, size_t size, Module & out_module, bool verify_code = false);
+
+// Checks that every instruction is valid and stays inside its function:
+// known opcodes, registers below the function's register count, constant
+// and function indices in range, jumps inside the function, the parts of
+// superinstructions where they should be, and no falling off the end.
+// That catches a file that is damaged, or was written for other code; it
+// does NOT make one from an untrusted source safe to run. What registers
+// hold isn't checked (nor is anything that would take following the data
+// flow), so a Call on a register LoadI filled, or a GetF on one that holds
+// no object, still follows whatever pointer it finds there. Only load
+// modules you would run the compiler's output of.
+ModuleFileError VerifyCode (Module const & module);
+
+//======================================================================
+
+	}	// namespace VM
+}	// namespace UPL
+
+//======================================================================
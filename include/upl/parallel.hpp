@@ -0,0 +1,110 @@
+#pragma once
+
+//======================================================================
+
+#include <upl/common.hpp>
+#include <upl/errors.hpp>
+#include <upl/heap.hpp>
+#include <upl/thread_pool.hpp>
+#include <upl/vm.hpp>
+
+#include <atomic>
+#include <memory>
+#include <utility>
+#include <vector>
+
+//======================================================================
+
+namespace UPL {
+	namespace VM {
+
+//======================================================================
+//  Runs the PMap and PReduce instructions on a ThreadPool: each element
+// of a Vector (or Array) is handed to a function on whichever worker
+// gets to it, and the results are written straight into place. Each
+// worker has an interpreter of its own, over a heap of its own, so the
+// function may allocate all it likes; but what goes in and what comes
+// out must be scalars (bools, bytes, chars, ints and reals), as nothing
+// on one heap may point into another.
+//
+//  The function must be pure (see FindPureFunctions, in ir_passes.hpp;
+// only the instructions the compiler marked as such come here), and for
+// PReduce, associative: each piece of the vector is folded on
+// its own, from its first element, and the results of the pieces are
+// folded onto the initial value, in order, at the end. If the function
+// fails for any element, the rest are abandoned, and the error is that
+// of whichever failure came first in time, not in element order.
+//======================================================================
+
+class Parallel
+{
+public:
+	// Of each worker's interpreter; smaller than the usual.
+	static size_t const msc_WorkerRegisters = 1 << 18;
+	static size_t const msc_WorkerFrames = 1 << 14;
+
+	// A small nursery and (address space for) a modest old generation.
+	static HeapConfig WorkerHeapConfig ();
+
+	// Whether elements (or results) of this type can go between heaps.
+	static bool IsScalar (Type::STContainer const & types, Type::ID type);
+
+public:
+	// Note: Parallel does NOT own the module. "threads" counts the thread
+	// that runs the instructions; 0 is one per hardware thread.
+	explicit Parallel (Module const & module, unsigned threads = 0, HeapConfig const & worker_heap = WorkerHeapConfig());
+	~Parallel ();
+
+	Parallel (Parallel const &) = delete;
+	Parallel & operator = (Parallel const &) = delete;
+
+	unsigned workerCount () const {return m_pool.workerCount();}
+
+	// Whether "f", taking "arity" arguments of which the last is of type
+	// "element", can run here; its other arguments and result must be
+	// scalars too. The instructions do it in place when it can't.
+	bool accepts (Function const * f, unsigned arity, Type::ID element) const;
+
+	// out[i] = f(in[i]), for all of in; "out" must be a new vector (or
+	// array) of as many scalar elements. The elements done are added to
+	// "out_elements".
+	RunError map (Heap & heap, Function const * f, Object * in, Object * out, uint64_t & out_elements);
+	// f(...f(f(init, in[0]), in[1])..., in[n - 1]), for associative "f".
+	RunError reduce (Heap & heap, Function const * f, Reg init, Object * in, Reg & out_result, uint64_t & out_elements);
+
+	// The workers read the module's globals from "globals" (which isn't
+	// owned), as the interpreter running the instructions does; those
+	// holding heap references they can't read (see globals.hpp), so the
+	// compiler doesn't run the functions that do here. Only to be changed
+	// between instructions.
+	void setGlobals (Globals * globals);
+
+	// Only meaningful between instructions.
+	ThreadPoolStats poolStats () const {return m_pool.stats();}
+	void resetStats () {m_pool.resetStats ();}
+
+private:
+	struct Worker
+	{
+		Error::Reporter reporter;		// Collects what the interpreter reports; only the RunError is passed on
+		std::unique_ptr<Heap> heap;
+		std::unique_ptr<Interpreter> interpreter;
+		std::vector<std::pair<size_t, Reg>> partials;	// Of PReduce: where each piece begins, and what it folded to
+	};
+
+	size_t grainFor (size_t n) const;
+	void fail (RunError err);
+
+private:
+	Module const & m_module;
+	ThreadPool m_pool;
+	std::vector<std::unique_ptr<Worker>> m_workers;
+	std::atomic<int> m_error;		// The first RunError of the current instruction
+};
+
+//======================================================================
+
+	}	// namespace VM
+}	// namespace UPL
+
+//======================================================================
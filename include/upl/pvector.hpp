@@ -0,0 +1,113 @@
+#pragma once
+
+//======================================================================
+
+#include <upl/common.hpp>
+#include <upl/heap.hpp>
+#include <upl/value.hpp>
+
+#include <vector>
+
+//======================================================================
+
+namespace UPL {
+	namespace VM {
+
+//======================================================================
+//  Persistent vectors: "changing" one makes a new version and leaves the
+// old one as it was. Each is a 32-way trie of leaves plus a tail (as in
+// Clojure), reached through a head (see VectorNode):
+//
+//  - The leaves are ordinary Vector objects, of the vector's own type,
+//    with room for 32 elements; so ints, reals and bytes are packed
+//    arrays of them, not boxed Values, and chunk() hands them out a leaf
+//    at a time for bulk (and vectorized) loops.
+//  - The last (up to) 32 elements are in the tail, outside the trie, so
+//    push() mostly copies just the tail, and only every 32nd one adds a
+//    leaf to the trie. set() copies the path to the element: at most
+//    seven nodes and the leaf.
+//  - slice() shares the trie too: the head keeps where the slice starts,
+//    and everything past its end is cut off (a new path down to its last
+//    leaf, which becomes the tail.) What's before its start is kept
+//    alive, but never seen again.
+//
+//  The elements must be scalars or references, as for the VM's vectors;
+// they're passed in and out as their bytes, in the layout of the Vector
+// type's elements.
+//
+//  Transients: between beginEdit() and endEdit(), push() and set() given
+// that edit change the heads, nodes and leaves made during it in place,
+// exactly as Hamt's do. (So a version in the middle of an edit mustn't
+// be sliced, unless the edit is done with it.)
+//======================================================================
+
+class PVector
+{
+public:
+	typedef uint32_t Edit;					// 0 is none
+
+	static int const msc_Bits = 5;
+	static uint32_t const msc_Width = 1U << msc_Bits;
+
+public:
+	// Note: the PVector does NOT own the heap.
+	explicit PVector (Heap & heap);
+
+	// These may collect garbage (see Heap::allocate), and return nullptr
+	// if the heap is exhausted (or the index is out of range.)
+	Object * newVector (Type::ID type);		// Empty; nullptr if "type" isn't a Vector type, of scalars or references
+	Object * push (Object * vector, void const * element, Edit edit = 0);
+	Object * set (Object * vector, uint32_t index, void const * element, Edit edit = 0);
+	Object * slice (Object * vector, uint32_t from, uint32_t to);	// [from, to)
+
+	uint32_t size (Object const * vector) const;
+	Type::ID type (Object const * vector) const {return static_cast<VectorNode const *>(vector)->leaf_type;}
+	Type::Size stride (Object const * vector);
+
+	// Where element "index" is; nullptr if it's out of range.
+	uint8_t const * at (Object const * vector, uint32_t index);
+	// The same, and how many elements (at least one) follow it
+	// contiguously, itself included.
+	uint8_t const * chunk (Object const * vector, uint32_t index, uint32_t & out_count);
+
+	Edit beginEdit ();
+	void endEdit (Edit edit);
+
+private:
+	struct Leaf
+	{
+		bool valid = false;
+		bool is_ref = false;
+		Type::Size offset = 0;
+		Type::Size stride = 0;
+	};
+
+	Leaf const & leafInfo (Type::ID type);
+	size_t bytesToChange (Leaf const & leaf) const;
+	bool reserve (size_t bytes, Value * values, int count);
+
+	VectorNode * newNode (uint32_t count, Edit edit);
+	VectorNode * editable (VectorNode * node, Edit edit);
+	Object * newLeaf (Type::ID type, Object const * from, Leaf const & leaf);
+	Object * leafOf (VectorNode const * head, uint32_t j) const;
+	void put (VectorNode * node, uint32_t index, Object * child, bool owned, Edit edit);
+	void write (Object * leaf, uint32_t index, void const * element, Leaf const & leaf_info);
+
+	VectorNode * pushTail (uint32_t size, int level, VectorNode * node, Object * tail, bool tail_owned, Edit edit);
+	Object * newPath (int level, Object * tail, bool tail_owned, Edit edit);
+	VectorNode * setIn (int level, VectorNode * node, uint32_t j, void const * element, Leaf const & leaf, Type::ID type, Edit edit);
+	VectorNode * trim (int level, VectorNode const * node, uint32_t last);
+
+private:
+	Heap & m_heap;
+	std::vector<Leaf> m_leaves;				// By Vector type
+	std::vector<Edit> m_open_edits;
+	Edit m_next_edit;
+};
+
+//======================================================================
+
+	}	// namespace VM
+}	// namespace UPL
+
+//======================================================================
@@ -0,0 +1,127 @@
+#pragma once
+
+//======================================================================
+
+#include <upl/common.hpp>
+#include <upl/heap.hpp>
+#include <upl/value.hpp>
+
+#include <deque>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+//======================================================================
+
+namespace UPL {
+	namespace VM {
+
+//======================================================================
+//  Strings, as the VM has them, are UTF-8 and come in three forms, all
+// immutable and interchangeable:
+//
+//  - Up to 5 bytes, inline in the Value (see Value::TryFromSmallString.)
+//  - A flat String object, of the bytes.
+//  - A rope: a RopeNode that's the concatenation of two strings. The
+//    tree is kept balanced (AVL, by height), so concatenating is
+//    O(log n) and only makes new nodes along one edge of each side,
+//    sharing the rest. Each node knows the bytes and the code points
+//    below it, so finding the n-th code point is a walk down to a leaf
+//    and a scan of (at most msc_LeafMax bytes of) it.
+//
+// Concatenations of flat strings that are short in all (msc_FlatMax)
+// are copied into a new flat one instead, so that building a string a
+// little at a time doesn't end up as a tree of tiny leaves; and long
+// strings are made (by fromUTF8()) as trees of leaves of msc_LeafMax.
+//
+//  intern() hands out the same String for the same bytes, and keeps it
+// alive for as long as the Ropes do.
+//======================================================================
+
+class Ropes
+	: public RootSource
+{
+public:
+	static size_t const msc_FlatMax = 128;
+	static size_t const msc_LeafMax = 512;
+
+public:
+	// Note: the Ropes do NOT own the heap.
+	explicit Ropes (Heap & heap);
+	~Ropes ();
+
+	Ropes (Ropes const &) = delete;
+	Ropes & operator = (Ropes const &) = delete;
+
+	// These may collect garbage (see Heap::allocate), and return nil if
+	// the heap is exhausted.
+	Value fromUTF8 (char const * utf8, size_t size);
+	Value intern (char const * utf8, size_t size);
+	Value concat (Value a, Value b);
+
+	// For any string, in any of its forms
+	uint64_t bytes (Value s) const;
+	uint64_t length (Value s) const;		// In code points
+	int height (Value s) const;
+	bool charAt (Value s, uint64_t index, Char & out_char) const;	// False if out of range
+	std::string toUTF8 (Value s) const;
+
+	// Calls f(char const * utf8, size_t size) for each flat piece, in
+	// order. f mustn't allocate.
+	template <typename F> void forEachPiece (Value s, F && f) const;
+
+	void visitRoots (RootVisitor & visitor) override;
+
+private:
+	bool isRope (Value s) const {return s.isObject() && s.asObject()->type == Heap::msc_RopeNodeType;}
+	char const * flatBytes (Value s, char * buffer, size_t & out_size) const;
+	uint64_t flatChars (Value s) const;
+
+	Value flat (Value a, Value b);
+	Value node (Value left, Value right);
+	Value merge (Value left, Value right);
+	Value join (Value left, Value right);
+	Value joinRight (Value left, Value right);
+	Value joinLeft (Value left, Value right);
+	Value rotateLeft (Value s);
+	Value rotateRight (Value s);
+
+private:
+	Heap & m_heap;
+	std::deque<Value> m_interned;			// deque, so they stay where they are for the roots
+	std::unordered_map<std::string, size_t> m_intern_index;
+	std::vector<Value> m_scratch;			// Pieces being put together, also roots
+};
+
+//======================================================================
+
+template <typename F>
+void Ropes::forEachPiece (Value s, F && f) const
+{
+	char buffer [Value::msc_SmallStringMax];
+	std::vector<Value> pending (1, s);
+	while (!pending.empty())
+	{
+		auto const v = pending.back();
+		pending.pop_back ();
+		if (isRope(v))
+		{
+			auto const halves = static_cast<RopeNode const *>(v.asObject())->halves();
+			pending.push_back (halves[1]);
+			pending.push_back (halves[0]);
+			continue;
+		}
+
+		size_t size;
+		auto const p = flatBytes(v, buffer, size);
+		if (size > 0)
+			f (p, size);
+	}
+}
+
+//======================================================================
+
+	}	// namespace VM
+}	// namespace UPL
+
+//======================================================================
@@ -0,0 +1,338 @@
+#pragma once
+
+//======================================================================
+
+#include <upl/common.hpp>
+#include <upl/errors.hpp>
+#include <upl/globals.hpp>
+#include <upl/heap.hpp>
+#include <upl/st_code.hpp>
+#include <upl/vm.hpp>
+
+#include <cstddef>
+#include <memory>
+#include <string>
+
+//======================================================================
+
+namespace UPL {
+
+//======================================================================
+//  The embedding API: what a C++ program needs to run a module, in one
+// place. A Runtime loads a module (or takes one built in memory) and owns
+// the heap, the interpreter and the module's globals (forced lazily, see
+// globals.hpp) that run it.
+//
+//  Host types stand for the module's types through HostType: Bool, uint8_t
+// (byte), Char, Int (and int), Real, void (nil), StringRef and VectorRef.
+// A function is looked up once, by its name and C++ signature, into a
+// Function, whose calls put their arguments straight into registers, the
+// way the interpreter holds each type: nothing is boxed, and nothing is
+// looked up or checked again per call.
+//
+//  Strings and vectors go both ways as references (rooted for as long as
+// the Ref lives), and their contents are seen in place, through Views;
+// nothing is copied either way. The heap owns that memory, not the host:
+// a vector's elements are inline in its object, so a host array can't
+// become a vector without a copy; instead, the host fills a vector the
+// runtime made (newVector) in place. A view is good until the next
+// garbage collection, which may move the object, or for as long as the
+// object lives if it's pinned (see Heap::allocate), as newVector's are
+// unless asked otherwise.
+//
+//  A runtime (and everything from it) is for one thread at a time. Refs
+// and Functions mustn't outlive their runtime.
+//======================================================================
+
+class Runtime;
+
+//----------------------------------------------------------------------
+// Some elements in place (a pointer and a count), borrowed from whatever
+// holds them.
+
+template <typename T>
+class View
+{
+public:
+	View () : m_data (nullptr), m_size (0) {}
+	View (T * data, size_t size) : m_data (data), m_size (size) {}
+
+	T * data () const {return m_data;}
+	size_t size () const {return m_size;}
+	bool empty () const {return 0 == m_size;}
+	T * begin () const {return m_data;}
+	T * end () const {return m_data + m_size;}
+	T & operator [] (size_t index) const {return m_data[index];}
+
+private:
+	T * m_data;
+	size_t m_size;
+};
+
+//----------------------------------------------------------------------
+// A Value the heap keeps alive (and up to date, as it moves) for as long
+// as the Ref is around; or none.
+
+class Ref
+{
+public:
+	Ref () : m_heap (nullptr), m_value () {}
+	Ref (VM::Heap & heap, VM::Value value);
+	Ref (Ref const & that);
+	Ref & operator = (Ref const & that);
+	~Ref ();
+
+	bool valid () const {return nullptr != m_heap && !m_value.isNil();}
+	VM::Value value () const {return m_value;}
+
+protected:
+	VM::Heap * m_heap;
+	VM::Value m_value;
+};
+
+//----------------------------------------------------------------------
+
+class StringRef
+	: public Ref
+{
+public:
+	StringRef () {}
+	StringRef (VM::Heap & heap, VM::Value value) : Ref (heap, value) {}
+
+	// The UTF-8 bytes. In place if the string is a String object; else (if
+	// it's short enough to be inline in the Value, or a rope) put together
+	// in "scratch".
+	View<char const> bytes (std::string & scratch) const;
+};
+
+//----------------------------------------------------------------------
+
+template <typename T>
+class VectorRef
+	: public Ref
+{
+public:
+	VectorRef () {}
+	VectorRef (VM::Heap & heap, VM::Value value) : Ref (heap, value) {}
+
+	// The elements, in place; none if it isn't a vector of T's. See the
+	// top of this file for how long they stay where they are.
+	inline View<T> elements () const;
+};
+
+//======================================================================
+// What each host type is in the module's types, and how it goes into and
+// out of a register. "msc_Tag" is for those that can be elements of a
+// VectorRef.
+
+template <typename T> struct HostType;		// Only these:
+
+#define UPL_PRIVATE__HOST_SCALAR(T, tag, to_reg, from_reg)										\
+	template <> struct HostType<T>																\
+	{																							\
+		static Type::Tag const msc_Tag = Type::Tag::tag;										\
+		static Type::ID Get (Type::STContainer &) {return Type::STContainer::DefaultID(msc_Tag);}	\
+		static VM::Reg ToReg (T v) {return to_reg;}												\
+		static T FromReg (VM::Heap &, VM::Reg r) {return from_reg;}								\
+	};
+
+UPL_PRIVATE__HOST_SCALAR (Bool   , Bool, VM::Reg::FromBool(v)   , 0 != r.i)
+UPL_PRIVATE__HOST_SCALAR (uint8_t, Byte, VM::Reg::FromInt(v)    , uint8_t(r.i))
+UPL_PRIVATE__HOST_SCALAR (Char   , Char, VM::Reg::FromInt(Int(v)), Char(r.i))
+UPL_PRIVATE__HOST_SCALAR (Int    , Int , VM::Reg::FromInt(v)    , r.i)
+UPL_PRIVATE__HOST_SCALAR (int    , Int , VM::Reg::FromInt(v)    , int(r.i))
+UPL_PRIVATE__HOST_SCALAR (Real   , Real, VM::Reg::FromReal(v)   , r.r)
+
+#undef UPL_PRIVATE__HOST_SCALAR
+
+template <> struct HostType<void>
+{
+	static Type::ID Get (Type::STContainer &) {return Type::STContainer::DefaultID(Type::Tag::Nil);}
+};
+
+template <> struct HostType<StringRef>
+{
+	static Type::ID Get (Type::STContainer &) {return Type::STContainer::DefaultID(Type::Tag::String);}
+	static VM::Reg ToReg (StringRef const & v) {return VM::Reg::FromValue(v.value());}
+	static StringRef FromReg (VM::Heap & heap, VM::Reg r) {return StringRef(heap, r.value());}
+};
+
+template <typename T> struct HostType<VectorRef<T>>
+{
+	static Type::ID Get (Type::STContainer & types)
+	{
+		return types.createType(Type::Unpacked(Type::Tag::Vector, false, HostType<T>::Get(types)));
+	}
+	static VM::Reg ToReg (VectorRef<T> const & v) {return VM::Reg::FromValue(v.value());}
+	static VectorRef<T> FromReg (VM::Heap & heap, VM::Reg r) {return VectorRef<T>(heap, r.value());}
+};
+
+// The function type of a C++ signature
+template <typename Signature> struct HostSignature;
+
+template <typename R, typename... Args> struct HostSignature<R (Args...)>
+{
+	static Type::ID Get (Type::STContainer & types)
+	{
+		return types.createType(Type::Unpacked(Type::Tag::Function, false, HostType<R>::Get(types), {HostType<Args>::Get(types)...}));
+	}
+};
+
+//======================================================================
+// A function of the runtime's module, of a known signature (see
+// Runtime::function.) A call returns false on a run-time error, which
+// has been reported (see Runtime::lastError); a reference result is
+// rooted before anything else can run.
+
+template <typename Signature> class Function;
+
+template <typename R, typename... Args>
+class Function<R (Args...)>
+{
+public:
+	Function () : m_vm (nullptr), m_index (0) {}
+
+	bool valid () const {return nullptr != m_vm;}
+	uint32_t index () const {return m_index;}
+
+	bool operator () (Args const &... args, R & out_result) const
+	{
+		VM::Reg const regs [sizeof...(Args) + 1] = {HostType<Args>::ToReg(args)..., VM::Reg::Nil()};
+		VM::Reg result;
+		if (!m_vm->call(m_index, regs, int(sizeof...(Args)), result))
+			return false;
+		out_result = HostType<R>::FromReg(m_vm->heap(), result);
+		return true;
+	}
+
+private:
+	friend class Runtime;
+	Function (VM::Interpreter * vm, uint32_t index) : m_vm (vm), m_index (index) {}
+
+	VM::Interpreter * m_vm;
+	uint32_t m_index;
+};
+
+template <typename... Args>
+class Function<void (Args...)>
+{
+public:
+	Function () : m_vm (nullptr), m_index (0) {}
+
+	bool valid () const {return nullptr != m_vm;}
+	uint32_t index () const {return m_index;}
+
+	bool operator () (Args const &... args) const
+	{
+		VM::Reg const regs [sizeof...(Args) + 1] = {HostType<Args>::ToReg(args)..., VM::Reg::Nil()};
+		VM::Reg result;
+		return m_vm->call(m_index, regs, int(sizeof...(Args)), result);
+	}
+
+private:
+	friend class Runtime;
+	Function (VM::Interpreter * vm, uint32_t index) : m_vm (vm), m_index (index) {}
+
+	VM::Interpreter * m_vm;
+	uint32_t m_index;
+};
+
+//======================================================================
+
+class Runtime
+{
+public:
+	explicit Runtime (VM::HeapConfig const & heap_config = VM::HeapConfig());
+	~Runtime ();
+
+	Runtime (Runtime const &) = delete;
+	Runtime & operator = (Runtime const &) = delete;
+
+	// The module to run: from a file (mapped; see LoadModule), or built in
+	// memory. Only one, once; false, saying why, if it can't be used.
+	// "verify_code" turns away a damaged file, not a malicious one: the
+	// file must be trusted either way (see VerifyCode.)
+	bool load (char const * path, std::string & out_error, bool verify_code = true);
+	bool adopt (std::unique_ptr<VM::Module> module, std::string & out_error);
+	bool loaded () const {return nullptr != m_vm;}
+
+	// Only once loaded.
+	VM::Module & module () {return *m_module;}
+	VM::Heap & heap () {return *m_heap;}
+	VM::Interpreter & interpreter () {return *m_vm;}	// To set a Jit, a Memo, ... on
+	VM::Globals * globals () {return m_globals.get();}	// nullptr if the module has none
+	Error::Reporter & reporter () {return m_reporter;}
+
+	// Function "name", if it has "Signature" (exactly; an int parameter
+	// is an Int, and so on); false, saying why, if not.
+	template <typename Signature>
+	bool function (char const * name, Function<Signature> & out_function, std::string & out_error);
+
+	// Of the last call of any of the Functions
+	VM::RunError lastError () const {return m_vm->lastError();}
+
+	// New values. These may collect garbage, and are invalid if the heap
+	// is exhausted. A string is copied in (into a String object unless
+	// it's short enough to be inline); a vector is zeroed, and pinned
+	// unless asked otherwise, for the host to fill in place.
+	StringRef newString (char const * utf8, size_t size);
+	template <typename T>
+	VectorRef<T> newVector (uint32_t count, bool pinned = true);
+
+private:
+	void start ();
+	bool checkFunction (char const * name, Type::ID type, uint32_t & out_index, std::string & out_error) const;
+
+private:
+	VM::HeapConfig const m_heap_config;
+	std::unique_ptr<VM::Module> m_module;
+	Error::Reporter m_reporter;
+	std::unique_ptr<VM::Heap> m_heap;
+	std::unique_ptr<VM::Globals> m_globals;
+	std::unique_ptr<VM::Interpreter> m_vm;
+};
+
+//======================================================================
+
+template <typename T>
+inline View<T> VectorRef<T>::elements () const
+{
+	if (!m_value.isObject())
+		return View<T>();
+	uint8_t * first;
+	Type::ID element;
+	Type::Size stride;
+	uint32_t count;
+	if (!m_heap->packedElements(m_value.asObject(), first, element, stride, count) ||
+			m_heap->types().tag(element) != HostType<T>::msc_Tag || stride != sizeof(T))
+		return View<T>();
+	return View<T>(reinterpret_cast<T *>(first), count);
+}
+
+//----------------------------------------------------------------------
+
+template <typename Signature>
+bool Runtime::function (char const * name, Function<Signature> & out_function, std::string & out_error)
+{
+	uint32_t index;
+	if (!loaded() || !checkFunction(name, HostSignature<Signature>::Get(m_module->types()), index, out_error))
+		return false;
+	out_function = Function<Signature>(m_vm.get(), index);
+	return true;
+}
+
+//----------------------------------------------------------------------
+
+template <typename T>
+VectorRef<T> Runtime::newVector (uint32_t count, bool pinned)
+{
+	auto const type = HostType<VectorRef<T>>::Get(m_module->types());
+	auto const obj = m_heap->allocate(type, count, pinned);
+	return (nullptr != obj) ? VectorRef<T>(*m_heap, VM::Value::FromObject(obj)) : VectorRef<T>();
+}
+
+//======================================================================
+
+}	// namespace UPL
+
+//======================================================================
@@ -0,0 +1,259 @@
+#pragma once
+
+//======================================================================
+
+#include <upl/common.hpp>
+#include <upl/errors.hpp>
+#include <upl/fiber.hpp>
+#include <upl/heap.hpp>
+#include <upl/vm.hpp>
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+//======================================================================
+
+namespace UPL {
+	namespace VM {
+
+//======================================================================
+//  I/O for scripts: what the Io instruction does (operation C, on the B
+// operands after R[A], the result going into R[A].) Descriptors are
+// plain ints, and buffers are vectors (or arrays) of bytes. A system call
+// that fails gives minus its errno as the result; run-time errors are
+// only for bad operands.
+//
+//  In a green thread (see Scheduler), an operation that would block
+// suspends the green thread instead, until its descriptor is ready or
+// its time is up, and its OS thread runs other green threads meanwhile.
+// Anywhere else, it blocks, as the system call would; Yield does nothing
+// there, and Spawn fails with -ENOSYS. A descriptor should only be read
+// (or written) by one green thread at a time.
+//======================================================================
+
+enum class IoOp : uint8_t
+{
+	Yield,		// ()						-> 0, once the others have had a turn
+	Sleep,		// (int ms)					-> 0
+	Read,		// (int fd, bytes b, int n)	-> bytes read into b[0...n), at least one, or 0 at the end
+	Write,		// (int fd, bytes b, int n)	-> n, once all of b[0...n) is written
+	Accept,		// (int fd)					-> the descriptor of a new connection
+	Close,		// (int fd)					-> 0
+	Spawn,		// (function f, int x)		-> the task running f(x), in a new green thread
+};
+
+int const IoOpCount = 7;
+
+bool IsValidIo (uint8_t code);
+char const * IoName (uint8_t code);		// e.g. "read"
+int IoOperands (uint8_t code);
+
+// What the Io instruction does: operation "code" on the "count"
+// registers after "args", into args[0], for "interpreter", which runs
+// green thread "task" if any (see Interpreter::setTask.) May suspend the
+// green thread, and collect garbage while it's suspended.
+RunError RunIo (Interpreter & interpreter, Task * task, uint8_t code, unsigned count, Reg * args);
+
+// What green thread "task" (if any) forces and waits for globals as (see
+// globals.hpp); none without fibers, as nothing can be suspended then.
+GlobalsWaiter * GlobalsWaiterOf (Task * task);
+
+//======================================================================
+//  Green threads ("tasks"): many more threads of execution than there are
+// OS threads, each running a function of the module, scheduled M:N on a
+// pool of OS threads (the workers). Each task runs on a fiber of its own
+// (see fiber.hpp) with an interpreter of its own, so it can be suspended
+// anywhere, however deep in calls, when it waits for I/O or a timer, or
+// yields; switching tasks costs about as much as a couple of calls.
+//
+//  Each worker has a heap of its own, and runs an event loop (epoll): the
+// tasks waiting on a descriptor or a timer are resumed once it's ready,
+// in the order they became ready, along with those that yielded. Tasks
+// spawned meanwhile start once those are done, or every so often anyway
+// (so that tasks that keep yielding can't hold them off for ever); this
+// keeps as few tasks started as can be, and their stacks in the cache.
+// When a worker has nothing to run, it steals a task that hasn't started
+// yet from another worker; and failing that, waits for events. Started tasks stay on their worker,
+// as their values live on its heap; and so, as with Parallel, what tasks
+// take and return must be scalars (or nil, for what they return.)
+//
+//  Each started task takes memory for its stack and registers (pooled,
+// for the next ones), so no more than max_started are started on any one
+// worker at a time; the rest wait to be started, there or elsewhere. (So
+// if that many tasks wait on what only tasks yet to start would do,
+// they wait for ever.)
+//
+//  Without fibers (UPL_FIBERS_AVAILABLE), run() runs the tasks one after
+// the other, to completion, on the calling thread, and their I/O blocks.
+//======================================================================
+
+struct SchedulerConfig
+{
+	size_t stack_size = Fiber::msc_DefaultStackSize;	// Of each task's fiber
+	size_t task_registers = 1 << 12;					// Of each task's interpreter
+	size_t task_frames = 1 << 10;
+	uint32_t max_started = 4096;						// On each worker, at a time
+	HeapConfig worker_heap = HeapConfig();
+};
+
+struct SchedulerStats
+{
+	uint64_t spawned = 0;
+	uint64_t finished = 0;
+	uint64_t failed = 0;		// Of those finished, with a run-time error
+	uint64_t switches = 0;		// Into tasks
+	uint64_t steals = 0;
+	uint64_t yields = 0;
+	uint64_t io_waits = 0;		// For a descriptor to be ready
+	uint64_t sleeps = 0;
+	uint64_t global_waits = 0;	// For another to force a global
+	uint64_t polls = 0;			// Of the event loops
+	uint64_t contexts = 0;		// Fibers (and interpreters) made, for all the tasks
+	uint64_t max_started = 0;	// At once, on one worker
+};
+
+//----------------------------------------------------------------------
+
+class Scheduler
+{
+public:
+	// Note: Scheduler does NOT own the module. "threads" counts the thread
+	// that calls run(); 0 is one per hardware thread.
+	explicit Scheduler (Module const & module, unsigned threads = 0, SchedulerConfig const & config = SchedulerConfig());
+	~Scheduler ();
+
+	Scheduler (Scheduler const &) = delete;
+	Scheduler & operator = (Scheduler const &) = delete;
+
+	unsigned workerCount () const {return unsigned(m_workers.size());}
+	Heap & workerHeap (unsigned worker) {return *m_workers[worker]->heap;}
+	SchedulerConfig const & config () const {return m_config;}
+
+	// Whether function "function" can run as a task: it takes "arg_count"
+	// scalars and returns a scalar or nil.
+	bool accepts (uint32_t function, int arg_count) const;
+
+	// A new task, to run function(args...) once run() is called; false if
+	// the function can't (see accepts.) Not while run() is running; the
+	// tasks themselves spawn with IoOp::Spawn.
+	bool spawn (uint32_t function, Reg const * args, int arg_count, uint32_t * out_task = nullptr);
+
+	// Runs all the tasks, and those they spawn, to completion, on this
+	// thread and the other workers. Not reentrant.
+	void run ();
+
+	// Of the tasks spawned so far (by the host or the tasks), which are
+	// numbered in the order they were spawned. A task's result is there
+	// once it has finished; false if it hasn't, or failed ("out_error"
+	// says why; what went wrong isn't reported anywhere else.)
+	uint32_t taskCount () const;
+	bool taskResult (uint32_t task, Reg & out_result, RunError & out_error) const;
+
+	// The tasks read the module's globals from "globals" (which isn't
+	// owned); only those that aren't heap references (see globals.hpp.)
+	// A task waiting for another (task or thread) to force a global is
+	// suspended meanwhile. Only to be changed between runs.
+	void setGlobals (Globals * globals) {m_globals = globals;}
+
+	// Only meaningful between runs.
+	SchedulerStats stats () const;
+	void resetStats ();
+
+private:
+	friend class Task;
+	friend RunError RunIo (Interpreter & interpreter, Task * task, uint8_t code, unsigned count, Reg * args);
+
+	// What a started task runs on
+	struct Context
+	{
+		std::unique_ptr<Fiber> fiber;
+		std::unique_ptr<Interpreter> interpreter;
+	};
+
+	struct Timer
+	{
+		uint64_t deadline;		// In steady_clock nanoseconds
+		Task * task;
+
+		bool operator > (Timer const & that) const {return deadline > that.deadline;}
+	};
+
+	struct Worker
+	{
+		unsigned index = 0;				// Of m_workers
+		Error::Reporter reporter;		// Collects what the interpreters report; only the RunErrors are kept
+		std::unique_ptr<Heap> heap;
+		std::vector<std::unique_ptr<Context>> contexts;
+		std::vector<Context *> idle;	// Of the contexts, those no task is on
+		std::thread thread;
+
+		std::mutex mutex;				// Guards "fresh" and "woken"
+		std::deque<Task *> fresh;		// Not started; other workers may take these
+		std::deque<Task *> woken;		// To be made ready, by any thread (see wakeFromGlobal)
+		std::atomic<bool> any_woken;
+		std::deque<Task *> ready;		// Started, and to be resumed; only this worker's
+		std::vector<Timer> timers;		// A heap, soonest on top
+		uint32_t started = 0;			// And not finished
+
+		int epoll = -1;
+		int wake = -1;					// An eventfd, to get it out of epoll_wait
+		std::atomic<bool> sleeping;
+		uint32_t since_poll = 0;		// Tasks resumed
+		uint32_t picks = 0;				// Tasks picked to run
+
+		SchedulerStats stats;			// Its part of them
+	};
+
+	static void TaskMain (void * task);
+
+	Task * spawnOn (Worker & w, uint32_t function, Reg const * args, int arg_count);
+	void workerMain (unsigned index);
+	void work (Worker & w);
+	Task * next (Worker & w);
+	void resume (Worker & w, Task * task);
+	void finish (Worker & w, Task * task);
+	void makeReady (Worker & w, Task * task);
+	void poll (Worker & w, int timeout_ms);
+	void wakeOne ();
+	void wakeAll ();
+
+	// From the tasks, on their own fibers: each returns once the task
+	// has been resumed.
+	void yield (Task * task);
+	void sleep (Task * task, Int ms);
+	int waitFor (Task * task, int fd, bool out);	// 0, or minus the errno of adding it to the event loop
+	void waitForGlobal (Task * task);
+
+	// From any thread: "task" is to be resumed (by its own worker.)
+	void wakeFromGlobal (Task * task);
+
+private:
+	Module const & m_module;
+	SchedulerConfig const m_config;
+	std::vector<std::unique_ptr<Worker>> m_workers;
+	Globals * m_globals;
+
+	mutable std::mutex m_tasks_mutex;	// Guards m_tasks (but not what's in the tasks)
+	std::vector<std::unique_ptr<Task>> m_tasks;
+	std::atomic<uint64_t> m_live;		// Tasks not finished
+	std::atomic<uint64_t> m_fresh;		// Of those, not started
+
+	// Parking the workers between runs, as ThreadPool does
+	std::mutex m_mutex;
+	std::condition_variable m_start;
+	uint64_t m_generation;
+	bool m_stopping;
+	std::atomic<unsigned> m_busy;
+};
+
+//======================================================================
+
+	}	// namespace VM
+}	// namespace UPL
+
+//======================================================================
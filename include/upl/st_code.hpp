@@ -22,8 +22,12 @@ namespace std {
 	{
 		inline size_t operator()(const basic_string<uint8_t> & us) const
 		{
-			hash<char *> cstring_hash;
-			return cstring_hash((char *) us.c_str());
+			// FNV-1a over the contents. (Packed ST-codes can contain zero
+			// bytes, and hash<char *> would only hash the pointer anyway.)
+			size_t ret = 2166136261U;
+			for (auto b : us)
+				ret = (ret ^ b) * 16777619U;
+			return ret;
 		}
 	};
 }
@@ -163,14 +167,52 @@ private:
 	static inline uint8_t Qrtt (uint8_t const * packed_mem, unsigned quartet);	// Zero is the high-order 4 bits
 };
 
-//----------------------------------------------------------------------
+//======================================================================
+// Builds packed ST-codes directly, quartet by quartet, into a scratch
+// buffer that is reused between types. This skips the STIR string (and
+// the Pack step) entirely; once the buffer has grown to the size of the
+// largest type built, building a type doesn't allocate anything.
+
+class STBuilder
+{
+public:
+	STBuilder () : m_buf (), m_half (false) {m_buf.reserve (32);}
+
+	// Low-level interface: begin(), then any number of addInt()s, then finish().
+	inline void begin (Tag tag, bool is_const);
+	inline void addInt (uint32_t v);
+	inline PackedST const & finish ();
+
+	PackedST const & packed () const {return m_buf;}
+
+	inline PackedST const & makeBasic (bool is_const, Tag tag);
+	PackedST const & makeVariant (bool is_const, std::vector<ID> const & allowed_types);	// Sorts and removes duplicates, like STCode::MakeVariant
+	inline PackedST const & makeArray (bool is_const, Size size, ID type);
+	inline PackedST const & makeVector (bool is_const, ID type);
+	inline PackedST const & makeMap (bool is_const, ID key_type, ID value_type);
+	inline PackedST const & makeTuple (bool is_const, std::vector<ID> const & field_types);
+	inline PackedST const & makePackage (bool is_const, std::vector<ID> const & field_types);
+	inline PackedST const & makeFunction (bool is_const, ID return_type, std::vector<ID> const & param_types);
+
+	PackedST const & build (Unpacked const & unpacked);
+
+private:
+	inline void addQuartet (uint8_t q);
+	inline void addIntList (std::vector<ID> const & ids);
+
+private:
+	PackedST m_buf;
+	bool m_half;				// Is the low quartet of the last byte still empty?
+	std::vector<ID> m_scratch;	// For sorting variant type lists
+};
+
 //======================================================================
 
 class STContainer
 {
 private:
 	struct Entry { uint8_t bytes [4]; };
-	typedef std::unordered_map<PackedST, ID> TypeLookup;
+	struct Key { uint32_t hash; uint32_t size; };	// Of a type's packed code
 
 public:
 	STContainer ();
@@ -181,9 +223,21 @@ public:
 	ID createType (PackedST const & packed_st);
 	ID createType (Unpacked const & unpacked);
 
+	// Batch creation; reserves room for all the new types (in the type
+	// table and the lookup) up front and builds each one in a reused
+	// scratch buffer, so the only allocation left is the stash growing
+	// for types too long to be inline. "out_ids" must have room for
+	// "count" IDs.
+	void createTypes (Unpacked const * unpackeds, size_t count, ID * out_ids);
+	std::vector<ID> createTypes (std::vector<Unpacked> const & unpackeds);
+
 	ID lookupType (PackedST const & packed_st) const;
 	ID byTag (Tag tag) const;
 
+	// The IDs of the basic types every container starts with (see the
+	// constructor.) InvalidID for tags that aren't basic.
+	static inline ID DefaultID (Tag tag, bool is_const = false);
+
 	inline bool isValid (ID id) const;
 	inline Tag tag (ID id) const;
 	inline bool isConst (ID id) const;
@@ -216,10 +270,20 @@ private:
 	ID getSecondType (ID id) const;					// For Map (value)
 	Size getSize (ID id) const;						// For Array
 
+	// The lookup is open-addressed (linear probing, at most half full) and
+	// holds only IDs; a type's packed code is compared where it's kept (in
+	// its entry or the stash), so there's no copy of it to allocate.
+	static uint32_t HashOf (PackedST const & packed_st);
+	bool isCode (ID id, PackedST const & packed_st, uint32_t hash) const;
+	size_t findSlot (PackedST const & packed_st, uint32_t hash) const;	// Its slot, or the empty one it'd go in
+	void reserveLookup (size_t count);
+
 private:
 	std::vector<Entry> m_types;
+	std::vector<Key> m_keys;		// Parallel to m_types
 	std::basic_string<uint8_t> m_stash;
-	TypeLookup m_lookup;
+	std::vector<ID> m_slots;		// A power of two of them; InvalidID if empty
+	STBuilder m_builder;
 
 private:
 	static_assert (sizeof(Entry) == 4, "Entry was expected to be 4 bytes long.");
@@ -503,14 +567,12 @@ inline int STCode::UnpackedSize (PackedST const & packed_st)
 inline PackedST STCode::Pack (STIR const & st_ir)
 {
 	auto s = PackedSize(st_ir);
-	
-	assert (st_ir[st_ir.size()] == 0);	// Assume there's a NUL at the end of st_ir; this is BAD.
 
 	PackedST ret (s, 0);
 
 	ret[0] = st_ir[0];
 	for (int i = 1, j = 1, n = int(st_ir.size()); j < n; ++i, j += 2)
-		ret[i] = ((st_ir[j] & 0xF) << 4) | (st_ir[j + 1] & 0xF);
+		ret[i] = ((st_ir[j] & 0xF) << 4) | ((j + 1 < n) ? (st_ir[j + 1] & 0xF) : 0);
 
 	return ret;
 }
@@ -522,15 +584,14 @@ inline STIR STCode::Unpack (PackedST const & packed_st)
 	auto s = UnpackedSize(packed_st);
 
 	STIR ret (s, 0xFF);
-	assert (ret[ret.size()] == 0);	// Assume there's a NUL at the end of ret; this is BAD.
 
 	ret[0] = packed_st[0];
 	for (int i = 1, j = 1, n = int(packed_st.size()); j < n; i += 2, ++j)
 	{
 		ret[i] = (packed_st[j] >> 4) & 0xF;
-		ret[i + 1] = packed_st[j] & 0xF;
+		if (i + 1 < s)
+			ret[i + 1] = packed_st[j] & 0xF;
 	}
-	ret[ret.size()] = 0;
 
 	return ret;
 }
@@ -560,6 +621,146 @@ inline uint8_t STCode::Qrtt (uint8_t const * packed_mem, unsigned quartet)
 
 //======================================================================
 
+inline void STBuilder::begin (Tag tag, bool is_const)
+{
+	m_buf.clear ();
+	m_buf += STCode::SerializeTag (tag, is_const, false);
+	m_half = false;
+}
+
+//----------------------------------------------------------------------
+// Same encoding as STCode::SerializeInt, minus the temporary string.
+inline void STBuilder::addInt (uint32_t v)
+{
+	if (v < 8)
+	{
+		addQuartet (uint8_t(v));
+		return;
+	}
+
+	int digits = 1;
+	while (digits < 8 && (v >> (4 * digits)) != 0)
+		++digits;
+
+	addQuartet (uint8_t(7 + digits));
+	for (int i = digits - 1; i >= 0; --i)
+		addQuartet ((v >> (4 * i)) & 0x0F);
+}
+
+//----------------------------------------------------------------------
+
+inline PackedST const & STBuilder::finish ()
+{
+	assert (m_buf.size() > 0);
+	// An unused low quartet in the last byte is exactly what the
+	// "odd length" bit means (see STCode::RetagLengthOddness.)
+	if (m_half)
+		m_buf[0] |= STCode::msc_OddLengthBit;
+	return m_buf;
+}
+
+//----------------------------------------------------------------------
+
+inline PackedST const & STBuilder::makeBasic (bool is_const, Tag tag)
+{
+	assert (TagInfo(tag).is_basic);
+
+	begin (tag, is_const);
+	return finish ();
+}
+
+//----------------------------------------------------------------------
+
+inline PackedST const & STBuilder::makeArray (bool is_const, Size size, ID type)
+{
+	begin (Tag::Array, is_const);
+	addInt (size);
+	addInt (type);
+	return finish ();
+}
+
+//----------------------------------------------------------------------
+
+inline PackedST const & STBuilder::makeVector (bool is_const, ID type)
+{
+	begin (Tag::Vector, is_const);
+	addInt (type);
+	return finish ();
+}
+
+//----------------------------------------------------------------------
+
+inline PackedST const & STBuilder::makeMap (bool is_const, ID key_type, ID value_type)
+{
+	begin (Tag::Map, is_const);
+	addInt (key_type);
+	addInt (value_type);
+	return finish ();
+}
+
+//----------------------------------------------------------------------
+
+inline PackedST const & STBuilder::makeTuple (bool is_const, std::vector<ID> const & field_types)
+{
+	begin (Tag::Tuple, is_const);
+	addIntList (field_types);
+	return finish ();
+}
+
+//----------------------------------------------------------------------
+
+inline PackedST const & STBuilder::makePackage (bool is_const, std::vector<ID> const & field_types)
+{
+	begin (Tag::Package, is_const);
+	addIntList (field_types);
+	return finish ();
+}
+
+//----------------------------------------------------------------------
+
+inline PackedST const & STBuilder::makeFunction (bool is_const, ID return_type, std::vector<ID> const & param_types)
+{
+	begin (Tag::Function, is_const);
+	addInt (return_type);
+	addIntList (param_types);
+	return finish ();
+}
+
+//----------------------------------------------------------------------
+
+inline void STBuilder::addQuartet (uint8_t q)
+{
+	if (m_half)
+		m_buf.back() |= (q & 0x0F);
+	else
+		m_buf += uint8_t((q & 0x0F) << 4);
+	m_half = !m_half;
+}
+
+//----------------------------------------------------------------------
+
+inline void STBuilder::addIntList (std::vector<ID> const & ids)
+{
+	addInt (uint32_t(ids.size()));
+	for (auto id : ids)
+		addInt (id);
+}
+
+//======================================================================
+
+inline ID STContainer::DefaultID (Tag tag, bool is_const)
+{
+	auto const i = TagToInt(tag);
+	if (tag == Tag::Nil)
+		return 1;
+	else if (i > TagToInt(Tag::Nil) && i < TagToInt(Tag::Variant))
+		return ID(2 * (i - 1) + (is_const ? 1 : 0));
+	else
+		return InvalidID;
+}
+
+//----------------------------------------------------------------------
+
 inline bool STContainer::isValid (ID id) const
 {
 	return id < m_types.size();
@@ -0,0 +1,114 @@
+#pragma once
+
+//======================================================================
+
+#include <upl/common.hpp>
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+//======================================================================
+
+namespace UPL {
+	namespace VM {
+
+//======================================================================
+//  A work-stealing thread pool for data-parallel loops. Each worker has a
+// deque of ranges of the loop: it takes work from the back of its own,
+// and when that's empty, steals from the front of someone else's (where
+// the biggest pieces are.) The thread that starts a loop works on it too,
+// as worker 0, until all of it is done.
+//
+//  Chunking is adaptive (lazy binary splitting): a worker runs its range
+// a grain at a time, and only splits off the second half for others to
+// steal when its own deque is empty, i.e. when nobody has anything left
+// to take. So a loop whose pieces take about as long as each other is cut
+// into about as many ranges as there are workers, and one whose costs
+// vary gets cut finer where it's needed.
+//======================================================================
+
+struct ThreadPoolStats
+{
+	uint64_t loops = 0;
+	uint64_t ranges = 0;		// Run, a grain or more at a time
+	uint64_t splits = 0;
+	uint64_t steals = 0;
+};
+
+//----------------------------------------------------------------------
+
+class ThreadPool
+{
+public:
+	// body (begin, end, worker): elements [begin, end) of the loop, on
+	// worker "worker" (0 is the thread that called parallelFor.)
+	typedef std::function<void (size_t, size_t, unsigned)> Body;
+
+public:
+	// "threads" counts the calling thread; 0 is one per hardware thread.
+	explicit ThreadPool (unsigned threads = 0);
+	~ThreadPool ();
+
+	ThreadPool (ThreadPool const &) = delete;
+	ThreadPool & operator = (ThreadPool const &) = delete;
+
+	unsigned workerCount () const {return unsigned(m_workers.size());}
+
+	// Runs "body" over [0, n), in pieces of at least "grain" elements
+	// (but for the last), and returns once all of it has run. Not
+	// reentrant: "body" mustn't start another loop on this pool, and only
+	// one thread at a time may.
+	void parallelFor (size_t n, size_t grain, Body const & body);
+
+	// Only meaningful between loops.
+	ThreadPoolStats stats () const;
+	void resetStats ();
+
+private:
+	struct Range
+	{
+		size_t begin, end;
+	};
+
+	struct Worker
+	{
+		std::mutex mutex;				// Guards the deque
+		std::deque<Range> deque;
+		std::thread thread;
+		uint64_t ranges = 0, splits = 0, steals = 0;
+	};
+
+	void workerMain (unsigned index);
+	void work (unsigned index);			// Until the loop is all done
+	bool take (unsigned index, Range & out_range);
+	void run (unsigned index, Range range);
+
+private:
+	std::vector<std::unique_ptr<Worker>> m_workers;
+
+	std::mutex m_mutex;					// Guards the three below
+	std::condition_variable m_wake;
+	uint64_t m_generation;				// Of the loop; workers join each new one
+	bool m_stopping;
+
+	// The current loop
+	Body const * m_body;
+	size_t m_grain;
+	std::atomic<size_t> m_remaining;	// Elements not done yet
+	std::atomic<unsigned> m_busy;		// Workers (other than 0) still looking at it
+	uint64_t m_loops;
+};
+
+//======================================================================
+
+	}	// namespace VM
+}	// namespace UPL
+
+//======================================================================
@@ -34,8 +34,59 @@ private:
 	NameLookup m_names;
 };
 
-//----------------------------------------------------------------------
 //======================================================================
+// The same thing as a chain of ScopedRegistry objects, but flattened: a
+// single table maps each name to a stack of its bindings (innermost on
+// top), and each scope only remembers which stacks it pushed onto. So a
+// lookup is one hash no matter how deeply scopes are nested, and opening
+// or closing a scope costs O(bindings in it) without allocating a map.
+
+class FlatScopedRegistry
+{
+private:
+	struct Binding
+	{
+		ID type;
+		int depth;
+	};
+	typedef std::vector<Binding> BindingStack;
+	typedef std::unordered_map<String, BindingStack> BindingTable;
+
+public:
+	// Starts with the outermost scope already open.
+	// Note: Registry does NOT own the STContainer
+	explicit FlatScopedRegistry (STContainer * root_st_container);
+	~FlatScopedRegistry ();
+
+	FlatScopedRegistry (FlatScopedRegistry const &) = delete;
+	FlatScopedRegistry & operator = (FlatScopedRegistry const &) = delete;
+
+	void openScope ();
+	void closeScope ();		// Undoes every binding made since the matching openScope()
+	int depth () const {return int(m_scope_marks.size());}
+
+	bool createName (String const & new_name, ID existing_type);
+	ID findByName (String const & name) const;
+
+	// Opens a scope for the lifetime of the object
+	class Scope
+	{
+	public:
+		explicit Scope (FlatScopedRegistry & registry) : m_registry (registry) {m_registry.openScope();}
+		~Scope () {m_registry.closeScope();}
+		Scope (Scope const &) = delete;
+		Scope & operator = (Scope const &) = delete;
+	private:
+		FlatScopedRegistry & m_registry;
+	};
+
+private:
+	STContainer * m_st_container = nullptr;
+	BindingTable m_table;
+	std::vector<BindingStack *> m_undo_log;	// One entry per binding, innermost scope last
+	std::vector<size_t> m_scope_marks;		// Undo log size when each scope was opened
+};
+
 //----------------------------------------------------------------------
 //======================================================================
 
@@ -0,0 +1,284 @@
+#pragma once
+
+//======================================================================
+
+#include <upl/common.hpp>
+#include <upl/st_code.hpp>
+
+#include <cstring>
+
+//======================================================================
+
+namespace UPL {
+	namespace VM {
+
+//======================================================================
+//  The dynamically-typed value representation, for "any" and variants
+// (and anywhere else the type isn't known statically.) It's one 64-bit
+// word, NaN-boxed:
+//
+//  - Any double except a NaN is stored as itself. NaNs are all turned
+//    into the one canonical (positive, quiet) NaN.
+//  - Everything else lives in the negative quiet NaN space: the top 13
+//    bits are all ones, the next 3 bits are a tag and the low 48 bits are
+//    the payload:
+//      tag 0: a pointer to a heap Object (never null)
+//      tag 1: nil
+//      tag 2: bool (0 or 1)
+//      tag 3: byte
+//      tag 4: char
+//      tag 5: int, if it fits in 48 bits (otherwise boxed in a BoxedInt)
+//      tag 6: string of up to 5 UTF-8 bytes; the length is in bits 40-47
+//
+// So scalars and short strings never allocate, and the run-time type of
+// any value is either implied by its tag or is in its object's header.
+//======================================================================
+
+struct Object
+{
+	Type::ID type;		// The exact (run-time) type of this object
+	uint32_t flags;		// Belongs to the memory manager
+};
+
+//----------------------------------------------------------------------
+
+struct BoxedInt
+	: Object
+{
+	Int value;
+};
+
+//----------------------------------------------------------------------
+
+class Value
+{
+public:
+	enum class Kind : uint8_t
+	{
+		Object,
+		Nil,
+		Bool,
+		Byte,
+		Char,
+		Int,
+		SmallString,
+		Real,
+	};
+
+	static int const msc_SmallStringMax = 5;
+	static int const msc_InlineIntBits = 48;
+
+private:
+	static uint64_t const msc_BoxBits = 0xFFF8000000000000ULL;
+	static uint64_t const msc_PayloadMask = 0x0000FFFFFFFFFFFFULL;
+	static uint64_t const msc_CanonicalNaN = 0x7FF8000000000000ULL;
+	static int const msc_TagShift = 48;
+
+public:
+	Value () : m_bits (Tagged(Kind::Nil, 0)) {}
+
+	static Value Nil () {return Value();}
+	static Value FromBool (Bool v) {return FromBits(Tagged(Kind::Bool, v ? 1 : 0));}
+	static Value FromByte (uint8_t v) {return FromBits(Tagged(Kind::Byte, v));}
+	static Value FromChar (Char v) {return FromBits(Tagged(Kind::Char, uint32_t(v)));}
+	static inline Value FromReal (Real v);
+
+	static bool IntFitsInline (Int v) {return v >= -(Int(1) << 47) && v < (Int(1) << 47);}
+	static Value FromInlineInt (Int v) {assert (IntFitsInline(v)); return FromBits(Tagged(Kind::Int, uint64_t(v) & msc_PayloadMask));}
+	static inline Value FromObject (Object * obj);
+
+	// Returns false if the string is too long to be inline.
+	static inline bool TryFromSmallString (char const * utf8, size_t size, Value & out);
+
+	static Value FromBits (uint64_t bits) {Value ret; ret.m_bits = bits; return ret;}
+	uint64_t bits () const {return m_bits;}
+
+	inline Kind kind () const;
+	bool isReal () const {return m_bits < msc_BoxBits;}
+	bool isObject () const {return (m_bits >> msc_TagShift) == (msc_BoxBits >> msc_TagShift);}
+	bool isNil () const {return m_bits == Tagged(Kind::Nil, 0);}
+	bool isInlineInt () const {return kind() == Kind::Int;}
+
+	Real asReal () const {Real ret; memcpy (&ret, &m_bits, sizeof(ret)); return ret;}
+	Bool asBool () const {return 0 != (m_bits & 1);}
+	uint8_t asByte () const {return uint8_t(m_bits);}
+	Char asChar () const {return Char(uint32_t(m_bits));}
+	Object * asObject () const {return reinterpret_cast<Object *>(uintptr_t(m_bits & msc_PayloadMask));}
+	inline Int asInt () const;		// Inline or boxed
+
+	int smallStringSize () const {return int((m_bits >> 40) & 0xFF);}
+	inline void smallStringCopy (char * out) const;	// Copies smallStringSize() bytes
+
+	// The run-time type, as an ID of the default types of an STContainer
+	// for scalars, or from the object header otherwise.
+	inline Type::ID typeID () const;
+
+	// Identity, not structural, equality (but 1.0 == 1.0, of course.)
+	bool operator == (Value const & that) const {return m_bits == that.m_bits;}
+	bool operator != (Value const & that) const {return m_bits != that.m_bits;}
+
+private:
+	static uint64_t Tagged (Kind kind, uint64_t payload) {return msc_BoxBits | (uint64_t(kind) << msc_TagShift) | payload;}
+
+private:
+	uint64_t m_bits;
+};
+
+static_assert (sizeof(Value) == 8, "Values are expected to be 64 bits.");
+
+//----------------------------------------------------------------------
+// Every Map object is a node of a hash array mapped trie (see hamt.hpp),
+// followed by "count" Values: its entries (key, then value) and then its
+// children. "count" is how many there's room for; the ones past those in
+// use are nil.
+
+struct MapNode
+	: Object
+{
+	uint32_t count;
+	uint32_t datamap;		// The slots that hold an entry
+	uint32_t nodemap;		// The slots that hold a child node
+	uint32_t size;			// Entries in this node and all below it
+	uint32_t edit;			// The transient edit that may change it in place, if any
+	uint32_t reserved;
+
+	Value * values () {return reinterpret_cast<Value *>(this + 1);}
+	Value const * values () const {return reinterpret_cast<Value const *>(this + 1);}
+};
+
+//----------------------------------------------------------------------
+// The insides of a persistent vector (see pvector.hpp): its head, whose
+// children are the root of its trie and its tail, and the interior
+// nodes of the trie. Both are objects of type Heap::msc_VectorNodeType,
+// followed by "count" Object pointers (null past the ones in use.)
+
+struct VectorNode
+	: Object
+{
+	uint32_t count;
+	uint32_t edit;			// The transient edit that may change it in place, if any
+	uint32_t owned;			// The children that are leaves made by that edit, too
+	uint32_t size;			// Head only: elements in the trie and the tail
+	uint32_t start;			// Head only: of the slice it is
+	uint32_t shift;			// Head only: of the root
+	Type::ID leaf_type;		// Head only: the Vector type of the leaves (and of the elements)
+	uint32_t reserved;
+
+	Object ** children () {return reinterpret_cast<Object **>(this + 1);}
+	Object * const * children () const {return reinterpret_cast<Object * const *>(this + 1);}
+};
+
+//----------------------------------------------------------------------
+// A string that's the concatenation of two others (see rope.hpp): an
+// object of type Heap::msc_RopeNodeType, followed by the two halves, as
+// Values (short strings, String objects or other RopeNodes.)
+
+struct RopeNode
+	: Object
+{
+	uint32_t count;			// Always 2
+	uint32_t height;		// Of the tree; a flat string's is 0
+	uint64_t bytes;			// Of UTF-8
+	uint64_t chars;			// Code points
+
+	Value * halves () {return reinterpret_cast<Value *>(this + 1);}
+	Value const * halves () const {return reinterpret_cast<Value const *>(this + 1);}
+};
+
+//----------------------------------------------------------------------
+
+String Printable (Value v);
+
+//======================================================================
+
+inline Value Value::FromReal (Real v)
+{
+	if (v != v)
+		return FromBits(msc_CanonicalNaN);
+
+	Value ret;
+	memcpy (&ret.m_bits, &v, sizeof(v));
+	return ret;
+}
+
+//----------------------------------------------------------------------
+
+inline Value Value::FromObject (Object * obj)
+{
+	auto const p = uint64_t(reinterpret_cast<uintptr_t>(obj));
+	assert (nullptr != obj);
+	assert (0 == (p & ~msc_PayloadMask));	// 48-bit address space
+	return FromBits(msc_BoxBits | p);
+}
+
+//----------------------------------------------------------------------
+
+inline bool Value::TryFromSmallString (char const * utf8, size_t size, Value & out)
+{
+	if (size > size_t(msc_SmallStringMax))
+		return false;
+
+	uint64_t payload = uint64_t(size) << 40;
+	for (size_t i = 0; i < size; ++i)
+		payload |= uint64_t(uint8_t(utf8[i])) << (8 * i);
+
+	out = FromBits(Tagged(Kind::SmallString, payload));
+	return true;
+}
+
+//----------------------------------------------------------------------
+
+inline Value::Kind Value::kind () const
+{
+	if (isReal())
+		return Kind::Real;
+	return Kind((m_bits >> msc_TagShift) & 0x7);
+}
+
+//----------------------------------------------------------------------
+
+inline Int Value::asInt () const
+{
+	if (isObject())
+		return static_cast<BoxedInt const *>(asObject())->value;
+
+	// Sign-extend the 48-bit payload
+	return Int(m_bits << (64 - msc_InlineIntBits)) >> (64 - msc_InlineIntBits);
+}
+
+//----------------------------------------------------------------------
+
+inline void Value::smallStringCopy (char * out) const
+{
+	for (int i = 0, n = smallStringSize(); i < n; ++i)
+		out[i] = char((m_bits >> (8 * i)) & 0xFF);
+}
+
+//----------------------------------------------------------------------
+
+inline Type::ID Value::typeID () const
+{
+	using Type::Tag;
+	using Type::STContainer;
+
+	switch (kind())
+	{
+	case Kind::Object:		return asObject()->type;
+	case Kind::Nil:			return STContainer::DefaultID(Tag::Nil);
+	case Kind::Bool:		return STContainer::DefaultID(Tag::Bool);
+	case Kind::Byte:		return STContainer::DefaultID(Tag::Byte);
+	case Kind::Char:		return STContainer::DefaultID(Tag::Char);
+	case Kind::Int:			return STContainer::DefaultID(Tag::Int);
+	case Kind::SmallString:	return STContainer::DefaultID(Tag::String);
+	case Kind::Real:		return STContainer::DefaultID(Tag::Real);
+	}
+
+	UPL_UNREACHABLE;
+}
+
+//======================================================================
+
+	}	// namespace VM
+}	// namespace UPL
+
+//======================================================================
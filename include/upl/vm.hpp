@@ -3,16 +3,683 @@
 //======================================================================
 
 #include <upl/common.hpp>
+#include <upl/definitions.hpp>
+#include <upl/errors.hpp>
+#include <upl/heap.hpp>
+#include <upl/st_code.hpp>
+#include <upl/value.hpp>
+#include <upl/vm_superinstructions.inc>
+
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include <memory>
+#include <unordered_map>
+
+//======================================================================
+
+#if !defined(UPL_VM_COMPUTED_GOTO)
+	#if defined(__GNUC__) || defined(__clang__)
+		#define UPL_VM_COMPUTED_GOTO	1
+	#else
+		#define UPL_VM_COMPUTED_GOTO	0
+	#endif
+#endif
 
 //======================================================================
 
 namespace UPL {
+	namespace VM {
 
 //======================================================================
+//  This file implements the bytecode, the modules that hold it, and a
+// register-based interpreter for it. The instruction set is described in
+// definitions.hpp (UPL_PRIVATE__VM_OPCODES.)
+//======================================================================
+
+typedef uint32_t Instruction;
+
+//----------------------------------------------------------------------
+
+// The opcodes of definitions.hpp, then the superinstructions (see below.)
+#define OPCODE_ENUM(e,s,f)			e,
+#define FUSED_PAIR_ENUM(e,s,x,y)	e,
+#define FUSED_TRIPLE_ENUM(e,s,x,y,z)	e,
+enum class Op : uint8_t
+{
+	UPL_PRIVATE__VM_OPCODES(OPCODE_ENUM)
+	UPL_PRIVATE__VM_FUSED_PAIRS(FUSED_PAIR_ENUM)
+	UPL_PRIVATE__VM_FUSED_TRIPLES(FUSED_TRIPLE_ENUM)
+};
+#undef  FUSED_TRIPLE_ENUM
+#undef  FUSED_PAIR_ENUM
+#undef  OPCODE_ENUM
+
+#define OPCODE_COUNT(e,s,f)			+1
+#define FUSED_PAIR_COUNT(e,s,x,y)	+1
+#define FUSED_TRIPLE_COUNT(e,s,x,y,z)	+1
+int const BaseOpCount = 0 UPL_PRIVATE__VM_OPCODES(OPCODE_COUNT);
+int const OpCount = BaseOpCount
+	UPL_PRIVATE__VM_FUSED_PAIRS(FUSED_PAIR_COUNT)
+	UPL_PRIVATE__VM_FUSED_TRIPLES(FUSED_TRIPLE_COUNT);
+#undef  FUSED_TRIPLE_COUNT
+#undef  FUSED_PAIR_COUNT
+#undef  OPCODE_COUNT
+
+static_assert (OpCount <= 256, "Opcodes must fit in a byte.");
+
+//----------------------------------------------------------------------
+
+enum class Format : uint8_t
+{
+	None,
+	A,
+	AB,
+	AN,		// Like AB, but B is a count rather than a register
+	ANN,	// Like AN, and C is a number too
+	ABC,
+	ABN,	// Like ABC, but C is a number
+	ABx,
+	AsBx,
+	sBx,
+};
+
+//----------------------------------------------------------------------
+
+char const * OpName (Op op);
+char const * OpIdentifier (Op op);	// As in the source, e.g. "LoadK"
+Format OpFormat (Op op);
+bool IsSafepoint (Op op);	// May collect garbage (allocates, or calls something that might)
+bool FindOp (char const * name, Op & out_op);
+
 //----------------------------------------------------------------------
+//  Superinstructions: a superinstruction stands for a short run of simple
+// instructions that (going by a profile; see OpcodeProfile) often follow
+// each other, and does them all with one dispatch. Only the opcode of the
+// first instruction of the run is replaced; the others are left as they
+// are, operands and all, and the superinstruction reads them from the
+// instructions that follow it. So code with superinstructions is the same
+// size and shape as without, jumping into the middle of a run is fine,
+// and it can be taken back apart one instruction at a time.
+//
+// The set of superinstructions is generated (vm_superinstructions.inc,
+// by the "superinstructions" build target) and so it differs from build
+// to build; OpcodeSetID tells them apart.
+
+bool IsFusable (Op op);				// Can be part of a superinstruction (only the last part, if it jumps)
+int FusedParts (Op op, Op out_parts [3]);	// The simple opcodes, in order (just "op" itself if it isn't fused)
+Instruction Unfused (Instruction ins);		// The first part on its own
+
+// Rewrites the runs in "code" that have a superinstruction. Returns how
+// many.
+uint32_t FuseSuperinstructions (Instruction * code, size_t size);
+
+uint32_t OpcodeSetID ();
+
+//----------------------------------------------------------------------
+
+inline Instruction Encode (Op op, uint8_t a = 0, uint8_t b = 0, uint8_t c = 0)
+{
+	return Instruction(op) | (Instruction(a) << 8) | (Instruction(b) << 16) | (Instruction(c) << 24);
+}
+
+inline Instruction EncodeBx (Op op, uint8_t a, uint16_t bx)
+{
+	return Instruction(op) | (Instruction(a) << 8) | (Instruction(bx) << 16);
+}
+
+inline Instruction EncodeSBx (Op op, uint8_t a, int16_t sbx)
+{
+	return EncodeBx(op, a, uint16_t(sbx));
+}
+
+inline Op GetOp (Instruction ins) {return Op(ins & 0xFF);}
+inline unsigned GetA (Instruction ins) {return (ins >> 8) & 0xFF;}
+inline unsigned GetB (Instruction ins) {return (ins >> 16) & 0xFF;}
+inline unsigned GetC (Instruction ins) {return ins >> 24;}
+inline unsigned GetBx (Instruction ins) {return ins >> 16;}
+inline int GetSBx (Instruction ins) {return int16_t(ins >> 16);}
+
 //======================================================================
+// Integer arithmetic wraps around instead of being undefined. (These are
+// also what the code generator folds constants with.)
 
-}	// namespace UPL
+inline Int WrapAdd (Int a, Int b) {return Int(uint64_t(a) + uint64_t(b));}
+inline Int WrapSub (Int a, Int b) {return Int(uint64_t(a) - uint64_t(b));}
+inline Int WrapMul (Int a, Int b) {return Int(uint64_t(a) * uint64_t(b));}
+inline Int WrapNeg (Int a) {return Int(0 - uint64_t(a));}
+inline Int WrapDiv (Int a, Int b) {return (b == -1) ? WrapNeg(a) : a / b;}	// b != 0
+inline Int WrapMod (Int a, Int b) {return (b == -1) ? 0 : a % b;}			// b != 0
+
+inline Int RealToInt (Real v)
+{
+	if (std::isnan(v))
+		return 0;
+	if (v >= Real(std::numeric_limits<Int>::max()))
+		return std::numeric_limits<Int>::max();
+	if (v <= Real(std::numeric_limits<Int>::min()))
+		return std::numeric_limits<Int>::min();
+	return Int(v);
+}
+
+//======================================================================
+
+struct Function;
+
+//----------------------------------------------------------------------
+// Which registers hold Values (that may be heap references) while the
+// instruction at "pc" (relative to the function's code) is executing.
+// There is one for each safepoint; the code generator keeps the live set
+// up to date in the Assembler, which records them.
+
+struct StackMap
+{
+	static int const msc_MaxRegisters = 256;
+
+	uint32_t pc;
+	uint32_t reserved;
+	uint64_t live [msc_MaxRegisters / 64];
+
+	bool isLive (unsigned reg) const {return 0 != (live[reg / 64] & (uint64_t(1) << (reg % 64)));}
+};
+
+//----------------------------------------------------------------------
+// One register (or constant.) Untyped; the instructions know what's in it.
+
+union Reg
+{
+	Int i;
+	Real r;
+	uint64_t u;
+	void * p;
+	Function const * f;
+
+	static Reg FromInt (Int v) {Reg ret; ret.i = v; return ret;}
+	static Reg FromReal (Real v) {Reg ret; ret.r = v; return ret;}
+	static Reg FromBool (Bool v) {Reg ret; ret.i = v ? 1 : 0; return ret;}
+	static Reg FromValue (Value v) {Reg ret; ret.u = v.bits(); return ret;}
+	static Reg Nil () {Reg ret; ret.u = 0; return ret;}
+
+	Value value () const {return Value::FromBits(u);}
+};
+
+static_assert (sizeof(Reg) == 8, "Registers are expected to be 64 bits.");
+
+//----------------------------------------------------------------------
+// Plain data, so that a function table can be used straight out of a
+// file. The code lives in the module, starting at "code_offset".
+
+struct Function
+{
+	// Of "flags"
+	static uint16_t const msc_Pure = 1 << 0;		// Has no effects (see FindPureFunctions), so its calls may be memoized
+	static uint16_t const msc_Memoize = 1 << 1;		// Asked to be: its calls are memoized from the first (if it's pure)
+
+	uint32_t code_offset;
+	uint32_t code_size;
+	uint32_t name;				// Offset into the module's names
+	Type::ID type;
+	uint16_t param_count;		// Parameters come in R[0] ... R[param_count - 1]
+	uint16_t register_count;	// Including the parameters
+	uint32_t stack_map_offset;	// Into the module's stack maps, sorted by pc
+	uint32_t stack_map_count;
+	uint16_t flags;
+	uint16_t reserved;
+};
+
+//----------------------------------------------------------------------
+// A top-level binding, evaluated lazily: its initializer (a function of
+// no parameters) runs on its first use, and what it returns is the
+// binding's value from then on (see globals.hpp.)
+
+struct Global
+{
+	uint32_t name;				// Offset into the module's names
+	Type::ID type;
+	uint32_t initializer;		// Function index
+	uint32_t reserved;
+};
+
+//======================================================================
+
+// A module is either built in memory, or a read-only view of a module
+// image (see module_file.hpp); either way, the tables below are flat
+// arrays that can be used as they are.
+
+class Module
+{
+public:
+	// The flat tables, wherever they live.
+	struct Tables
+	{
+		Function const * functions = nullptr;
+		uint32_t function_count = 0;
+		Global const * globals = nullptr;
+		uint32_t global_count = 0;
+		Instruction const * code = nullptr;
+		uint32_t code_size = 0;
+		Reg const * constants = nullptr;
+		uint32_t constant_count = 0;
+		StackMap const * stack_maps = nullptr;
+		uint32_t stack_map_count = 0;
+		char const * names = nullptr;		// NUL-terminated, one after the other
+		uint32_t names_size = 0;
+	};
+
+public:
+	Module ();
+	~Module ();
+
+	Module (Module const &) = delete;
+	Module & operator = (Module const &) = delete;
+
+	Type::STContainer & types () {return m_types;}
+	Type::STContainer const & types () const {return m_types;}
+	Tables const & tables () const {return m_tables;}
+	bool isImage () const {return nullptr != m_image;}
+
+	uint32_t functionCount () const {return m_tables.function_count;}
+	Function const & function (uint32_t index) const {return m_tables.functions[index];}
+	Function const * functions () const {return m_tables.functions;}
+	uint32_t functionIndex (Function const * f) const {return uint32_t(f - m_tables.functions);}
+	char const * functionName (uint32_t index) const {return m_tables.names + m_tables.functions[index].name;}
+	uint32_t findFunction (char const * name) const;	// Returns functionCount() if not found
+
+	uint32_t globalCount () const {return m_tables.global_count;}
+	Global const & global (uint32_t index) const {return m_tables.globals[index];}
+	char const * globalName (uint32_t index) const {return m_tables.names + m_tables.globals[index].name;}
+	uint32_t findGlobal (char const * name) const;		// Returns globalCount() if not found
+
+	Instruction const * code () const {return m_tables.code;}
+	Instruction const * code (Function const & f) const {return m_tables.code + f.code_offset;}
+	uint32_t codeSize () const {return m_tables.code_size;}
+
+	StackMap const * findStackMap (Function const & f, uint32_t pc) const;	// nullptr if none
+
+	uint32_t constantCount () const {return m_tables.constant_count;}
+	Reg const * constants () const {return m_tables.constants;}
+
+	// Makes this module a view of an image; "image" keeps the memory the
+	// tables point into alive, and is released with the module. Only for
+	// a module that is still empty.
+	void attachImage (std::shared_ptr<void const> image, Tables const & tables);
+
+	// Building (not for images.) Identical constants are shared.
+	uint32_t addConstant (Reg value);
+	uint32_t addFunction (std::string const & name, Type::ID type, uint16_t param_count, uint16_t register_count,
+		std::vector<Instruction> const & code, std::vector<StackMap> const & stack_maps = std::vector<StackMap>());
+	// For forward references (e.g. recursion): declare first, define later.
+	uint32_t declareFunction (std::string const & name, Type::ID type, uint16_t param_count);
+	void defineFunction (uint32_t index, uint16_t register_count,
+		std::vector<Instruction> const & code, std::vector<StackMap> const & stack_maps = std::vector<StackMap>());
+	void setFunctionFlags (uint32_t index, uint16_t flags);
+	// The initializer must take no parameters, and return the type.
+	uint32_t addGlobal (std::string const & name, Type::ID type, uint32_t initializer);
+
+	String disassemble (uint32_t function_index) const;
+
+private:
+	void refreshTables ();
+
+private:
+	Type::STContainer m_types;
+	Tables m_tables;
+	std::shared_ptr<void const> m_image;
+
+	// When building
+	std::vector<Function> m_functions;
+	std::vector<Global> m_globals;
+	std::vector<char> m_names;
+	std::vector<Instruction> m_code;
+	std::vector<Reg> m_constants;
+	std::vector<StackMap> m_stack_maps;
+	std::unordered_map<uint64_t, uint32_t> m_constant_lookup;
+};
+
+//======================================================================
+// Emits the code for one function, with forward-patchable jump labels.
+// Every safepoint instruction gets a stack map of the registers marked
+// live (with setLive) at the time it is emitted.
+
+class Assembler
+{
+public:
+	typedef int Label;
+
+	static uint32_t const msc_MaxBx = 0xFFFF;
+
+	Assembler () : m_live (), m_bx_out_of_range (false) {}
+
+	inline void emit (Instruction ins);
+	void emit (Op op, uint8_t a = 0, uint8_t b = 0, uint8_t c = 0) {emit (Encode(op, a, b, c));}
+	inline void emitBx (Op op, uint8_t a, uint32_t bx);	// A constant's, function's or global's index, say
+	void emitLoadInt (uint8_t a, Int v, Module & module);	// Uses LoadI if it fits, LoadK if not
+	void emitLoadReal (uint8_t a, Real v, Module & module);
+
+	void setLive (uint8_t reg, bool holds_value);
+	void clearLive () {memset (m_live, 0, sizeof(m_live));}
+
+	Label newLabel ();
+	void bind (Label label);
+	void emitJump (Op op, uint8_t a, Label target);	// Jmp, JmpT or JmpF
+
+	size_t size () const {return m_code.size();}
+
+	// Patches the jumps. Returns false if a jump doesn't fit in 16 bits
+	// or targets an unbound label, or if a Bx operand didn't fit (see
+	// bxOutOfRange.)
+	bool finish (std::vector<Instruction> & out_code, std::vector<StackMap> * out_stack_maps = nullptr);
+	bool bxOutOfRange () const {return m_bx_out_of_range;}
+
+private:
+	struct Fixup {size_t at; Label target;};
+
+	std::vector<Instruction> m_code;
+	std::vector<int> m_labels;	// Bound position, or -1
+	std::vector<Fixup> m_fixups;
+	std::vector<StackMap> m_stack_maps;
+	uint64_t m_live [StackMap::msc_MaxRegisters / 64];
+	bool m_bx_out_of_range;		// Since the last finish
+};
+
+//----------------------------------------------------------------------
+
+inline void Assembler::emit (Instruction ins)
+{
+	if (IsSafepoint(GetOp(ins)))
+	{
+		StackMap map;
+		map.pc = uint32_t(m_code.size());
+		map.reserved = 0;
+		memcpy (map.live, m_live, sizeof(map.live));
+		m_stack_maps.push_back (map);
+	}
+	m_code.push_back (ins);
+}
+
+//----------------------------------------------------------------------
+// One that doesn't fit is emitted anyway (wrapped), and fails finish.
+
+inline void Assembler::emitBx (Op op, uint8_t a, uint32_t bx)
+{
+	if (bx > msc_MaxBx)
+		m_bx_out_of_range = true;
+	emit (EncodeBx(op, a, uint16_t(bx)));
+}
 
 //======================================================================
 
+enum class RunError
+{
+	None,
+	StackOverflow,
+	DivisionByZero,
+	BadArgCount,
+	BadOpcode,
+	BadFunction,
+	OutOfMemory,
+	NotAnObject,
+	BadField,
+	IndexOutOfRange,
+	BadGlobal,
+	CyclicGlobal,
+};
+
+//----------------------------------------------------------------------
+
+struct Stats
+{
+	uint64_t instructions = 0;
+	uint64_t calls = 0;
+	uint64_t tail_calls = 0;		// Of the calls, those that reused their caller's frame
+	uint64_t max_frame_depth = 0;
+	uint64_t native_entries = 0;	// Into JIT-compiled code
+	uint64_t native_exits = 0;		// Of those, back to the interpreter before returning
+	uint64_t cache_hits = 0;		// Inline caches, at calls and field and element accesses
+	uint64_t cache_misses = 0;
+	uint64_t cache_megamorphic = 0;	// Of the misses, those at a cache that was already full
+	uint64_t bulk_elements = 0;		// Done by Bulk instructions
+	uint64_t parallel_elements = 0;	// Done by PMap and PReduce instructions on a Parallel
+	uint64_t memo_hits = 0;			// Calls answered from a Memo's tables, without running the callee
+	uint64_t memo_misses = 0;		// Calls that looked there first, and ran it
+};
+
+//----------------------------------------------------------------------
+// Counts the simple instructions that run straight after each other
+// (jumps taken, calls and returns break the chain), in pairs and triples;
+// a superinstruction is executed as its parts. The text format is a line
+// per pair or triple: the count, then the mnemonics.
+
+class OpcodeProfile
+{
+public:
+	OpcodeProfile ();
+
+	inline void record (Instruction const * at);
+
+	uint64_t total () const {return m_total;}
+	uint64_t pair (Op a, Op b) const {return m_pairs[Index(a, b)];}
+	uint64_t triple (Op a, Op b, Op c) const {return m_triples[Index(a, b, c)];}
+	void clear ();
+
+	bool save (char const * path) const;
+	bool load (char const * path);		// Adds to what's already counted
+
+private:
+	static size_t Index (Op a, Op b) {return size_t(a) * BaseOpCount + size_t(b);}
+	static size_t Index (Op a, Op b, Op c) {return Index(a, b) * BaseOpCount + size_t(c);}
+
+	inline void push (Op op);
+
+private:
+	std::vector<uint64_t> m_pairs;
+	std::vector<uint64_t> m_triples;
+	uint64_t m_total;
+	Instruction const * m_next;		// The instruction after the last one recorded
+	Op m_last [2];					// And its (simple) opcode, and the one before
+	int m_chain;					// How many of those count
+};
+
+//----------------------------------------------------------------------
+
+inline void OpcodeProfile::record (Instruction const * at)
+{
+	if (at != m_next)
+		m_chain = 0;
+
+	Op parts [3];
+	int const n = FusedParts(GetOp(*at), parts);
+	for (int i = 0; i < n; ++i)
+		push (parts[i]);
+	m_next = at + n;
+}
+
+//----------------------------------------------------------------------
+
+inline void OpcodeProfile::push (Op op)
+{
+	m_total += 1;
+	if (m_chain >= 1)
+		m_pairs[Index(m_last[1], op)] += 1;
+	if (m_chain >= 2)
+		m_triples[Index(m_last[0], m_last[1], op)] += 1;
+	m_last[0] = m_last[1];
+	m_last[1] = op;
+	m_chain = (m_chain < 2) ? m_chain + 1 : 2;
+}
+
+//----------------------------------------------------------------------
+
+class Jit;
+class Parallel;
+class Memo;
+class MemoTable;
+class Globals;
+class GlobalsWaiter;
+class Task;
+
+// Where the result of a memoized call goes, once it has one (see memo.hpp)
+struct MemoReservation
+{
+	uint32_t slot;
+	uint32_t stamp;
+	uint64_t calls;		// Stats::calls as it was made, for what the result costs
+};
+
+class Interpreter
+	: public RootSource
+{
+public:
+	static size_t const msc_DefaultRegisterFileSize = 1 << 20;
+	static size_t const msc_DefaultMaxFrames = 1 << 16;
+	static unsigned const msc_CacheWays = 4;	// Callees or object types remembered per instruction
+
+public:
+	// Note: the interpreter does NOT own the module, the reporter or the
+	// heap. The heap must be over the module's types.
+	Interpreter (Module const & module, Error::Reporter & reporter, Heap & heap,
+		size_t register_file_size = msc_DefaultRegisterFileSize, size_t max_frames = msc_DefaultMaxFrames);
+	~Interpreter ();
+
+	Interpreter (Interpreter const &) = delete;
+	Interpreter & operator = (Interpreter const &) = delete;
+
+	// Runs a function to completion. On a run-time error, reports it and
+	// returns false. A reference result must be rooted (Heap::addRoot)
+	// before anything else allocates.
+	bool call (uint32_t function_index, Reg const * args, int arg_count, Reg & out_result);
+	// The value of global "index" (see setGlobals), forced first if need
+	// be; the same goes as for call.
+	bool readGlobal (uint32_t index, Reg & out_value);
+
+	RunError lastError () const {return m_last_error;}
+	Stats const & stats () const {return m_stats;}
+	void resetStats () {m_stats = Stats();}
+	Heap & heap () {return m_heap;}
+	Module const & module () const {return m_module;}
+
+	// Hot functions are handed to "jit" (which isn't owned), or to none.
+	void setJit (Jit * jit) {m_jit = jit;}
+	Jit * jit () const {return m_jit;}
+
+	// Every instruction executed is recorded in "profile" (which isn't
+	// owned), if any. It slows the interpreter down, and the JIT
+	// doesn't record anything.
+	void setProfile (OpcodeProfile * profile) {m_profile = profile;}
+	OpcodeProfile * profile () const {return m_profile;}
+
+	// The PMap and PReduce instructions the compiler found safe to run in
+	// parallel do so on "parallel" (which isn't owned), if it accepts them;
+	// the rest run right here, an element at a time.
+	void setParallel (Parallel * parallel) {m_parallel = parallel;}
+	Parallel * parallel () const {return m_parallel;}
+
+	// The calls "memo" (which isn't owned) picks are answered from its
+	// tables where they can be, and their results added where they can't.
+	// Only to be changed between calls.
+	void setMemo (Memo * memo) {m_memo = memo;}
+	Memo * memo () const {return m_memo;}
+
+	// The module's globals (GetG) are read from, and forced in, "globals"
+	// (which isn't owned); without any, reading one is an error. Only to
+	// be changed between calls.
+	void setGlobals (Globals * globals) {m_globals = globals;}
+	Globals * globals () const {return m_globals;}
+
+	// The green thread this interpreter runs (see scheduler.hpp), whose
+	// Io instructions suspend it rather than block; or none.
+	void setTask (Task * task) {m_task = task;}
+	Task * task () const {return m_task;}
+
+	void visitRoots (RootVisitor & visitor) override;
+
+private:
+	struct Frame
+	{
+		Function const * function;
+		Instruction const * return_pc;	// Where the caller resumes
+		uint32_t base;					// Index of R[0] in the register file
+		uint32_t return_reg;			// Caller's register (relative to its base) for the result
+		MemoTable * memo;				// Where the result is to be remembered, if anywhere
+		MemoReservation reservation;
+	};
+
+	// How a field or element of some type is loaded into a register and
+	// stored from one.
+	enum class Access : uint8_t
+	{
+		Bad,		// The VM has no way to
+		Nil,
+		Bool,
+		Byte,
+		Char,
+		Int,
+		Real,
+		Ref,
+	};
+
+	// Every Call, TailCall, GetF, SetF, GetE and SetE instruction has an
+	// inline cache: what the last few executions found, keyed on the
+	// callee or on the object's (run-time) type. A call to a callee seen
+	// before skips its checks; an access to an object of a type seen before
+	// skips looking up its shape and the field's type.
+	struct CacheEntry
+	{
+		uintptr_t key;				// Function const *, or Type::ID
+		Type::Size offset;			// Of the field, or the first element (in the payload)
+		Type::Size stride;			// Of the elements
+		Type::Size count_offset;	// Of the element count
+		Access access;
+	};
+
+	struct InlineCache
+	{
+		uint32_t count;
+		CacheEntry entries [msc_CacheWays];
+	};
+
+	bool run (size_t entry_depth, Reg & out_result);
+	bool fail (RunError err, Function const * where);
+	void prepareCaches ();
+	inline CacheEntry const * cached (InlineCache const & cache, uintptr_t key);
+	CacheEntry const * remember (InlineCache & cache, CacheEntry const & entry, CacheEntry & scratch);
+	Access accessOf (Type::ID type) const;
+	static inline void Load (uint8_t const * at, Access access, Reg & out);
+	inline bool store (Object const * holder, uint8_t * at, Access access, Reg v);
+	// PMap and PReduce, on the operands in args[1], args[2] and args[3];
+	// "pc" is just past the instruction. A RunError::None failure is
+	// one a call made from here has reported already.
+	bool mapElements (Instruction const * pc, Reg * args, bool parallel, RunError & out_error);
+	bool reduceElements (Instruction const * pc, Reg * args, bool parallel, RunError & out_error);
+	// Calls "f" from the instruction before "pc", which must be a safepoint.
+	bool callFrom (Instruction const * pc, Function const & f, Reg const * args, Reg & out_result);
+	// GetG, when the global isn't forced yet (or there's no Globals); the
+	// same goes for errors as for mapElements.
+	bool forceGlobal (Instruction const * pc, uint32_t index, Reg & out_value, RunError & out_error);
+
+private:
+	Module const & m_module;
+	Error::Reporter & m_reporter;
+	Heap & m_heap;
+	std::vector<Reg> m_registers;
+	std::vector<Frame> m_frames;
+	size_t m_max_frames;
+	RunError m_last_error;
+	Stats m_stats;
+	Instruction const * m_pc;		// Of the innermost frame, as of its last safepoint
+	Jit * m_jit;
+	OpcodeProfile * m_profile;
+	Parallel * m_parallel;
+	Memo * m_memo;
+	Globals * m_globals;
+	Task * m_task;
+	std::vector<uint32_t> m_cache_slots;	// For each instruction of the module, into m_caches
+	std::vector<InlineCache> m_caches;
+};
+
+//======================================================================
+
+	}	// namespace VM
+}	// namespace UPL
+
+//======================================================================
@@ -1,14 +1,54 @@
 //======================================================================
 
 #include <upl/st_code.hpp>
+#include <upl/layout.hpp>
+#include <upl/types.hpp>
+#include <upl/vm.hpp>
+#include <upl/heap.hpp>
+#include <upl/hamt.hpp>
+#include <upl/pvector.hpp>
+#include <upl/rope.hpp>
+#include <upl/module_file.hpp>
+#include <upl/value.hpp>
+#include <upl/code_gen.hpp>
+#include <upl/ir.hpp>
+#include <upl/ir_passes.hpp>
+#include <upl/jit.hpp>
+#include <upl/bulk.hpp>
+#include <upl/globals.hpp>
+#include <upl/parallel.hpp>
+#include <upl/memo.hpp>
+#include <upl/runtime.hpp>
+#include <upl/scheduler.hpp>
+#include <upl/thread_pool.hpp>
 
 #include <upl/lexer.hpp>
 #include <upl/input.hpp>
 #include <upl/errors.hpp>
+#include <upl/error_sinks.hpp>
 #include <upl/common.hpp>
 
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cmath>
 #include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
 #include <iostream>
+#include <limits>
+#include <memory>
+#include <random>
+#include <string>
+#include <thread>
+#include <unordered_map>
+
+#if UPL_FIBERS_AVAILABLE
+	#include <fcntl.h>
+	#include <unistd.h>
+#endif
 
 //======================================================================
 //======================================================================
@@ -16,15 +56,48 @@
 //======================================================================
 
 void ReportErrors (UPL::Error::Reporter const & err);
+std::string TempPath (char const * name);
 void TestStringConversions ();
 void TestInputStream ();
 void TestLexer ();
 void TestSTCode ();
+void TestLayouts ();
+void TestScopes ();
+void TestConcurrentReporter ();
+void TestErrorSinks ();
+void TestVM ();
+void TestValues ();
+void PrintHeapStats (UPL::VM::Heap const & heap);
+void TestHeap ();
+void TestMaps ();
+void TestVectors ();
+void TestStrings ();
+void BuildIRCorpus (UPL::Type::STContainer & types, UPL::CodeGen::IRModule & out);
+struct IRCase {char const * name; std::vector<UPL::VM::Reg> args; UPL::Int expected;};
+std::vector<IRCase> IRCorpusCases ();
+void TestIR ();
+void TestJit ();
+void ProfileCorpus (UPL::VM::OpcodeProfile & profile);
+void TestSuperinstructions ();
+void TestBulk ();
+void TestParallel ();
+void TestMemo ();
+void TestGlobals ();
+void TestScheduler ();
+void TestRuntime ();
 
 //======================================================================
 
-int main (int /*argc*/, char * /*argv*/[])
+int main (int argc, char * argv[])
 {
+	// For the "superinstructions" build target
+	if (3 == argc && 0 == strcmp(argv[1], "--profile"))
+	{
+		UPL::VM::OpcodeProfile profile;
+		ProfileCorpus (profile);
+		return profile.save(argv[2]) ? 0 : 1;
+	}
+
 	std::cout << "This is the UPL playpen, where testing and tinkering happens.\n";
 	std::cout << std::endl;
 
@@ -52,6 +125,120 @@ int main (int /*argc*/, char * /*argv*/[])
 	TestSTCode ();
 	std::cout << std::endl;
 
+	std::cout << "===================" << std::endl;
+	std::cout << "Testing the layouts" << std::endl;
+	std::cout << "-------------------" << std::endl;
+	TestLayouts ();
+	std::cout << std::endl;
+
+	std::cout << "==================" << std::endl;
+	std::cout << "Testing the scopes" << std::endl;
+	std::cout << "------------------" << std::endl;
+	TestScopes ();
+	std::cout << std::endl;
+
+	std::cout << "================================" << std::endl;
+	std::cout << "Testing the concurrent reporter" << std::endl;
+	std::cout << "--------------------------------" << std::endl;
+	TestConcurrentReporter ();
+	std::cout << std::endl;
+
+	std::cout << "========================" << std::endl;
+	std::cout << "Testing the error sinks" << std::endl;
+	std::cout << "------------------------" << std::endl;
+	TestErrorSinks ();
+	std::cout << std::endl;
+
+	std::cout << "==============" << std::endl;
+	std::cout << "Testing the VM" << std::endl;
+	std::cout << "--------------" << std::endl;
+	TestVM ();
+	std::cout << std::endl;
+
+	std::cout << "==================" << std::endl;
+	std::cout << "Testing the values" << std::endl;
+	std::cout << "------------------" << std::endl;
+	TestValues ();
+	std::cout << std::endl;
+
+	std::cout << "================" << std::endl;
+	std::cout << "Testing the heap" << std::endl;
+	std::cout << "----------------" << std::endl;
+	TestHeap ();
+	std::cout << std::endl;
+
+	std::cout << "================" << std::endl;
+	std::cout << "Testing the maps" << std::endl;
+	std::cout << "----------------" << std::endl;
+	TestMaps ();
+	std::cout << std::endl;
+
+	std::cout << "===================" << std::endl;
+	std::cout << "Testing the vectors" << std::endl;
+	std::cout << "-------------------" << std::endl;
+	TestVectors ();
+	std::cout << std::endl;
+
+	std::cout << "===================" << std::endl;
+	std::cout << "Testing the strings" << std::endl;
+	std::cout << "-------------------" << std::endl;
+	TestStrings ();
+	std::cout << std::endl;
+
+	std::cout << "=================================" << std::endl;
+	std::cout << "Testing the IR and the optimizer" << std::endl;
+	std::cout << "---------------------------------" << std::endl;
+	TestIR ();
+	std::cout << std::endl;
+
+	std::cout << "===============" << std::endl;
+	std::cout << "Testing the JIT" << std::endl;
+	std::cout << "---------------" << std::endl;
+	TestJit ();
+	std::cout << std::endl;
+
+	std::cout << "=============================" << std::endl;
+	std::cout << "Testing the superinstructions" << std::endl;
+	std::cout << "-----------------------------" << std::endl;
+	TestSuperinstructions ();
+	std::cout << std::endl;
+
+	std::cout << "=============================" << std::endl;
+	std::cout << "Testing the bulk operations" << std::endl;
+	std::cout << "-----------------------------" << std::endl;
+	TestBulk ();
+	std::cout << std::endl;
+
+	std::cout << "========================================" << std::endl;
+	std::cout << "Testing the parallel map and reduce" << std::endl;
+	std::cout << "----------------------------------------" << std::endl;
+	TestParallel ();
+	std::cout << std::endl;
+
+	std::cout << "========================================" << std::endl;
+	std::cout << "Testing the memoization of pure functions" << std::endl;
+	std::cout << "----------------------------------------" << std::endl;
+	TestMemo ();
+	std::cout << std::endl;
+
+	std::cout << "========================================" << std::endl;
+	std::cout << "Testing the lazy globals" << std::endl;
+	std::cout << "----------------------------------------" << std::endl;
+	TestGlobals ();
+	std::cout << std::endl;
+
+	std::cout << "========================================" << std::endl;
+	std::cout << "Testing the green threads" << std::endl;
+	std::cout << "----------------------------------------" << std::endl;
+	TestScheduler ();
+	std::cout << std::endl;
+
+	std::cout << "========================================" << std::endl;
+	std::cout << "Testing the embedding runtime" << std::endl;
+	std::cout << "----------------------------------------" << std::endl;
+	TestRuntime ();
+	std::cout << std::endl;
+
 	return 0;
 }
 
@@ -74,6 +261,23 @@ void ReportErrors (UPL::Error::Reporter const & err)
 			<< endl;
 }
 
+//----------------------------------------------------------------------
+// Where the tests put the files they write; each removes its own when done.
+std::string TempPath (char const * name)
+{
+	char const * dir = std::getenv("TMPDIR");
+	if (nullptr == dir || '\0' == dir[0]) dir = std::getenv("TEMP");
+#if defined(P_tmpdir)
+	if (nullptr == dir || '\0' == dir[0]) dir = P_tmpdir;
+#endif
+	if (nullptr == dir || '\0' == dir[0]) dir = ".";
+
+	std::string ret = dir;
+	if ('/' != ret.back() && '\\' != ret.back())
+		ret += '/';
+	return ret + "upl-" + name;
+}
+
 //----------------------------------------------------------------------
 
 void TestStringConversions ()
@@ -210,6 +414,38 @@ void TestSTCode ()
 		wcout << std::dec << id[i] << endl;
 	}
 
+	// The direct builder must produce exactly what the STIR path does.
+	UPL::Type::STBuilder stb;
+	assert (stb.makeVariant(false, {reg.byTag(Tag::Any), reg.byTag(Tag::Int), reg.byTag(Tag::String), reg.byTag(Tag::Nil), reg.byTag(Tag::Int)}) == p0);
+	assert (stb.makeFunction(false, id0, {id0, id0, id0, reg.byTag(Tag::Bool)}) == p1);
+	assert (stb.makeMap(false, id1, id0) == p2);
+	assert (stb.makeArray(true, 2000000000, id1) == p3);
+	assert (stb.makeBasic(true, Tag::Real) == ST::Pack(ST::MakeReal(true)));
+	assert (stb.makeTuple(false, {id0, id1, id2, id3}) == ST::Pack(ST::MakeTuple(false, {id0, id1, id2, id3})));
+
+	std::vector<UPL::Type::Unpacked> batch;
+	batch.emplace_back (Tag::Tuple, false, std::vector<UPL::Type::ID>{id0, id1, id2, id3});
+	batch.emplace_back (Tag::Map, false, id1, id0, 0);
+	batch.emplace_back (Tag::Vector, true, id3);
+	auto batch_ids = reg.createTypes(batch);
+	assert (batch_ids[1] == id2);
+	assert (reg.unpack(batch_ids[0]).type_list == batch[0].type_list);
+	assert (reg.getVectorType(batch_ids[2]) == id3 && reg.isConst(batch_ids[2]));
+	wcout << "Batch created types " << batch_ids[0] << ", " << batch_ids[1] << ", " << batch_ids[2] << endl;
+
+	// Enough of them to grow the lookup a few times; each must be found
+	// again, and a second batch of the same must make nothing new.
+	std::vector<UPL::Type::Unpacked> many;
+	for (UPL::Type::Size n = 1; n <= 5000; ++n)
+		many.emplace_back (Tag::Array, false, id0, 0, n);
+	auto const before = reg.size();
+	auto many_ids = reg.createTypes(many);
+	assert (reg.size() == before + many.size());
+	assert (reg.createTypes(many) == many_ids && reg.size() == before + many.size());
+	for (size_t i = 0; i < many.size(); ++i)
+		assert (reg.getArraySize(many_ids[i]) == i + 1 && reg.lookupType(stb.build(many[i])) == many_ids[i]);
+	wcout << "Batch created " << reg.size() - before << " array types" << endl;
+
 	wcout << endl;
 	for (unsigned i = 0; i < reg.size(); ++i)
 	{
@@ -226,4 +462,4396 @@ void TestSTCode ()
 }
 
 //----------------------------------------------------------------------
+
+void TestLayouts ()
+{
+	using std::wcout;
+	using std::endl;
+	using UPL::Type::Tag;
+	using UPL::Type::ID;
+	using UPL::Type::Unpacked;
+
+	UPL::Type::STContainer reg;
+	UPL::Type::LayoutEngine layouts (reg);
+
+	auto t_bool = reg.createType(Unpacked(Tag::Bool, false));
+	auto t_char = reg.createType(Unpacked(Tag::Char, false));
+	auto t_int = reg.createType(Unpacked(Tag::Int, false));
+	auto t_real = reg.createType(Unpacked(Tag::Real, false));
+	auto t_str = reg.createType(Unpacked(Tag::String, false));
+	auto t_tup = reg.createType(Unpacked(Tag::Tuple, false, std::vector<ID>{t_bool, t_real, t_char, t_int, t_bool}));
+	auto t_var = reg.createType(Unpacked(Tag::Variant, false, std::vector<ID>{t_int, t_bool}));
+	auto t_arr = reg.createType(Unpacked(Tag::Array, false, t_tup, 0, 4));
+	auto t_big = reg.createType(Unpacked(Tag::Array, false, t_str, 0, 100000));
+	auto t_fun = reg.createType(Unpacked(Tag::Function, false, t_real, std::vector<ID>{t_int, t_int}));
+
+	ID ids [] = {t_bool, t_char, t_int, t_real, t_str, t_tup, t_var, t_arr, t_big, t_fun};
+	for (auto id : ids)
+	{
+		auto const & l = layouts.layout(id);
+		wcout
+			<< id << " (" << UPL::Type::TagInfo(reg.tag(id)).name << ") : size " << l.size
+			<< ", align " << l.alignment << ", boxed " << l.is_boxed << ", ptrs " << l.has_pointers
+			<< ", fields (";
+		for (auto f : l.field_offsets)
+			wcout << " " << f;
+		wcout << ")" << endl;
+	}
+
+	// {bool, real, char, int, bool} packs into 8 + 8 + 4 + 1 + 1 -> 24 bytes
+	assert (layouts.sizeOf(t_tup) == 24);
+	assert (layouts.fieldOffset(t_tup, 1) == 0 && layouts.fieldOffset(t_tup, 3) == 8);
+	assert (layouts.sizeOf(t_var) == 16 && !layouts.hasPointers(t_var));
+	assert (layouts.sizeOf(t_arr) == 96);
+	assert (layouts.isBoxed(t_big) && layouts.hasPointers(t_big));
+	assert (layouts.isBoxed(t_fun));
+}
+
+//----------------------------------------------------------------------
+
+void TestScopes ()
+{
+	using std::wcout;
+	using std::endl;
+	using UPL::Type::Tag;
+	using UPL::Type::Unpacked;
+
+	UPL::Type::STContainer reg;
+	UPL::Type::FlatScopedRegistry names (&reg);
+
+	auto t_int = reg.createType(Unpacked(Tag::Int, false));
+	auto t_real = reg.createType(Unpacked(Tag::Real, false));
+	auto t_bool = reg.createType(Unpacked(Tag::Bool, false));
+
+	bool ok = names.createName(L"x", t_int);
+	assert (ok);
+	ok = names.createName(L"x", t_real);
+	assert (!ok);	// Already bound in this scope
+
+	{
+		UPL::Type::FlatScopedRegistry::Scope s1 (names);
+		names.createName (L"x", t_real);
+		names.createName (L"y", t_bool);
+		assert (names.findByName(L"x") == t_real);
+
+		// Deep nesting costs nothing extra to look through
+		for (int i = 0; i < 1000; ++i)
+			names.openScope ();
+		assert (names.findByName(L"y") == t_bool);
+		for (int i = 0; i < 1000; ++i)
+			names.closeScope ();
+	}
+
+	assert (names.findByName(L"x") == t_int);
+	assert (names.findByName(L"y") == UPL::Type::InvalidID);
+	wcout << "Depth after closing: " << names.depth() << ", x -> " << names.findByName(L"x") << endl;
+	(void)ok;
+}
+
+//----------------------------------------------------------------------
+
+void TestConcurrentReporter ()
+{
+	using std::wcout;
+	using std::endl;
+	using UPL::Error::Severity;
+	using UPL::Error::Category;
+
+	UPL::Error::ConcurrentReporter rep (10);
+
+	std::vector<std::thread> threads;
+	for (int t = 0; t < 4; ++t)
+		threads.emplace_back ([&rep, t]{
+			auto & local = rep.local();
+			local.pushFileName ("file-" + std::to_string(3 - t) + ".upl");
+			for (int i = 0; i < 5; ++i)
+				local.newReport (UPL::Location(i + 1, t), Severity::Warning, Category::Lexer, 100 + i, L"thread", UPL::ToString(t));
+			local.popFileName ();
+		});
+	for (auto & th : threads)
+		th.join ();
+
+	assert (rep.count() == 20 && rep.keptCount() == 10 && rep.droppedCount() == 10);
+
+	// The cap keeps the first reports in merge order, whichever thread
+	// got to them first: those of the first two files.
+	auto const merged = rep.merge();
+	assert (merged.size() == 10 && merged[0].file() == "file-0.upl" && merged[9].file() == "file-1.upl");
+	(void)merged;
+
+	UPL::Error::Reporter err;
+	rep.mergeInto (err);
+	ReportErrors (err);
+	wcout << "(" << rep.droppedCount(Severity::Warning) << " more warnings not shown)" << endl;
+}
+
+//----------------------------------------------------------------------
+
+void TestErrorSinks ()
+{
+	using std::wcout;
+	using std::endl;
+
+	// stdout has gone wide-oriented by now, so the text goes to stderr.
+	UPL::Error::TextSink text (stderr);
+	FILE * json_file = tmpfile();
+	FILE * bin_file = tmpfile();
+
+	{
+		UPL::Error::JSONLinesSink json (json_file);
+		UPL::Error::BinarySink bin (bin_file, 2);
+
+		struct Tee : UPL::Error::Sink
+		{
+			std::vector<UPL::Error::Sink *> sinks;
+			void consume (UPL::Error::Record const & r) override {for (auto s : sinks) s->consume(r);}
+			void flush () override {for (auto s : sinks) s->flush();}
+		} tee;
+		tee.sinks = {&text, &json, &bin};
+
+		UPL::Error::Reporter err;
+		err.setSink (&tee, false);
+		err.pushFileName ("sample-program-00.upl");
+		err.newLexerWarning (UPL::Location(3, 5), 12, L"a \"quoted\" message");
+		err.newParserError (UPL::Location(7, 1), -3, L"unicode: \u00e9\u4e2d");
+		err.popFileName ();
+		err.newCodeGenNote (UPL::Location(), 0);
+		assert (err.count() == 3 && err.reports().empty());
+	}
+
+	std::vector<UPL::Error::Record> back;
+	rewind (bin_file);
+	bool ok = UPL::Error::ReadBinaryDiagnostics(bin_file, back);
+	assert (ok && back.size() == 3);
+	assert (back[1].number() == -3 && back[1].message() == L"unicode: \u00e9\u4e2d");
+	(void)ok;
+
+	UPL::Error::Reporter round_trip;
+	for (auto const & r : back)
+	{
+		round_trip.pushFileName (r.file());
+		round_trip.newReport (r.location(), r.severity(), r.category(), r.number(), r.message());
+		round_trip.popFileName ();
+	}
+	ReportErrors (round_trip);
+
+	rewind (json_file);
+	char line [512];
+	while (fgets(line, sizeof(line), json_file))
+		wcout << UPL::ToString<char const *>(line);
+
+	fclose (json_file);
+	fclose (bin_file);
+
+	// A flood of errors is still written in batches: the first error goes
+	// out at once, the rest (almost all) with full batches.
+	FILE * flood_file = tmpfile();
+	size_t flood_writes;
+	{
+		UPL::Error::JSONLinesSink flood (flood_file);
+		UPL::Error::Reporter err;
+		err.setSink (&flood, false);
+		err.pushFileName ("flood.upl");
+		for (int i = 0; i < 100000; ++i)
+			err.newParserError (UPL::Location(i + 1, 1), 1, L"flooded");
+		err.popFileName ();
+		flood.flush ();
+		assert (flood.recordsWritten() == 100000);
+		flood_writes = flood.writeCount();
+	}
+	fclose (flood_file);
+	assert (flood_writes < 100000 / UPL::Error::BufferedSink::msc_DefaultBatchRecords + 100);
+	wcout << "100000 errors took " << flood_writes << " writes" << endl;
+
+	// An error held back goes out once it has waited the interval, even
+	// if nothing comes after it
+	FILE * quiet_file = tmpfile();
+	{
+		UPL::Error::TextSink quiet (quiet_file, UPL::Error::BufferedSink::msc_DefaultBatchRecords,
+			UPL::Error::BufferedSink::msc_DefaultBatchBytes, 20);
+		UPL::Error::Reporter err;
+		err.setSink (&quiet, false);
+		err.pushFileName ("quiet.upl");
+		err.newParserError (UPL::Location(1, 1), 1, L"first");
+		err.newParserError (UPL::Location(2, 1), 1, L"held back");
+		err.poll ();
+		assert (1 == quiet.recordsWritten());
+		std::this_thread::sleep_for (std::chrono::milliseconds(30));
+		err.poll ();
+		assert (2 == quiet.recordsWritten() && 2 == quiet.writeCount());
+		err.popFileName ();
+	}
+	fclose (quiet_file);
+}
+
+//----------------------------------------------------------------------
+
+void TestVM ()
+{
+	using std::wcout;
+	using std::endl;
+	using UPL::Type::Tag;
+	using UPL::Type::ID;
+	using UPL::Type::Unpacked;
+	using UPL::VM::Op;
+	using UPL::VM::Reg;
+
+	UPL::Error::Reporter err;
+	UPL::VM::Module mod;
+	auto & types = mod.types();
+
+	auto t_int = types.createType(Unpacked(Tag::Int, false));
+	auto t_real = types.createType(Unpacked(Tag::Real, false));
+	auto t_foo = types.createType(Unpacked(Tag::Function, false, t_real, std::vector<ID>{t_int, t_int}));
+	auto t_fib = types.createType(Unpacked(Tag::Function, false, t_int, std::vector<ID>{t_int}));
+
+	// def Foo = func(int a, int b)->real {def invalid = b == 0; invalid ? 0 : real(a) / real(b);};
+	// a: r0, b: r1, invalid: r2, temporaries: r3, r4
+	{
+		Op eq, div;
+		UPL::CodeGen::SelectBinaryOp (types, t_int, UPL::CodeGen::BinaryOp::Eq, eq);
+		UPL::CodeGen::SelectBinaryOp (types, t_real, UPL::CodeGen::BinaryOp::Div, div);
+
+		UPL::VM::Assembler as;
+		auto else_label = as.newLabel();
+		as.emitLoadInt (3, 0, mod);
+		as.emit (eq, 2, 1, 3);
+		as.emitJump (Op::JmpF, 2, else_label);
+		as.emitLoadReal (3, 0.0, mod);
+		as.emit (Op::Ret, 3);
+		as.bind (else_label);
+		as.emit (Op::IToR, 3, 0);
+		as.emit (Op::IToR, 4, 1);
+		as.emit (div, 3, 3, 4);
+		as.emit (Op::Ret, 3);
+
+		std::vector<UPL::VM::Instruction> code;
+		bool ok = as.finish(code);
+		assert (ok);
+		(void)ok;
+		mod.addFunction ("Foo", t_foo, 2, 5, code);
+	}
+
+	// def Fib = func(int n)->int {n < 2 ? n : Fib(n - 1) + Fib(n - 2);};
+	// n: r0, temporaries: r1 ... r4
+	{
+		auto fib = mod.declareFunction("Fib", t_fib, 1);
+
+		UPL::VM::Assembler as;
+		auto recurse = as.newLabel();
+		as.emitLoadInt (1, 2, mod);
+		as.emit (Op::LtI, 1, 0, 1);
+		as.emitJump (Op::JmpF, 1, recurse);
+		as.emit (Op::Ret, 0);
+		as.bind (recurse);
+		as.emitBx (Op::LoadF, 1, uint16_t(fib));
+		as.emitLoadInt (3, 1, mod);
+		as.emit (Op::SubI, 2, 0, 3);
+		as.emit (Op::Call, 1, 1);			// r1 = Fib(n - 1)
+		as.emitBx (Op::LoadF, 2, uint16_t(fib));
+		as.emitLoadInt (4, 2, mod);
+		as.emit (Op::SubI, 3, 0, 4);
+		as.emit (Op::Call, 2, 1);			// r2 = Fib(n - 2)
+		as.emit (Op::AddI, 1, 1, 2);
+		as.emit (Op::Ret, 1);
+
+		std::vector<UPL::VM::Instruction> code;
+		bool ok = as.finish(code);
+		assert (ok);
+		(void)ok;
+		mod.defineFunction (fib, 5, code);
+	}
+
+	wcout << mod.disassemble(0) << mod.disassemble(1);
+
+	// A constant whose index doesn't fit in Bx can't be loaded
+	{
+		UPL::VM::Module big;
+		UPL::VM::Assembler as;
+		for (uint32_t i = 0; i <= UPL::VM::Assembler::msc_MaxBx; ++i)
+			big.addConstant (Reg::FromInt(i));
+		as.emitLoadReal (0, 0.5, big);
+		as.emit (Op::Ret, 0);
+		std::vector<UPL::VM::Instruction> code;
+		bool const ok = as.finish(code);
+		assert (!ok && as.bxOutOfRange());
+		(void)ok;
+	}
+
+	UPL::VM::Heap heap (mod.types());
+	UPL::VM::Interpreter vm (mod, err, heap);
+	Reg result;
+
+	Reg foo_args [] = {Reg::FromInt(22), Reg::FromInt(7)};
+	vm.call (mod.findFunction("Foo"), foo_args, 2, result);
+	wcout << "Foo(22, 7) = " << result.r << endl;
+	foo_args[1] = Reg::FromInt(0);
+	vm.call (mod.findFunction("Foo"), foo_args, 2, result);
+	wcout << "Foo(22, 0) = " << result.r << endl;
+
+	Reg fib_args [] = {Reg::FromInt(27)};
+	auto start = std::chrono::steady_clock::now();
+	vm.call (mod.findFunction("Fib"), fib_args, 1, result);
+	auto secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	wcout
+		<< "Fib(27) = " << result.i << " in " << secs << "s; "
+		<< vm.stats().instructions << " instructions, " << vm.stats().calls << " calls, max depth "
+		<< vm.stats().max_frame_depth << endl;
+	assert (result.i == 196418);
+
+	// A run-time error: an overly deep recursion
+	UPL::VM::Interpreter small_vm (mod, err, heap, 64);
+	fib_args[0] = Reg::FromInt(100);
+	bool ok = small_vm.call(mod.findFunction("Fib"), fib_args, 1, result);
+	assert (!ok && small_vm.lastError() == UPL::VM::RunError::StackOverflow);
+
+	// Round trip through a module file, and run the mapped copy
+	auto const file = TempPath("playpen-test.uplm");
+	auto const path = file.c_str();
+	auto res = UPL::VM::SaveModule(mod, path);
+	assert (UPL::VM::ModuleFileError::None == res);
+	UPL::VM::Module loaded;
+	start = std::chrono::steady_clock::now();
+	res = UPL::VM::LoadModule(path, loaded, true);
+	secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	assert (UPL::VM::ModuleFileError::None == res && loaded.isImage());
+	assert (loaded.types().size() == mod.types().size() && loaded.codeSize() == mod.codeSize());
+	(void)res;
+	wcout << "Loaded " << path << " in " << secs * 1e6 << "us" << endl;
+
+	UPL::VM::Heap loaded_heap (loaded.types());
+	UPL::VM::Interpreter loaded_vm (loaded, err, loaded_heap);
+	fib_args[0] = Reg::FromInt(27);
+	ok = loaded_vm.call(loaded.findFunction("Fib"), fib_args, 1, result);
+	assert (ok && result.i == 196418);
+	(void)ok;
+	remove (path);
+
+	ReportErrors (err);
+}
+
+//----------------------------------------------------------------------
+// For comparison with VM::Value: the obvious tagged union.
+struct NaiveValue
+{
+	UPL::Type::ID type;
+	union {
+		UPL::Int i;
+		UPL::Real r;
+		UPL::Bool b;
+		void * p;
+	};
+};
+
+//----------------------------------------------------------------------
+
+void TestValues ()
+{
+	using std::wcout;
+	using std::endl;
+	using UPL::VM::Value;
+	using UPL::Type::Tag;
+	using UPL::Type::STContainer;
+
+	Value v;
+	assert (v.isNil() && v.typeID() == STContainer::DefaultID(Tag::Nil));
+	v = Value::FromInlineInt(-12345678901LL);
+	assert (v.kind() == Value::Kind::Int && v.asInt() == -12345678901LL);
+	v = Value::FromReal(-2.5);
+	assert (v.isReal() && v.asReal() == -2.5 && v.typeID() == STContainer::DefaultID(Tag::Real));
+	v = Value::FromReal(0.0 / 0.0);
+	assert (v.isReal());
+	bool ok = Value::TryFromSmallString("h\xC3\xA9!", 4, v);
+	assert (ok && v.smallStringSize() == 4 && v.typeID() == STContainer::DefaultID(Tag::String));
+	ok = Value::TryFromSmallString("too long", 8, v);
+	assert (!ok);
+	(void)ok;
+	UPL::VM::BoxedInt big;
+	big.type = STContainer::DefaultID(Tag::Int);
+	big.value = UPL::Int(1) << 60;
+	v = Value::FromObject(&big);
+	assert (v.isObject() && v.asInt() == big.value && v.typeID() == big.type);
+
+	Value samples [] = {Value::Nil(), Value::FromBool(true), Value::FromChar(L'x'), Value::FromInlineInt(42), Value::FromReal(3.25), v};
+	for (auto s : samples)
+		wcout << UPL::VM::Printable(s) << " : type " << s.typeID() << endl;
+
+	// Micro-benchmark: generic arithmetic and type dispatch over a mix of
+	// ints and reals, in both representations.
+	int const N = 1 << 20;
+	int const Rounds = 20;
+	std::vector<Value> boxed (N);
+	std::vector<NaiveValue> naive (N);
+	for (int i = 0; i < N; ++i)
+	{
+		if (i % 3)
+		{
+			boxed[i] = Value::FromInlineInt(i);
+			naive[i].type = STContainer::DefaultID(Tag::Int);
+			naive[i].i = i;
+		}
+		else
+		{
+			boxed[i] = Value::FromReal(i * 0.5);
+			naive[i].type = STContainer::DefaultID(Tag::Real);
+			naive[i].r = i * 0.5;
+		}
+	}
+
+	auto time = [](char const * what, std::function<double ()> const & f) {
+		auto start = std::chrono::steady_clock::now();
+		double r = f();
+		auto ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+		wcout << "  " << what << ": " << ns / (double(N) * Rounds) << " ns/value (" << r << ")" << endl;
+	};
+
+	wcout << "sizeof(Value) = " << sizeof(Value) << ", sizeof(NaiveValue) = " << sizeof(NaiveValue) << endl;
+
+	time ("nan-boxed, arithmetic", [&]{
+		UPL::Int ai = 0; UPL::Real ar = 0;
+		for (int k = 0; k < Rounds; ++k)
+			for (auto const & x : boxed)
+				if (x.isReal()) ar += x.asReal(); else ai += x.asInt();
+		return ar + ai;
+	});
+	time ("tagged-union, arithmetic", [&]{
+		UPL::Int ai = 0; UPL::Real ar = 0;
+		for (int k = 0; k < Rounds; ++k)
+			for (auto const & x : naive)
+				if (x.type == STContainer::DefaultID(Tag::Real)) ar += x.r; else ai += x.i;
+		return ar + ai;
+	});
+	time ("nan-boxed, type dispatch", [&]{
+		double acc = 0;
+		for (int k = 0; k < Rounds; ++k)
+			for (auto const & x : boxed)
+				switch (x.kind())
+				{
+				case Value::Kind::Int: acc += 1; break;
+				case Value::Kind::Real: acc += 2; break;
+				default: acc += 3; break;
+				}
+		return acc;
+	});
+	time ("tagged-union, type dispatch", [&]{
+		double acc = 0;
+		for (int k = 0; k < Rounds; ++k)
+			for (auto const & x : naive)
+				switch (x.type)
+				{
+				case 8: acc += 1; break;
+				case 10: acc += 2; break;
+				default: acc += 3; break;
+				}
+		return acc;
+	});
+}
+
+//----------------------------------------------------------------------
+
+void PrintHeapStats (UPL::VM::Heap const & heap)
+{
+	using std::wcout;
+	using std::endl;
+
+	auto const st = heap.stats();
+	wcout
+		<< "  allocated " << st.objects_allocated << " objects, " << st.bytes_allocated << " bytes ("
+		<< st.bytes_pretenured << " pretenured), promoted " << st.bytes_promoted << ", freed " << st.bytes_freed << endl
+		<< "  old: " << st.old_used << " used, " << st.old_free << " free, top " << st.old_top
+		<< "; " << st.dirty_cards_scanned << " dirty cards scanned" << endl;
+
+	auto print = [](char const * what, UPL::VM::PauseHistogram const & h) {
+		wcout << "  " << what << ": " << h.count << " pauses, avg " << h.averageMicroseconds()
+			<< "us, max " << h.max_ns / 1000.0 << "us; histogram (us):";
+		for (int i = 0; i < UPL::VM::PauseHistogram::msc_BucketCount; ++i)
+			if (h.buckets[i])
+				wcout << " [" << (i ? (1 << i) : 0) << ".." << (2 << i) << "):" << h.buckets[i];
+		wcout << endl;
+	};
+	print ("minor", st.minor_pauses);
+	print ("major", st.major_pauses);
+}
+
+//----------------------------------------------------------------------
+
+void TestHeap ()
+{
+	using std::wcout;
+	using std::endl;
+	using UPL::Type::Tag;
+	using UPL::Type::ID;
+	using UPL::Type::Size;
+	using UPL::Type::Unpacked;
+	using UPL::Type::STContainer;
+	using UPL::VM::Heap;
+	using UPL::VM::Object;
+	using UPL::VM::Value;
+	using UPL::VM::Op;
+	using UPL::VM::Reg;
+
+	UPL::Error::Reporter err;
+	UPL::VM::Module mod;
+	auto & types = mod.types();
+
+	auto const t_int = STContainer::DefaultID(Tag::Int);
+	auto const t_any = STContainer::DefaultID(Tag::Any);
+	auto const t_str = STContainer::DefaultID(Tag::String);
+	auto const t_node = types.createType(Unpacked(Tag::Tuple, false, std::vector<ID>{t_int, t_any}));	// (value, next)
+	auto const t_strs = types.createType(Unpacked(Tag::Vector, false, t_str));
+	auto const t_vi = types.createType(Unpacked(Tag::Vector, false, t_int));
+	auto const t_vvi = types.createType(Unpacked(Tag::Vector, false, t_vi));
+	auto const t_build = types.createType(Unpacked(Tag::Function, false, t_int, std::vector<ID>{t_int}));
+
+	UPL::VM::HeapConfig config;
+	config.nursery_size = 256 << 10;
+	config.min_major_threshold = 1 << 20;
+	Heap heap (types, config);
+
+	// From the host: a list that survives while garbage is made, and a
+	// (pretenured, so old) table whose slots keep getting young strings.
+	{
+		int const N = 20000, Slots = 10000;
+		Value list, table;
+		heap.addRoot (&list);
+		heap.addRoot (&table);
+		table = Value::FromObject(heap.allocate(t_strs, Slots));
+		std::vector<std::string> expected (Slots);
+
+		Size value_offset, next_offset, elem_offset, elem_stride;
+		ID field_type, elem_type;
+		auto const any_payload = heap.layouts().layout(t_any).field_offsets[1];
+
+		for (int i = 0; i < N; ++i)
+		{
+			auto const node = heap.allocate(t_node);
+			auto const fields = static_cast<uint8_t *>(heap.payload(node));
+			heap.fieldInfo (node, 0, value_offset, field_type);
+			heap.fieldInfo (node, 1, next_offset, field_type);
+			UPL::Int v = i;
+			memcpy (fields + value_offset, &v, sizeof(v));
+			if (list.isObject())
+			{
+				Object * next = list.asObject();
+				memcpy (fields + next_offset, &t_node, sizeof(t_node));
+				memcpy (fields + next_offset + any_payload, &next, sizeof(next));
+				heap.writeBarrier (node, fields + next_offset + any_payload, next);
+			}
+			list = Value::FromObject(node);
+
+			for (int j = 0; j < 8; ++j)
+				heap.newString ("some garbage", 12);
+
+			auto const slot = (i * 7919) % Slots;
+			expected[slot] = "string #" + std::to_string(i);
+			auto const str = heap.newString(expected[slot].data(), expected[slot].size());
+			auto const tbl = table.asObject();
+			heap.elementInfo (tbl, elem_offset, elem_type, elem_stride);
+			auto const at = static_cast<uint8_t *>(heap.payload(tbl)) + elem_offset + slot * elem_stride;
+			Object * str_obj = str.asObject();
+			memcpy (at, &str_obj, sizeof(str_obj));
+			heap.writeBarrier (tbl, at, str_obj);
+		}
+
+		int count = 0;
+		for (Value p = list; p.isObject(); ++count)
+		{
+			auto const fields = static_cast<uint8_t *>(heap.payload(p.asObject()));
+			UPL::Int v;
+			memcpy (&v, fields + value_offset, sizeof(v));
+			assert (v == N - 1 - count);
+			ID next_type;
+			memcpy (&next_type, fields + next_offset, sizeof(next_type));
+			Object * next;
+			memcpy (&next, fields + next_offset + any_payload, sizeof(next));
+			p = (next_type == t_node) ? Value::FromObject(next) : Value::Nil();
+		}
+		assert (count == N);
+
+		auto const tbl = table.asObject();
+		for (int slot = 0; slot < Slots; ++slot)
+		{
+			Object * str;
+			memcpy (&str, static_cast<uint8_t *>(heap.payload(tbl)) + elem_offset + slot * elem_stride, sizeof(str));
+			assert (nullptr != str && str->type == t_str);
+			auto const chars = static_cast<char const *>(heap.payload(str)) + sizeof(uint32_t);
+			assert (std::string(chars, heap.countOf(str)) == expected[slot]);
+			(void)chars;
+		}
+
+		wcout << "Host-built list of " << count << " nodes and a table of " << Slots << " strings survived:" << endl;
+		PrintHeapStats (heap);
+		heap.removeRoot (&table);
+		heap.removeRoot (&list);
+	}
+
+	// From the VM: build a vector of small vectors, boxing big ints as
+	// garbage along the way, then sum it. r1 (the outer vector) and r3
+	// (the inner one) are live across the safepoints that may move them.
+	// def Build = func(int n)->int {...}
+	// n: r0, outer: r1, i: r2, inner: r3, temporaries: r4, r6, r7, r8, sum: r5, one: r9
+	{
+		UPL::VM::Assembler as;
+		auto const l_build = as.newLabel(), l_sum = as.newLabel(), l_sum_loop = as.newLabel(), l_done = as.newLabel();
+		as.emitBx (Op::LoadK, 6, uint16_t(mod.addConstant(Reg::FromInt(t_vvi))));
+		as.emit (Op::NewN, 1, 6, 0);
+		as.setLive (1, true);
+		as.emitLoadInt (2, 0, mod);
+		as.emitLoadInt (5, 0, mod);
+		as.emitLoadInt (9, 1, mod);
+		as.emitLoadInt (8, UPL::Int(1) << 50, mod);
+		as.bind (l_build);
+		as.emit (Op::LtI, 4, 2, 0);
+		as.emitJump (Op::JmpF, 4, l_sum);
+		as.emitBx (Op::LoadK, 6, uint16_t(mod.addConstant(Reg::FromInt(t_vi))));
+		as.emitLoadInt (4, 3, mod);
+		as.emit (Op::NewN, 3, 6, 4);
+		as.setLive (3, true);
+		as.emitLoadInt (4, 0, mod);
+		as.emit (Op::SetE, 3, 4, 2);		// inner[0] = i
+		as.emit (Op::AddI, 7, 8, 2);
+		as.emit (Op::BoxI, 7, 7);			// garbage
+		as.emit (Op::SetE, 1, 2, 3);		// outer[i] = inner
+		as.setLive (3, false);
+		as.emit (Op::AddI, 2, 2, 9);
+		as.emitJump (Op::Jmp, 0, l_build);
+		as.bind (l_sum);
+		as.emitLoadInt (2, 0, mod);
+		as.bind (l_sum_loop);
+		as.emit (Op::LtI, 4, 2, 0);
+		as.emitJump (Op::JmpF, 4, l_done);
+		as.emit (Op::GetE, 3, 1, 2);
+		as.emitLoadInt (4, 0, mod);
+		as.emit (Op::GetE, 4, 3, 4);
+		as.emit (Op::AddI, 5, 5, 4);
+		as.emit (Op::AddI, 2, 2, 9);
+		as.emitJump (Op::Jmp, 0, l_sum_loop);
+		as.bind (l_done);
+		as.emit (Op::Ret, 5);
+
+		std::vector<UPL::VM::Instruction> code;
+		std::vector<UPL::VM::StackMap> stack_maps;
+		bool ok = as.finish(code, &stack_maps);
+		assert (ok);
+		(void)ok;
+		mod.addFunction ("Build", t_build, 1, 10, code, stack_maps);
+	}
+
+	wcout << mod.disassemble(0);
+
+	UPL::VM::Interpreter vm (mod, err, heap);
+	Reg result, args [] = {Reg::FromInt(50000)};
+	auto start = std::chrono::steady_clock::now();
+	bool ok = vm.call(mod.findFunction("Build"), args, 1, result);
+	auto secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	assert (ok && result.i == 50000LL * 49999 / 2);
+	(void)ok;
+	wcout << "Build(50000) = " << result.i << " in " << secs << "s:" << endl;
+	PrintHeapStats (heap);
+
+	heap.collect ();
+	wcout << "After a full collection:" << endl;
+	PrintHeapStats (heap);
+	ReportErrors (err);
+}
+
+//======================================================================
+
+void TestMaps ()
+{
+	using std::wcout;
+	using std::endl;
+	using UPL::Int;
+	using UPL::Type::Tag;
+	using UPL::Type::Unpacked;
+	using UPL::Type::STContainer;
+	using UPL::VM::Hamt;
+	using UPL::VM::Object;
+	using UPL::VM::Value;
+
+	UPL::VM::Module mod;
+	auto & types = mod.types();
+	auto const t_int = STContainer::DefaultID(Tag::Int);
+	auto const t_ii = types.createType(Unpacked(Tag::Map, false, t_int, t_int, 0));
+	auto const t_si = types.createType(Unpacked(Tag::Map, false, STContainer::DefaultID(Tag::String), t_int, 0));
+	auto const t_ai = types.createType(Unpacked(Tag::Map, false, STContainer::DefaultID(Tag::Any), t_int, 0));
+	auto const t_ri = types.createType(Unpacked(Tag::Map, false, STContainer::DefaultID(Tag::Real), t_int, 0));
+
+	UPL::VM::HeapConfig config;
+	config.nursery_size = 1 << 20;
+	UPL::VM::Heap heap (types, config);
+	Hamt hamt (heap);
+
+	auto const checked = [] (Object * map) {assert (nullptr != map); return Value::FromObject(map);};
+	auto const lookup = [&hamt] (Value map, Value key, Int & out) {
+		Value v;
+		if (!hamt.find(map.asObject(), key, v))
+			return false;
+		out = v.asInt();
+		return true;
+	};
+
+	// Against std::unordered_map, with enough random (and mostly boxed)
+	// 64-bit keys that a few of their hashes collide. Some versions are
+	// kept along the way, and must stay as they were.
+	{
+		int const N = 200000, Kept = 8;
+		std::mt19937_64 rng (42);
+		std::unordered_map<Int, Int> expected, kept_expected [Kept];
+		std::vector<Int> keys;
+		Value map = checked(hamt.newMap(t_ii)), kept [Kept];
+		heap.addRoot (&map);
+		for (int k = 0; k < Kept; ++k)
+			heap.addRoot (kept + k);
+
+		for (int i = 0; i < N; ++i)
+		{
+			auto const r = rng();
+			Int key;
+			if (keys.empty() || r % 8 < 5)
+			{
+				key = Int(rng());
+				keys.push_back (key);
+			}
+			else
+				key = keys[(r >> 8) % keys.size()];
+
+			auto const boxed = heap.newInt(key);
+			if (7 == r % 8)
+			{
+				map = checked(hamt.remove(map.asObject(), boxed));
+				expected.erase (key);
+			}
+			else
+			{
+				map = checked(hamt.set(map.asObject(), boxed, Value::FromInlineInt(i)));
+				expected[key] = i;
+			}
+
+			if (0 == (i + 1) % (N / Kept))
+			{
+				kept[i / (N / Kept)] = map;
+				kept_expected[i / (N / Kept)] = expected;
+			}
+		}
+
+		for (int k = 0; k < Kept; ++k)
+		{
+			assert (hamt.size(kept[k].asObject()) == kept_expected[k].size());
+			for (auto const & e : kept_expected[k])
+			{
+				Int v = -1;
+				bool const found = lookup(kept[k], heap.newInt(e.first), v);
+				assert (found && v == e.second);
+				(void)found;
+			}
+		}
+
+		size_t seen = 0;
+		hamt.forEach (map.asObject(), [&] (Value key, Value value) {
+			auto const e = expected.find(key.asInt());
+			assert (e != expected.end() && e->second == value.asInt());
+			(void)e;
+			++seen;
+		});
+		assert (seen == expected.size() && hamt.size(map.asObject()) == expected.size());
+
+		for (auto key : keys)
+			map = checked(hamt.remove(map.asObject(), heap.newInt(key)));
+		assert (0 == hamt.size(map.asObject()) && 0 == Hamt::Used(static_cast<UPL::VM::MapNode *>(map.asObject())));
+
+		wcout
+			<< "  " << N << " random changes, checked against std::unordered_map; " << Kept
+			<< " old versions intact, " << heap.stats().minor_collections << " minor collections along the way" << endl;
+
+		for (int k = Kept; k-- > 0; )
+			heap.removeRoot (kept + k);
+		heap.removeRoot (&map);
+	}
+
+	// Keys by their type: strings by content, "any" by what each turns
+	// out to be, and -0.0 is 0.0
+	{
+		Value map = checked(hamt.newMap(t_si));
+		heap.addRoot (&map);
+		for (int i = 0; i < 1000; ++i)
+		{
+			auto const s = (i % 2 ? "a longer key #" : "k") + std::to_string(i);
+			auto const key = heap.newString(s.data(), s.size());
+			map = checked(hamt.set(map.asObject(), key, Value::FromInlineInt(i)));
+		}
+		for (int i = 0; i < 1000; ++i)
+		{
+			auto const s = (i % 2 ? "a longer key #" : "k") + std::to_string(i);
+			Int v = -1;
+			bool const found = lookup(map, heap.newString(s.data(), s.size()), v);
+			assert (found && v == i);
+			(void)found;
+		}
+
+		map = checked(hamt.newMap(t_ai));
+		Value const small = heap.newString("five!", 5);
+		map = checked(hamt.set(map.asObject(), Value::FromInlineInt(5), Value::FromInlineInt(1)));
+		map = checked(hamt.set(map.asObject(), Value::FromReal(5.0), Value::FromInlineInt(2)));
+		map = checked(hamt.set(map.asObject(), small, Value::FromInlineInt(3)));
+		map = checked(hamt.set(map.asObject(), heap.newInt(Int(1) << 60), Value::FromInlineInt(4)));
+		map = checked(hamt.set(map.asObject(), heap.newString("a longer five", 13), Value::FromInlineInt(5)));
+		Int v = 0;
+		assert (5 == hamt.size(map.asObject()));
+		assert (lookup(map, heap.newInt(Int(1) << 60), v) && 4 == v);
+		assert (lookup(map, heap.newString("a longer five", 13), v) && 5 == v);
+		assert (lookup(map, Value::FromReal(5.0), v) && 2 == v);
+		assert (!lookup(map, Value::FromInlineInt(6), v));
+
+		map = checked(hamt.newMap(t_ri));
+		map = checked(hamt.set(map.asObject(), Value::FromReal(0.0), Value::FromInlineInt(1)));
+		map = checked(hamt.set(map.asObject(), Value::FromReal(-0.0), Value::FromInlineInt(2)));
+		assert (1 == hamt.size(map.asObject()) && lookup(map, Value::FromReal(0.0), v) && 2 == v);
+		(void)v;
+
+		wcout << "  String, \"any\" and real keys work by value" << endl;
+		heap.removeRoot (&map);
+	}
+
+	// Keys whose hashes are the same (all 32 bits; found by search), so
+	// they share a collision node at the bottom: removing from it, until
+	// it's empty
+	{
+		static Int const sc_Pairs [][2] = {{16091, 94704}, {15919, 136418}, {126594, 147696}};
+		Value map = checked(hamt.newMap(t_ii));
+		heap.addRoot (&map);
+		for (auto const & p : sc_Pairs)
+			for (int j = 0; j < 2; ++j)
+				map = checked(hamt.set(map.asObject(), Value::FromInlineInt(p[j]), Value::FromInlineInt(p[j] + 1)));
+		Int v = 0;
+		assert (6 == hamt.size(map.asObject()));
+		for (auto const & p : sc_Pairs)
+		{
+			map = checked(hamt.remove(map.asObject(), Value::FromInlineInt(p[0])));
+			assert (!lookup(map, Value::FromInlineInt(p[0]), v) && lookup(map, Value::FromInlineInt(p[1]), v) && p[1] + 1 == v);
+			map = checked(hamt.remove(map.asObject(), Value::FromInlineInt(p[1])));
+			assert (!lookup(map, Value::FromInlineInt(p[1]), v));
+		}
+		assert (0 == hamt.size(map.asObject()));
+		(void)v;
+
+		wcout << "  Keys whose hashes collide are found and removed" << endl;
+		heap.removeRoot (&map);
+	}
+
+	// Transients: a batch of changes in place, while the version it
+	// started from stays as it was
+	{
+		int const N = 20000;
+		Value before = checked(hamt.newMap(t_ii)), map;
+		heap.addRoot (&before);
+		heap.addRoot (&map);
+		for (int i = 0; i < N; ++i)
+			before = checked(hamt.set(before.asObject(), Value::FromInlineInt(i), Value::FromInlineInt(i)));
+
+		auto const allocated = heap.stats().bytes_allocated;
+		auto const edit = hamt.beginEdit();
+		map = before;
+		for (int i = 0; i < 2 * N; ++i)
+			map = checked(hamt.set(map.asObject(), Value::FromInlineInt(i), Value::FromInlineInt(-i), edit));
+		for (int i = 0; i < N / 2; ++i)
+			map = checked(hamt.remove(map.asObject(), Value::FromInlineInt(3 * i), edit));
+		hamt.endEdit (edit);
+		auto const edit_bytes = heap.stats().bytes_allocated - allocated;
+
+		Int v = 0;
+		assert (hamt.size(before.asObject()) == uint32_t(N) && lookup(before, Value::FromInlineInt(7), v) && 7 == v);
+		assert (hamt.size(map.asObject()) == uint32_t(2 * N - N / 2) && lookup(map, Value::FromInlineInt(7), v) && -7 == v);
+		assert (!lookup(map, Value::FromInlineInt(3), v));
+
+		// Done with, it's persistent again
+		auto const after = checked(hamt.set(map.asObject(), Value::FromInlineInt(7), Value::FromInlineInt(0)));
+		assert (lookup(map, Value::FromInlineInt(7), v) && -7 == v && lookup(after, Value::FromInlineInt(7), v) && 0 == v);
+		(void)v;
+		(void)after;
+
+		wcout << "  a transient batch of " << 2 * N + N / 2 << " changes allocated " << edit_bytes / 1024 << "KB" << endl;
+		heap.removeRoot (&map);
+		heap.removeRoot (&before);
+	}
+
+	// Timings: insert, lookup and update N keys, persistently (every
+	// version kept until the next one), against std::unordered_map
+	// copied on each write.
+	for (int n : {1000, 5000})
+	{
+		typedef std::unordered_map<Int, Int> StdMap;
+		auto const key_of = [] (int i) {return Int((uint64_t(i) * 0x9E3779B97F4A7C15ULL) >> 17);};
+		auto const now = [] {return std::chrono::steady_clock::now();};
+		auto const ms = [] (std::chrono::steady_clock::time_point since) {
+			return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - since).count();
+		};
+
+		heap.collect ();
+		Value map = checked(hamt.newMap(t_ii)), transient;
+		heap.addRoot (&map);
+		heap.addRoot (&transient);
+		double hamt_ms [4], cow_ms [3];
+
+		auto start = now();
+		for (int i = 0; i < n; ++i)
+			map = checked(hamt.set(map.asObject(), Value::FromInlineInt(key_of(i)), Value::FromInlineInt(i)));
+		hamt_ms[0] = ms(start);
+
+		start = now();
+		auto const edit = hamt.beginEdit();
+		transient = checked(hamt.newMap(t_ii));
+		for (int i = 0; i < n; ++i)
+			transient = checked(hamt.set(transient.asObject(), Value::FromInlineInt(key_of(i)), Value::FromInlineInt(i), edit));
+		hamt.endEdit (edit);
+		hamt_ms[3] = ms(start);
+
+		Int volatile sum = 0;		// So that the lookups can't be moved out of the timings
+		Int v = 0;
+		start = now();
+		for (int i = 0; i < n; ++i)
+			sum += lookup(map, Value::FromInlineInt(key_of(i)), v) ? v : 0;
+		hamt_ms[1] = ms(start);
+
+		start = now();
+		for (int i = 0; i < n; ++i)
+			map = checked(hamt.set(map.asObject(), Value::FromInlineInt(key_of(i)), Value::FromInlineInt(-i)));
+		hamt_ms[2] = ms(start);
+
+		auto cow = std::make_shared<StdMap>();
+		start = now();
+		for (int i = 0; i < n; ++i)
+		{
+			auto next = std::make_shared<StdMap>(*cow);
+			(*next)[key_of(i)] = i;
+			cow = next;
+		}
+		cow_ms[0] = ms(start);
+
+		Int volatile cow_sum = 0;
+		start = now();
+		for (int i = 0; i < n; ++i)
+		{
+			auto const e = cow->find(key_of(i));
+			cow_sum += (e != cow->end()) ? e->second : 0;
+		}
+		cow_ms[1] = ms(start);
+
+		start = now();
+		for (int i = 0; i < n; ++i)
+		{
+			auto next = std::make_shared<StdMap>(*cow);
+			(*next)[key_of(i)] = -i;
+			cow = next;
+		}
+		cow_ms[2] = ms(start);
+
+		assert (sum == cow_sum && hamt.size(map.asObject()) == cow->size());
+		(void)v;
+		wcout
+			<< "  " << n << " keys, HAMT vs copy-on-write std::unordered_map: insert " << hamt_ms[0] << "ms vs " << cow_ms[0]
+			<< "ms (transient " << hamt_ms[3] << "ms), lookup " << hamt_ms[1] << "ms vs " << cow_ms[1]
+			<< "ms (both summing to " << sum << "), update " << hamt_ms[2] << "ms vs " << cow_ms[2] << "ms" << endl;
+
+		heap.removeRoot (&transient);
+		heap.removeRoot (&map);
+	}
+}
+
+//======================================================================
+
+void TestVectors ()
+{
+	using std::wcout;
+	using std::endl;
+	using UPL::Int;
+	using UPL::Type::Tag;
+	using UPL::Type::Unpacked;
+	using UPL::Type::STContainer;
+	using UPL::VM::PVector;
+	using UPL::VM::Object;
+	using UPL::VM::Value;
+
+	UPL::VM::Module mod;
+	auto & types = mod.types();
+	auto const t_vi = types.createType(Unpacked(Tag::Vector, false, STContainer::DefaultID(Tag::Int)));
+	auto const t_vb = types.createType(Unpacked(Tag::Vector, false, STContainer::DefaultID(Tag::Byte)));
+	auto const t_vs = types.createType(Unpacked(Tag::Vector, false, STContainer::DefaultID(Tag::String)));
+
+	UPL::VM::HeapConfig config;
+	config.nursery_size = 1 << 20;
+	UPL::VM::Heap heap (types, config);
+	PVector pv (heap);
+
+	auto const checked = [] (Object * v) {assert (nullptr != v); return Value::FromObject(v);};
+	auto const get = [&pv] (Value v, uint32_t i) {
+		Int ret;
+		auto const at = pv.at(v.asObject(), i);
+		assert (nullptr != at);
+		memcpy (&ret, at, sizeof(ret));
+		return ret;
+	};
+	auto const same = [&pv, &get] (Value v, std::vector<Int> const & expected) {
+		if (pv.size(v.asObject()) != expected.size())
+			return false;
+		for (uint32_t i = 0; i < expected.size(); ++i)
+			if (get(v, i) != expected[i])
+				return false;
+		return true;
+	};
+
+	// Against std::vector: pushes, sets and slices (and pushes onto
+	// slices), keeping some versions along the way, that must stay as
+	// they were
+	{
+		int const N = 100000, Kept = 8;
+		std::mt19937_64 rng (7);
+		std::vector<Int> expected, kept_expected [Kept];
+		Value v = checked(pv.newVector(t_vi)), kept [Kept];
+		heap.addRoot (&v);
+		for (int k = 0; k < Kept; ++k)
+			heap.addRoot (kept + k);
+
+		for (int i = 0; i < N; ++i)
+		{
+			auto const r = rng();
+			Int x = Int(rng() >> 1);
+			if (r % 16 < 11 || expected.empty())
+			{
+				v = checked(pv.push(v.asObject(), &x));
+				expected.push_back (x);
+			}
+			else if (r % 16 < 15)
+			{
+				auto const at = uint32_t((r >> 8) % expected.size());
+				v = checked(pv.set(v.asObject(), at, &x));
+				expected[at] = x;
+			}
+			else
+			{
+				auto const from = uint32_t((r >> 8) % (expected.size() / 8 + 1));
+				auto const to = uint32_t(expected.size() - (r >> 32) % (expected.size() / 8 + 1));
+				v = checked(pv.slice(v.asObject(), from, to));
+				expected = std::vector<Int>(expected.begin() + from, expected.begin() + to);
+			}
+
+			if (0 == (i + 1) % (N / Kept))
+			{
+				kept[i / (N / Kept)] = v;
+				kept_expected[i / (N / Kept)] = expected;
+			}
+		}
+
+		for (int k = 0; k < Kept; ++k)
+		{
+			bool const ok = same(kept[k], kept_expected[k]);
+			assert (ok);
+			(void)ok;
+		}
+
+		wcout
+			<< "  " << N << " random pushes, sets and slices, checked against std::vector; " << Kept << " old versions intact, "
+			<< heap.stats().minor_collections << " minor collections along the way" << endl;
+
+		for (int k = Kept; k-- > 0; )
+			heap.removeRoot (kept + k);
+		heap.removeRoot (&v);
+	}
+
+	// Packed bytes, and references that keep their strings alive
+	{
+		Value bytes = checked(pv.newVector(t_vb)), strings = checked(pv.newVector(t_vs));
+		heap.addRoot (&bytes);
+		heap.addRoot (&strings);
+		for (int i = 0; i < 5000; ++i)
+		{
+			uint8_t const b = uint8_t(i * 7);
+			bytes = checked(pv.push(bytes.asObject(), &b));
+
+			auto const s = "string number " + std::to_string(i);
+			Object * str = heap.newString(s.data(), s.size()).asObject();
+			strings = checked(pv.push(strings.asObject(), &str));
+		}
+		heap.collect ();
+
+		assert (1 == pv.stride(bytes.asObject()) && 5000 == pv.size(strings.asObject()));
+		for (uint32_t i = 0; i < 5000; ++i)
+		{
+			assert (*pv.at(bytes.asObject(), i) == uint8_t(i * 7));
+			Object * str;
+			memcpy (&str, pv.at(strings.asObject(), i), sizeof(str));
+			auto const s = "string number " + std::to_string(i);
+			assert (heap.countOf(str) == s.size() && 0 == memcmp(static_cast<char *>(heap.payload(str)) + sizeof(uint32_t), s.data(), s.size()));
+			(void)str;
+		}
+		wcout << "  byte and string vectors survived a full collection" << endl;
+		heap.removeRoot (&strings);
+		heap.removeRoot (&bytes);
+	}
+
+	// Timings, per operation: push (persistent, every version kept until
+	// the next one, and transient), index, slice, and a sum through the
+	// leaves, against std::vector
+	for (int n : {10000, 1000000})
+	{
+		auto const now = [] {return std::chrono::steady_clock::now();};
+		auto const ns = [] (std::chrono::steady_clock::time_point since, int count) {
+			return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - since).count() / count;
+		};
+
+		heap.collect ();
+		Value v = checked(pv.newVector(t_vi)), transient, slice;
+		heap.addRoot (&v);
+		heap.addRoot (&transient);
+		heap.addRoot (&slice);
+
+		auto const allocated = heap.stats().bytes_allocated;
+		auto start = now();
+		for (Int i = 0; i < n; ++i)
+			v = checked(pv.push(v.asObject(), &i));
+		auto const push_ns = ns(start, n);
+		auto const push_bytes = heap.stats().bytes_allocated - allocated;
+
+		auto const edit = pv.beginEdit();
+		start = now();
+		transient = checked(pv.newVector(t_vi));
+		for (Int i = 0; i < n; ++i)
+			transient = checked(pv.push(transient.asObject(), &i, edit));
+		auto const transient_ns = ns(start, n);
+		pv.endEdit (edit);
+		auto const transient_bytes = heap.stats().bytes_allocated - allocated - push_bytes;
+
+		Int volatile sum = 0;		// So that the loops can't be moved out of the timings
+		start = now();
+		for (int i = 0; i < n; ++i)
+			sum += get(v, uint32_t((uint64_t(i) * 7919) % n));
+		auto const index_ns = ns(start, n);
+
+		int const Slices = 10000;
+		start = now();
+		for (int i = 0; i < Slices; ++i)
+			slice = checked(pv.slice(v.asObject(), uint32_t(i % (n / 2)), uint32_t(n - 1 - i % (n / 4))));
+		auto const slice_ns = ns(start, Slices);
+
+		start = now();
+		Int leaf_sum = 0;
+		for (uint32_t i = 0, count; i < uint32_t(n); i += count)
+		{
+			Int const * p = reinterpret_cast<Int const *>(pv.chunk(v.asObject(), i, count));
+			for (uint32_t j = 0; j < count; ++j)
+				leaf_sum += p[j];
+		}
+		sum = leaf_sum;
+		auto const sum_ns = ns(start, n);
+
+		std::vector<Int> flat (n);
+		for (int i = 0; i < n; ++i)
+			flat[i] = i;
+		start = now();
+		Int flat_sum = 0;
+		for (auto x : flat)
+			flat_sum += x;
+		sum = flat_sum;
+		auto const flat_ns = ns(start, n);
+
+		assert (leaf_sum == Int(n) * (n - 1) / 2 && leaf_sum == flat_sum && same(transient, flat));
+		wcout
+			<< "  " << n << " ints: push " << push_ns << "ns (" << double(push_bytes) / n << " bytes), transient push " << transient_ns
+			<< "ns (" << double(transient_bytes) / n << " bytes), index " << index_ns << "ns, slice " << slice_ns
+			<< "ns, sum by leaves " << sum_ns << "ns vs std::vector " << flat_ns << "ns" << endl;
+
+		heap.removeRoot (&slice);
+		heap.removeRoot (&transient);
+		heap.removeRoot (&v);
+	}
+}
+
+//======================================================================
+
+void TestStrings ()
+{
+	using std::wcout;
+	using std::endl;
+	using UPL::Char;
+	using UPL::VM::Ropes;
+	using UPL::VM::Value;
+
+	UPL::VM::Module mod;
+	UPL::VM::HeapConfig config;
+	config.nursery_size = 1 << 20;
+	UPL::VM::Heap heap (mod.types(), config);
+	Ropes ropes (heap);
+
+	// The code points of some UTF-8, for checking charAt()
+	auto const decode = [] (std::string const & s) {
+		std::vector<Char> ret;
+		for (size_t i = 0; i < s.size(); )
+		{
+			auto const b = uint8_t(s[i]);
+			int const n = (b < 0x80) ? 1 : (b < 0xE0) ? 2 : (b < 0xF0) ? 3 : 4;
+			uint32_t c = (1 == n) ? b : (b & (0x7F >> n));
+			for (int k = 1; k < n; ++k)
+				c = (c << 6) | (uint8_t(s[i + k]) & 0x3F);
+			ret.push_back (Char(c));
+			i += n;
+		}
+		return ret;
+	};
+
+	// Built a piece at a time (ASCII, and two-, three- and four-byte
+	// code points), against std::string; some versions are kept along the
+	// way, and must stay as they were
+	{
+		int const N = 20000, Kept = 4;
+		char const * const pieces [] = {"a", "bc", "def", "\xC3\xA9", "\xE2\x82\xAC", "\xF0\x9F\x98\x80", "a longer piece of text, ", ""};
+		std::mt19937 rng (3);
+		std::string expected, kept_expected [Kept];
+		Value s = ropes.fromUTF8("", 0), kept [Kept];
+		heap.addRoot (&s);
+		for (int k = 0; k < Kept; ++k)
+			heap.addRoot (kept + k);
+
+		for (int i = 0; i < N; ++i)
+		{
+			std::string const piece = pieces[rng() % 8];
+			auto const v = ropes.fromUTF8(piece.data(), piece.size());
+			if (rng() % 4)
+			{
+				s = ropes.concat(s, v);
+				expected += piece;
+			}
+			else
+			{
+				s = ropes.concat(v, s);
+				expected = piece + expected;
+			}
+			if (0 == (i + 1) % (N / Kept))
+			{
+				kept[i / (N / Kept)] = s;
+				kept_expected[i / (N / Kept)] = expected;
+			}
+		}
+
+		for (int k = 0; k < Kept; ++k)
+		{
+			assert (ropes.toUTF8(kept[k]) == kept_expected[k]);
+			auto const chars = decode(kept_expected[k]);
+			assert (ropes.bytes(kept[k]) == kept_expected[k].size() && ropes.length(kept[k]) == chars.size());
+			for (size_t i = 0; i < chars.size(); i += 97)
+			{
+				Char c = 0;
+				bool const ok = ropes.charAt(kept[k], i, c);
+				assert (ok && c == chars[i]);
+				(void)ok;
+			}
+		}
+		Char c;
+		assert (!ropes.charAt(s, ropes.length(s), c));
+		(void)c;
+
+		wcout
+			<< "  " << N << " concatenations (at either end), checked against std::string: " << ropes.bytes(s) << " bytes, "
+			<< ropes.length(s) << " code points, height " << ropes.height(s) << endl;
+
+		for (int k = Kept; k-- > 0; )
+			heap.removeRoot (kept + k);
+		heap.removeRoot (&s);
+	}
+
+	// A long string is a balanced tree of leaves; interned strings are
+	// shared, and stay
+	{
+		std::string text;
+		for (int i = 0; text.size() < (1 << 20); ++i)
+			text += "line " + std::to_string(i) + ": \xE2\x82\xAC" + std::to_string(i * 3) + "\n";
+		Value s = ropes.fromUTF8(text.data(), text.size());
+		heap.addRoot (&s);
+		auto const chars = decode(text);
+		assert (ropes.toUTF8(s) == text && ropes.length(s) == chars.size());
+		Char c = 0;
+		assert (ropes.charAt(s, chars.size() / 2, c) && c == chars[chars.size() / 2]);
+		(void)c;
+
+		ropes.intern ("some interned string", 20);
+		heap.collect ();
+		auto const interned = ropes.intern("some interned string", 20);
+		assert (ropes.toUTF8(interned) == "some interned string" && interned == ropes.intern("some interned string", 20));
+		(void)interned;
+
+		wcout << "  1MB of text made a tree of height " << ropes.height(s) << " (leaves of " << Ropes::msc_LeafMax << " bytes)" << endl;
+		heap.removeRoot (&s);
+	}
+
+	// Timings: building a string out of many short pieces, as a rope and
+	// by copying it whole every time (quadratic), and indexing
+	for (int n : {1000, 10000})
+	{
+		auto const now = [] {return std::chrono::steady_clock::now();};
+		auto const ns = [] (std::chrono::steady_clock::time_point since, int count) {
+			return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - since).count() / count;
+		};
+
+		heap.collect ();
+		Value rope = ropes.fromUTF8("", 0), copied = heap.newString("", 0);
+		heap.addRoot (&rope);
+		heap.addRoot (&copied);
+		std::string const piece = "piece \xE2\x82\xAC!";
+
+		auto start = now();
+		for (int i = 0; i < n; ++i)
+			rope = ropes.concat(rope, ropes.fromUTF8(piece.data(), piece.size()));
+		auto const rope_ns = ns(start, n);
+
+		std::string buffer;
+		start = now();
+		for (int i = 0; i < n; ++i)
+		{
+			buffer = ropes.toUTF8(copied) + piece;
+			copied = heap.newString(buffer.data(), buffer.size());
+		}
+		auto const copy_ns = ns(start, n);
+
+		Char volatile c = 0;		// So that the lookups can't be moved out of the timings
+		auto const length = ropes.length(rope);
+		start = now();
+		for (int i = 0; i < n; ++i)
+		{
+			Char ch;
+			ropes.charAt(rope, (uint64_t(i) * 7919) % length, ch);
+			c = ch;
+		}
+		auto const index_ns = ns(start, n);
+
+		assert (ropes.toUTF8(rope) == ropes.toUTF8(copied));
+		(void)c;
+		wcout
+			<< "  " << n << " appends: " << rope_ns << "ns each as a rope (height " << ropes.height(rope) << "), " << copy_ns
+			<< "ns copying; charAt " << index_ns << "ns" << endl;
+		heap.removeRoot (&copied);
+		heap.removeRoot (&rope);
+	}
+}
+
+//======================================================================
+// A few programs, lowered the way a straightforward front end would:
+// every "def" and assignment a copy of its initializer, every literal a
+// fresh constant, no folding. All of them take and return ints.
+
+void BuildIRCorpus (UPL::Type::STContainer & types, UPL::CodeGen::IRModule & out)
+{
+	using UPL::Type::Tag;
+	using UPL::Type::ID;
+	using UPL::Type::Unpacked;
+	using UPL::Type::STContainer;
+	using UPL::CodeGen::BinaryOp;
+	using UPL::CodeGen::IRBuilder;
+	using UPL::CodeGen::IRFunction;
+
+	auto const t_int = STContainer::DefaultID(Tag::Int);
+	auto const t_int_int = types.createType(Unpacked(Tag::Function, false, t_int, std::vector<ID>{t_int}));
+	auto const t_int_int_int = types.createType(Unpacked(Tag::Function, false, t_int, std::vector<ID>{t_int, t_int}));
+	auto const t_row = types.createType(Unpacked(Tag::Vector, false, t_int));
+	auto const t_rows = types.createType(Unpacked(Tag::Vector, false, t_row));
+	auto const t_any = STContainer::DefaultID(Tag::Any);
+	auto const t_int_void = types.createType(Unpacked(Tag::Function, false, t_int, std::vector<ID>{}));
+	auto const t_any_int_int = types.createType(Unpacked(Tag::Function, false, t_int, std::vector<ID>{t_any, t_int}));
+	auto const t_bool = STContainer::DefaultID(Tag::Bool);
+	auto const t_int_bool = types.createType(Unpacked(Tag::Function, false, t_bool, std::vector<ID>{t_int}));
+	auto const t_pair = types.createType(Unpacked(Tag::Tuple, false, std::vector<ID>{t_int, t_int}));
+	auto const t_real = STContainer::DefaultID(Tag::Real);
+	auto const t_int_real = types.createType(Unpacked(Tag::Function, false, t_real, std::vector<ID>{t_int}));
+	auto const t_int_int_real = types.createType(Unpacked(Tag::Function, false, t_real, std::vector<ID>{t_int, t_int}));
+
+	// def Fib = func(int n)->int {n < 2 ? n : Fib(n - 1) + Fib(n - 2);};
+	{
+		out.functions.push_back (IRFunction("Fib", t_int_int, {t_int}));
+		IRBuilder b (out.functions.back(), types);
+		auto result = b.newVariable(t_int);
+		auto then = b.newBlock(), other = b.newBlock(), done = b.newBlock();
+		auto n = b.copy(b.param(0));
+		b.branch (b.binary(BinaryOp::Lt, n, b.constInt(2)), then, other);
+		b.seal (then); b.seal (other);
+		b.setBlock (then);
+		b.assign (result, b.copy(n));
+		b.jump (done);
+		b.setBlock (other);
+		auto f1 = b.call(b.functionRef(0, t_int_int), {b.binary(BinaryOp::Sub, n, b.constInt(1))}, t_int);
+		auto f2 = b.call(b.functionRef(0, t_int_int), {b.binary(BinaryOp::Sub, n, b.constInt(2))}, t_int);
+		b.assign (result, b.binary(BinaryOp::Add, f1, f2));
+		b.jump (done);
+		b.seal (done);
+		b.setBlock (done);
+		b.ret (b.use(result));
+	}
+
+	// def x = 42; def Baz = func(int a)->int {def y = x * 2; a * (y - x - x + 1) + x / 7;};
+	{
+		out.functions.push_back (IRFunction("Baz", t_int_int, {t_int}));
+		IRBuilder b (out.functions.back(), types);
+		auto x = b.copy(b.constInt(42));
+		auto y = b.copy(b.binary(BinaryOp::Mul, x, b.constInt(2)));
+		auto k = b.binary(BinaryOp::Add, b.binary(BinaryOp::Sub, b.binary(BinaryOp::Sub, y, x), x), b.constInt(1));
+		b.ret (b.binary(BinaryOp::Add, b.binary(BinaryOp::Mul, b.param(0), k), b.binary(BinaryOp::Div, x, b.constInt(7))));
+	}
+
+	// def scale = 3; def offset = 4;
+	// def Poly = func(int n)->int {
+	//     var sum = 0; var i = 0;
+	//     while (i < n) {def sq = i * i; sum = sum + sq + (scale * offset) * i + i * i; i = i + 1;}
+	//     sum;};
+	{
+		out.functions.push_back (IRFunction("Poly", t_int_int, {t_int}));
+		IRBuilder b (out.functions.back(), types);
+		auto sum = b.newVariable(t_int), i = b.newVariable(t_int);
+		auto scale = b.copy(b.constInt(3)), offset = b.copy(b.constInt(4));
+		b.assign (sum, b.copy(b.constInt(0)));
+		b.assign (i, b.copy(b.constInt(0)));
+		auto head = b.newBlock(), body = b.newBlock(), done = b.newBlock();
+		b.jump (head);
+		b.setBlock (head);
+		b.branch (b.binary(BinaryOp::Lt, b.use(i), b.param(0)), body, done);
+		b.seal (body);
+		b.setBlock (body);
+		auto sq = b.copy(b.binary(BinaryOp::Mul, b.use(i), b.use(i)));
+		auto t = b.binary(BinaryOp::Add, b.use(sum), sq);
+		t = b.binary(BinaryOp::Add, t, b.binary(BinaryOp::Mul, b.binary(BinaryOp::Mul, scale, offset), b.use(i)));
+		t = b.binary(BinaryOp::Add, t, b.binary(BinaryOp::Mul, b.use(i), b.use(i)));
+		b.assign (sum, b.copy(t));
+		b.assign (i, b.copy(b.binary(BinaryOp::Add, b.use(i), b.constInt(1))));
+		b.jump (head);
+		b.seal (head); b.seal (done);
+		b.setBlock (done);
+		b.ret (b.use(sum));
+	}
+
+	// def debug = false;
+	// def Checked = func(int n)->int {
+	//     var acc = 0; var k = 0;
+	//     while (k < n) {if (debug) acc = acc + Fib(20); acc = acc + (k % 7) * 1 + 0; k = k + 1;}
+	//     acc;};
+	{
+		out.functions.push_back (IRFunction("Checked", t_int_int, {t_int}));
+		IRBuilder b (out.functions.back(), types);
+		auto acc = b.newVariable(t_int), k = b.newVariable(t_int);
+		auto debug = b.copy(b.constBool(false));
+		b.assign (acc, b.copy(b.constInt(0)));
+		b.assign (k, b.copy(b.constInt(0)));
+		auto head = b.newBlock(), body = b.newBlock(), trace = b.newBlock(), rest = b.newBlock(), done = b.newBlock();
+		b.jump (head);
+		b.setBlock (head);
+		b.branch (b.binary(BinaryOp::Lt, b.use(k), b.param(0)), body, done);
+		b.seal (body);
+		b.setBlock (body);
+		b.branch (debug, trace, rest);
+		b.seal (trace);
+		b.setBlock (trace);
+		b.assign (acc, b.copy(b.binary(BinaryOp::Add, b.use(acc), b.call(b.functionRef(0, t_int_int), {b.constInt(20)}, t_int))));
+		b.jump (rest);
+		b.seal (rest);
+		b.setBlock (rest);
+		auto m = b.binary(BinaryOp::Mul, b.binary(BinaryOp::Mod, b.use(k), b.constInt(7)), b.constInt(1));
+		b.assign (acc, b.copy(b.binary(BinaryOp::Add, b.binary(BinaryOp::Add, b.use(acc), m), b.constInt(0))));
+		b.assign (k, b.copy(b.binary(BinaryOp::Add, b.use(k), b.constInt(1))));
+		b.jump (head);
+		b.seal (head); b.seal (done);
+		b.setBlock (done);
+		b.ret (b.use(acc));
+	}
+
+	// def Mix = func(int a, int b)->int {
+	//     var x = a; var y = b; var i = 0;
+	//     while (i < 10) {def t = x; x = y; y = t + y; i = i + 1;}  (the phis swap)
+	//     x - y;};
+	{
+		out.functions.push_back (IRFunction("Mix", t_int_int_int, {t_int, t_int}));
+		IRBuilder b (out.functions.back(), types);
+		auto x = b.newVariable(t_int), y = b.newVariable(t_int), i = b.newVariable(t_int);
+		b.assign (x, b.copy(b.param(0)));
+		b.assign (y, b.copy(b.param(1)));
+		b.assign (i, b.copy(b.constInt(0)));
+		auto head = b.newBlock(), body = b.newBlock(), done = b.newBlock();
+		b.jump (head);
+		b.setBlock (head);
+		b.branch (b.binary(BinaryOp::Lt, b.use(i), b.constInt(10)), body, done);
+		b.seal (body);
+		b.setBlock (body);
+		auto t = b.copy(b.use(x));
+		b.assign (x, b.copy(b.use(y)));
+		b.assign (y, b.copy(b.binary(BinaryOp::Add, t, b.use(y))));
+		b.assign (i, b.copy(b.binary(BinaryOp::Add, b.use(i), b.constInt(1))));
+		b.jump (head);
+		b.seal (head); b.seal (done);
+		b.setBlock (done);
+		b.ret (b.binary(BinaryOp::Sub, b.use(x), b.use(y)));
+	}
+
+	// def Rows = func(int n)->int {
+	//     def rows = vector<vector<int>>(n); var i = 0;
+	//     while (i < n) {def row = vector<int>(2 + 1); row[1] = i * (2 + 3); rows[i] = row; i = i + 1;}
+	//     var s = 0; var j = 0;
+	//     while (j < n) {s = s + rows[j][1] + int(any(j + 1000000000000000)) - j - 1000000000000000; j = j + 1;}
+	//     len(rows) == n ? s : -1;};
+	{
+		out.functions.push_back (IRFunction("Rows", t_int_int, {t_int}));
+		IRBuilder b (out.functions.back(), types);
+		auto i = b.newVariable(t_int), s = b.newVariable(t_int), j = b.newVariable(t_int);
+		auto rows = b.copy(b.newArray(t_rows, b.param(0)));
+		b.assign (i, b.copy(b.constInt(0)));
+		auto head1 = b.newBlock(), body1 = b.newBlock(), between = b.newBlock(), head2 = b.newBlock(), body2 = b.newBlock(), done = b.newBlock();
+		b.jump (head1);
+		b.setBlock (head1);
+		b.branch (b.binary(BinaryOp::Lt, b.use(i), b.param(0)), body1, between);
+		b.seal (body1); b.seal (between);
+		b.setBlock (body1);
+		auto row = b.copy(b.newArray(t_row, b.binary(BinaryOp::Add, b.constInt(2), b.constInt(1))));
+		b.setElement (row, b.constInt(1), b.binary(BinaryOp::Mul, b.use(i), b.binary(BinaryOp::Add, b.constInt(2), b.constInt(3))));
+		b.setElement (rows, b.use(i), row);
+		b.assign (i, b.copy(b.binary(BinaryOp::Add, b.use(i), b.constInt(1))));
+		b.jump (head1);
+		b.seal (head1);
+		b.setBlock (between);
+		b.assign (s, b.copy(b.constInt(0)));
+		b.assign (j, b.copy(b.constInt(0)));
+		b.jump (head2);
+		b.setBlock (head2);
+		b.branch (b.binary(BinaryOp::Lt, b.use(j), b.param(0)), body2, done);
+		b.seal (body2); b.seal (done);
+		b.setBlock (body2);
+		auto big = b.constInt(1000000000000000LL);
+		auto cell = b.getElement(b.getElement(rows, b.use(j), t_row), b.constInt(1), t_int);
+		auto round_trip = b.unbox(b.box(b.binary(BinaryOp::Add, b.use(j), big)), t_int);
+		auto t = b.binary(BinaryOp::Add, b.binary(BinaryOp::Add, b.use(s), cell), round_trip);
+		t = b.binary(BinaryOp::Sub, b.binary(BinaryOp::Sub, t, b.use(j)), b.constInt(1000000000000000LL));
+		b.assign (s, b.copy(t));
+		b.assign (j, b.copy(b.binary(BinaryOp::Add, b.use(j), b.constInt(1))));
+		b.jump (head2);
+		b.seal (head2);
+		b.setBlock (done);
+		auto fine = b.newBlock(), bad = b.newBlock();
+		b.branch (b.binary(BinaryOp::Eq, b.length(rows), b.param(0)), fine, bad);
+		b.seal (fine); b.seal (bad);
+		b.setBlock (fine);
+		b.ret (b.use(s));
+		b.setBlock (bad);
+		b.ret (b.constInt(-1));
+	}
+
+	// def Square = func(int a)->int {a * a;};
+	{
+		out.functions.push_back (IRFunction("Square", t_int_int, {t_int}));
+		IRBuilder b (out.functions.back(), types);
+		auto a = b.copy(b.param(0));
+		b.ret (b.binary(BinaryOp::Mul, a, a));
+	}
+
+	// def Get = func()->int {42;};
+	{
+		out.functions.push_back (IRFunction("Get", t_int_void, {}));
+		IRBuilder b (out.functions.back(), types);
+		b.ret (b.constInt(42));
+	}
+
+	// def SumSquares = func(int n)->int {
+	//     var s = 0; var i = 0;
+	//     while (i < n) {s = s + Square(i) + Get(); i = i + 1;}
+	//     s;};
+	{
+		out.functions.push_back (IRFunction("SumSquares", t_int_int, {t_int}));
+		IRBuilder b (out.functions.back(), types);
+		auto s = b.newVariable(t_int), i = b.newVariable(t_int);
+		b.assign (s, b.copy(b.constInt(0)));
+		b.assign (i, b.copy(b.constInt(0)));
+		auto head = b.newBlock(), body = b.newBlock(), done = b.newBlock();
+		b.jump (head);
+		b.setBlock (head);
+		b.branch (b.binary(BinaryOp::Lt, b.use(i), b.param(0)), body, done);
+		b.seal (body);
+		b.setBlock (body);
+		auto sq = b.call(b.functionRef(6, t_int_int), {b.use(i)}, t_int);
+		auto k = b.call(b.functionRef(7, t_int_void), {}, t_int);
+		b.assign (s, b.copy(b.binary(BinaryOp::Add, b.binary(BinaryOp::Add, b.use(s), sq), k)));
+		b.assign (i, b.copy(b.binary(BinaryOp::Add, b.use(i), b.constInt(1))));
+		b.jump (head);
+		b.seal (head); b.seal (done);
+		b.setBlock (done);
+		b.ret (b.use(s));
+	}
+
+	// def Count = func(any v, int n)->int {n == 0 ? 0 : (typeof(v) == int ? int(v) : 1) + Count(v, n - 1);};
+	{
+		out.functions.push_back (IRFunction("Count", t_any_int_int, {t_any, t_int}));
+		IRBuilder b (out.functions.back(), types);
+		auto x = b.newVariable(t_int);
+		auto zero = b.newBlock(), rest = b.newBlock(), is_int = b.newBlock(), other = b.newBlock(), join = b.newBlock();
+		b.branch (b.binary(BinaryOp::Eq, b.param(1), b.constInt(0)), zero, rest);
+		b.seal (zero); b.seal (rest);
+		b.setBlock (zero);
+		b.ret (b.constInt(0));
+		b.setBlock (rest);
+		b.branch (b.binary(BinaryOp::Eq, b.typeOf(b.param(0)), b.constInt(t_int)), is_int, other);
+		b.seal (is_int); b.seal (other);
+		b.setBlock (is_int);
+		b.assign (x, b.unbox(b.param(0), t_int));
+		b.jump (join);
+		b.setBlock (other);
+		b.assign (x, b.constInt(1));
+		b.jump (join);
+		b.seal (join);
+		b.setBlock (join);
+		auto r = b.call(b.functionRef(9, t_any_int_int), {b.param(0), b.binary(BinaryOp::Sub, b.param(1), b.constInt(1))}, t_int);
+		b.ret (b.binary(BinaryOp::Add, b.use(x), r));
+	}
+
+	// def CountSevens = func(int n)->int {Count(any(7), n);};
+	{
+		out.functions.push_back (IRFunction("CountSevens", t_int_int, {t_int}));
+		IRBuilder b (out.functions.back(), types);
+		b.ret (b.call(b.functionRef(9, t_any_int_int), {b.box(b.constInt(7)), b.param(0)}, t_int));
+	}
+
+	// def Loop = func(int n, int acc)->int {n == 0 ? acc : Loop(n - 1, acc + n);};
+	{
+		out.functions.push_back (IRFunction("Loop", t_int_int_int, {t_int, t_int}));
+		IRBuilder b (out.functions.back(), types);
+		auto result = b.newVariable(t_int);
+		auto then = b.newBlock(), other = b.newBlock(), done = b.newBlock();
+		auto n = b.copy(b.param(0)), acc = b.copy(b.param(1));
+		b.branch (b.binary(BinaryOp::Eq, n, b.constInt(0)), then, other);
+		b.seal (then); b.seal (other);
+		b.setBlock (then);
+		b.assign (result, b.copy(acc));
+		b.jump (done);
+		b.setBlock (other);
+		auto next = b.binary(BinaryOp::Sub, n, b.constInt(1));
+		b.assign (result, b.copy(b.call(b.functionRef(11, t_int_int_int), {next, b.binary(BinaryOp::Add, acc, n)}, t_int)));
+		b.jump (done);
+		b.seal (done);
+		b.setBlock (done);
+		b.ret (b.use(result));
+	}
+
+	// def IsEven = func(int n)->bool {n == 0 ? true : IsOdd(n - 1);};
+	// def IsOdd = func(int n)->bool {n == 0 ? false : IsEven(n - 1);};
+	for (int odd = 0; odd < 2; ++odd)
+	{
+		out.functions.push_back (IRFunction(odd ? "IsOdd" : "IsEven", t_int_bool, {t_int}));
+		IRBuilder b (out.functions.back(), types);
+		auto then = b.newBlock(), other = b.newBlock();
+		b.branch (b.binary(BinaryOp::Eq, b.param(0), b.constInt(0)), then, other);
+		b.seal (then); b.seal (other);
+		b.setBlock (then);
+		b.ret (b.constBool(0 == odd));
+		b.setBlock (other);
+		b.ret (b.call(b.functionRef(odd ? 12 : 13, t_int_bool), {b.binary(BinaryOp::Sub, b.param(0), b.constInt(1))}, t_bool));
+	}
+
+	// def Pairs = func(int n)->int {
+	//     def t = (0, 0); var i = 0;
+	//     while (i < n) {
+	//         def p = (i, i * 2); def q = vector<int>(3); q[0] = p.0; q[2] = p.1 + 1;
+	//         if (i % 2 == 0) t.0 = t.0 + q[2]; else t.1 = t.1 + q[0] * len(q);
+	//         i = i + 1;}
+	//     t.0 - t.1;};
+	{
+		out.functions.push_back (IRFunction("Pairs", t_int_int, {t_int}));
+		IRBuilder b (out.functions.back(), types);
+		auto i = b.newVariable(t_int);
+		auto t = b.copy(b.newObject(t_pair));
+		b.assign (i, b.copy(b.constInt(0)));
+		auto head = b.newBlock(), body = b.newBlock(), even = b.newBlock(), odd = b.newBlock(), next = b.newBlock(), done = b.newBlock();
+		b.jump (head);
+		b.setBlock (head);
+		b.branch (b.binary(BinaryOp::Lt, b.use(i), b.param(0)), body, done);
+		b.seal (body);
+		b.setBlock (body);
+		auto p = b.copy(b.newObject(t_pair));
+		b.setField (p, 0, b.use(i));
+		b.setField (p, 1, b.binary(BinaryOp::Mul, b.use(i), b.constInt(2)));
+		auto q = b.copy(b.newArray(t_row, b.constInt(3)));
+		b.setElement (q, b.constInt(0), b.getField(p, 0, t_int));
+		b.setElement (q, b.constInt(2), b.binary(BinaryOp::Add, b.getField(p, 1, t_int), b.constInt(1)));
+		b.branch (b.binary(BinaryOp::Eq, b.binary(BinaryOp::Mod, b.use(i), b.constInt(2)), b.constInt(0)), even, odd);
+		b.seal (even); b.seal (odd);
+		b.setBlock (even);
+		b.setField (t, 0, b.binary(BinaryOp::Add, b.getField(t, 0, t_int), b.getElement(q, b.constInt(2), t_int)));
+		b.jump (next);
+		b.setBlock (odd);
+		b.setField (t, 1, b.binary(BinaryOp::Add, b.getField(t, 1, t_int), b.binary(BinaryOp::Mul, b.getElement(q, b.constInt(0), t_int), b.length(q))));
+		b.jump (next);
+		b.seal (next);
+		b.setBlock (next);
+		b.assign (i, b.copy(b.binary(BinaryOp::Add, b.use(i), b.constInt(1))));
+		b.jump (head);
+		b.seal (head); b.seal (done);
+		b.setBlock (done);
+		b.ret (b.binary(BinaryOp::Sub, b.getField(t, 0, t_int), b.getField(t, 1, t_int)));
+	}
+
+	// (From the sample program)
+	// def Foo = func(int a, int b)->real {def invalid = b == 0; invalid ? 0 : real(a) / real(b);};
+	{
+		out.functions.push_back (IRFunction("Foo", t_int_int_real, {t_int, t_int}));
+		IRBuilder b (out.functions.back(), types);
+		auto result = b.newVariable(t_real);
+		auto then = b.newBlock(), other = b.newBlock(), done = b.newBlock();
+		auto invalid = b.copy(b.binary(BinaryOp::Eq, b.param(1), b.constInt(0)));
+		b.branch (invalid, then, other);
+		b.seal (then); b.seal (other);
+		b.setBlock (then);
+		b.assign (result, b.constReal(0));
+		b.jump (done);
+		b.setBlock (other);
+		b.assign (result, b.binary(BinaryOp::Div, b.toReal(b.param(0)), b.toReal(b.param(1))));
+		b.jump (done);
+		b.seal (done);
+		b.setBlock (done);
+		b.ret (b.use(result));
+	}
+
+	// def Harmonic = func(int n)->real {
+	//     var s = 0.0; var i = 0;
+	//     while (i < n) {s = s + Foo(i, i % 7) * 0.5 - real(i % 3); i = i + 1;}
+	//     s;};
+	{
+		out.functions.push_back (IRFunction("Harmonic", t_int_real, {t_int}));
+		IRBuilder b (out.functions.back(), types);
+		auto s = b.newVariable(t_real), i = b.newVariable(t_int);
+		b.assign (s, b.copy(b.constReal(0)));
+		b.assign (i, b.copy(b.constInt(0)));
+		auto head = b.newBlock(), body = b.newBlock(), done = b.newBlock();
+		b.jump (head);
+		b.setBlock (head);
+		b.branch (b.binary(BinaryOp::Lt, b.use(i), b.param(0)), body, done);
+		b.seal (body);
+		b.setBlock (body);
+		auto foo = b.call(b.functionRef(15, t_int_int_real), {b.use(i), b.binary(BinaryOp::Mod, b.use(i), b.constInt(7))}, t_real);
+		auto t = b.binary(BinaryOp::Add, b.use(s), b.binary(BinaryOp::Mul, foo, b.constReal(0.5)));
+		b.assign (s, b.copy(b.binary(BinaryOp::Sub, t, b.toReal(b.binary(BinaryOp::Mod, b.use(i), b.constInt(3))))));
+		b.assign (i, b.copy(b.binary(BinaryOp::Add, b.use(i), b.constInt(1))));
+		b.jump (head);
+		b.seal (head); b.seal (done);
+		b.setBlock (done);
+		b.ret (b.use(s));
+	}
+
+	// def Dispatch = func(int n)->int {
+	//     var s = 0; var i = 0;
+	//     while (i < n) {var f = i % 2 == 0 ? Square : Fib; s = s + f(i % 10); i = i + 1;}
+	//     s;};
+	{
+		out.functions.push_back (IRFunction("Dispatch", t_int_int, {t_int}));
+		IRBuilder b (out.functions.back(), types);
+		auto s = b.newVariable(t_int), i = b.newVariable(t_int), f = b.newVariable(t_int_int);
+		b.assign (s, b.copy(b.constInt(0)));
+		b.assign (i, b.copy(b.constInt(0)));
+		auto head = b.newBlock(), body = b.newBlock(), even = b.newBlock(), odd = b.newBlock(), call = b.newBlock(), done = b.newBlock();
+		b.jump (head);
+		b.setBlock (head);
+		b.branch (b.binary(BinaryOp::Lt, b.use(i), b.param(0)), body, done);
+		b.seal (body);
+		b.setBlock (body);
+		b.branch (b.binary(BinaryOp::Eq, b.binary(BinaryOp::Mod, b.use(i), b.constInt(2)), b.constInt(0)), even, odd);
+		b.seal (even); b.seal (odd);
+		b.setBlock (even);
+		b.assign (f, b.functionRef(6, t_int_int));
+		b.jump (call);
+		b.setBlock (odd);
+		b.assign (f, b.functionRef(0, t_int_int));
+		b.jump (call);
+		b.seal (call);
+		b.setBlock (call);
+		auto r = b.call(b.use(f), {b.binary(BinaryOp::Mod, b.use(i), b.constInt(10))}, t_int);
+		b.assign (s, b.copy(b.binary(BinaryOp::Add, b.use(s), r)));
+		b.assign (i, b.copy(b.binary(BinaryOp::Add, b.use(i), b.constInt(1))));
+		b.jump (head);
+		b.seal (head); b.seal (done);
+		b.setBlock (done);
+		b.ret (b.use(s));
+	}
+}
+
+//----------------------------------------------------------------------
+// What to run the corpus with, and (where it's not 0) the expected result.
+
+std::vector<IRCase> IRCorpusCases ()
+{
+	using UPL::VM::Reg;
+
+	return {
+		{"Fib", {Reg::FromInt(25)}, 75025},
+		{"Baz", {Reg::FromInt(1000)}, 1006},
+		{"Poly", {Reg::FromInt(100000)}, 0},
+		{"Checked", {Reg::FromInt(100000)}, 0},
+		{"Mix", {Reg::FromInt(3), Reg::FromInt(4)}, 0},
+		{"Rows", {Reg::FromInt(50000)}, 5 * 50000LL * 49999 / 2},
+		{"SumSquares", {Reg::FromInt(100000)}, 99999LL * 100000 * 199999 / 6 + 42 * 100000},
+		{"CountSevens", {Reg::FromInt(10000)}, 7 * 10000},
+		{"Loop", {Reg::FromInt(1000000), Reg::FromInt(0)}, 1000000LL * 1000001 / 2},	// Far deeper than the frame limit, if not for tail calls
+		{"IsOdd", {Reg::FromInt(1000001)}, 1},
+		{"Pairs", {Reg::FromInt(100000)}, -2500050000LL},
+		{"Harmonic", {Reg::FromInt(100000)}, 0},
+		{"Dispatch", {Reg::FromInt(100000)}, 10000 * (0 + 4 + 16 + 36 + 64) + 10000 * (1 + 2 + 5 + 13 + 34)},	// Squares of the evens, Fibs of the odds
+	};
+}
+
+//----------------------------------------------------------------------
+
+void TestIR ()
+{
+	using std::wcout;
+	using std::endl;
+	using UPL::VM::Reg;
+	using namespace UPL::CodeGen;
+
+	auto const cases = IRCorpusCases();
+
+	// Plain (as lowered), optimized function by function, and with the
+	// module-wide passes (specialization and inlining) too.
+	int const Variants = 3;
+	UPL::Error::Reporter err;
+	UPL::VM::Module modules [Variants];
+	IRModule irs [Variants];
+	for (int i = 0; i < Variants; ++i)
+		BuildIRCorpus (modules[i].types(), irs[i]);
+
+	std::string error;
+	for (auto const & f : irs[0].functions)
+	{
+		bool ok = f.verify(error);
+		if (!ok) wcout << "Not valid: " << error.c_str() << endl;
+		assert (ok);
+		(void)ok;
+	}
+
+	std::vector<PassReport> reports, module_reports;
+	for (auto & f : irs[1].functions)
+		Optimize (f, modules[1].types(), &reports);
+	OptimizeModule (irs[2], modules[2].types(), &module_reports);
+	for (int i = 1; i < Variants; ++i)
+		for (auto const & f : irs[i].functions)
+		{
+			bool ok = f.verify(error);
+			if (!ok) wcout << "Not valid after optimizing " << f.name().c_str() << ": " << error.c_str() << endl;
+			assert (ok);
+			(void)ok;
+		}
+	wcout << irs[0].functions[2].print(modules[0].types()) << irs[1].functions[2].print(modules[1].types());
+	wcout << irs[2].functions[8].print(modules[2].types()) << irs[2].functions.back().print(modules[2].types());
+
+	EmitStats stats [Variants];
+	for (int i = 0; i < Variants; ++i)
+	{
+		bool ok = EmitModule(irs[i], modules[i], error, &stats[i]);
+		if (!ok) wcout << "Emit failed: " << error.c_str() << endl;
+		assert (ok);
+		(void)ok;
+	}
+	wcout << modules[1].disassemble(modules[1].findFunction("Poly")) << modules[1].disassemble(modules[1].findFunction("Rows")) << modules[1].disassemble(modules[1].findFunction("Loop"));
+
+	auto print_reports = [] (char const * title, std::vector<PassReport> const & reports) {
+		wcout << title << endl;
+		for (auto const & r : reports)
+			wcout
+				<< "  " << r.pass << ": " << r.runs << " runs, " << r.changes << " changes, "
+				<< r.instructions_removed << " IR instructions removed, "
+				<< r.nanoseconds / 1000.0 << "us" << endl;
+	};
+	print_reports ("Passes:", reports);
+	print_reports ("Passes, module-wide:", module_reports);
+	wcout << "Emitted (plain -> optimized -> inlined):" << endl;
+	wcout << "  " << stats[0].instructions << " -> " << stats[1].instructions << " -> " << stats[2].instructions << " instructions" << endl;
+	wcout << "  " << stats[0].moves << " -> " << stats[1].moves << " -> " << stats[2].moves << " moves" << endl;
+	wcout << "  at most " << stats[0].max_registers << " -> " << stats[1].max_registers << " -> " << stats[2].max_registers << " registers" << endl;
+	wcout << "  " << stats[0].functions << " -> " << stats[1].functions << " -> " << stats[2].functions << " functions" << endl;
+	wcout << "  " << stats[0].tail_calls << " -> " << stats[1].tail_calls << " -> " << stats[2].tail_calls << " tail calls" << endl;
+
+	UPL::VM::HeapConfig config;
+	config.nursery_size = 256 << 10;	// So that Rows collects, with its vectors live
+	std::vector<std::unique_ptr<UPL::VM::Heap>> heaps;
+	std::vector<std::unique_ptr<UPL::VM::Interpreter>> vms;
+	for (int i = 0; i < Variants; ++i)
+	{
+		heaps.emplace_back (new UPL::VM::Heap (modules[i].types(), config));
+		vms.emplace_back (new UPL::VM::Interpreter (modules[i], err, *heaps[i]));
+	}
+
+	for (auto const & c : cases)
+	{
+		Reg results [Variants];
+		double secs [Variants];
+		uint64_t executed [Variants], depth [Variants], allocated [Variants];
+		uint64_t hits = 0, lookups = 0;		// Of the optimized variant
+		for (int i = 0; i < Variants; ++i)
+		{
+			vms[i]->resetStats ();
+			auto const objects = heaps[i]->stats().objects_allocated;
+			auto const start = std::chrono::steady_clock::now();
+			bool ok = vms[i]->call(modules[i].findFunction(c.name), c.args.data(), int(c.args.size()), results[i]);
+			secs[i] = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+			executed[i] = vms[i]->stats().instructions;
+			depth[i] = vms[i]->stats().max_frame_depth;
+			allocated[i] = heaps[i]->stats().objects_allocated - objects;
+			if (1 == i)
+			{
+				hits = vms[i]->stats().cache_hits;
+				lookups = hits + vms[i]->stats().cache_misses;
+			}
+			assert (ok && results[i].i == results[0].i && (0 == c.expected || results[i].i == c.expected));
+			(void)ok;
+		}
+
+		wcout << "  " << c.name << " = " << results[0].i << ": executed ";
+		for (int i = 0; i < Variants; ++i)
+			wcout << (i ? " -> " : "") << executed[i];
+		wcout << " instructions in ";
+		for (int i = 0; i < Variants; ++i)
+			wcout << (i ? " -> " : "") << secs[i] * 1000;
+		wcout << "ms, at most " << depth[1] << " frames deep";
+		if (0 != lookups)
+			wcout << ", " << lookups << " inline cache lookups, " << 100.0 * hits / lookups << "% hits";
+		if (0 != allocated[0])
+		{
+			wcout << ", allocated ";
+			for (int i = 0; i < Variants; ++i)
+				wcout << (i ? " -> " : "") << allocated[i];
+			wcout << " objects";
+		}
+		wcout << endl;
+	}
+	wcout << "  collections: " << heaps[0]->stats().minor_collections << ", " << heaps[1]->stats().minor_collections << ", " << heaps[2]->stats().minor_collections << endl;
+
+	// A loop written as (tail) recursion, 10^8 times around, in one frame
+	{
+		auto & vm = *vms[2];
+		Reg const args [] = {Reg::FromInt(100000000), Reg::FromInt(0)};
+		Reg result;
+		vm.resetStats ();
+		auto const start = std::chrono::steady_clock::now();
+		bool ok = vm.call(modules[2].findFunction("Loop"), args, 2, result);
+		auto const secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		assert (ok && result.i == 100000000LL * 100000001 / 2 && vm.stats().max_frame_depth <= 1);
+		(void)ok;
+		wcout
+			<< "  Loop(10^8) = " << result.i << ": " << vm.stats().tail_calls << " tail calls, " << vm.stats().instructions << " instructions in "
+			<< secs * 1000 << "ms (" << vm.stats().instructions / secs / 1e6 << "M/s), at most " << vm.stats().max_frame_depth << " frames deep" << endl;
+	}
+
+	// Boxed nils, bytes and chars keep their types, whether boxed when run
+	// (plain) or folded (optimized):
+	// def Boxed = func(byte y, char c)->int {
+	//     unbox<byte>(any(y)) == y && unbox<char>(any(c)) == c ?
+	//         typeof(any(nil)) + 100 * typeof(any(y)) + 10000 * typeof(any(c)) : -1;};
+	for (int optimize = 0; optimize < 2; ++optimize)
+	{
+		using UPL::Type::Tag;
+		using UPL::Type::ID;
+		using UPL::Type::STContainer;
+
+		UPL::VM::Module mod;
+		auto & types = mod.types();
+		auto const t_int = STContainer::DefaultID(Tag::Int);
+		auto const t_byte = STContainer::DefaultID(Tag::Byte);
+		auto const t_char = STContainer::DefaultID(Tag::Char);
+		IRModule ir;
+		ir.functions.push_back (IRFunction("Boxed", types.createType(UPL::Type::Unpacked(Tag::Function, false, t_int, std::vector<ID>{t_byte, t_char})), {t_byte, t_char}));
+		{
+			IRBuilder b (ir.functions.back(), types);
+			auto const y = b.param(0), c = b.param(1);
+			auto same = b.newBlock(), second = b.newBlock(), other = b.newBlock();
+			b.branch (b.binary(BinaryOp::Eq, b.unbox(b.box(y), t_byte), y), second, other);
+			b.seal (second);
+			b.setBlock (second);
+			b.branch (b.binary(BinaryOp::Eq, b.unbox(b.box(c), t_char), c), same, other);
+			b.seal (same); b.seal (other);
+			b.setBlock (same);
+			auto const n = b.typeOf(b.box(b.constNil()));
+			auto const ty = b.binary(BinaryOp::Mul, b.constInt(100), b.typeOf(b.box(y)));
+			auto const tc = b.binary(BinaryOp::Mul, b.constInt(10000), b.typeOf(b.box(c)));
+			b.ret (b.binary(BinaryOp::Add, b.binary(BinaryOp::Add, n, ty), tc));
+			b.setBlock (other);
+			b.ret (b.constInt(-1));
+		}
+		if (optimize)
+			Optimize (ir.functions.back(), types);
+		bool ok = ir.functions.back().verify(error) && EmitModule(ir, mod, error);
+		assert (ok);
+
+		UPL::VM::Heap heap (types);
+		UPL::VM::Interpreter vm (mod, err, heap);
+		Reg const args [] = {Reg::FromInt(200), Reg::FromInt(0x4E2D)};
+		Reg result;
+		ok = vm.call(mod.findFunction("Boxed"), args, 2, result);
+		auto const expected = UPL::Int(STContainer::DefaultID(Tag::Nil)) + 100 * UPL::Int(t_byte) + 10000 * UPL::Int(t_char);
+		assert (ok && result.i == expected);
+		(void)ok; (void)expected;
+		wcout << "  Boxed (" << (optimize ? "optimized" : "plain") << ") = " << result.i << endl;
+	}
+
+	// A constant whose index doesn't fit in an instruction is an error, not
+	// a load of another one:
+	// def Half = func()->real {0.5;};
+	{
+		using UPL::Type::Tag;
+		using UPL::Type::STContainer;
+
+		UPL::VM::Module mod;
+		auto & types = mod.types();
+		for (uint32_t i = 0; i <= UPL::VM::Assembler::msc_MaxBx; ++i)
+			mod.addConstant (Reg::FromInt(i));
+		auto const t_real = STContainer::DefaultID(Tag::Real);
+		IRModule ir;
+		ir.functions.push_back (IRFunction("Half", types.createType(UPL::Type::Unpacked(Tag::Function, false, t_real, {})), {}));
+		{
+			IRBuilder b (ir.functions.back(), types);
+			b.ret (b.constReal(0.5));
+		}
+		std::string error;
+		bool const ok = EmitModule(ir, mod, error);
+		assert (!ok && std::string::npos != error.find("out of range"));
+		(void)ok;
+		wcout << "  65537 constants: " << error.c_str() << endl;
+	}
+
+	ReportErrors (err);
+}
+
+//----------------------------------------------------------------------
+
+void TestJit ()
+{
+	using std::wcout;
+	using std::endl;
+	using UPL::VM::Reg;
+	using UPL::VM::Jit;
+	using UPL::VM::JitOptions;
+	using namespace UPL::CodeGen;
+
+	if (!UPL_JIT_AVAILABLE)
+	{
+		wcout << "  (No JIT on this platform.)" << endl;
+		return;
+	}
+
+	UPL::Error::Reporter err;
+	UPL::VM::Module module;
+	IRModule ir;
+	BuildIRCorpus (module.types(), ir);
+	OptimizeModule (ir, module.types());
+	std::string error;
+	bool ok = EmitModule(ir, module, error);
+	if (!ok) wcout << "Emit failed: " << error.c_str() << endl;
+	assert (ok);
+	wcout << module.disassemble(module.findFunction("Harmonic"));
+
+	// The same module, interpreted and with (eagerly) compiled hot code;
+	// the results must agree to the bit.
+	JitOptions options;
+	options.threshold = 2;
+	Jit jit (module, options);
+	UPL::VM::Heap heap_0 (module.types()), heap_1 (module.types());
+	UPL::VM::Interpreter interpreted (module, err, heap_0), compiled (module, err, heap_1);
+	compiled.setJit (&jit);
+
+	for (auto const & c : IRCorpusCases())
+	{
+		Reg results [2];
+		ok = interpreted.call(module.findFunction(c.name), c.args.data(), int(c.args.size()), results[0]);
+		assert (ok);
+		compiled.resetStats ();
+		ok = compiled.call(module.findFunction(c.name), c.args.data(), int(c.args.size()), results[1]);
+		assert (ok && results[0].u == results[1].u);
+		wcout
+			<< "  " << c.name << ": " << compiled.stats().native_entries << " native entries, "
+			<< compiled.stats().native_exits << " exits, " << compiled.stats().instructions << " instructions interpreted" << endl;
+	}
+	wcout
+		<< "  compiled " << jit.stats().compiled << ", rejected " << jit.stats().rejected << ", "
+		<< jit.stats().code_bytes << " bytes of code in " << jit.stats().compile_seconds * 1000 << "ms" << endl;
+
+	// Numeric code, the way the sample program's Foo is used
+	{
+		Reg const args [] = {Reg::FromInt(10000000)};
+		Reg results [2];
+		double secs [2];
+		UPL::VM::Interpreter * const vms [2] = {&interpreted, &compiled};
+		for (int i = 0; i < 2; ++i)
+		{
+			auto const start = std::chrono::steady_clock::now();
+			ok = vms[i]->call(module.findFunction("Harmonic"), args, 1, results[i]);
+			secs[i] = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+			assert (ok);
+		}
+		assert (results[0].u == results[1].u);
+		wcout
+			<< "  Harmonic(10^7) = " << results[0].r << ": interpreted in " << secs[0] * 1000 << "ms, JIT in "
+			<< secs[1] * 1000 << "ms (" << secs[0] / secs[1] << "x)" << endl;
+	}
+
+	// A cache that only has room for a couple of functions at a time
+	{
+		JitOptions tiny = options;
+		tiny.cache_capacity = 2 * 4096;
+		Jit small (module, tiny);
+		compiled.setJit (&small);
+		for (auto const & c : IRCorpusCases())
+		{
+			Reg results [2];
+			ok = interpreted.call(module.findFunction(c.name), c.args.data(), int(c.args.size()), results[0]);
+			ok = ok && compiled.call(module.findFunction(c.name), c.args.data(), int(c.args.size()), results[1]);
+			assert (ok && results[0].u == results[1].u);
+		}
+		wcout
+			<< "  with a tiny cache: compiled " << small.stats().compiled << ", evicted " << small.stats().evicted
+			<< ", " << small.stats().code_bytes << " bytes left" << endl;
+		compiled.setJit (nullptr);
+	}
+	(void)ok;
+
+	// The same module through a file (what "uplc --run <file> Harmonic 10000000" runs)
+	auto const path = TempPath("playpen-jit.uplm");
+	UPL::VM::Module loaded;
+	auto res = UPL::VM::SaveModule(module, path.c_str());
+	if (UPL::VM::ModuleFileError::None == res)
+		res = UPL::VM::LoadModule(path.c_str(), loaded, true);
+	wcout << "  through " << path.c_str() << ": " << UPL::VM::ModuleFileErrorName(res) << endl;
+	assert (UPL::VM::ModuleFileError::None == res && loaded.codeSize() == module.codeSize());
+	(void)res;
+	remove (path.c_str());
+
+	ReportErrors (err);
+}
+
+//----------------------------------------------------------------------
+// Runs the IR corpus (optimized) to see which instructions follow which.
+
+void ProfileCorpus (UPL::VM::OpcodeProfile & profile)
+{
+	using namespace UPL::CodeGen;
+
+	UPL::Error::Reporter err;
+	UPL::VM::Module module;
+	IRModule ir;
+	BuildIRCorpus (module.types(), ir);
+	OptimizeModule (ir, module.types());
+	std::string error;
+	bool ok = EmitModule(ir, module, error);
+	assert (ok);
+
+	UPL::VM::Heap heap (module.types());
+	UPL::VM::Interpreter vm (module, err, heap);
+	vm.setProfile (&profile);
+	for (auto const & c : IRCorpusCases())
+	{
+		UPL::VM::Reg result;
+		ok = vm.call(module.findFunction(c.name), c.args.data(), int(c.args.size()), result);
+		assert (ok);
+	}
+	(void)ok;
+}
+
+//----------------------------------------------------------------------
+
+void TestSuperinstructions ()
+{
+	using std::wcout;
+	using std::endl;
+	using UPL::VM::Op;
+	using UPL::VM::Reg;
+	using namespace UPL::CodeGen;
+
+	UPL::VM::OpcodeProfile profile;
+	ProfileCorpus (profile);
+
+	// The most frequent pairs and triples, whatever this build fuses
+	struct Run {uint64_t count; Op ops [3];};
+	std::vector<Run> pairs, triples;
+	for (int a = 0; a < UPL::VM::BaseOpCount; ++a)
+		for (int b = 0; b < UPL::VM::BaseOpCount; ++b)
+		{
+			pairs.push_back ({profile.pair(Op(a), Op(b)), {Op(a), Op(b), Op(b)}});
+			for (int c = 0; c < UPL::VM::BaseOpCount; ++c)
+				if (0 != profile.triple(Op(a), Op(b), Op(c)))
+					triples.push_back ({profile.triple(Op(a), Op(b), Op(c)), {Op(a), Op(b), Op(c)}});
+		}
+	auto const by_count = [] (Run const & x, Run const & y) {return x.count > y.count;};
+	std::sort (pairs.begin(), pairs.end(), by_count);
+	std::sort (triples.begin(), triples.end(), by_count);
+	wcout << "  " << profile.total() << " instructions profiled; the most frequent runs:" << endl;
+	for (int i = 0; i < 6 && i < int(pairs.size()) && i < int(triples.size()); ++i)
+		wcout
+			<< "    " << UPL::VM::OpName(pairs[i].ops[0]) << " " << UPL::VM::OpName(pairs[i].ops[1]) << ": " << pairs[i].count << "\t"
+			<< UPL::VM::OpName(triples[i].ops[0]) << " " << UPL::VM::OpName(triples[i].ops[1]) << " " << UPL::VM::OpName(triples[i].ops[2])
+			<< ": " << triples[i].count << endl;
+
+	// The round trip through the text format
+	auto const path = TempPath("playpen-profile.txt");
+	UPL::VM::OpcodeProfile loaded;
+	bool ok = profile.save(path.c_str()) && loaded.load(path.c_str());
+	assert (ok && loaded.total() == profile.total() && loaded.pair(pairs[0].ops[0], pairs[0].ops[1]) == pairs[0].count);
+	remove (path.c_str());
+
+	// The same code with and without superinstructions: the same results,
+	// and the same instruction counts (superinstructions count as their parts)
+	UPL::Error::Reporter err;
+	UPL::VM::Module modules [2];
+	EmitStats stats [2];
+	for (int i = 0; i < 2; ++i)
+	{
+		IRModule ir;
+		BuildIRCorpus (modules[i].types(), ir);
+		OptimizeModule (ir, modules[i].types());
+		EmitOptions options;
+		options.superinstructions = (1 == i);
+		std::string error;
+		ok = EmitModule(ir, modules[i], error, &stats[i], options);
+		assert (ok);
+	}
+	wcout
+		<< "  " << UPL::VM::OpCount - UPL::VM::BaseOpCount << " superinstructions in this build; "
+		<< stats[1].superinstructions << " of " << stats[1].instructions << " instructions start one" << endl;
+	wcout << modules[1].disassemble(modules[1].findFunction("Harmonic"));
+
+	UPL::VM::Heap heap_0 (modules[0].types()), heap_1 (modules[1].types());
+	UPL::VM::Interpreter plain (modules[0], err, heap_0), fused (modules[1], err, heap_1);
+	double secs [2] = {0, 0};
+	for (auto const & c : IRCorpusCases())
+	{
+		Reg results [2];
+		UPL::VM::Interpreter * const vms [2] = {&plain, &fused};
+		for (int i = 0; i < 2; ++i)
+		{
+			auto const start = std::chrono::steady_clock::now();
+			ok = vms[i]->call(modules[i].findFunction(c.name), c.args.data(), int(c.args.size()), results[i]);
+			secs[i] += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+			assert (ok);
+		}
+		assert (results[0].u == results[1].u);
+	}
+	assert (plain.stats().instructions == fused.stats().instructions);
+	wcout
+		<< "  the corpus: " << plain.stats().instructions << " instructions in " << secs[0] * 1000 << "ms plain, "
+		<< secs[1] * 1000 << "ms with superinstructions (" << secs[0] / secs[1] << "x)" << endl;
+
+	// A numeric loop, long enough to time
+	{
+		Reg const args [] = {Reg::FromInt(10000000)};
+		Reg results [2];
+		UPL::VM::Interpreter * const vms [2] = {&plain, &fused};
+		for (int i = 0; i < 2; ++i)
+		{
+			auto const start = std::chrono::steady_clock::now();
+			ok = vms[i]->call(modules[i].findFunction("Poly"), args, 1, results[i]);
+			secs[i] = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+			assert (ok);
+		}
+		assert (results[0].u == results[1].u);
+		wcout
+			<< "  Poly(10^7): " << secs[0] * 1000 << "ms plain, " << secs[1] * 1000 << "ms with superinstructions ("
+			<< secs[0] / secs[1] << "x)" << endl;
+	}
+	(void)ok;
+
+	ReportErrors (err);
+}
+
+//======================================================================
+
+void TestBulk ()
+{
+	using std::wcout;
+	using std::endl;
+	using UPL::Int;
+	using UPL::Real;
+	using UPL::VM::Reg;
+	using UPL::VM::Value;
+	using UPL::VM::Heap;
+	using UPL::VM::BulkElement;
+	using UPL::VM::BulkForm;
+	using UPL::VM::BulkOp;
+	using UPL::VM::BulkIsa;
+	using UPL::Type::Tag;
+	using UPL::Type::ID;
+	using UPL::Type::Unpacked;
+	using UPL::Type::STContainer;
+	using namespace UPL::CodeGen;
+
+	auto const best = UPL::VM::BulkBestIsa();
+	wcout << "  the best this machine can do: " << UPL::VM::BulkIsaName(best) << endl;
+
+	// Packed elements, as the kernels see them
+	struct Data
+	{
+		BulkElement e;
+		std::vector<uint8_t> bytes;
+
+		size_t width () const {return (BulkElement::Byte == e) ? 1 : 8;}
+		void resize (size_t n) {bytes.assign (n * width(), 0);}
+		Reg get (size_t i) const
+		{
+			Reg ret = Reg::FromInt(0);
+			if (BulkElement::Byte == e)
+				ret.i = bytes[i];
+			else
+				memcpy (&ret, &bytes[i * 8], 8);
+			return ret;
+		}
+		void set (size_t i, Reg v)
+		{
+			if (BulkElement::Byte == e)
+				bytes[i] = uint8_t(v.i);
+			else
+				memcpy (&bytes[i * 8], &v, 8);
+		}
+	};
+
+	// Small ints and whole reals (so that some are equal), and NaNs
+	auto const random = [] (std::mt19937_64 & rng, BulkElement e, bool nans) {
+		switch (e)
+		{
+		case BulkElement::Int:
+			return Reg::FromInt((0 == rng() % 2) ? Int(rng() % 101) - 50 : Int(rng()));
+		case BulkElement::Real:
+			if (nans && 0 == rng() % 16)
+				return Reg::FromReal(std::numeric_limits<Real>::quiet_NaN());
+			return Reg::FromReal((0 == rng() % 2) ? Real(Int(rng() % 21) - 10) : std::uniform_real_distribution<Real>(-100, 100)(rng));
+		case BulkElement::Byte:
+			return Reg::FromInt(Int(rng() % 256));
+		}
+		return Reg::Nil();
+	};
+	std::mt19937_64 rng (45);
+	auto const fill = [&rng, &random] (BulkElement e, size_t n, bool nans) {
+		Data ret = {e, {}};
+		ret.resize (n);
+		for (size_t i = 0; i < n; ++i)
+			ret.set (i, random(rng, e, nans));
+		return ret;
+	};
+
+	// What one element at a time would do; bytes are reduced as ints.
+	auto const apply = [] (BulkElement e, BulkOp op, Reg x, Reg y) {
+		Reg ret = Reg::FromInt(0);
+		if (BulkElement::Real == e)
+			switch (op)
+			{
+			case BulkOp::Add:	ret.r = x.r + y.r; break;
+			case BulkOp::Sub:	ret.r = x.r - y.r; break;
+			case BulkOp::Mul:	ret.r = x.r * y.r; break;
+			case BulkOp::Min:	ret = (x.r < y.r) ? x : y; break;
+			case BulkOp::Max:	ret = (x.r > y.r) ? x : y; break;
+			default:			break;
+			}
+		else
+		{
+			switch (op)
+			{
+			case BulkOp::Add:	ret.u = x.u + y.u; break;
+			case BulkOp::Sub:	ret.u = x.u - y.u; break;
+			case BulkOp::Mul:	ret.u = x.u * y.u; break;
+			case BulkOp::Min:	ret = (x.i < y.i) ? x : y; break;
+			case BulkOp::Max:	ret = (x.i > y.i) ? x : y; break;
+			default:			break;
+			}
+			if (BulkElement::Byte == e)
+				ret.i = uint8_t(ret.i);
+		}
+		return ret;
+	};
+	auto const holds = [] (BulkElement e, BulkOp op, Reg x, Reg k) {
+		if (BulkElement::Real == e)
+			switch (op)
+			{
+			case BulkOp::Eq:	return x.r == k.r;
+			case BulkOp::Lt:	return x.r < k.r;
+			case BulkOp::Le:	return x.r <= k.r;
+			case BulkOp::Gt:	return x.r > k.r;
+			default:			return x.r >= k.r;
+			}
+		switch (op)
+		{
+		case BulkOp::Eq:	return x.i == k.i;
+		case BulkOp::Lt:	return x.i < k.i;
+		case BulkOp::Le:	return x.i <= k.i;
+		case BulkOp::Gt:	return x.i > k.i;
+		default:			return x.i >= k.i;
+		}
+	};
+	// Which NaN comes out of adding two of them isn't up to us.
+	auto const same = [] (BulkElement e, Reg x, Reg y) {
+		return x.u == y.u || (BulkElement::Real == e && x.r != x.r && y.r != y.r);
+	};
+	auto const close = [] (Real x, Real y) {
+		return std::fabs(x - y) <= 1e-9 * std::max(std::fabs(x), std::fabs(y));
+	};
+	(void)same; (void)close;
+
+	// Every kernel of every instruction set this machine has, against the
+	// above, on lengths around the vectors' widths, and in place
+	size_t const lengths [] = {0, 1, 3, 7, 15, 16, 17, 31, 32, 33, 100, 1001};
+	BulkIsa const isas [] = {BulkIsa::Scalar, BulkIsa::SSE2, BulkIsa::AVX2};
+	BulkElement const elements [] = {BulkElement::Int, BulkElement::Real, BulkElement::Byte};
+	uint32_t checked = 0;
+	for (auto isa : isas)
+	{
+		if (!UPL::VM::BulkUseIsa(isa))
+			continue;
+		assert (UPL::VM::BulkCurrentIsa() == isa);
+		for (auto e : elements)
+			for (auto n : lengths)
+				for (int op = 0; op < UPL::VM::BulkOpCount; ++op)
+				{
+					auto const o = BulkOp(op);
+					auto const a = fill(e, n, true), b = fill(e, n, true);
+					auto const k = (n > 0 && 0 == rng() % 2) ? a.get(rng() % n) : random(rng, e, false);
+					if (o <= BulkOp::Max)
+					{
+						Data mapped = a, zipped = a, in_place = a;
+						UPL::VM::BulkMap (e, o, mapped.bytes.data(), a.bytes.data(), k, n);
+						UPL::VM::BulkZip (e, o, zipped.bytes.data(), a.bytes.data(), b.bytes.data(), n);
+						UPL::VM::BulkMap (e, o, in_place.bytes.data(), in_place.bytes.data(), k, n);
+						for (size_t i = 0; i < n; ++i)
+						{
+							assert (same(e, mapped.get(i), apply(e, o, a.get(i), k)));
+							assert (same(e, zipped.get(i), apply(e, o, a.get(i), b.get(i))));
+							assert (same(e, in_place.get(i), mapped.get(i)));
+						}
+
+						// Reals are reduced without NaNs (or overflow), as their
+						// lanes are combined in another order.
+						if (o != BulkOp::Sub)
+						{
+							Data r = a;
+							if (BulkElement::Real == e)
+								for (size_t i = 0; i < n; ++i)
+									r.set (i, Reg::FromReal(std::uniform_real_distribution<Real>(0.5, 1.5)(rng)));
+							auto const init = (BulkElement::Real == e) ? Reg::FromReal(1.25) : Reg::FromInt(3);
+							auto want = init;
+							for (size_t i = 0; i < n; ++i)
+								want = apply((BulkElement::Real == e) ? e : BulkElement::Int, o, want, r.get(i));
+							auto const got = UPL::VM::BulkReduce(e, o, init, r.bytes.data(), n);
+							assert ((BulkElement::Real == e && o <= BulkOp::Mul) ? close(got.r, want.r) : got.u == want.u);
+							(void)got;
+						}
+					}
+					else
+						for (int negate = 0; negate < 2; ++negate)
+						{
+							Data out = a, in_place = a;
+							out.resize (n);
+							auto const kept = UPL::VM::BulkFilter(e, o, 0 != negate, out.bytes.data(), a.bytes.data(), k, n);
+							auto const kept_in_place = UPL::VM::BulkFilter(e, o, 0 != negate, in_place.bytes.data(), in_place.bytes.data(), k, n);
+							size_t j = 0;
+							for (size_t i = 0; i < n; ++i)
+								if (holds(e, o, a.get(i), k) != (0 != negate))
+								{
+									assert (j < kept && same(e, out.get(j), a.get(i)) && same(e, in_place.get(j), a.get(i)));
+									++j;
+								}
+							assert (j == kept && kept == kept_in_place);
+							(void)kept; (void)kept_in_place;
+						}
+					checked += 1;
+				}
+	}
+	UPL::VM::BulkUseIsa (best);
+	wcout << "  " << checked << " kernel runs checked against one element at a time" << endl;
+
+	// Three modules with the same types: for the instruction's checks, and
+	// for loops as they are and lowered.
+	UPL::VM::Module modules [3];
+	ID t_vi = 0, t_vr = 0, t_vb = 0, t_vs = 0;
+	auto const t_int = STContainer::DefaultID(Tag::Int);
+	auto const t_real = STContainer::DefaultID(Tag::Real);
+	for (auto & m : modules)
+	{
+		auto & types = m.types();
+		t_vi = types.createType(Unpacked(Tag::Vector, false, t_int));
+		t_vr = types.createType(Unpacked(Tag::Vector, false, t_real));
+		t_vb = types.createType(Unpacked(Tag::Vector, false, STContainer::DefaultID(Tag::Byte)));
+		t_vs = types.createType(Unpacked(Tag::Vector, false, STContainer::DefaultID(Tag::String)));
+	}
+	auto const & types = modules[0].types();
+	auto const element_of = [&types] (ID vector_type) {
+		auto const tag = types.tag(types.getVectorType(vector_type));
+		return (tag == Tag::Int) ? BulkElement::Int : (tag == Tag::Real) ? BulkElement::Real : BulkElement::Byte;
+	};
+
+	auto const make = [] (Heap & heap, ID type, size_t n, std::function<Reg (size_t)> const & f) {
+		auto const obj = heap.allocate(type, uint32_t(n));
+		assert (nullptr != obj);
+		UPL::Type::Size offset, stride;
+		ID element;
+		heap.elementInfo (obj, offset, element, stride);
+		auto const p = static_cast<uint8_t *>(heap.payload(obj)) + offset;
+		for (size_t i = 0; i < n; ++i)
+		{
+			auto const v = f(i);
+			if (1 == stride)
+				p[i] = uint8_t(v.i);
+			else
+				memcpy (p + i * stride, &v, 8);
+		}
+		return Value::FromObject(obj);
+	};
+	auto const element = [] (Heap & heap, Value v, size_t i) {
+		UPL::Type::Size offset, stride;
+		ID type;
+		heap.elementInfo (v.asObject(), offset, type, stride);
+		auto const p = static_cast<uint8_t const *>(heap.payload(v.asObject())) + offset + i * stride;
+		Reg ret = Reg::FromInt(0);
+		if (1 == stride)
+			ret.i = *p;
+		else
+			memcpy (&ret, p, 8);
+		return ret;
+	};
+
+	UPL::VM::HeapConfig config;
+	config.nursery_size = 32 << 20;
+	{
+		Heap heap (modules[2].types(), config);
+		heap.reserve (1 << 20);
+		auto const ints = make(heap, t_vi, 10, [] (size_t i) {return Reg::FromInt(Int(i));});
+		auto const short_ints = make(heap, t_vi, 4, [] (size_t i) {return Reg::FromInt(Int(i));});
+		auto const reals = make(heap, t_vr, 10, [] (size_t i) {return Reg::FromReal(Real(i));});
+		auto const bytes = make(heap, t_vb, 10, [] (size_t i) {return Reg::FromInt(Int(i));});
+		auto const strings = make(heap, t_vs, 0, [] (size_t) {return Reg::Nil();});
+		auto const empty = make(heap, t_vi, 0, [] (size_t) {return Reg::Nil();});
+
+		uint64_t done = 0;
+		auto const run = [&heap, &done] (uint8_t code, std::vector<Reg> args, Reg * out_result) {
+			args.insert (args.begin(), Reg::Nil());
+			auto const err = UPL::VM::RunBulk(heap, code, unsigned(args.size() - 1), args.data(), done);
+			if (nullptr != out_result)
+				*out_result = args[0];
+			return err;
+		};
+		auto const obj = [] (Value v) {return Reg::FromValue(v);};
+		auto const map_add = UPL::VM::BulkCode(BulkForm::Map, BulkOp::Add);
+		auto const lt = UPL::VM::BulkCode(BulkForm::Filter, BulkOp::Lt);
+		Reg r;
+		bool ok = true;
+		ok = ok && (UPL::VM::RunError::BadOpcode == run(UPL::VM::BulkCode(BulkForm::Reduce, BulkOp::Sub), {Reg::FromInt(0), obj(ints)}, nullptr));
+		ok = ok && (UPL::VM::RunError::BadOpcode == run(UPL::VM::BulkCode(BulkForm::Map, BulkOp::Lt), {obj(ints), obj(ints), Reg::FromInt(0)}, nullptr));
+		ok = ok && (UPL::VM::RunError::BadArgCount == run(map_add, {obj(ints), obj(ints)}, nullptr));
+		ok = ok && (UPL::VM::RunError::NotAnObject == run(map_add, {obj(ints), Reg::FromInt(1), Reg::FromInt(0)}, nullptr));
+		ok = ok && (UPL::VM::RunError::BadField == run(map_add, {obj(reals), obj(ints), Reg::FromInt(0)}, nullptr));
+		ok = ok && (UPL::VM::RunError::BadField == run(map_add, {obj(strings), obj(strings), Reg::Nil()}, nullptr));
+		ok = ok && (UPL::VM::RunError::IndexOutOfRange == run(map_add, {obj(short_ints), obj(ints), Reg::FromInt(0)}, nullptr));
+		ok = ok && (UPL::VM::RunError::IndexOutOfRange == run(UPL::VM::BulkCode(BulkForm::Zip, BulkOp::Add), {obj(ints), obj(ints), obj(short_ints)}, nullptr));
+		ok = ok && (element(heap, ints, 0).i == 0 && element(heap, ints, 9).i == 9);
+
+		// Nothing to do needs no out; a filter needs only room for what it keeps.
+		ok = ok && (UPL::VM::RunError::None == run(map_add, {Reg::Nil(), obj(empty), Reg::FromInt(0)}, nullptr));
+		ok = ok && (UPL::VM::RunError::None == run(lt, {obj(short_ints), obj(ints), Reg::FromInt(3)}, &r) && r.i == 3);
+		ok = ok && (UPL::VM::RunError::IndexOutOfRange == run(lt, {obj(short_ints), obj(ints), Reg::FromInt(6)}, nullptr));
+		ok = ok && (UPL::VM::RunError::None == run(UPL::VM::BulkCode(BulkForm::Reduce, BulkOp::Add), {Reg::FromInt(1), obj(bytes)}, &r) && r.i == 46);
+		ok = ok && (UPL::VM::RunError::None == run(UPL::VM::BulkCode(BulkForm::Zip, BulkOp::Mul), {obj(reals), obj(reals), obj(reals)}, &r));
+		ok = ok && (r.u == obj(reals).u && element(heap, reals, 9).r == 81);
+		assert (ok);
+		(void)ok;
+		(void)r;
+		wcout << "  the instruction's checks, on " << done << " elements: done" << endl;
+	}
+
+	// Loops the way the front end writes them, as they are and lowered
+	IRModule irs [2];
+	for (int variant = 0; variant < 2; ++variant)
+	{
+		auto & out = irs[variant];
+		auto & types = modules[variant].types();
+		auto const fn = [&types] (ID result, std::vector<ID> params) {
+			return types.createType(Unpacked(Tag::Function, false, result, params));
+		};
+
+		// The loop "for i = 0; i < len(a); i += 1 {...}", with "body" in it
+		auto const loop = [t_int] (IRBuilder & b, ValueID a, std::function<void (ValueID i)> const & body) {
+			auto i = b.newVariable(t_int);
+			b.assign (i, b.copy(b.constInt(0)));
+			auto head = b.newBlock(), inside = b.newBlock(), done = b.newBlock();
+			b.jump (head);
+			b.setBlock (head);
+			b.branch (b.binary(BinaryOp::Lt, b.use(i), b.length(a)), inside, done);
+			b.seal (inside);
+			b.setBlock (inside);
+			body (b.use(i));
+			b.assign (i, b.copy(b.binary(BinaryOp::Add, b.use(i), b.constInt(1))));
+			b.jump (head);
+			b.seal (head); b.seal (done);
+			b.setBlock (done);
+		};
+
+		// def Scale = func(vector<int> out, vector<int> a, int k)->int {for ... out[i] = a[i] * k; len(out);};
+		{
+			out.functions.push_back (IRFunction("Scale", fn(t_int, {t_vi, t_vi, t_int}), {t_vi, t_vi, t_int}));
+			IRBuilder b (out.functions.back(), types);
+			loop (b, b.param(1), [&] (ValueID i) {
+				b.setElement (b.param(0), i, b.binary(BinaryOp::Mul, b.getElement(b.param(1), i, t_int), b.param(2)));
+			});
+			b.ret (b.length(b.param(0)));
+		}
+
+		// def AddTo = func(vector<real> out, vector<real> a, vector<real> b)->int {for ... out[i] = a[i] + b[i]; 0;};
+		{
+			out.functions.push_back (IRFunction("AddTo", fn(t_int, {t_vr, t_vr, t_vr}), {t_vr, t_vr, t_vr}));
+			IRBuilder b (out.functions.back(), types);
+			loop (b, b.param(1), [&] (ValueID i) {
+				b.setElement (b.param(0), i, b.binary(BinaryOp::Add, b.getElement(b.param(1), i, t_real), b.getElement(b.param(2), i, t_real)));
+			});
+			b.ret (b.constInt(0));
+		}
+
+		// def Total = func(vector<byte> a)->int {var acc = 0; for ... acc = acc + a[i]; acc;};
+		// def Product = func(vector<int> a, int init)->int {var acc = init; for ... acc = a[i] * acc; acc;};
+		// def SumReals = func(vector<real> a)->real {var acc = 0.0; for ... acc = acc + a[i]; acc;};
+		for (int which = 0; which < 3; ++which)
+		{
+			static char const * const sc_Names [] = {"Total", "Product", "SumReals"};
+			auto const t_a = (0 == which) ? t_vb : (1 == which) ? t_vi : t_vr;
+			auto const t_acc = (2 == which) ? t_real : t_int;
+			auto const params = (1 == which) ? std::vector<ID>{t_a, t_int} : std::vector<ID>{t_a};
+			out.functions.push_back (IRFunction(sc_Names[which], fn(t_acc, params), params));
+			IRBuilder b (out.functions.back(), types);
+			auto acc = b.newVariable(t_acc);
+			b.assign (acc, (1 == which) ? b.param(1) : (2 == which) ? b.constReal(0) : b.constInt(0));
+			loop (b, b.param(0), [&] (ValueID i) {
+				auto const x = b.getElement(b.param(0), i, types.getVectorType(t_a));
+				b.assign (acc, b.copy((1 == which) ? b.binary(BinaryOp::Mul, x, b.use(acc)) : b.binary(BinaryOp::Add, b.use(acc), x)));
+			});
+			b.ret (b.use(acc));
+		}
+
+		// def Keep = func(vector<real> out, vector<real> a, real k)->int {
+		//     var j = 0; for ... if (!(a[i] < k)) {out[j] = a[i]; j = j + 1;} j;};
+		// def Big = func(vector<int> out, vector<int> a)->int {
+		//     var j = 0; for ... if (10 < a[i]) {out[j] = a[i]; j = j + 1;} j;};
+		for (int which = 0; which < 2; ++which)
+		{
+			auto const t_v = (0 == which) ? t_vr : t_vi;
+			auto const params = (0 == which) ? std::vector<ID>{t_v, t_v, t_real} : std::vector<ID>{t_v, t_v};
+			out.functions.push_back (IRFunction((0 == which) ? "Keep" : "Big", fn(t_int, params), params));
+			IRBuilder b (out.functions.back(), types);
+			auto j = b.newVariable(t_int);
+			b.assign (j, b.copy(b.constInt(0)));
+			loop (b, b.param(1), [&] (ValueID i) {
+				auto const x = b.getElement(b.param(1), i, types.getVectorType(t_v));
+				auto const test = (0 == which)
+					? b.logicalNot(b.binary(BinaryOp::Lt, x, b.param(2)))
+					: b.binary(BinaryOp::Lt, b.constInt(10), x);
+				auto store = b.newBlock(), join = b.newBlock();
+				b.branch (test, store, join);
+				b.seal (store);
+				b.setBlock (store);
+				b.setElement (b.param(0), b.use(j), x);
+				b.assign (j, b.copy(b.binary(BinaryOp::Add, b.use(j), b.constInt(1))));
+				b.jump (join);
+				b.seal (join);
+				b.setBlock (join);
+			});
+			b.ret (b.use(j));
+		}
+	}
+
+	std::string error;
+	std::vector<PassReport> reports;
+	for (auto & f : irs[1].functions)
+	{
+		Optimize (f, modules[1].types(), &reports);
+		bool ok = f.verify(error);
+		if (!ok) wcout << "Not valid after lowering " << f.name().c_str() << ": " << error.c_str() << endl;
+		assert (ok);
+		(void)ok;
+	}
+	auto const bulks = [&irs] (char const * name) {
+		uint32_t ret = 0;
+		for (auto const & f : irs[1].functions)
+			if (f.name() == name)
+				for (auto const & ins : f.values())
+					ret += (!ins.dead && NoBlock != ins.block && ins.op == IROp::Bulk) ? 1 : 0;
+		return ret;
+	};
+	assert (bulks("Scale") == 1 && bulks("AddTo") == 1 && bulks("Total") == 1 && bulks("Product") == 1);
+	assert (bulks("Keep") == 1 && bulks("Big") == 1 && bulks("SumReals") == 0);
+	(void)bulks;
+	for (auto const & r : reports)
+		if (0 == strcmp(r.pass, "bulk-loops"))
+			wcout << "  " << r.changes << " loops lowered, in " << r.nanoseconds / 1000.0 << "us" << endl;
+	wcout << irs[0].functions.back().print(types) << irs[1].functions.back().print(types);
+
+	// ...and with reals reassociated
+	{
+		IRFunction sums = irs[1].functions[4];
+		auto const lowered = LowerBulkLoops(sums, types, true);
+		assert (1 == lowered && sums.verify(error));
+		(void)lowered;
+	}
+
+	UPL::Error::Reporter err;
+	for (int i = 0; i < 2; ++i)
+	{
+		bool ok = EmitModule(irs[i], modules[i], error);
+		if (!ok) wcout << "Emit failed: " << error.c_str() << endl;
+		assert (ok);
+		(void)ok;
+	}
+	wcout << modules[1].disassemble(modules[1].findFunction("Keep"));
+
+	Heap heap_0 (modules[0].types(), config), heap_1 (modules[1].types(), config);
+	Heap * const heaps [2] = {&heap_0, &heap_1};
+	UPL::VM::Interpreter plain (modules[0], err, heap_0), lowered (modules[1], err, heap_1);
+	UPL::VM::Interpreter * const vms [2] = {&plain, &lowered};
+
+	// The vectors come first among the arguments; reals are summed
+	// without NaNs.
+	struct Case {char const * name; ID params [3]; int vectors; bool in_place;};
+	Case const cases [] = {
+		{"Scale", {t_vi, t_vi, t_int}, 2, false},
+		{"Scale", {t_vi, t_vi, t_int}, 2, true},
+		{"AddTo", {t_vr, t_vr, t_vr}, 3, false},
+		{"Total", {t_vb, 0, 0}, 1, false},
+		{"Product", {t_vi, t_int, 0}, 1, false},
+		{"SumReals", {t_vr, 0, 0}, 1, false},
+		{"Keep", {t_vr, t_vr, t_real}, 2, false},
+		{"Keep", {t_vr, t_vr, t_real}, 2, true},
+		{"Big", {t_vi, t_vi, 0}, 2, false},
+	};
+	for (auto n : lengths)
+		for (auto const & c : cases)
+		{
+			bool const sums = 0 == strcmp(c.name, "SumReals");
+			auto const seed = rng();
+			Reg results [2];
+			Value vectors [2][3];
+			int count = 0;
+			for (int v = 0; v < 2; ++v)
+			{
+				std::mt19937_64 data (seed);
+				Reg args [3];
+				heaps[v]->reserve (64 << 10);
+				for (count = 0; count < 3 && 0 != c.params[count]; ++count)
+					if (count < c.vectors)
+					{
+						auto const e = element_of(c.params[count]);
+						vectors[v][count] = make(*heaps[v], c.params[count], n, [&] (size_t) {
+							auto const r = random(data, e, !sums);
+							return sums ? Reg::FromReal(std::fabs(r.r) + 1) : r;
+						});
+						args[count] = Reg::FromValue(vectors[v][count]);
+					}
+					else
+						args[count] = random(data, (t_real == c.params[count]) ? BulkElement::Real : BulkElement::Int, false);
+				if (c.in_place)
+					args[0] = args[1];
+				bool ok = vms[v]->call(modules[v].findFunction(c.name), args, count, results[v]);
+				assert (ok);
+				(void)ok;
+			}
+
+			assert (sums ? close(results[0].r, results[1].r) : results[0].u == results[1].u);
+			for (int a = 0; a < c.vectors; ++a)
+				for (size_t i = 0; i < n; ++i)
+					assert (same(element_of(c.params[a]), element(heap_0, vectors[0][a], i), element(heap_1, vectors[1][a], i)));
+		}
+	assert (0 != lowered.stats().bulk_elements && 0 == plain.stats().bulk_elements);
+	wcout
+		<< "  the lowered loops agree with the originals: " << lowered.stats().instructions << " instructions instead of "
+		<< plain.stats().instructions << ", and " << lowered.stats().bulk_elements << " elements done in bulk" << endl;
+
+	// How fast: each instruction set, and a loop against the instruction
+	{
+		size_t const N = 1 << 16;
+		int const Rounds = 200;
+		auto const a = fill(BulkElement::Int, N, false), b = fill(BulkElement::Real, N, false), c = fill(BulkElement::Byte, N, false);
+		Data out_i = a, out_r = b;
+		auto const time = [N, Rounds] (std::function<void ()> const & f) {
+			auto const start = std::chrono::steady_clock::now();
+			for (int r = 0; r < Rounds; ++r)
+				f ();
+			return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / (double(N) * Rounds);
+		};
+		for (auto isa : isas)
+		{
+			if (!UPL::VM::BulkUseIsa(isa))
+				continue;
+			volatile Int sink = 0;
+			auto const map = time([&] {UPL::VM::BulkMap (BulkElement::Int, BulkOp::Add, out_i.bytes.data(), a.bytes.data(), Reg::FromInt(3), N);});
+			auto const zip = time([&] {UPL::VM::BulkZip (BulkElement::Real, BulkOp::Mul, out_r.bytes.data(), b.bytes.data(), b.bytes.data(), N);});
+			auto const sum = time([&] {sink = sink + UPL::VM::BulkReduce(BulkElement::Byte, BulkOp::Add, Reg::FromInt(0), c.bytes.data(), N).i;});
+			auto const keep = time([&] {sink = sink + Int(UPL::VM::BulkFilter(BulkElement::Int, BulkOp::Lt, false, out_i.bytes.data(), a.bytes.data(), Reg::FromInt(0), N));});
+			wcout
+				<< "  " << UPL::VM::BulkIsaName(isa) << ": map-add (ints) " << map << "ns, zip-mul (reals) " << zip << "ns, reduce-add (bytes) "
+				<< sum << "ns, filter-lt (ints) " << keep << "ns an element" << endl;
+		}
+		UPL::VM::BulkUseIsa (best);
+
+		size_t const M = 1 << 20;
+		for (auto name : {"Scale", "Total"})
+		{
+			bool const scale = 0 == strcmp(name, "Scale");
+			double ns [2];
+			Reg results [2];
+			for (int v = 0; v < 2; ++v)
+			{
+				heaps[v]->reserve (10 << 20);
+				auto const obj = make(*heaps[v], scale ? t_vi : t_vb, M, [] (size_t i) {return Reg::FromInt(Int(i * 7919 % 251));});
+				Reg const args [] = {Reg::FromValue(obj), Reg::FromValue(obj), Reg::FromInt(3)};
+				auto const start = std::chrono::steady_clock::now();
+				bool ok = vms[v]->call(modules[v].findFunction(name), scale ? args : args + 1, scale ? 3 : 1, results[v]);
+				ns[v] = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / M;
+				assert (ok);
+				(void)ok;
+			}
+			assert (results[0].u == results[1].u);
+			wcout << "  " << name << "(2^20): " << ns[0] << "ns an element as a loop, " << ns[1] << "ns lowered (" << ns[0] / ns[1] << "x)" << endl;
+		}
+	}
+
+	ReportErrors (err);
+}
+
+//======================================================================
+
+void TestParallel ()
+{
+	using std::wcout;
+	using std::endl;
+	using UPL::Int;
+	using UPL::VM::Reg;
+	using UPL::VM::Value;
+	using UPL::VM::Heap;
+	using UPL::VM::Parallel;
+	using UPL::VM::ThreadPool;
+	using UPL::Type::Tag;
+	using UPL::Type::ID;
+	using UPL::Type::Unpacked;
+	using UPL::Type::STContainer;
+	using namespace UPL::CodeGen;
+
+	auto const hardware = UPL_MAX(1U, std::thread::hardware_concurrency());
+	wcout << "  hardware threads: " << hardware << endl;
+
+	// The pool on its own: every element exactly once, however it's split
+	for (unsigned threads : {1U, 2U, 4U, 8U})
+	{
+		ThreadPool pool (threads);
+		size_t const N = 1000003;
+		std::vector<std::atomic<uint8_t>> hits (N);
+		for (auto grain : {size_t(1), size_t(64), size_t(5000), N})
+		{
+			for (auto & h : hits)
+				h.store (0);
+			pool.parallelFor (N, grain, [&] (size_t begin, size_t end, unsigned worker) {
+				assert (worker < threads && begin < end && end <= N && (end - begin >= grain || end == N));
+				for (size_t i = begin; i < end; ++i)
+					hits[i].fetch_add (1);
+				(void)worker;
+			});
+			for (auto const & h : hits)
+			{
+				assert (1 == h.load());
+				(void)h;
+			}
+		}
+		pool.parallelFor (0, 1, [] (size_t, size_t, unsigned) {assert (false);});
+		auto const st = pool.stats();
+		wcout << "  " << threads << " threads: " << st.loops << " loops, " << st.ranges << " ranges run, "
+			<< st.splits << " splits, " << st.steals << " steals" << endl;
+	}
+
+	UPL::VM::Module module;
+	auto & types = module.types();
+	auto const t_int = STContainer::DefaultID(Tag::Int);
+	auto const t_vi = types.createType(Unpacked(Tag::Vector, false, t_int));
+	auto const fn = [&types] (ID result, std::vector<ID> params) {
+		return types.createType(Unpacked(Tag::Function, false, result, params));
+	};
+	auto const t_int_int = fn(t_int, {t_int});
+	auto const t_int_int_int = fn(t_int, {t_int, t_int});
+
+	enum {Steps, Add, Boxes, Inverse, Store, Touch, MapSteps, SumSteps, MapBoxes, MapInverse, MapTouch};
+	IRModule ir;
+
+	// def Steps = func(int n)->int {var s = 0; while (n != 1) {if (n % 2 == 0) n = n / 2; else n = 3 * n + 1; s = s + 1;} s;};
+	{
+		ir.functions.push_back (IRFunction("Steps", t_int_int, {t_int}));
+		IRBuilder b (ir.functions.back(), types);
+		auto n = b.newVariable(t_int), s = b.newVariable(t_int);
+		b.assign (n, b.param(0));
+		b.assign (s, b.copy(b.constInt(0)));
+		auto head = b.newBlock(), body = b.newBlock(), even = b.newBlock(), odd = b.newBlock(), next = b.newBlock(), done = b.newBlock();
+		b.jump (head);
+		b.setBlock (head);
+		b.branch (b.binary(BinaryOp::Eq, b.use(n), b.constInt(1)), done, body);
+		b.seal (body);
+		b.setBlock (body);
+		b.branch (b.binary(BinaryOp::Eq, b.binary(BinaryOp::Mod, b.use(n), b.constInt(2)), b.constInt(0)), even, odd);
+		b.seal (even); b.seal (odd);
+		b.setBlock (even);
+		b.assign (n, b.binary(BinaryOp::Div, b.use(n), b.constInt(2)));
+		b.jump (next);
+		b.setBlock (odd);
+		b.assign (n, b.binary(BinaryOp::Add, b.binary(BinaryOp::Mul, b.constInt(3), b.use(n)), b.constInt(1)));
+		b.jump (next);
+		b.seal (next);
+		b.setBlock (next);
+		b.assign (s, b.binary(BinaryOp::Add, b.use(s), b.constInt(1)));
+		b.jump (head);
+		b.seal (head); b.seal (done);
+		b.setBlock (done);
+		b.ret (b.use(s));
+	}
+
+	// def Add = func(int a, int b)->int {a + b;};
+	{
+		ir.functions.push_back (IRFunction("Add", t_int_int_int, {t_int, t_int}));
+		IRBuilder b (ir.functions.back(), types);
+		b.ret (b.binary(BinaryOp::Add, b.param(0), b.param(1)));
+	}
+
+	// Allocates, so collects garbage now and then, but is still pure:
+	// def Boxes = func(int x)->int {var v = newn vector<int> (x % 7 + 1); v[x % 7] = x; v[x % 7] * 2;};
+	{
+		ir.functions.push_back (IRFunction("Boxes", t_int_int, {t_int}));
+		IRBuilder b (ir.functions.back(), types);
+		auto const i = b.binary(BinaryOp::Mod, b.param(0), b.constInt(7));
+		auto const v = b.newArray(t_vi, b.binary(BinaryOp::Add, i, b.constInt(1)));
+		b.setElement (v, i, b.param(0));
+		b.ret (b.binary(BinaryOp::Mul, b.getElement(v, i, t_int), b.constInt(2)));
+	}
+
+	// def Inverse = func(int x)->int {1000000 / (x - 500);};
+	{
+		ir.functions.push_back (IRFunction("Inverse", t_int_int, {t_int}));
+		IRBuilder b (ir.functions.back(), types);
+		b.ret (b.binary(BinaryOp::Div, b.constInt(1000000), b.binary(BinaryOp::Sub, b.param(0), b.constInt(500))));
+	}
+
+	// Writes to what it's given, so neither it nor what calls it is pure:
+	// def Store = func(vector<int> v, int x)->int {v[0] = x; x;};
+	// def Touch = func(int x)->int {Store(newn vector<int> 1, x) + 1;};
+	{
+		ir.functions.push_back (IRFunction("Store", fn(t_int, {t_vi, t_int}), {t_vi, t_int}));
+		IRBuilder b (ir.functions.back(), types);
+		b.setElement (b.param(0), b.constInt(0), b.param(1));
+		b.ret (b.param(1));
+	}
+	{
+		ir.functions.push_back (IRFunction("Touch", t_int_int, {t_int}));
+		IRBuilder b (ir.functions.back(), types);
+		auto const v = b.newArray(t_vi, b.constInt(1));
+		auto const r = b.call(b.functionRef(Store, ir.functions[Store].type()), {v, b.param(0)}, t_int);
+		b.ret (b.binary(BinaryOp::Add, r, b.constInt(1)));
+	}
+
+	// def MapSteps = func(vector<int> a)->vector<int> {pmap(Steps, a);};
+	// def SumSteps = func(vector<int> a)->int {preduce(Add, 0, pmap(Steps, a));};
+	// and the same as MapSteps for Boxes, Inverse and Touch
+	auto const t_map = fn(t_vi, {t_vi});
+	for (auto which : {MapSteps, SumSteps, MapBoxes, MapInverse, MapTouch})
+	{
+		static char const * const sc_Names [] = {"MapSteps", "SumSteps", "MapBoxes", "MapInverse", "MapTouch"};
+		ir.functions.push_back (IRFunction(sc_Names[which - MapSteps], (SumSteps == which) ? fn(t_int, {t_vi}) : t_map, {t_vi}));
+		IRBuilder b (ir.functions.back(), types);
+		auto const f = (MapBoxes == which) ? Boxes : (MapInverse == which) ? Inverse : (MapTouch == which) ? Touch : Steps;
+		auto const mapped = b.parallelMap(t_vi, b.functionRef(f, t_int_int), b.param(0));
+		if (SumSteps == which)
+			b.ret (b.parallelReduce(b.functionRef(Add, t_int_int_int), b.constInt(0), mapped, t_int));
+		else
+			b.ret (mapped);
+	}
+
+	auto const pure = FindPureFunctions(ir);
+	assert (pure[Steps] && pure[Add] && pure[Boxes] && pure[Inverse] && !pure[Store] && !pure[Touch]);
+	(void)pure;
+
+	std::vector<PassReport> reports;
+	OptimizeModule (ir, types, &reports);
+	auto const count = [&ir] (uint32_t index, IROp op, uint32_t aux) {
+		uint32_t ret = 0;
+		for (auto const & ins : ir.functions[index].values())
+			ret += (!ins.dead && NoBlock != ins.block && ins.op == op && ins.aux == aux) ? 1 : 0;
+		return ret;
+	};
+	assert (1 == count(MapSteps, IROp::PMap, 1) && 1 == count(SumSteps, IROp::PMap, 1) && 1 == count(SumSteps, IROp::PReduce, 1));
+	assert (1 == count(MapBoxes, IROp::PMap, 1) && 1 == count(MapInverse, IROp::PMap, 1));
+	assert (0 == count(MapTouch, IROp::PMap, 0) && 0 == count(MapTouch, IROp::PMap, 1));
+	(void)count;
+	for (auto const & r : reports)
+		if (0 == strcmp(r.pass, "parallel-plan"))
+			wcout << "  " << r.changes << " left to run an element at a time, as a loop" << endl;
+	wcout << ir.functions[SumSteps].print(types) << ir.functions[MapTouch].print(types);
+
+	std::string error;
+	bool ok = EmitModule(ir, module, error);
+	if (!ok) wcout << "Emit failed: " << error.c_str() << endl;
+	assert (ok);
+	wcout << module.disassemble(SumSteps);
+
+	UPL::Error::Reporter err;
+	UPL::VM::HeapConfig config;
+	config.nursery_size = 128 << 10;
+	Heap heap (module.types(), config);
+
+	auto const make = [&heap, t_vi] (size_t n, std::function<Int (size_t)> const & f) {
+		auto const obj = heap.allocate(t_vi, uint32_t(n));
+		assert (nullptr != obj);
+		uint8_t * first;
+		ID element;
+		UPL::Type::Size stride;
+		uint32_t size;
+		heap.packedElements (obj, first, element, stride, size);
+		for (size_t i = 0; i < n; ++i)
+		{
+			auto const v = f(i);
+			memcpy (first + i * stride, &v, sizeof(v));
+		}
+		return Value::FromObject(obj);
+	};
+	auto const elements = [&heap] (Value v) {
+		uint8_t * first;
+		ID element;
+		UPL::Type::Size stride;
+		uint32_t size;
+		heap.packedElements (v.asObject(), first, element, stride, size);
+		std::vector<Int> ret (size);
+		for (size_t i = 0; i < size; ++i)
+			memcpy (&ret[i], first + i * stride, sizeof(Int));
+		return ret;
+	};
+
+	// Runs one of the functions on a new vector of "n" ints, i + 1, and
+	// keeps what it returns (rooted, if it's a vector.)
+	struct Run {bool ok; Reg result; std::vector<Int> mapped; UPL::VM::RunError error; double ns;};
+	auto const run = [&] (UPL::VM::Interpreter & vm, uint32_t function, size_t n) {
+		Run ret;
+		Value in = make(n, [] (size_t i) {return Int(i + 1);});
+		heap.addRoot (&in);
+		Reg arg = Reg::FromValue(in);
+		auto const start = std::chrono::steady_clock::now();
+		ret.ok = vm.call(function, &arg, 1, ret.result);
+		ret.ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+		ret.error = vm.lastError();
+		heap.removeRoot (&in);
+		if (ret.ok && SumSteps != function)
+			ret.mapped = elements(ret.result.value());
+		return ret;
+	};
+
+	// One at a time, in place: the reference (and the garbage collector
+	// moving things about under the calls)
+	UPL::VM::Interpreter sequential (module, err, heap);
+	size_t const N = 100000;
+	auto const steps = run(sequential, MapSteps, N);
+	auto const sum = run(sequential, SumSteps, N);
+	auto const boxes = run(sequential, MapBoxes, 20000);
+	auto const touched = run(sequential, MapTouch, 1000);
+	auto const failed = run(sequential, MapInverse, 1000);
+	assert (steps.ok && sum.ok && boxes.ok && touched.ok && !failed.ok && UPL::VM::RunError::DivisionByZero == failed.error);
+	assert (steps.mapped.size() == N && 0 == steps.mapped[0] && 7 == steps.mapped[2] && 111 == steps.mapped[26]);
+	Int total = 0;
+	for (auto s : steps.mapped)
+		total += s;
+	assert (total == sum.result.i);
+	for (size_t i = 0; i < boxes.mapped.size(); ++i)
+		assert (boxes.mapped[i] == 2 * Int(i + 1));
+	for (size_t i = 0; i < touched.mapped.size(); ++i)
+		assert (touched.mapped[i] == Int(i + 2));
+	assert (0 == sequential.stats().parallel_elements && 0 != heap.stats().minor_collections);
+	wcout << "  one at a time: " << N << " Collatz step counts in " << steps.ns / 1e6 << "ms, their sum in "
+		<< sum.ns / 1e6 << "ms; " << heap.stats().minor_collections << " minor collections along the way" << endl;
+
+	for (unsigned threads : {1U, 2U, 4U, hardware})
+	{
+		Parallel parallel (module, threads);
+		UPL::VM::Interpreter vm (module, err, heap);
+		vm.setParallel (&parallel);
+
+		auto const p_steps = run(vm, MapSteps, N);
+		auto const p_sum = run(vm, SumSteps, N);
+		auto const p_boxes = run(vm, MapBoxes, 20000);
+		auto const p_touched = run(vm, MapTouch, 1000);
+		auto const p_failed = run(vm, MapInverse, 1000);
+		assert (p_steps.ok && p_steps.mapped == steps.mapped && p_sum.ok && p_sum.result.i == sum.result.i);
+		assert (p_boxes.ok && p_boxes.mapped == boxes.mapped && p_touched.ok && p_touched.mapped == touched.mapped);
+		assert (!p_failed.ok && UPL::VM::RunError::DivisionByZero == p_failed.error);
+		assert (vm.stats().parallel_elements == 3 * N + 20000);
+		(void)p_touched;
+		(void)p_failed;
+
+		auto const st = parallel.poolStats();
+		wcout
+			<< "  " << threads << " thread" << ((1 == threads) ? "" : "s") << ": step counts in " << p_steps.ns / 1e6 << "ms ("
+			<< steps.ns / p_steps.ns << "x), their sum in " << p_sum.ns / 1e6 << "ms (" << sum.ns / p_sum.ns << "x); "
+			<< st.ranges << " ranges, " << st.splits << " splits, " << st.steals << " steals" << endl;
+	}
+	if (hardware < 4)
+		wcout << "  (with " << hardware << " hardware thread" << ((1 == hardware) ? "" : "s") << ", more threads can only cost time)" << endl;
+
+	(void)ok;
+	wcout << "  errors reported (one for each failed run): " << err.count() << endl;
+}
+
+//======================================================================
+
+void TestMemo ()
+{
+	using std::wcout;
+	using std::endl;
+	using UPL::Int;
+	using UPL::VM::Reg;
+	using UPL::VM::Memo;
+	using UPL::VM::MemoConfig;
+	using UPL::VM::MemoTable;
+	using UPL::VM::MemoReservation;
+	using UPL::Type::Tag;
+	using UPL::Type::ID;
+	using UPL::Type::Unpacked;
+	using UPL::Type::STContainer;
+	using namespace UPL::CodeGen;
+
+	UPL::VM::Module module;
+	auto & types = module.types();
+	auto const t_int = STContainer::DefaultID(Tag::Int);
+	auto const t_int_int = types.createType(Unpacked(Tag::Function, false, t_int, {t_int}));
+	auto const t_int_int_int = types.createType(Unpacked(Tag::Function, false, t_int, {t_int, t_int}));
+
+	enum {Fib, Steps, Mix, Inverse, Twice, Total, MixAll};
+	IRModule ir;
+
+	// Marked to be memoized:
+	// def Fib = func(int n)->int {if (n < 2) n; else Fib(n - 1) + Fib(n - 2);};
+	{
+		ir.functions.push_back (IRFunction("Fib", t_int_int, {t_int}));
+		ir.functions.back().setFlags (UPL::VM::Function::msc_Memoize);
+		IRBuilder b (ir.functions.back(), types);
+		auto const small = b.newBlock(), big = b.newBlock();
+		b.branch (b.binary(BinaryOp::Lt, b.param(0), b.constInt(2)), small, big);
+		b.seal (small); b.seal (big);
+		b.setBlock (small);
+		b.ret (b.param(0));
+		b.setBlock (big);
+		auto const self = b.functionRef(Fib, t_int_int);
+		auto const a = b.call(self, {b.binary(BinaryOp::Sub, b.param(0), b.constInt(1))}, t_int);
+		auto const c = b.call(self, {b.binary(BinaryOp::Sub, b.param(0), b.constInt(2))}, t_int);
+		b.ret (b.binary(BinaryOp::Add, a, c));
+	}
+
+	// Not marked; the trajectories meet, so memoizing pays:
+	// def Steps = func(int n)->int {if (n == 1) 0; else 1 + Steps(if (n % 2 == 0) n / 2; else 3 * n + 1);};
+	{
+		ir.functions.push_back (IRFunction("Steps", t_int_int, {t_int}));
+		IRBuilder b (ir.functions.back(), types);
+		auto const m = b.newVariable(t_int);
+		auto const one = b.newBlock(), more = b.newBlock(), even = b.newBlock(), odd = b.newBlock(), next = b.newBlock();
+		b.branch (b.binary(BinaryOp::Eq, b.param(0), b.constInt(1)), one, more);
+		b.seal (one); b.seal (more);
+		b.setBlock (one);
+		b.ret (b.constInt(0));
+		b.setBlock (more);
+		b.branch (b.binary(BinaryOp::Eq, b.binary(BinaryOp::Mod, b.param(0), b.constInt(2)), b.constInt(0)), even, odd);
+		b.seal (even); b.seal (odd);
+		b.setBlock (even);
+		b.assign (m, b.binary(BinaryOp::Div, b.param(0), b.constInt(2)));
+		b.jump (next);
+		b.setBlock (odd);
+		b.assign (m, b.binary(BinaryOp::Add, b.binary(BinaryOp::Mul, b.constInt(3), b.param(0)), b.constInt(1)));
+		b.jump (next);
+		b.seal (next);
+		b.setBlock (next);
+		auto const rest = b.call(b.functionRef(Steps, t_int_int), {b.use(m)}, t_int);
+		b.ret (b.binary(BinaryOp::Add, b.constInt(1), rest));
+	}
+
+	// Never called with the same arguments twice, so memoizing doesn't pay
+	// (and the recursive call is a tail call):
+	// def Mix = func(int n, int k)->int {if (k == 0) n; else Mix(n * 31 + 7, k - 1);};
+	{
+		ir.functions.push_back (IRFunction("Mix", t_int_int_int, {t_int, t_int}));
+		IRBuilder b (ir.functions.back(), types);
+		auto const done = b.newBlock(), more = b.newBlock();
+		b.branch (b.binary(BinaryOp::Eq, b.param(1), b.constInt(0)), done, more);
+		b.seal (done); b.seal (more);
+		b.setBlock (done);
+		b.ret (b.param(0));
+		b.setBlock (more);
+		auto const n = b.binary(BinaryOp::Add, b.binary(BinaryOp::Mul, b.param(0), b.constInt(31)), b.constInt(7));
+		b.ret (b.call(b.functionRef(Mix, t_int_int_int), {n, b.binary(BinaryOp::Sub, b.param(1), b.constInt(1))}, t_int));
+	}
+
+	// Marked, and fails for 5; marked functions aren't inlined, so Twice
+	// calls it twice:
+	// def Inverse = func(int x)->int {1000 / (x - 5);};
+	// def Twice = func(int x)->int {Inverse(x) + Inverse(x);};
+	{
+		ir.functions.push_back (IRFunction("Inverse", t_int_int, {t_int}));
+		ir.functions.back().setFlags (UPL::VM::Function::msc_Memoize);
+		IRBuilder b (ir.functions.back(), types);
+		b.ret (b.binary(BinaryOp::Div, b.constInt(1000), b.binary(BinaryOp::Sub, b.param(0), b.constInt(5))));
+	}
+	{
+		ir.functions.push_back (IRFunction("Twice", t_int_int, {t_int}));
+		IRBuilder b (ir.functions.back(), types);
+		auto const f = b.functionRef(Inverse, t_int_int);
+		b.ret (b.binary(BinaryOp::Add, b.call(f, {b.param(0)}, t_int), b.call(f, {b.param(0)}, t_int)));
+	}
+
+	// def Total = func(int n)->int {var s = 0; for (var i = 1; i <= n; i = i + 1) s = s + Steps(i); s;};
+	// def MixAll = func(int n)->int {var s = 0; for (var i = 1; i <= n; i = i + 1) s = s + Mix(i, 3); s;};
+	for (auto which : {Total, MixAll})
+	{
+		ir.functions.push_back (IRFunction((Total == which) ? "Total" : "MixAll", t_int_int, {t_int}));
+		IRBuilder b (ir.functions.back(), types);
+		auto i = b.newVariable(t_int), s = b.newVariable(t_int);
+		b.assign (i, b.copy(b.constInt(1)));
+		b.assign (s, b.copy(b.constInt(0)));
+		auto head = b.newBlock(), body = b.newBlock(), done = b.newBlock();
+		b.jump (head);
+		b.setBlock (head);
+		b.branch (b.binary(BinaryOp::Le, b.use(i), b.param(0)), body, done);
+		b.seal (body);
+		b.setBlock (body);
+		auto const x = (Total == which)
+			? b.call(b.functionRef(Steps, t_int_int), {b.use(i)}, t_int)
+			: b.call(b.functionRef(Mix, t_int_int_int), {b.use(i), b.constInt(3)}, t_int);
+		b.assign (s, b.binary(BinaryOp::Add, b.use(s), x));
+		b.assign (i, b.binary(BinaryOp::Add, b.use(i), b.constInt(1)));
+		b.jump (head);
+		b.seal (head); b.seal (done);
+		b.setBlock (done);
+		b.ret (b.use(s));
+	}
+
+	OptimizeModule (ir, types);
+	for (auto f : {Fib, Steps, Mix, Inverse, Twice, Total, MixAll})
+	{
+		assert (0 != (ir.functions[f].flags() & UPL::VM::Function::msc_Pure));
+		(void)f;
+	}
+	assert (0 != (ir.functions[Fib].flags() & UPL::VM::Function::msc_Memoize));
+
+	std::string error;
+	bool ok = EmitModule(ir, module, error);
+	if (!ok) wcout << "Emit failed: " << error.c_str() << endl;
+	assert (ok);
+	wcout << module.disassemble(Twice);
+
+	UPL::Error::Reporter err;
+	UPL::VM::Heap heap (module.types());
+	auto const call = [] (UPL::VM::Interpreter & vm, uint32_t function, Int x, double * out_ns = nullptr) {
+		Reg arg = Reg::FromInt(x), result = Reg::Nil();
+		auto const start = std::chrono::steady_clock::now();
+		bool const ok = vm.call(function, &arg, 1, result);
+		if (nullptr != out_ns)
+			*out_ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+		return ok ? result.i : Int(-1);
+	};
+
+	// Without: the reference
+	UPL::VM::Interpreter plain (module, err, heap);
+	double fib_ns, total_ns, mix_ns;
+	Int const fib = call(plain, Fib, 27, &fib_ns);
+	auto const fib_calls = plain.stats().calls;
+	size_t const N = 30000;
+	Int const total = call(plain, Total, N, &total_ns);
+	Int const mix = call(plain, MixAll, N, &mix_ns);
+	assert (196418 == fib && 0 == plain.stats().memo_hits + plain.stats().memo_misses);
+	wcout << "  without: Fib(27) in " << fib_ns / 1e6 << "ms (" << fib_calls << " calls), Total(" << N << ") in "
+		<< total_ns / 1e6 << "ms, MixAll(" << N << ") in " << mix_ns / 1e6 << "ms" << endl;
+
+	// Only the marked functions
+	{
+		Memo memo (module);
+		UPL::VM::Interpreter vm (module, err, heap);
+		vm.setMemo (&memo);
+		double ns;
+		Int const fib27 = call(vm, Fib, 27, &ns);
+		assert (fib == fib27 && vm.stats().calls < 100 && 25 == vm.stats().memo_hits);
+		Int const fib90 = call(vm, Fib, 90);
+		Int const total_marked = call(vm, Total, N);
+		assert (Int(2880067194370816120LL) == fib90 && total == total_marked && nullptr == memo.table(Steps));
+		(void)fib27; (void)fib90; (void)total_marked;
+		wcout << "  marked: Fib(27) in " << ns / 1e6 << "ms (" << fib_ns / ns << "x); "
+			<< vm.stats().memo_hits << " hits, " << vm.stats().memo_misses << " misses" << endl;
+
+		// A failed call leaves nothing behind
+		vm.resetStats ();
+		Int const failed = call(vm, Twice, 5);
+		Int const failed_again = call(vm, Twice, 5);
+		Int const twice = call(vm, Twice, 10);
+		assert (-1 == failed && -1 == failed_again && 400 == twice);
+		assert (1 == vm.stats().memo_hits && 3 == vm.stats().memo_misses);
+		(void)failed; (void)failed_again; (void)twice;
+	}
+
+	// The ones that turn out to be worth it, and for as long as they are;
+	// with small tables, the hits Steps had on trial don't last.
+	for (uint32_t capacity : {4096U, 64U})
+	{
+		MemoConfig config;
+		config.mode = MemoConfig::Mode::Profile;
+		config.capacity = capacity;
+		Memo memo (module, config);
+		UPL::VM::Interpreter vm (module, err, heap);
+		vm.setMemo (&memo);
+		double ns, m_ns;
+		Int const p_total = call(vm, Total, N, &ns);
+		Int const p_mix = call(vm, MixAll, N, &m_ns);
+		assert (total == p_total && mix == p_mix);
+		(void)p_total; (void)p_mix;
+		auto const steps = memo.table(Steps);
+		assert (nullptr == memo.table(Mix) && 0 != vm.stats().memo_hits && (nullptr != steps) == (4096 == capacity));
+		wcout << "  profiled, " << capacity << " entries: Total(" << N << ") in " << ns / 1e6 << "ms (" << total_ns / ns
+			<< "x), MixAll(" << N << ") in " << m_ns / 1e6 << "ms (" << mix_ns / m_ns << "x); Steps "
+			<< ((nullptr != steps) ? "kept its table" : "switched off") << "; " << vm.stats().memo_hits << " hits, "
+			<< vm.stats().memo_misses << " misses" << endl;
+
+		memo.clear ();
+		assert (nullptr == memo.table(Steps));
+		Int const again = call(vm, Total, N);
+		assert (total == again && (nullptr != memo.table(Steps)) == (4096 == capacity));
+		(void)again;
+		(void)steps;
+	}
+
+	// One that passes its trial while its arguments repeat, but is switched
+	// off at the next check once they stop
+	{
+		MemoConfig config;
+		config.mode = MemoConfig::Mode::Profile;
+		Memo memo (module, config);
+		UPL::VM::Interpreter vm (module, err, heap);
+		vm.setMemo (&memo);
+		for (int k = 0; k < 200; ++k)
+			call (vm, MixAll, 50);
+		bool const kept = nullptr != memo.table(Mix);
+		Int const p_mix = call(vm, MixAll, N);
+		assert (kept && mix == p_mix && nullptr == memo.table(Mix));
+		(void)kept; (void)p_mix;
+	}
+
+	// A reservation counts as found: the hand passes over it once, and
+	// takes an entry that wasn't found since instead. (Filling 4 entries,
+	// then reserving 5 takes 1's; 2 is found, so 6 takes 3's, 7 takes 4's,
+	// and 8 takes 2's, leaving 5's to be filled.)
+	{
+		MemoTable table (1, 4);
+		Reg key, result;
+		MemoReservation pending, r;
+		for (Int k = 1; k <= 5; ++k)
+		{
+			key = Reg::FromInt(k);
+			table.find (&key, result, (5 == k) ? &pending : &r);
+			if (5 != k)
+				table.fill (r, Reg::FromInt(10 * k), 1);
+		}
+		key = Reg::FromInt(2);
+		table.find (&key, result, nullptr);
+		for (Int k = 6; k <= 8; ++k)
+		{
+			key = Reg::FromInt(k);
+			table.find (&key, result, &r);
+			table.fill (r, Reg::FromInt(10 * k), 1);
+		}
+		table.fill (pending, Reg::FromInt(50), 1);
+		key = Reg::FromInt(5);
+		bool const found = table.find(&key, result, nullptr);
+		assert (found && 50 == result.i && 4 == table.counts().evictions);
+		(void)found;
+	}
+
+	(void)ok;
+	(void)fib;
+	(void)total;
+	(void)mix;
+	wcout << "  errors reported: " << err.count() << endl;
+}
+
+//======================================================================
+
+void TestGlobals ()
+{
+	using std::wcout;
+	using std::endl;
+	using UPL::Int;
+	using UPL::VM::Reg;
+	using UPL::VM::Heap;
+	using UPL::VM::Globals;
+	using UPL::VM::Interpreter;
+	using UPL::VM::RunError;
+	using UPL::Type::Tag;
+	using UPL::Type::ID;
+	using UPL::Type::Unpacked;
+	using UPL::Type::STContainer;
+	using namespace UPL::CodeGen;
+
+	auto const t_int = STContainer::DefaultID(Tag::Int);
+
+	// def Work = func(int n)->int {var s = 0; for (var i = 0; i < n; i = i + 1) s = (s * 31 + i) % 1000003; s;};
+	auto const add_work = [t_int] (IRModule & ir, STContainer & types) {
+		ir.functions.push_back (IRFunction("Work", types.createType(Unpacked(Tag::Function, false, t_int, {t_int})), {t_int}));
+		IRBuilder b (ir.functions.back(), types);
+		auto i = b.newVariable(t_int), s = b.newVariable(t_int);
+		b.assign (i, b.copy(b.constInt(0)));
+		b.assign (s, b.copy(b.constInt(0)));
+		auto head = b.newBlock(), body = b.newBlock(), done = b.newBlock();
+		b.jump (head);
+		b.setBlock (head);
+		b.branch (b.binary(BinaryOp::Lt, b.use(i), b.param(0)), body, done);
+		b.seal (body);
+		b.setBlock (body);
+		auto const mixed = b.binary(BinaryOp::Add, b.binary(BinaryOp::Mul, b.use(s), b.constInt(31)), b.use(i));
+		b.assign (s, b.binary(BinaryOp::Mod, mixed, b.constInt(1000003)));
+		b.assign (i, b.binary(BinaryOp::Add, b.use(i), b.constInt(1)));
+		b.jump (head);
+		b.seal (head); b.seal (done);
+		b.setBlock (done);
+		b.ret (b.use(s));
+	};
+	auto const emit = [] (IRModule & ir, UPL::VM::Module & module) {
+		OptimizeModule (ir, module.types());
+		std::string error;
+		bool const ok = EmitModule(ir, module, error);
+		if (!ok) wcout << "Emit failed: " << error.c_str() << endl;
+		assert (ok);
+		(void)ok;
+	};
+
+	UPL::Error::Reporter err;
+
+	// A configuration: lots of defs, of which an entry point uses a couple.
+	// def Work = ...;
+	// def G0 = Work(20000); def G1 = Work(20001); ...
+	// def Table = {var v = newn vector<int> 100; v[7] = Work(100); v;};
+	// def Main = func()->int {G3 + G250;};
+	// def SumTable = func()->int {Table[7] + G1;};
+	// def AddTable = func(int x)->int {x + Table[7]};
+	// def MapAddTable = func(vector<int> a)->vector<int> {pmap(AddTable, a);};
+	UPL::VM::Module module;
+	auto & types = module.types();
+	auto const t_vi = types.createType(Unpacked(Tag::Vector, false, t_int));
+	auto const t_void_int = types.createType(Unpacked(Tag::Function, false, t_int, {}));
+	auto const t_void_vi = types.createType(Unpacked(Tag::Function, false, t_vi, {}));
+	auto const t_int_int = types.createType(Unpacked(Tag::Function, false, t_int, {t_int}));
+	uint32_t const K = 300;
+	uint32_t const Work = 0, Init0 = 1, InitTable = Init0 + K, Main = InitTable + 1, SumTable = Main + 1;
+	uint32_t const AddTable = SumTable + 1, MapAddTable = AddTable + 1;
+	uint32_t const Table = K;		// The globals: G0... and then Table
+
+	IRModule ir;
+	add_work (ir, types);
+	for (uint32_t k = 0; k < K; ++k)
+	{
+		auto const name = "G" + std::to_string(k);
+		ir.functions.push_back (IRFunction("init " + name, t_void_int, {}));
+		IRBuilder b (ir.functions.back(), types);
+		b.ret (b.call(b.functionRef(Work, ir.functions[Work].type()), {b.constInt(20000 + k)}, t_int));
+		ir.globals.push_back ({name, t_int, Init0 + k});
+	}
+	{
+		ir.functions.push_back (IRFunction("init Table", t_void_vi, {}));
+		IRBuilder b (ir.functions.back(), types);
+		auto const v = b.newArray(t_vi, b.constInt(100));
+		b.setElement (v, b.constInt(7), b.call(b.functionRef(Work, ir.functions[Work].type()), {b.constInt(100)}, t_int));
+		b.ret (v);
+		ir.globals.push_back ({"Table", t_vi, InitTable});
+	}
+	{
+		ir.functions.push_back (IRFunction("Main", t_void_int, {}));
+		IRBuilder b (ir.functions.back(), types);
+		b.ret (b.binary(BinaryOp::Add, b.global(3, t_int), b.global(250, t_int)));
+	}
+	{
+		ir.functions.push_back (IRFunction("SumTable", t_void_int, {}));
+		IRBuilder b (ir.functions.back(), types);
+		b.ret (b.binary(BinaryOp::Add, b.getElement(b.global(Table, t_vi), b.constInt(7), t_int), b.global(1, t_int)));
+	}
+	{
+		ir.functions.push_back (IRFunction("AddTable", t_int_int, {t_int}));
+		IRBuilder b (ir.functions.back(), types);
+		b.ret (b.binary(BinaryOp::Add, b.param(0), b.getElement(b.global(Table, t_vi), b.constInt(7), t_int)));
+	}
+	{
+		ir.functions.push_back (IRFunction("MapAddTable", types.createType(Unpacked(Tag::Function, false, t_vi, {t_vi})), {t_vi}));
+		IRBuilder b (ir.functions.back(), types);
+		b.ret (b.parallelMap(t_vi, b.functionRef(AddTable, t_int_int), b.param(0)));
+	}
+
+	auto const pure = FindPureFunctions(ir);
+	assert (pure[Main] && pure[SumTable] && pure[AddTable]);
+	(void)pure;
+	emit (ir, module);
+	for (auto const & ins : ir.functions[MapAddTable].values())
+	{
+		assert (ins.dead || NoBlock == ins.block || IROp::PMap != ins.op);	// Reads Table, so it's a loop
+		(void)ins;
+	}
+	assert (K + 1 == module.globalCount() && Table == module.findGlobal("Table"));
+	wcout << module.disassemble(SumTable);
+
+	Heap heap (module.types());
+	auto const call = [] (Interpreter & vm, uint32_t function, double * out_ns = nullptr) {
+		Reg result = Reg::Nil();
+		auto const start = std::chrono::steady_clock::now();
+		bool const ok = vm.call(function, nullptr, 0, result);
+		if (nullptr != out_ns)
+			*out_ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+		return ok ? result.i : Int(-1);
+	};
+
+	// Without any globals, reading one is an error
+	{
+		Interpreter vm (module, err, heap);
+		Int const r = call(vm, Main);
+		assert (-1 == r && RunError::BadGlobal == vm.lastError());
+		(void)r;
+	}
+
+	// Lazily: only what the entry point uses is evaluated
+	Int main_value;
+	double lazy_ns, again_ns;
+	{
+		Globals globals (module, heap);
+		Interpreter vm (module, err, heap);
+		vm.setGlobals (&globals);
+		main_value = call(vm, Main, &lazy_ns);
+		assert (2 == globals.forcedCount() && globals.isForced(3) && globals.isForced(250) && !globals.isForced(Table));
+		Int const again = call(vm, Main, &again_ns);
+		assert (main_value == again && 2 == globals.stats().forced);
+		(void)again;
+
+		Reg g3, g250;
+		bool const read = vm.readGlobal(3, g3) && vm.readGlobal(250, g250);
+		assert (read && g3.i + g250.i == main_value);
+		(void)read;
+
+		// A reference survives the collections (it's a root of the heap)
+		Int const table = call(vm, SumTable);
+		for (int i = 0; i < 3; ++i)
+		{
+			for (int j = 0; j < 1000; ++j)
+				heap.allocate (t_vi, 1000);
+			heap.collect (true);
+		}
+		Int const table_again = call(vm, SumTable);
+		assert (-1 != table && table == table_again && globals.isHeapBound(Table) && !globals.isHeapBound(0));
+		(void)table; (void)table_again;
+
+		// In place of the pmap, a loop
+		UPL::VM::Value in = UPL::VM::Value::FromObject(heap.allocate(t_vi, 10));
+		heap.addRoot (&in);
+		Reg arg = Reg::FromValue(in), mapped;
+		bool const mapped_ok = vm.call(MapAddTable, &arg, 1, mapped);
+		heap.removeRoot (&in);
+		assert (mapped_ok && 0 == vm.stats().parallel_elements);
+		(void)mapped_ok;
+
+		wcout << "  lazily: Main in " << lazy_ns / 1e6 << "ms, forcing " << 2 << " of " << module.globalCount()
+			<< " globals; again in " << again_ns / 1e3 << "us" << endl;
+	}
+
+	// Eagerly: everything, as it would be without thunks
+	{
+		Globals globals (module, heap);
+		Interpreter vm (module, err, heap);
+		vm.setGlobals (&globals);
+		auto const start = std::chrono::steady_clock::now();
+		bool const all = globals.forceAll(vm);
+		auto const eager_ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+		Int const eager_main = call(vm, Main);
+		assert (all && module.globalCount() == globals.forcedCount() && main_value == eager_main);
+		(void)all; (void)eager_main;
+		wcout << "  eagerly: all " << module.globalCount() << " globals in " << eager_ns / 1e6 << "ms ("
+			<< eager_ns / lazy_ns << "x as long as Main lazily)" << endl;
+	}
+
+	// Written out and read back in
+	auto const path = TempPath("playpen-globals.uplm");
+	{
+		auto const res = UPL::VM::SaveModule(module, path.c_str());
+		UPL::VM::Module loaded;
+		auto const res2 = UPL::VM::LoadModule(path.c_str(), loaded, true);
+		assert (UPL::VM::ModuleFileError::None == res && UPL::VM::ModuleFileError::None == res2);
+		assert (loaded.globalCount() == module.globalCount() && Table == loaded.findGlobal("Table"));
+		assert (InitTable == loaded.global(Table).initializer && std::string("G250") == loaded.globalName(250));
+		Heap loaded_heap (loaded.types());
+		Globals globals (loaded, loaded_heap);
+		Interpreter vm (loaded, err, loaded_heap);
+		vm.setGlobals (&globals);
+		Int const loaded_main = call(vm, Main);
+		assert (main_value == loaded_main);
+		(void)res; (void)res2; (void)loaded_main;
+	}
+	remove (path.c_str());		// Once the mapping is gone
+
+	// Cycles, and forcing from several threads:
+	// def Self = Self + 1;
+	// def Ping = Pong + 1; def Pong = Ping + 1;
+	// def Slow = Work(3000000);
+	// def AddSlow = func(int x)->int {x + Slow;};
+	// def MapAddSlow = func(vector<int> a)->vector<int> {pmap(AddSlow, a);};
+	UPL::VM::Module module2;
+	auto & types2 = module2.types();
+	auto const t2_vi = types2.createType(Unpacked(Tag::Vector, false, t_int));
+	auto const t2_void_int = types2.createType(Unpacked(Tag::Function, false, t_int, {}));
+	auto const t2_int_int = types2.createType(Unpacked(Tag::Function, false, t_int, {t_int}));
+	enum {Work2, InitSelf, InitPing, InitPong, InitSlow, AddSlow, MapAddSlow};
+	enum {Self, Ping, Pong, Slow};
+	IRModule ir2;
+	add_work (ir2, types2);
+	for (auto which : {InitSelf, InitPing, InitPong})
+	{
+		static char const * const sc_Names [] = {"Self", "Ping", "Pong"};
+		auto const name = sc_Names[which - InitSelf];
+		ir2.functions.push_back (IRFunction(std::string("init ") + name, t2_void_int, {}));
+		IRBuilder b (ir2.functions.back(), types2);
+		auto const other = (InitSelf == which) ? Self : (InitPing == which) ? Pong : Ping;
+		b.ret (b.binary(BinaryOp::Add, b.global(other, t_int), b.constInt(1)));
+		ir2.globals.push_back ({name, t_int, uint32_t(which)});
+	}
+	{
+		ir2.functions.push_back (IRFunction("init Slow", t2_void_int, {}));
+		IRBuilder b (ir2.functions.back(), types2);
+		b.ret (b.call(b.functionRef(Work2, ir2.functions[Work2].type()), {b.constInt(3000000)}, t_int));
+		ir2.globals.push_back ({"Slow", t_int, InitSlow});
+	}
+	{
+		ir2.functions.push_back (IRFunction("AddSlow", t2_int_int, {t_int}));
+		IRBuilder b (ir2.functions.back(), types2);
+		b.ret (b.binary(BinaryOp::Add, b.param(0), b.global(Slow, t_int)));
+	}
+	{
+		ir2.functions.push_back (IRFunction("MapAddSlow", types2.createType(Unpacked(Tag::Function, false, t2_vi, {t2_vi})), {t2_vi}));
+		IRBuilder b (ir2.functions.back(), types2);
+		b.ret (b.parallelMap(t2_vi, b.functionRef(AddSlow, t2_int_int), b.param(0)));
+	}
+	emit (ir2, module2);
+	{
+		uint32_t parallel_maps = 0;
+		for (auto const & ins : ir2.functions[MapAddSlow].values())
+			parallel_maps += (!ins.dead && IROp::PMap == ins.op && 1 == ins.aux) ? 1 : 0;
+		assert (1 == parallel_maps);	// Slow is an int, which any heap can hold
+		(void)parallel_maps;
+	}
+
+	Heap heap2 (module2.types());
+	{
+		Globals globals (module2, heap2);
+		Interpreter vm (module2, err, heap2);
+		vm.setGlobals (&globals);
+		for (int attempt = 0; attempt < 2; ++attempt)
+			for (uint32_t g : {uint32_t(Self), uint32_t(Ping), uint32_t(Pong)})
+			{
+				Reg value;
+				bool const ok = vm.readGlobal(g, value);
+				assert (!ok && RunError::CyclicGlobal == vm.lastError() && !globals.isForced(g));
+				(void)ok;
+			}
+		assert (0 == globals.forcedCount() && 6 == globals.stats().cycles);
+		wcout << "  cycles: " << globals.stats().cycles << " found, " << globals.stats().failed << " initializers failed" << endl;
+	}
+
+	// The threads each force the same globals, with interpreters and heaps
+	// of their own: each is forced once, and the cycle between Ping and
+	// Pong is found even when two threads take a part each.
+	{
+		Globals globals (module2, heap2);
+		unsigned const T = 4;
+		std::atomic<unsigned> ready (0);
+		std::vector<Int> values (T, -1);
+		std::vector<RunError> errors (T, RunError::None);
+		std::vector<std::thread> threads;
+		auto const start = std::chrono::steady_clock::now();
+		for (unsigned t = 0; t < T; ++t)
+			threads.emplace_back ([&, t] {
+				UPL::Error::Reporter reporter;
+				Heap own_heap (module2.types());
+				Interpreter vm (module2, reporter, own_heap);
+				vm.setGlobals (&globals);
+				ready.fetch_add (1);
+				while (ready.load() < T)
+					std::this_thread::yield ();
+
+				Reg value;
+				if (vm.readGlobal(Slow, value))
+					values[t] = value.i;
+				Reg cyclic;
+				bool const ok = vm.readGlobal((t % 2) ? Ping : Pong, cyclic);
+				errors[t] = ok ? RunError::None : vm.lastError();
+			});
+		for (auto & t : threads)
+			t.join ();
+		auto const ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+
+		auto const st = globals.stats();
+		for (unsigned t = 0; t < T; ++t)
+			assert (values[t] == values[0] && -1 != values[0] && RunError::CyclicGlobal == errors[t]);
+		assert (1 == st.forced && 1 == globals.forcedCount() && T == st.cycles);
+		wcout << "  " << T << " threads: Slow forced " << st.forced << " time in " << ns / 1e6 << "ms; "
+			<< st.waits << " waits for another thread, " << st.cycles << " cycles found" << endl;
+
+		// And the workers of a Parallel read it too, without forcing it again
+		UPL::VM::Parallel parallel (module2, 2);
+		parallel.setGlobals (&globals);
+		Interpreter vm (module2, err, heap2);
+		vm.setGlobals (&globals);
+		vm.setParallel (&parallel);
+		UPL::VM::Value in = UPL::VM::Value::FromObject(heap2.allocate(t2_vi, 10000));
+		heap2.addRoot (&in);
+		Reg arg = Reg::FromValue(in), mapped;
+		bool const ok = vm.call(MapAddSlow, &arg, 1, mapped);
+		heap2.removeRoot (&in);
+		assert (ok && 10000 == vm.stats().parallel_elements && 1 == globals.stats().forced);
+		(void)ok;
+	}
+
+	(void)main_value;
+	wcout << "  errors reported: " << err.count() << endl;
+}
+
+//----------------------------------------------------------------------
+
+void TestScheduler ()
+{
+	using std::wcout;
+	using std::endl;
+	using UPL::Int;
+	using UPL::VM::Reg;
+	using UPL::VM::Heap;
+	using UPL::VM::Fiber;
+	using UPL::VM::Globals;
+	using UPL::VM::IoOp;
+	using UPL::VM::Interpreter;
+	using UPL::VM::RunError;
+	using UPL::VM::Scheduler;
+	using UPL::VM::SchedulerConfig;
+	using UPL::Type::Tag;
+	using UPL::Type::Unpacked;
+	using UPL::Type::STContainer;
+	using namespace UPL::CodeGen;
+
+	auto const elapsed_ns = [] (std::chrono::steady_clock::time_point start) {
+		return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+	};
+
+	// A bare fiber, switched into and out of
+#if UPL_FIBERS_AVAILABLE
+	{
+		struct PingPong
+		{
+			Fiber fiber;
+			uint64_t count = 0;
+			bool stop = false;
+		} pp;
+		assert (pp.fiber.valid());
+		pp.fiber.start ([] (void * arg) {
+			auto & p = *static_cast<PingPong *>(arg);
+			while (!p.stop)
+			{
+				p.count += 1;
+				p.fiber.suspend ();
+			}
+		}, &pp);
+
+		uint64_t const N = 1000000;
+		auto const start = std::chrono::steady_clock::now();
+		for (uint64_t i = 0; i < N; ++i)
+			pp.fiber.resume ();
+		auto const ns = elapsed_ns(start);
+		pp.stop = true;
+		bool const finished = pp.fiber.resume();
+		assert (finished && N == pp.count);
+		(void)finished;
+		wcout << "  fiber: " << ns / N << "ns for a resume and a suspend" << endl;
+	}
+#endif
+
+	// Small = func(int x)->int {yield(); x * 3 + 1;};
+	// Yielder = func(int n)->int {for (var i = 0; i < n; i = i + 1) yield(); n;};
+	// Sleeper = func(int ms)->int {sleep(ms); ms;};
+	// Writer = func(int fd)->int {sleep(20); var b = newn vector<byte> 4096; (fill b with 7s);
+	//     var t = 0; for (var k = 0; k < 64; k = k + 1) t = t + write(fd, b, 4096); close(fd); t;};
+	// Reader = func(int fd)->int {var b = newn vector<byte> 4096; var s = 0;
+	//     for (var r = read(fd, b, 4096); 0 < r; r = read(fd, b, 4096)) for (var i = 0; i < r; i = i + 1) s = s + b[i];
+	//     close(fd); s;};
+	// Churn = func(int n)->int {for (var i = 0; i < n; i = i + 1) {newn vector<int> 1000; yield();} n;};
+	// Spawner = func(int n)->int {for (var i = 0; i < n; i = i + 1) spawn(Small, i); n;};
+	// SpawnOne = func(int x)->int {spawn(Small, x);};
+	// BadRead = func(int fd)->int {read(fd, newn vector<int> 10, 10);};
+	// def Lazy = {sleep(20); 42;};
+	// ReadLazy = func(int x)->int {Lazy + x;};
+	UPL::VM::Module module;
+	auto & types = module.types();
+	auto const t_int = STContainer::DefaultID(Tag::Int);
+	auto const t_byte = STContainer::DefaultID(Tag::Byte);
+	auto const t_vi = types.createType(Unpacked(Tag::Vector, false, t_int));
+	auto const t_vb = types.createType(Unpacked(Tag::Vector, false, t_byte));
+	auto const t_int_int = types.createType(Unpacked(Tag::Function, false, t_int, {t_int}));
+	auto const t_void_int = types.createType(Unpacked(Tag::Function, false, t_int, {}));
+	enum {Small, Yielder, Sleeper, Writer, Reader, Churn, Spawner, SpawnOne, BadRead, InitLazy, ReadLazy};
+	enum {Lazy};
+
+	IRModule ir;
+	auto const add = [&] (char const * name) -> IRFunction & {
+		ir.functions.push_back (IRFunction(name, t_int_int, {t_int}));
+		return ir.functions.back();
+	};
+	auto const io = [t_int] (IRBuilder & b, IoOp op, std::vector<ValueID> operands) {
+		return b.io(uint8_t(op), std::move(operands), t_int);
+	};
+	// for (var i = 0; i < n; i = i + 1) body(i);
+	auto const loop = [t_int] (IRBuilder & b, ValueID n, std::function<void (ValueID)> const & body) {
+		auto i = b.newVariable(t_int);
+		b.assign (i, b.copy(b.constInt(0)));
+		auto head = b.newBlock(), inside = b.newBlock(), done = b.newBlock();
+		b.jump (head);
+		b.setBlock (head);
+		b.branch (b.binary(BinaryOp::Lt, b.use(i), n), inside, done);
+		b.seal (inside);
+		b.setBlock (inside);
+		body (b.use(i));
+		b.assign (i, b.binary(BinaryOp::Add, b.use(i), b.constInt(1)));
+		b.jump (head);
+		b.seal (head); b.seal (done);
+		b.setBlock (done);
+	};
+	{
+		IRBuilder b (add("Small"), types);
+		io (b, IoOp::Yield, {});
+		b.ret (b.binary(BinaryOp::Add, b.binary(BinaryOp::Mul, b.param(0), b.constInt(3)), b.constInt(1)));
+	}
+	{
+		IRBuilder b (add("Yielder"), types);
+		loop (b, b.param(0), [&] (ValueID) {io (b, IoOp::Yield, {});});
+		b.ret (b.param(0));
+	}
+	{
+		IRBuilder b (add("Sleeper"), types);
+		io (b, IoOp::Sleep, {b.param(0)});
+		b.ret (b.param(0));
+	}
+	{
+		IRBuilder b (add("Writer"), types);
+		io (b, IoOp::Sleep, {b.constInt(20)});
+		auto const buf = b.newArray(t_vb, b.constInt(4096));
+		loop (b, b.constInt(4096), [&] (ValueID i) {b.setElement (buf, i, b.constInt(7, t_byte));});
+		auto t = b.newVariable(t_int);
+		b.assign (t, b.copy(b.constInt(0)));
+		loop (b, b.constInt(64), [&] (ValueID) {
+			b.assign (t, b.binary(BinaryOp::Add, b.use(t), io(b, IoOp::Write, {b.param(0), buf, b.constInt(4096)})));
+		});
+		io (b, IoOp::Close, {b.param(0)});
+		b.ret (b.use(t));
+	}
+	{
+		IRBuilder b (add("Reader"), types);
+		auto const buf = b.newArray(t_vb, b.constInt(4096));
+		auto s = b.newVariable(t_int);
+		b.assign (s, b.copy(b.constInt(0)));
+		auto head = b.newBlock(), inside = b.newBlock(), done = b.newBlock();
+		b.jump (head);
+		b.setBlock (head);
+		auto const r = io(b, IoOp::Read, {b.param(0), buf, b.constInt(4096)});
+		b.branch (b.binary(BinaryOp::Lt, b.constInt(0), r), inside, done);
+		b.seal (inside);
+		b.setBlock (inside);
+		loop (b, r, [&] (ValueID i) {b.assign (s, b.binary(BinaryOp::Add, b.use(s), b.getElement(buf, i, t_byte)));});
+		b.jump (head);
+		b.seal (head); b.seal (done);
+		b.setBlock (done);
+		io (b, IoOp::Close, {b.param(0)});
+		b.ret (b.use(s));
+	}
+	{
+		IRBuilder b (add("Churn"), types);
+		loop (b, b.param(0), [&] (ValueID) {
+			b.newArray (t_vi, b.constInt(1000));
+			io (b, IoOp::Yield, {});
+		});
+		b.ret (b.param(0));
+	}
+	{
+		IRBuilder b (add("Spawner"), types);
+		loop (b, b.param(0), [&] (ValueID i) {io (b, IoOp::Spawn, {b.functionRef(Small, t_int_int), i});});
+		b.ret (b.param(0));
+	}
+	{
+		IRBuilder b (add("SpawnOne"), types);
+		b.ret (io(b, IoOp::Spawn, {b.functionRef(Small, t_int_int), b.param(0)}));
+	}
+	{
+		IRBuilder b (add("BadRead"), types);
+		b.ret (io(b, IoOp::Read, {b.param(0), b.newArray(t_vi, b.constInt(10)), b.constInt(10)}));
+	}
+	{
+		ir.functions.push_back (IRFunction("init Lazy", t_void_int, {}));
+		IRBuilder b (ir.functions.back(), types);
+		io (b, IoOp::Sleep, {b.constInt(20)});
+		b.ret (b.constInt(42));
+		ir.globals.push_back ({"Lazy", t_int, InitLazy});
+	}
+	{
+		IRBuilder b (add("ReadLazy"), types);
+		b.ret (b.binary(BinaryOp::Add, b.global(Lazy, t_int), b.param(0)));
+	}
+	OptimizeModule (ir, types);
+	{
+		std::string error;
+		bool const ok = EmitModule(ir, module, error);
+		if (!ok) wcout << "Emit failed: " << error.c_str() << endl;
+		assert (ok);
+		(void)ok;
+	}
+	wcout << module.disassemble(Reader);
+
+	auto const run = [] (Scheduler & s) {
+		auto const start = std::chrono::steady_clock::now();
+		s.run ();
+		return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+	};
+	auto const result = [] (Scheduler const & s, uint32_t task) {
+		Reg r;
+		RunError e;
+		return s.taskResult(task, r, e) ? r.i : Int(-1);
+	};
+
+	// Two tasks taking turns, on one thread
+	{
+		Scheduler s (module, 1);
+		Reg const n = Reg::FromInt(200000);
+		bool const spawned = s.spawn(Yielder, &n, 1) && s.spawn(Yielder, &n, 1);
+		assert (spawned && s.accepts(Small, 1) && !s.accepts(Small, 2) && !s.accepts(1000, 1));
+		(void)spawned;
+		auto const ns = run(s);
+		auto const st = s.stats();
+		assert (200000 == result(s, 0) && 200000 == result(s, 1) && 400000 == st.yields && 2 == st.contexts);
+		wcout << "  yielding: " << ns / st.switches << "ns per task switch (" << st.switches << " switches)" << endl;
+	}
+
+	// Lots of little tasks, each yielding once, on 1, 2 and 4 threads
+	for (unsigned threads : {1U, 2U, 4U})
+	{
+		uint32_t const N = 100000;
+		Scheduler s (module, threads);
+		for (uint32_t i = 0; i < N; ++i)
+		{
+			Reg const x = Reg::FromInt(i);
+			s.spawn (Small, &x, 1);
+		}
+		auto const ns = run(s);
+		auto const st = s.stats();
+		bool ok = N == st.finished && 0 == st.failed && st.max_started <= s.config().max_started;
+		for (uint32_t i = 0; i < N; i += 997)
+			ok = ok && Int(i) * 3 + 1 == result(s, i);
+		assert (ok);
+		(void)ok;
+		wcout << "  " << N << " tasks on " << threads << " thread(s): " << ns / 1e6 << "ms, "
+			<< N / (ns / 1e9) / 1e6 << "M tasks/s; " << st.contexts << " contexts, " << st.steals << " steals" << endl;
+	}
+
+	// Sleepers overlap
+	{
+		Scheduler s (module, 1);
+		for (Int i = 0; i < 100; ++i)
+		{
+			Reg const ms = Reg::FromInt(20 + i % 10);
+			s.spawn (Sleeper, &ms, 1);
+		}
+		auto const ns = run(s);
+		assert (100 == s.stats().sleeps && 29 == result(s, 99) && ns < 1000e6);
+		wcout << "  100 tasks sleeping 20-29ms each: " << ns / 1e6 << "ms in all" << endl;
+	}
+
+	// A pipe between two tasks, while a third fills the heap with garbage:
+	// the reader's buffer is moved while it waits.
+#if UPL_FIBERS_AVAILABLE
+	{
+		int fds [2];
+		bool const piped = 0 == pipe2(fds, O_NONBLOCK | O_CLOEXEC);
+		assert (piped);
+		(void)piped;
+
+		SchedulerConfig config;
+		config.worker_heap.nursery_size = 1 << 20;
+		Scheduler s (module, 1, config);
+		Reg const reader_fd = Reg::FromInt(fds[0]), churn_n = Reg::FromInt(2000), writer_fd = Reg::FromInt(fds[1]);
+		s.spawn (Reader, &reader_fd, 1);
+		s.spawn (Churn, &churn_n, 1);
+		s.spawn (Writer, &writer_fd, 1);
+		auto const ns = run(s);
+		auto const st = s.stats();
+		auto const heap_st = s.workerHeap(0).stats();
+		assert (7 * 64 * 4096 == result(s, 0) && 2000 == result(s, 1) && 64 * 4096 == result(s, 2));
+		assert (st.io_waits >= 1 && heap_st.minor_collections > 0);
+		wcout << "  pipe: " << 64 * 4096 / 1024 << "KB in " << ns / 1e6 << "ms, " << st.io_waits << " waits, "
+			<< heap_st.minor_collections << " collections meanwhile" << endl;
+	}
+#endif
+
+	// Tasks spawning tasks, which the other workers steal
+	{
+		Scheduler s (module, 2);
+		Reg const n = Reg::FromInt(1000);
+		s.spawn (Spawner, &n, 1);
+		run (s);
+		bool ok = 1001 == s.taskCount() && 1000 == result(s, 0);
+		for (uint32_t i = 1; i <= 1000; ++i)
+			ok = ok && Int(i - 1) * 3 + 1 == result(s, i);
+		assert (ok);
+		(void)ok;
+		wcout << "  spawned by a task: " << s.taskCount() - 1 << " tasks, " << s.stats().steals << " stolen" << endl;
+	}
+
+	// A task that fails doesn't take the others with it
+	{
+		Scheduler s (module, 1);
+		Reg const fd = Reg::FromInt(0), x = Reg::FromInt(5);
+		s.spawn (BadRead, &fd, 1);
+		s.spawn (Small, &x, 1);
+		run (s);
+		Reg r;
+		RunError e;
+		bool const ok = s.taskResult(0, r, e);
+		assert (!ok && RunError::BadField == e && 16 == result(s, 1) && 1 == s.stats().failed);
+		(void)ok;
+	}
+
+	// A global whose initializer sleeps: the other tasks reading it wait
+	// for the one forcing it (on its worker or another), not fail.
+	for (unsigned threads : {1U, 2U})
+	{
+		Heap heap (module.types());
+		Globals globals (module, heap);
+		Scheduler s (module, threads);
+		s.setGlobals (&globals);
+		for (Int i = 0; i < 10; ++i)
+		{
+			Reg const x = Reg::FromInt(i);
+			s.spawn (ReadLazy, &x, 1);
+		}
+		run (s);
+		auto const st = s.stats();
+		bool ok = 10 == st.finished && 0 == st.failed && (1 < threads || 9 == st.global_waits);
+		for (uint32_t i = 0; i < 10; ++i)
+			ok = ok && 42 + Int(i) == result(s, i);
+		assert (ok);
+		(void)ok;
+		wcout << "  a sleeping global on " << threads << " thread(s): " << st.global_waits << " tasks waited" << endl;
+	}
+
+	// Outside a task, I/O blocks, yielding does nothing and spawning fails
+	{
+		UPL::Error::Reporter err;
+		Heap heap (module.types());
+		Interpreter vm (module, err, heap);
+		Reg arg = Reg::FromInt(10), r;
+		auto const start = std::chrono::steady_clock::now();
+		bool const slept = vm.call(Sleeper, &arg, 1, r);
+		auto const ns = elapsed_ns(start);
+		assert (slept && 10 == r.i && ns >= 10e6);
+		bool const yielded = vm.call(Yielder, &arg, 1, r);
+		assert (yielded && 10 == r.i);
+		bool const spawned = vm.call(SpawnOne, &arg, 1, r);
+		assert (spawned && -ENOSYS == r.i);
+		(void)slept; (void)yielded; (void)spawned; (void)ns;
+	}
+}
+
+//----------------------------------------------------------------------
+
+void TestRuntime ()
+{
+	using std::wcout;
+	using std::endl;
+	using UPL::Int;
+	using UPL::Real;
+	using UPL::Runtime;
+	using UPL::Function;
+	using UPL::StringRef;
+	using UPL::VectorRef;
+	using UPL::VM::Reg;
+	using UPL::VM::Value;
+	using UPL::VM::RunError;
+	using UPL::Type::Tag;
+	using UPL::Type::Unpacked;
+	using UPL::Type::STContainer;
+	using namespace UPL::CodeGen;
+
+	auto const elapsed_ns = [] (std::chrono::steady_clock::time_point start) {
+		return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+	};
+
+	// Add = func(int a, int b)->int {a + b;};
+	// Div = func(int a, int b)->int {a / b;};
+	// Sum = func(vector<real> v)->real {var s = 0.0; for (var i = 0; i < len(v); i = i + 1) s = s + v[i]; s;};
+	// Scale = func(vector<real> v, real k) {for (var i = 0; i < len(v); i = i + 1) v[i] = v[i] * k;};
+	// Range = func(int n)->vector<int> {var v = newn vector<int> n; for (...) v[i] = i; v;};
+	// Bytes = func(string s)->int {len(s);};
+	// Same = func(string s)->string {s;};
+	// def Answer = Add(40, 2);
+	// GetAnswer = func()->int {Answer;};
+	std::unique_ptr<UPL::VM::Module> module (new UPL::VM::Module);
+	auto & types = module->types();
+	auto const t_nil = STContainer::DefaultID(Tag::Nil);
+	auto const t_int = STContainer::DefaultID(Tag::Int);
+	auto const t_real = STContainer::DefaultID(Tag::Real);
+	auto const t_str = STContainer::DefaultID(Tag::String);
+	auto const t_vi = types.createType(Unpacked(Tag::Vector, false, t_int));
+	auto const t_vr = types.createType(Unpacked(Tag::Vector, false, t_real));
+	auto const function_type = [&types] (UPL::Type::ID result, std::vector<UPL::Type::ID> params) {
+		return types.createType(Unpacked(Tag::Function, false, result, std::move(params)));
+	};
+	enum {Add, Div, Sum, Scale, Range, Bytes, Same, InitAnswer, GetAnswer};
+
+	IRModule ir;
+	auto const add = [&] (char const * name, UPL::Type::ID result, std::vector<UPL::Type::ID> params) -> IRFunction & {
+		ir.functions.push_back (IRFunction(name, function_type(result, params), params));
+		return ir.functions.back();
+	};
+	// for (var i = 0; i < len(v); i = i + 1) body(i);
+	auto const each = [t_int] (IRBuilder & b, ValueID v, std::function<void (ValueID)> const & body) {
+		auto i = b.newVariable(t_int);
+		b.assign (i, b.copy(b.constInt(0)));
+		auto head = b.newBlock(), inside = b.newBlock(), done = b.newBlock();
+		b.jump (head);
+		b.setBlock (head);
+		b.branch (b.binary(BinaryOp::Lt, b.use(i), b.length(v)), inside, done);
+		b.seal (inside);
+		b.setBlock (inside);
+		body (b.use(i));
+		b.assign (i, b.binary(BinaryOp::Add, b.use(i), b.constInt(1)));
+		b.jump (head);
+		b.seal (head); b.seal (done);
+		b.setBlock (done);
+	};
+	{
+		IRBuilder b (add("Add", t_int, {t_int, t_int}), types);
+		b.ret (b.binary(BinaryOp::Add, b.param(0), b.param(1)));
+	}
+	{
+		IRBuilder b (add("Div", t_int, {t_int, t_int}), types);
+		b.ret (b.binary(BinaryOp::Div, b.param(0), b.param(1)));
+	}
+	{
+		IRBuilder b (add("Sum", t_real, {t_vr}), types);
+		auto s = b.newVariable(t_real);
+		b.assign (s, b.copy(b.constReal(0.0)));
+		each (b, b.param(0), [&] (ValueID i) {b.assign (s, b.binary(BinaryOp::Add, b.use(s), b.getElement(b.param(0), i, t_real)));});
+		b.ret (b.use(s));
+	}
+	{
+		IRBuilder b (add("Scale", t_nil, {t_vr, t_real}), types);
+		each (b, b.param(0), [&] (ValueID i) {
+			b.setElement (b.param(0), i, b.binary(BinaryOp::Mul, b.getElement(b.param(0), i, t_real), b.param(1)));
+		});
+		b.ret ();
+	}
+	{
+		IRBuilder b (add("Range", t_vi, {t_int}), types);
+		auto const v = b.newArray(t_vi, b.param(0));
+		each (b, v, [&] (ValueID i) {b.setElement (v, i, i);});
+		b.ret (v);
+	}
+	{
+		IRBuilder b (add("Bytes", t_int, {t_str}), types);
+		b.ret (b.length(b.param(0)));
+	}
+	{
+		IRBuilder b (add("Same", t_str, {t_str}), types);
+		b.ret (b.param(0));
+	}
+	{
+		IRBuilder b (add("init Answer", t_int, {}), types);
+		b.ret (b.call(b.functionRef(Add, ir.functions[Add].type()), {b.constInt(40), b.constInt(2)}, t_int));
+		ir.globals.push_back ({"Answer", t_int, InitAnswer});
+	}
+	{
+		IRBuilder b (add("GetAnswer", t_int, {}), types);
+		b.ret (b.global(0, t_int));
+	}
+	OptimizeModule (ir, types);
+	auto const path = TempPath("playpen-runtime.uplm");
+	{
+		std::string error;
+		bool const ok = EmitModule(ir, *module, error) &&
+			UPL::VM::ModuleFileError::None == UPL::VM::SaveModule(*module, path.c_str());
+		if (!ok) wcout << "Emit failed: " << error.c_str() << endl;
+		assert (ok);
+		(void)ok;
+	}
+
+	Runtime rt;
+	std::string error;
+	bool const adopted = rt.adopt(std::move(module), error);
+	assert (adopted && rt.loaded() && nullptr != rt.globals());
+	(void)adopted;
+
+	// Looked up by name and signature, once
+	Function<Int (Int, Int)> add_f, div_f;
+	Function<Real (VectorRef<Real>)> sum_f;
+	Function<void (VectorRef<Real>, Real)> scale_f;
+	Function<VectorRef<Int> (Int)> range_f;
+	Function<Int (StringRef)> bytes_f;
+	Function<StringRef (StringRef)> same_f;
+	Function<Int ()> answer_f;
+	bool const found = rt.function("Add", add_f, error) && rt.function("Div", div_f, error) &&
+		rt.function("Sum", sum_f, error) && rt.function("Scale", scale_f, error) &&
+		rt.function("Range", range_f, error) && rt.function("Bytes", bytes_f, error) &&
+		rt.function("Same", same_f, error) && rt.function("GetAnswer", answer_f, error);
+	if (!found) wcout << "Lookup failed: " << error.c_str() << endl;
+	assert (found);
+	(void)found;
+	{
+		Function<Real (Int, Int)> wrong;
+		Function<Int (Int)> missing;
+		bool const wrong_found = rt.function("Add", wrong, error);
+		assert (!wrong_found && !wrong.valid());
+		wcout << "  Add as real(int, int): " << error.c_str() << endl;
+		bool const missing_found = rt.function("Mul", missing, error);
+		assert (!missing_found);
+		wcout << "  Mul: " << error.c_str() << endl;
+		(void)wrong_found; (void)missing_found;
+	}
+
+	// Scalars, and errors
+	{
+		Int sum = 0, quotient = 0, answer = 0;
+		bool const ok = add_f(2, 3, sum) && div_f(7, 2, quotient) && answer_f(answer);
+		assert (ok && 5 == sum && 3 == quotient && 42 == answer);
+		bool const divided = div_f(1, 0, quotient);
+		assert (!divided && RunError::DivisionByZero == rt.lastError() && 3 == quotient);
+		(void)ok; (void)divided;
+	}
+
+	// The cost of a call: through a Function, straight into the
+	// interpreter, and by name with every argument (and the result) boxed
+	// in a Value, as a generic call would.
+	{
+		int const N = 1000000;
+		Int total = 0, r;
+		auto start = std::chrono::steady_clock::now();
+		for (int i = 0; i < N; ++i)
+			if (add_f(i, 1, r))
+				total += r;
+		auto const typed_ns = elapsed_ns(start) / N;
+
+		auto & vm = rt.interpreter();
+		Int raw_total = 0;
+		start = std::chrono::steady_clock::now();
+		for (int i = 0; i < N; ++i)
+		{
+			Reg const args [2] = {Reg::FromInt(i), Reg::FromInt(1)};
+			Reg result;
+			if (vm.call(add_f.index(), args, 2, result))
+				raw_total += result.i;
+		}
+		auto const raw_ns = elapsed_ns(start) / N;
+
+		auto & heap = rt.heap();
+		auto const & m = rt.module();
+		Int boxed_total = 0;
+		start = std::chrono::steady_clock::now();
+		for (int i = 0; i < N; ++i)
+		{
+			std::vector<Value> boxed = {heap.newInt(i), heap.newInt(1)};
+			auto const f = m.findFunction("Add");
+			if (f >= m.functionCount() || boxed.size() != m.function(f).param_count)
+				continue;
+			std::vector<Reg> args;
+			for (auto v : boxed)
+				args.push_back (Reg::FromInt(v.asInt()));
+			Reg result;
+			if (vm.call(f, args.data(), int(args.size()), result))
+				boxed_total += heap.newInt(result.i).asInt();
+		}
+		auto const boxed_ns = elapsed_ns(start) / N;
+
+		assert (total == raw_total && total == boxed_total && Int(N) * (N + 1) / 2 == total);
+		wcout << "  a call: " << typed_ns << "ns through a Function, " << raw_ns << "ns straight into the interpreter, "
+			<< boxed_ns << "ns by name with boxed arguments" << endl;
+	}
+
+	// A vector, filled and read in place
+	{
+		uint32_t const N = 1 << 20;
+		auto v = rt.newVector<Real>(N);
+		auto const elements = v.elements();
+		assert (v.valid() && N == elements.size() && rt.heap().isOld(elements.data()));
+		for (uint32_t i = 0; i < N; ++i)
+			elements[i] = Real(i % 1000);
+
+		Real sum = 0;
+		auto start = std::chrono::steady_clock::now();
+		bool const summed = sum_f(v, sum);
+		auto const sum_ns = elapsed_ns(start);
+		bool const scaled = scale_f(v, 0.5);
+		rt.heap().collect (true);
+		auto const after = v.elements();
+		assert (summed && scaled && Real(N / 1000) * 999 * 1000 / 2 + Real(N % 1000) * (N % 1000 - 1) / 2 == sum);
+		assert (after.data() == elements.data() && 499.5 == after[999]);
+		(void)summed; (void)scaled; (void)after;
+
+		// What passing a host array by copy would add, both ways
+		std::vector<Real> host (N, 1.0);
+		start = std::chrono::steady_clock::now();
+		auto copy = rt.newVector<Real>(N, false);
+		memcpy (copy.elements().data(), host.data(), N * sizeof(Real));
+		memcpy (host.data(), copy.elements().data(), N * sizeof(Real));
+		auto const copy_ns = elapsed_ns(start);
+		wcout << "  " << N << " reals: summed in place in " << sum_ns / 1e6 << "ms; copying them in and out would add "
+			<< copy_ns / 1e6 << "ms" << endl;
+	}
+
+	// A vector the script made, which moves when collected; the Ref keeps
+	// up with it
+	{
+		VectorRef<Int> range;
+		bool const made = range_f(1000, range);
+		auto const young = range.elements();
+		assert (made && 1000 == young.size() && 999 == young[999] && !rt.heap().isOld(young.data()));
+		for (int i = 0; i < 100; ++i)
+			rt.newVector<Int>(1000, false);
+		rt.heap().collect (false);
+		auto const moved = range.elements();
+		assert (moved.data() != young.data() && 1000 == moved.size() && 999 == moved[999] && 0 == moved[0]);
+		assert (range.elements().empty() == false && VectorRef<Real>(rt.heap(), range.value()).elements().empty());
+		(void)made; (void)young; (void)moved;
+	}
+
+	// Strings: seen in place, unless inline
+	{
+		std::string const text (200, 'x');
+		auto const s = rt.newString(text.data(), text.size());
+		Int n = 0;
+		StringRef same;
+		bool const ok = bytes_f(s, n) && same_f(s, same);
+		std::string scratch;
+		auto const bytes = same.bytes(scratch);
+		assert (ok && 200 == n && 200 == bytes.size() && scratch.empty());
+		assert (bytes.data() == s.bytes(scratch).data() && std::string(bytes.begin(), bytes.end()) == text);
+
+		auto const hi = rt.newString("hi", 2);
+		auto const hi_bytes = hi.bytes(scratch);
+		assert (2 == hi_bytes.size() && hi_bytes.data() == scratch.data() && "hi" == scratch);
+		(void)ok; (void)bytes; (void)hi_bytes;
+	}
+
+	// From a module file
+	{
+		Runtime loaded;
+		Function<Int (Int, Int)> f;
+		Int r = 0;
+		bool const ok = loaded.load(path.c_str(), error) && loaded.function("Add", f, error) && f(20, 22, r);
+		assert (ok && 42 == r);
+		bool const again = loaded.load(path.c_str(), error);
+		assert (!again);
+		bool const missing = Runtime().load(TempPath("playpen-nothing.uplm").c_str(), error);
+		assert (!missing);
+		wcout << "  loading a missing file: " << error.c_str() << endl;
+		(void)ok; (void)again; (void)missing;
+	}
+	remove (path.c_str());
+
+	wcout << "  errors reported: " << rt.reporter().count() << endl;
+}
+
 //======================================================================
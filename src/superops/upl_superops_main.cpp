@@ -0,0 +1,171 @@
+//======================================================================
+//  Picks the superinstructions from an opcode profile (see OpcodeProfile
+// in vm.hpp) and writes them out as vm_superinstructions.inc. The
+// "superinstructions" target in CMakeLists.txt runs this on a profile of
+// the playpen's benchmarks.
+//======================================================================
+
+#include <upl/vm.hpp>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+
+//======================================================================
+
+using UPL::VM::Op;
+
+//----------------------------------------------------------------------
+
+static int Usage ()
+{
+	std::cerr
+		<< "Usage:\n"
+		<< "  superops <profile.txt> <vm_superinstructions.inc> [--pairs=N] [--triples=N] [--min-share=PERCENT]\n"
+		<< "    picks the (at most N) pairs and triples of simple instructions that run\n"
+		<< "    most often one after another, and at least PERCENT of the time\n";
+	return 2;
+}
+
+//----------------------------------------------------------------------
+
+struct Candidate
+{
+	Op ops [3];
+	int count;		// Of the ops
+	uint64_t executed;
+};
+
+//----------------------------------------------------------------------
+// Only the last part of a superinstruction may jump; after the others,
+// the next part must be the next instruction.
+static bool CanBePart (Op op, bool last)
+{
+	if (!UPL::VM::IsFusable(op))
+		return false;
+	return last || (op != Op::Jmp && op != Op::JmpT && op != Op::JmpF);
+}
+
+//----------------------------------------------------------------------
+
+static std::vector<Candidate> Pick (UPL::VM::OpcodeProfile const & profile, int parts, size_t max_count, double min_share)
+{
+	std::vector<Candidate> all;
+	uint64_t total = 0;
+	int const n = UPL::VM::BaseOpCount;
+	for (int a = 0; a < n; ++a)
+		for (int b = 0; b < n; ++b)
+			for (int c = 0; c < (3 == parts ? n : 1); ++c)
+			{
+				Candidate k = {{Op(a), Op(b), Op(c)}, parts, 0};
+				k.executed = (3 == parts) ? profile.triple(Op(a), Op(b), Op(c)) : profile.pair(Op(a), Op(b));
+				total += k.executed;
+				bool ok = 0 != k.executed;
+				for (int i = 0; ok && i < parts; ++i)
+					ok = CanBePart(k.ops[i], i == parts - 1);
+				if (ok)
+					all.push_back (k);
+			}
+
+	std::stable_sort (all.begin(), all.end(), [] (Candidate const & x, Candidate const & y) {return x.executed > y.executed;});
+	std::vector<Candidate> ret;
+	for (auto const & k : all)
+		if (ret.size() < max_count && k.executed >= min_share * total)
+			ret.push_back (k);
+	return ret;
+}
+
+//----------------------------------------------------------------------
+
+static void WriteList (FILE * f, char const * macro, std::vector<Candidate> const & list, uint64_t total)
+{
+	fprintf (f, "#define %s(action)%s\n", macro, list.empty() ? "" : "\t\\");
+	for (size_t i = 0; i < list.size(); ++i)
+	{
+		auto const & k = list[i];
+		std::string id, name, parts;
+		for (int p = 0; p < k.count; ++p)
+		{
+			id += std::string(p ? "_" : "") + UPL::VM::OpIdentifier(k.ops[p]);
+			name += std::string(p ? "+" : "") + UPL::VM::OpName(k.ops[p]);
+			parts += std::string(", ") + UPL::VM::OpIdentifier(k.ops[p]);
+		}
+		fprintf (f, "\taction (%s, \"%s\"%s)\t/* %.2f%% */%s\n",
+			id.c_str(), name.c_str(), parts.c_str(), 100.0 * k.executed / total, (i + 1 < list.size()) ? "\t\\" : "");
+	}
+	fprintf (f, "\n");
+}
+
+//======================================================================
+
+int main (int argc, char * argv[])
+{
+	if (argc < 3)
+		return Usage();
+
+	size_t max_pairs = 24, max_triples = 12;
+	double min_share = 0.01;
+	for (int i = 3; i < argc; ++i)
+		if (0 == strncmp(argv[i], "--pairs=", 8))
+			max_pairs = size_t(atoi(argv[i] + 8));
+		else if (0 == strncmp(argv[i], "--triples=", 10))
+			max_triples = size_t(atoi(argv[i] + 10));
+		else if (0 == strncmp(argv[i], "--min-share=", 12))
+			min_share = atof(argv[i] + 12) / 100;
+		else
+			return Usage();
+
+	UPL::VM::OpcodeProfile profile;
+	if (!profile.load(argv[1]))
+	{
+		std::cerr << argv[1] << ": can't read the profile\n";
+		return 1;
+	}
+
+	// (A profile only counts simple instructions, so the superinstructions
+	// of this build don't come into it.)
+	size_t const room = 256 - size_t(UPL::VM::BaseOpCount);
+	auto triples = Pick(profile, 3, std::min(max_triples, room), min_share);
+	auto pairs = Pick(profile, 2, std::min(max_pairs, room - triples.size()), min_share);
+
+	FILE * f = fopen(argv[2], "w");
+	if (nullptr == f)
+	{
+		std::cerr << argv[2] << ": can't write\n";
+		return 1;
+	}
+
+	fprintf (f,
+		"//======================================================================\n"
+		"// Generated by \"superops\" (see the \"superinstructions\" target in\n"
+		"// CMakeLists.txt) from an opcode profile; don't edit by hand. The\n"
+		"// comments are how much of the profile each one stood for.\n"
+		"//======================================================================\n\n");
+	uint64_t pair_total = 0, triple_total = 0;
+	for (int a = 0; a < UPL::VM::BaseOpCount; ++a)
+		for (int b = 0; b < UPL::VM::BaseOpCount; ++b)
+		{
+			pair_total += profile.pair(Op(a), Op(b));
+			for (int c = 0; c < UPL::VM::BaseOpCount; ++c)
+				triple_total += profile.triple(Op(a), Op(b), Op(c));
+		}
+	WriteList (f, "UPL_PRIVATE__VM_FUSED_PAIRS", pairs, UPL_MAX(pair_total, uint64_t(1)));
+	WriteList (f, "UPL_PRIVATE__VM_FUSED_TRIPLES", triples, UPL_MAX(triple_total, uint64_t(1)));
+	fprintf (f, "//======================================================================\n");
+
+	bool const ok = 0 == ferror(f);
+	if (0 != fclose(f) || !ok)
+	{
+		std::cerr << argv[2] << ": can't write\n";
+		return 1;
+	}
+
+	std::cout << "Wrote " << pairs.size() << " pairs and " << triples.size() << " triples to " << argv[2] << "\n";
+	return 0;
+}
+
+//======================================================================
@@ -0,0 +1,462 @@
+//======================================================================
+
+#include <upl/bulk.hpp>
+#include <upl/bulk_kernels.hpp>
+
+#include <atomic>
+
+#if defined(__SSE2__) || defined(_M_X64)
+	#define UPL_BULK_SSE2	1
+	#include <emmintrin.h>
+#else
+	#define UPL_BULK_SSE2	0
+#endif
+
+//======================================================================
+
+namespace UPL {
+	namespace VM {
+
+//======================================================================
+
+namespace {
+
+//----------------------------------------------------------------------
+
+#if UPL_BULK_SSE2
+
+// SSE2 has no 64-bit compares (nor minimums and maximums); they're made
+// of 32-bit ones.
+struct Sse2Int
+{
+	typedef int64_t T;
+	typedef __m128i V;
+	typedef __m128i M;
+	static int const N = 2;
+
+	static V Load (T const * p) {return _mm_loadu_si128(reinterpret_cast<__m128i const *>(p));}
+	static void Store (T * p, V v) {_mm_storeu_si128 (reinterpret_cast<__m128i *>(p), v);}
+	static V Splat (T k) {return _mm_set1_epi64x(k);}
+
+	static V Add (V a, V b) {return _mm_add_epi64(a, b);}
+	static V Sub (V a, V b) {return _mm_sub_epi64(a, b);}
+	static V Mul (V a, V b)
+	{
+		auto const cross = _mm_add_epi64(_mm_mul_epu32(_mm_srli_epi64(a, 32), b), _mm_mul_epu32(a, _mm_srli_epi64(b, 32)));
+		return _mm_add_epi64(_mm_mul_epu32(a, b), _mm_slli_epi64(cross, 32));
+	}
+	static V Min (V a, V b) {return Select(Lt(a, b), a, b);}
+	static V Max (V a, V b) {return Select(Lt(b, a), a, b);}
+
+	static M Eq (V a, V b)
+	{
+		auto const e = _mm_cmpeq_epi32(a, b);
+		return _mm_and_si128(e, _mm_shuffle_epi32(e, _MM_SHUFFLE(2, 3, 0, 1)));
+	}
+	// The high halves decide, unless they're equal; then the sign of the
+	// difference does.
+	static M Lt (V a, V b)
+	{
+		auto const r = _mm_or_si128(_mm_and_si128(_mm_cmpeq_epi32(b, a), _mm_sub_epi64(a, b)), _mm_cmpgt_epi32(b, a));
+		return _mm_shuffle_epi32(r, _MM_SHUFFLE(3, 3, 1, 1));
+	}
+	static M Le (V a, V b) {return _mm_xor_si128(Lt(b, a), _mm_set1_epi32(-1));}
+	static unsigned Bits (M m) {return unsigned(_mm_movemask_pd(_mm_castsi128_pd(m)));}
+
+	static V Select (M m, V a, V b) {return _mm_or_si128(_mm_and_si128(m, a), _mm_andnot_si128(m, b));}
+};
+
+//----------------------------------------------------------------------
+
+struct Sse2Real
+{
+	typedef double T;
+	typedef __m128d V;
+	typedef __m128d M;
+	static int const N = 2;
+
+	static V Load (T const * p) {return _mm_loadu_pd(p);}
+	static void Store (T * p, V v) {_mm_storeu_pd (p, v);}
+	static V Splat (T k) {return _mm_set1_pd(k);}
+
+	static V Add (V a, V b) {return _mm_add_pd(a, b);}
+	static V Sub (V a, V b) {return _mm_sub_pd(a, b);}
+	static V Mul (V a, V b) {return _mm_mul_pd(a, b);}
+	static V Min (V a, V b) {return _mm_min_pd(a, b);}
+	static V Max (V a, V b) {return _mm_max_pd(a, b);}
+
+	static M Eq (V a, V b) {return _mm_cmpeq_pd(a, b);}
+	static M Lt (V a, V b) {return _mm_cmplt_pd(a, b);}
+	static M Le (V a, V b) {return _mm_cmple_pd(a, b);}
+	static unsigned Bits (M m) {return unsigned(_mm_movemask_pd(m));}
+};
+
+//----------------------------------------------------------------------
+// No byte multiply either: the even and the odd bytes are multiplied as
+// 16-bit words.
+
+struct Sse2Byte
+{
+	typedef uint8_t T;
+	typedef __m128i V;
+	typedef __m128i M;
+	typedef __m128i W;
+	static int const N = 16;
+
+	static V Load (T const * p) {return _mm_loadu_si128(reinterpret_cast<__m128i const *>(p));}
+	static void Store (T * p, V v) {_mm_storeu_si128 (reinterpret_cast<__m128i *>(p), v);}
+	static V Splat (T k) {return _mm_set1_epi8(char(k));}
+
+	static V Add (V a, V b) {return _mm_add_epi8(a, b);}
+	static V Sub (V a, V b) {return _mm_sub_epi8(a, b);}
+	static V Mul (V a, V b)
+	{
+		auto const even = _mm_mullo_epi16(a, b);
+		auto const odd = _mm_mullo_epi16(_mm_srli_epi16(a, 8), _mm_srli_epi16(b, 8));
+		return _mm_or_si128(_mm_slli_epi16(odd, 8), _mm_and_si128(even, _mm_set1_epi16(0xFF)));
+	}
+	static V Min (V a, V b) {return _mm_min_epu8(a, b);}
+	static V Max (V a, V b) {return _mm_max_epu8(a, b);}
+
+	static M Eq (V a, V b) {return _mm_cmpeq_epi8(a, b);}
+	static M Lt (V a, V b) {return _mm_andnot_si128(Eq(a, b), Le(a, b));}
+	static M Le (V a, V b) {return _mm_cmpeq_epi8(_mm_min_epu8(a, b), a);}
+	static unsigned Bits (M m) {return unsigned(_mm_movemask_epi8(m));}
+
+	static W Zero () {return _mm_setzero_si128();}
+	static W AddUp (W w, V v) {return _mm_add_epi64(w, _mm_sad_epu8(v, _mm_setzero_si128()));}
+	static int64_t Total (W w) {return _mm_cvtsi128_si64(w) + _mm_cvtsi128_si64(_mm_unpackhi_epi64(w, w));}
+};
+
+#endif	// UPL_BULK_SSE2
+
+//----------------------------------------------------------------------
+
+BulkKernels const * Kernels (BulkIsa isa)
+{
+	static BulkKernels const sc_Scalar = MakeKernels<ScalarInt, ScalarReal, ScalarByte>();
+#if UPL_BULK_SSE2
+	static BulkKernels const sc_Sse2 = MakeKernels<Sse2Int, Sse2Real, Sse2Byte>();
+#endif
+
+	switch (isa)
+	{
+	case BulkIsa::Scalar:	return &sc_Scalar;
+#if UPL_BULK_SSE2
+	case BulkIsa::SSE2:		return &sc_Sse2;
+	case BulkIsa::AVX2:
+	#if defined(__GNUC__)
+		__builtin_cpu_init ();
+		if (__builtin_cpu_supports("avx2"))
+			return BulkAvx2Kernels();
+	#endif
+		return nullptr;
+#endif
+	default:				return nullptr;
+	}
+}
+
+//----------------------------------------------------------------------
+
+std::atomic<BulkKernels const *> gs_Kernels (nullptr);
+std::atomic<BulkIsa> gs_Isa (BulkIsa::Scalar);
+
+BulkKernels const & Current ()
+{
+	auto ret = gs_Kernels.load(std::memory_order_acquire);
+	if (nullptr == ret)
+	{
+		BulkUseIsa (BulkBestIsa());
+		ret = gs_Kernels.load(std::memory_order_acquire);
+	}
+	return *ret;
+}
+
+//----------------------------------------------------------------------
+// Where the packed elements of an object are, and how many. False if it
+// isn't a Vector or an Array of ints, reals or bytes.
+
+bool Packed (Heap & heap, Reg r, BulkElement & out_element, uint8_t * & out_data, uint32_t & out_count)
+{
+	auto const v = r.value();
+	if (!v.isObject())
+		return false;
+
+	Type::ID element;
+	Type::Size stride;
+	if (!heap.packedElements(v.asObject(), out_data, element, stride, out_count))
+		return false;
+
+	switch (heap.types().tag(element))
+	{
+	case Type::Tag::Int:	out_element = BulkElement::Int; break;
+	case Type::Tag::Real:	out_element = BulkElement::Real; break;
+	case Type::Tag::Byte:	out_element = BulkElement::Byte; break;
+	default:				return false;
+	}
+	return stride == ((BulkElement::Byte == out_element) ? 1 : 8);
+}
+
+//----------------------------------------------------------------------
+// A scalar operand (or result), in the elements' own representation.
+
+union Element
+{
+	int64_t i;
+	double r;
+	uint8_t b;
+};
+
+Element ToElement (BulkElement e, Reg k)
+{
+	Element ret;
+	ret.i = 0;
+	switch (e)
+	{
+	case BulkElement::Int:	ret.i = k.i; break;
+	case BulkElement::Real:	ret.r = k.r; break;
+	case BulkElement::Byte:	ret.b = uint8_t(k.i); break;
+	}
+	return ret;
+}
+
+//----------------------------------------------------------------------
+
+}	// namespace
+
+//======================================================================
+
+int BulkOperands (BulkForm form)
+{
+	return (BulkForm::Reduce == form) ? 2 : 3;
+}
+
+//----------------------------------------------------------------------
+
+bool IsValidBulk (uint8_t code)
+{
+	if (0 != (code & 0x40) || int(BulkOpOf(code)) >= BulkOpCount)
+		return false;
+
+	auto const op = BulkOpOf(code);
+	bool const arithmetic = op <= BulkOp::Max;
+	switch (BulkFormOf(code))
+	{
+	case BulkForm::Map:
+	case BulkForm::Zip:		return arithmetic && !BulkNegated(code);
+	case BulkForm::Reduce:	return arithmetic && op != BulkOp::Sub && !BulkNegated(code);
+	case BulkForm::Filter:	return !arithmetic;
+	}
+	return false;
+}
+
+//----------------------------------------------------------------------
+
+char const * BulkName (uint8_t code)
+{
+	static std::vector<std::string> const sc_Names = [] {
+		char const * const forms [] = {"map", "zip", "reduce", "filter"};
+		char const * const ops [] = {"add", "sub", "mul", "min", "max", "eq", "lt", "le", "gt", "ge"};
+		std::vector<std::string> ret (256, "?");
+		for (unsigned c = 0; c < 256; ++c)
+			if (IsValidBulk(uint8_t(c)))
+				ret[c] = std::string(forms[int(BulkFormOf(uint8_t(c)))]) + (BulkNegated(uint8_t(c)) ? "-not-" : "-") + ops[int(BulkOpOf(uint8_t(c)))];
+		return ret;
+	}();
+	return sc_Names[code].c_str();
+}
+
+//----------------------------------------------------------------------
+
+char const * BulkIsaName (BulkIsa isa)
+{
+	switch (isa)
+	{
+	case BulkIsa::Scalar:	return "scalar";
+	case BulkIsa::SSE2:		return "SSE2";
+	case BulkIsa::AVX2:		return "AVX2";
+	}
+	return "?";
+}
+
+//----------------------------------------------------------------------
+
+BulkIsa BulkBestIsa ()
+{
+	for (auto isa : {BulkIsa::AVX2, BulkIsa::SSE2})
+		if (nullptr != Kernels(isa))
+			return isa;
+	return BulkIsa::Scalar;
+}
+
+//----------------------------------------------------------------------
+
+BulkIsa BulkCurrentIsa ()
+{
+	Current ();
+	return gs_Isa.load();
+}
+
+//----------------------------------------------------------------------
+
+bool BulkUseIsa (BulkIsa isa)
+{
+	auto const k = Kernels(isa);
+	if (nullptr == k)
+		return false;
+	gs_Isa.store (isa);
+	gs_Kernels.store (k, std::memory_order_release);
+	return true;
+}
+
+//======================================================================
+
+void BulkMap (BulkElement e, BulkOp op, void * out, void const * a, Reg k, size_t n)
+{
+	auto const f = Current().map[int(e)][int(op)];
+	assert (nullptr != f);
+	auto const kk = ToElement(e, k);
+	f (out, a, &kk, n);
+}
+
+//----------------------------------------------------------------------
+
+void BulkZip (BulkElement e, BulkOp op, void * out, void const * a, void const * b, size_t n)
+{
+	auto const f = Current().zip[int(e)][int(op)];
+	assert (nullptr != f);
+	f (out, a, b, n);
+}
+
+//----------------------------------------------------------------------
+
+Reg BulkReduce (BulkElement e, BulkOp op, Reg init, void const * a, size_t n)
+{
+	auto const f = Current().reduce[int(e)][int(op)];
+	assert (nullptr != f);
+	f (&init, a, n);
+	return init;
+}
+
+//----------------------------------------------------------------------
+
+size_t BulkFilter (BulkElement e, BulkOp op, bool negate, void * out, void const * a, Reg k, size_t n)
+{
+	auto const f = Current().filter[int(e)][int(op)];
+	assert (nullptr != f);
+	auto const kk = ToElement(e, k);
+	return f(out, a, &kk, n, negate);
+}
+
+//======================================================================
+// A Filter whose out is shorter than a is fine as long as what's kept
+// fits (as it would be for the loop); it's done in pieces that can't
+// overflow it, and fails at the first element that doesn't fit, with
+// what's before it already stored.
+
+static bool FilterInto (BulkElement e, BulkOp op, bool negate, uint8_t * out, size_t n_out,
+	uint8_t const * a, Reg k, size_t n, size_t & out_kept)
+{
+	size_t const size = (BulkElement::Byte == e) ? 1 : 8;
+	if (n_out >= n)
+	{
+		out_kept = BulkFilter(e, op, negate, out, a, k, n);
+		return true;
+	}
+
+	size_t i = 0, j = 0;
+	while (i < n)
+	{
+		auto const m = UPL_MIN(n - i, n_out - j);
+		if (0 == m)
+		{
+			Element scratch;
+			if (0 != BulkFilter(e, op, negate, &scratch, a + i * size, k, 1))
+				return false;
+			i += 1;
+			continue;
+		}
+		j += BulkFilter(e, op, negate, out + j * size, a + i * size, k, m);
+		i += m;
+	}
+	out_kept = j;
+	return true;
+}
+
+//----------------------------------------------------------------------
+
+RunError RunBulk (Heap & heap, uint8_t code, unsigned count, Reg * args, uint64_t & out_elements)
+{
+	if (!IsValidBulk(code))
+		return RunError::BadOpcode;
+	auto const form = BulkFormOf(code);
+	auto const op = BulkOpOf(code);
+	if (count != unsigned(BulkOperands(form)))
+		return RunError::BadArgCount;
+
+	BulkElement e, e_other;
+	uint8_t * a, * other;
+	uint32_t n, n_other;
+	if (!args[2].value().isObject())
+		return RunError::NotAnObject;
+	if (!Packed(heap, args[2], e, a, n))
+		return RunError::BadField;
+
+	if (BulkForm::Reduce == form)
+	{
+		args[0] = BulkReduce(e, op, args[1], a, n);
+		out_elements += n;
+		return RunError::None;
+	}
+
+	// Nothing to do (and the loop wouldn't look at out, or b, either)
+	if (0 == n)
+	{
+		args[0] = (BulkForm::Filter == form) ? Reg::FromInt(0) : args[1];
+		return RunError::None;
+	}
+
+	// The other object: out, and for Zip, b too
+	if (!args[1].value().isObject())
+		return RunError::NotAnObject;
+	if (!Packed(heap, args[1], e_other, other, n_other) || e_other != e)
+		return RunError::BadField;
+	if (n_other < n && BulkForm::Filter != form)
+		return RunError::IndexOutOfRange;
+	auto const out = other;
+	auto const n_out = n_other;
+
+	if (BulkForm::Zip == form)
+	{
+		if (!args[3].value().isObject())
+			return RunError::NotAnObject;
+		if (!Packed(heap, args[3], e_other, other, n_other) || e_other != e)
+			return RunError::BadField;
+		if (n_other < n)
+			return RunError::IndexOutOfRange;
+	}
+
+	switch (form)
+	{
+	case BulkForm::Map:		BulkMap (e, op, out, a, args[3], n); args[0] = args[1]; break;
+	case BulkForm::Zip:		BulkZip (e, op, out, a, other, n); args[0] = args[1]; break;
+	case BulkForm::Filter:
+		{
+			size_t j;
+			if (!FilterInto(e, op, BulkNegated(code), out, n_out, a, args[3], n, j))
+				return RunError::IndexOutOfRange;
+			args[0] = Reg::FromInt(Int(j));
+		}
+		break;
+	case BulkForm::Reduce:	break;
+	}
+	out_elements += n;
+	return RunError::None;
+}
+
+//======================================================================
+
+	}	// namespace VM
+}	// namespace UPL
+
+//======================================================================
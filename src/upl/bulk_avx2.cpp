@@ -0,0 +1,148 @@
+//======================================================================
+//  The AVX2 kernels of bulk.hpp. Only this file is compiled for AVX2 (see
+// CMakeLists.txt), and it's only used once the CPU is known to have it.
+//======================================================================
+
+#include <upl/bulk_kernels.hpp>
+
+#if defined(__AVX2__)
+	#include <immintrin.h>
+#endif
+
+//======================================================================
+
+namespace UPL {
+	namespace VM {
+
+//======================================================================
+
+#if defined(__AVX2__)
+
+namespace {
+
+//----------------------------------------------------------------------
+// No 64-bit multiply (nor minimum or maximum); the multiply is made of
+// 32-bit ones.
+
+struct Avx2Int
+{
+	typedef int64_t T;
+	typedef __m256i V;
+	typedef __m256i M;
+	static int const N = 4;
+
+	static V Load (T const * p) {return _mm256_loadu_si256(reinterpret_cast<__m256i const *>(p));}
+	static void Store (T * p, V v) {_mm256_storeu_si256 (reinterpret_cast<__m256i *>(p), v);}
+	static V Splat (T k) {return _mm256_set1_epi64x(k);}
+
+	static V Add (V a, V b) {return _mm256_add_epi64(a, b);}
+	static V Sub (V a, V b) {return _mm256_sub_epi64(a, b);}
+	static V Mul (V a, V b)
+	{
+		auto const cross = _mm256_add_epi64(_mm256_mul_epu32(_mm256_srli_epi64(a, 32), b), _mm256_mul_epu32(a, _mm256_srli_epi64(b, 32)));
+		return _mm256_add_epi64(_mm256_mul_epu32(a, b), _mm256_slli_epi64(cross, 32));
+	}
+	static V Min (V a, V b) {return _mm256_blendv_epi8(b, a, Lt(a, b));}
+	static V Max (V a, V b) {return _mm256_blendv_epi8(b, a, Lt(b, a));}
+
+	static M Eq (V a, V b) {return _mm256_cmpeq_epi64(a, b);}
+	static M Lt (V a, V b) {return _mm256_cmpgt_epi64(b, a);}
+	static M Le (V a, V b) {return _mm256_xor_si256(_mm256_cmpgt_epi64(a, b), _mm256_set1_epi32(-1));}
+	static unsigned Bits (M m) {return unsigned(_mm256_movemask_pd(_mm256_castsi256_pd(m)));}
+};
+
+//----------------------------------------------------------------------
+// The ordered, quiet compares: false for NaNs, as in C++.
+
+struct Avx2Real
+{
+	typedef double T;
+	typedef __m256d V;
+	typedef __m256d M;
+	static int const N = 4;
+
+	static V Load (T const * p) {return _mm256_loadu_pd(p);}
+	static void Store (T * p, V v) {_mm256_storeu_pd (p, v);}
+	static V Splat (T k) {return _mm256_set1_pd(k);}
+
+	static V Add (V a, V b) {return _mm256_add_pd(a, b);}
+	static V Sub (V a, V b) {return _mm256_sub_pd(a, b);}
+	static V Mul (V a, V b) {return _mm256_mul_pd(a, b);}
+	static V Min (V a, V b) {return _mm256_min_pd(a, b);}
+	static V Max (V a, V b) {return _mm256_max_pd(a, b);}
+
+	static M Eq (V a, V b) {return _mm256_cmp_pd(a, b, _CMP_EQ_OQ);}
+	static M Lt (V a, V b) {return _mm256_cmp_pd(a, b, _CMP_LT_OQ);}
+	static M Le (V a, V b) {return _mm256_cmp_pd(a, b, _CMP_LE_OQ);}
+	static unsigned Bits (M m) {return unsigned(_mm256_movemask_pd(m));}
+};
+
+//----------------------------------------------------------------------
+// Bytes are multiplied as 16-bit words, the even and the odd ones apart.
+
+struct Avx2Byte
+{
+	typedef uint8_t T;
+	typedef __m256i V;
+	typedef __m256i M;
+	typedef __m256i W;
+	static int const N = 32;
+
+	static V Load (T const * p) {return _mm256_loadu_si256(reinterpret_cast<__m256i const *>(p));}
+	static void Store (T * p, V v) {_mm256_storeu_si256 (reinterpret_cast<__m256i *>(p), v);}
+	static V Splat (T k) {return _mm256_set1_epi8(char(k));}
+
+	static V Add (V a, V b) {return _mm256_add_epi8(a, b);}
+	static V Sub (V a, V b) {return _mm256_sub_epi8(a, b);}
+	static V Mul (V a, V b)
+	{
+		auto const even = _mm256_mullo_epi16(a, b);
+		auto const odd = _mm256_mullo_epi16(_mm256_srli_epi16(a, 8), _mm256_srli_epi16(b, 8));
+		return _mm256_or_si256(_mm256_slli_epi16(odd, 8), _mm256_and_si256(even, _mm256_set1_epi16(0xFF)));
+	}
+	static V Min (V a, V b) {return _mm256_min_epu8(a, b);}
+	static V Max (V a, V b) {return _mm256_max_epu8(a, b);}
+
+	static M Eq (V a, V b) {return _mm256_cmpeq_epi8(a, b);}
+	static M Lt (V a, V b) {return _mm256_andnot_si256(Eq(a, b), Le(a, b));}
+	static M Le (V a, V b) {return _mm256_cmpeq_epi8(_mm256_min_epu8(a, b), a);}
+	static unsigned Bits (M m) {return unsigned(_mm256_movemask_epi8(m));}
+
+	static W Zero () {return _mm256_setzero_si256();}
+	static W AddUp (W w, V v) {return _mm256_add_epi64(w, _mm256_sad_epu8(v, _mm256_setzero_si256()));}
+	static int64_t Total (W w)
+	{
+		auto const half = _mm_add_epi64(_mm256_castsi256_si128(w), _mm256_extracti128_si256(w, 1));
+		return _mm_cvtsi128_si64(half) + _mm_cvtsi128_si64(_mm_unpackhi_epi64(half, half));
+	}
+};
+
+//----------------------------------------------------------------------
+
+}	// namespace
+
+//======================================================================
+
+BulkKernels const * BulkAvx2Kernels ()
+{
+	static BulkKernels const sc_Avx2 = MakeKernels<Avx2Int, Avx2Real, Avx2Byte>();
+	return &sc_Avx2;
+}
+
+//----------------------------------------------------------------------
+
+#else
+
+BulkKernels const * BulkAvx2Kernels ()
+{
+	return nullptr;
+}
+
+#endif	// __AVX2__
+
+//======================================================================
+
+	}	// namespace VM
+}	// namespace UPL
+
+//======================================================================
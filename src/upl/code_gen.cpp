@@ -1,15 +1,927 @@
 //======================================================================
 
 #include <upl/code_gen.hpp>
+#include <upl/ir.hpp>
+
+#include <algorithm>
+#include <cstdio>
 
 //======================================================================
 
 namespace UPL {
+	namespace CodeGen {
+
+//======================================================================
+
+RegKind RegKindOf (Type::STContainer const & types, Type::ID type)
+{
+	switch (types.tag(type))
+	{
+	case Type::Tag::Bool:
+	case Type::Tag::Byte:
+	case Type::Tag::Char:
+	case Type::Tag::Int:	return RegKind::Int;
+	case Type::Tag::Real:	return RegKind::Real;
+	default:				return RegKind::None;
+	}
+}
+
+//----------------------------------------------------------------------
+
+bool SelectBinaryOp (Type::STContainer const & types, Type::ID operand_type, BinaryOp op, VM::Op & out_op)
+{
+	static VM::Op const sc_IntOps [] = {VM::Op::AddI, VM::Op::SubI, VM::Op::MulI, VM::Op::DivI, VM::Op::ModI, VM::Op::EqI, VM::Op::LtI, VM::Op::LeI};
+	static VM::Op const sc_RealOps [] = {VM::Op::AddR, VM::Op::SubR, VM::Op::MulR, VM::Op::DivR, VM::Op::Nop, VM::Op::EqR, VM::Op::LtR, VM::Op::LeR};
+
+	switch (RegKindOf(types, operand_type))
+	{
+	case RegKind::Int:
+		// Only equality makes sense for bools.
+		if (types.tag(operand_type) == Type::Tag::Bool && op != BinaryOp::Eq)
+			return false;
+		out_op = sc_IntOps[int(op)];
+		return true;
+	case RegKind::Real:
+		out_op = sc_RealOps[int(op)];
+		return out_op != VM::Op::Nop;
+	case RegKind::None:
+		return false;
+	}
+
+	return false;
+}
+
+//----------------------------------------------------------------------
+
+bool SelectNegateOp (Type::STContainer const & types, Type::ID operand_type, VM::Op & out_op)
+{
+	switch (types.tag(operand_type))
+	{
+	case Type::Tag::Int:	out_op = VM::Op::NegI; return true;
+	case Type::Tag::Real:	out_op = VM::Op::NegR; return true;
+	case Type::Tag::Bool:	out_op = VM::Op::Not; return true;
+	default:				return false;
+	}
+}
+
+//----------------------------------------------------------------------
+
+bool HoldsValue (Type::STContainer const & types, Type::ID type)
+{
+	if (0 == type || RegKindOf(types, type) != RegKind::None)
+		return false;
+	auto const tag = types.tag(type);
+	return tag != Type::Tag::Function && tag != Type::Tag::Nil && tag != Type::Tag::INVALID;
+}
+
+//======================================================================
+
+namespace {
+
+//----------------------------------------------------------------------
+
+class BitSet
+{
+public:
+	explicit BitSet (size_t n = 0) : m_words ((n + 63) / 64, 0) {}
+
+	bool test (size_t i) const {return 0 != (m_words[i / 64] & (uint64_t(1) << (i % 64)));}
+	void set (size_t i) {m_words[i / 64] |= uint64_t(1) << (i % 64);}
+	void reset (size_t i) {m_words[i / 64] &= ~(uint64_t(1) << (i % 64));}
+
+	// Returns whether anything was added.
+	bool merge (BitSet const & that)
+	{
+		uint64_t added = 0;
+		for (size_t i = 0; i < m_words.size(); ++i)
+		{
+			added |= that.m_words[i] & ~m_words[i];
+			m_words[i] |= that.m_words[i];
+		}
+		return 0 != added;
+	}
+
+	template <typename F>
+	void forEach (F && f) const
+	{
+		for (size_t i = 0; i < m_words.size(); ++i)
+		{
+			size_t b = i * 64;
+			for (auto w = m_words[i]; 0 != w; w >>= 1, ++b)
+				if (0 != (w & 1))
+					f (b);
+		}
+	}
+
+private:
+	std::vector<uint64_t> m_words;
+};
+
+//----------------------------------------------------------------------
+
+class FunctionEmitter
+{
+public:
+	FunctionEmitter (IRFunction const & f, VM::Module & module, uint32_t first_function, uint32_t first_global,
+			EmitOptions const & options)
+		: m_f (f)
+		, m_module (module)
+		, m_types (module.types())
+		, m_options (options)
+		, m_first_function (first_function)
+		, m_first_global (first_global)
+		, m_moves (0)
+		, m_tail_calls (0)
+	{
+	}
+
+	bool run (uint32_t index, std::string & out_error, EmitStats * out_stats);
+
+private:
+	bool fail (std::string & out_error, char const * what, ValueID v = NoValue)
+	{
+		char msg [160];
+		snprintf (msg, sizeof(msg), "%s: %s (v%u)", m_f.name().c_str(), what, unsigned(v));
+		out_error = msg;
+		return false;
+	}
+
+	bool hasRegister (ValueID v) const {return 0 != m_f[v].type && !m_remat[v];}
+	uint8_t reg (ValueID v) const {return uint8_t(m_reg[v]);}
+
+	bool isTailCall (ValueID call) const;
+	void number ();
+	void computeLiveness ();
+	bool allocate (std::string & out_error);
+	bool emitInstr (ValueID v, std::string & out_error);
+	void emitValueInto (uint8_t r, ValueID v);
+	void emitEdge (BlockID from, BlockID to);
+	bool hasEdgeMoves (BlockID from, BlockID to) const;
+	void setLiveFor (ValueID safepoint);
+
+private:
+	IRFunction const & m_f;
+	VM::Module & m_module;
+	Type::STContainer const & m_types;
+	EmitOptions const m_options;
+	uint32_t m_first_function;
+	uint32_t m_first_global;
+
+	std::vector<BlockID> m_order;			// Layout
+	std::vector<uint32_t> m_block_start;	// Positions
+	std::vector<uint32_t> m_block_end;
+	std::vector<uint32_t> m_pos;			// Of each value's instruction
+	std::vector<uint8_t> m_remat;			// Constants and functions only used by calls, loaded in place
+	std::vector<uint8_t> m_tail;			// Calls whose value is what the function returns
+	std::vector<BitSet> m_live_out;
+	std::vector<BitSet> m_live_in;
+	std::vector<uint32_t> m_start;			// Live intervals
+	std::vector<uint32_t> m_end;
+	std::vector<int> m_reg;
+	std::unordered_map<ValueID, std::vector<ValueID>> m_live_across;	// Per safepoint, the Values in registers
+	int m_call_area;
+	int m_max_args;
+	std::vector<VM::Assembler::Label> m_labels;
+	VM::Assembler m_as;
+	uint32_t m_moves;
+	uint32_t m_tail_calls;
+};
+
+//----------------------------------------------------------------------
+// Whether nothing happens after the call but returning its value: the
+// rest of its block (and of the blocks it jumps on to) only copies the
+// value, or takes it through phis, before a Ret.
+
+bool FunctionEmitter::isTailCall (ValueID call) const
+{
+	std::vector<ValueID> carriers (1, call);	// The values that are the call's result
+	auto const carries = [&carriers] (ValueID v) {return std::find(carriers.begin(), carriers.end(), v) != carriers.end();};
+
+	auto b = m_f[call].block;
+	auto const & first = m_f.block(b).code;
+	size_t i = size_t(std::find(first.begin(), first.end(), call) - first.begin()) + 1;
+	for (int hops = 0; hops < 8; ++hops)
+	{
+		BlockID next = NoBlock;
+		auto const & code = m_f.block(b).code;
+		for (; i < code.size() && NoBlock == next; ++i)
+		{
+			auto const & ins = m_f[code[i]];
+			if (ins.dead || ins.op == IROp::Phi)	// Phis are looked at from the jump
+				continue;
+			if (ins.op == IROp::Ret)
+				return !ins.operands.empty() && carries(ins.operands[0]);
+			if (ins.op == IROp::Jmp)
+				next = ins.targets[0];
+			else if (ins.op == IROp::Copy && carries(ins.operands[0]))
+				carriers.push_back (code[i]);
+			else
+				return false;
+		}
+		if (NoBlock == next)
+			return false;
+
+		auto const & succ = m_f.block(next);
+		auto const k = std::find(succ.preds.begin(), succ.preds.end(), b) - succ.preds.begin();
+		for (auto v : succ.code)
+			if (!m_f[v].dead && m_f[v].op == IROp::Phi && carries(m_f[v].operands[k]))
+				carriers.push_back (v);
+		b = next;
+		i = 0;
+	}
+	return false;
+}
+
+//----------------------------------------------------------------------
+
+void FunctionEmitter::number ()
+{
+	std::vector<BlockID> idom;
+	m_f.computeDominators (m_order, idom);
+
+	auto const nv = m_f.values().size();
+	m_pos.assign (nv, 0);
+	m_block_start.assign (m_f.blocks().size(), 0);
+	m_block_end.assign (m_f.blocks().size(), 0);
+
+	// Phis (and the entry's parameters) are at the start of their block.
+	uint32_t p = 0;
+	for (auto b : m_order)
+	{
+		m_block_start[b] = p;
+		for (auto v : m_f.block(b).code)
+		{
+			auto const & ins = m_f[v];
+			if (ins.dead)
+				continue;
+			m_pos[v] = (ins.op == IROp::Phi || ins.op == IROp::Param) ? m_block_start[b] : ++p;
+		}
+		m_block_end[b] = p;
+		++p;
+	}
+
+	std::vector<uint32_t> uses (nv, 0), call_uses (nv, 0);
+	for (auto b : m_order)
+		for (auto v : m_f.block(b).code)
+			if (!m_f[v].dead)
+				for (auto o : m_f[v].operands)
+				{
+					uses[o] += 1;
+					if (m_f[v].op == IROp::Call || m_f[v].op == IROp::Bulk || m_f[v].op == IROp::PMap || m_f[v].op == IROp::PReduce ||
+						m_f[v].op == IROp::Io)
+						call_uses[o] += 1;
+				}
+
+	m_remat.assign (nv, 0);
+	for (ValueID v = 1; v < nv; ++v)
+		if (!m_f[v].dead && (m_f[v].op == IROp::Const || m_f[v].op == IROp::Func) && uses[v] > 0 && uses[v] == call_uses[v])
+			m_remat[v] = 1;
+
+	m_tail.assign (nv, 0);
+	for (auto b : m_order)
+		for (auto v : m_f.block(b).code)
+			if (!m_f[v].dead && m_f[v].op == IROp::Call)
+				m_tail[v] = isTailCall(v);
+}
+
+//----------------------------------------------------------------------
+
+void FunctionEmitter::computeLiveness ()
+{
+	auto const nb = m_f.blocks().size();
+	auto const nv = m_f.values().size();
+	m_live_in.assign (nb, BitSet(nv));
+	m_live_out.assign (nb, BitSet(nv));
+
+	// Upward-exposed uses and definitions, phis apart
+	std::vector<BitSet> gen (nb, BitSet(nv)), kill (nb, BitSet(nv));
+	for (auto b : m_order)
+		for (auto v : m_f.block(b).code)
+		{
+			auto const & ins = m_f[v];
+			if (ins.dead)
+				continue;
+			if (ins.op != IROp::Phi)
+				for (auto o : ins.operands)
+					if (hasRegister(o) && !kill[b].test(o))
+						gen[b].set (o);
+			kill[b].set (v);
+		}
+
+	for (bool changed = true; changed; )
+	{
+		changed = false;
+		for (auto i = m_order.size(); i-- > 0; )
+		{
+			auto const b = m_order[i];
+			BitSet out (nv);
+			BlockID succs [2];
+			auto const count = m_f.successors(b, succs);
+			for (int s = 0; s < count; ++s)
+			{
+				auto const & succ = m_f.block(succs[s]);
+				auto const k = std::find(succ.preds.begin(), succ.preds.end(), b) - succ.preds.begin();
+				out.merge (m_live_in[succs[s]]);
+				for (auto v : succ.code)
+					if (!m_f[v].dead && m_f[v].op == IROp::Phi && hasRegister(m_f[v].operands[k]))
+						out.set (m_f[v].operands[k]);
+			}
+
+			BitSet in = gen[b];
+			out.forEach ([&] (size_t v) {if (!kill[b].test(v)) in.set (v);});
+			changed = m_live_out[b].merge(out) | changed;
+			changed = m_live_in[b].merge(in) | changed;
+		}
+	}
+}
+
+//----------------------------------------------------------------------
+
+bool FunctionEmitter::allocate (std::string & out_error)
+{
+	auto const nv = m_f.values().size();
+	uint32_t const none = 0xFFFFFFFFU;
+	m_start.assign (nv, none);
+	m_end.assign (nv, 0);
+
+	auto cover = [&] (ValueID v, uint32_t p)
+	{
+		m_start[v] = std::min(m_start[v], p);
+		m_end[v] = std::max(m_end[v], p);
+	};
+
+	m_max_args = 0;
+	for (auto b : m_order)
+	{
+		for (auto v : m_f.block(b).code)
+		{
+			auto const & ins = m_f[v];
+			if (ins.dead)
+				continue;
+			if (hasRegister(v))
+				cover (v, m_pos[v]);
+
+			if (ins.op == IROp::Phi)
+			{
+				// Used at the end of each predecessor, and written there too.
+				for (size_t k = 0; k < ins.operands.size(); ++k)
+				{
+					auto const e = m_block_end[m_f.block(b).preds[k]];
+					cover (v, e);
+					if (hasRegister(ins.operands[k]))
+						cover (ins.operands[k], e);
+				}
+				continue;
+			}
+
+			if (ins.op == IROp::Call)
+				m_max_args = std::max(m_max_args, int(ins.operands.size()) - 1);
+			else if (ins.op == IROp::Bulk || ins.op == IROp::PMap || ins.op == IROp::PReduce || ins.op == IROp::Io)
+				m_max_args = std::max(m_max_args, int(ins.operands.size()));
+			for (auto o : ins.operands)
+				if (hasRegister(o))
+					cover (o, m_pos[v]);
+		}
+		m_live_in[b].forEach ([&] (size_t v) {cover (ValueID(v), m_block_start[b]);});
+		m_live_out[b].forEach ([&] (size_t v) {cover (ValueID(v), m_block_end[b]);});
+	}
+
+	// Linear scan; parameters are where the caller put them.
+	std::vector<ValueID> intervals;
+	for (ValueID v = 1; v < nv; ++v)
+		if (none != m_start[v])
+			intervals.push_back (v);
+	std::stable_sort (intervals.begin(), intervals.end(), [this] (ValueID a, ValueID b) {
+		auto const pa = m_f[a].op == IROp::Param, pb = m_f[b].op == IROp::Param;
+		if (m_start[a] != m_start[b])
+			return m_start[a] < m_start[b];
+		return pa && !pb;
+	});
+
+	m_reg.assign (nv, -1);
+	bool busy [VM::StackMap::msc_MaxRegisters] = {};
+	std::vector<ValueID> active;
+	int reg_count = int(m_f.paramTypes().size());
+	for (auto v : intervals)
+	{
+		for (size_t i = 0; i < active.size(); )
+			if (m_end[active[i]] < m_start[v])
+			{
+				busy[m_reg[active[i]]] = false;
+				active[i] = active.back();
+				active.pop_back ();
+			}
+			else
+				++i;
+
+		int r;
+		if (m_f[v].op == IROp::Param)
+			r = int(m_f[v].aux);
+		else
+			for (r = 0; r < VM::StackMap::msc_MaxRegisters && busy[r]; ++r)
+				;
+		if (r >= VM::StackMap::msc_MaxRegisters || busy[r])
+			return fail(out_error, "too many live values for the registers", v);
+
+		busy[r] = true;
+		m_reg[v] = r;
+		active.push_back (v);
+		reg_count = std::max(reg_count, r + 1);
+	}
+
+	// Then the calls' callee and arguments (and the bulk operations'
+	// result and operands); its first register doubles as the scratch for
+	// breaking cycles of phi moves.
+	m_call_area = reg_count;
+	if (m_call_area + 1 + m_max_args > VM::StackMap::msc_MaxRegisters)
+		return fail(out_error, "too many registers");
+	return true;
+}
+
+//----------------------------------------------------------------------
+// The Values in registers that are live across each safepoint: a
+// backward walk over each block from its live-out set.
+
+void FunctionEmitter::setLiveFor (ValueID safepoint)
+{
+	m_as.clearLive ();
+	auto i = m_live_across.find(safepoint);
+	if (i != m_live_across.end())
+		for (auto v : i->second)
+			m_as.setLive (reg(v), true);
+}
+
+//----------------------------------------------------------------------
+
+bool FunctionEmitter::run (uint32_t index, std::string & out_error, EmitStats * out_stats)
+{
+	number ();
+	computeLiveness ();
+	if (!allocate(out_error))
+		return false;
+
+	for (auto b : m_order)
+	{
+		BitSet live = m_live_out[b];
+		auto const & code = m_f.block(b).code;
+		for (auto i = code.size(); i-- > 0; )
+		{
+			auto const v = code[i];
+			auto const & ins = m_f[v];
+			if (ins.dead || ins.op == IROp::Phi)
+				continue;
+			live.reset (v);
+
+			bool safepoint = ins.op == IROp::New || ins.op == IROp::NewN || ins.op == IROp::Call ||
+				ins.op == IROp::PMap || ins.op == IROp::PReduce || ins.op == IROp::Global || ins.op == IROp::Io ||
+				(ins.op == IROp::Box && m_types.tag(m_f[ins.operands[0]].type) == Type::Tag::Int);
+			if (safepoint)
+			{
+				auto & across = m_live_across[v];
+				live.forEach ([&] (size_t u) {if (HoldsValue(m_types, m_f[ValueID(u)].type)) across.push_back (ValueID(u));});
+			}
+
+			for (auto o : ins.operands)
+				if (hasRegister(o))
+					live.set (o);
+		}
+	}
+
+	m_labels.resize (m_f.blocks().size());
+	for (auto b : m_order)
+		m_labels[b] = m_as.newLabel();
+
+	for (size_t k = 0; k < m_order.size(); ++k)
+	{
+		auto const b = m_order[k];
+		auto const next = (k + 1 < m_order.size()) ? m_order[k + 1] : NoBlock;
+		m_as.bind (m_labels[b]);
+
+		for (auto v : m_f.block(b).code)
+		{
+			auto const & ins = m_f[v];
+			if (ins.dead)
+				continue;
+			if (ins.op == IROp::Call && m_tail[v])
+			{
+				// Never comes back here; the rest of the block only returns its value.
+				if (!emitInstr(v, out_error))
+					return false;
+				break;
+			}
+
+			switch (ins.op)
+			{
+			case IROp::Ret:
+				if (ins.operands.empty())
+					m_as.emit (VM::Op::RetNil);
+				else
+					m_as.emit (VM::Op::Ret, reg(ins.operands[0]));
+				break;
+
+			case IROp::Jmp:
+				emitEdge (b, ins.targets[0]);
+				if (next != ins.targets[0])
+					m_as.emitJump (VM::Op::Jmp, 0, m_labels[ins.targets[0]]);
+				break;
+
+			case IROp::Br:
+			{
+				auto const c = reg(ins.operands[0]);
+				auto const t = ins.targets[0], e = ins.targets[1];
+				auto const mt = hasEdgeMoves(b, t), me = hasEdgeMoves(b, e);
+				if (!me && (mt || next != e))
+				{
+					m_as.emitJump (VM::Op::JmpF, c, m_labels[e]);
+					emitEdge (b, t);
+					if (next != t)
+						m_as.emitJump (VM::Op::Jmp, 0, m_labels[t]);
+				}
+				else if (!mt)
+				{
+					m_as.emitJump (VM::Op::JmpT, c, m_labels[t]);
+					emitEdge (b, e);
+					if (next != e)
+						m_as.emitJump (VM::Op::Jmp, 0, m_labels[e]);
+				}
+				else
+				{
+					auto const other = m_as.newLabel();
+					m_as.emitJump (VM::Op::JmpF, c, other);
+					emitEdge (b, t);
+					m_as.emitJump (VM::Op::Jmp, 0, m_labels[t]);
+					m_as.bind (other);
+					emitEdge (b, e);
+					if (next != e)
+						m_as.emitJump (VM::Op::Jmp, 0, m_labels[e]);
+				}
+				break;
+			}
+
+			default:
+				if (!emitInstr(v, out_error))
+					return false;
+				break;
+			}
+		}
+	}
+
+	std::vector<VM::Instruction> code;
+	std::vector<VM::StackMap> stack_maps;
+	if (!m_as.finish(code, &stack_maps))
+		return fail(out_error, m_as.bxOutOfRange() ? "a constant's, function's or global's index is out of range" : "a jump is out of range");
+	uint32_t const fused = m_options.superinstructions ? VM::FuseSuperinstructions(code.data(), code.size()) : 0;
+
+	auto const register_count = uint16_t(m_call_area + 1 + m_max_args);
+	m_module.defineFunction (index, register_count, code, stack_maps);
+
+	if (nullptr != out_stats)
+	{
+		out_stats->functions += 1;
+		out_stats->instructions += uint32_t(code.size());
+		out_stats->moves += m_moves;
+		out_stats->tail_calls += m_tail_calls;
+		out_stats->superinstructions += fused;
+		out_stats->max_registers = std::max(out_stats->max_registers, uint32_t(register_count));
+	}
+	return true;
+}
+
+//----------------------------------------------------------------------
+
+void FunctionEmitter::emitValueInto (uint8_t r, ValueID v)
+{
+	auto const & ins = m_f[v];
+	if (ins.op == IROp::Func)
+		m_as.emitBx (VM::Op::LoadF, r, m_first_function + ins.aux);
+	else if (ins.op == IROp::Const)
+	{
+		switch (RegKindOf(m_types, ins.type))
+		{
+		case RegKind::Int:	m_as.emitLoadInt (r, ins.number.i, m_module); break;
+		case RegKind::Real:	m_as.emitLoadReal (r, ins.number.r, m_module); break;
+		case RegKind::None:
+			if (0 == ins.number.u)
+				m_as.emit (VM::Op::LoadNil, r);
+			else
+				m_as.emitBx (VM::Op::LoadK, r, m_module.addConstant(ins.number));
+			break;
+		}
+	}
+	else if (reg(v) != r)
+	{
+		m_as.emit (VM::Op::Move, r, reg(v));
+		m_moves += 1;
+	}
+}
+
+//----------------------------------------------------------------------
+
+bool FunctionEmitter::emitInstr (ValueID v, std::string & out_error)
+{
+	static BinaryOp const sc_BinaryOps [] = {BinaryOp::Add, BinaryOp::Sub, BinaryOp::Mul, BinaryOp::Div, BinaryOp::Mod, BinaryOp::Eq, BinaryOp::Lt, BinaryOp::Le};
+
+	auto const & ins = m_f[v];
+	auto const & o = ins.operands;
+	if (m_remat[v])
+		return true;
+
+	VM::Op op;
+	switch (ins.op)
+	{
+	case IROp::Param:
+	case IROp::Phi:
+		break;
+
+	case IROp::Const:
+	case IROp::Func:
+		emitValueInto (reg(v), v);
+		break;
+
+	case IROp::Copy:
+		if (reg(v) != reg(o[0]))
+			m_as.emit (VM::Op::Move, reg(v), reg(o[0]));
+		break;
+
+	case IROp::Add: case IROp::Sub: case IROp::Mul: case IROp::Div: case IROp::Mod:
+	case IROp::Eq: case IROp::Lt: case IROp::Le:
+		if (!SelectBinaryOp(m_types, m_f[o[0]].type, sc_BinaryOps[int(ins.op) - int(IROp::Add)], op))
+			return fail(out_error, "no instruction for this operation on this type", v);
+		m_as.emit (op, reg(v), reg(o[0]), reg(o[1]));
+		break;
+
+	case IROp::Neg:
+		if (!SelectNegateOp(m_types, m_f[o[0]].type, op))
+			return fail(out_error, "no instruction to negate this type", v);
+		m_as.emit (op, reg(v), reg(o[0]));
+		break;
+
+	case IROp::Not:		m_as.emit (VM::Op::Not, reg(v), reg(o[0])); break;
+	case IROp::IToR:	m_as.emit (VM::Op::IToR, reg(v), reg(o[0])); break;
+	case IROp::RToI:	m_as.emit (VM::Op::RToI, reg(v), reg(o[0])); break;
+	case IROp::TypeOf:	m_as.emit (VM::Op::TypeOf, reg(v), reg(o[0])); break;
+
+	case IROp::Box:
+		if (m_types.tag(m_f[o[0]].type) == Type::Tag::Nil)
+		{
+			// A nil register is all zeros, which as a Value would be 0.0.
+			m_as.emitBx (VM::Op::LoadK, reg(v), m_module.addConstant(VM::Reg::FromValue(VM::Value::Nil())));
+			break;
+		}
+		switch (m_types.tag(m_f[o[0]].type))
+		{
+		case Type::Tag::Bool:	op = VM::Op::BoxB; break;
+		case Type::Tag::Byte:	op = VM::Op::BoxY; break;
+		case Type::Tag::Char:	op = VM::Op::BoxC; break;
+		case Type::Tag::Int:	op = VM::Op::BoxI; break;
+		case Type::Tag::Real:	op = VM::Op::BoxR; break;
+		default:				op = VM::Op::Move; break;
+		}
+		setLiveFor (v);
+		m_as.emit (op, reg(v), reg(o[0]));
+		break;
+
+	case IROp::Unbox:
+		if (m_types.tag(ins.type) == Type::Tag::Nil)
+		{
+			m_as.emit (VM::Op::LoadNil, reg(v));
+			break;
+		}
+		switch (m_types.tag(ins.type))
+		{
+		case Type::Tag::Bool:	op = VM::Op::UnboxB; break;
+		case Type::Tag::Byte:	op = VM::Op::UnboxY; break;
+		case Type::Tag::Char:	op = VM::Op::UnboxC; break;
+		case Type::Tag::Int:	op = VM::Op::UnboxI; break;
+		case Type::Tag::Real:	op = VM::Op::UnboxR; break;
+		default:				op = VM::Op::Move; break;
+		}
+		m_as.emit (op, reg(v), reg(o[0]));
+		break;
+
+	case IROp::New:
+		setLiveFor (v);
+		m_as.emitBx (VM::Op::New, reg(v), m_module.addConstant(VM::Reg::FromInt(Int(ins.aux))));
+		break;
+
+	case IROp::NewN:
+		setLiveFor (v);
+		m_as.emit (VM::Op::NewN, reg(v), reg(o[0]), reg(o[1]));
+		break;
+
+	case IROp::Global:
+		// Forcing it runs the initializer, which may collect
+		setLiveFor (v);
+		m_as.emitBx (VM::Op::GetG, reg(v), m_first_global + ins.aux);
+		break;
+
+	case IROp::GetF:	m_as.emit (VM::Op::GetF, reg(v), reg(o[0]), uint8_t(ins.aux)); break;
+	case IROp::SetF:	m_as.emit (VM::Op::SetF, reg(o[0]), reg(o[1]), uint8_t(ins.aux)); break;
+	case IROp::GetE:	m_as.emit (VM::Op::GetE, reg(v), reg(o[0]), reg(o[1])); break;
+	case IROp::SetE:	m_as.emit (VM::Op::SetE, reg(o[0]), reg(o[1]), reg(o[2])); break;
+	case IROp::Len:		m_as.emit (VM::Op::Len, reg(v), reg(o[0])); break;
+
+	case IROp::Call:
+	{
+		auto const a = uint8_t(m_call_area);
+		for (size_t i = 0; i < o.size(); ++i)
+			emitValueInto (uint8_t(a + i), o[i]);
+		if (m_tail[v])
+		{
+			m_as.emit (VM::Op::TailCall, a, uint8_t(o.size() - 1));
+			m_tail_calls += 1;
+			break;
+		}
+		setLiveFor (v);
+		m_as.emit (VM::Op::Call, a, uint8_t(o.size() - 1));
+		if (hasRegister(v) && m_end[v] > m_start[v])
+		{
+			m_as.emit (VM::Op::Move, reg(v), a);
+			m_moves += 1;
+		}
+		break;
+	}
+
+	case IROp::Bulk:
+	{
+		// Like a call, but it doesn't allocate, so it isn't a safepoint.
+		auto const a = uint8_t(m_call_area);
+		for (size_t i = 0; i < o.size(); ++i)
+			emitValueInto (uint8_t(a + 1 + i), o[i]);
+		m_as.emit (VM::Op::Bulk, a, uint8_t(o.size()), uint8_t(ins.aux));
+		if (hasRegister(v) && m_end[v] > m_start[v])
+		{
+			m_as.emit (VM::Op::Move, reg(v), a);
+			m_moves += 1;
+		}
+		break;
+	}
+
+	case IROp::PMap:
+	case IROp::PReduce:
+	{
+		// Also like a call, and they call the function.
+		auto const a = uint8_t(m_call_area);
+		for (size_t i = 0; i < o.size(); ++i)
+			emitValueInto (uint8_t(a + 1 + i), o[i]);
+		setLiveFor (v);
+		m_as.emit ((ins.op == IROp::PMap) ? VM::Op::PMap : VM::Op::PReduce, a, uint8_t(o.size()), uint8_t(0 != ins.aux));
+		if (hasRegister(v) && m_end[v] > m_start[v])
+		{
+			m_as.emit (VM::Op::Move, reg(v), a);
+			m_moves += 1;
+		}
+		break;
+	}
+
+	case IROp::Io:
+	{
+		// Like a call too, and a safepoint, as the task may be suspended.
+		auto const a = uint8_t(m_call_area);
+		for (size_t i = 0; i < o.size(); ++i)
+			emitValueInto (uint8_t(a + 1 + i), o[i]);
+		setLiveFor (v);
+		m_as.emit (VM::Op::Io, a, uint8_t(o.size()), uint8_t(ins.aux));
+		if (hasRegister(v) && m_end[v] > m_start[v])
+		{
+			m_as.emit (VM::Op::Move, reg(v), a);
+			m_moves += 1;
+		}
+		break;
+	}
+
+	default:
+		return fail(out_error, "unexpected instruction", v);
+	}
+	return true;
+}
+
+//----------------------------------------------------------------------
+
+bool FunctionEmitter::hasEdgeMoves (BlockID from, BlockID to) const
+{
+	auto const & succ = m_f.block(to);
+	auto const k = std::find(succ.preds.begin(), succ.preds.end(), from) - succ.preds.begin();
+	for (auto v : succ.code)
+		if (!m_f[v].dead && m_f[v].op == IROp::Phi)
+		{
+			auto const src = m_f[v].operands[k];
+			if (!hasRegister(src) || reg(src) != reg(v))
+				return true;
+		}
+	return false;
+}
+
+//----------------------------------------------------------------------
+// The phis of "to" all take their values at once, so the moves are a
+// parallel copy: a move is done once nothing else still needs to read
+// its destination, and a cycle is broken through the scratch register.
+
+void FunctionEmitter::emitEdge (BlockID from, BlockID to)
+{
+	auto const & succ = m_f.block(to);
+	auto const k = std::find(succ.preds.begin(), succ.preds.end(), from) - succ.preds.begin();
+
+	struct Move {int dst; int src; ValueID value;};	// src < 0: rematerialize "value"
+	std::vector<Move> pending;
+	for (auto v : succ.code)
+		if (!m_f[v].dead && m_f[v].op == IROp::Phi)
+		{
+			auto const src = m_f[v].operands[k];
+			if (!hasRegister(src))
+				pending.push_back ({m_reg[v], -1, src});
+			else if (reg(src) != reg(v))
+				pending.push_back ({m_reg[v], m_reg[src], src});
+		}
+
+	auto const scratch = m_call_area;
+	while (!pending.empty())
+	{
+		bool progress = false;
+		for (size_t i = 0; i < pending.size(); ++i)
+		{
+			auto const dst = pending[i].dst;
+			bool blocked = false;
+			for (size_t j = 0; j < pending.size() && !blocked; ++j)
+				blocked = (j != i && pending[j].src == dst);
+			if (blocked)
+				continue;
+
+			if (pending[i].src < 0)
+				emitValueInto (uint8_t(dst), pending[i].value);
+			else
+				m_as.emit (VM::Op::Move, uint8_t(dst), uint8_t(pending[i].src));
+			m_moves += 1;
+			pending.erase (pending.begin() + i);
+			progress = true;
+			break;
+		}
+
+		if (!progress)
+		{
+			// Only cycles left: save one destination and read it from the scratch instead.
+			auto const dst = pending[0].dst;
+			m_as.emit (VM::Op::Move, uint8_t(scratch), uint8_t(dst));
+			m_moves += 1;
+			for (auto & m : pending)
+				if (m.src == dst)
+					m.src = scratch;
+		}
+	}
+}
+
+//----------------------------------------------------------------------
+
+}	// namespace
 
 //======================================================================
+
+bool EmitFunction (IRFunction const & f, VM::Module & module, uint32_t index, uint32_t first_function, uint32_t first_global,
+	std::string & out_error, EmitStats * out_stats, EmitOptions const & options)
+{
+	if (!f.verify(out_error))
+		return false;
+	FunctionEmitter emitter (f, module, first_function, first_global, options);
+	return emitter.run(index, out_error, out_stats);
+}
+
+//----------------------------------------------------------------------
+
+bool EmitModule (IRModule const & ir, VM::Module & module, std::string & out_error, EmitStats * out_stats,
+	EmitOptions const & options)
+{
+	// Functions and globals are loaded by their index in a Bx operand;
+	// constants are checked as they are added.
+	auto const first = module.functionCount();
+	if (first + ir.functions.size() > VM::Assembler::msc_MaxBx + 1 || module.globalCount() + ir.globals.size() > VM::Assembler::msc_MaxBx + 1)
+	{
+		out_error = "too many functions or globals for a module";
+		return false;
+	}
+	for (auto const & f : ir.functions)
+		module.setFunctionFlags (module.declareFunction(f.name(), f.type(), uint16_t(f.paramTypes().size())), f.flags());
+
+	auto const first_global = module.globalCount();
+	for (auto const & g : ir.globals)
+	{
+		if (g.initializer >= ir.functions.size() || !ir.functions[g.initializer].paramTypes().empty())
+		{
+			out_error = g.name + ": the initializer of a global must be a function of the module taking no parameters";
+			return false;
+		}
+		module.addGlobal (g.name, g.type, first + g.initializer);
+	}
+
+	for (uint32_t i = 0; i < ir.functions.size(); ++i)
+		if (!EmitFunction(ir.functions[i], module, first + i, first, first_global, out_error, out_stats, options))
+			return false;
+	return true;
+}
+
 //----------------------------------------------------------------------
 //======================================================================
 
+	}	// namespace CodeGen
 }	// namespace UPL
 
 //======================================================================
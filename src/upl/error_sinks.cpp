@@ -0,0 +1,338 @@
+//======================================================================
+
+#include <upl/error_sinks.hpp>
+
+#include <cstring>
+
+//======================================================================
+
+namespace UPL {
+	namespace Error {
+
+//======================================================================
+
+static void AppendUTF8 (std::string & out, String const & str)
+{
+	for (auto wc : str)
+	{
+		uint32_t c = uint32_t(wc);
+		if (c < 0x80)
+			out += char(c);
+		else if (c < 0x800)
+		{
+			out += char(0xC0 | (c >> 6));
+			out += char(0x80 | (c & 0x3F));
+		}
+		else if (c < 0x10000)
+		{
+			out += char(0xE0 | (c >> 12));
+			out += char(0x80 | ((c >> 6) & 0x3F));
+			out += char(0x80 | (c & 0x3F));
+		}
+		else
+		{
+			out += char(0xF0 | ((c >> 18) & 0x07));
+			out += char(0x80 | ((c >> 12) & 0x3F));
+			out += char(0x80 | ((c >> 6) & 0x3F));
+			out += char(0x80 | (c & 0x3F));
+		}
+	}
+}
+
+//----------------------------------------------------------------------
+// Only needs to undo AppendUTF8, so it isn't too picky.
+static String DecodeUTF8 (std::string const & str)
+{
+	String ret;
+	for (size_t i = 0; i < str.size(); )
+	{
+		uint8_t const b = uint8_t(str[i]);
+		int extra = (b < 0x80) ? 0 : (b < 0xE0) ? 1 : (b < 0xF0) ? 2 : 3;
+		uint32_t c = (extra == 0) ? b : (b & (0x3F >> extra));
+		for (int k = 1; k <= extra && i + k < str.size(); ++k)
+			c = (c << 6) | (uint8_t(str[i + k]) & 0x3F);
+		ret += Char(c);
+		i += 1 + extra;
+	}
+	return ret;
+}
+
+//----------------------------------------------------------------------
+
+static void AppendJSONString (std::string & out, std::string const & utf8)
+{
+	static char const sc_Hex [] = "0123456789abcdef";
+
+	out += '"';
+	for (auto ch : utf8)
+	{
+		auto const c = uint8_t(ch);
+		switch (c)
+		{
+		case '"':	out += "\\\""; break;
+		case '\\':	out += "\\\\"; break;
+		case '\n':	out += "\\n"; break;
+		case '\r':	out += "\\r"; break;
+		case '\t':	out += "\\t"; break;
+		default:
+			if (c < 0x20)
+			{
+				out += "\\u00";
+				out += sc_Hex[c >> 4];
+				out += sc_Hex[c & 0xF];
+			}
+			else
+				out += char(c);
+		}
+	}
+	out += '"';
+}
+
+//----------------------------------------------------------------------
+
+static void AppendVarint (std::string & out, uint64_t v)
+{
+	while (v >= 0x80)
+	{
+		out += char(0x80 | (v & 0x7F));
+		v >>= 7;
+	}
+	out += char(v);
+}
+
+//----------------------------------------------------------------------
+
+static bool ReadVarint (FILE * in, uint64_t & v)
+{
+	v = 0;
+	for (int shift = 0; shift < 64; shift += 7)
+	{
+		int const c = fgetc(in);
+		if (EOF == c)
+			return false;
+		v |= uint64_t(c & 0x7F) << shift;
+		if (0 == (c & 0x80))
+			return true;
+	}
+	return false;
+}
+
+//----------------------------------------------------------------------
+
+static bool ReadBytes (FILE * in, std::string & out)
+{
+	uint64_t len = 0;
+	if (!ReadVarint(in, len) || len > (1U << 30))
+		return false;
+	out.resize (size_t(len));
+	return len == 0 || fread(&out[0], 1, size_t(len), in) == len;
+}
+
+//======================================================================
+
+BufferedSink::BufferedSink (FILE * out, int batch_records, size_t batch_bytes, int error_interval_ms)
+	: m_out (out)
+	, m_batch_records (batch_records)
+	, m_batch_bytes (batch_bytes)
+	, m_error_interval (std::chrono::milliseconds(error_interval_ms))
+	, m_last_error_write (std::chrono::steady_clock::now() - m_error_interval)
+	, m_held_since ()
+	, m_holding_error (false)
+	, m_buffer ()
+	, m_pending_records (0)
+	, m_records_written (0)
+	, m_bytes_written (0)
+	, m_write_count (0)
+{
+	assert (nullptr != m_out);
+	m_buffer.reserve (m_batch_bytes + 256);
+}
+
+//----------------------------------------------------------------------
+// flush() doesn't encode anything, so it's safe to call from here.
+BufferedSink::~BufferedSink ()
+{
+	flush ();
+}
+
+//----------------------------------------------------------------------
+
+void BufferedSink::consume (Record const & record)
+{
+	encode (record, m_buffer);
+	m_pending_records += 1;
+
+	bool const error = record.severity() == Severity::Error;
+	if (m_pending_records >= m_batch_records || m_buffer.size() >= m_batch_bytes ||
+		record.severity() == Severity::Fatal)
+		flush ();
+	else if (error || m_holding_error)
+	{
+		// Only errors, and what comes after one held back, look at the clock.
+		auto const now = std::chrono::steady_clock::now();
+		if ((error && now - m_last_error_write >= m_error_interval) ||
+			(m_holding_error && now - m_held_since >= m_error_interval))
+		{
+			m_last_error_write = now;
+			flush ();
+		}
+		else if (!m_holding_error)
+		{
+			m_holding_error = true;
+			m_held_since = now;
+		}
+	}
+}
+
+//----------------------------------------------------------------------
+
+void BufferedSink::poll ()
+{
+	if (!m_holding_error)
+		return;
+	auto const now = std::chrono::steady_clock::now();
+	if (now - m_held_since >= m_error_interval)
+	{
+		m_last_error_write = now;
+		flush ();
+	}
+}
+
+//----------------------------------------------------------------------
+
+void BufferedSink::flush ()
+{
+	if (!m_buffer.empty())
+	{
+		m_bytes_written += fwrite(m_buffer.data(), 1, m_buffer.size(), m_out);
+		m_buffer.clear ();
+		m_write_count += 1;
+	}
+	m_records_written += m_pending_records;
+	m_pending_records = 0;
+	m_holding_error = false;
+	fflush (m_out);
+}
+
+//======================================================================
+
+void TextSink::encode (Record const & record, std::string & out)
+{
+	char nums [64];
+
+	out += record.file();
+	snprintf (nums, sizeof(nums), ":%d:%d: ", record.location().line(), record.location().column());
+	out += nums;
+	out += SeverityName(record.severity());
+	out += ": ";
+	AppendUTF8 (out, record.message());
+	snprintf (nums, sizeof(nums), " [%s %d]\n", CategoryName(record.category()), record.number());
+	out += nums;
+}
+
+//======================================================================
+
+void JSONLinesSink::encode (Record const & record, std::string & out)
+{
+	char nums [96];
+	std::string msg;
+	AppendUTF8 (msg, record.message());
+
+	out += "{\"file\":";
+	AppendJSONString (out, record.file());
+	snprintf (nums, sizeof(nums), ",\"line\":%d,\"column\":%d,\"severity\":\"%s\",\"category\":\"%s\",\"number\":%d,\"message\":",
+		record.location().line(), record.location().column(),
+		SeverityName(record.severity()), CategoryName(record.category()), record.number());
+	out += nums;
+	AppendJSONString (out, msg);
+	out += "}\n";
+}
+
+//======================================================================
+
+BinarySink::BinarySink (FILE * out, int batch_records, size_t batch_bytes, int error_interval_ms)
+	: BufferedSink (out, batch_records, batch_bytes, error_interval_ms)
+	, m_files ()
+{
+	buffer() += "UPLD";
+	buffer() += char(msc_Version);
+}
+
+//----------------------------------------------------------------------
+
+void BinarySink::encode (Record const & record, std::string & out)
+{
+	size_t file = 0;
+	while (file < m_files.size() && m_files[file] != record.file())
+		++file;
+
+	if (file == m_files.size())
+	{
+		m_files.push_back (record.file());
+		out += char(1);
+		AppendVarint (out, record.file().size());
+		out += record.file();
+	}
+
+	auto const num = int64_t(record.number());
+	std::string msg;
+	AppendUTF8 (msg, record.message());
+
+	out += char(2);
+	out += char((int(record.severity()) << 4) | int(record.category()));
+	AppendVarint (out, file);
+	AppendVarint (out, uint32_t(record.location().line()));
+	AppendVarint (out, uint32_t(record.location().column()));
+	AppendVarint (out, (uint64_t(num) << 1) ^ uint64_t(num >> 63));
+	AppendVarint (out, msg.size());
+	out += msg;
+}
+
+//======================================================================
+
+bool ReadBinaryDiagnostics (FILE * in, std::vector<Record> & out)
+{
+	char header [5];
+	if (fread(header, 1, 5, in) != 5 || 0 != memcmp(header, "UPLD", 4) || header[4] != char(BinarySink::msc_Version))
+		return false;
+
+	std::vector<Path> files;
+	std::string bytes;
+
+	for (;;)
+	{
+		int const kind = fgetc(in);
+		if (EOF == kind)
+			return true;
+
+		if (1 == kind)
+		{
+			if (!ReadBytes(in, bytes))
+				return false;
+			files.push_back (bytes);
+		}
+		else if (2 == kind)
+		{
+			int const sev_cat = fgetc(in);
+			uint64_t file = 0, line = 0, column = 0, num = 0;
+			if (EOF == sev_cat || !ReadVarint(in, file) || !ReadVarint(in, line) ||
+				!ReadVarint(in, column) || !ReadVarint(in, num) || !ReadBytes(in, bytes) ||
+				file >= files.size())
+				return false;
+
+			out.emplace_back (
+				files[size_t(file)], Location(int(line), int(column)),
+				Severity(sev_cat >> 4), Category(sev_cat & 0xF),
+				Number(int64_t(num >> 1) ^ -int64_t(num & 1)), DecodeUTF8(bytes));
+		}
+		else
+			return false;
+	}
+}
+
+//======================================================================
+
+	}	// namespace Error
+}	// namespace UPL
+
+//======================================================================
@@ -2,24 +2,69 @@
 
 #include <upl/errors.hpp>
 
+#include <algorithm>
+#include <tuple>
+
 //======================================================================
 
 namespace UPL {
 	namespace Error {
 
 //======================================================================
+
+char const * CategoryName (Category cat)
+{
+	switch (cat)
+	{
+	case Category::Unknown:		return "unknown";
+	case Category::Internal:	return "internal";
+	case Category::Input:		return "input";
+	case Category::Lexer:		return "lexer";
+	case Category::Parser:		return "parser";
+	case Category::CodeGen:		return "codegen";
+	case Category::VM:			return "vm";
+	case Category::Runtime:		return "runtime";
+	case Category::Other:		return "other";
+	}
+	return "???";
+}
+
 //----------------------------------------------------------------------
+
+char const * SeverityName (Severity sev)
+{
+	switch (sev)
+	{
+	case Severity::Note:		return "note";
+	case Severity::Warning:		return "warning";
+	case Severity::Error:		return "error";
+	case Severity::Fatal:		return "fatal";
+	}
+	return "???";
+}
+
 //======================================================================
 
 Reporter::Reporter ()
 	: m_reports ()
 	, m_file_name_stack ()
+	, m_sink (nullptr)
+	, m_keep_reports (true)
+	, m_count (0)
 {
 	m_file_name_stack.emplace_back ("???");
 }
 
 //----------------------------------------------------------------------
 
+void Reporter::setSink (Sink * sink, bool keep_reports /*= true*/)
+{
+	m_sink = sink;
+	m_keep_reports = keep_reports || (nullptr == sink);
+}
+
+//----------------------------------------------------------------------
+
 void Reporter::pushFileName (Path new_file_name)
 {
 	m_file_name_stack.emplace_back (std::move(new_file_name));
@@ -37,7 +82,17 @@ void Reporter::popFileName ()
 
 void Reporter::newReport (Location loc, Severity sev, Category cat, Number num, String msg /*= String()*/)
 {
-	m_reports.emplace_back (currentFile(), std::move(loc), sev, cat, num, std::move(msg));
+	m_count += 1;
+
+	if (nullptr == m_sink)
+		m_reports.emplace_back (currentFile(), std::move(loc), sev, cat, num, std::move(msg));
+	else if (m_keep_reports)
+	{
+		m_reports.emplace_back (currentFile(), std::move(loc), sev, cat, num, std::move(msg));
+		m_sink->consume (m_reports.back());
+	}
+	else
+		m_sink->consume (Record(currentFile(), std::move(loc), sev, cat, num, std::move(msg)));
 }
 
 //----------------------------------------------------------------------
@@ -71,6 +126,323 @@ IMPLEMENT_CONVENIENCE_REPORT_METHOD(Runtime, Error)
 
 #undef IMPLEMENT_CONVENIENCE_REPORT_METHOD
 
+//======================================================================
+
+static std::atomic<uint64_t> gs_NextConcurrentReporterSerial (1);
+
+// Merge order, but for the message: file (by path), line, column,
+// severity, category and number.
+template <typename Ranked>
+static std::tuple<FileID, int, int, int, int, Number> MergeKey (Ranked const & r)
+{
+	return std::make_tuple(
+		r.file_rank, r.rec->location.line(), r.rec->location.column(),
+		int(r.rec->severity), int(r.rec->category), r.rec->number);
+}
+
+//----------------------------------------------------------------------
+
+String ConcurrentReporter::DefaultFormatter (Number /*num*/, String const * args, int arg_count)
+{
+	String ret;
+	for (int i = 0; i < arg_count; ++i)
+	{
+		if (i > 0)
+			ret += L" ";
+		ret += args[i];
+	}
+	return ret;
+}
+
+//----------------------------------------------------------------------
+
+ConcurrentReporter::Local::Local (ConcurrentReporter & owner, std::thread::id thread)
+	: m_owner (owner)
+	, m_thread (thread)
+	, m_file_stack ()
+	, m_records ()
+	, m_arg_pool ()
+	, m_arg_ends ()
+	, m_submitted (0)
+{
+	m_file_stack.push_back (0);	// "???"
+	for (auto & d : m_dropped)
+		d = 0;
+}
+
+//----------------------------------------------------------------------
+
+void ConcurrentReporter::Local::pushFileName (Path const & new_file_name)
+{
+	m_file_stack.push_back (m_owner.internPath(new_file_name));
+}
+
+//----------------------------------------------------------------------
+
+void ConcurrentReporter::Local::popFileName ()
+{
+	if (m_file_stack.size() > 1)
+		m_file_stack.pop_back ();
+}
+
+//----------------------------------------------------------------------
+
+void ConcurrentReporter::Local::newReport (Location const & loc, Severity sev, Category cat, Number num)
+{
+	newReport (loc, sev, cat, num, nullptr, 0);
+}
+
+//----------------------------------------------------------------------
+
+void ConcurrentReporter::Local::newReport (Location const & loc, Severity sev, Category cat, Number num, String const & arg0)
+{
+	newReport (loc, sev, cat, num, &arg0, 1);
+}
+
+//----------------------------------------------------------------------
+
+void ConcurrentReporter::Local::newReport (Location const & loc, Severity sev, Category cat, Number num, String const & arg0, String const & arg1)
+{
+	if (!admit(sev))
+		return;
+	m_records.push_back ({currentFile(), loc, sev, cat, num, uint32_t(m_arg_ends.size()), 2});
+	addArg (arg0);
+	addArg (arg1);
+}
+
+//----------------------------------------------------------------------
+
+void ConcurrentReporter::Local::newReport (Location const & loc, Severity sev, Category cat, Number num, String const * args, int arg_count)
+{
+	if (!admit(sev))
+		return;
+	m_records.push_back ({currentFile(), loc, sev, cat, num, uint32_t(m_arg_ends.size()), uint32_t(arg_count)});
+	for (int i = 0; i < arg_count; ++i)
+		addArg (args[i]);
+}
+
+//----------------------------------------------------------------------
+
+bool ConcurrentReporter::Local::admit (Severity sev)
+{
+	if (m_submitted++ < m_owner.cap())
+		return true;
+
+	m_dropped[int(sev)] += 1;
+	return false;
+}
+
+//----------------------------------------------------------------------
+
+void ConcurrentReporter::Local::addArg (String const & arg)
+{
+	m_arg_pool += arg;
+	m_arg_ends.push_back (uint32_t(m_arg_pool.size()));
+}
+
+//----------------------------------------------------------------------
+//----------------------------------------------------------------------
+
+ConcurrentReporter::ConcurrentReporter (size_t cap)
+	: m_serial (gs_NextConcurrentReporterSerial.fetch_add(1))
+	, m_cap (cap)
+	, m_mutex ()
+	, m_locals ()
+	, m_paths ()
+{
+	m_paths.emplace_back ("???");
+}
+
+//----------------------------------------------------------------------
+
+ConcurrentReporter::~ConcurrentReporter ()
+{
+}
+
+//----------------------------------------------------------------------
+
+ConcurrentReporter::Local & ConcurrentReporter::local ()
+{
+	// Remembers the last buffer used on this thread. A reporter's serial is
+	// never reused, so a stale entry can't match a newer reporter.
+	static thread_local uint64_t tls_serial = 0;
+	static thread_local Local * tls_local = nullptr;
+
+	if (tls_serial == m_serial)
+		return *tls_local;
+
+	auto const this_thread = std::this_thread::get_id();
+	std::lock_guard<std::mutex> lock (m_mutex);
+
+	Local * found = nullptr;
+	for (auto const & l : m_locals)
+		if (l->m_thread == this_thread)
+			found = l.get();
+
+	if (nullptr == found)
+	{
+		m_locals.emplace_back (new Local (*this, this_thread));
+		found = m_locals.back().get();
+	}
+
+	tls_serial = m_serial;
+	tls_local = found;
+	return *found;
+}
+
+//----------------------------------------------------------------------
+// Linear, but only called when a thread switches files.
+FileID ConcurrentReporter::internPath (Path const & path)
+{
+	std::lock_guard<std::mutex> lock (m_mutex);
+
+	for (size_t i = 0; i < m_paths.size(); ++i)
+		if (m_paths[i] == path)
+			return FileID(i);
+
+	m_paths.push_back (path);
+	return FileID(m_paths.size() - 1);
+}
+
+//----------------------------------------------------------------------
+
+Path ConcurrentReporter::path (FileID file) const
+{
+	std::lock_guard<std::mutex> lock (m_mutex);
+	return (file < m_paths.size()) ? m_paths[file] : m_paths[0];
+}
+
+//----------------------------------------------------------------------
+
+size_t ConcurrentReporter::count () const
+{
+	std::lock_guard<std::mutex> lock (m_mutex);
+	size_t ret = 0;
+	for (auto const & l : m_locals)
+		ret += l->m_submitted;
+	return ret;
+}
+
+//----------------------------------------------------------------------
+
+size_t ConcurrentReporter::keptCount () const
+{
+	std::lock_guard<std::mutex> lock (m_mutex);
+	size_t ret = 0;
+	for (auto const & l : m_locals)
+		ret += l->m_records.size();
+	return std::min(ret, cap());
+}
+
+//----------------------------------------------------------------------
+
+size_t ConcurrentReporter::droppedCount () const
+{
+	return
+		droppedCount(Severity::Note) + droppedCount(Severity::Warning) +
+		droppedCount(Severity::Error) + droppedCount(Severity::Fatal);
+}
+
+//----------------------------------------------------------------------
+// Those each thread only counted, and those the merge leaves out. (Reports
+// that tie in merge order up to the message have the same severity, so
+// which of them are left out doesn't matter here.)
+size_t ConcurrentReporter::droppedCount (Severity sev) const
+{
+	std::lock_guard<std::mutex> lock (m_mutex);
+	size_t ret = 0;
+	for (auto const & l : m_locals)
+		ret += l->m_dropped[int(sev)];
+
+	auto const all = ranked();
+	for (size_t i = cap(); i < all.size(); ++i)
+		if (sev == all[i].rec->severity)
+			ret += 1;
+	return ret;
+}
+
+//----------------------------------------------------------------------
+
+std::vector<ConcurrentReporter::Ranked> ConcurrentReporter::ranked () const
+{
+	// FileIDs are handed out in whatever order the threads got to them,
+	// so order the files by path instead.
+	std::vector<FileID> by_path (m_paths.size()), path_rank (m_paths.size());
+	for (size_t i = 0; i < by_path.size(); ++i)
+		by_path[i] = FileID(i);
+	std::sort (by_path.begin(), by_path.end(),
+		[this](FileID a, FileID b){return m_paths[a] < m_paths[b];});
+	for (size_t i = 0; i < by_path.size(); ++i)
+		path_rank[by_path[i]] = FileID(i);
+
+	std::vector<Ranked> ret;
+	for (auto const & l : m_locals)
+		for (auto const & r : l->m_records)
+			ret.push_back ({l.get(), &r, path_rank[r.file]});
+
+	std::stable_sort (ret.begin(), ret.end(),
+		[](Ranked const & a, Ranked const & b){return MergeKey(a) < MergeKey(b);});
+	return ret;
+}
+
+//----------------------------------------------------------------------
+
+std::vector<Record> ConcurrentReporter::merge (Formatter formatter) const
+{
+	std::lock_guard<std::mutex> lock (m_mutex);
+
+	struct Item
+	{
+		Ranked r;
+		String message;
+	};
+
+	std::vector<Item> items;
+	for (auto const & i : ranked())
+	{
+		auto const & r = *i.rec;
+		auto const l = i.local;
+		std::vector<String> args;
+		args.reserve (r.arg_count);
+		for (uint32_t a = r.first_arg; a < r.first_arg + r.arg_count; ++a)
+		{
+			auto const b = (a > 0) ? l->m_arg_ends[a - 1] : 0;
+			args.emplace_back (l->m_arg_pool, b, l->m_arg_ends[a] - b);
+		}
+		items.push_back ({i, formatter(r.number, args.data(), int(args.size()))});
+	}
+
+	// Already in order but for the messages, which only break ties.
+	std::stable_sort (items.begin(), items.end(),
+		[](Item const & a, Item const & b){
+			auto const ka = MergeKey(a.r), kb = MergeKey(b.r);
+			return ka < kb || (ka == kb && a.message < b.message);
+		});
+	auto const kept = cap();
+	if (items.size() > kept)
+		items.resize (kept);
+
+	std::vector<Record> ret;
+	ret.reserve (items.size());
+	for (auto & i : items)
+		ret.emplace_back (
+			m_paths[i.r.rec->file], i.r.rec->location, i.r.rec->severity,
+			i.r.rec->category, i.r.rec->number, std::move(i.message));
+	return ret;
+}
+
+//----------------------------------------------------------------------
+
+void ConcurrentReporter::mergeInto (Reporter & reporter, Formatter formatter) const
+{
+	for (auto & r : merge(formatter))
+	{
+		reporter.pushFileName (r.file());
+		reporter.newReport (r.location(), r.severity(), r.category(), r.number(), r.message());
+		reporter.popFileName ();
+	}
+}
+
 //======================================================================
 
 	}	// namespace Error
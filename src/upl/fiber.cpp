@@ -0,0 +1,194 @@
+//======================================================================
+
+#include <upl/fiber.hpp>
+
+#include <cassert>
+#include <cstdint>
+#include <cstdlib>
+
+#if UPL_FIBERS_AVAILABLE
+	#include <sys/mman.h>
+	#include <unistd.h>
+#endif
+
+//======================================================================
+
+#if UPL_FIBERS_AVAILABLE
+
+// Saves the callee-saved registers on the current stack, stores the stack
+// pointer in *save_sp, and switches to the stack at load_sp, where the same
+// was saved (or laid out by Fiber::start); returns into whatever called
+// the switch that saved it. The frame, from the stack pointer up:
+//     8 unused, MXCSR (4), x87 control word (2, and 2 unused),
+//     r12, r13, r14, r15, rbx, rbp, return address
+extern "C" void upl_private_fiber_switch (void ** save_sp, void * load_sp);
+
+// Where a new fiber "returns" to first: calls r13 (Fiber::Main) with r12
+// (the fiber), which never returns.
+extern "C" void upl_private_fiber_start ();
+
+asm (
+	"	.text\n"
+	"	.globl	upl_private_fiber_switch\n"
+	"	.hidden	upl_private_fiber_switch\n"
+	"	.type	upl_private_fiber_switch, @function\n"
+	"	.p2align 4\n"
+	"upl_private_fiber_switch:\n"
+	"	pushq	%rbp\n"
+	"	pushq	%rbx\n"
+	"	pushq	%r15\n"
+	"	pushq	%r14\n"
+	"	pushq	%r13\n"
+	"	pushq	%r12\n"
+	"	subq	$16, %rsp\n"
+	"	stmxcsr	8(%rsp)\n"
+	"	fnstcw	12(%rsp)\n"
+	"	movq	%rsp, (%rdi)\n"
+	"	movq	%rsi, %rsp\n"
+	"	ldmxcsr	8(%rsp)\n"
+	"	fldcw	12(%rsp)\n"
+	"	addq	$16, %rsp\n"
+	"	popq	%r12\n"
+	"	popq	%r13\n"
+	"	popq	%r14\n"
+	"	popq	%r15\n"
+	"	popq	%rbx\n"
+	"	popq	%rbp\n"
+	"	ret\n"
+	"	.size	upl_private_fiber_switch, .-upl_private_fiber_switch\n"
+	"\n"
+	"	.globl	upl_private_fiber_start\n"
+	"	.hidden	upl_private_fiber_start\n"
+	"	.type	upl_private_fiber_start, @function\n"
+	"	.p2align 4\n"
+	"upl_private_fiber_start:\n"
+	"	movq	%r12, %rdi\n"
+	"	callq	*%r13\n"
+	"	ud2\n"
+	"	.size	upl_private_fiber_start, .-upl_private_fiber_start\n"
+);
+
+#endif	// UPL_FIBERS_AVAILABLE
+
+//======================================================================
+
+namespace UPL {
+	namespace VM {
+
+//======================================================================
+
+Fiber::Fiber (size_t stack_size)
+	: m_stack (nullptr)
+	, m_stack_size (0)
+	, m_sp (nullptr)
+	, m_resumer_sp (nullptr)
+	, m_entry (nullptr)
+	, m_arg (nullptr)
+	, m_running (false)
+	, m_finished (true)		// Or rather, not started
+{
+#if UPL_FIBERS_AVAILABLE
+	auto const page = size_t(sysconf(_SC_PAGESIZE));
+	stack_size = UPL_MAX(page, (stack_size + page - 1) / page * page);
+
+	void * p = mmap(nullptr, stack_size + page, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (MAP_FAILED == p)
+		return;
+	if (0 != mprotect(p, page, PROT_NONE))
+	{
+		munmap (p, stack_size + page);
+		return;
+	}
+
+	m_stack = p;
+	m_stack_size = stack_size;
+#else
+	(void)stack_size;
+#endif
+}
+
+//----------------------------------------------------------------------
+
+Fiber::~Fiber ()
+{
+	assert (!m_running);
+#if UPL_FIBERS_AVAILABLE
+	if (nullptr != m_stack)
+		munmap (m_stack, m_stack_size + size_t(sysconf(_SC_PAGESIZE)));
+#endif
+}
+
+//----------------------------------------------------------------------
+// Lays out the frame upl_private_fiber_switch would have left, returning
+// into upl_private_fiber_start with the stack pointer 16-aligned, as a
+// call expects it.
+
+void Fiber::start (Entry entry, void * arg)
+{
+	assert (valid() && !m_running && m_finished);
+	m_entry = entry;
+	m_arg = arg;
+	m_finished = false;
+
+#if UPL_FIBERS_AVAILABLE
+	auto const top = reinterpret_cast<uintptr_t>(m_stack) + size_t(sysconf(_SC_PAGESIZE)) + m_stack_size;
+	auto const frame = reinterpret_cast<uint64_t *>(top - 72);
+	uint32_t mxcsr;
+	uint16_t fpucw;
+	asm volatile ("stmxcsr %0" : "=m" (mxcsr));
+	asm volatile ("fnstcw %0" : "=m" (fpucw));
+
+	frame[0] = 0;
+	frame[1] = uint64_t(mxcsr) | (uint64_t(fpucw) << 32);
+	frame[2] = reinterpret_cast<uint64_t>(this);			// r12
+	frame[3] = reinterpret_cast<uint64_t>(&Fiber::Main);	// r13
+	frame[4] = frame[5] = frame[6] = 0;						// r14, r15, rbx
+	frame[7] = 0;											// rbp: the end, for debuggers
+	frame[8] = reinterpret_cast<uint64_t>(&upl_private_fiber_start);
+	m_sp = frame;
+#endif
+}
+
+//----------------------------------------------------------------------
+
+bool Fiber::resume ()
+{
+	assert (valid() && !m_running && !m_finished);
+	m_running = true;
+#if UPL_FIBERS_AVAILABLE
+	upl_private_fiber_switch (&m_resumer_sp, m_sp);
+#endif
+	m_running = false;
+	return m_finished;
+}
+
+//----------------------------------------------------------------------
+
+void Fiber::suspend ()
+{
+	assert (m_running);
+#if UPL_FIBERS_AVAILABLE
+	upl_private_fiber_switch (&m_sp, m_resumer_sp);
+#endif
+}
+
+//----------------------------------------------------------------------
+// Nothing is ever switched back to the frame this leaves: start() lays
+// out a fresh one.
+
+void Fiber::Main (Fiber * fiber)
+{
+	fiber->m_entry (fiber->m_arg);
+	fiber->m_finished = true;
+#if UPL_FIBERS_AVAILABLE
+	upl_private_fiber_switch (&fiber->m_sp, fiber->m_resumer_sp);
+#endif
+	abort ();
+}
+
+//======================================================================
+
+	}	// namespace VM
+}	// namespace UPL
+
+//======================================================================
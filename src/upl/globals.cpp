@@ -0,0 +1,226 @@
+//======================================================================
+
+#include <upl/globals.hpp>
+#include <upl/code_gen.hpp>
+
+#include <algorithm>
+#include <cassert>
+
+//======================================================================
+
+namespace UPL {
+	namespace VM {
+
+//======================================================================
+
+Globals::Globals (Module const & module, Heap & heap)
+	: m_module (module)
+	, m_heap (heap)
+	, m_cells (module.globalCount())
+	, m_mutex ()
+	, m_settled ()
+	, m_waiting ()
+	, m_stats ()
+{
+	for (uint32_t i = 0; i < m_cells.size(); ++i)
+	{
+		auto & cell = m_cells[i];
+		cell.state.store (Unforced);
+		cell.heap_bound = CodeGen::HoldsValue(module.types(), module.global(i).type);
+		cell.value = Reg::Nil();
+		cell.owner = nullptr;
+	}
+	m_heap.addRootSource (this);
+}
+
+//----------------------------------------------------------------------
+
+Globals::~Globals ()
+{
+	m_heap.removeRootSource (this);
+}
+
+//----------------------------------------------------------------------
+
+uint32_t Globals::forcedCount () const
+{
+	uint32_t ret = 0;
+	for (auto const & cell : m_cells)
+		ret += (Forced == cell.state.load(std::memory_order_acquire)) ? 1 : 0;
+	return ret;
+}
+
+//----------------------------------------------------------------------
+// A thread stands for itself by the address of a thread_local of its own.
+
+Globals::Who Globals::Me (GlobalsWaiter * waiter)
+{
+	static thread_local char tls_me = 0;
+	return (nullptr != waiter) ? static_cast<Who>(waiter) : static_cast<Who>(&tls_me);
+}
+
+//----------------------------------------------------------------------
+// Before waiting on a global, follows the owners: if whoever is forcing
+// it waits on one that whoever... is forcing, and that ends with the
+// caller, nobody would ever wake up. A green thread that waits is taken
+// off m_waiting as it's woken (so that it's woken only once); a thread
+// takes itself off.
+
+Globals::Claim Globals::claim (uint32_t index, Reg & out_value, GlobalsWaiter * waiter)
+{
+	auto const me = Me(waiter);
+	std::unique_lock<std::mutex> lock (m_mutex);
+	auto & cell = m_cells[index];
+	for (;;)
+	{
+		switch (cell.state.load(std::memory_order_relaxed))
+		{
+		case Forced:
+			out_value = cell.value;
+			return Claim::Forced;
+
+		case Unforced:
+			cell.state.store (Forcing, std::memory_order_relaxed);
+			cell.owner = me;
+			return Claim::Mine;
+
+		default:
+			break;
+		}
+
+		auto owner = cell.owner;
+		for (size_t hops = 0; hops <= m_waiting.size(); ++hops)
+		{
+			if (owner == me)
+			{
+				m_stats.cycles += 1;
+				return Claim::Cycle;
+			}
+			auto const waiting = std::find_if(m_waiting.begin(), m_waiting.end(),
+				[owner] (Waiting const & w) {return w.who == owner;});
+			if (waiting == m_waiting.end())
+				break;
+			owner = m_cells[waiting->index].owner;
+		}
+
+		m_stats.waits += 1;
+		m_waiting.push_back ({me, index, waiter});
+		if (nullptr != waiter)
+		{
+			lock.unlock ();
+			waiter->suspendForGlobal ();
+			lock.lock ();
+		}
+		else
+		{
+			m_settled.wait (lock);
+			m_waiting.erase (std::find_if(m_waiting.begin(), m_waiting.end(),
+				[me, index] (Waiting const & w) {return w.who == me && w.index == index;}));
+		}
+	}
+}
+
+//----------------------------------------------------------------------
+
+void Globals::settle (uint32_t index, Reg value, GlobalsWaiter * waiter)
+{
+	{
+		std::lock_guard<std::mutex> lock (m_mutex);
+		auto & cell = m_cells[index];
+		assert (Forcing == cell.state.load(std::memory_order_relaxed) && Me(waiter) == cell.owner);
+		cell.value = value;
+		cell.owner = nullptr;
+		cell.state.store (Forced, std::memory_order_release);
+		m_stats.forced += 1;
+		wakeWaiters (index);
+	}
+	m_settled.notify_all ();
+	(void)waiter;
+}
+
+//----------------------------------------------------------------------
+
+void Globals::abandon (uint32_t index, GlobalsWaiter * waiter)
+{
+	{
+		std::lock_guard<std::mutex> lock (m_mutex);
+		auto & cell = m_cells[index];
+		assert (Forcing == cell.state.load(std::memory_order_relaxed) && Me(waiter) == cell.owner);
+		cell.owner = nullptr;
+		cell.state.store (Unforced, std::memory_order_relaxed);
+		m_stats.failed += 1;
+		wakeWaiters (index);
+	}
+	m_settled.notify_all ();
+	(void)waiter;
+}
+
+//----------------------------------------------------------------------
+// The green threads waiting on the global; the threads are notified.
+
+void Globals::wakeWaiters (uint32_t index)
+{
+	for (size_t i = 0; i < m_waiting.size(); )
+	{
+		auto const waiter = m_waiting[i].waiter;
+		if (m_waiting[i].index != index || nullptr == waiter)
+		{
+			++i;
+			continue;
+		}
+		m_waiting.erase (m_waiting.begin() + i);
+		waiter->wakeForGlobal ();
+	}
+}
+
+//----------------------------------------------------------------------
+
+bool Globals::forceAll (Interpreter & interpreter)
+{
+	assert (&interpreter.heap() == &m_heap);
+	for (uint32_t i = 0; i < m_cells.size(); ++i)
+	{
+		Reg value;
+		if (!isForced(i) && !interpreter.readGlobal(i, value))
+			return false;
+	}
+	return true;
+}
+
+//----------------------------------------------------------------------
+
+GlobalsStats Globals::stats () const
+{
+	std::lock_guard<std::mutex> lock (m_mutex);
+	return m_stats;
+}
+
+//----------------------------------------------------------------------
+
+void Globals::resetStats ()
+{
+	std::lock_guard<std::mutex> lock (m_mutex);
+	m_stats = GlobalsStats();
+}
+
+//----------------------------------------------------------------------
+// Only this heap's thread collects, and only it settles the globals whose
+// values are references, so there's nothing to lock.
+
+void Globals::visitRoots (RootVisitor & visitor)
+{
+	for (auto & cell : m_cells)
+		if (cell.heap_bound && Forced == cell.state.load(std::memory_order_acquire))
+		{
+			auto v = cell.value.value();
+			visitor.visit (v);
+			cell.value = Reg::FromValue(v);
+		}
+}
+
+//======================================================================
+
+	}	// namespace VM
+}	// namespace UPL
+
+//======================================================================
@@ -0,0 +1,619 @@
+//======================================================================
+
+#include <upl/hamt.hpp>
+
+#include <algorithm>
+#include <cstring>
+
+//======================================================================
+
+namespace UPL {
+	namespace VM {
+
+//======================================================================
+
+static inline uint32_t Bit (uint32_t hash, int shift)
+{
+	return uint32_t(1) << ((hash >> shift) & 31);
+}
+
+//----------------------------------------------------------------------
+// Where the entry or child of "bit" is, among those of "bitmap".
+static inline uint32_t Index (uint32_t bitmap, uint32_t bit)
+{
+	return Hamt::PopCount(bitmap & (bit - 1));
+}
+
+//----------------------------------------------------------------------
+
+static inline MapNode * NodeOf (Value v)
+{
+	return static_cast<MapNode *>(v.asObject());
+}
+
+//----------------------------------------------------------------------
+// The finalizer of MurmurHash3, so that ints that differ only in their
+// high bits still spread over the slots.
+static inline uint32_t Mix (uint64_t x)
+{
+	x ^= x >> 33;
+	x *= 0xFF51AFD7ED558CCDULL;
+	x ^= x >> 33;
+	x *= 0xC4CEB9FE1A85EC53ULL;
+	x ^= x >> 33;
+	return uint32_t(x);
+}
+
+//----------------------------------------------------------------------
+
+static inline uint32_t HashBytes (char const * p, uint32_t size)
+{
+	uint32_t ret = 2166136261U;		// FNV-1a
+	for (uint32_t i = 0; i < size; ++i)
+		ret = (ret ^ uint8_t(p[i])) * 16777619U;
+	return ret;
+}
+
+//----------------------------------------------------------------------
+
+static inline uint64_t RealBits (Real r)
+{
+	if (0 == r)
+		r = 0;		// -0 is the same key as 0
+	uint64_t ret;
+	memcpy (&ret, &r, sizeof(ret));
+	return ret;
+}
+
+//======================================================================
+
+Hamt::Hamt (Heap & heap)
+	: m_heap (heap)
+	, m_key_kinds ()
+	, m_open_edits ()
+	, m_next_edit (1)
+{
+}
+
+//----------------------------------------------------------------------
+
+Object * Hamt::newMap (Type::ID type)
+{
+	if (KeyKind::Unknown == keyKind(type))
+		return nullptr;
+	return m_heap.allocate(type, 0);
+}
+
+//----------------------------------------------------------------------
+
+Object * Hamt::set (Object * map, Value key, Value value, Edit edit)
+{
+	assert (0 == edit || std::find(m_open_edits.begin(), m_open_edits.end(), edit) != m_open_edits.end());
+
+	auto const kind = keyKind(map->type);
+	auto const hash = hashOf(kind, key);
+	Value rooted [3] = {Value::FromObject(map), key, value};
+	if (!reserve(bytesToChange(static_cast<MapNode *>(map), hash), rooted, 3))
+		return nullptr;
+
+	Change c = {kind, hash, rooted[1], rooted[2], edit, false};
+	return insert(NodeOf(rooted[0]), 0, c);
+}
+
+//----------------------------------------------------------------------
+
+Object * Hamt::remove (Object * map, Value key, Edit edit)
+{
+	assert (0 == edit || std::find(m_open_edits.begin(), m_open_edits.end(), edit) != m_open_edits.end());
+
+	auto const kind = keyKind(map->type);
+	auto const hash = hashOf(kind, key);
+	Value rooted [2] = {Value::FromObject(map), key};
+	if (!reserve(bytesToChange(static_cast<MapNode *>(map), hash), rooted, 2))
+		return nullptr;
+
+	Change c = {kind, hash, rooted[1], Value::Nil(), edit, false};
+	return erase(NodeOf(rooted[0]), 0, c);
+}
+
+//----------------------------------------------------------------------
+
+bool Hamt::find (Object const * map, Value key, Value & out_value)
+{
+	auto const kind = keyKind(map->type);
+	auto const hash = hashOf(kind, key);
+	auto node = static_cast<MapNode const *>(map);
+
+	for (int shift = 0; ; shift += msc_Bits)
+	{
+		auto const v = node->values();
+		if (shift > msc_MaxShift)
+		{
+			for (uint32_t i = 0; i < node->size; ++i)
+				if (equal(kind, v[2 * i], key))
+				{
+					out_value = v[2 * i + 1];
+					return true;
+				}
+			return false;
+		}
+
+		auto const bit = Bit(hash, shift);
+		if (node->datamap & bit)
+		{
+			auto const i = 2 * Index(node->datamap, bit);
+			if (!equal(kind, v[i], key))
+				return false;
+			out_value = v[i + 1];
+			return true;
+		}
+		if (0 == (node->nodemap & bit))
+			return false;
+		node = NodeOf(v[2 * PopCount(node->datamap) + Index(node->nodemap, bit)]);
+	}
+}
+
+//----------------------------------------------------------------------
+
+Hamt::Edit Hamt::beginEdit ()
+{
+	// Edits aren't reused (until 2^32 of them wrap around), so no node
+	// left over from an old one can be changed by a new one.
+	if (0 == m_next_edit)
+		m_next_edit = 1;
+	m_open_edits.push_back (m_next_edit);
+	return m_next_edit++;
+}
+
+//----------------------------------------------------------------------
+
+void Hamt::endEdit (Edit edit)
+{
+	m_open_edits.erase (std::remove(m_open_edits.begin(), m_open_edits.end(), edit), m_open_edits.end());
+}
+
+//======================================================================
+
+Hamt::KeyKind Hamt::keyKind (Type::ID type)
+{
+	using Type::Tag;
+
+	if (type < m_key_kinds.size() && KeyKind::Unknown != m_key_kinds[type])
+		return m_key_kinds[type];
+
+	auto const & types = m_heap.types();
+	if (type >= types.size() || types.tag(type) != Tag::Map)
+		return KeyKind::Unknown;
+
+	KeyKind ret;
+	switch (types.tag(types.getMapKeyType(type)))
+	{
+	case Tag::Int:		ret = KeyKind::Int; break;
+	case Tag::Real:		ret = KeyKind::Real; break;
+	case Tag::String:	ret = KeyKind::String; break;
+	case Tag::Any:
+	case Tag::Variant:	ret = KeyKind::Dynamic; break;
+	default:			ret = KeyKind::Bits; break;
+	}
+
+	if (type >= m_key_kinds.size())
+		m_key_kinds.resize (size_t(type) + 1, KeyKind::Unknown);
+	m_key_kinds[type] = ret;
+	return ret;
+}
+
+//----------------------------------------------------------------------
+
+Hamt::KeyKind Hamt::dynamicKind (Value v) const
+{
+	switch (v.kind())
+	{
+	case Value::Kind::Int:			return KeyKind::Int;
+	case Value::Kind::Real:			return KeyKind::Real;
+	case Value::Kind::SmallString:	return KeyKind::String;
+	case Value::Kind::Object:
+		switch (m_heap.types().tag(v.asObject()->type))
+		{
+		case Type::Tag::Int:		return KeyKind::Int;
+		case Type::Tag::String:		return KeyKind::String;
+		default:					return KeyKind::Bits;
+		}
+	default:
+		return KeyKind::Bits;
+	}
+}
+
+//----------------------------------------------------------------------
+
+uint32_t Hamt::hashOf (KeyKind kind, Value key) const
+{
+	if (KeyKind::Dynamic == kind)
+		kind = dynamicKind(key);
+
+	switch (kind)
+	{
+	case KeyKind::Int:
+		return Mix(uint64_t(key.asInt()));
+
+	case KeyKind::Real:
+		return Mix(RealBits(key.asReal()));
+
+	case KeyKind::String:
+	{
+		char buffer [Value::msc_SmallStringMax];
+		char const * bytes;
+		uint32_t size;
+		if (bytesOf(key, buffer, bytes, size))
+			return HashBytes(bytes, size);
+		return Mix(key.bits());
+	}
+
+	default:
+		return Mix(key.bits());
+	}
+}
+
+//----------------------------------------------------------------------
+
+bool Hamt::equal (KeyKind kind, Value a, Value b) const
+{
+	if (a == b)
+		return true;
+
+	if (KeyKind::Dynamic == kind)
+	{
+		kind = dynamicKind(a);
+		if (kind != dynamicKind(b))
+			return false;
+	}
+
+	switch (kind)
+	{
+	case KeyKind::Int:
+		return a.asInt() == b.asInt();
+
+	case KeyKind::Real:
+		return a.asReal() == b.asReal();
+
+	case KeyKind::String:
+	{
+		char buffer_a [Value::msc_SmallStringMax], buffer_b [Value::msc_SmallStringMax];
+		char const * bytes_a, * bytes_b;
+		uint32_t size_a, size_b;
+		return bytesOf(a, buffer_a, bytes_a, size_a) && bytesOf(b, buffer_b, bytes_b, size_b) &&
+			size_a == size_b && 0 == memcmp(bytes_a, bytes_b, size_a);
+	}
+
+	default:
+		return false;
+	}
+}
+
+//----------------------------------------------------------------------
+// A small string's bytes are copied into "buffer"; a String object's
+// are where they are.
+bool Hamt::bytesOf (Value v, char * buffer, char const * & out_bytes, uint32_t & out_size) const
+{
+	if (v.kind() == Value::Kind::SmallString)
+	{
+		v.smallStringCopy (buffer);
+		out_bytes = buffer;
+		out_size = uint32_t(v.smallStringSize());
+		return true;
+	}
+
+	if (!v.isObject() || m_heap.types().tag(v.asObject()->type) != Type::Tag::String)
+		return false;
+
+	auto const p = reinterpret_cast<char const *>(v.asObject()) + sizeof(Object);
+	memcpy (&out_size, p, sizeof(out_size));
+	out_bytes = p + sizeof(uint32_t);
+	return true;
+}
+
+//======================================================================
+// An upper bound on what set() or remove() may allocate: a bigger copy
+// of each node on the path to the key, and a chain of new nodes down to
+// where the key and the one already in its slot part ways.
+size_t Hamt::bytesToChange (MapNode const * root, uint32_t hash) const
+{
+	auto const pair_node = sizeof(MapNode) + (4 + msc_Slack) * sizeof(Value);
+	size_t ret = (msc_MaxShift / msc_Bits + 2) * pair_node;
+
+	auto node = root;
+	for (int shift = 0; ; shift += msc_Bits)
+	{
+		auto const size = sizeof(MapNode) + (Used(node) + 2 + msc_Slack) * sizeof(Value);
+		if (size >= m_heap.config().pretenure_size)
+			return SIZE_MAX;	// Only a huge collision node; it can't be had without risking a collection
+		ret += size;
+
+		if (shift > msc_MaxShift)
+			return ret;
+		auto const bit = Bit(hash, shift);
+		if (0 == (node->nodemap & bit))
+			return ret;
+		node = NodeOf(node->values()[2 * PopCount(node->datamap) + Index(node->nodemap, bit)]);
+	}
+}
+
+//----------------------------------------------------------------------
+// Makes room for "bytes" of allocations while "values" are roots (they
+// may move.) After this, nothing allocates enough to collect garbage,
+// so the nodes can be worked on through plain pointers.
+bool Hamt::reserve (size_t bytes, Value * values, int count)
+{
+	for (int i = 0; i < count; ++i)
+		m_heap.addRoot (values + i);
+	bool const ret = m_heap.reserve(bytes);
+	for (int i = count; i-- > 0; )
+		m_heap.removeRoot (values + i);
+	return ret;
+}
+
+//----------------------------------------------------------------------
+
+MapNode * Hamt::newNode (Type::ID type, uint32_t used, Edit edit)
+{
+	auto const ret = static_cast<MapNode *>(m_heap.allocate(type, (0 != edit) ? used + msc_Slack : used));
+	assert (nullptr != ret);	// There's room reserved for it
+	ret->edit = edit;
+	auto const v = ret->values();
+	for (uint32_t i = 0; i < ret->count; ++i)
+		v[i] = Value::Nil();
+	return ret;
+}
+
+//----------------------------------------------------------------------
+// The node with the Values of "node", less "remove" of them from
+// "remove_at" on, and with "insert" (to be filled in) before the one at
+// "insert_at"; both are indices into "node". That's "node" itself if it
+// belongs to the edit and has room, otherwise a copy.
+MapNode * Hamt::reshape (MapNode * node, uint32_t remove_at, uint32_t remove, uint32_t insert_at, uint32_t insert, Edit edit)
+{
+	static uint32_t const sc_MaxInPlace = 2 * 32 + msc_Slack;
+
+	auto const used = Used(node);
+	auto const new_used = used - remove + insert;
+	bool const in_place = 0 != edit && node->edit == edit && node->count >= new_used && used <= sc_MaxInPlace;
+	if (in_place && 0 == remove && 0 == insert)
+		return node;
+
+	Value saved [sc_MaxInPlace];
+	Value const * from = node->values();
+	auto ret = node;
+	if (in_place)
+	{
+		memcpy (saved, from, used * sizeof(Value));
+		from = saved;
+	}
+	else
+	{
+		ret = newNode(node->type, new_used, edit);
+		ret->datamap = node->datamap;
+		ret->nodemap = node->nodemap;
+		ret->size = node->size;
+	}
+
+	auto const to = ret->values();
+	uint32_t j = 0;
+	for (uint32_t i = 0; i <= used; ++i)
+	{
+		if (i == insert_at)
+			j += insert;
+		if (i == used)
+			break;
+		if (i >= remove_at && i < remove_at + remove)
+			continue;
+		if (in_place)
+			put (ret, j++, from[i]);
+		else
+			to[j++] = from[i];
+	}
+
+	for (j = new_used; j < used; ++j)
+		to[j] = Value::Nil();
+	return ret;
+}
+
+//----------------------------------------------------------------------
+
+void Hamt::put (MapNode * node, uint32_t index, Value v)
+{
+	auto const at = node->values() + index;
+	*at = v;
+	m_heap.writeBarrier (node, at, v);
+}
+
+//----------------------------------------------------------------------
+
+MapNode * Hamt::insert (MapNode * node, int shift, Change & c)
+{
+	auto const v = node->values();
+	auto const size = node->size;
+
+	if (shift > msc_MaxShift)
+	{
+		for (uint32_t i = 0; i < size; ++i)
+			if (equal(c.kind, v[2 * i], c.key))
+				return setValue(node, 2 * i + 1, c);
+
+		auto const ret = reshape(node, 0, 0, 2 * size, 2, c.edit);
+		put (ret, 2 * size, c.key);
+		put (ret, 2 * size + 1, c.value);
+		ret->size = size + 1;
+		c.done = true;
+		return ret;
+	}
+
+	auto const bit = Bit(c.hash, shift);
+	auto const datamap = node->datamap;
+	auto const nodemap = node->nodemap;
+	auto const children_at = 2 * PopCount(datamap);
+
+	if (datamap & bit)
+	{
+		auto const i = 2 * Index(datamap, bit);
+		if (equal(c.kind, v[i], c.key))
+			return setValue(node, i + 1, c);
+
+		// Both keys go down into a new child, in place of the entry
+		auto const child = pair(node->type, shift + msc_Bits, v[i], v[i + 1], hashOf(c.kind, v[i]), c);
+		auto const at = children_at + Index(nodemap, bit);
+		auto const ret = reshape(node, i, 2, at, 1, c.edit);
+		ret->datamap = datamap ^ bit;
+		ret->nodemap = nodemap | bit;
+		ret->size = size + 1;
+		put (ret, at - 2, Value::FromObject(child));
+		c.done = true;
+		return ret;
+	}
+
+	if (nodemap & bit)
+	{
+		auto const at = children_at + Index(nodemap, bit);
+		auto const child = NodeOf(v[at]);
+		auto const new_child = insert(child, shift + msc_Bits, c);
+		if (new_child == child && !c.done)
+			return node;
+
+		auto const ret = reshape(node, 0, 0, 0, 0, c.edit);
+		put (ret, at, Value::FromObject(new_child));
+		ret->size = size + (c.done ? 1 : 0);
+		return ret;
+	}
+
+	auto const at = 2 * Index(datamap, bit);
+	auto const ret = reshape(node, 0, 0, at, 2, c.edit);
+	ret->datamap = datamap | bit;
+	ret->size = size + 1;
+	put (ret, at, c.key);
+	put (ret, at + 1, c.value);
+	c.done = true;
+	return ret;
+}
+
+//----------------------------------------------------------------------
+
+MapNode * Hamt::erase (MapNode * node, int shift, Change & c)
+{
+	auto const v = node->values();
+	auto const size = node->size;
+
+	if (shift > msc_MaxShift)
+	{
+		for (uint32_t i = 0; i < size; ++i)
+			if (equal(c.kind, v[2 * i], c.key))
+			{
+				auto const ret = reshape(node, 2 * i, 2, 0, 0, c.edit);
+				ret->size = size - 1;
+				c.done = true;
+				return ret;
+			}
+		return node;
+	}
+
+	auto const bit = Bit(c.hash, shift);
+	auto const datamap = node->datamap;
+	auto const nodemap = node->nodemap;
+
+	if (datamap & bit)
+	{
+		auto const i = 2 * Index(datamap, bit);
+		if (!equal(c.kind, v[i], c.key))
+			return node;
+
+		auto const ret = reshape(node, i, 2, 0, 0, c.edit);
+		ret->datamap = datamap ^ bit;
+		ret->size = size - 1;
+		c.done = true;
+		return ret;
+	}
+
+	if (0 == (nodemap & bit))
+		return node;
+
+	auto const at = 2 * PopCount(datamap) + Index(nodemap, bit);
+	auto const child = NodeOf(v[at]);
+	auto const new_child = erase(child, shift + msc_Bits, c);
+	if (!c.done)
+		return node;
+
+	MapNode * ret;
+	if (1 == new_child->size && 0 == new_child->nodemap)
+	{
+		// Pull the last entry of the child up into this node
+		auto const i = 2 * Index(datamap, bit);
+		ret = reshape(node, at, 1, i, 2, c.edit);
+		ret->datamap = datamap | bit;
+		ret->nodemap = nodemap ^ bit;
+		put (ret, i, new_child->values()[0]);
+		put (ret, i + 1, new_child->values()[1]);
+	}
+	else
+	{
+		ret = reshape(node, 0, 0, 0, 0, c.edit);
+		put (ret, at, Value::FromObject(new_child));
+	}
+	ret->size = size - 1;
+	return ret;
+}
+
+//----------------------------------------------------------------------
+// A new subtree holding the entry (key, value) of hash "hash", and the
+// one of "c".
+MapNode * Hamt::pair (Type::ID type, int shift, Value key, Value value, uint32_t hash, Change const & c)
+{
+	if (shift > msc_MaxShift)
+	{
+		auto const ret = newNode(type, 4, c.edit);
+		auto const v = ret->values();
+		v[0] = key;
+		v[1] = value;
+		v[2] = c.key;
+		v[3] = c.value;
+		ret->size = 2;
+		return ret;
+	}
+
+	auto const bit = Bit(hash, shift), new_bit = Bit(c.hash, shift);
+	if (bit == new_bit)
+	{
+		auto const child = pair(type, shift + msc_Bits, key, value, hash, c);
+		auto const ret = newNode(type, 1, c.edit);
+		ret->nodemap = bit;
+		ret->size = 2;
+		ret->values()[0] = Value::FromObject(child);
+		return ret;
+	}
+
+	auto const ret = newNode(type, 4, c.edit);
+	auto const v = ret->values();
+	int const first = (bit < new_bit) ? 0 : 2;
+	v[first] = key;
+	v[first + 1] = value;
+	v[2 - first] = c.key;
+	v[3 - first] = c.value;
+	ret->datamap = bit | new_bit;
+	ret->size = 2;
+	return ret;
+}
+
+//----------------------------------------------------------------------
+
+MapNode * Hamt::setValue (MapNode * node, uint32_t index, Change const & c)
+{
+	if (node->values()[index] == c.value)
+		return node;
+
+	auto const ret = reshape(node, 0, 0, 0, 0, c.edit);
+	put (ret, index, c.value);
+	return ret;
+}
+
+//======================================================================
+
+	}	// namespace VM
+}	// namespace UPL
+
+//======================================================================
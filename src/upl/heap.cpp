@@ -0,0 +1,1025 @@
+//======================================================================
+
+#include <upl/heap.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+//======================================================================
+
+namespace UPL {
+	namespace VM {
+
+//======================================================================
+
+static inline Object * LoadRef (uint8_t const * at, bool is_value)
+{
+	if (is_value)
+	{
+		uint64_t bits;
+		memcpy (&bits, at, sizeof(bits));
+		auto const v = Value::FromBits(bits);
+		return v.isObject() ? v.asObject() : nullptr;
+	}
+
+	Object * ret;
+	memcpy (&ret, at, sizeof(ret));
+	return ret;
+}
+
+//----------------------------------------------------------------------
+
+static inline void StoreRef (uint8_t * at, bool is_value, Object * obj)
+{
+	if (is_value)
+	{
+		auto const bits = Value::FromObject(obj).bits();
+		memcpy (at, &bits, sizeof(bits));
+	}
+	else
+		memcpy (at, &obj, sizeof(obj));
+}
+
+//----------------------------------------------------------------------
+// The types an "Any" holds unboxed.
+static inline bool IsScalarTag (Type::Tag tag)
+{
+	using Type::Tag;
+	return tag == Tag::INVALID || tag == Tag::Nil || tag == Tag::Bool || tag == Tag::Byte ||
+		tag == Tag::Char || tag == Tag::Int || tag == Tag::Real;
+}
+
+//----------------------------------------------------------------------
+
+static inline uint64_t NowNS ()
+{
+	return uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count());
+}
+
+//======================================================================
+
+void PauseHistogram::add (uint64_t ns)
+{
+	int bucket = 0;
+	for (uint64_t us = ns / 1000; us > 1 && bucket < msc_BucketCount - 1; us >>= 1)
+		++bucket;
+
+	buckets[bucket] += 1;
+	count += 1;
+	total_ns += ns;
+	max_ns = UPL_MAX(max_ns, ns);
+}
+
+//======================================================================
+// Copies young objects into the old generation, leaving forwarding
+// pointers behind, and scans what it copied (Cheney-style, but with an
+// explicit list since the copies aren't contiguous.)
+class Heap::Evacuator
+	: public RootVisitor
+{
+public:
+	explicit Evacuator (Heap & heap) : m_heap (heap), m_pending () {}
+
+	void visit (Value & v) override
+	{
+		if (v.isObject() && m_heap.isYoung(v.asObject()))
+			v = Value::FromObject(evacuate(v.asObject()));
+	}
+
+	void slot (uint8_t * at, bool is_value)
+	{
+		auto const obj = LoadRef(at, is_value);
+		if (nullptr != obj && m_heap.isYoung(obj))
+			StoreRef (at, is_value, evacuate(obj));
+	}
+
+	void drain ()
+	{
+		while (!m_pending.empty())
+		{
+			auto const obj = m_pending.back();
+			m_pending.pop_back ();
+			m_heap.forEachSlot (obj, nullptr, nullptr, [this](uint8_t * at, bool is_value){slot (at, is_value);});
+		}
+	}
+
+private:
+	Object * evacuate (Object * obj)
+	{
+		Object * ret;
+		if (obj->flags & Forwarded)
+		{
+			memcpy (&ret, m_heap.payload(obj), sizeof(ret));
+			return ret;
+		}
+
+		auto const size = m_heap.sizeOf(obj);
+		ret = reinterpret_cast<Object *>(m_heap.allocateOld(size));
+		if (nullptr == ret)
+		{
+			// collectGarbage() made sure there was room, so this can only be
+			// fragmentation; there's no way to back out of a half-done copy.
+			fprintf (stderr, "UPL heap: out of memory while promoting %u bytes.\n", unsigned(size));
+			abort ();
+		}
+
+		memcpy (ret, obj, size);
+		ret->flags &= ~uint32_t(Marked);
+		obj->flags |= Forwarded;
+		memcpy (m_heap.payload(obj), &ret, sizeof(ret));
+
+		m_heap.m_stats.bytes_promoted += size;
+		m_pending.push_back (ret);
+		return ret;
+	}
+
+private:
+	Heap & m_heap;
+	std::vector<Object *> m_pending;
+};
+
+//----------------------------------------------------------------------
+
+class Heap::Marker
+	: public RootVisitor
+{
+public:
+	explicit Marker (Heap & heap) : m_heap (heap), m_stack () {}
+
+	void visit (Value & v) override
+	{
+		if (v.isObject())
+			mark (v.asObject());
+	}
+
+	void drain ()
+	{
+		while (!m_stack.empty())
+		{
+			auto const obj = m_stack.back();
+			m_stack.pop_back ();
+			m_heap.forEachSlot (obj, nullptr, nullptr, [this](uint8_t * at, bool is_value){
+				auto const ref = LoadRef(at, is_value);
+				if (nullptr != ref)
+					mark (ref);
+			});
+		}
+	}
+
+private:
+	void mark (Object * obj)
+	{
+		if (0 == (obj->flags & Marked))
+		{
+			obj->flags |= Marked;
+			m_stack.push_back (obj);
+		}
+	}
+
+private:
+	Heap & m_heap;
+	std::vector<Object *> m_stack;
+};
+
+//======================================================================
+
+Heap::Heap (Type::STContainer const & types, HeapConfig const & config)
+	: m_types (types)
+	, m_layouts (types)
+	, m_config (config)
+	, m_nursery (nullptr)
+	, m_nursery_end (nullptr)
+	, m_nursery_top (nullptr)
+	, m_old (nullptr)
+	, m_old_top (nullptr)
+	, m_cards (nullptr)
+	, m_crossing (nullptr)
+	, m_dirty_cards ()
+	, m_free_small ()
+	, m_free_large ()
+	, m_old_used (0)
+	, m_old_free (0)
+	, m_next_major (config.min_major_threshold)
+	, m_shapes ()
+	, m_vector_node_shape ()
+	, m_rope_node_shape ()
+	, m_roots ()
+	, m_root_sources ()
+	, m_stats ()
+{
+	// Card crossing offsets are 32 bits.
+	m_config.old_capacity = UPL_MIN(m_config.old_capacity, size_t(0xFFFFFFFFU)) / msc_CardSize * msc_CardSize;
+	m_config.nursery_size = m_config.nursery_size / 8 * 8;
+
+	auto const card_count = m_config.old_capacity / msc_CardSize;
+
+	// calloc, so untouched pages of these big regions cost nothing.
+	m_nursery = static_cast<uint8_t *>(calloc(m_config.nursery_size, 1));
+	m_old = static_cast<uint8_t *>(calloc(m_config.old_capacity, 1));
+	m_cards = static_cast<uint8_t *>(calloc(card_count, 1));
+	m_crossing = static_cast<uint32_t *>(calloc(card_count, sizeof(uint32_t)));
+
+	if (nullptr == m_nursery || nullptr == m_old || nullptr == m_cards || nullptr == m_crossing)
+	{
+		free (m_nursery);
+		free (m_old);
+		free (m_cards);
+		free (m_crossing);
+		m_nursery = m_old = m_cards = nullptr;
+		m_crossing = nullptr;
+		m_config.nursery_size = 0;
+		m_config.old_capacity = 0;
+	}
+
+	m_nursery_end = m_nursery + m_config.nursery_size;
+	m_nursery_top = m_nursery;
+	m_old_top = m_old;
+}
+
+//----------------------------------------------------------------------
+
+Heap::~Heap ()
+{
+	free (m_nursery);
+	free (m_old);
+	free (m_cards);
+	free (m_crossing);
+}
+
+//----------------------------------------------------------------------
+
+Object * Heap::allocate (Type::ID type, uint32_t count, bool pinned)
+{
+	auto const & s = shape(type);
+	if (!s.allocatable)
+		return nullptr;
+
+	auto const size = ObjectSize(s, count);
+	uint8_t * p = nullptr;
+
+	if (!pinned && size < m_config.pretenure_size && size <= m_config.nursery_size / 2)
+	{
+		if (size_t(m_nursery_end - m_nursery_top) < size)
+			collectGarbage (false);
+
+		p = m_nursery_top;	// The nursery is kept zeroed
+		m_nursery_top += size;
+	}
+	else
+	{
+		if (m_old_used + size > m_next_major)
+			collectGarbage (true);
+
+		p = allocateOld(size);
+		if (nullptr == p)
+		{
+			collectGarbage (true);
+			p = allocateOld(size);
+			if (nullptr == p)
+				return nullptr;
+		}
+		m_stats.bytes_pretenured += size;
+	}
+
+	auto const ret = reinterpret_cast<Object *>(p);
+	ret->type = type;
+	ret->flags = 0;
+	if (s.is_array)
+		memcpy (p + sizeof(Object) + s.count_offset, &count, sizeof(count));
+
+	m_stats.objects_allocated += 1;
+	m_stats.bytes_allocated += size;
+	return ret;
+}
+
+//----------------------------------------------------------------------
+
+bool Heap::reserve (size_t bytes)
+{
+	if (bytes > m_config.nursery_size / 2)
+		return false;
+
+	if (size_t(m_nursery_end - m_nursery_top) < bytes)
+		collectGarbage (false);
+	return true;
+}
+
+//----------------------------------------------------------------------
+
+Value Heap::newInt (Int v)
+{
+	if (Value::IntFitsInline(v))
+		return Value::FromInlineInt(v);
+
+	auto const obj = static_cast<BoxedInt *>(allocate(Type::STContainer::DefaultID(Type::Tag::Int)));
+	if (nullptr == obj)
+		return Value::Nil();
+	obj->value = v;
+	return Value::FromObject(obj);
+}
+
+//----------------------------------------------------------------------
+
+Value Heap::newString (char const * utf8, size_t size)
+{
+	Value ret;
+	if (Value::TryFromSmallString(utf8, size, ret))
+		return ret;
+
+	if (size > 0xFFFFFFFFU)
+		return Value::Nil();
+
+	auto const obj = allocate(Type::STContainer::DefaultID(Type::Tag::String), uint32_t(size));
+	if (nullptr == obj)
+		return Value::Nil();
+	memcpy (static_cast<uint8_t *>(payload(obj)) + shape(obj->type).element_offset, utf8, size);
+	return Value::FromObject(obj);
+}
+
+//----------------------------------------------------------------------
+
+Object * Heap::newClosure (Type::ID type, uint32_t function_index, uint32_t capture_count)
+{
+	if (type >= m_types.size() || m_types.tag(type) != Type::Tag::Function)
+		return nullptr;
+
+	auto const obj = allocate(type, capture_count);
+	if (nullptr != obj)
+		memcpy (payload(obj), &function_index, sizeof(function_index));
+	return obj;
+}
+
+//----------------------------------------------------------------------
+
+void Heap::collect (bool major)
+{
+	collectGarbage (major);
+}
+
+//----------------------------------------------------------------------
+
+bool Heap::resizeNursery (size_t new_size)
+{
+	new_size = new_size / 8 * 8;
+	if (new_size < 4 * msc_MinObjectSize)
+		return false;
+
+	collectGarbage (false);
+
+	auto const p = static_cast<uint8_t *>(calloc(new_size, 1));
+	if (nullptr == p)
+		return false;
+
+	free (m_nursery);
+	m_nursery = m_nursery_top = p;
+	m_nursery_end = p + new_size;
+	m_config.nursery_size = new_size;
+	return true;
+}
+
+//----------------------------------------------------------------------
+
+void Heap::addRoot (Value * root)
+{
+	m_roots.push_back (root);
+}
+
+//----------------------------------------------------------------------
+// Roots usually come and go in LIFO order, so search from the back.
+void Heap::removeRoot (Value * root)
+{
+	for (size_t i = m_roots.size(); i-- > 0; )
+		if (m_roots[i] == root)
+		{
+			m_roots.erase (m_roots.begin() + i);
+			return;
+		}
+}
+
+//----------------------------------------------------------------------
+
+void Heap::addRootSource (RootSource * source)
+{
+	m_root_sources.push_back (source);
+}
+
+//----------------------------------------------------------------------
+
+void Heap::removeRootSource (RootSource * source)
+{
+	m_root_sources.erase (std::remove(m_root_sources.begin(), m_root_sources.end(), source), m_root_sources.end());
+}
+
+//----------------------------------------------------------------------
+
+HeapStats Heap::stats () const
+{
+	auto ret = m_stats;
+	ret.nursery_size = m_config.nursery_size;
+	ret.nursery_used = size_t(m_nursery_top - m_nursery);
+	ret.old_capacity = m_config.old_capacity;
+	ret.old_used = m_old_used;
+	ret.old_free = m_old_free;
+	ret.old_top = size_t(m_old_top - m_old);
+	return ret;
+}
+
+//----------------------------------------------------------------------
+
+void Heap::setMajorThreshold (size_t min_bytes, double growth_factor)
+{
+	m_config.min_major_threshold = min_bytes;
+	m_config.major_growth_factor = UPL_MAX(growth_factor, 1.0);
+	m_next_major = UPL_MAX(m_next_major, min_bytes);
+}
+
+//----------------------------------------------------------------------
+
+size_t Heap::sizeOf (Object const * obj)
+{
+	return ObjectSize(shape(obj->type), countOf(obj));
+}
+
+//----------------------------------------------------------------------
+
+uint32_t Heap::countOf (Object const * obj)
+{
+	auto const & s = shape(obj->type);
+	if (!s.is_array)
+		return 0;
+
+	uint32_t ret;
+	memcpy (&ret, reinterpret_cast<uint8_t const *>(obj) + sizeof(Object) + s.count_offset, sizeof(ret));
+	return ret;
+}
+
+//----------------------------------------------------------------------
+
+bool Heap::fieldInfo (Object const * obj, int index, Type::Size & out_offset, Type::ID & out_type)
+{
+	auto const & s = shape(obj->type);
+	if (index < 0 || size_t(index) >= s.field_types.size())
+		return false;
+
+	out_offset = s.field_offsets[index];
+	out_type = s.field_types[index];
+	return true;
+}
+
+//----------------------------------------------------------------------
+
+bool Heap::elementInfo (Object const * obj, Type::Size & out_offset, Type::ID & out_type, Type::Size & out_stride,
+	Type::Size * out_count_offset)
+{
+	return elementInfo(obj->type, out_offset, out_type, out_stride, out_count_offset);
+}
+
+//----------------------------------------------------------------------
+
+bool Heap::elementInfo (Type::ID type, Type::Size & out_offset, Type::ID & out_type, Type::Size & out_stride,
+	Type::Size * out_count_offset)
+{
+	auto const & s = shape(type);
+	if (!s.is_array || 0 == s.element_type)
+		return false;
+
+	out_offset = s.element_offset;
+	out_type = s.element_type;
+	out_stride = s.element_stride;
+	if (nullptr != out_count_offset)
+		*out_count_offset = s.count_offset;
+	return true;
+}
+
+//----------------------------------------------------------------------
+
+bool Heap::packedElements (Object * obj, uint8_t * & out_first, Type::ID & out_type, Type::Size & out_stride,
+	uint32_t & out_count)
+{
+	if (obj->type >= m_types.size())
+		return false;		// One of the heap's own
+
+	auto const data = static_cast<uint8_t *>(payload(obj));
+	Type::Size offset = 0, count_offset;
+	switch (m_types.tag(obj->type))
+	{
+	case Type::Tag::Vector:
+		if (!elementInfo(obj->type, offset, out_type, out_stride, &count_offset))
+			return false;
+		memcpy (&out_count, data + count_offset, sizeof(out_count));
+		break;
+	case Type::Tag::Array:
+		out_type = m_types.getArrayType(obj->type);
+		out_stride = m_layouts.strideOf(out_type);
+		out_count = uint32_t(m_types.getArraySize(obj->type));
+		break;
+	default:
+		return false;
+	}
+	out_first = data + offset;
+	return true;
+}
+
+//======================================================================
+
+Heap::Shape const & Heap::shape (Type::ID type)
+{
+	using Type::Tag;
+	using Type::LayoutEngine;
+
+	assert (type != msc_FreeType);
+
+	if (type == msc_VectorNodeType || type == msc_RopeNodeType)
+	{
+		bool const is_vector = (type == msc_VectorNodeType);
+		auto & s = is_vector ? m_vector_node_shape : m_rope_node_shape;
+		if (!s.valid)
+		{
+			s.valid = s.allocatable = s.is_array = true;
+			s.fixed_size = s.element_offset = (is_vector ? sizeof(VectorNode) : sizeof(RopeNode)) - sizeof(Object);
+			s.element_stride = 8;
+			s.element_slots.push_back ({0, is_vector ? SlotKind::Ref : SlotKind::Value, 0});
+		}
+		return s;
+	}
+
+	if (type >= m_shapes.size())
+		m_shapes.resize (UPL_MAX(m_types.size(), size_t(type) + 1));
+
+	auto & s = m_shapes[type];
+	if (s.valid)
+		return s;
+
+	s.valid = true;
+	if (0 == type || type >= m_types.size())
+		return s;
+
+	s.allocatable = true;
+	auto const & l = m_layouts.layout(type);
+
+	switch (m_types.tag(type))
+	{
+	case Tag::String:
+		s.is_array = true;
+		s.element_offset = sizeof(uint32_t);
+		s.element_stride = 1;
+		s.element_type = Type::STContainer::DefaultID(Tag::Byte);
+		break;
+
+	case Tag::Vector:
+	{
+		auto const e = m_types.getVectorType(type);
+		s.is_array = true;
+		s.element_offset = LayoutEngine::RoundUp(sizeof(uint32_t), m_layouts.alignOf(e));
+		s.element_stride = m_layouts.strideOf(e);
+		s.element_type = e;
+		buildSlots (e, 0, s, s.element_slots);
+		break;
+	}
+
+	case Tag::Map:
+		s.is_array = true;
+		s.element_offset = sizeof(MapNode) - sizeof(Object);
+		s.element_stride = sizeof(Value);
+		s.element_slots.push_back ({0, SlotKind::Value, 0});
+		break;
+
+	case Tag::Function:
+		s.is_array = true;
+		s.count_offset = sizeof(uint32_t);
+		s.element_offset = 2 * sizeof(uint32_t);
+		s.element_stride = sizeof(uint64_t);
+		s.element_slots.push_back ({0, SlotKind::Value, 0});
+		break;
+
+	case Tag::Tuple:
+	case Tag::Package:
+		s.fixed_size = l.is_boxed ? l.heap_size : l.size;
+		s.field_types = (m_types.tag(type) == Tag::Tuple) ? m_types.getTupleTypes(type) : m_types.getPackageTypes(type);
+		s.field_offsets = l.field_offsets;
+		for (size_t i = 0; i < s.field_types.size(); ++i)
+			buildSlots (s.field_types[i], s.field_offsets[i], s, s.slots);
+		break;
+
+	case Tag::Array:
+	{
+		auto const e = m_types.getArrayType(type);
+		auto const stride = m_layouts.strideOf(e);
+		s.fixed_size = l.is_boxed ? l.heap_size : l.size;
+		if (m_layouts.hasPointers(e))
+			for (Type::Size i = 0, n = m_types.getArraySize(type); i < n; ++i)
+				buildSlots (e, i * stride, s, s.slots);
+		break;
+	}
+
+	default:
+		s.fixed_size = l.size;
+		buildSlots (type, 0, s, s.slots);
+		break;
+	}
+
+	if (s.is_array)
+		s.fixed_size = s.element_offset;
+
+	return s;
+}
+
+//----------------------------------------------------------------------
+// The references inside an (inline) value of "type" at offset "base".
+void Heap::buildSlots (Type::ID type, Type::Size base, Shape & shape, std::vector<Slot> & out)
+{
+	using Type::Tag;
+
+	auto const & l = m_layouts.layout(type);
+	if (!l.has_pointers)
+		return;
+
+	if (l.is_boxed)
+	{
+		out.push_back ({base, SlotKind::Ref, 0});
+		return;
+	}
+
+	switch (m_types.tag(type))
+	{
+	case Tag::Any:
+		out.push_back ({base, SlotKind::Any, l.field_offsets[1]});
+		break;
+
+	case Tag::Variant:
+	{
+		VariantMap vm;
+		vm.discriminator_size = l.discriminator_size;
+		vm.payload_offset = l.field_offsets[1];
+		for (auto alt : m_types.getVariantTypes(type))
+		{
+			vm.alternatives.emplace_back ();
+			buildSlots (alt, 0, shape, vm.alternatives.back());
+		}
+
+		auto const index = uint32_t(shape.variants.size());
+		shape.variants.push_back (std::move(vm));
+		out.push_back ({base, SlotKind::Variant, index});
+		break;
+	}
+
+	case Tag::Tuple:
+	case Tag::Package:
+	{
+		auto const fields = (m_types.tag(type) == Tag::Tuple) ? m_types.getTupleTypes(type) : m_types.getPackageTypes(type);
+		for (size_t i = 0; i < fields.size(); ++i)
+			buildSlots (fields[i], base + l.field_offsets[i], shape, out);
+		break;
+	}
+
+	case Tag::Array:
+	{
+		auto const e = m_types.getArrayType(type);
+		auto const stride = m_layouts.strideOf(e);
+		for (Type::Size i = 0, n = m_types.getArraySize(type); i < n; ++i)
+			buildSlots (e, base + i * stride, shape, out);
+		break;
+	}
+
+	default:
+		break;
+	}
+}
+
+//----------------------------------------------------------------------
+
+size_t Heap::ObjectSize (Shape const & s, uint32_t count)
+{
+	auto const payload = s.is_array ? (s.element_offset + uint64_t(count) * s.element_stride) : uint64_t(s.fixed_size);
+	auto const ret = (sizeof(Object) + payload + 7) / 8 * 8;
+	return size_t(UPL_MAX(ret, uint64_t(msc_MinObjectSize)));
+}
+
+//----------------------------------------------------------------------
+
+size_t Heap::chunkSize (Object const * chunk)
+{
+	return (chunk->type == msc_FreeType) ? chunk->flags : sizeOf(chunk);
+}
+
+//----------------------------------------------------------------------
+
+template <typename F>
+void Heap::forEachSlot (Object * obj, uint8_t const * lo, uint8_t const * hi, F && f)
+{
+	auto const & s = shape(obj->type);
+	auto const base = static_cast<uint8_t *>(payload(obj));
+
+	forEachSlotIn (s, s.slots, base, lo, hi, f);
+
+	if (!s.is_array || s.element_slots.empty())
+		return;
+
+	// Only the elements that overlap [lo, hi)
+	auto const elements = base + s.element_offset;
+	size_t first = 0, last = countOf(obj);
+	if (nullptr != lo)
+	{
+		if (lo > elements)
+			first = size_t(lo - elements) / s.element_stride;
+		if (hi > elements)
+			last = UPL_MIN(last, (size_t(hi - elements) + s.element_stride - 1) / s.element_stride);
+		else
+			last = 0;
+	}
+
+	for (size_t i = first; i < last; ++i)
+		forEachSlotIn (s, s.element_slots, elements + i * s.element_stride, lo, hi, f);
+}
+
+//----------------------------------------------------------------------
+
+template <typename F>
+void Heap::forEachSlotIn (Shape const & s, std::vector<Slot> const & slots, uint8_t * base, uint8_t const * lo, uint8_t const * hi, F && f)
+{
+	for (auto const & slot : slots)
+	{
+		auto const at = base + slot.offset;
+
+		switch (slot.kind)
+		{
+		case SlotKind::Ref:
+		case SlotKind::Value:
+			if (nullptr == lo || (at >= lo && at < hi))
+				f (at, slot.kind == SlotKind::Value);
+			break;
+
+		case SlotKind::Any:
+		{
+			Type::ID id;
+			memcpy (&id, at, sizeof(id));
+			auto const ref = at + slot.aux;
+			if (id < m_types.size() && !IsScalarTag(m_types.tag(id)) && (nullptr == lo || (ref >= lo && ref < hi)))
+				f (ref, false);
+			break;
+		}
+
+		case SlotKind::Variant:
+		{
+			auto const & vm = s.variants[slot.aux];
+			uint32_t index = 0;
+			memcpy (&index, at, vm.discriminator_size);	// Little-endian
+			if (index < vm.alternatives.size())
+				forEachSlotIn (s, vm.alternatives[index], at + vm.payload_offset, lo, hi, f);
+			break;
+		}
+		}
+	}
+}
+
+//======================================================================
+// Exact-size bins for small chunks, first fit for the rest, then the
+// untouched end of the region, then splitting a bigger small chunk.
+uint8_t * Heap::allocateOld (size_t size)
+{
+	uint8_t * ret = nullptr;
+	size_t chunk_size = 0;
+
+	auto take = [&](std::vector<Object *> & list, size_t i) {
+		auto const c = list[i];
+		list[i] = list.back();
+		list.pop_back ();
+		ret = reinterpret_cast<uint8_t *>(c);
+		chunk_size = c->flags;
+	};
+
+	if (size / 8 <= msc_SmallBins && !m_free_small[size / 8].empty())
+		take (m_free_small[size / 8], m_free_small[size / 8].size() - 1);
+
+	for (size_t i = 0; nullptr == ret && i < m_free_large.size(); ++i)
+		if (m_free_large[i]->flags >= size)
+			take (m_free_large, i);
+
+	if (nullptr == ret && size <= size_t(m_old + m_config.old_capacity - m_old_top))
+	{
+		ret = m_old_top;
+		m_old_top += size;
+	}
+
+	for (size_t b = size / 8 + 2; nullptr == ret && b <= size_t(msc_SmallBins); ++b)
+		if (!m_free_small[b].empty())
+			take (m_free_small[b], m_free_small[b].size() - 1);
+
+	if (nullptr == ret)
+		return nullptr;
+
+	if (chunk_size > 0)
+	{
+		m_old_free -= chunk_size;
+		if (chunk_size > size)
+			makeFree (ret + size, chunk_size - size);
+	}
+
+	memset (ret, 0, size);
+	coverCards (ret, size);
+	m_old_used += size;
+	return ret;
+}
+
+//----------------------------------------------------------------------
+
+void Heap::makeFree (uint8_t * start, size_t size)
+{
+	while (size > 0)
+	{
+		auto const n = UPL_MIN(size, size_t(0x80000000U));
+		auto const chunk = reinterpret_cast<Object *>(start);
+		chunk->type = msc_FreeType;
+		chunk->flags = uint32_t(n);
+		coverCards (start, n);
+
+		if (n / 8 <= msc_SmallBins)
+			m_free_small[n / 8].push_back (chunk);
+		else
+			m_free_large.push_back (chunk);
+
+		m_old_free += n;
+		start += n;
+		size -= n;
+	}
+}
+
+//----------------------------------------------------------------------
+// Every card whose first byte is in [start, start + size) is covered by
+// the chunk starting at "start".
+void Heap::coverCards (uint8_t const * start, size_t size)
+{
+	auto const offset = size_t(start - m_old);
+	auto const first = (offset + msc_CardSize - 1) >> msc_CardShift;
+	auto const last = (offset + size - 1) >> msc_CardShift;
+	for (auto k = first; k <= last; ++k)
+		m_crossing[k] = uint32_t(offset);
+}
+
+//----------------------------------------------------------------------
+
+void Heap::markCard (void const * slot)
+{
+	assert (isOld(slot));
+	auto const k = size_t(static_cast<uint8_t const *>(slot) - m_old) >> msc_CardShift;
+	if (0 == m_cards[k])
+	{
+		m_cards[k] = 1;
+		m_dirty_cards.push_back (uint32_t(k));
+	}
+}
+
+//======================================================================
+// A minor collection needs room for the whole nursery to be promoted;
+// if there may not be, a major one goes first (it then has to trace
+// through the nursery too.)
+void Heap::collectGarbage (bool force_major)
+{
+	auto const young = size_t(m_nursery_top - m_nursery);
+	auto const room = size_t(m_old + m_config.old_capacity - m_old_top) + m_old_free;
+
+	bool did_major = false;
+	if (room < young)
+	{
+		major ();
+		did_major = true;
+	}
+
+	minor ();
+
+	if (!did_major && (force_major || m_old_used > m_next_major))
+		major ();
+}
+
+//----------------------------------------------------------------------
+
+void Heap::minor ()
+{
+	auto const start = NowNS();
+
+	Evacuator evacuator (*this);
+	visitAllRoots (evacuator);
+
+	// Old-to-young references: walk the objects overlapping each dirty
+	// card, starting from the one covering its first byte.
+	auto const slot = [&evacuator](uint8_t * at, bool is_value){evacuator.slot (at, is_value);};
+	for (auto k : m_dirty_cards)
+	{
+		m_cards[k] = 0;
+		auto const card = m_old + (size_t(k) << msc_CardShift);
+		auto const card_end = UPL_MIN(card + msc_CardSize, m_old_top);
+
+		for (auto p = m_old + m_crossing[k]; p < card_end; )
+		{
+			auto const obj = reinterpret_cast<Object *>(p);
+			auto const size = chunkSize(obj);
+			if (obj->type != msc_FreeType)
+				forEachSlot (obj, card, card_end, slot);
+			p += size;
+		}
+	}
+	m_stats.dirty_cards_scanned += m_dirty_cards.size();
+	m_dirty_cards.clear ();
+
+	evacuator.drain ();
+
+	memset (m_nursery, 0, size_t(m_nursery_top - m_nursery));
+	m_nursery_top = m_nursery;
+
+	m_stats.minor_collections += 1;
+	m_stats.minor_pauses.add (NowNS() - start);
+}
+
+//----------------------------------------------------------------------
+
+void Heap::major ()
+{
+	auto const start = NowNS();
+
+	Marker marker (*this);
+	visitAllRoots (marker);
+	marker.drain ();
+
+	sweep ();
+
+	// Marking went through the nursery as well.
+	for (auto p = m_nursery; p < m_nursery_top; )
+	{
+		auto const obj = reinterpret_cast<Object *>(p);
+		obj->flags &= ~uint32_t(Marked);
+		p += sizeOf(obj);
+	}
+
+	m_next_major = UPL_MAX(m_config.min_major_threshold, size_t(m_old_used * m_config.major_growth_factor));
+
+	m_stats.major_collections += 1;
+	m_stats.major_pauses.add (NowNS() - start);
+}
+
+//----------------------------------------------------------------------
+
+void Heap::visitAllRoots (RootVisitor & visitor)
+{
+	for (auto root : m_roots)
+		visitor.visit (*root);
+	for (auto source : m_root_sources)
+		source->visitRoots (visitor);
+}
+
+//----------------------------------------------------------------------
+// Coalesces runs of dead objects and free chunks, rebuilds the free
+// lists, and gives a free run at the very end back to the bump region.
+void Heap::sweep ()
+{
+	for (auto & bin : m_free_small)
+		bin.clear ();
+	m_free_large.clear ();
+	m_old_free = 0;
+
+	size_t live = 0, freed = 0;
+	uint8_t * run = nullptr;
+
+	for (auto p = m_old; p < m_old_top; )
+	{
+		auto const obj = reinterpret_cast<Object *>(p);
+		auto const size = chunkSize(obj);
+		bool const is_free = (obj->type == msc_FreeType);
+
+		if (is_free || 0 == (obj->flags & Marked))
+		{
+			if (!is_free)
+				freed += size;
+			if (nullptr == run)
+				run = p;
+		}
+		else
+		{
+			obj->flags &= ~uint32_t(Marked);
+			live += size;
+			if (nullptr != run)
+			{
+				makeFree (run, size_t(p - run));
+				run = nullptr;
+			}
+		}
+
+		p += size;
+	}
+
+	if (nullptr != run)
+		m_old_top = run;
+
+	m_old_used = live;
+	m_stats.bytes_freed += freed;
+}
+
+//======================================================================
+
+	}	// namespace VM
+}	// namespace UPL
+
+//======================================================================
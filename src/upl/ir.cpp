@@ -0,0 +1,871 @@
+//======================================================================
+
+#include <upl/ir.hpp>
+#include <upl/bulk.hpp>
+#include <upl/scheduler.hpp>
+
+#include <algorithm>
+#include <cassert>
+#include <cstdio>
+
+//======================================================================
+
+namespace UPL {
+	namespace CodeGen {
+
+//======================================================================
+
+#define IR_OPCODE_INFO(e,s,n,k)		{s, n, IRKind::k},
+static struct {
+	char const * name;
+	int operands;
+	IRKind kind;
+} const gsc_IROpInfo [IROpCount] = { UPL_PRIVATE__IR_OPCODES(IR_OPCODE_INFO) };
+#undef  IR_OPCODE_INFO
+
+//----------------------------------------------------------------------
+
+char const * IROpName (IROp op)
+{
+	return (int(op) < IROpCount) ? gsc_IROpInfo[int(op)].name : "???";
+}
+
+//----------------------------------------------------------------------
+
+int IROpOperands (IROp op)
+{
+	return (int(op) < IROpCount) ? gsc_IROpInfo[int(op)].operands : 0;
+}
+
+//----------------------------------------------------------------------
+
+IRKind IROpKind (IROp op)
+{
+	return (int(op) < IROpCount) ? gsc_IROpInfo[int(op)].kind : IRKind::Effect;
+}
+
+//======================================================================
+
+IRFunction::IRFunction (std::string name, Type::ID type, std::vector<Type::ID> param_types)
+	: m_name (std::move(name))
+	, m_type (type)
+	, m_param_types (std::move(param_types))
+	, m_flags (0)
+	, m_values (1)
+	, m_blocks (1)
+{
+	m_values[0].dead = true;
+}
+
+//----------------------------------------------------------------------
+
+BlockID IRFunction::addBlock ()
+{
+	m_blocks.push_back (IRBlock());
+	return BlockID(m_blocks.size() - 1);
+}
+
+//----------------------------------------------------------------------
+
+ValueID IRFunction::addInstr (IRInstr instr)
+{
+	m_values.push_back (std::move(instr));
+	return ValueID(m_values.size() - 1);
+}
+
+//----------------------------------------------------------------------
+
+int IRFunction::successors (BlockID b, BlockID out [2]) const
+{
+	auto const t = terminator(b);
+	if (NoValue == t)
+		return 0;
+
+	auto const & ins = m_values[t];
+	switch (ins.op)
+	{
+	case IROp::Jmp:
+		out[0] = ins.targets[0];
+		return 1;
+	case IROp::Br:
+		out[0] = ins.targets[0];
+		out[1] = ins.targets[1];
+		return 2;
+	default:
+		return 0;
+	}
+}
+
+//----------------------------------------------------------------------
+
+uint32_t IRFunction::instructionCount () const
+{
+	uint32_t ret = 0;
+	for (auto const & b : m_blocks)
+		if (!b.dead)
+			for (auto v : b.code)
+				if (!m_values[v].dead)
+					ret += 1;
+	return ret;
+}
+
+//----------------------------------------------------------------------
+
+void IRFunction::compact ()
+{
+	for (auto & b : m_blocks)
+	{
+		if (b.dead)
+		{
+			b.code.clear ();
+			b.preds.clear ();
+			continue;
+		}
+		b.code.erase (std::remove_if(b.code.begin(), b.code.end(), [this] (ValueID v) {return m_values[v].dead;}), b.code.end());
+	}
+}
+
+//----------------------------------------------------------------------
+
+void IRFunction::removePred (BlockID b, BlockID pred)
+{
+	auto & block = m_blocks[b];
+	auto const i = std::find(block.preds.begin(), block.preds.end(), pred) - block.preds.begin();
+	if (size_t(i) >= block.preds.size())
+		return;
+
+	block.preds.erase (block.preds.begin() + i);
+	for (auto v : block.code)
+	{
+		auto & ins = m_values[v];
+		if (ins.op == IROp::Phi && !ins.dead)
+			ins.operands.erase (ins.operands.begin() + i);
+	}
+}
+
+//----------------------------------------------------------------------
+
+uint32_t IRFunction::rewriteOperands (std::vector<ValueID> const & map)
+{
+	uint32_t ret = 0;
+	for (auto & ins : m_values)
+		if (!ins.dead)
+			for (auto & o : ins.operands)
+			{
+				auto v = o;
+				while (v < map.size() && NoValue != map[v] && map[v] != v)
+					v = map[v];
+				if (v != o)
+				{
+					o = v;
+					ret += 1;
+				}
+			}
+	return ret;
+}
+
+//----------------------------------------------------------------------
+// Cooper, Harvey and Kennedy, "A Simple, Fast Dominance Algorithm".
+
+void IRFunction::computeDominators (std::vector<BlockID> & out_rpo, std::vector<BlockID> & out_idom) const
+{
+	auto const n = m_blocks.size();
+	out_rpo.clear ();
+	out_idom.assign (n, NoBlock);
+
+	// Postorder, iteratively. The successors are visited last one first,
+	// so that in the reverse postorder a branch's first target tends to
+	// come right after it (which is how the emitter lays blocks out.)
+	std::vector<uint8_t> visited (n, 0);
+	std::vector<std::pair<BlockID, int>> stack;
+	stack.push_back ({0, 0});
+	visited[0] = 1;
+	while (!stack.empty())
+	{
+		auto & top = stack.back();
+		BlockID succs [2];
+		auto const count = successors(top.first, succs);
+		if (top.second < count)
+		{
+			auto const s = succs[count - 1 - top.second++];
+			if (!visited[s])
+			{
+				visited[s] = 1;
+				stack.push_back ({s, 0});
+			}
+		}
+		else
+		{
+			out_rpo.push_back (top.first);
+			stack.pop_back ();
+		}
+	}
+	std::reverse (out_rpo.begin(), out_rpo.end());
+
+	std::vector<uint32_t> order (n, 0xFFFFFFFFU);
+	for (uint32_t i = 0; i < out_rpo.size(); ++i)
+		order[out_rpo[i]] = i;
+
+	out_idom[0] = 0;
+	for (bool changed = true; changed; )
+	{
+		changed = false;
+		for (size_t i = 1; i < out_rpo.size(); ++i)
+		{
+			auto const b = out_rpo[i];
+			BlockID new_idom = NoBlock;
+			for (auto p : m_blocks[b].preds)
+			{
+				if (NoBlock == out_idom[p] || 0xFFFFFFFFU == order[p])
+					continue;
+				if (NoBlock == new_idom)
+				{
+					new_idom = p;
+					continue;
+				}
+				auto x = p, y = new_idom;
+				while (x != y)
+				{
+					while (order[x] > order[y]) x = out_idom[x];
+					while (order[y] > order[x]) y = out_idom[y];
+				}
+				new_idom = x;
+			}
+			if (new_idom != out_idom[b])
+			{
+				out_idom[b] = new_idom;
+				changed = true;
+			}
+		}
+	}
+	out_idom[0] = NoBlock;
+}
+
+//----------------------------------------------------------------------
+
+bool IRFunction::verify (std::string & out_error) const
+{
+	char msg [160];
+	#define IR_FAIL(...)	do { snprintf (msg, sizeof(msg), __VA_ARGS__); out_error = m_name + ": " + msg; return false; } while (false)
+
+	for (BlockID b = 0; b < m_blocks.size(); ++b)
+	{
+		auto const & block = m_blocks[b];
+		if (block.dead)
+			continue;
+		if (block.code.empty())
+			IR_FAIL ("block %u is empty", unsigned(b));
+		if (0 == b && !block.preds.empty())
+			IR_FAIL ("the entry block has predecessors");
+
+		bool phis = true;
+		for (size_t i = 0; i < block.code.size(); ++i)
+		{
+			auto const v = block.code[i];
+			auto const & ins = m_values[v];
+			if (ins.dead)
+				continue;
+			if (ins.block != b)
+				IR_FAIL ("v%u is in block %u but says %u", unsigned(v), unsigned(b), unsigned(ins.block));
+
+			auto const is_jump = IROpKind(ins.op) == IRKind::Jump;
+			if (is_jump != (i + 1 == block.code.size()))
+				IR_FAIL ("block %u doesn't end in exactly one jump", unsigned(b));
+
+			if (ins.op == IROp::Phi)
+			{
+				if (!phis)
+					IR_FAIL ("phi v%u after other instructions", unsigned(v));
+				if (ins.operands.size() != block.preds.size())
+					IR_FAIL ("phi v%u has %u operands for %u predecessors", unsigned(v), unsigned(ins.operands.size()), unsigned(block.preds.size()));
+			}
+			else if (ins.op != IROp::Copy)		// A phi found to be trivial may linger as a copy
+				phis = false;
+
+			auto const n = IROpOperands(ins.op);
+			if (n >= 0 && size_t(n) != ins.operands.size())
+				IR_FAIL ("v%u (%s) has %u operands", unsigned(v), IROpName(ins.op), unsigned(ins.operands.size()));
+			if (ins.op == IROp::Bulk && (ins.aux > 0xFF || !VM::IsValidBulk(uint8_t(ins.aux)) ||
+					ins.operands.size() != size_t(VM::BulkOperands(VM::BulkFormOf(uint8_t(ins.aux))))))
+				IR_FAIL ("v%u is a bad bulk operation", unsigned(v));
+			if (ins.op == IROp::Io && (ins.aux > 0xFF || int(ins.operands.size()) != VM::IoOperands(uint8_t(ins.aux))))
+				IR_FAIL ("v%u is a bad I/O operation", unsigned(v));
+
+			for (auto o : ins.operands)
+				if (NoValue == o || o >= m_values.size() || m_values[o].dead)
+					IR_FAIL ("v%u uses missing or dead v%u", unsigned(v), unsigned(o));
+		}
+
+		BlockID succs [2];
+		auto const count = successors(b, succs);
+		for (int s = 0; s < count; ++s)
+		{
+			if (succs[s] >= m_blocks.size() || m_blocks[succs[s]].dead)
+				IR_FAIL ("block %u jumps to a missing block", unsigned(b));
+			auto const & preds = m_blocks[succs[s]].preds;
+			if (std::count(preds.begin(), preds.end(), b) != 1)
+				IR_FAIL ("block %u isn't listed once as a predecessor of %u", unsigned(b), unsigned(succs[s]));
+		}
+		for (auto p : block.preds)
+		{
+			BlockID ps [2];
+			auto const pc = successors(p, ps);
+			if (m_blocks[p].dead || std::find(ps, ps + pc, b) == ps + pc)
+				IR_FAIL ("block %u lists %u, which doesn't jump to it, as a predecessor", unsigned(b), unsigned(p));
+		}
+	}
+
+	#undef IR_FAIL
+	return true;
+}
+
+//----------------------------------------------------------------------
+
+String IRFunction::print (Type::STContainer const & types) const
+{
+	#define TAG_NAME(v,e,s,b,sc,co,cl,ca)	s,
+	static char const * const sc_TagNames [] = { UPL_PRIVATE__TYPE_TAGS(TAG_NAME) };
+	#undef  TAG_NAME
+
+	char line [160];
+	snprintf (line, sizeof(line), "ir %s (%u params%s%s)\n", m_name.c_str(), unsigned(m_param_types.size()),
+		(m_flags & VM::Function::msc_Pure) ? ", pure" : "", (m_flags & VM::Function::msc_Memoize) ? ", memoize" : "");
+	String ret = ToString<char const *>(line);
+
+	for (BlockID b = 0; b < m_blocks.size(); ++b)
+	{
+		auto const & block = m_blocks[b];
+		if (block.dead)
+			continue;
+
+		int n = snprintf (line, sizeof(line), " b%u:", unsigned(b));
+		if (!block.preds.empty())
+		{
+			n += snprintf (line + n, sizeof(line) - n, "\t; preds");
+			for (auto p : block.preds)
+				if (n < int(sizeof(line)) - 12)
+					n += snprintf (line + n, sizeof(line) - n, " b%u", unsigned(p));
+		}
+		ret += ToString<char const *>(line);
+		ret += L"\n";
+
+		for (auto v : block.code)
+		{
+			auto const & ins = m_values[v];
+			if (ins.dead)
+				continue;
+
+			n = 0;
+			if (0 != ins.type)
+				n = snprintf (line, sizeof(line), "  v%-4u %-6s = ", unsigned(v), sc_TagNames[int(types.tag(ins.type))]);
+			else
+				n = snprintf (line, sizeof(line), "  %16s", "");
+			n += snprintf (line + n, sizeof(line) - n, "%s", IROpName(ins.op));
+
+			switch (ins.op)
+			{
+			case IROp::Const:
+				if (RegKindOf(types, ins.type) == RegKind::Real)
+					n += snprintf (line + n, sizeof(line) - n, " %g", ins.number.r);
+				else
+					n += snprintf (line + n, sizeof(line) - n, " %lld", static_cast<long long>(ins.number.i));
+				break;
+			case IROp::Param:
+			case IROp::Func:
+			case IROp::Global:
+			case IROp::New:
+			case IROp::GetF:
+			case IROp::SetF:
+				n += snprintf (line + n, sizeof(line) - n, " #%u", unsigned(ins.aux));
+				break;
+			case IROp::Bulk:
+				n += snprintf (line + n, sizeof(line) - n, " %s", VM::BulkName(uint8_t(ins.aux)));
+				break;
+			case IROp::Io:
+				n += snprintf (line + n, sizeof(line) - n, " %s", VM::IoName(uint8_t(ins.aux)));
+				break;
+			case IROp::PMap:
+			case IROp::PReduce:
+				if (0 != ins.aux)
+					n += snprintf (line + n, sizeof(line) - n, " parallel");
+				break;
+			default:
+				break;
+			}
+
+			for (auto o : ins.operands)
+				if (n < int(sizeof(line)) - 12)
+					n += snprintf (line + n, sizeof(line) - n, " v%u", unsigned(o));
+
+			if (ins.op == IROp::Jmp)
+				snprintf (line + n, sizeof(line) - n, " b%u", unsigned(ins.targets[0]));
+			else if (ins.op == IROp::Br)
+				snprintf (line + n, sizeof(line) - n, " b%u b%u", unsigned(ins.targets[0]), unsigned(ins.targets[1]));
+
+			ret += ToString<char const *>(line);
+			ret += L"\n";
+		}
+	}
+
+	return ret;
+}
+
+//======================================================================
+
+IRBuilder::IRBuilder (IRFunction & function, Type::STContainer const & types)
+	: m_function (function)
+	, m_types (types)
+	, m_block (0)
+	, m_variable_types ()
+	, m_current_def ()
+	, m_sealed (function.blocks().size(), false)
+	, m_incomplete_phis ()
+	, m_params (function.paramTypes().size(), NoValue)
+{
+	// Nothing ever jumps to the entry.
+	m_sealed[0] = true;
+}
+
+//----------------------------------------------------------------------
+
+bool IRBuilder::isTerminated () const
+{
+	auto const t = m_function.terminator(m_block);
+	return NoValue != t && IROpKind(m_function[t].op) == IRKind::Jump;
+}
+
+//----------------------------------------------------------------------
+
+void IRBuilder::seal (BlockID b)
+{
+	if (m_sealed.size() < m_function.blocks().size())
+		m_sealed.resize (m_function.blocks().size(), false);
+	if (m_sealed[b])
+		return;
+
+	auto i = m_incomplete_phis.find(b);
+	if (i != m_incomplete_phis.end())
+	{
+		auto pending = std::move(i->second);
+		m_incomplete_phis.erase (i);
+		for (auto const & p : pending)
+			addPhiOperands (p.first, p.second);
+	}
+	m_sealed[b] = true;
+}
+
+//----------------------------------------------------------------------
+
+IRBuilder::Variable IRBuilder::newVariable (Type::ID type)
+{
+	m_variable_types.push_back (type);
+	return Variable(m_variable_types.size() - 1);
+}
+
+//----------------------------------------------------------------------
+
+ValueID IRBuilder::param (uint32_t index)
+{
+	assert (index < m_params.size());
+	if (NoValue == m_params[index])
+	{
+		// Always in the entry block, wherever it's asked for.
+		IRInstr ins;
+		ins.op = IROp::Param;
+		ins.type = m_function.paramTypes()[index];
+		ins.block = 0;
+		ins.aux = index;
+		auto const v = m_function.addInstr(std::move(ins));
+		auto & code = m_function.block(0).code;
+		auto at = code.begin();
+		while (at != code.end() && m_function[*at].op == IROp::Param)
+			++at;
+		code.insert (at, v);
+		m_params[index] = v;
+	}
+	return m_params[index];
+}
+
+//----------------------------------------------------------------------
+
+ValueID IRBuilder::constInt (Int v, Type::ID type)
+{
+	return constant(0 == type ? Type::STContainer::DefaultID(Type::Tag::Int) : type, VM::Reg::FromInt(v));
+}
+
+//----------------------------------------------------------------------
+
+ValueID IRBuilder::constReal (Real v)
+{
+	return constant(Type::STContainer::DefaultID(Type::Tag::Real), VM::Reg::FromReal(v));
+}
+
+//----------------------------------------------------------------------
+
+ValueID IRBuilder::constBool (Bool v)
+{
+	return constant(Type::STContainer::DefaultID(Type::Tag::Bool), VM::Reg::FromBool(v));
+}
+
+//----------------------------------------------------------------------
+
+ValueID IRBuilder::constNil ()
+{
+	return constant(Type::STContainer::DefaultID(Type::Tag::Nil), VM::Reg::Nil());
+}
+
+//----------------------------------------------------------------------
+
+ValueID IRBuilder::functionRef (uint32_t index, Type::ID type)
+{
+	return emit(IROp::Func, type, {}, index);
+}
+
+//----------------------------------------------------------------------
+
+ValueID IRBuilder::global (uint32_t index, Type::ID type)
+{
+	return emit(IROp::Global, type, {}, index);
+}
+
+//----------------------------------------------------------------------
+
+ValueID IRBuilder::copy (ValueID v)
+{
+	return emit(IROp::Copy, m_function[v].type, {v});
+}
+
+//----------------------------------------------------------------------
+
+ValueID IRBuilder::binary (BinaryOp op, ValueID a, ValueID b)
+{
+	static IROp const sc_Ops [] = {IROp::Add, IROp::Sub, IROp::Mul, IROp::Div, IROp::Mod, IROp::Eq, IROp::Lt, IROp::Le};
+
+	auto const type = (op >= BinaryOp::Eq)
+		? Type::STContainer::DefaultID(Type::Tag::Bool)
+		: m_function[a].type;
+	return emit(sc_Ops[int(op)], type, {a, b});
+}
+
+//----------------------------------------------------------------------
+
+ValueID IRBuilder::negate (ValueID a)
+{
+	return emit(IROp::Neg, m_function[a].type, {a});
+}
+
+//----------------------------------------------------------------------
+
+ValueID IRBuilder::logicalNot (ValueID a)
+{
+	return emit(IROp::Not, Type::STContainer::DefaultID(Type::Tag::Bool), {a});
+}
+
+//----------------------------------------------------------------------
+
+ValueID IRBuilder::toReal (ValueID a)
+{
+	return emit(IROp::IToR, Type::STContainer::DefaultID(Type::Tag::Real), {a});
+}
+
+//----------------------------------------------------------------------
+
+ValueID IRBuilder::toInt (ValueID a)
+{
+	return emit(IROp::RToI, Type::STContainer::DefaultID(Type::Tag::Int), {a});
+}
+
+//----------------------------------------------------------------------
+
+ValueID IRBuilder::box (ValueID a)
+{
+	return emit(IROp::Box, Type::STContainer::DefaultID(Type::Tag::Any), {a});
+}
+
+//----------------------------------------------------------------------
+
+ValueID IRBuilder::unbox (ValueID a, Type::ID type)
+{
+	return emit(IROp::Unbox, type, {a});
+}
+
+//----------------------------------------------------------------------
+
+ValueID IRBuilder::typeOf (ValueID a)
+{
+	return emit(IROp::TypeOf, Type::STContainer::DefaultID(Type::Tag::Int), {a});
+}
+
+//----------------------------------------------------------------------
+
+ValueID IRBuilder::newObject (Type::ID type)
+{
+	return emit(IROp::New, type, {}, type);
+}
+
+//----------------------------------------------------------------------
+
+ValueID IRBuilder::newArray (Type::ID type, ValueID count)
+{
+	return emit(IROp::NewN, type, {constInt(Int(type)), count});
+}
+
+//----------------------------------------------------------------------
+
+ValueID IRBuilder::getField (ValueID obj, uint32_t index, Type::ID type)
+{
+	return emit(IROp::GetF, type, {obj}, index);
+}
+
+//----------------------------------------------------------------------
+
+void IRBuilder::setField (ValueID obj, uint32_t index, ValueID v)
+{
+	emit (IROp::SetF, 0, {obj, v}, index);
+}
+
+//----------------------------------------------------------------------
+
+ValueID IRBuilder::getElement (ValueID obj, ValueID index, Type::ID type)
+{
+	return emit(IROp::GetE, type, {obj, index});
+}
+
+//----------------------------------------------------------------------
+
+void IRBuilder::setElement (ValueID obj, ValueID index, ValueID v)
+{
+	emit (IROp::SetE, 0, {obj, index, v});
+}
+
+//----------------------------------------------------------------------
+
+ValueID IRBuilder::length (ValueID obj)
+{
+	return emit(IROp::Len, Type::STContainer::DefaultID(Type::Tag::Int), {obj});
+}
+
+//----------------------------------------------------------------------
+
+ValueID IRBuilder::call (ValueID callee, std::vector<ValueID> const & args, Type::ID result_type)
+{
+	std::vector<ValueID> operands (1, callee);
+	operands.insert (operands.end(), args.begin(), args.end());
+	return emit(IROp::Call, result_type, std::move(operands));
+}
+
+//----------------------------------------------------------------------
+
+ValueID IRBuilder::bulk (uint8_t code, std::vector<ValueID> operands, Type::ID result_type)
+{
+	return emit(IROp::Bulk, result_type, std::move(operands), code);
+}
+
+//----------------------------------------------------------------------
+
+ValueID IRBuilder::io (uint8_t code, std::vector<ValueID> operands, Type::ID result_type)
+{
+	return emit(IROp::Io, result_type, std::move(operands), code);
+}
+
+//----------------------------------------------------------------------
+
+ValueID IRBuilder::parallelMap (Type::ID type, ValueID func, ValueID vec)
+{
+	return emit(IROp::PMap, type, {constInt(Int(type)), func, vec});
+}
+
+//----------------------------------------------------------------------
+
+ValueID IRBuilder::parallelReduce (ValueID func, ValueID init, ValueID vec, Type::ID result_type)
+{
+	return emit(IROp::PReduce, result_type, {func, init, vec});
+}
+
+//----------------------------------------------------------------------
+
+void IRBuilder::ret (ValueID v)
+{
+	if (NoValue == v)
+		emit (IROp::Ret, 0, {});
+	else
+		emit (IROp::Ret, 0, {v});
+}
+
+//----------------------------------------------------------------------
+
+void IRBuilder::jump (BlockID target)
+{
+	auto const j = emit(IROp::Jmp, 0, {});
+	m_function[j].targets[0] = target;
+	addEdge (m_block, target);
+}
+
+//----------------------------------------------------------------------
+
+void IRBuilder::branch (ValueID cond, BlockID if_true, BlockID if_false)
+{
+	if (if_true == if_false)
+	{
+		jump (if_true);
+		return;
+	}
+
+	auto const j = emit(IROp::Br, 0, {cond});
+	m_function[j].targets[0] = if_true;
+	m_function[j].targets[1] = if_false;
+	addEdge (m_block, if_true);
+	addEdge (m_block, if_false);
+}
+
+//----------------------------------------------------------------------
+
+ValueID IRBuilder::emit (IROp op, Type::ID type, std::vector<ValueID> operands, uint32_t aux)
+{
+	assert (!isTerminated());
+
+	IRInstr ins;
+	ins.op = op;
+	ins.type = type;
+	ins.block = m_block;
+	ins.aux = aux;
+	ins.operands = std::move(operands);
+	auto const v = m_function.addInstr(std::move(ins));
+	m_function.block(m_block).code.push_back (v);
+	return v;
+}
+
+//----------------------------------------------------------------------
+
+ValueID IRBuilder::constant (Type::ID type, VM::Reg number)
+{
+	auto const v = emit(IROp::Const, type, {});
+	m_function[v].number = number;
+	return v;
+}
+
+//----------------------------------------------------------------------
+
+void IRBuilder::addEdge (BlockID from, BlockID to)
+{
+	assert (to >= m_sealed.size() || !m_sealed[to]);
+	m_function.block(to).preds.push_back (from);
+}
+
+//----------------------------------------------------------------------
+
+void IRBuilder::writeVariable (Variable var, BlockID b, ValueID v)
+{
+	m_current_def[Key(var, b)] = v;
+}
+
+//----------------------------------------------------------------------
+
+ValueID IRBuilder::readVariable (Variable var, BlockID b)
+{
+	auto i = m_current_def.find(Key(var, b));
+	if (i != m_current_def.end())
+		return i->second;
+
+	if (m_sealed.size() < m_function.blocks().size())
+		m_sealed.resize (m_function.blocks().size(), false);
+
+	ValueID v;
+	auto const & preds = m_function.block(b).preds;
+	if (!m_sealed[b])
+	{
+		v = newPhi(b, m_variable_types[var]);
+		m_incomplete_phis[b].push_back ({var, v});
+	}
+	else if (preds.empty())
+	{
+		// Read before any assignment: the zero of its type, at the top of the entry.
+		IRInstr ins;
+		ins.op = IROp::Const;
+		ins.type = m_variable_types[var];
+		ins.block = 0;
+		v = m_function.addInstr(std::move(ins));
+		auto & code = m_function.block(0).code;
+		auto at = code.begin();
+		while (at != code.end() && m_function[*at].op == IROp::Param)
+			++at;
+		code.insert (at, v);
+	}
+	else if (preds.size() == 1)
+		v = readVariable(var, preds[0]);
+	else
+	{
+		v = newPhi(b, m_variable_types[var]);
+		writeVariable (var, b, v);	// Breaks cycles
+		v = addPhiOperands(var, v);
+	}
+
+	writeVariable (var, b, v);
+	return v;
+}
+
+//----------------------------------------------------------------------
+
+ValueID IRBuilder::newPhi (BlockID b, Type::ID type)
+{
+	IRInstr ins;
+	ins.op = IROp::Phi;
+	ins.type = type;
+	ins.block = b;
+	auto const v = m_function.addInstr(std::move(ins));
+
+	auto & code = m_function.block(b).code;
+	auto at = code.begin();
+	while (at != code.end() && m_function[*at].op == IROp::Phi)
+		++at;
+	code.insert (at, v);
+	return v;
+}
+
+//----------------------------------------------------------------------
+
+ValueID IRBuilder::addPhiOperands (Variable var, ValueID phi)
+{
+	auto const b = m_function[phi].block;
+	auto const preds = m_function.block(b).preds;		// A copy; reading may add blocks
+	for (auto p : preds)
+	{
+		auto const v = readVariable(var, p);
+		m_function[phi].operands.push_back (v);
+	}
+	return tryRemoveTrivialPhi(phi);
+}
+
+//----------------------------------------------------------------------
+// A phi whose operands are all the same value (or itself) is just that
+// value. It stays in place as a copy (it may already have users), so it
+// has to stay among the phis, which is fine for the emitter: all the
+// phis of a block are in place on entry, before the copy is done.
+
+ValueID IRBuilder::tryRemoveTrivialPhi (ValueID phi)
+{
+	ValueID same = NoValue;
+	for (auto o : m_function[phi].operands)
+	{
+		if (o == same || o == phi)
+			continue;
+		if (NoValue != same)
+			return phi;
+		same = o;
+	}
+	if (NoValue == same)
+		return phi;		// Unreachable, or only ever reads itself; leave it
+
+	auto & ins = m_function[phi];
+	ins.op = IROp::Copy;
+	ins.operands.assign (1, same);
+	return same;
+}
+
+//----------------------------------------------------------------------
+//======================================================================
+
+	}	// namespace CodeGen
+}	// namespace UPL
+
+//======================================================================
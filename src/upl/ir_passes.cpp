@@ -0,0 +1,2203 @@
+//======================================================================
+
+#include <upl/ir_passes.hpp>
+#include <upl/bulk.hpp>
+#include <upl/code_gen.hpp>
+#include <upl/parallel.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <map>
+#include <string>
+#include <unordered_map>
+
+//======================================================================
+
+namespace UPL {
+	namespace CodeGen {
+
+//======================================================================
+
+static inline ValueID Resolve (std::vector<ValueID> const & map, ValueID v)
+{
+	while (NoValue != map[v])
+		v = map[v];
+	return v;
+}
+
+//----------------------------------------------------------------------
+
+uint32_t PropagateCopies (IRFunction & f)
+{
+	auto & values = f.values();
+	std::vector<ValueID> map (values.size(), NoValue);
+	uint32_t ret = 0;
+
+	for (bool changed = true; changed; )
+	{
+		changed = false;
+		for (ValueID v = 1; v < values.size(); ++v)
+		{
+			auto & ins = values[v];
+			if (ins.dead)
+				continue;
+
+			ValueID same = NoValue;
+			if (ins.op == IROp::Copy)
+				same = Resolve(map, ins.operands[0]);
+			else if (ins.op == IROp::Phi)
+			{
+				for (auto o : ins.operands)
+				{
+					o = Resolve(map, o);
+					if (o == v || o == same)
+						continue;
+					if (NoValue != same)
+					{
+						same = NoValue;
+						break;
+					}
+					same = o;
+				}
+			}
+
+			if (NoValue == same || same == v)
+				continue;
+
+			map[v] = same;
+			ins.dead = true;
+			ret += 1;
+			changed = true;
+		}
+	}
+
+	if (ret > 0)
+		f.rewriteOperands (map);
+	return ret;
+}
+
+//======================================================================
+
+namespace {
+
+//----------------------------------------------------------------------
+
+bool IsConst (IRFunction const & f, ValueID v)
+{
+	return f[v].op == IROp::Const;
+}
+
+//----------------------------------------------------------------------
+
+bool IsConstInt (IRFunction const & f, Type::STContainer const & types, ValueID v, Int value)
+{
+	return IsConst(f, v) && RegKindOf(types, f[v].type) == RegKind::Int && f[v].number.i == value;
+}
+
+//----------------------------------------------------------------------
+
+void MakeConst (IRInstr & ins, VM::Reg number)
+{
+	ins.op = IROp::Const;
+	ins.operands.clear ();
+	ins.number = number;
+	ins.aux = 0;
+}
+
+//----------------------------------------------------------------------
+
+void MakeCopy (IRInstr & ins, ValueID of)
+{
+	ins.op = IROp::Copy;
+	ins.operands.assign (1, of);
+	ins.aux = 0;
+}
+
+//----------------------------------------------------------------------
+// Evaluates "ins" if all of its operands are constants. Returns false if
+// it can't (or shouldn't) be done at compile time.
+
+bool Evaluate (IRFunction const & f, Type::STContainer const & types, IRInstr const & ins, VM::Reg & out)
+{
+	for (auto o : ins.operands)
+		if (!IsConst(f, o))
+			return false;
+
+	auto const arg_kind = ins.operands.empty() ? RegKind::None : RegKindOf(types, f[ins.operands[0]].type);
+	auto const a = ins.operands.size() > 0 ? f[ins.operands[0]].number : VM::Reg::Nil();
+	auto const b = ins.operands.size() > 1 ? f[ins.operands[1]].number : VM::Reg::Nil();
+	auto const is_int = arg_kind == RegKind::Int;
+	auto const is_real = arg_kind == RegKind::Real;
+
+	switch (ins.op)
+	{
+	case IROp::Add:
+		if (is_int)  {out = VM::Reg::FromInt(VM::WrapAdd(a.i, b.i)); return true;}
+		if (is_real) {out = VM::Reg::FromReal(a.r + b.r); return true;}
+		return false;
+	case IROp::Sub:
+		if (is_int)  {out = VM::Reg::FromInt(VM::WrapSub(a.i, b.i)); return true;}
+		if (is_real) {out = VM::Reg::FromReal(a.r - b.r); return true;}
+		return false;
+	case IROp::Mul:
+		if (is_int)  {out = VM::Reg::FromInt(VM::WrapMul(a.i, b.i)); return true;}
+		if (is_real) {out = VM::Reg::FromReal(a.r * b.r); return true;}
+		return false;
+	case IROp::Div:
+		if (is_int && 0 != b.i) {out = VM::Reg::FromInt(VM::WrapDiv(a.i, b.i)); return true;}
+		if (is_real) {out = VM::Reg::FromReal(a.r / b.r); return true;}
+		return false;
+	case IROp::Mod:
+		if (is_int && 0 != b.i) {out = VM::Reg::FromInt(VM::WrapMod(a.i, b.i)); return true;}
+		return false;
+	case IROp::Eq:
+		if (is_int)  {out = VM::Reg::FromBool(a.i == b.i); return true;}
+		if (is_real) {out = VM::Reg::FromBool(a.r == b.r); return true;}
+		return false;
+	case IROp::Lt:
+		if (is_int)  {out = VM::Reg::FromBool(a.i < b.i); return true;}
+		if (is_real) {out = VM::Reg::FromBool(a.r < b.r); return true;}
+		return false;
+	case IROp::Le:
+		if (is_int)  {out = VM::Reg::FromBool(a.i <= b.i); return true;}
+		if (is_real) {out = VM::Reg::FromBool(a.r <= b.r); return true;}
+		return false;
+	case IROp::Neg:
+		if (types.tag(f[ins.operands[0]].type) == Type::Tag::Bool) {out = VM::Reg::FromBool(0 == a.i); return true;}
+		if (is_int)  {out = VM::Reg::FromInt(VM::WrapNeg(a.i)); return true;}
+		if (is_real) {out = VM::Reg::FromReal(-a.r); return true;}
+		return false;
+	case IROp::Not:
+		if (is_int)  {out = VM::Reg::FromBool(0 == a.i); return true;}
+		return false;
+	case IROp::IToR:
+		if (is_int)  {out = VM::Reg::FromReal(Real(a.i)); return true;}
+		return false;
+	case IROp::RToI:
+		if (is_real) {out = VM::Reg::FromInt(VM::RealToInt(a.r)); return true;}
+		return false;
+	case IROp::Box:
+		// Only what doesn't need the heap
+		switch (types.tag(f[ins.operands[0]].type))
+		{
+		case Type::Tag::Nil:	out = VM::Reg::FromValue(VM::Value::Nil()); return true;
+		case Type::Tag::Bool:	out = VM::Reg::FromValue(VM::Value::FromBool(0 != a.i)); return true;
+		case Type::Tag::Byte:	out = VM::Reg::FromValue(VM::Value::FromByte(uint8_t(a.i))); return true;
+		case Type::Tag::Char:	out = VM::Reg::FromValue(VM::Value::FromChar(Char(a.i))); return true;
+		case Type::Tag::Real:	out = VM::Reg::FromValue(VM::Value::FromReal(a.r)); return true;
+		case Type::Tag::Int:
+			if (!VM::Value::IntFitsInline(a.i))
+				return false;
+			out = VM::Reg::FromValue(VM::Value::FromInlineInt(a.i));
+			return true;
+		default:
+			return false;
+		}
+	case IROp::Unbox:
+	{
+		auto const val = a.value();
+		switch (types.tag(ins.type))
+		{
+		case Type::Tag::Nil:	if (!val.isNil()) return false; out = VM::Reg::Nil(); return true;
+		case Type::Tag::Bool:	if (val.kind() != VM::Value::Kind::Bool) return false; out = VM::Reg::FromBool(val.asBool()); return true;
+		case Type::Tag::Byte:	if (val.kind() != VM::Value::Kind::Byte) return false; out = VM::Reg::FromInt(val.asByte()); return true;
+		case Type::Tag::Char:	if (val.kind() != VM::Value::Kind::Char) return false; out = VM::Reg::FromInt(Int(val.asChar())); return true;
+		case Type::Tag::Int:	if (val.kind() != VM::Value::Kind::Int) return false; out = VM::Reg::FromInt(val.asInt()); return true;
+		case Type::Tag::Real:	if (!val.isReal()) return false; out = VM::Reg::FromReal(val.asReal()); return true;
+		default:				return false;
+		}
+	}
+	case IROp::TypeOf:
+		if (a.value().isObject())
+			return false;
+		out = VM::Reg::FromInt(Int(a.value().typeID()));
+		return true;
+	default:
+		return false;
+	}
+}
+
+//----------------------------------------------------------------------
+// The type of a boxed scalar is known even if its value isn't (a big int
+// is boxed on the heap, but still as an Int.)
+
+bool TypeOfBoxed (IRFunction const & f, Type::STContainer const & types, IRInstr const & ins, VM::Reg & out)
+{
+	if (ins.op != IROp::TypeOf || f[ins.operands[0]].op != IROp::Box)
+		return false;
+
+	auto const tag = types.tag(f[f[ins.operands[0]].operands[0]].type);
+	switch (tag)
+	{
+	case Type::Tag::Nil: case Type::Tag::Bool: case Type::Tag::Byte: case Type::Tag::Char:
+	case Type::Tag::Int: case Type::Tag::Real:
+		break;
+	default:
+		return false;
+	}
+
+	out = VM::Reg::FromInt(Int(Type::STContainer::DefaultID(tag)));
+	return true;
+}
+
+//----------------------------------------------------------------------
+// The identities that don't need all the operands to be constant. Returns
+// the value "ins" is equal to, or NoValue.
+
+ValueID Simplify (IRFunction const & f, Type::STContainer const & types, IRInstr const & ins)
+{
+	if (ins.operands.empty())
+		return NoValue;
+
+	auto const x = ins.operands[0];
+	auto const y = ins.operands.size() > 1 ? ins.operands[1] : NoValue;
+
+	switch (ins.op)
+	{
+	case IROp::Add:
+		if (IsConstInt(f, types, y, 0)) return x;
+		if (IsConstInt(f, types, x, 0)) return y;
+		return NoValue;
+	case IROp::Sub:
+		return IsConstInt(f, types, y, 0) ? x : NoValue;
+	case IROp::Mul:
+		if (IsConstInt(f, types, y, 1)) return x;
+		if (IsConstInt(f, types, x, 1)) return y;
+		return NoValue;
+	case IROp::Div:
+		return IsConstInt(f, types, y, 1) ? x : NoValue;
+	case IROp::Neg:
+	case IROp::Not:
+		// Double negation; for ints, Not gives a bool, so only for bools.
+		if (f[x].op == ins.op && f[f[x].operands[0]].type == ins.type)
+			return f[x].operands[0];
+		return NoValue;
+	case IROp::Unbox:
+		if (f[x].op == IROp::Box && f[f[x].operands[0]].type == ins.type)
+			return f[x].operands[0];
+		return NoValue;
+	default:
+		return NoValue;
+	}
+}
+
+//----------------------------------------------------------------------
+
+}	// namespace
+
+//======================================================================
+
+uint32_t FoldConstants (IRFunction & f, Type::STContainer const & types)
+{
+	std::vector<BlockID> rpo, idom;
+	f.computeDominators (rpo, idom);
+
+	uint32_t ret = 0;
+	for (auto b : rpo)
+	{
+		for (auto v : f.block(b).code)
+		{
+			auto & ins = f[v];
+			if (ins.dead)
+				continue;
+
+			if (ins.op == IROp::Phi)
+			{
+				// All the same constant: stays among the phis as a copy.
+				bool same = !ins.operands.empty();
+				for (auto o : ins.operands)
+					same = same && IsConst(f, o) && f[o].type == f[ins.operands[0]].type && f[o].number.u == f[ins.operands[0]].number.u;
+				if (same && ins.operands[0] != v)
+				{
+					MakeCopy (ins, ins.operands[0]);
+					ret += 1;
+				}
+				continue;
+			}
+
+			if (ins.op == IROp::Br)
+			{
+				auto const cond = ins.operands[0];
+				if (!IsConst(f, cond))
+					continue;
+				auto const taken = ins.targets[0 != f[cond].number.i ? 0 : 1];
+				auto const dropped = ins.targets[0 != f[cond].number.i ? 1 : 0];
+				ins.op = IROp::Jmp;
+				ins.operands.clear ();
+				ins.targets[0] = taken;
+				ins.targets[1] = NoBlock;
+				f.removePred (dropped, b);
+				ret += 1;
+				continue;
+			}
+
+			VM::Reg number;
+			if (Evaluate(f, types, ins, number) || TypeOfBoxed(f, types, ins, number))
+			{
+				MakeConst (ins, number);
+				ret += 1;
+				continue;
+			}
+
+			auto const same = Simplify(f, types, ins);
+			if (NoValue != same)
+			{
+				MakeCopy (ins, same);
+				ret += 1;
+			}
+		}
+	}
+
+	return ret + RemoveUnreachableBlocks(f);
+}
+
+//======================================================================
+
+namespace {
+
+//----------------------------------------------------------------------
+// What makes two instructions the same computation, as bytes.
+
+std::string CSEKey (IRInstr const & ins)
+{
+	std::string key;
+	auto put = [&key] (void const * p, size_t n) {key.append (static_cast<char const *>(p), n);};
+
+	put (&ins.op, sizeof(ins.op));
+	put (&ins.type, sizeof(ins.type));
+	put (&ins.aux, sizeof(ins.aux));
+	if (ins.op == IROp::Const)
+		put (&ins.number.u, sizeof(ins.number.u));
+
+	auto operands = ins.operands;
+	if (operands.size() == 2 && (ins.op == IROp::Add || ins.op == IROp::Mul || ins.op == IROp::Eq))
+		if (operands[0] > operands[1])
+			std::swap (operands[0], operands[1]);
+	for (auto o : operands)
+		put (&o, sizeof(o));
+	return key;
+}
+
+//----------------------------------------------------------------------
+
+bool IsShareable (IRInstr const & ins)
+{
+	auto const kind = IROpKind(ins.op);
+	if (kind != IRKind::Pure && kind != IRKind::Traps)
+		return false;
+	return ins.op != IROp::Phi && ins.op != IROp::Copy && ins.op != IROp::Param;
+}
+
+//----------------------------------------------------------------------
+
+}	// namespace
+
+//----------------------------------------------------------------------
+// A walk over the dominator tree with a scoped table: whatever is in the
+// table when a block is visited was computed in one of its dominators.
+
+uint32_t EliminateCommonSubexpressions (IRFunction & f)
+{
+	std::vector<BlockID> rpo, idom;
+	f.computeDominators (rpo, idom);
+
+	auto const block_count = f.blocks().size();
+	std::vector<std::vector<BlockID>> children (block_count);
+	for (auto b : rpo)
+		if (NoBlock != idom[b])
+			children[idom[b]].push_back (b);
+
+	std::vector<ValueID> map (f.values().size(), NoValue);
+	std::unordered_map<std::string, ValueID> available;
+	std::vector<std::string> scope;		// Keys added, in order
+	std::vector<std::pair<BlockID, size_t>> stack;	// Block, and the scope size before it (or SIZE_MAX to enter)
+	uint32_t ret = 0;
+
+	stack.push_back ({0, SIZE_MAX});
+	while (!stack.empty())
+	{
+		auto const b = stack.back().first;
+		auto const mark = stack.back().second;
+		stack.pop_back ();
+
+		if (SIZE_MAX != mark)
+		{
+			// Leaving b
+			while (scope.size() > mark)
+			{
+				available.erase (scope.back());
+				scope.pop_back ();
+			}
+			continue;
+		}
+
+		stack.push_back ({b, scope.size()});
+		for (auto v : f.block(b).code)
+		{
+			auto & ins = f[v];
+			if (ins.dead || !IsShareable(ins))
+				continue;
+			for (auto & o : ins.operands)
+				o = Resolve(map, o);
+
+			auto key = CSEKey(ins);
+			auto i = available.find(key);
+			if (i != available.end())
+			{
+				map[v] = i->second;
+				ins.dead = true;
+				ret += 1;
+			}
+			else
+			{
+				available.emplace (key, v);
+				scope.push_back (std::move(key));
+			}
+		}
+		for (auto c : children[b])
+			stack.push_back ({c, SIZE_MAX});
+	}
+
+	if (ret > 0)
+		f.rewriteOperands (map);
+	return ret;
+}
+
+//======================================================================
+
+uint32_t EliminateDeadCode (IRFunction & f)
+{
+	auto & values = f.values();
+	std::vector<uint8_t> live (values.size(), 0);
+	std::vector<ValueID> work;
+
+	for (auto const & block : f.blocks())
+	{
+		if (block.dead)
+			continue;
+		for (auto v : block.code)
+		{
+			auto const & ins = values[v];
+			if (ins.dead)
+				continue;
+
+			bool needed;
+			switch (IROpKind(ins.op))
+			{
+			case IRKind::Pure:	needed = false; break;
+			// A division is only known not to fail by a constant, non-zero divisor.
+			case IRKind::Traps:	needed = !(values[ins.operands[1]].op == IROp::Const && 0 != values[ins.operands[1]].number.i); break;
+			default:			needed = true; break;
+			}
+			if (needed)
+			{
+				live[v] = 1;
+				work.push_back (v);
+			}
+		}
+	}
+
+	while (!work.empty())
+	{
+		auto const v = work.back();
+		work.pop_back ();
+		for (auto o : values[v].operands)
+			if (!live[o])
+			{
+				live[o] = 1;
+				work.push_back (o);
+			}
+	}
+
+	uint32_t ret = 0;
+	for (auto const & block : f.blocks())
+		if (!block.dead)
+			for (auto v : block.code)
+				if (!values[v].dead && !live[v])
+				{
+					values[v].dead = true;
+					ret += 1;
+				}
+	return ret;
+}
+
+//======================================================================
+
+namespace {
+
+//----------------------------------------------------------------------
+// The field types that can live in a register just as well: scalars, and
+// references (which start out as nil.)
+
+bool IsReplaceableField (Type::STContainer const & types, Type::ID type, VM::Reg & out_initial)
+{
+	switch (types.tag(type))
+	{
+	case Type::Tag::Bool: case Type::Tag::Byte: case Type::Tag::Char: case Type::Tag::Int: case Type::Tag::Real:
+		out_initial = VM::Reg::FromInt(0);
+		return true;
+	case Type::Tag::String: case Type::Tag::Vector: case Type::Tag::Map:
+		out_initial = VM::Reg::FromValue(VM::Value::Nil());
+		return true;
+	default:
+		return false;
+	}
+}
+
+//----------------------------------------------------------------------
+// Where "obj" is the object operand of each of its users, and the field
+// (or constant index) is within it. Anything else (being stored, passed,
+// returned, boxed, merged by a phi, indexed by a variable, ...) lets it
+// escape.
+
+bool DoesNotEscape (IRFunction const & f, ValueID obj, std::vector<ValueID> const & users, uint32_t field_count)
+{
+	for (auto u : users)
+	{
+		auto const & ins = f[u];
+		if (ins.dead || ins.operands[0] != obj || std::count(ins.operands.begin(), ins.operands.end(), obj) != 1)
+			return false;
+
+		switch (ins.op)
+		{
+		case IROp::GetF:
+		case IROp::SetF:
+			if (ins.aux >= field_count)
+				return false;
+			break;
+		case IROp::GetE:
+		case IROp::SetE:
+		{
+			auto const & index = f[ins.operands[1]];
+			if (index.op != IROp::Const || index.number.i < 0 || index.number.i >= Int(field_count))
+				return false;
+			break;
+		}
+		case IROp::Len:
+			break;
+		default:
+			return false;
+		}
+	}
+	return true;
+}
+
+//----------------------------------------------------------------------
+// Turns the fields of "obj" into SSA values: a phi per field wherever
+// paths join below its allocation (the trivial ones are removed later),
+// the loads into copies of the current values and the stores into nothing.
+
+void ReplaceWithScalars (IRFunction & f, ValueID obj, std::vector<Type::ID> const & field_types,
+	std::vector<VM::Reg> const & initial, std::vector<BlockID> const & rpo, std::vector<BlockID> const & idom)
+{
+	auto const home = f[obj].block;
+	auto const n = field_types.size();
+
+	auto dominated = [&] (BlockID b) {
+		while (NoBlock != b && b != home)
+			b = idom[b];
+		return b == home;
+	};
+
+	// The initial values, where the object was allocated.
+	std::vector<ValueID> current (n);
+	{
+		auto & code = f.block(home).code;
+		auto at = std::find(code.begin(), code.end(), obj) - code.begin();
+		for (size_t i = 0; i < n; ++i)
+		{
+			IRInstr k;
+			k.op = IROp::Const;
+			k.type = field_types[i];
+			k.block = home;
+			k.number = initial[i];
+			current[i] = f.addInstr(std::move(k));
+			code.insert (code.begin() + at + i, current[i]);
+		}
+	}
+
+	std::unordered_map<BlockID, std::vector<ValueID>> phis;
+	for (auto b : rpo)
+		if (b != home && f.block(b).preds.size() > 1 && dominated(b))
+		{
+			auto & ps = phis[b];
+			for (size_t i = 0; i < n; ++i)
+			{
+				IRInstr phi;
+				phi.op = IROp::Phi;
+				phi.type = field_types[i];
+				phi.block = b;
+				phi.operands.assign (f.block(b).preds.size(), NoValue);
+				ps.push_back (f.addInstr(std::move(phi)));
+			}
+			auto & code = f.block(b).code;
+			code.insert (code.begin(), ps.begin(), ps.end());
+		}
+
+	std::unordered_map<BlockID, std::vector<BlockID>> children;
+	for (auto b : rpo)
+		if (NoBlock != idom[b])
+			children[idom[b]].push_back (b);
+
+	// Down the dominator tree from the allocation, with the values each
+	// block starts with.
+	std::vector<std::pair<BlockID, std::vector<ValueID>>> work (1, std::make_pair(home, current));
+	while (!work.empty())
+	{
+		auto const b = work.back().first;
+		auto values = std::move(work.back().second);
+		work.pop_back ();
+
+		auto p = phis.find(b);
+		if (p != phis.end())
+			values = p->second;
+
+		for (auto v : f.block(b).code)
+		{
+			auto & ins = f[v];
+			if (ins.dead || ins.operands.empty() || ins.operands[0] != obj || ins.op == IROp::Phi)
+				continue;
+
+			switch (ins.op)
+			{
+			case IROp::GetF:	MakeCopy (ins, values[ins.aux]); break;
+			case IROp::GetE:	MakeCopy (ins, values[size_t(f[ins.operands[1]].number.i)]); break;
+			case IROp::SetF:	values[ins.aux] = ins.operands[1]; ins.dead = true; break;
+			case IROp::SetE:	values[size_t(f[ins.operands[1]].number.i)] = ins.operands[2]; ins.dead = true; break;
+			case IROp::Len:		MakeConst (ins, VM::Reg::FromInt(Int(n))); break;
+			default:			break;
+			}
+		}
+
+		BlockID succs [2];
+		auto const count = f.successors(b, succs);
+		for (int i = 0; i < count; ++i)
+		{
+			auto const s = phis.find(succs[i]);
+			if (s == phis.end())
+				continue;
+			auto const & preds = f.block(succs[i]).preds;
+			auto const k = std::find(preds.begin(), preds.end(), b) - preds.begin();
+			for (size_t j = 0; j < n; ++j)
+				f[s->second[j]].operands[k] = values[j];
+		}
+
+		for (auto c : children[b])
+			work.push_back (std::make_pair(c, values));
+	}
+
+	f[obj].dead = true;
+}
+
+//----------------------------------------------------------------------
+
+}	// namespace
+
+//----------------------------------------------------------------------
+
+uint32_t ReplaceObjectsWithScalars (IRFunction & f, Type::STContainer const & types, uint32_t max_fields)
+{
+	std::vector<std::vector<ValueID>> users (f.values().size());
+	for (ValueID v = 1; v < f.values().size(); ++v)
+		if (!f[v].dead && NoBlock != f[v].block)
+			for (auto o : f[v].operands)
+				if (users[o].empty() || users[o].back() != v)
+					users[o].push_back (v);
+
+	std::vector<BlockID> rpo, idom;
+	bool have_dominators = false;
+
+	uint32_t ret = 0;
+	auto const nv = f.values().size();
+	for (ValueID v = 1; v < nv; ++v)
+	{
+		auto const & ins = f[v];
+		if (ins.dead || (ins.op != IROp::New && ins.op != IROp::NewN))
+			continue;
+
+		std::vector<Type::ID> field_types;
+		if (ins.op == IROp::New)
+		{
+			auto const tag = types.tag(ins.type);
+			if (tag == Type::Tag::Tuple)
+				field_types = types.getTupleTypes(ins.type);
+			else if (tag == Type::Tag::Package)
+				field_types = types.getPackageTypes(ins.type);
+		}
+		else
+		{
+			auto const & count = f[ins.operands[1]];
+			if (types.tag(ins.type) == Type::Tag::Vector && count.op == IROp::Const && count.number.i >= 0 && count.number.i <= Int(max_fields))
+				field_types.assign (size_t(count.number.i), types.getVectorType(ins.type));
+		}
+		if (field_types.empty() || field_types.size() > max_fields)
+			continue;
+
+		std::vector<VM::Reg> initial (field_types.size());
+		bool replaceable = true;
+		for (size_t i = 0; i < field_types.size() && replaceable; ++i)
+			replaceable = IsReplaceableField(types, field_types[i], initial[i]);
+		if (!replaceable || !DoesNotEscape(f, v, users[v], uint32_t(field_types.size())))
+			continue;
+
+		if (!have_dominators)
+		{
+			f.computeDominators (rpo, idom);
+			have_dominators = true;
+		}
+		ReplaceWithScalars (f, v, field_types, initial, rpo, idom);
+		ret += 1;
+	}
+	return ret;
+}
+
+//======================================================================
+
+uint32_t RemoveUnreachableBlocks (IRFunction & f)
+{
+	auto & blocks = f.blocks();
+	std::vector<uint8_t> reachable (blocks.size(), 0);
+	std::vector<BlockID> work (1, 0);
+	reachable[0] = 1;
+	while (!work.empty())
+	{
+		auto const b = work.back();
+		work.pop_back ();
+		BlockID succs [2];
+		auto const count = f.successors(b, succs);
+		for (int i = 0; i < count; ++i)
+			if (!reachable[succs[i]])
+			{
+				reachable[succs[i]] = 1;
+				work.push_back (succs[i]);
+			}
+	}
+
+	uint32_t ret = 0;
+	for (BlockID b = 0; b < blocks.size(); ++b)
+	{
+		if (reachable[b] || blocks[b].dead)
+			continue;
+
+		BlockID succs [2];
+		auto const count = f.successors(b, succs);
+		for (int i = 0; i < count; ++i)
+			if (reachable[succs[i]])
+				f.removePred (succs[i], b);
+
+		for (auto v : blocks[b].code)
+			f[v].dead = true;
+		blocks[b].dead = true;
+		ret += 1;
+	}
+	return ret;
+}
+
+//======================================================================
+
+//======================================================================
+
+uint32_t MergeBlocks (IRFunction & f)
+{
+	auto & blocks = f.blocks();
+
+	uint32_t ret = 0;
+	for (BlockID b = 0; b < blocks.size(); ++b)
+	{
+		if (blocks[b].dead)
+			continue;
+
+		for (;;)
+		{
+			auto const jump = f.terminator(b);
+			if (NoValue == jump || f[jump].op != IROp::Jmp)
+				break;
+			auto const s = f[jump].targets[0];
+			if (s == b || 0 == s || blocks[s].preds.size() != 1)
+				break;
+
+			// The phis of "s" have one operand each, from "b"
+			blocks[b].code.pop_back ();
+			f[jump].dead = true;
+			for (auto v : blocks[s].code)
+			{
+				if (f[v].op == IROp::Phi)
+					MakeCopy (f[v], f[v].operands[0]);
+				f[v].block = b;
+				blocks[b].code.push_back (v);
+			}
+
+			BlockID succs [2];
+			auto const count = f.successors(b, succs);
+			for (int i = 0; i < count; ++i)
+				for (auto & p : blocks[succs[i]].preds)
+					if (p == s)
+						p = b;
+
+			blocks[s].code.clear ();
+			blocks[s].preds.clear ();
+			blocks[s].dead = true;
+			ret += 1;
+		}
+	}
+	return ret;
+}
+
+//======================================================================
+
+namespace {
+
+//----------------------------------------------------------------------
+// A loop "for i = 0; i < len(a); i += 1" with nothing else in its head
+// but phis (i's and at most one more), the length and constants: "head"
+// branches to the first of "body" (whose last block jumps back) or to
+// "exit", and is entered from "pre" otherwise.
+
+struct CountedLoop
+{
+	BlockID pre = NoBlock, head = NoBlock, exit = NoBlock;
+	std::vector<BlockID> body;
+	ValueID i = NoValue, step = NoValue, a = NoValue;
+	ValueID other = NoValue;				// The head's other phi, if there is one
+	size_t pre_k = 0, latch_k = 0;			// Phi operands from "pre" and from the last of "body"
+};
+
+//----------------------------------------------------------------------
+
+bool IsConstOne (IRFunction const & f, Type::STContainer const & types, ValueID v)
+{
+	return IsConstInt(f, types, v, 1);
+}
+
+//----------------------------------------------------------------------
+// The blocks of the body: one that jumps back, or a diamond whose join
+// does.
+
+bool FindBody (IRFunction const & f, BlockID head, BlockID first, std::vector<BlockID> & out_body)
+{
+	auto jumpsTo = [&f] (BlockID b, BlockID to) {
+		auto const t = f.terminator(b);
+		return NoValue != t && f[t].op == IROp::Jmp && f[t].targets[0] == to;
+	};
+
+	auto const & b1 = f.block(first);
+	if (b1.preds.size() != 1 || first == head)
+		return false;
+	if (jumpsTo(first, head))
+	{
+		out_body.assign (1, first);
+		return true;
+	}
+
+	auto const br = f.terminator(first);
+	if (NoValue == br || f[br].op != IROp::Br)
+		return false;
+	for (int side = 0; side < 2; ++side)
+	{
+		auto const b2 = f[br].targets[side], b3 = f[br].targets[1 - side];
+		if (b2 == head || b3 == head || b2 == first || b3 == first || b2 == b3)
+			continue;
+		if (f.block(b2).preds.size() == 1 && jumpsTo(b2, b3) && f.block(b3).preds.size() == 2 && jumpsTo(b3, head))
+		{
+			out_body = {first, b2, b3};
+			return true;
+		}
+	}
+	return false;
+}
+
+//----------------------------------------------------------------------
+
+bool FindCountedLoop (IRFunction const & f, Type::STContainer const & types, BlockID head, CountedLoop & out)
+{
+	auto const & h = f.block(head);
+	auto const br = f.terminator(head);
+	if (h.dead || h.preds.size() != 2 || NoValue == br || f[br].op != IROp::Br)
+		return false;
+
+	out = CountedLoop();
+	out.head = head;
+	out.exit = f[br].targets[1];
+	if (out.exit == head || !FindBody(f, head, f[br].targets[0], out.body))
+		return false;
+
+	auto const latch = out.body.back();
+	if (h.preds[0] == latch)
+		out.latch_k = 0, out.pre_k = 1;
+	else if (h.preds[1] == latch)
+		out.latch_k = 1, out.pre_k = 0;
+	else
+		return false;
+	out.pre = h.preds[out.pre_k];
+	auto const pre_jump = f.terminator(out.pre);
+	if (out.pre == head || NoValue == pre_jump || f[pre_jump].op != IROp::Jmp)
+		return false;
+
+	// The test: i < len(a)
+	auto const & cond = f[f[br].operands[0]];
+	if (cond.op != IROp::Lt || cond.block != head)
+		return false;
+	auto const & len = f[cond.operands[1]];
+	if (len.op != IROp::Len)
+		return false;
+	out.i = cond.operands[0];
+	out.a = len.operands[0];
+	if (f[out.a].block == head || std::find(out.body.begin(), out.body.end(), f[out.a].block) != out.body.end())
+		return false;
+
+	// i: a phi from 0, stepped by 1 in the latch
+	auto const & i = f[out.i];
+	if (i.op != IROp::Phi || i.block != head || !IsConstInt(f, types, i.operands[out.pre_k], 0))
+		return false;
+	out.step = i.operands[out.latch_k];
+	auto const & step = f[out.step];
+	if (step.op != IROp::Add || step.block != latch || step.operands[0] != out.i || !IsConstOne(f, types, step.operands[1]))
+		return false;
+
+	for (auto v : h.code)
+	{
+		auto const & ins = f[v];
+		if (ins.dead || v == out.i || v == br || ins.op == IROp::Const || &ins == &cond || &ins == &len)
+			continue;
+		if (ins.op != IROp::Phi || NoValue != out.other)
+			return false;
+		out.other = v;
+	}
+	return true;
+}
+
+//----------------------------------------------------------------------
+
+bool ElementOf (Type::STContainer const & types, Type::ID type, VM::BulkElement & out)
+{
+	if (types.tag(type) != Type::Tag::Vector)
+		return false;
+	switch (types.tag(types.getVectorType(type)))
+	{
+	case Type::Tag::Int:	out = VM::BulkElement::Int; return true;
+	case Type::Tag::Real:	out = VM::BulkElement::Real; return true;
+	case Type::Tag::Byte:	out = VM::BulkElement::Byte; return true;
+	default:				return false;
+	}
+}
+
+//----------------------------------------------------------------------
+// What a loop does, once it's known to be one bulk operation.
+
+struct BulkLoop
+{
+	uint8_t code = 0;
+	std::vector<ValueID> operands;		// Constants inside the loop are copied out
+	ValueID result_phi = NoValue;		// The head's phi that starts out as the result
+};
+
+//----------------------------------------------------------------------
+
+class BulkMatcher
+{
+public:
+	BulkMatcher (IRFunction const & f, Type::STContainer const & types, CountedLoop const & loop, bool reassociate_reals)
+		: m_f (f)
+		, m_types (types)
+		, m_loop (loop)
+		, m_reassociate_reals (reassociate_reals)
+	{
+	}
+
+	bool match (BulkLoop & out);
+
+private:
+	bool inLoop (ValueID v) const
+	{
+		auto const b = m_f[v].block;
+		return b == m_loop.head || std::find(m_loop.body.begin(), m_loop.body.end(), b) != m_loop.body.end();
+	}
+
+	// Usable before the loop, as it is or copied
+	bool invariant (ValueID v) const {return !inLoop(v) || m_f[v].op == IROp::Const;}
+
+	// An invariant scalar that goes with the elements
+	bool scalar (ValueID v) const
+	{
+		auto const want = (m_element == VM::BulkElement::Real) ? RegKind::Real : RegKind::Int;
+		return invariant(v) && RegKindOf(m_types, m_f[v].type) == want;
+	}
+
+	// A vector of the same elements as "a", from outside the loop
+	bool sameVector (ValueID v) const
+	{
+		VM::BulkElement e;
+		return !inLoop(v) && ElementOf(m_types, m_f[v].type, e) && e == m_element;
+	}
+
+	bool isElement (ValueID v, ValueID of) const
+	{
+		auto const & ins = m_f[v];
+		return ins.op == IROp::GetE && ins.operands[0] == of && ins.operands[1] == m_loop.i;
+	}
+
+	// The body's instructions, but for constants, the step and the jumps
+	std::vector<ValueID> work (BlockID b) const;
+	bool usedOutside (ValueID allowed) const;
+
+	bool matchElementWise (BulkLoop & out);
+	bool matchReduce (BulkLoop & out);
+	bool matchFilter (BulkLoop & out);
+
+	IRFunction const & m_f;
+	Type::STContainer const & m_types;
+	CountedLoop const & m_loop;
+	bool m_reassociate_reals;
+	VM::BulkElement m_element = VM::BulkElement::Int;
+};
+
+//----------------------------------------------------------------------
+
+std::vector<ValueID> BulkMatcher::work (BlockID b) const
+{
+	std::vector<ValueID> ret;
+	for (auto v : m_f.block(b).code)
+	{
+		auto const & ins = m_f[v];
+		if (!ins.dead && ins.op != IROp::Const && v != m_loop.step && IROpKind(ins.op) != IRKind::Jump)
+			ret.push_back (v);
+	}
+	return ret;
+}
+
+//----------------------------------------------------------------------
+// Whether anything after the loop uses what it computed (other than the
+// head's phi "allowed", which the bulk operation stands in for.)
+
+bool BulkMatcher::usedOutside (ValueID allowed) const
+{
+	for (ValueID v = 1; v < m_f.values().size(); ++v)
+	{
+		auto const & ins = m_f[v];
+		if (ins.dead || NoBlock == ins.block || inLoop(v))
+			continue;
+		for (auto o : ins.operands)
+			if (o != allowed && inLoop(o) && m_f[o].op != IROp::Const)
+				return true;
+	}
+	return false;
+}
+
+//----------------------------------------------------------------------
+
+bool BulkMatcher::match (BulkLoop & out)
+{
+	if (!ElementOf(m_types, m_f[m_loop.a].type, m_element))
+		return false;
+
+	bool const found = (1 == m_loop.body.size())
+		? (NoValue == m_loop.other) ? matchElementWise(out) : matchReduce(out)
+		: matchFilter(out);
+	return found && !usedOutside(out.result_phi);
+}
+
+//----------------------------------------------------------------------
+// out[i] = a[i] op k, or a[i] op b[i]; only Add, Sub and Mul can be
+// written that way.
+
+bool BulkMatcher::matchElementWise (BulkLoop & out)
+{
+	auto const code = work(m_loop.body[0]);
+	if (code.size() != 3 && code.size() != 4)
+		return false;
+
+	ValueID set = NoValue, y = NoValue;
+	for (auto v : code)
+		switch (m_f[v].op)
+		{
+		case IROp::SetE:					set = v; break;
+		case IROp::Add: case IROp::Sub: case IROp::Mul:	y = v; break;
+		default:							break;
+		}
+	if (NoValue == set || NoValue == y)
+		return false;
+
+	auto const & s = m_f[set];
+	auto const o = s.operands[0];
+	if (s.operands[1] != m_loop.i || s.operands[2] != y || !sameVector(o))
+		return false;
+
+	auto const & op = m_f[y];
+	auto const bulk_op = (op.op == IROp::Add) ? VM::BulkOp::Add : (op.op == IROp::Sub) ? VM::BulkOp::Sub : VM::BulkOp::Mul;
+	auto x = op.operands[0], other = op.operands[1];
+	if (!isElement(x, m_loop.a) && op.op != IROp::Sub)
+		std::swap (x, other);
+	if (!isElement(x, m_loop.a))
+		return false;
+
+	if (3 == code.size() && scalar(other))
+	{
+		out.code = VM::BulkCode(VM::BulkForm::Map, bulk_op);
+		out.operands = {o, m_loop.a, other};
+		return true;
+	}
+
+	if (4 == code.size() && m_f[other].op == IROp::GetE && m_f[other].operands[1] == m_loop.i && other != x)
+	{
+		auto const b = m_f[other].operands[0];
+		if (!sameVector(b))
+			return false;
+		out.code = VM::BulkCode(VM::BulkForm::Zip, bulk_op);
+		out.operands = {o, m_loop.a, b};
+		return true;
+	}
+	return false;
+}
+
+//----------------------------------------------------------------------
+// acc = acc op a[i], with Add or Mul; reals only if their sums and
+// products may be reassociated.
+
+bool BulkMatcher::matchReduce (BulkLoop & out)
+{
+	auto const code = work(m_loop.body[0]);
+	auto const & acc = m_f[m_loop.other];
+	if (code.size() != 2 || (m_element == VM::BulkElement::Real && !m_reassociate_reals))
+		return false;
+
+	auto const next = acc.operands[m_loop.latch_k];
+	auto const & op = m_f[next];
+	if (std::find(code.begin(), code.end(), next) == code.end() || (op.op != IROp::Add && op.op != IROp::Mul))
+		return false;
+	auto const x = (op.operands[0] == m_loop.other) ? op.operands[1] : op.operands[0];
+	if (op.operands[0] != m_loop.other && op.operands[1] != m_loop.other)
+		return false;
+	if (!isElement(x, m_loop.a) || std::find(code.begin(), code.end(), x) == code.end())
+		return false;
+
+	// Bytes add up to an Int.
+	auto const init = acc.operands[m_loop.pre_k];
+	auto const want = (m_element == VM::BulkElement::Real) ? RegKind::Real : RegKind::Int;
+	if (RegKindOf(m_types, acc.type) != want || !invariant(init))
+		return false;
+
+	out.code = VM::BulkCode(VM::BulkForm::Reduce, (op.op == IROp::Add) ? VM::BulkOp::Add : VM::BulkOp::Mul);
+	out.operands = {init, m_loop.a};
+	out.result_phi = m_loop.other;
+	return true;
+}
+
+//----------------------------------------------------------------------
+// if (a[i] cmp k) {out[j] = a[i]; j += 1}, where j starts at 0: the test
+// (maybe with the operands swapped, or negated) is in the first block,
+// the store in the second and j's phi in the third.
+
+bool BulkMatcher::matchFilter (BulkLoop & out)
+{
+	auto const first = m_loop.body[0], store = m_loop.body[1], join = m_loop.body[2];
+	auto const & j = m_f[m_loop.other];
+	if (NoValue == m_loop.other || !IsConstInt(m_f, m_types, j.operands[m_loop.pre_k], 0))
+		return false;
+
+	// The join has just j's phi (and the step.)
+	auto const join_code = work(join);
+	if (join_code.size() != 1 || join_code[0] != j.operands[m_loop.latch_k])
+		return false;
+	auto const & phi = m_f[join_code[0]];
+	auto const & join_preds = m_f.block(join).preds;
+	auto const from_first = (join_preds[0] == first) ? 0 : 1;
+	auto const bumped = phi.operands[1 - from_first];
+	if (phi.op != IROp::Phi || phi.operands[from_first] != m_loop.other)
+		return false;
+
+	// The store, and the bump of j
+	auto const store_code = work(store);
+	if (store_code.size() != 2)
+		return false;
+	auto const set = (m_f[store_code[0]].op == IROp::SetE) ? store_code[0] : store_code[1];
+	auto const & s = m_f[set];
+	auto const & add = m_f[bumped];
+	if (s.op != IROp::SetE || add.op != IROp::Add || add.block != store ||
+			add.operands[0] != m_loop.other || !IsConstInt(m_f, m_types, add.operands[1], 1))
+		return false;
+	auto const o = s.operands[0], x = s.operands[2];
+	if (s.operands[1] != m_loop.other || !sameVector(o) || !isElement(x, m_loop.a) || m_f[x].block != first)
+		return false;
+
+	// The test
+	auto const first_code = work(first);
+	auto const br = m_f.terminator(first);
+	bool take = m_f[br].targets[0] == store;
+	auto c = m_f[br].operands[0];
+	if (m_f[c].op == IROp::Not)
+	{
+		take = !take;
+		c = m_f[c].operands[0];
+	}
+	if (first_code.size() != ((c == m_f[br].operands[0]) ? 2U : 3U) || m_f[c].block != first)
+		return false;
+
+	auto const & cmp = m_f[c];
+	if (cmp.op != IROp::Eq && cmp.op != IROp::Lt && cmp.op != IROp::Le)
+		return false;
+	bool const swapped = cmp.operands[1] == x;
+	auto const k = swapped ? cmp.operands[0] : cmp.operands[1];
+	if ((swapped ? cmp.operands[1] : cmp.operands[0]) != x || !scalar(k))
+		return false;
+
+	// Bytes are compared with a byte.
+	if (m_element == VM::BulkElement::Byte && (m_f[k].op != IROp::Const || m_f[k].number.i < 0 || m_f[k].number.i > 255))
+		return false;
+
+	VM::BulkOp op;
+	switch (cmp.op)
+	{
+	case IROp::Eq:	op = VM::BulkOp::Eq; break;
+	case IROp::Lt:	op = swapped ? VM::BulkOp::Gt : VM::BulkOp::Lt; break;
+	default:		op = swapped ? VM::BulkOp::Ge : VM::BulkOp::Le; break;
+	}
+	out.code = VM::BulkCode(VM::BulkForm::Filter, op, !take);
+	out.operands = {o, m_loop.a, k};
+	out.result_phi = m_loop.other;
+	return true;
+}
+
+//----------------------------------------------------------------------
+// The operation goes at the end of the preheader, and the head jumps
+// straight to the exit; the body is left unreachable.
+
+void ReplaceLoop (IRFunction & f, CountedLoop const & loop, BulkLoop const & bulk)
+{
+	auto & pre = f.block(loop.pre).code;
+	auto at = pre.size() - 1;
+
+	IRInstr ins;
+	ins.op = IROp::Bulk;
+	ins.block = loop.pre;
+	ins.aux = bulk.code;
+	ins.type = (NoValue == bulk.result_phi) ? 0 : f[bulk.result_phi].type;
+	for (auto o : bulk.operands)
+	{
+		auto const b = f[o].block;
+		if (b == loop.head || std::find(loop.body.begin(), loop.body.end(), b) != loop.body.end())
+		{
+			auto k = f[o];
+			k.block = loop.pre;
+			o = f.addInstr(std::move(k));
+			pre.insert (pre.begin() + at++, o);
+		}
+		ins.operands.push_back (o);
+	}
+	auto const v = f.addInstr(std::move(ins));
+	pre.insert (pre.begin() + at, v);
+
+	if (NoValue != bulk.result_phi)
+		f[bulk.result_phi].operands[loop.pre_k] = v;
+
+	auto & br = f[f.terminator(loop.head)];
+	br.op = IROp::Jmp;
+	br.operands.clear ();
+	br.targets[0] = loop.exit;
+	br.targets[1] = NoBlock;
+	f.removePred (loop.body[0], loop.head);
+}
+
+//----------------------------------------------------------------------
+
+}	// namespace
+
+//----------------------------------------------------------------------
+
+uint32_t LowerBulkLoops (IRFunction & f, Type::STContainer const & types, bool reassociate_reals)
+{
+	uint32_t ret = 0;
+	for (BlockID b = 0; b < f.blocks().size(); ++b)
+	{
+		CountedLoop loop;
+		BulkLoop bulk;
+		if (!FindCountedLoop(f, types, b, loop) || !BulkMatcher(f, types, loop, reassociate_reals).match(bulk))
+			continue;
+		ReplaceLoop (f, loop, bulk);
+		ret += 1;
+	}
+	if (0 != ret)
+		RemoveUnreachableBlocks (f);
+	return ret;
+}
+
+//======================================================================
+
+static void Record (std::vector<PassReport> * out_reports, char const * name, uint32_t changes, int64_t removed, uint64_t ns)
+{
+	if (nullptr == out_reports)
+		return;
+
+	auto r = std::find_if(out_reports->begin(), out_reports->end(), [name] (PassReport const & p) {return 0 == strcmp(p.pass, name);});
+	if (r == out_reports->end())
+	{
+		out_reports->push_back (PassReport());
+		r = out_reports->end() - 1;
+		r->pass = name;
+	}
+	r->runs += 1;
+	r->changes += changes;
+	r->instructions_removed += removed;
+	r->nanoseconds += ns;
+}
+
+//----------------------------------------------------------------------
+
+static uint64_t NanosecondsSince (std::chrono::steady_clock::time_point start)
+{
+	return uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count());
+}
+
+//----------------------------------------------------------------------
+
+void Optimize (IRFunction & f, Type::STContainer const & types, std::vector<PassReport> * out_reports, int max_rounds)
+{
+	auto run = [&] (char const * name, uint32_t (*pass) (IRFunction &, Type::STContainer const &)) -> uint32_t
+	{
+		auto const before = f.instructionCount();
+		auto const start = std::chrono::steady_clock::now();
+		auto const changes = pass(f, types);
+		f.compact ();
+		Record (out_reports, name, changes, int64_t(before) - f.instructionCount(), NanosecondsSince(start));
+		return changes;
+	};
+
+	for (int round = 0; round < max_rounds; ++round)
+	{
+		uint32_t changes = 0;
+		changes += run("merge-blocks", [] (IRFunction & f, Type::STContainer const &) {return MergeBlocks(f);});
+		changes += run("copy-propagation", [] (IRFunction & f, Type::STContainer const &) {return PropagateCopies(f);});
+		changes += run("constant-folding", [] (IRFunction & f, Type::STContainer const & t) {return FoldConstants(f, t);});
+		changes += run("copy-propagation", [] (IRFunction & f, Type::STContainer const &) {return PropagateCopies(f);});
+		changes += run("cse", [] (IRFunction & f, Type::STContainer const &) {return EliminateCommonSubexpressions(f);});
+		changes += run("scalar-replacement", [] (IRFunction & f, Type::STContainer const & t) {return ReplaceObjectsWithScalars(f, t);});
+		changes += run("bulk-loops", [] (IRFunction & f, Type::STContainer const & t) {return LowerBulkLoops(f, t);});
+		changes += run("dce", [] (IRFunction & f, Type::STContainer const &) {return EliminateDeadCode(f);});
+		if (0 == changes)
+			break;
+	}
+}
+
+//======================================================================
+
+namespace {
+
+//----------------------------------------------------------------------
+// The function a call calls directly, or -1.
+
+int64_t DirectCallee (IRFunction const & f, IRInstr const & call)
+{
+	if (call.op != IROp::Call)
+		return -1;
+	auto const & callee = f[call.operands[0]];
+	return callee.op == IROp::Func ? int64_t(callee.aux) : -1;
+}
+
+//----------------------------------------------------------------------
+// Which functions are part of a cycle of direct calls (Tarjan's strongly
+// connected components, on the direct call graph.)
+
+std::vector<uint8_t> FindRecursive (IRModule const & m)
+{
+	auto const n = m.functions.size();
+	std::vector<std::vector<uint32_t>> calls (n);
+	for (uint32_t i = 0; i < n; ++i)
+		for (auto const & ins : m.functions[i].values())
+		{
+			auto const callee = ins.dead ? -1 : DirectCallee(m.functions[i], ins);
+			if (callee >= 0 && uint64_t(callee) < n)
+				calls[i].push_back (uint32_t(callee));
+		}
+
+	std::vector<uint8_t> ret (n, 0);
+	std::vector<int> index (n, -1), low (n, 0);
+	std::vector<uint8_t> on_stack (n, 0);
+	std::vector<uint32_t> stack;
+	int next_index = 0;
+
+	struct Frame {uint32_t f; size_t edge;};
+	for (uint32_t root = 0; root < n; ++root)
+	{
+		if (index[root] >= 0)
+			continue;
+
+		std::vector<Frame> frames (1, Frame{root, 0});
+		index[root] = low[root] = next_index++;
+		stack.push_back (root);
+		on_stack[root] = 1;
+
+		while (!frames.empty())
+		{
+			auto & top = frames.back();
+			if (top.edge < calls[top.f].size())
+			{
+				auto const g = calls[top.f][top.edge++];
+				if (g == top.f)
+					ret[g] = 1;
+				if (index[g] < 0)
+				{
+					index[g] = low[g] = next_index++;
+					stack.push_back (g);
+					on_stack[g] = 1;
+					frames.push_back ({g, 0});
+				}
+				else if (on_stack[g])
+					low[top.f] = std::min(low[top.f], index[g]);
+				continue;
+			}
+
+			auto const f = top.f;
+			frames.pop_back ();
+			if (!frames.empty())
+				low[frames.back().f] = std::min(low[frames.back().f], low[f]);
+
+			if (low[f] == index[f])
+			{
+				std::vector<uint32_t> component;
+				uint32_t g;
+				do
+				{
+					g = stack.back();
+					stack.pop_back ();
+					on_stack[g] = 0;
+					component.push_back (g);
+				} while (g != f);
+				if (component.size() > 1)
+					for (auto c : component)
+						ret[c] = 1;
+			}
+		}
+	}
+	return ret;
+}
+
+//----------------------------------------------------------------------
+
+uint32_t InlineCost (IRFunction const & g)
+{
+	uint32_t ret = 0;
+	for (auto const & b : g.blocks())
+		if (!b.dead)
+			for (auto v : b.code)
+				if (!g[v].dead && g[v].op != IROp::Param && g[v].op != IROp::Ret)
+					ret += 1;
+	return ret;
+}
+
+//----------------------------------------------------------------------
+// Replaces the call "c" in "f" with a copy of g's body. The code after
+// the call moves to a new block, which the copy's returns jump to, and
+// "c" becomes the phi of what they return.
+
+void InlineCall (IRFunction & f, ValueID c, IRFunction const & g)
+{
+	auto const b = f[c].block;
+	auto const args = std::vector<ValueID>(f[c].operands.begin() + 1, f[c].operands.end());
+
+	// Split the block after the call
+	auto const cont = f.addBlock();
+	{
+		auto & code = f.block(b).code;
+		auto const at = std::find(code.begin(), code.end(), c);
+		f.block(cont).code.assign (at + 1, code.end());
+		code.erase (at, code.end());
+		for (auto v : f.block(cont).code)
+			f[v].block = cont;
+
+		BlockID succs [2];
+		auto const count = f.successors(cont, succs);
+		for (int i = 0; i < count; ++i)
+			for (auto & p : f.block(succs[i]).preds)
+				if (p == b)
+					p = cont;
+	}
+
+	// Copy the blocks and then the instructions, and fix up the references.
+	std::vector<BlockID> block_map (g.blocks().size(), NoBlock);
+	for (BlockID gb = 0; gb < g.blocks().size(); ++gb)
+		if (!g.block(gb).dead)
+			block_map[gb] = f.addBlock();
+
+	std::vector<ValueID> value_map (g.values().size(), NoValue);
+	std::vector<ValueID> returns;
+	std::vector<BlockID> return_blocks;
+	for (BlockID gb = 0; gb < g.blocks().size(); ++gb)
+	{
+		if (g.block(gb).dead)
+			continue;
+		auto const nb = block_map[gb];
+		for (auto p : g.block(gb).preds)
+			f.block(nb).preds.push_back (block_map[p]);
+
+		for (auto v : g.block(gb).code)
+		{
+			auto const & ins = g[v];
+			if (ins.dead)
+				continue;
+			if (ins.op == IROp::Param)
+			{
+				value_map[v] = args[ins.aux];
+				continue;
+			}
+
+			IRInstr copy = ins;
+			copy.block = nb;
+			if (ins.op == IROp::Ret)
+			{
+				if (!ins.operands.empty())
+					returns.push_back (ins.operands[0]);
+				else
+					returns.push_back (NoValue);
+				return_blocks.push_back (nb);
+				copy.op = IROp::Jmp;
+				copy.operands.clear ();
+				copy.targets[0] = cont;
+			}
+			else
+			{
+				copy.targets[0] = (NoBlock == ins.targets[0]) ? NoBlock : block_map[ins.targets[0]];
+				copy.targets[1] = (NoBlock == ins.targets[1]) ? NoBlock : block_map[ins.targets[1]];
+			}
+
+			auto const nv = f.addInstr(std::move(copy));
+			f.block(nb).code.push_back (nv);
+			value_map[v] = nv;
+		}
+	}
+
+	for (ValueID v = 1; v < g.values().size(); ++v)
+		if (NoValue != value_map[v] && g[v].op != IROp::Param)
+			for (auto & o : f[value_map[v]].operands)
+				o = value_map[o];
+
+	// Into the copy, and out of it
+	IRInstr jump;
+	jump.op = IROp::Jmp;
+	jump.block = b;
+	jump.targets[0] = block_map[0];
+	f.block(b).code.push_back (f.addInstr(std::move(jump)));
+	f.block(block_map[0]).preds.push_back (b);
+
+	f.block(cont).preds = return_blocks;
+	auto & result = f[c];
+	if (0 == result.type)
+		result.dead = true;
+	else
+	{
+		for (auto & r : returns)
+			if (NoValue == r)
+			{
+				// Returns nothing where something is expected: a zero.
+				IRInstr zero;
+				zero.op = IROp::Const;
+				zero.type = result.type;
+				zero.block = cont;
+				r = f.addInstr(std::move(zero));
+				f.block(block_map[0]).code.insert (f.block(block_map[0]).code.begin(), r);
+				f[r].block = block_map[0];
+			}
+		for (size_t i = 0; i < returns.size(); ++i)
+			returns[i] = NoValue == value_map[returns[i]] ? returns[i] : value_map[returns[i]];
+
+		auto & phi = f[c];
+		phi.op = IROp::Phi;
+		phi.block = cont;
+		phi.operands = returns;
+		f.block(cont).code.insert (f.block(cont).code.begin(), c);
+	}
+}
+
+//----------------------------------------------------------------------
+// The bool, int or real type of what's passed boxed as "arg", or 0. It's
+// either boxed right there, or already folded into a constant.
+
+Type::ID UnboxedType (IRFunction const & f, Type::STContainer const & types, ValueID arg)
+{
+	auto const & ins = f[arg];
+	if (ins.op == IROp::Box)
+	{
+		auto const type = f[ins.operands[0]].type;
+		auto const tag = types.tag(type);
+		return (tag == Type::Tag::Bool || tag == Type::Tag::Int || tag == Type::Tag::Real) ? type : 0;
+	}
+
+	if (ins.op == IROp::Const)
+	{
+		auto const tag = types.tag(ins.type);
+		if (tag != Type::Tag::Any && tag != Type::Tag::Variant)
+			return 0;
+		switch (ins.number.value().kind())
+		{
+		case VM::Value::Kind::Bool:		return Type::STContainer::DefaultID(Type::Tag::Bool);
+		case VM::Value::Kind::Int:		return Type::STContainer::DefaultID(Type::Tag::Int);
+		case VM::Value::Kind::Real:		return Type::STContainer::DefaultID(Type::Tag::Real);
+		default:						return 0;
+		}
+	}
+
+	return 0;
+}
+
+//----------------------------------------------------------------------
+
+}	// namespace
+
+//----------------------------------------------------------------------
+
+uint32_t InlineCalls (IRModule & m, InlineOptions const & options)
+{
+	auto const recursive = FindRecursive(m);
+
+	uint32_t ret = 0;
+	for (int round = 0; round < options.max_rounds; ++round)
+	{
+		uint32_t inlined = 0;
+		for (auto & f : m.functions)
+		{
+			auto size = InlineCost(f);
+			for (ValueID c = 1; c < f.values().size(); ++c)
+			{
+				auto const & ins = f[c];
+				auto const callee = ins.dead ? -1 : DirectCallee(f, ins);
+				if (callee < 0 || uint64_t(callee) >= m.functions.size() || recursive[callee])
+					continue;
+
+				auto const & g = m.functions[callee];
+				if (&g == &f || 0 != (g.flags() & VM::Function::msc_Memoize) || g.paramTypes().size() + 1 != ins.operands.size())
+					continue;
+
+				uint32_t allowance = options.max_callee_size;
+				for (size_t i = 1; i < ins.operands.size(); ++i)
+					if (f[ins.operands[i]].op == IROp::Const)
+						allowance += options.constant_arg_bonus;
+				auto const cost = InlineCost(g);
+				if (cost > allowance || size + cost > options.max_caller_size)
+					continue;
+
+				InlineCall (f, c, g);
+				size += cost;
+				inlined += 1;
+			}
+		}
+
+		ret += inlined;
+		if (0 == inlined)
+			break;
+	}
+	return ret;
+}
+
+//======================================================================
+
+uint32_t SpecializeCalls (IRModule & m, Type::STContainer & types)
+{
+	std::map<std::pair<uint32_t, std::vector<Type::ID>>, uint32_t> specializations;
+	uint32_t ret = 0;
+
+	// Includes the copies as they are made, so that the recursive calls
+	// in a copy get specialized (to the copy itself) too.
+	for (uint32_t fi = 0; fi < m.functions.size(); ++fi)
+	{
+		for (ValueID c = 1; c < m.functions[fi].values().size(); ++c)
+		{
+			auto & f = m.functions[fi];
+			auto const callee = f[c].dead ? -1 : DirectCallee(f, f[c]);
+			if (callee < 0 || uint64_t(callee) >= m.functions.size())
+				continue;
+
+			auto params = m.functions[callee].paramTypes();
+			if (params.size() + 1 != f[c].operands.size())
+				continue;
+
+			bool any = false;
+			for (size_t i = 0; i < params.size(); ++i)
+			{
+				auto const tag = types.tag(params[i]);
+				auto const unboxed = UnboxedType(f, types, f[c].operands[i + 1]);
+				if ((tag == Type::Tag::Any || tag == Type::Tag::Variant) && 0 != unboxed)
+				{
+					params[i] = unboxed;
+					any = true;
+				}
+			}
+			if (!any)
+				continue;
+
+			// Find or make the copy; "m.functions" may grow, so no references across this.
+			auto const key = std::make_pair(uint32_t(callee), params);
+			auto found = specializations.find(key);
+			uint32_t target;
+			if (found != specializations.end())
+				target = found->second;
+			else
+			{
+				auto const & g = m.functions[callee];
+				auto const type = types.createType(Type::Unpacked(Type::Tag::Function, false, types.getFunctionReturnType(g.type()), params));
+
+				#define TAG_NAME(v,e,s,b,sc,co,cl,ca)	s,
+				static char const * const sc_TagNames [] = { UPL_PRIVATE__TYPE_TAGS(TAG_NAME) };
+				#undef  TAG_NAME
+
+				std::string name = g.name() + "<";
+				for (size_t i = 0; i < params.size(); ++i)
+					name += std::string(i ? "," : "") + sc_TagNames[int(types.tag(params[i]))];
+				name += ">";
+
+				IRFunction spec (name, type, params);
+				spec.values() = g.values();
+				spec.blocks() = g.blocks();
+				spec.setFlags (g.flags());
+
+				// Each specialized parameter comes unboxed, and is boxed again for its users.
+				auto const original = g.paramTypes();
+				for (ValueID p = 1; p < spec.values().size(); ++p)
+				{
+					if (spec[p].dead || spec[p].op != IROp::Param || spec[p].type == params[spec[p].aux])
+						continue;
+
+					spec[p].type = params[spec[p].aux];
+					IRInstr box;
+					box.op = IROp::Box;
+					box.type = original[spec[p].aux];
+					box.block = 0;
+					box.operands.assign (1, p);
+					auto const boxed = spec.addInstr(std::move(box));
+					for (ValueID u = 1; u + 1 < spec.values().size(); ++u)
+						if (!spec[u].dead)
+							for (auto & o : spec[u].operands)
+								if (o == p)
+									o = boxed;
+
+					auto & code = spec.block(0).code;
+					auto at = code.begin();
+					while (at != code.end() && spec[*at].op == IROp::Param)
+						++at;
+					code.insert (at, boxed);
+				}
+
+				target = uint32_t(m.functions.size());
+				specializations.emplace (key, target);
+				m.functions.push_back (std::move(spec));
+			}
+
+			// Call the copy with the unboxed arguments
+			auto & caller = m.functions[fi];
+			IRInstr func;
+			func.op = IROp::Func;
+			func.type = m.functions[target].type();
+			func.block = caller[c].block;
+			func.aux = target;
+			auto const fv = caller.addInstr(std::move(func));
+			auto & code = caller.block(caller[c].block).code;
+			code.insert (std::find(code.begin(), code.end(), c), fv);
+
+			caller[c].operands[0] = fv;
+			for (size_t i = 0; i < params.size(); ++i)
+			{
+				auto const a = caller[c].operands[i + 1];
+				if (caller[a].type == params[i])
+					continue;
+				if (caller[a].op == IROp::Box)
+				{
+					caller[c].operands[i + 1] = caller[a].operands[0];
+					continue;
+				}
+
+				// A boxed constant; the same, unboxed
+				auto const val = caller[a].number.value();
+				IRInstr k;
+				k.op = IROp::Const;
+				k.type = params[i];
+				k.block = caller[c].block;
+				switch (types.tag(params[i]))
+				{
+				case Type::Tag::Bool:	k.number = VM::Reg::FromBool(val.asBool()); break;
+				case Type::Tag::Real:	k.number = VM::Reg::FromReal(val.asReal()); break;
+				default:				k.number = VM::Reg::FromInt(val.asInt()); break;
+				}
+				auto const kv = caller.addInstr(std::move(k));
+				auto & block_code = caller.block(caller[c].block).code;
+				block_code.insert (std::find(block_code.begin(), block_code.end(), c), kv);
+				caller[c].operands[i + 1] = kv;
+			}
+			ret += 1;
+		}
+	}
+	return ret;
+}
+
+//======================================================================
+
+namespace {
+
+//----------------------------------------------------------------------
+// The function a PMap or PReduce applies directly, or -1.
+
+int64_t DirectApplied (IRFunction const & f, IRInstr const & ins)
+{
+	if (ins.op != IROp::PMap && ins.op != IROp::PReduce)
+		return -1;
+	auto const & func = f[ins.operands[(ins.op == IROp::PMap) ? 1 : 0]];
+	return func.op == IROp::Func ? int64_t(func.aux) : -1;
+}
+
+//----------------------------------------------------------------------
+
+bool IsLocalObject (IRFunction const & f, ValueID obj)
+{
+	return f[obj].op == IROp::New || f[obj].op == IROp::NewN;
+}
+
+//----------------------------------------------------------------------
+
+bool IsScalarVector (Type::STContainer const & types, Type::ID type)
+{
+	return types.tag(type) == Type::Tag::Vector && VM::Parallel::IsScalar(types, types.getVectorType(type));
+}
+
+//----------------------------------------------------------------------
+// The functions that read (directly, or through what they call, map,
+// fold or force) a global holding a heap reference, which lives on the
+// heap of the interpreter that forced it, and so can't be read from a
+// Parallel's workers. Those that call indirectly aren't pure anyway.
+
+std::vector<uint8_t> FindHeapGlobalReaders (IRModule const & m, Type::STContainer const & types)
+{
+	auto const n = m.functions.size();
+	std::vector<uint8_t> ret (n, 0);
+	std::vector<std::vector<uint32_t>> uses (n);
+
+	for (uint32_t fi = 0; fi < n; ++fi)
+	{
+		auto const & f = m.functions[fi];
+		for (auto const & ins : f.values())
+		{
+			if (ins.dead)
+				continue;
+			int64_t used = -1;
+			if (ins.op == IROp::Global && ins.aux < m.globals.size())
+			{
+				if (HoldsValue(types, m.globals[ins.aux].type))
+					ret[fi] = 1;
+				used = m.globals[ins.aux].initializer;
+			}
+			else if (ins.op == IROp::Call)
+				used = DirectCallee(f, ins);
+			else
+				used = DirectApplied(f, ins);
+			if (used >= 0 && uint64_t(used) < n)
+				uses[fi].push_back (uint32_t(used));
+		}
+	}
+
+	for (bool changed = true; changed; )
+	{
+		changed = false;
+		for (uint32_t fi = 0; fi < n; ++fi)
+			if (!ret[fi])
+				for (auto g : uses[fi])
+					if (ret[g])
+					{
+						ret[fi] = 1;
+						changed = true;
+						break;
+					}
+	}
+	return ret;
+}
+
+//----------------------------------------------------------------------
+// Whether "ins" can run on a Parallel: its function is a direct reference
+// to a pure one that reads no heap-bound globals, and everything that
+// goes between heaps is a scalar.
+
+bool CanRunInParallel (IRModule const & m, Type::STContainer const & types, std::vector<uint8_t> const & pure,
+	std::vector<uint8_t> const & heap_readers, IRFunction const & f, IRInstr const & ins)
+{
+	auto const callee = DirectApplied(f, ins);
+	if (callee < 0 || uint64_t(callee) >= m.functions.size() || !pure[callee] || heap_readers[callee] ||
+			!IsScalarVector(types, f[ins.operands[2]].type))
+		return false;
+
+	auto const & g = m.functions[callee];
+	auto const arity = (ins.op == IROp::PMap) ? 1U : 2U;
+	if (g.paramTypes().size() != arity || types.tag(g.type()) != Type::Tag::Function ||
+			!VM::Parallel::IsScalar(types, types.getFunctionReturnType(g.type())))
+		return false;
+	for (auto p : g.paramTypes())
+		if (!VM::Parallel::IsScalar(types, p))
+			return false;
+
+	if (ins.op == IROp::PMap)
+		return IsScalarVector(types, ins.type);
+	return VM::Parallel::IsScalar(types, ins.type) && VM::Parallel::IsScalar(types, f[ins.operands[1]].type);
+}
+
+//----------------------------------------------------------------------
+// Replaces the PMap or PReduce "v" with the loop it stands for:
+//
+//     n = len vec; [out = newn type n]; goto head
+//   head:
+//     i = phi 0, i + 1; [acc = phi init, r]; if (i < n) goto body else cont
+//   body:
+//     r = func(e = vec[i]) [or func(acc, e)]; [out[i] = r]; goto head
+//   cont:
+//     v = copy out [or acc]; the rest of the block
+//
+// and returns true; false if "vec" isn't a Vector (which can't be indexed.)
+
+bool ExpandParallelOp (IRFunction & f, Type::STContainer const & types, ValueID v)
+{
+	auto const op = f[v].op;
+	auto const vec = f[v].operands[2];
+	if (types.tag(f[vec].type) != Type::Tag::Vector)
+		return false;
+
+	auto const is_map = (op == IROp::PMap);
+	auto const func = f[v].operands[is_map ? 1 : 0];
+	auto const element = types.getVectorType(f[vec].type);
+	auto const func_type = f[func].type;
+	auto const result = (types.tag(func_type) == Type::Tag::Function) ? types.getFunctionReturnType(func_type) :
+		(is_map ? types.getVectorType(f[v].type) : f[v].type);
+	auto const int_type = Type::STContainer::DefaultID(Type::Tag::Int);
+	auto const bool_type = Type::STContainer::DefaultID(Type::Tag::Bool);
+	auto const b = f[v].block;
+
+	// Split the block around "v", which moves to the start of the rest.
+	auto const cont = f.addBlock();
+	{
+		auto & code = f.block(b).code;
+		auto const at = std::find(code.begin(), code.end(), v);
+		f.block(cont).code.assign (at, code.end());
+		code.erase (at, code.end());
+		for (auto u : f.block(cont).code)
+			f[u].block = cont;
+
+		BlockID succs [2];
+		auto const count = f.successors(cont, succs);
+		for (int i = 0; i < count; ++i)
+			for (auto & p : f.block(succs[i]).preds)
+				if (p == b)
+					p = cont;
+	}
+	auto const head = f.addBlock();
+	auto const body = f.addBlock();
+
+	auto add = [&f] (BlockID block, IROp op, Type::ID type, std::vector<ValueID> operands) -> ValueID {
+		IRInstr ins;
+		ins.op = op;
+		ins.type = type;
+		ins.block = block;
+		ins.operands = std::move(operands);
+		auto const ret = f.addInstr(std::move(ins));
+		f.block(block).code.push_back (ret);
+		return ret;
+	};
+	auto constant = [&] (BlockID block, Int n) {
+		auto const ret = add(block, IROp::Const, int_type, {});
+		f[ret].number = VM::Reg::FromInt(n);
+		return ret;
+	};
+	auto jump = [&] (BlockID from, BlockID to) {
+		auto const j = add(from, IROp::Jmp, 0, {});
+		f[j].targets[0] = to;
+	};
+
+	auto const n = add(b, IROp::Len, int_type, {vec});
+	auto const out = is_map ? add(b, IROp::NewN, f[v].type, {f[v].operands[0], n}) : NoValue;
+	auto const zero = constant(b, 0);
+	jump (b, head);
+
+	auto const i = add(head, IROp::Phi, int_type, {zero, NoValue});
+	auto const acc = is_map ? NoValue : add(head, IROp::Phi, f[v].type, {f[v].operands[1], NoValue});
+	auto const test = add(head, IROp::Lt, bool_type, {i, n});
+	auto const br = add(head, IROp::Br, 0, {test});
+	f[br].targets[0] = body;
+	f[br].targets[1] = cont;
+
+	auto const e = add(body, IROp::GetE, element, {vec, i});
+	auto const r = add(body, IROp::Call, result, is_map ? std::vector<ValueID>{func, e} : std::vector<ValueID>{func, acc, e});
+	if (is_map)
+		add (body, IROp::SetE, 0, {out, i, r});
+	auto const next = add(body, IROp::Add, int_type, {i, constant(body, 1)});
+	jump (body, head);
+
+	f[i].operands[1] = next;
+	if (!is_map)
+		f[acc].operands[1] = r;
+	f.block(head).preds = {b, body};
+	f.block(body).preds = {head};
+	f.block(cont).preds = {head};
+
+	auto & copy = f[v];
+	copy.op = IROp::Copy;
+	copy.aux = 0;
+	copy.operands.assign (1, is_map ? out : acc);
+	return true;
+}
+
+//----------------------------------------------------------------------
+
+}	// namespace
+
+//----------------------------------------------------------------------
+
+std::vector<uint8_t> FindPureFunctions (IRModule const & m)
+{
+	auto const n = m.functions.size();
+	std::vector<uint8_t> ret (n, 1);
+	std::vector<std::vector<uint32_t>> uses (n);	// Called, mapped or folded with
+
+	for (uint32_t fi = 0; fi < n; ++fi)
+	{
+		auto const & f = m.functions[fi];
+		for (auto const & ins : f.values())
+		{
+			if (ins.dead)
+				continue;
+
+			bool local = true;
+			switch (ins.op)
+			{
+			case IROp::SetF:
+			case IROp::SetE:
+				local = IsLocalObject(f, ins.operands[0]);
+				break;
+			case IROp::Bulk:
+				local = VM::BulkFormOf(uint8_t(ins.aux)) == VM::BulkForm::Reduce || IsLocalObject(f, ins.operands[0]);
+				break;
+			case IROp::Call:
+			case IROp::PMap:
+			case IROp::PReduce:
+			{
+				auto const callee = (ins.op == IROp::Call) ? DirectCallee(f, ins) : DirectApplied(f, ins);
+				if (callee >= 0 && uint64_t(callee) < n)
+					uses[fi].push_back (uint32_t(callee));
+				else
+					local = false;
+				break;
+			}
+			case IROp::Io:
+				local = false;
+				break;
+			case IROp::Global:
+				// As pure as its initializer, which runs (at most) once
+				if (ins.aux < m.globals.size() && m.globals[ins.aux].initializer < n)
+					uses[fi].push_back (m.globals[ins.aux].initializer);
+				else
+					local = false;
+				break;
+			default:
+				break;
+			}
+			if (!local)
+			{
+				ret[fi] = 0;
+				break;
+			}
+		}
+	}
+
+	// The greatest fixed point: pure until shown to use something impure,
+	// so that (mutually) recursive functions can be pure.
+	for (bool changed = true; changed; )
+	{
+		changed = false;
+		for (uint32_t fi = 0; fi < n; ++fi)
+			if (ret[fi])
+				for (auto g : uses[fi])
+					if (!ret[g])
+					{
+						ret[fi] = 0;
+						changed = true;
+						break;
+					}
+	}
+	return ret;
+}
+
+//----------------------------------------------------------------------
+
+uint32_t PlanParallelOps (IRModule & m, Type::STContainer const & types)
+{
+	auto const pure = FindPureFunctions(m);
+	auto const heap_readers = FindHeapGlobalReaders(m, types);
+
+	uint32_t ret = 0;
+	for (auto & f : m.functions)
+		for (ValueID v = 1; v < f.values().size(); ++v)
+		{
+			auto & ins = f[v];
+			if (ins.dead || (ins.op != IROp::PMap && ins.op != IROp::PReduce))
+				continue;
+
+			ins.aux = CanRunInParallel(m, types, pure, heap_readers, f, ins) ? 1 : 0;
+			if (0 == ins.aux && ExpandParallelOp(f, types, v))
+				ret += 1;
+		}
+	return ret;
+}
+
+//----------------------------------------------------------------------
+
+uint32_t MarkPureFunctions (IRModule & m)
+{
+	auto const pure = FindPureFunctions(m);
+
+	uint32_t ret = 0;
+	for (size_t i = 0; i < m.functions.size(); ++i)
+	{
+		auto & f = m.functions[i];
+		auto const others = uint16_t(f.flags() & ~VM::Function::msc_Pure);
+		f.setFlags (pure[i] ? uint16_t(others | VM::Function::msc_Pure) : others);
+		ret += pure[i] ? 1 : 0;
+	}
+	return ret;
+}
+
+//======================================================================
+
+void OptimizeModule (IRModule & m, Type::STContainer & types, std::vector<PassReport> * out_reports, InlineOptions const & options)
+{
+	auto size = [&m] () {
+		int64_t ret = 0;
+		for (auto const & f : m.functions)
+			ret += f.instructionCount();
+		return ret;
+	};
+
+	for (auto & f : m.functions)
+		Optimize (f, types, out_reports);
+
+	auto before = size();
+	auto start = std::chrono::steady_clock::now();
+	auto changes = PlanParallelOps(m, types);
+	Record (out_reports, "parallel-plan", changes, before - size(), NanosecondsSince(start));
+
+	before = size();
+	start = std::chrono::steady_clock::now();
+	changes = SpecializeCalls(m, types);
+	Record (out_reports, "specialize", changes, before - size(), NanosecondsSince(start));
+
+	before = size();
+	start = std::chrono::steady_clock::now();
+	changes = InlineCalls(m, options);
+	for (auto & f : m.functions)
+		f.compact ();
+	Record (out_reports, "inline", changes, before - size(), NanosecondsSince(start));
+
+	for (auto & f : m.functions)
+		Optimize (f, types, out_reports);
+
+	start = std::chrono::steady_clock::now();
+	changes = MarkPureFunctions(m);
+	Record (out_reports, "mark-pure", changes, 0, NanosecondsSince(start));
+}
+
+//----------------------------------------------------------------------
+//======================================================================
+
+	}	// namespace CodeGen
+}	// namespace UPL
+
+//======================================================================
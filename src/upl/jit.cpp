@@ -0,0 +1,464 @@
+//======================================================================
+
+#include <upl/jit.hpp>
+
+#include <chrono>
+#include <cstring>
+#include <limits>
+
+#if UPL_JIT_AVAILABLE
+	#include <sys/mman.h>
+	#include <unistd.h>
+#endif
+
+//======================================================================
+
+namespace UPL {
+	namespace VM {
+
+//======================================================================
+
+char const * JitModeName (JitMode mode)
+{
+	switch (mode)
+	{
+	case JitMode::Off:		return "off";
+	case JitMode::Baseline:	return "baseline";
+	}
+	return "???";
+}
+
+//----------------------------------------------------------------------
+
+bool ParseJitMode (char const * name, JitMode & out_mode)
+{
+	if (0 == strcmp(name, "off"))
+		out_mode = JitMode::Off;
+	else if (0 == strcmp(name, "baseline"))
+		out_mode = JitMode::Baseline;
+	else
+		return false;
+	return true;
+}
+
+//======================================================================
+
+namespace {
+
+#if UPL_JIT_AVAILABLE
+
+//----------------------------------------------------------------------
+// The templates. While native code runs, rbx points at R[0] and r12 at
+// where the result goes; rax, rcx, rdx, xmm0 and xmm1 are scratch. Every
+// register operand is a memory operand, [rbx + 8 * r].
+
+class X64Emitter
+{
+public:
+	explicit X64Emitter (uint32_t pc_count)
+		: m_code ()
+		, m_pc_offsets (pc_count, 0)
+		, m_branches ()
+		, m_exits ()
+	{
+	}
+
+	std::vector<uint8_t> & code () {return m_code;}
+	size_t size () const {return m_code.size();}
+
+	void bytes (std::initializer_list<uint8_t> bs) {m_code.insert (m_code.end(), bs);}
+	void u32 (uint32_t v) {for (int i = 0; i < 4; ++i) m_code.push_back (uint8_t(v >> (8 * i)));}
+	void u64 (uint64_t v) {for (int i = 0; i < 8; ++i) m_code.push_back (uint8_t(v >> (8 * i)));}
+
+	// An instruction whose last operand is [rbx + 8 * r]
+	void mem (std::initializer_list<uint8_t> opcode, uint8_t modrm_reg, unsigned r)
+	{
+		bytes (opcode);
+		m_code.push_back (uint8_t(0x80 | (modrm_reg << 3) | 3));	// mod 10, rm rbx: [rbx + disp32]
+		u32 (8 * r);
+	}
+
+	void load (unsigned r)		{mem ({0x48, 0x8B}, 0, r);}			// mov rax, R[r]
+	void loadRcx (unsigned r)	{mem ({0x48, 0x8B}, 1, r);}			// mov rcx, R[r]
+	void store (unsigned r)		{mem ({0x48, 0x89}, 0, r);}			// mov R[r], rax
+	void storeRdx (unsigned r)	{mem ({0x48, 0x89}, 2, r);}			// mov R[r], rdx
+	void loadReal (unsigned r)	{mem ({0xF2, 0x0F, 0x10}, 0, r);}	// movsd xmm0, R[r]
+	void storeReal (unsigned r)	{mem ({0xF2, 0x0F, 0x11}, 0, r);}	// movsd R[r], xmm0
+
+	// setcc al; movzx eax, al; mov R[a], rax
+	void storeFlag (uint8_t setcc, unsigned a)
+	{
+		bytes ({0x0F, setcc, 0xC0, 0x0F, 0xB6, 0xC0});
+		store (a);
+	}
+
+	void markPc (uint32_t pc) {m_pc_offsets[pc] = uint32_t(m_code.size());}
+
+	// A jump (jmp, or a jcc with its second opcode byte) to bytecode "pc"
+	void jumpTo (std::initializer_list<uint8_t> opcode, uint32_t pc)
+	{
+		bytes (opcode);
+		m_branches.push_back ({uint32_t(m_code.size()), pc});
+		u32 (0);
+	}
+
+	// A jcc (second opcode byte) out to the interpreter at "pc"
+	void exitIf (uint8_t jcc, uint32_t pc)
+	{
+		bytes ({0x0F, jcc});
+		m_exits.push_back ({uint32_t(m_code.size()), pc});
+		u32 (0);
+	}
+
+	// The exit stubs ("mov eax, pc" then to the epilogue), and the branches' targets
+	void finish (size_t epilogue)
+	{
+		for (auto const & e : m_exits)
+		{
+			patch (e.at, m_code.size());
+			bytes ({0xB8});
+			u32 (e.pc);
+			bytes ({0xE9});
+			u32 (uint32_t(int32_t(epilogue) - int32_t(m_code.size() + 4)));
+		}
+		for (auto const & b : m_branches)
+			patch (b.at, m_pc_offsets[b.pc]);
+	}
+
+	uint32_t pcOffset (uint32_t pc) const {return m_pc_offsets[pc];}
+
+private:
+	struct Fixup {uint32_t at; uint32_t pc;};
+
+	void patch (uint32_t at, size_t target)
+	{
+		auto const rel = uint32_t(int32_t(target) - int32_t(at + 4));
+		for (int i = 0; i < 4; ++i)
+			m_code[at + i] = uint8_t(rel >> (8 * i));
+	}
+
+private:
+	std::vector<uint8_t> m_code;
+	std::vector<uint32_t> m_pc_offsets;
+	std::vector<Fixup> m_branches;
+	std::vector<Fixup> m_exits;
+};
+
+//----------------------------------------------------------------------
+// Emits one instruction's template; false if there's none (and the
+// instruction is left to the interpreter.)
+
+bool EmitTemplate (X64Emitter & x, Module const & module, Instruction ins, uint32_t pc, uint32_t code_size)
+{
+	auto const a = GetA(ins), b = GetB(ins), c = GetC(ins);
+	auto const target = int64_t(pc) + 1 + GetSBx(ins);
+
+	switch (GetOp(ins))
+	{
+	case Op::Nop:		break;
+	case Op::Move:		x.load (b); x.store (a); break;
+	case Op::LoadI:		x.mem ({0x48, 0xC7}, 0, a); x.u32 (uint32_t(GetSBx(ins))); break;	// mov qword R[a], imm32
+	case Op::LoadNil:	x.mem ({0x48, 0xC7}, 0, a); x.u32 (0); break;
+	case Op::LoadK:		x.bytes ({0x48, 0xB8}); x.u64 (module.constants()[GetBx(ins)].u); x.store (a); break;	// mov rax, imm64
+	case Op::LoadF:
+		x.bytes ({0x48, 0xB8});
+		x.u64 (uint64_t(reinterpret_cast<uintptr_t>(module.functions() + GetBx(ins))));
+		x.store (a);
+		break;
+
+	case Op::AddI:		x.load (b); x.mem ({0x48, 0x03}, 0, c); x.store (a); break;			// add rax, R[c]
+	case Op::SubI:		x.load (b); x.mem ({0x48, 0x2B}, 0, c); x.store (a); break;			// sub rax, R[c]
+	case Op::MulI:		x.load (b); x.mem ({0x48, 0x0F, 0xAF}, 0, c); x.store (a); break;	// imul rax, R[c]
+	case Op::NegI:		x.load (b); x.bytes ({0x48, 0xF7, 0xD8}); x.store (a); break;		// neg rax
+
+	case Op::DivI:
+	case Op::ModI:
+		// Zero (an error) and -1 (which idiv can trap on) are the interpreter's.
+		x.loadRcx (c);
+		x.bytes ({0x48, 0x85, 0xC9});						// test rcx, rcx
+		x.exitIf (0x84, pc);								// je
+		x.bytes ({0x48, 0x83, 0xF9, 0xFF});					// cmp rcx, -1
+		x.exitIf (0x84, pc);
+		x.load (b);
+		x.bytes ({0x48, 0x99, 0x48, 0xF7, 0xF9});			// cqo; idiv rcx
+		if (GetOp(ins) == Op::DivI)
+			x.store (a);
+		else
+			x.storeRdx (a);
+		break;
+
+	case Op::AddR:		x.loadReal (b); x.mem ({0xF2, 0x0F, 0x58}, 0, c); x.storeReal (a); break;	// addsd
+	case Op::SubR:		x.loadReal (b); x.mem ({0xF2, 0x0F, 0x5C}, 0, c); x.storeReal (a); break;	// subsd
+	case Op::MulR:		x.loadReal (b); x.mem ({0xF2, 0x0F, 0x59}, 0, c); x.storeReal (a); break;	// mulsd
+	case Op::DivR:		x.loadReal (b); x.mem ({0xF2, 0x0F, 0x5E}, 0, c); x.storeReal (a); break;	// divsd
+	case Op::NegR:		x.load (b); x.bytes ({0x48, 0x0F, 0xBA, 0xF8, 0x3F}); x.store (a); break;	// btc rax, 63
+
+	case Op::EqI:		x.load (b); x.mem ({0x48, 0x3B}, 0, c); x.storeFlag (0x94, a); break;	// cmp; sete
+	case Op::LtI:		x.load (b); x.mem ({0x48, 0x3B}, 0, c); x.storeFlag (0x9C, a); break;	// setl
+	case Op::LeI:		x.load (b); x.mem ({0x48, 0x3B}, 0, c); x.storeFlag (0x9E, a); break;	// setle
+
+	// ucomisd; unordered (a NaN) sets ZF, PF and CF, and must give false.
+	case Op::EqR:
+		x.loadReal (b);
+		x.mem ({0x66, 0x0F, 0x2E}, 0, c);					// ucomisd xmm0, R[c]
+		x.bytes ({0x0F, 0x94, 0xC0, 0x0F, 0x9B, 0xC1, 0x20, 0xC8});	// sete al; setnp cl; and al, cl
+		x.bytes ({0x0F, 0xB6, 0xC0});
+		x.store (a);
+		break;
+	case Op::LtR:		x.loadReal (c); x.mem ({0x66, 0x0F, 0x2E}, 0, b); x.storeFlag (0x97, a); break;	// c > b: seta
+	case Op::LeR:		x.loadReal (c); x.mem ({0x66, 0x0F, 0x2E}, 0, b); x.storeFlag (0x93, a); break;	// c >= b: setae
+
+	case Op::Not:		x.mem ({0x48, 0x83}, 7, b); x.bytes ({0x00}); x.storeFlag (0x94, a); break;		// cmp R[b], 0; sete
+	case Op::IToR:		x.mem ({0xF2, 0x48, 0x0F, 0x2A}, 0, b); x.storeReal (a); break;				// cvtsi2sd xmm0, R[b]
+	case Op::RToI:
+		// Out of range (or NaN) gives 1 << 63; the interpreter saturates.
+		x.mem ({0xF2, 0x48, 0x0F, 0x2C}, 0, b);				// cvttsd2si rax, R[b]
+		x.bytes ({0x48, 0xB9});								// mov rcx, 1 << 63
+		x.u64 (uint64_t(1) << 63);
+		x.bytes ({0x48, 0x39, 0xC8});						// cmp rax, rcx
+		x.exitIf (0x84, pc);
+		x.store (a);
+		break;
+
+	case Op::Jmp:
+		if (target < 0 || target >= code_size)
+			return false;
+		x.jumpTo ({0xE9}, uint32_t(target));
+		break;
+	case Op::JmpT:
+	case Op::JmpF:
+		if (target < 0 || target >= code_size)
+			return false;
+		x.mem ({0x48, 0x83}, 7, a); x.bytes ({0x00});		// cmp qword R[a], 0
+		x.jumpTo ({0x0F, uint8_t(GetOp(ins) == Op::JmpT ? 0x85 : 0x84)}, uint32_t(target));
+		break;
+
+	case Op::Ret:
+		x.load (a);
+		x.bytes ({0x49, 0x89, 0x04, 0x24});					// mov [r12], rax
+		x.bytes ({0xB8}); x.u32 (Jit::msc_Returned);
+		return true;	// (The caller adds the jump to the epilogue)
+	case Op::RetNil:
+		x.bytes ({0x49, 0xC7, 0x04, 0x24}); x.u32 (0);		// mov qword [r12], 0
+		x.bytes ({0xB8}); x.u32 (Jit::msc_Returned);
+		return true;
+
+	default:
+		return false;
+	}
+	return true;
+}
+
+//----------------------------------------------------------------------
+
+bool HasTemplate (Op op)
+{
+	switch (op)
+	{
+	case Op::BoxB: case Op::BoxI: case Op::BoxR: case Op::BoxY: case Op::BoxC:
+	case Op::UnboxB: case Op::UnboxI: case Op::UnboxR: case Op::UnboxY: case Op::UnboxC: case Op::TypeOf:
+	case Op::New: case Op::NewN: case Op::GetF: case Op::SetF: case Op::GetE: case Op::SetE: case Op::Len:
+	case Op::Bulk: case Op::PMap: case Op::PReduce: case Op::Io: case Op::Call: case Op::TailCall: case Op::GetG:
+		return false;
+	default:
+		return int(op) < OpCount;
+	}
+}
+
+#endif	// UPL_JIT_AVAILABLE
+
+//----------------------------------------------------------------------
+
+}	// namespace
+
+//======================================================================
+
+Jit::Jit (Module const & module, JitOptions const & options)
+	: m_module (module)
+	, m_options (options)
+	, m_stats ()
+	, m_entries (module.functionCount())
+	, m_clock (0)
+{
+	if (!UPL_JIT_AVAILABLE)
+		m_options.mode = JitMode::Off;
+
+	for (auto & e : m_entries)
+		e.threshold = (JitMode::Off == m_options.mode) ? std::numeric_limits<uint32_t>::max() : m_options.threshold;
+}
+
+//----------------------------------------------------------------------
+
+Jit::~Jit ()
+{
+	for (uint32_t i = 0; i < m_entries.size(); ++i)
+		evict (i);
+}
+
+//----------------------------------------------------------------------
+
+void Jit::flush ()
+{
+	for (uint32_t i = 0; i < m_entries.size(); ++i)
+	{
+		evict (i);
+		m_entries[i].count = 0;
+	}
+}
+
+//----------------------------------------------------------------------
+
+void Jit::evict (uint32_t index)
+{
+	auto & e = m_entries[index];
+	if (nullptr == e.pages)
+		return;
+
+#if UPL_JIT_AVAILABLE
+	munmap (e.pages, e.size);
+#endif
+	m_stats.code_bytes -= e.size;
+	e.pages = nullptr;
+	e.code = nullptr;
+	e.size = 0;
+	e.count = 0;
+}
+
+//----------------------------------------------------------------------
+// Evicts the least recently entered functions until "size" more fits.
+
+bool Jit::makeRoom (size_t size)
+{
+	if (size > m_options.cache_capacity)
+		return false;
+
+	while (m_stats.code_bytes + size > m_options.cache_capacity)
+	{
+		uint32_t victim = uint32_t(m_entries.size());
+		for (uint32_t i = 0; i < m_entries.size(); ++i)
+			if (nullptr != m_entries[i].code && (victim == m_entries.size() || m_entries[i].last_entered < m_entries[victim].last_entered))
+				victim = i;
+		if (victim == m_entries.size())
+			return false;
+		evict (victim);
+		m_stats.evicted += 1;
+	}
+	return true;
+}
+
+//----------------------------------------------------------------------
+
+Jit::NativeCode Jit::compile (uint32_t index)
+{
+	auto & e = m_entries[index];
+	if (nullptr != e.code)
+		return e.code;
+
+#if UPL_JIT_AVAILABLE
+	auto const start = std::chrono::steady_clock::now();
+	auto const & f = m_module.function(index);
+
+	// Superinstructions are compiled one part at a time.
+	std::vector<Instruction> code (m_module.code(f), m_module.code(f) + f.code_size);
+	for (auto & ins : code)
+		ins = Unfused(ins);
+
+	auto reject = [&] () -> NativeCode {
+		e.threshold = std::numeric_limits<uint32_t>::max();
+		m_stats.rejected += 1;
+		return nullptr;
+	};
+
+	uint32_t covered = 0;
+	for (uint32_t pc = 0; pc < f.code_size; ++pc)
+		covered += HasTemplate(GetOp(code[pc])) ? 1 : 0;
+	if (0 == f.code_size || covered < m_options.min_coverage * f.code_size)
+		return reject();
+
+	// Prologue: save rbx and r12, keep R and out_result in them, and jump
+	// through the table to the code for "pc".
+	X64Emitter x (f.code_size);
+	x.bytes ({0x53, 0x41, 0x54});							// push rbx; push r12
+	x.bytes ({0x48, 0x89, 0xFB, 0x49, 0x89, 0xD4});			// mov rbx, rdi; mov r12, rdx
+	x.bytes ({0x89, 0xF6});									// mov esi, esi
+	x.bytes ({0x48, 0x8D, 0x05});							// lea rax, [rip + table]
+	auto const table_disp = x.size();
+	x.u32 (0);
+	x.bytes ({0xFF, 0x24, 0xF0});							// jmp [rax + rsi * 8]
+
+	std::vector<uint32_t> epilogue_jumps;
+	for (uint32_t pc = 0; pc < f.code_size; ++pc)
+	{
+		x.markPc (pc);
+		if (!EmitTemplate(x, m_module, code[pc], pc, f.code_size))
+		{
+			x.bytes ({0xB8});								// mov eax, pc
+			x.u32 (pc);
+		}
+		else if (GetOp(code[pc]) != Op::Ret && GetOp(code[pc]) != Op::RetNil)
+			continue;
+
+		x.bytes ({0xE9});
+		epilogue_jumps.push_back (uint32_t(x.size()));
+		x.u32 (0);
+	}
+
+	auto const epilogue = x.size();
+	x.bytes ({0x41, 0x5C, 0x5B, 0xC3});						// pop r12; pop rbx; ret
+	x.finish (epilogue);
+	for (auto at : epilogue_jumps)
+	{
+		auto const rel = uint32_t(int32_t(epilogue) - int32_t(at + 4));
+		memcpy (x.code().data() + at, &rel, 4);
+	}
+
+	// The entry table, aligned, after the code
+	while (0 != x.size() % 8)
+		x.bytes ({0xCC});
+	auto const table = x.size();
+	auto const rel = uint32_t(int32_t(table) - int32_t(table_disp + 4));
+	memcpy (x.code().data() + table_disp, &rel, 4);
+	x.code().resize (table + 8 * size_t(f.code_size));
+
+	// Write, then make it executable (and read-only.)
+	auto const page = size_t(sysconf(_SC_PAGESIZE));
+	auto const size = (x.size() + page - 1) / page * page;
+	if (!makeRoom(size))
+		return reject();
+
+	void * pages = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (MAP_FAILED == pages)
+		return reject();
+
+	auto const base = static_cast<uint8_t *>(pages);
+	memcpy (base, x.code().data(), x.size());
+	for (uint32_t pc = 0; pc < f.code_size; ++pc)
+	{
+		auto const address = uint64_t(reinterpret_cast<uintptr_t>(base + x.pcOffset(pc)));
+		memcpy (base + table + 8 * size_t(pc), &address, 8);
+	}
+	if (0 != mprotect(pages, size, PROT_READ | PROT_EXEC))
+	{
+		munmap (pages, size);
+		return reject();
+	}
+
+	e.pages = pages;
+	e.size = size;
+	e.code = reinterpret_cast<NativeCode>(pages);
+	m_stats.code_bytes += size;
+	m_stats.compiled += 1;
+	m_stats.compile_seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	return e.code;
+#else
+	e.threshold = std::numeric_limits<uint32_t>::max();
+	return nullptr;
+#endif
+}
+
+//======================================================================
+
+	}	// namespace VM
+}	// namespace UPL
+
+//======================================================================
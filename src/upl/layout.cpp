@@ -0,0 +1,213 @@
+//======================================================================
+
+#include <upl/layout.hpp>
+
+#include <algorithm>
+
+//======================================================================
+
+namespace UPL {
+	namespace Type {
+
+//======================================================================
+
+LayoutEngine::LayoutEngine (STContainer const & types, Size max_inline_size)
+	: m_types (types)
+	, m_max_inline_size (max_inline_size)
+	, m_layouts ()
+	, m_valid ()
+	, m_computed_count (0)
+{
+}
+
+//----------------------------------------------------------------------
+
+Layout const & LayoutEngine::layout (ID id)
+{
+	if (id >= m_layouts.size())
+	{
+		auto const n = UPL_MAX(m_types.size(), size_t(id) + 1);
+		m_layouts.resize (n);
+		m_valid.resize (n, false);
+	}
+
+	if (!m_valid[id])
+	{
+		// Types only ever refer to types created before them, so the
+		// recursion below never needs to grow the tables again.
+		auto l = compute(id);
+		m_layouts[id] = std::move(l);
+		m_valid[id] = true;
+		m_computed_count += 1;
+	}
+
+	return m_layouts[id];
+}
+
+//----------------------------------------------------------------------
+
+Layout LayoutEngine::compute (ID id)
+{
+	switch (m_types.tag(id))
+	{
+	case Tag::INVALID:	return unboxed(0);
+	case Tag::Nil:		return unboxed(0);
+	case Tag::Bool:		return unboxed(sizeof(Bool));
+	case Tag::Byte:		return unboxed(sizeof(uint8_t));
+	case Tag::Char:		return unboxed(sizeof(Char));
+	case Tag::Int:		return unboxed(sizeof(Int));
+	case Tag::Real:		return unboxed(sizeof(Real));
+	case Tag::String:	return boxed();
+	case Tag::Any:		return computeAny();
+	case Tag::Variant:	return computeVariant(m_types.getVariantTypes(id));
+	case Tag::Array:	return computeArray(m_types.getArraySize(id), m_types.getArrayType(id));
+	case Tag::Vector:	return boxed();
+	case Tag::Map:		return boxed();
+	case Tag::Tuple:	return computeFields(m_types.getTupleTypes(id));
+	case Tag::Package:	return computeFields(m_types.getPackageTypes(id));
+	case Tag::Function:	return boxed();	// A reference to a closure object
+	}
+
+	UPL_UNREACHABLE;
+}
+
+//----------------------------------------------------------------------
+// A variant is a small index into its (sorted) list of alternatives,
+// followed by a payload big enough for the largest of them.
+Layout LayoutEngine::computeVariant (std::vector<ID> const & alternatives)
+{
+	Layout ret;
+
+	ret.discriminator_size = (alternatives.size() <= 0x100) ? 1 : (alternatives.size() <= 0x10000) ? 2 : 4;
+
+	Size payload_size = 0, payload_align = 1;
+	for (auto alt : alternatives)
+	{
+		auto const & l = layout(alt);
+		payload_size = UPL_MAX(payload_size, l.size);
+		payload_align = UPL_MAX(payload_align, l.alignment);
+		ret.has_pointers = ret.has_pointers || l.has_pointers;
+	}
+
+	auto const payload_offset = RoundUp(ret.discriminator_size, payload_align);
+	ret.alignment = UPL_MAX(payload_align, ret.discriminator_size);
+	ret.size = RoundUp(payload_offset + payload_size, ret.alignment);
+	ret.field_offsets = {0, payload_offset};
+
+	return ret;
+}
+
+//----------------------------------------------------------------------
+// "Any" can hold anything, so it's the full type ID plus a word that is
+// either an unboxed scalar or a reference to a boxed value.
+Layout LayoutEngine::computeAny ()
+{
+	Layout ret;
+
+	ret.discriminator_size = sizeof(ID);
+	ret.alignment = UPL_MAX(Size(sizeof(ID)), msc_PointerSize);
+	ret.size = RoundUp(sizeof(ID), ret.alignment) + msc_PointerSize;
+	ret.has_pointers = true;
+	ret.field_offsets = {0, RoundUp(sizeof(ID), ret.alignment)};
+
+	return ret;
+}
+
+//----------------------------------------------------------------------
+
+Layout LayoutEngine::computeArray (Size count, ID elem_type)
+{
+	auto const & e = layout(elem_type);
+
+	Layout ret;
+	ret.alignment = e.alignment;
+	ret.has_pointers = e.has_pointers && count > 0;
+	auto const inline_size = uint64_t(count) * RoundUp(e.size, e.alignment);
+	ret.size = Size(UPL_MIN(inline_size, uint64_t(0xFFFFFFFFU)));
+
+	return boxedIfTooBig(std::move(ret), inline_size);
+}
+
+//----------------------------------------------------------------------
+// Fields are placed in order of decreasing alignment (ties keep their
+// declaration order), which leaves padding only at the very end.
+Layout LayoutEngine::computeFields (std::vector<ID> const & field_types)
+{
+	auto const n = field_types.size();
+
+	std::vector<size_t> order (n);
+	for (size_t i = 0; i < n; ++i)
+		order[i] = i;
+
+	std::vector<Layout const *> fields (n);
+	for (size_t i = 0; i < n; ++i)
+		fields[i] = &layout(field_types[i]);
+
+	std::stable_sort (order.begin(), order.end(),
+		[&fields](size_t a, size_t b){return fields[a]->alignment > fields[b]->alignment;});
+
+	Layout ret;
+	ret.field_offsets.resize (n);
+
+	uint64_t offset = 0;
+	for (auto i : order)
+	{
+		auto const & f = *fields[i];
+		offset = RoundUp(Size(offset), f.alignment);
+		ret.field_offsets[i] = Size(offset);
+		offset += f.size;
+		ret.alignment = UPL_MAX(ret.alignment, f.alignment);
+		ret.has_pointers = ret.has_pointers || f.has_pointers;
+		if (offset > 0xFFFFFFFFU)
+			break;
+	}
+
+	auto const inline_size = (offset + ret.alignment - 1) / ret.alignment * ret.alignment;
+	ret.size = Size(UPL_MIN(inline_size, uint64_t(0xFFFFFFFFU)));
+
+	return boxedIfTooBig(std::move(ret), inline_size);
+}
+
+//----------------------------------------------------------------------
+
+Layout LayoutEngine::boxed () const
+{
+	Layout ret;
+	ret.size = msc_PointerSize;
+	ret.alignment = msc_PointerSize;
+	ret.is_boxed = true;
+	ret.has_pointers = true;
+	return ret;
+}
+
+//----------------------------------------------------------------------
+
+Layout LayoutEngine::unboxed (Size size) const
+{
+	Layout ret;
+	ret.size = size;
+	ret.alignment = UPL_MAX(size, Size(1));
+	return ret;
+}
+
+//----------------------------------------------------------------------
+// A boxed aggregate keeps its inline field offsets; they are now offsets
+// into the heap object instead of into the enclosing value.
+Layout LayoutEngine::boxedIfTooBig (Layout l, uint64_t inline_size) const
+{
+	if (inline_size <= m_max_inline_size)
+		return l;
+
+	auto ret = boxed();
+	ret.heap_size = l.size;
+	ret.field_offsets = std::move(l.field_offsets);
+	return ret;
+}
+
+//----------------------------------------------------------------------
+//======================================================================
+
+	}	// namespace Type
+}	// namespace UPL
+
+//======================================================================
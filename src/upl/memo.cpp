@@ -0,0 +1,329 @@
+//======================================================================
+
+#include <upl/memo.hpp>
+#include <upl/parallel.hpp>
+
+#include <cassert>
+#include <cstring>
+
+//======================================================================
+
+namespace UPL {
+	namespace VM {
+
+//======================================================================
+
+MemoTable::MemoTable (unsigned arity, uint32_t capacity)
+	: m_arity (arity)
+	, m_capacity (UPL_MAX(capacity, 1U))
+	, m_entries ()
+	, m_keys ()
+	, m_index ()
+	, m_used (0)
+	, m_hand (0)
+	, m_stamp (0)
+	, m_counts ()
+{
+	clear ();
+}
+
+//----------------------------------------------------------------------
+
+bool MemoTable::find (Reg const * args, Reg & out_result, MemoReservation * out_reservation)
+{
+	if (m_entries.empty())
+		return false;
+
+	auto const hash = Hash(args, m_arity);
+	auto const mask = uint32_t(m_index.size() - 1);
+	auto i = uint32_t(hash) & mask;
+	for (; 0 != m_index[i]; i = (i + 1) & mask)
+	{
+		auto const slot = m_index[i] - 1;
+		auto & e = m_entries[slot];
+		if (e.hash != hash || !e.filled)
+			continue;
+		auto const key = m_keys.data() + size_t(slot) * m_arity;
+		unsigned j = 0;
+		while (j < m_arity && key[j].u == args[j].u)
+			++j;
+		if (j == m_arity)
+		{
+			e.referenced = true;
+			out_result = e.result;
+			m_counts.hits += 1;
+			m_counts.saved += e.cost;
+			return true;
+		}
+	}
+
+	m_counts.misses += 1;
+	if (nullptr == out_reservation)
+		return false;
+
+	auto const slot = (m_used < m_capacity) ? m_used++ : evict();
+	auto & e = m_entries[slot];
+	e.hash = hash;
+	e.result = Reg::Nil();
+	e.stamp = ++m_stamp;
+	e.cost = 0;
+	e.filled = false;
+	e.referenced = true;		// See evict
+	for (unsigned j = 0; j < m_arity; ++j)
+		m_keys[size_t(slot) * m_arity + j] = args[j];
+
+	i = uint32_t(hash) & mask;
+	while (0 != m_index[i])
+		i = (i + 1) & mask;
+	m_index[i] = slot + 1;
+
+	out_reservation->slot = slot;
+	out_reservation->stamp = e.stamp;
+	return false;
+}
+
+//----------------------------------------------------------------------
+
+void MemoTable::fill (MemoReservation const & reservation, Reg result, uint64_t calls)
+{
+	if (reservation.slot >= m_entries.size())
+		return;
+	auto & e = m_entries[reservation.slot];
+	if (e.stamp == reservation.stamp && !e.filled)
+	{
+		e.result = result;
+		e.cost = uint32_t(UPL_MIN(calls - reservation.calls, uint64_t(UINT32_MAX)));
+		e.filled = true;
+	}
+}
+
+//----------------------------------------------------------------------
+
+void MemoTable::clear ()
+{
+	// At most half full, so the probes stay short.
+	size_t index_size = 2;
+	while (index_size < 2 * size_t(m_capacity))
+		index_size *= 2;
+
+	Entry empty;
+	memset (&empty, 0, sizeof(empty));
+	m_entries.assign (m_capacity, empty);
+	m_keys.assign (size_t(m_capacity) * m_arity, Reg::Nil());
+	m_index.assign (index_size, 0);
+	m_used = 0;
+	m_hand = 0;
+	m_counts = Counts();
+}
+
+//----------------------------------------------------------------------
+
+void MemoTable::release ()
+{
+	std::vector<Entry>().swap (m_entries);
+	std::vector<Reg>().swap (m_keys);
+	std::vector<uint32_t>().swap (m_index);
+	m_used = 0;
+	m_hand = 0;
+}
+
+//----------------------------------------------------------------------
+
+uint64_t MemoTable::Hash (Reg const * args, unsigned arity)
+{
+	uint64_t h = arity;
+	for (unsigned i = 0; i < arity; ++i)
+	{
+		h = (h ^ args[i].u) * 0x9E3779B97F4A7C15ULL;
+		h ^= h >> 29;
+	}
+	h ^= h >> 33;
+	h *= 0xFF51AFD7ED558CCDULL;
+	h ^= h >> 33;
+	return h;
+}
+
+//----------------------------------------------------------------------
+// The hand clears the "referenced" bits it passes, and stops at the first
+// entry that didn't have it; a reservation counts as referenced, so a
+// call gets a full turn of the hand to return.
+
+uint32_t MemoTable::evict ()
+{
+	for (;;)
+	{
+		auto & e = m_entries[m_hand];
+		auto const slot = m_hand;
+		m_hand = (m_hand + 1) % m_capacity;
+		if (e.referenced)
+		{
+			e.referenced = false;
+			continue;
+		}
+
+		unindex (slot);
+		m_counts.evictions += 1;
+		return slot;
+	}
+}
+
+//----------------------------------------------------------------------
+// Linear probing without tombstones: the entries after the hole that
+// could live in it (their home is at or before it, going round) are moved
+// back, one at a time, until there's a gap.
+
+void MemoTable::unindex (uint32_t slot)
+{
+	auto const mask = uint32_t(m_index.size() - 1);
+	auto i = uint32_t(m_entries[slot].hash) & mask;
+	while (m_index[i] != slot + 1)
+	{
+		assert (0 != m_index[i]);
+		i = (i + 1) & mask;
+	}
+
+	for (auto j = (i + 1) & mask; 0 != m_index[j]; j = (j + 1) & mask)
+	{
+		auto const home = uint32_t(m_entries[m_index[j] - 1].hash) & mask;
+		bool const stays = (i <= j) ? (i < home && home <= j) : (i < home || home <= j);
+		if (!stays)
+		{
+			m_index[i] = m_index[j];
+			i = j;
+		}
+	}
+	m_index[i] = 0;
+}
+
+//======================================================================
+
+Memo::Memo (Module const & module, MemoConfig const & config)
+	: m_module (module)
+	, m_config (config)
+	, m_states ()
+{
+}
+
+//----------------------------------------------------------------------
+
+Memo::~Memo ()
+{
+}
+
+//----------------------------------------------------------------------
+
+MemoTable const * Memo::table (uint32_t index) const
+{
+	if (index >= m_states.size())
+		return nullptr;
+	auto const & s = m_states[index];
+	return (Status::On == s.status || Status::Trial == s.status || Status::Kept == s.status) ? s.table.get() : nullptr;
+}
+
+//----------------------------------------------------------------------
+
+void Memo::clear ()
+{
+	for (auto & s : m_states)
+	{
+		s.status = Status::Unknown;
+		s.calls = 0;
+		s.checked = MemoTable::Counts();
+		if (s.table)
+			s.table->release ();
+	}
+}
+
+//----------------------------------------------------------------------
+// Everything but the calls to functions whose tables are on for good, or
+// that will never have one.
+
+MemoTable * Memo::decide (uint32_t index)
+{
+	if (MemoConfig::Mode::Off == m_config.mode)
+		return nullptr;
+	if (index >= m_states.size())
+		m_states.resize (m_module.functionCount());
+
+	auto & s = m_states[index];
+	switch (s.status)
+	{
+	case Status::Unknown:
+	{
+		auto const & f = m_module.function(index);
+		auto const & types = m_module.types();
+		bool scalars = Type::Tag::Function == types.tag(f.type) &&
+			Parallel::IsScalar(types, types.getFunctionReturnType(f.type));
+		for (auto p : types.getFunctionParamTypes(f.type))
+			scalars = scalars && Parallel::IsScalar(types, p);
+
+		if (!scalars || 0 == (f.flags & Function::msc_Pure))
+			s.status = Status::Never;
+		else if (0 != (f.flags & Function::msc_Memoize))
+			s.status = Status::On;
+		else if (MemoConfig::Mode::Profile == m_config.mode)
+			s.status = Status::Counting;
+		else
+			s.status = Status::Never;
+
+		if (Status::Counting != s.status)
+			break;
+	}
+	// Fall through
+	case Status::Counting:
+		if (++s.calls < m_config.profile_calls)
+			return nullptr;
+		s.status = Status::Trial;
+		s.calls = 0;
+		if (s.table)
+			s.table->clear ();
+		else
+			s.table.reset (new MemoTable(m_module.function(index).param_count, m_config.capacity));
+		return s.table.get();
+
+	case Status::Trial:
+	case Status::Kept:
+		if (++s.calls < ((Status::Trial == s.status) ? m_config.trial_calls : m_config.recheck_calls))
+			return s.table.get();
+		s.calls = 0;
+		if (worthIt(s.table->counts(), s.checked))
+		{
+			s.status = Status::Kept;
+			s.checked = s.table->counts();
+			return s.table.get();
+		}
+		s.status = Status::Never;
+		s.table->release ();
+		return nullptr;
+
+	default:
+		break;
+	}
+
+	// Just turned on (the tables of those on are found in tableFor)
+	if (Status::On != s.status)
+		return nullptr;
+	if (s.table)
+		s.table->clear ();
+	else
+		s.table.reset (new MemoTable(m_module.function(index).param_count, m_config.capacity));
+	return s.table.get();
+}
+
+//----------------------------------------------------------------------
+// Of the calls since "since" (the table's counts as of the last check, or
+// none before its trial), each hit counting for the calls it saved
+
+bool Memo::worthIt (MemoTable::Counts const & counts, MemoTable::Counts const & since) const
+{
+	auto const saved = counts.saved - since.saved;
+	auto const looked_up = (counts.hits - since.hits) + (counts.misses - since.misses);
+	return saved * 1000 >= uint64_t(m_config.min_hits_per_mille) * looked_up;
+}
+
+//======================================================================
+
+	}	// namespace VM
+}	// namespace UPL
+
+//======================================================================
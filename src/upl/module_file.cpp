@@ -0,0 +1,384 @@
+//======================================================================
+
+#include <upl/module_file.hpp>
+
+#include <cstring>
+
+#if !defined(_WIN32)
+	#include <fcntl.h>
+	#include <sys/mman.h>
+	#include <sys/stat.h>
+	#include <unistd.h>
+#endif
+
+//======================================================================
+
+namespace UPL {
+	namespace VM {
+
+//======================================================================
+
+static void AppendVarint (std::string & out, uint64_t v)
+{
+	while (v >= 0x80)
+	{
+		out += char(0x80 | (v & 0x7F));
+		v >>= 7;
+	}
+	out += char(v);
+}
+
+//----------------------------------------------------------------------
+
+static bool ReadVarint (uint8_t const * & p, uint8_t const * end, uint64_t & v)
+{
+	v = 0;
+	for (int shift = 0; shift < 64 && p < end; shift += 7)
+	{
+		auto const c = *p++;
+		v |= uint64_t(c & 0x7F) << shift;
+		if (0 == (c & 0x80))
+			return true;
+	}
+	return false;
+}
+
+//----------------------------------------------------------------------
+
+static void AppendSection (std::string & out, void const * data, size_t size, ModuleFileSection & section)
+{
+	auto const align = ModuleFileHeader::msc_SectionAlignment;
+	out.append (size_t((align - out.size() % align) % align), '\0');
+	section.offset = out.size();
+	section.size = size;
+	if (size > 0)
+		out.append (static_cast<char const *>(data), size);
+}
+
+//----------------------------------------------------------------------
+
+static bool IsValidSection (ModuleFileSection const & section, ModuleFileHeader const & header, size_t element_size)
+{
+	return
+		section.offset >= header.header_size &&
+		section.offset % ModuleFileHeader::msc_SectionAlignment == 0 &&
+		section.size <= header.file_size && section.offset <= header.file_size - section.size &&
+		section.size % element_size == 0 &&
+		section.size / element_size <= 0xFFFFFFFFU;
+}
+
+//----------------------------------------------------------------------
+
+static std::shared_ptr<void const> MapFile (char const * path, size_t & out_size, ModuleFileError & out_error)
+{
+	out_size = 0;
+
+#if defined(_WIN32)
+	// No mmap here (yet); read it all in.
+	FILE * f = fopen(path, "rb");
+	if (nullptr == f)
+	{
+		out_error = ModuleFileError::CantOpen;
+		return nullptr;
+	}
+
+	fseek (f, 0, SEEK_END);
+	auto const size = size_t(ftell(f));
+	fseek (f, 0, SEEK_SET);
+
+	std::shared_ptr<uint64_t> buffer (new uint64_t [size / 8 + 1], [](uint64_t * p){delete [] p;});
+	bool const ok = (fread(buffer.get(), 1, size, f) == size);
+	fclose (f);
+	if (!ok)
+	{
+		out_error = ModuleFileError::CantMap;
+		return nullptr;
+	}
+
+	out_size = size;
+	return std::shared_ptr<void const>(buffer, buffer.get());
+#else
+	int const fd = open(path, O_RDONLY);
+	if (fd < 0)
+	{
+		out_error = ModuleFileError::CantOpen;
+		return nullptr;
+	}
+
+	struct stat st;
+	if (0 != fstat(fd, &st) || st.st_size <= 0)
+	{
+		close (fd);
+		out_error = ModuleFileError::Truncated;
+		return nullptr;
+	}
+
+	auto const size = size_t(st.st_size);
+	void * p = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close (fd);
+	if (MAP_FAILED == p)
+	{
+		out_error = ModuleFileError::CantMap;
+		return nullptr;
+	}
+
+	out_size = size;
+	return std::shared_ptr<void const>(p, [size](void const * p){munmap (const_cast<void *>(p), size);});
+#endif
+}
+
+//======================================================================
+
+char const * ModuleFileErrorName (ModuleFileError err)
+{
+	switch (err)
+	{
+	case ModuleFileError::None:				return "no error";
+	case ModuleFileError::CantOpen:			return "can't open the file";
+	case ModuleFileError::CantWrite:		return "can't write the file";
+	case ModuleFileError::CantMap:			return "can't map (or read) the file";
+	case ModuleFileError::NotEmpty:			return "the module isn't empty";
+	case ModuleFileError::BadMagic:			return "not a UPL module";
+	case ModuleFileError::BadVersion:		return "unsupported module version";
+	case ModuleFileError::OtherOpcodes:		return "written by a build with other superinstructions";
+	case ModuleFileError::WrongByteOrder:	return "module was written with a different byte order";
+	case ModuleFileError::Truncated:		return "truncated or malformed module";
+	case ModuleFileError::BadTypes:			return "malformed type section";
+	case ModuleFileError::BadTables:		return "malformed function table";
+	case ModuleFileError::BadCode:			return "invalid bytecode";
+	}
+
+	UPL_UNREACHABLE;
+}
+
+//======================================================================
+
+void SerializeModule (Module const & module, std::string & out_bytes)
+{
+	auto const & types = module.types();
+	auto const & t = module.tables();
+
+	ModuleFileHeader header;
+	memset (&header, 0, sizeof(header));
+	memcpy (header.magic, "UPLM", 4);
+	header.version = ModuleFileHeader::msc_Version;
+	header.byte_order = ModuleFileHeader::msc_ByteOrderMark;
+	header.header_size = uint32_t(sizeof(header));
+	header.opcode_set = OpcodeSetID();
+
+	std::string type_bytes;
+	for (Type::ID id = 1; id < types.size(); ++id)
+	{
+		auto const packed = types.unpack(id).pack();
+		AppendVarint (type_bytes, packed.size());
+		type_bytes.append (reinterpret_cast<char const *>(packed.data()), packed.size());
+	}
+
+	out_bytes.assign (sizeof(header), '\0');
+	AppendSection (out_bytes, type_bytes.data(), type_bytes.size(), header.types);
+	AppendSection (out_bytes, t.functions, t.function_count * sizeof(Function), header.functions);
+	AppendSection (out_bytes, t.code, t.code_size * sizeof(Instruction), header.code);
+	AppendSection (out_bytes, t.constants, t.constant_count * sizeof(Reg), header.constants);
+	AppendSection (out_bytes, t.stack_maps, t.stack_map_count * sizeof(StackMap), header.stack_maps);
+	AppendSection (out_bytes, t.names, t.names_size, header.names);
+	AppendSection (out_bytes, t.globals, t.global_count * sizeof(Global), header.globals);
+	header.file_size = out_bytes.size();
+
+	memcpy (&out_bytes[0], &header, sizeof(header));
+}
+
+//----------------------------------------------------------------------
+
+ModuleFileError SaveModule (Module const & module, char const * path)
+{
+	std::string bytes;
+	SerializeModule (module, bytes);
+
+	FILE * f = fopen(path, "wb");
+	if (nullptr == f)
+		return ModuleFileError::CantOpen;
+
+	bool ok = (fwrite(bytes.data(), 1, bytes.size(), f) == bytes.size());
+	ok = (0 == fclose(f)) && ok;
+	return ok ? ModuleFileError::None : ModuleFileError::CantWrite;
+}
+
+//----------------------------------------------------------------------
+
+ModuleFileError LoadModule (char const * path, Module & out_module, bool verify_code)
+{
+	size_t size = 0;
+	auto err = ModuleFileError::None;
+	auto image = MapFile(path, size, err);
+	if (nullptr == image)
+		return err;
+
+	return LoadModuleImage(std::move(image), size, out_module, verify_code);
+}
+
+//----------------------------------------------------------------------
+
+ModuleFileError LoadModuleImage (std::shared_ptr<void const> image, size_t size, Module & out_module, bool verify_code)
+{
+	if (out_module.isImage() || out_module.functionCount() > 0 || out_module.codeSize() > 0 || out_module.constantCount() > 0)
+		return ModuleFileError::NotEmpty;
+
+	auto const base = static_cast<uint8_t const *>(image.get());
+	assert (0 == reinterpret_cast<uintptr_t>(base) % 8);
+
+	ModuleFileHeader header;
+	if (size < sizeof(header))
+		return ModuleFileError::Truncated;
+	memcpy (&header, base, sizeof(header));
+
+	if (0 != memcmp(header.magic, "UPLM", 4))
+		return ModuleFileError::BadMagic;
+	if (header.byte_order != ModuleFileHeader::msc_ByteOrderMark)
+		return ModuleFileError::WrongByteOrder;
+	if (header.version != ModuleFileHeader::msc_Version)
+		return ModuleFileError::BadVersion;
+	if (header.opcode_set != OpcodeSetID())
+		return ModuleFileError::OtherOpcodes;
+	if (header.header_size < sizeof(header) || header.file_size > size ||
+		!IsValidSection(header.types, header, 1) ||
+		!IsValidSection(header.functions, header, sizeof(Function)) ||
+		!IsValidSection(header.code, header, sizeof(Instruction)) ||
+		!IsValidSection(header.constants, header, sizeof(Reg)) ||
+		!IsValidSection(header.stack_maps, header, sizeof(StackMap)) ||
+		!IsValidSection(header.names, header, 1) ||
+		!IsValidSection(header.globals, header, sizeof(Global)))
+		return ModuleFileError::Truncated;
+
+	// The types, in ID order, so each one gets its old ID back (the basic
+	// ones every container starts with just match up.)
+	auto & types = out_module.types();
+	auto p = base + header.types.offset;
+	auto const types_end = p + header.types.size;
+	for (Type::ID expected = 1; p < types_end; ++expected)
+	{
+		uint64_t len = 0;
+		if (!ReadVarint(p, types_end, len) || len > uint64_t(types_end - p))
+			return ModuleFileError::BadTypes;
+		if (types.createType(Type::PackedST(p, size_t(len))) != expected)
+			return ModuleFileError::BadTypes;
+		p += len;
+	}
+
+	Module::Tables t;
+	t.functions = reinterpret_cast<Function const *>(base + header.functions.offset);
+	t.function_count = uint32_t(header.functions.size / sizeof(Function));
+	t.code = reinterpret_cast<Instruction const *>(base + header.code.offset);
+	t.code_size = uint32_t(header.code.size / sizeof(Instruction));
+	t.constants = reinterpret_cast<Reg const *>(base + header.constants.offset);
+	t.constant_count = uint32_t(header.constants.size / sizeof(Reg));
+	t.stack_maps = reinterpret_cast<StackMap const *>(base + header.stack_maps.offset);
+	t.stack_map_count = uint32_t(header.stack_maps.size / sizeof(StackMap));
+	t.names = reinterpret_cast<char const *>(base + header.names.offset);
+	t.names_size = uint32_t(header.names.size);
+	t.globals = reinterpret_cast<Global const *>(base + header.globals.offset);
+	t.global_count = uint32_t(header.globals.size / sizeof(Global));
+
+	// Cheap (one pass over the function table) and needed for memory
+	// safety even with trusted files, so always done.
+	if (t.names_size > 0 && '\0' != t.names[t.names_size - 1])
+		return ModuleFileError::BadTables;
+	for (uint32_t i = 0; i < t.function_count; ++i)
+	{
+		auto const & f = t.functions[i];
+		if (uint64_t(f.code_offset) + f.code_size > t.code_size ||
+			uint64_t(f.stack_map_offset) + f.stack_map_count > t.stack_map_count ||
+			f.name >= t.names_size || f.param_count > f.register_count || f.type >= types.size())
+			return ModuleFileError::BadTables;
+	}
+	for (uint32_t i = 0; i < t.global_count; ++i)
+	{
+		auto const & g = t.globals[i];
+		if (g.name >= t.names_size || g.type >= types.size() || g.initializer >= t.function_count ||
+				0 != t.functions[g.initializer].param_count)
+			return ModuleFileError::BadTables;
+	}
+
+	out_module.attachImage (std::move(image), t);
+
+	return verify_code ? VerifyCode(out_module) : ModuleFileError::None;
+}
+
+//======================================================================
+
+ModuleFileError VerifyCode (Module const & module)
+{
+	for (uint32_t fi = 0; fi < module.functionCount(); ++fi)
+	{
+		auto const & f = module.function(fi);
+		auto const code = module.code(f);
+		unsigned const regs = f.register_count;
+
+		if (0 == f.code_size || regs > unsigned(StackMap::msc_MaxRegisters))
+			return ModuleFileError::BadCode;
+
+		for (uint32_t i = 0; i < f.stack_map_count; ++i)
+		{
+			auto const & map = module.tables().stack_maps[f.stack_map_offset + i];
+			if (map.pc >= f.code_size || (i > 0 && map.pc <= module.tables().stack_maps[f.stack_map_offset + i - 1].pc))
+				return ModuleFileError::BadCode;
+		}
+
+		for (uint32_t i = 0; i < f.code_size; ++i)
+		{
+			auto const ins = Unfused(code[i]);
+			auto const op = GetOp(ins);
+			if (int(op) >= OpCount)
+				return ModuleFileError::BadCode;
+
+			Op parts [3];
+			int const part_count = FusedParts(GetOp(code[i]), parts);
+			if (i + part_count > f.code_size)
+				return ModuleFileError::BadCode;
+			for (int p = 1; p < part_count; ++p)
+				if (GetOp(Unfused(code[i + p])) != parts[p])
+					return ModuleFileError::BadCode;
+
+			auto const a = GetA(ins), b = GetB(ins), c = GetC(ins);
+			auto const target = int64_t(i) + 1 + GetSBx(ins);
+			bool ok = true;
+
+			switch (OpFormat(op))
+			{
+			case Format::None:	break;
+			case Format::A:		ok = a < regs; break;
+			case Format::AB:	ok = a < regs && b < regs; break;
+			case Format::AN:	ok = a + b < regs; break;
+			case Format::ANN:	ok = a + b < regs; break;
+			case Format::ABC:	ok = a < regs && b < regs && c < regs; break;
+			case Format::ABN:	ok = a < regs && b < regs; break;
+			case Format::ABx:
+				ok = a < regs && GetBx(ins) < ((op == Op::LoadF) ? module.functionCount() :
+					(op == Op::GetG) ? module.globalCount() : module.constantCount());
+				break;
+			case Format::AsBx:
+				ok = a < regs && (op == Op::LoadI || (target >= 0 && target < int64_t(f.code_size)));
+				break;
+			case Format::sBx:
+				ok = target >= 0 && target < int64_t(f.code_size);
+				break;
+			}
+
+			if (!ok)
+				return ModuleFileError::BadCode;
+		}
+
+		// Execution must not run off the end.
+		auto const last = GetOp(Unfused(code[f.code_size - 1]));
+		if (last != Op::Ret && last != Op::RetNil && last != Op::Jmp && last != Op::TailCall)
+			return ModuleFileError::BadCode;
+	}
+
+	return ModuleFileError::None;
+}
+
+//======================================================================
+
+	}	// namespace VM
+}	// namespace UPL
+
+//======================================================================
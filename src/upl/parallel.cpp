@@ -0,0 +1,252 @@
+//======================================================================
+
+#include <upl/parallel.hpp>
+
+#include <algorithm>
+#include <cstring>
+
+//======================================================================
+
+namespace UPL {
+	namespace VM {
+
+//======================================================================
+
+namespace {
+
+//----------------------------------------------------------------------
+// Scalar elements, as the interpreter's GetE and SetE see them.
+
+inline void LoadScalar (uint8_t const * at, Type::Tag tag, Reg & out)
+{
+	switch (tag)
+	{
+	case Type::Tag::Bool:	out = Reg::FromBool(0 != *at); return;
+	case Type::Tag::Byte:	out = Reg::FromInt(*at); return;
+	case Type::Tag::Char:	{Char c; memcpy (&c, at, sizeof(c)); out = Reg::FromInt(Int(uint32_t(c))); return;}
+	case Type::Tag::Int:	memcpy (&out.i, at, sizeof(Int)); return;
+	case Type::Tag::Real:	memcpy (&out.r, at, sizeof(Real)); return;
+	default:				out = Reg::Nil(); return;
+	}
+}
+
+//----------------------------------------------------------------------
+
+inline void StoreScalar (uint8_t * at, Type::Tag tag, Reg v)
+{
+	switch (tag)
+	{
+	case Type::Tag::Bool:	*at = (0 != v.i) ? 1 : 0; return;
+	case Type::Tag::Byte:	*at = uint8_t(v.i); return;
+	case Type::Tag::Char:	{Char c = Char(v.i); memcpy (at, &c, sizeof(c)); return;}
+	case Type::Tag::Int:	memcpy (at, &v.i, sizeof(Int)); return;
+	case Type::Tag::Real:	memcpy (at, &v.r, sizeof(Real)); return;
+	default:				return;
+	}
+}
+
+//----------------------------------------------------------------------
+
+struct Elements
+{
+	uint8_t * first;
+	Type::Tag tag;
+	Type::Size stride;
+	uint32_t count;
+};
+
+bool ScalarElements (Heap & heap, Object * obj, Elements & out)
+{
+	Type::ID type;
+	if (!heap.packedElements(obj, out.first, type, out.stride, out.count) || !Parallel::IsScalar(heap.types(), type))
+		return false;
+	out.tag = heap.types().tag(type);
+	return true;
+}
+
+//----------------------------------------------------------------------
+
+}	// namespace
+
+//======================================================================
+
+HeapConfig Parallel::WorkerHeapConfig ()
+{
+	HeapConfig ret;
+	ret.nursery_size = 256 << 10;
+	ret.old_capacity = size_t(64) << 20;
+	ret.min_major_threshold = 4 << 20;
+	return ret;
+}
+
+//----------------------------------------------------------------------
+
+bool Parallel::IsScalar (Type::STContainer const & types, Type::ID type)
+{
+	switch (types.tag(type))
+	{
+	case Type::Tag::Bool: case Type::Tag::Byte: case Type::Tag::Char: case Type::Tag::Int: case Type::Tag::Real:
+		return true;
+	default:
+		return false;
+	}
+}
+
+//----------------------------------------------------------------------
+
+Parallel::Parallel (Module const & module, unsigned threads, HeapConfig const & worker_heap)
+	: m_module (module)
+	, m_pool (threads)
+	, m_workers ()
+	, m_error (int(RunError::None))
+{
+	for (unsigned i = 0; i < m_pool.workerCount(); ++i)
+	{
+		std::unique_ptr<Worker> w (new Worker);
+		w->heap.reset (new Heap(module.types(), worker_heap));
+		w->interpreter.reset (new Interpreter(module, w->reporter, *w->heap, msc_WorkerRegisters, msc_WorkerFrames));
+		m_workers.push_back (std::move(w));
+	}
+}
+
+//----------------------------------------------------------------------
+
+Parallel::~Parallel ()
+{
+}
+
+//----------------------------------------------------------------------
+
+void Parallel::setGlobals (Globals * globals)
+{
+	for (auto & w : m_workers)
+		w->interpreter->setGlobals (globals);
+}
+
+//----------------------------------------------------------------------
+
+bool Parallel::accepts (Function const * f, unsigned arity, Type::ID element) const
+{
+	auto const & types = m_module.types();
+	if (nullptr == f || f->param_count != arity || !IsScalar(types, element) ||
+			types.tag(f->type) != Type::Tag::Function || !IsScalar(types, types.getFunctionReturnType(f->type)))
+		return false;
+
+	auto const params = types.getFunctionParamTypes(f->type);
+	if (params.size() != arity)
+		return false;
+	for (auto p : params)
+		if (!IsScalar(types, p))
+			return false;
+	return true;
+}
+
+//----------------------------------------------------------------------
+
+RunError Parallel::map (Heap & heap, Function const * f, Object * in, Object * out, uint64_t & out_elements)
+{
+	Elements src, dst;
+	if (!ScalarElements(heap, in, src) || !ScalarElements(heap, out, dst))
+		return RunError::BadField;
+	if (dst.count < src.count)
+		return RunError::IndexOutOfRange;
+
+	auto const index = m_module.functionIndex(f);
+	m_error.store (int(RunError::None));
+	m_pool.parallelFor (src.count, grainFor(src.count), [&] (size_t begin, size_t end, unsigned w) {
+		auto & interpreter = *m_workers[w]->interpreter;
+		for (size_t i = begin; i < end; ++i)
+		{
+			if (int(RunError::None) != m_error.load(std::memory_order_relaxed))
+				return;
+			Reg arg, result;
+			LoadScalar (src.first + i * src.stride, src.tag, arg);
+			if (!interpreter.call(index, &arg, 1, result))
+				return fail(interpreter.lastError());
+			StoreScalar (dst.first + i * dst.stride, dst.tag, result);
+		}
+	});
+
+	auto const err = RunError(m_error.load());
+	if (RunError::None == err)
+		out_elements += src.count;
+	return err;
+}
+
+//----------------------------------------------------------------------
+
+RunError Parallel::reduce (Heap & heap, Function const * f, Reg init, Object * in, Reg & out_result, uint64_t & out_elements)
+{
+	Elements src;
+	if (!ScalarElements(heap, in, src))
+		return RunError::BadField;
+
+	auto const index = m_module.functionIndex(f);
+	for (auto & w : m_workers)
+		w->partials.clear ();
+	m_error.store (int(RunError::None));
+	m_pool.parallelFor (src.count, grainFor(src.count), [&] (size_t begin, size_t end, unsigned w) {
+		auto & worker = *m_workers[w];
+		Reg args [2];
+		LoadScalar (src.first + begin * src.stride, src.tag, args[0]);
+		for (size_t i = begin + 1; i < end; ++i)
+		{
+			if (int(RunError::None) != m_error.load(std::memory_order_relaxed))
+				return;
+			LoadScalar (src.first + i * src.stride, src.tag, args[1]);
+			if (!worker.interpreter->call(index, args, 2, args[0]))
+				return fail(worker.interpreter->lastError());
+		}
+		worker.partials.emplace_back (begin, args[0]);
+	});
+
+	auto err = RunError(m_error.load());
+	if (RunError::None != err)
+		return err;
+
+	// The pieces, in order, onto "init"; here, on worker 0.
+	std::vector<std::pair<size_t, Reg>> partials;
+	for (auto const & w : m_workers)
+		partials.insert (partials.end(), w->partials.begin(), w->partials.end());
+	std::sort (partials.begin(), partials.end(), [] (std::pair<size_t, Reg> const & a, std::pair<size_t, Reg> const & b) {
+		return a.first < b.first;
+	});
+
+	auto & interpreter = *m_workers[0]->interpreter;
+	Reg args [2] = {init, Reg::Nil()};
+	for (auto const & p : partials)
+	{
+		args[1] = p.second;
+		if (!interpreter.call(index, args, 2, args[0]))
+			return interpreter.lastError();
+	}
+	out_result = args[0];
+	out_elements += src.count;
+	return RunError::None;
+}
+
+//----------------------------------------------------------------------
+// The smallest piece a worker runs, or splits off for others to steal.
+// Lazy splitting makes the pieces bigger wherever nobody's idle, so this
+// only has to be small enough to keep everyone busy near the end, and
+// big enough for the bookkeeping not to show.
+
+size_t Parallel::grainFor (size_t n) const
+{
+	return UPL_MAX(size_t(1), UPL_MIN(size_t(256), n / (8 * size_t(workerCount()))));
+}
+
+//----------------------------------------------------------------------
+
+void Parallel::fail (RunError err)
+{
+	int expected = int(RunError::None);
+	m_error.compare_exchange_strong (expected, int(err));
+}
+
+//======================================================================
+
+	}	// namespace VM
+}	// namespace UPL
+
+//======================================================================
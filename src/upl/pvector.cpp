@@ -0,0 +1,470 @@
+//======================================================================
+
+#include <upl/pvector.hpp>
+
+#include <algorithm>
+#include <cstring>
+
+//======================================================================
+
+namespace UPL {
+	namespace VM {
+
+//======================================================================
+
+static uint32_t const sc_Mask = PVector::msc_Width - 1;
+
+//----------------------------------------------------------------------
+// Where the tail starts, in a vector of "size" elements.
+static inline uint32_t TailOffset (uint32_t size)
+{
+	return (size < PVector::msc_Width) ? 0 : ((size - 1) & ~sc_Mask);
+}
+
+//----------------------------------------------------------------------
+
+static inline VectorNode * NodeOf (Object * obj)
+{
+	return static_cast<VectorNode *>(obj);
+}
+
+//======================================================================
+
+PVector::PVector (Heap & heap)
+	: m_heap (heap)
+	, m_leaves ()
+	, m_open_edits ()
+	, m_next_edit (1)
+{
+}
+
+//----------------------------------------------------------------------
+
+Object * PVector::newVector (Type::ID type)
+{
+	if (!leafInfo(type).valid || !m_heap.reserve(2 * (sizeof(VectorNode) + msc_Width * sizeof(Object *))))
+		return nullptr;
+
+	auto const ret = newNode(2, 0);
+	ret->leaf_type = type;
+	ret->shift = msc_Bits;
+	ret->children()[0] = newNode(msc_Width, 0);
+	return ret;
+}
+
+//----------------------------------------------------------------------
+
+Object * PVector::push (Object * vector, void const * element, Edit edit)
+{
+	assert (0 == edit || std::find(m_open_edits.begin(), m_open_edits.end(), edit) != m_open_edits.end());
+
+	auto const type = this->type(vector);
+	auto const & leaf = leafInfo(type);
+	if (0xFFFFFFFFU == NodeOf(vector)->size)
+		return nullptr;
+
+	// An element that's a reference may move too
+	Object * ref = nullptr;
+	if (leaf.is_ref)
+		memcpy (&ref, element, sizeof(ref));
+	Value rooted [2] = {Value::FromObject(vector), (nullptr != ref) ? Value::FromObject(ref) : Value::Nil()};
+	if (!reserve(bytesToChange(leaf), rooted, 2))
+		return nullptr;
+	if (nullptr != ref)
+	{
+		ref = rooted[1].asObject();
+		element = &ref;
+	}
+
+	auto const head = NodeOf(rooted[0].asObject());
+	auto const size = head->size;
+	auto const tail = head->children()[1];
+	bool const tail_owned = 0 != edit && head->edit == edit && 0 != (head->owned & 2);
+	auto const ret = editable(head, edit);
+	ret->size = size + 1;
+
+	// Room in the tail
+	auto const in_tail = size - TailOffset(size);
+	if (nullptr != tail && in_tail < msc_Width)
+	{
+		auto const new_tail = tail_owned ? tail : newLeaf(type, tail, leaf);
+		write (new_tail, in_tail, element, leaf);
+		put (ret, 1, new_tail, true, edit);
+		return ret;
+	}
+
+	// The full tail goes into the trie, and a new one starts
+	if (nullptr != tail)
+	{
+		auto const root = NodeOf(head->children()[0]);
+		VectorNode * new_root;
+		if ((size >> msc_Bits) > (1U << head->shift))
+		{
+			new_root = newNode(msc_Width, edit);
+			put (new_root, 0, root, false, edit);
+			put (new_root, 1, newPath(head->shift, tail, tail_owned, edit), false, edit);
+			ret->shift = head->shift + msc_Bits;
+		}
+		else
+			new_root = pushTail(size, head->shift, root, tail, tail_owned, edit);
+		put (ret, 0, new_root, false, edit);
+	}
+
+	auto const new_tail = newLeaf(type, nullptr, leaf);
+	write (new_tail, 0, element, leaf);
+	put (ret, 1, new_tail, true, edit);
+	return ret;
+}
+
+//----------------------------------------------------------------------
+
+Object * PVector::set (Object * vector, uint32_t index, void const * element, Edit edit)
+{
+	assert (0 == edit || std::find(m_open_edits.begin(), m_open_edits.end(), edit) != m_open_edits.end());
+
+	if (index >= size(vector))
+		return nullptr;
+
+	auto const type = this->type(vector);
+	auto const & leaf = leafInfo(type);
+	Object * ref = nullptr;
+	if (leaf.is_ref)
+		memcpy (&ref, element, sizeof(ref));
+	Value rooted [2] = {Value::FromObject(vector), (nullptr != ref) ? Value::FromObject(ref) : Value::Nil()};
+	if (!reserve(bytesToChange(leaf), rooted, 2))
+		return nullptr;
+	if (nullptr != ref)
+	{
+		ref = rooted[1].asObject();
+		element = &ref;
+	}
+
+	auto const head = NodeOf(rooted[0].asObject());
+	auto const j = head->start + index;
+	bool const tail_owned = 0 != edit && head->edit == edit && 0 != (head->owned & 2);
+	auto const ret = editable(head, edit);
+
+	if (j >= TailOffset(head->size))
+	{
+		auto const tail = head->children()[1];
+		auto const new_tail = tail_owned ? tail : newLeaf(type, tail, leaf);
+		write (new_tail, j & sc_Mask, element, leaf);
+		put (ret, 1, new_tail, true, edit);
+	}
+	else
+		put (ret, 0, setIn(head->shift, NodeOf(head->children()[0]), j, element, leaf, type, edit), false, edit);
+	return ret;
+}
+
+//----------------------------------------------------------------------
+
+Object * PVector::slice (Object * vector, uint32_t from, uint32_t to)
+{
+	if (from > to || to > size(vector))
+		return nullptr;
+
+	Value rooted = Value::FromObject(vector);
+	if (!reserve(bytesToChange(leafInfo(type(vector))), &rooted, 1))
+		return nullptr;
+
+	auto const head = NodeOf(rooted.asObject());
+	auto const end = head->start + to;
+	auto const ret = newNode(2, 0);
+	ret->leaf_type = head->leaf_type;
+	ret->start = head->start + from;
+	ret->size = end;
+
+	// Nothing to cut off
+	if (end == head->size)
+	{
+		ret->shift = head->shift;
+		ret->children()[0] = head->children()[0];
+		ret->children()[1] = head->children()[1];
+		return ret;
+	}
+
+	ret->shift = msc_Bits;
+	if (0 == end)
+	{
+		ret->children()[0] = newNode(msc_Width, 0);
+		return ret;
+	}
+
+	ret->children()[1] = leafOf(head, end - 1);
+	auto const tail_offset = TailOffset(end);
+	if (0 == tail_offset)
+	{
+		ret->children()[0] = newNode(msc_Width, 0);
+		return ret;
+	}
+
+	auto root = trim(head->shift, NodeOf(head->children()[0]), tail_offset - 1);
+	ret->shift = head->shift;
+	while (ret->shift > uint32_t(msc_Bits) && nullptr == root->children()[1])
+	{
+		root = NodeOf(root->children()[0]);
+		ret->shift -= msc_Bits;
+	}
+	ret->children()[0] = root;
+	return ret;
+}
+
+//----------------------------------------------------------------------
+
+uint32_t PVector::size (Object const * vector) const
+{
+	auto const head = static_cast<VectorNode const *>(vector);
+	return head->size - head->start;
+}
+
+//----------------------------------------------------------------------
+
+Type::Size PVector::stride (Object const * vector)
+{
+	return leafInfo(type(vector)).stride;
+}
+
+//----------------------------------------------------------------------
+
+uint8_t const * PVector::at (Object const * vector, uint32_t index)
+{
+	uint32_t count;
+	return chunk(vector, index, count);
+}
+
+//----------------------------------------------------------------------
+
+uint8_t const * PVector::chunk (Object const * vector, uint32_t index, uint32_t & out_count)
+{
+	auto const head = static_cast<VectorNode const *>(vector);
+	auto const size = head->size - head->start;
+	if (index >= size)
+		return nullptr;
+
+	auto const & leaf = leafInfo(head->leaf_type);
+	auto const j = head->start + index;
+	out_count = UPL_MIN(msc_Width - (j & sc_Mask), size - index);
+	return static_cast<uint8_t const *>(m_heap.payload(leafOf(head, j))) + leaf.offset + (j & sc_Mask) * leaf.stride;
+}
+
+//----------------------------------------------------------------------
+
+PVector::Edit PVector::beginEdit ()
+{
+	if (0 == m_next_edit)
+		m_next_edit = 1;
+	m_open_edits.push_back (m_next_edit);
+	return m_next_edit++;
+}
+
+//----------------------------------------------------------------------
+
+void PVector::endEdit (Edit edit)
+{
+	m_open_edits.erase (std::remove(m_open_edits.begin(), m_open_edits.end(), edit), m_open_edits.end());
+}
+
+//======================================================================
+
+PVector::Leaf const & PVector::leafInfo (Type::ID type)
+{
+	using Type::Tag;
+
+	if (type >= m_leaves.size())
+		m_leaves.resize (size_t(type) + 1);
+
+	auto & ret = m_leaves[type];
+	if (ret.valid || m_heap.types().tag(type) != Tag::Vector)
+		return ret;
+
+	Type::ID element;
+	if (!m_heap.elementInfo(type, ret.offset, element, ret.stride))
+		return ret;
+
+	switch (m_heap.types().tag(element))
+	{
+	case Tag::Nil:
+	case Tag::Bool:
+	case Tag::Byte:
+	case Tag::Char:
+	case Tag::Int:
+	case Tag::Real:
+		ret.valid = true;
+		break;
+	default:
+		ret.valid = ret.is_ref = m_heap.layouts().isBoxed(element);
+		break;
+	}
+	return ret;
+}
+
+//----------------------------------------------------------------------
+// An upper bound on what one push(), set() or slice() may allocate: a
+// head, two leaves and a node for each level (plus a new root.)
+size_t PVector::bytesToChange (Leaf const & leaf) const
+{
+	auto const node = sizeof(VectorNode) + msc_Width * sizeof(Object *);
+	auto const leaf_size = sizeof(Object) + leaf.offset + msc_Width * leaf.stride + 8;
+	return node + 2 * leaf_size + (32 / msc_Bits + 2) * node;
+}
+
+//----------------------------------------------------------------------
+// As Hamt::reserve().
+bool PVector::reserve (size_t bytes, Value * values, int count)
+{
+	for (int i = 0; i < count; ++i)
+		m_heap.addRoot (values + i);
+	bool const ret = m_heap.reserve(bytes);
+	for (int i = count; i-- > 0; )
+		m_heap.removeRoot (values + i);
+	return ret;
+}
+
+//----------------------------------------------------------------------
+
+VectorNode * PVector::newNode (uint32_t count, Edit edit)
+{
+	auto const ret = NodeOf(m_heap.allocate(Heap::msc_VectorNodeType, count));
+	assert (nullptr != ret);	// There's room reserved for it
+	ret->edit = edit;
+	return ret;
+}
+
+//----------------------------------------------------------------------
+// "node" itself if it belongs to the edit, otherwise a copy that does.
+VectorNode * PVector::editable (VectorNode * node, Edit edit)
+{
+	if (0 != edit && node->edit == edit)
+		return node;
+
+	auto const ret = newNode(node->count, edit);
+	ret->size = node->size;
+	ret->start = node->start;
+	ret->shift = node->shift;
+	ret->leaf_type = node->leaf_type;
+	memcpy (ret->children(), node->children(), node->count * sizeof(Object *));
+	return ret;
+}
+
+//----------------------------------------------------------------------
+// A leaf with the elements of "from", if any.
+Object * PVector::newLeaf (Type::ID type, Object const * from, Leaf const & leaf)
+{
+	auto const ret = m_heap.allocate(type, msc_Width);
+	assert (nullptr != ret);
+	if (nullptr != from)
+		memcpy (static_cast<uint8_t *>(m_heap.payload(ret)) + leaf.offset,
+			reinterpret_cast<uint8_t const *>(from) + sizeof(Object) + leaf.offset, msc_Width * leaf.stride);
+	return ret;
+}
+
+//----------------------------------------------------------------------
+// The leaf with element "j" (counting from the start of the trie.)
+Object * PVector::leafOf (VectorNode const * head, uint32_t j) const
+{
+	if (j >= TailOffset(head->size))
+		return head->children()[1];
+
+	auto node = head->children()[0];
+	for (int level = int(head->shift); level > 0; level -= msc_Bits)
+		node = NodeOf(node)->children()[(j >> level) & sc_Mask];
+	return node;
+}
+
+//----------------------------------------------------------------------
+// "owned": "child" is a leaf made by the edit.
+void PVector::put (VectorNode * node, uint32_t index, Object * child, bool owned, Edit edit)
+{
+	auto const at = node->children() + index;
+	*at = child;
+	m_heap.writeBarrier (node, at, child);
+	if (owned && 0 != edit)
+		node->owned |= 1U << index;
+	else
+		node->owned &= ~(1U << index);
+}
+
+//----------------------------------------------------------------------
+
+void PVector::write (Object * leaf, uint32_t index, void const * element, Leaf const & leaf_info)
+{
+	auto const at = static_cast<uint8_t *>(m_heap.payload(leaf)) + leaf_info.offset + index * leaf_info.stride;
+	memcpy (at, element, leaf_info.stride);
+	if (leaf_info.is_ref)
+	{
+		Object * ref;
+		memcpy (&ref, element, sizeof(ref));
+		if (nullptr != ref)
+			m_heap.writeBarrier (leaf, at, ref);
+	}
+}
+
+//----------------------------------------------------------------------
+// The trie of "node", a level of "level" of a vector of "size" elements,
+// with "tail" added after them.
+VectorNode * PVector::pushTail (uint32_t size, int level, VectorNode * node, Object * tail, bool tail_owned, Edit edit)
+{
+	auto const ret = editable(node, edit);
+	auto const sub = ((size - 1) >> level) & sc_Mask;
+	if (msc_Bits == level)
+	{
+		put (ret, sub, tail, tail_owned, edit);
+		return ret;
+	}
+
+	auto const child = node->children()[sub];
+	auto const new_child = (nullptr != child) ?
+		pushTail(size, level - msc_Bits, NodeOf(child), tail, tail_owned, edit) : newPath(level - msc_Bits, tail, tail_owned, edit);
+	put (ret, sub, new_child, false, edit);
+	return ret;
+}
+
+//----------------------------------------------------------------------
+// A chain of new nodes from "level" down to "tail".
+Object * PVector::newPath (int level, Object * tail, bool tail_owned, Edit edit)
+{
+	if (0 == level)
+		return tail;
+
+	auto const ret = newNode(msc_Width, edit);
+	put (ret, 0, newPath(level - msc_Bits, tail, tail_owned, edit), msc_Bits == level && tail_owned, edit);
+	return ret;
+}
+
+//----------------------------------------------------------------------
+
+VectorNode * PVector::setIn (int level, VectorNode * node, uint32_t j, void const * element, Leaf const & leaf, Type::ID type, Edit edit)
+{
+	auto const ret = editable(node, edit);
+	auto const sub = (j >> level) & sc_Mask;
+	auto const child = node->children()[sub];
+	if (msc_Bits == level)
+	{
+		bool const owned = (ret == node) && 0 != (node->owned & (1U << sub));
+		auto const new_leaf = owned ? child : newLeaf(type, child, leaf);
+		write (new_leaf, j & sc_Mask, element, leaf);
+		put (ret, sub, new_leaf, true, edit);
+	}
+	else
+		put (ret, sub, setIn(level - msc_Bits, NodeOf(child), j, element, leaf, type, edit), false, edit);
+	return ret;
+}
+
+//----------------------------------------------------------------------
+// A copy of the trie of "node" with nothing after element "last".
+VectorNode * PVector::trim (int level, VectorNode const * node, uint32_t last)
+{
+	auto const sub = (last >> level) & sc_Mask;
+	auto const ret = newNode(msc_Width, 0);
+	memcpy (ret->children(), node->children(), (sub + 1) * sizeof(Object *));
+	if (level > msc_Bits)
+		ret->children()[sub] = trim(level - msc_Bits, NodeOf(node->children()[sub]), last);
+	return ret;
+}
+
+//======================================================================
+
+	}	// namespace VM
+}	// namespace UPL
+
+//======================================================================
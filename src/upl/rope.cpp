@@ -0,0 +1,390 @@
+//======================================================================
+
+#include <upl/rope.hpp>
+
+#include <cstring>
+
+//======================================================================
+
+namespace UPL {
+	namespace VM {
+
+//======================================================================
+
+static inline bool IsContinuation (char c)
+{
+	return 0x80 == (uint8_t(c) & 0xC0);
+}
+
+//----------------------------------------------------------------------
+
+static inline uint64_t CountChars (char const * p, size_t size)
+{
+	uint64_t ret = 0;
+	for (size_t i = 0; i < size; ++i)
+		ret += IsContinuation(p[i]) ? 0 : 1;
+	return ret;
+}
+
+//----------------------------------------------------------------------
+// The code point starting at "p" (and at most "size" bytes long.)
+static Char DecodeChar (char const * p, size_t size)
+{
+	auto const b = uint8_t(p[0]);
+	int const extra = (b < 0x80) ? 0 : (b < 0xE0) ? 1 : (b < 0xF0) ? 2 : 3;
+	uint32_t ret = (0 == extra) ? b : (b & (0x3F >> extra));
+	for (int i = 1; i <= extra && size_t(i) < size; ++i)
+		ret = (ret << 6) | (uint8_t(p[i]) & 0x3F);
+	return Char(ret);
+}
+
+//----------------------------------------------------------------------
+
+static size_t const sc_NodeSize = sizeof(RopeNode) + 2 * sizeof(Value);
+
+//======================================================================
+
+Ropes::Ropes (Heap & heap)
+	: m_heap (heap)
+	, m_interned ()
+	, m_intern_index ()
+	, m_scratch ()
+{
+	m_heap.addRootSource (this);
+}
+
+//----------------------------------------------------------------------
+
+Ropes::~Ropes ()
+{
+	m_heap.removeRootSource (this);
+}
+
+//----------------------------------------------------------------------
+// A long string is cut into leaves (on code point boundaries), which are
+// then joined in pairs, level by level.
+Value Ropes::fromUTF8 (char const * utf8, size_t size)
+{
+	if (size <= msc_LeafMax)
+		return m_heap.newString(utf8, size);
+
+	auto const base = m_scratch.size();
+	for (size_t at = 0; at < size; )
+	{
+		auto end = UPL_MIN(at + msc_LeafMax, size);
+		while (end < size && end > at + 1 && IsContinuation(utf8[end]))
+			--end;
+		auto const leaf = m_heap.newString(utf8 + at, end - at);
+		if (leaf.isNil())
+		{
+			m_scratch.resize (base);
+			return leaf;
+		}
+		m_scratch.push_back (leaf);
+		at = end;
+	}
+
+	while (m_scratch.size() - base > 1)
+	{
+		size_t out = base;
+		for (size_t i = base; i < m_scratch.size(); i += 2)
+		{
+			if (i + 1 == m_scratch.size())
+			{
+				m_scratch[out++] = m_scratch[i];
+				continue;
+			}
+
+			auto const bound = 3 * (UPL_MAX(height(m_scratch[i]), height(m_scratch[i + 1])) + 2) * sc_NodeSize + sizeof(Object) + 8 + msc_FlatMax;
+			if (!m_heap.reserve(bound))
+			{
+				m_scratch.resize (base);
+				return Value::Nil();
+			}
+			auto const joined = join(m_scratch[i], m_scratch[i + 1]);
+			m_scratch[out++] = joined;
+		}
+		m_scratch.resize (out);
+	}
+
+	auto const ret = m_scratch[base];
+	m_scratch.resize (base);
+	return ret;
+}
+
+//----------------------------------------------------------------------
+
+Value Ropes::intern (char const * utf8, size_t size)
+{
+	std::string key (utf8, size);
+	auto const i = m_intern_index.find(key);
+	if (i != m_intern_index.end())
+		return m_interned[i->second];
+
+	auto const ret = fromUTF8(utf8, size);
+	if (ret.isNil())
+		return ret;
+	m_intern_index.emplace (std::move(key), m_interned.size());
+	m_interned.push_back (ret);
+	return ret;
+}
+
+//----------------------------------------------------------------------
+
+Value Ropes::concat (Value a, Value b)
+{
+	if (0 == bytes(a))
+		return b;
+	if (0 == bytes(b))
+		return a;
+
+	// Three new nodes at most for each level it goes down, and one flat
+	// string where it stops
+	auto const bound = 3 * (UPL_MAX(height(a), height(b)) + 2) * sc_NodeSize + sizeof(Object) + 8 + msc_FlatMax;
+	m_scratch.push_back (a);
+	m_scratch.push_back (b);
+	bool const ok = m_heap.reserve(bound);
+	b = m_scratch.back();
+	m_scratch.pop_back ();
+	a = m_scratch.back();
+	m_scratch.pop_back ();
+	return ok ? join(a, b) : Value::Nil();
+}
+
+//----------------------------------------------------------------------
+
+uint64_t Ropes::bytes (Value s) const
+{
+	if (isRope(s))
+		return static_cast<RopeNode const *>(s.asObject())->bytes;
+
+	size_t ret;
+	char buffer [Value::msc_SmallStringMax];
+	flatBytes (s, buffer, ret);
+	return ret;
+}
+
+//----------------------------------------------------------------------
+
+uint64_t Ropes::length (Value s) const
+{
+	if (isRope(s))
+		return static_cast<RopeNode const *>(s.asObject())->chars;
+	return flatChars(s);
+}
+
+//----------------------------------------------------------------------
+
+int Ropes::height (Value s) const
+{
+	return isRope(s) ? int(static_cast<RopeNode const *>(s.asObject())->height) : 0;
+}
+
+//----------------------------------------------------------------------
+// Below a node with as many bytes as code points, everything's ASCII, and
+// the lengths of the flat halves needn't be counted.
+bool Ropes::charAt (Value s, uint64_t index, Char & out_char) const
+{
+	bool ascii = false;
+	while (isRope(s))
+	{
+		auto const node = static_cast<RopeNode const *>(s.asObject());
+		ascii = ascii || node->bytes == node->chars;
+		auto const halves = node->halves();
+		auto const left = ascii ? bytes(halves[0]) : length(halves[0]);
+		if (index < left)
+			s = halves[0];
+		else
+		{
+			index -= left;
+			s = halves[1];
+		}
+	}
+
+	size_t size;
+	char buffer [Value::msc_SmallStringMax];
+	auto const p = flatBytes(s, buffer, size);
+	if (ascii)
+	{
+		if (index >= size)
+			return false;
+		out_char = Char(uint8_t(p[index]));
+		return true;
+	}
+	for (size_t i = 0; i < size; ++i)
+		if (!IsContinuation(p[i]) && 0 == index--)
+		{
+			out_char = DecodeChar(p + i, size - i);
+			return true;
+		}
+	return false;
+}
+
+//----------------------------------------------------------------------
+
+std::string Ropes::toUTF8 (Value s) const
+{
+	std::string ret;
+	ret.reserve (size_t(bytes(s)));
+	forEachPiece (s, [&ret] (char const * p, size_t size) {ret.append (p, size);});
+	return ret;
+}
+
+//----------------------------------------------------------------------
+
+void Ropes::visitRoots (RootVisitor & visitor)
+{
+	for (auto & v : m_interned)
+		visitor.visit (v);
+	for (auto & v : m_scratch)
+		visitor.visit (v);
+}
+
+//======================================================================
+// Where the bytes of a small string or a String object are; a small
+// string's are copied into "buffer" first. Anything else is empty.
+char const * Ropes::flatBytes (Value s, char * buffer, size_t & out_size) const
+{
+	if (s.kind() == Value::Kind::SmallString)
+	{
+		s.smallStringCopy (buffer);
+		out_size = size_t(s.smallStringSize());
+		return buffer;
+	}
+
+	if (!s.isObject() || m_heap.types().tag(s.asObject()->type) != Type::Tag::String)
+	{
+		out_size = 0;
+		return buffer;
+	}
+
+	auto const p = reinterpret_cast<char const *>(s.asObject()) + sizeof(Object);
+	uint32_t size;
+	memcpy (&size, p, sizeof(size));
+	out_size = size;
+	return p + sizeof(uint32_t);
+}
+
+//----------------------------------------------------------------------
+
+uint64_t Ropes::flatChars (Value s) const
+{
+	size_t size;
+	char buffer [Value::msc_SmallStringMax];
+	auto const p = flatBytes(s, buffer, size);
+	return CountChars(p, size);
+}
+
+//----------------------------------------------------------------------
+// These (down to rotateRight) allocate, but only after concat() or
+// fromUTF8() reserved enough room that they can't collect garbage.
+Value Ropes::flat (Value a, Value b)
+{
+	char buffer [msc_FlatMax], small [Value::msc_SmallStringMax];
+	size_t size_a, size_b;
+	auto const p_a = flatBytes(a, small, size_a);
+	memcpy (buffer, p_a, size_a);
+	auto const p_b = flatBytes(b, small, size_b);
+	memcpy (buffer + size_a, p_b, size_b);
+	return m_heap.newString(buffer, size_a + size_b);
+}
+
+//----------------------------------------------------------------------
+
+Value Ropes::node (Value left, Value right)
+{
+	auto const ret = static_cast<RopeNode *>(m_heap.allocate(Heap::msc_RopeNodeType, 2));
+	assert (nullptr != ret);
+	ret->height = uint32_t(1 + UPL_MAX(height(left), height(right)));
+	ret->bytes = bytes(left) + bytes(right);
+	ret->chars = length(left) + length(right);
+	ret->halves()[0] = left;
+	ret->halves()[1] = right;
+	return Value::FromObject(ret);
+}
+
+//----------------------------------------------------------------------
+
+Value Ropes::merge (Value left, Value right)
+{
+	if (!isRope(left) && !isRope(right) && bytes(left) + bytes(right) <= msc_FlatMax)
+		return flat(left, right);
+	return node(left, right);
+}
+
+//----------------------------------------------------------------------
+// The AVL join of two trees, without a key in between.
+Value Ropes::join (Value left, Value right)
+{
+	auto const h_left = height(left), h_right = height(right);
+	if (h_left > h_right + 1)
+		return joinRight(left, right);
+	if (h_right > h_left + 1)
+		return joinLeft(left, right);
+	return merge(left, right);
+}
+
+//----------------------------------------------------------------------
+// "left" is the taller: go down its right edge to where "right" fits.
+Value Ropes::joinRight (Value left, Value right)
+{
+	auto const halves = static_cast<RopeNode const *>(left.asObject())->halves();
+	auto const l = halves[0], c = halves[1];
+
+	if (height(c) <= height(right) + 1)
+	{
+		auto const t = merge(c, right);
+		if (height(t) <= height(l) + 1)
+			return node(l, t);
+		return rotateLeft(node(l, rotateRight(t)));
+	}
+
+	auto const t = joinRight(c, right);
+	auto const ret = node(l, t);
+	return (height(t) <= height(l) + 1) ? ret : rotateLeft(ret);
+}
+
+//----------------------------------------------------------------------
+// The mirror image of joinRight().
+Value Ropes::joinLeft (Value left, Value right)
+{
+	auto const halves = static_cast<RopeNode const *>(right.asObject())->halves();
+	auto const c = halves[0], r = halves[1];
+
+	if (height(c) <= height(left) + 1)
+	{
+		auto const t = merge(left, c);
+		if (height(t) <= height(r) + 1)
+			return node(t, r);
+		return rotateRight(node(rotateLeft(t), r));
+	}
+
+	auto const t = joinLeft(left, c);
+	auto const ret = node(t, r);
+	return (height(t) <= height(r) + 1) ? ret : rotateRight(ret);
+}
+
+//----------------------------------------------------------------------
+// (a, (b, c)) to ((a, b), c)
+Value Ropes::rotateLeft (Value s)
+{
+	auto const halves = static_cast<RopeNode const *>(s.asObject())->halves();
+	auto const inner = static_cast<RopeNode const *>(halves[1].asObject())->halves();
+	return node(node(halves[0], inner[0]), inner[1]);
+}
+
+//----------------------------------------------------------------------
+// ((a, b), c) to (a, (b, c))
+Value Ropes::rotateRight (Value s)
+{
+	auto const halves = static_cast<RopeNode const *>(s.asObject())->halves();
+	auto const inner = static_cast<RopeNode const *>(halves[0].asObject())->halves();
+	return node(inner[0], node(inner[1], halves[1]));
+}
+
+//======================================================================
+
+	}	// namespace VM
+}	// namespace UPL
+
+//======================================================================
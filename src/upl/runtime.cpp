@@ -0,0 +1,189 @@
+//======================================================================
+
+#include <upl/runtime.hpp>
+#include <upl/module_file.hpp>
+#include <upl/rope.hpp>
+
+//======================================================================
+
+namespace UPL {
+
+//======================================================================
+
+Ref::Ref (VM::Heap & heap, VM::Value value)
+	: m_heap (&heap)
+	, m_value (value)
+{
+	m_heap->addRoot (&m_value);
+}
+
+//----------------------------------------------------------------------
+
+Ref::Ref (Ref const & that)
+	: m_heap (that.m_heap)
+	, m_value (that.m_value)
+{
+	if (nullptr != m_heap)
+		m_heap->addRoot (&m_value);
+}
+
+//----------------------------------------------------------------------
+
+Ref & Ref::operator = (Ref const & that)
+{
+	if (this != &that)
+	{
+		if (nullptr != m_heap)
+			m_heap->removeRoot (&m_value);
+		m_heap = that.m_heap;
+		m_value = that.m_value;
+		if (nullptr != m_heap)
+			m_heap->addRoot (&m_value);
+	}
+	return *this;
+}
+
+//----------------------------------------------------------------------
+
+Ref::~Ref ()
+{
+	if (nullptr != m_heap)
+		m_heap->removeRoot (&m_value);
+}
+
+//======================================================================
+
+View<char const> StringRef::bytes (std::string & scratch) const
+{
+	if (nullptr == m_heap)
+		return View<char const>();
+
+	if (VM::Value::Kind::SmallString == m_value.kind())
+	{
+		scratch.resize (size_t(m_value.smallStringSize()));
+		m_value.smallStringCopy (&scratch[0]);
+		return View<char const>(scratch.data(), scratch.size());
+	}
+	if (!m_value.isObject())
+		return View<char const>();
+
+	auto const obj = m_value.asObject();
+	if (VM::Heap::msc_RopeNodeType == obj->type)
+	{
+		// Ropes' own state is only for making them; any will do to read one.
+		VM::Ropes ropes (*m_heap);
+		scratch = ropes.toUTF8(m_value);
+		return View<char const>(scratch.data(), scratch.size());
+	}
+
+	Type::Size offset;
+	Type::ID element;
+	Type::Size stride;
+	if (m_heap->types().tag(obj->type) != Type::Tag::String || !m_heap->elementInfo(obj, offset, element, stride))
+		return View<char const>();
+	auto const first = static_cast<char const *>(m_heap->payload(obj)) + offset;
+	return View<char const>(first, m_heap->countOf(obj));
+}
+
+//======================================================================
+
+Runtime::Runtime (VM::HeapConfig const & heap_config)
+	: m_heap_config (heap_config)
+	, m_module ()
+	, m_reporter ()
+	, m_heap ()
+	, m_globals ()
+	, m_vm ()
+{
+}
+
+//----------------------------------------------------------------------
+
+Runtime::~Runtime ()
+{
+}
+
+//----------------------------------------------------------------------
+
+bool Runtime::load (char const * path, std::string & out_error, bool verify_code)
+{
+	if (loaded())
+	{
+		out_error = "a module is loaded already";
+		return false;
+	}
+
+	std::unique_ptr<VM::Module> module (new VM::Module);
+	auto const err = VM::LoadModule(path, *module, verify_code);
+	if (VM::ModuleFileError::None != err)
+	{
+		out_error = std::string("can't load \"") + path + "\": " + VM::ModuleFileErrorName(err);
+		return false;
+	}
+	m_module = std::move(module);
+	start ();
+	return true;
+}
+
+//----------------------------------------------------------------------
+
+bool Runtime::adopt (std::unique_ptr<VM::Module> module, std::string & out_error)
+{
+	if (loaded())
+	{
+		out_error = "a module is loaded already";
+		return false;
+	}
+	if (nullptr == module)
+	{
+		out_error = "no module";
+		return false;
+	}
+	m_module = std::move(module);
+	start ();
+	return true;
+}
+
+//----------------------------------------------------------------------
+
+void Runtime::start ()
+{
+	m_heap.reset (new VM::Heap(m_module->types(), m_heap_config));
+	if (m_module->globalCount() > 0)
+		m_globals.reset (new VM::Globals(*m_module, *m_heap));
+	m_vm.reset (new VM::Interpreter(*m_module, m_reporter, *m_heap));
+	m_vm->setGlobals (m_globals.get());
+}
+
+//----------------------------------------------------------------------
+
+bool Runtime::checkFunction (char const * name, Type::ID type, uint32_t & out_index, std::string & out_error) const
+{
+	auto const index = m_module->findFunction(name);
+	if (index >= m_module->functionCount())
+	{
+		out_error = std::string("no function \"") + name + "\"";
+		return false;
+	}
+	if (m_module->function(index).type != type)
+	{
+		out_error = std::string("function \"") + name + "\" has another signature";
+		return false;
+	}
+	out_index = index;
+	return true;
+}
+
+//----------------------------------------------------------------------
+
+StringRef Runtime::newString (char const * utf8, size_t size)
+{
+	auto const s = m_heap->newString(utf8, size);
+	return s.isNil() ? StringRef() : StringRef(*m_heap, s);
+}
+
+//======================================================================
+
+}	// namespace UPL
+
+//======================================================================
@@ -0,0 +1,863 @@
+//======================================================================
+
+#include <upl/scheduler.hpp>
+#include <upl/globals.hpp>
+#include <upl/parallel.hpp>
+
+#include <algorithm>
+#include <cassert>
+#include <cerrno>
+#include <chrono>
+#include <functional>
+
+#if !defined(_WIN32)
+	#include <poll.h>
+	#include <sys/socket.h>
+	#include <unistd.h>
+#endif
+
+#if UPL_FIBERS_AVAILABLE
+	#include <sys/epoll.h>
+	#include <sys/eventfd.h>
+#endif
+
+//======================================================================
+
+namespace UPL {
+	namespace VM {
+
+//======================================================================
+
+class Task
+	: public GlobalsWaiter
+{
+public:
+	Task (uint32_t id_, uint32_t function_, Reg const * args_, int arg_count)
+		: id (id_)
+		, function (function_)
+		, args (args_, args_ + arg_count)
+		, scheduler (nullptr)
+		, worker (nullptr)
+		, context (nullptr)
+		, finished (false)
+		, result (Reg::Nil())
+		, error (RunError::None)
+	{
+	}
+
+	uint32_t const id;
+	uint32_t const function;
+	std::vector<Reg> args;			// Until it starts
+	Scheduler * scheduler;
+	Scheduler::Worker * worker;		// Once started
+	Scheduler::Context * context;	// While started
+	bool finished;
+	Reg result;
+	RunError error;
+
+	void suspendForGlobal () override {scheduler->waitForGlobal (this);}
+	void wakeForGlobal () override {scheduler->wakeFromGlobal (this);}
+};
+
+//======================================================================
+
+namespace {
+
+//----------------------------------------------------------------------
+
+char const * const gsc_IoNames [IoOpCount] = {"yield", "sleep", "read", "write", "accept", "close", "spawn"};
+int const gsc_IoOperands [IoOpCount] = {0, 1, 3, 3, 1, 1, 2};
+
+//----------------------------------------------------------------------
+
+uint64_t Now ()
+{
+	return uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count());
+}
+
+//----------------------------------------------------------------------
+
+// The bytes of the vector (or array) "v", as a byte pointer and a count.
+
+bool Bytes (Heap & heap, Value v, uint8_t * & out_first, uint32_t & out_count)
+{
+	if (!v.isObject())
+		return false;
+	Type::ID element;
+	Type::Size stride;
+	return heap.packedElements(v.asObject(), out_first, element, stride, out_count) &&
+		Type::Tag::Byte == heap.types().tag(element) && 1 == stride;
+}
+
+//----------------------------------------------------------------------
+
+#if !defined(_WIN32)
+
+// Whether "fd" is ready (1) or not (0) for reading or writing, or minus
+// the errno.
+int Ready (int fd, bool out)
+{
+	pollfd p;
+	p.fd = fd;
+	p.events = out ? POLLOUT : POLLIN;
+	p.revents = 0;
+	for (;;)
+	{
+		int const n = ::poll(&p, 1, 0);
+		if (n >= 0)
+			return (0 != (p.revents & POLLNVAL)) ? -EBADF : n;
+		if (EINTR != errno)
+			return -errno;
+	}
+}
+
+#endif
+
+//----------------------------------------------------------------------
+
+}	// namespace
+
+//======================================================================
+
+bool IsValidIo (uint8_t code)
+{
+	return code < IoOpCount;
+}
+
+//----------------------------------------------------------------------
+
+char const * IoName (uint8_t code)
+{
+	return IsValidIo(code) ? gsc_IoNames[code] : "???";
+}
+
+//----------------------------------------------------------------------
+
+int IoOperands (uint8_t code)
+{
+	return IsValidIo(code) ? gsc_IoOperands[code] : -1;
+}
+
+//----------------------------------------------------------------------
+
+GlobalsWaiter * GlobalsWaiterOf (Task * task)
+{
+#if UPL_FIBERS_AVAILABLE
+	return task;
+#else
+	(void)task;
+	return nullptr;
+#endif
+}
+
+//----------------------------------------------------------------------
+// A descriptor operation waits (suspending the task, if there is one) for
+// the descriptor to be ready, then makes the system call, until it doesn't
+// fail with EAGAIN or EINTR. The buffer stays rooted meanwhile, and its
+// bytes are found again every time, as it may have moved while the task
+// was suspended.
+
+RunError RunIo (Interpreter & interpreter, Task * task, uint8_t code, unsigned count, Reg * args)
+{
+	if (!IsValidIo(code))
+		return RunError::BadOpcode;
+	if (int(count) != IoOperands(code))
+		return RunError::BadArgCount;
+
+	auto & heap = interpreter.heap();
+	auto & result = args[0];
+	result = Reg::FromInt(0);
+
+#if !UPL_FIBERS_AVAILABLE
+	// Nothing can be suspended; the tasks are only there to spawn others.
+	auto const scheduler = (nullptr != task) ? task->scheduler : nullptr;
+	task = nullptr;
+#endif
+
+	switch (IoOp(code))
+	{
+	case IoOp::Yield:
+		if (nullptr != task)
+			task->scheduler->yield (task);
+		return RunError::None;
+
+	case IoOp::Sleep:
+		if (nullptr != task)
+			task->scheduler->sleep (task, args[1].i);
+		else if (args[1].i > 0)
+			std::this_thread::sleep_for (std::chrono::milliseconds(args[1].i));
+		return RunError::None;
+
+	case IoOp::Spawn:
+	{
+		auto const f = args[1].f;
+		auto const index = interpreter.module().functionIndex(f);
+#if UPL_FIBERS_AVAILABLE
+		auto const scheduler = (nullptr != task) ? task->scheduler : nullptr;
+#endif
+		if (nullptr == scheduler)
+		{
+			result = Reg::FromInt(-ENOSYS);
+			return RunError::None;
+		}
+		if (nullptr == f || index >= interpreter.module().functionCount() || !scheduler->accepts(index, 1))
+			return RunError::BadFunction;
+		auto const w = (nullptr != task) ? task->worker : scheduler->m_workers[0].get();
+		result = Reg::FromInt(scheduler->spawnOn(*w, index, args + 2, 1)->id);
+		return RunError::None;
+	}
+
+	default:
+		break;
+	}
+
+#if defined(_WIN32)
+	(void)heap;
+	result = Reg::FromInt(-ENOSYS);
+	return RunError::None;
+#else
+	auto const fd = int(args[1].i);
+	if (IoOp::Close == IoOp(code))
+	{
+		result = Reg::FromInt((0 == close(fd)) ? 0 : -errno);
+		return RunError::None;
+	}
+
+	bool const out = IoOp::Write == IoOp(code);
+	Value buffer = Value::Nil();
+	Int n = 0;
+	if (IoOp::Read == IoOp(code) || out)
+	{
+		uint8_t * first;
+		uint32_t size;
+		buffer = args[2].value();
+		n = args[3].i;
+		if (!Bytes(heap, buffer, first, size))
+			return RunError::BadField;
+		if (n < 0 || n > Int(size))
+			return RunError::IndexOutOfRange;
+	}
+
+	heap.addRoot (&buffer);
+	Int done = 0;
+	Int ret = 0;
+	for (;;)
+	{
+		// Not ready: wait for it, unless the event loop can't (e.g. for
+		// regular files, which are always ready anyway.)
+		auto const ready = Ready(fd, out);
+		if (ready < 0)
+		{
+			ret = ready;
+			break;
+		}
+		if (0 == ready && ((nullptr != task) ? 0 == task->scheduler->waitFor(task, fd, out) : true))
+		{
+			if (nullptr == task)
+			{
+				pollfd p;
+				p.fd = fd;
+				p.events = out ? POLLOUT : POLLIN;
+				::poll (&p, 1, -1);
+			}
+			continue;
+		}
+
+		ssize_t r;
+		if (IoOp::Accept == IoOp(code))
+			r = accept(fd, nullptr, nullptr);
+		else
+		{
+			uint8_t * first;
+			uint32_t size;
+			Bytes (heap, buffer, first, size);
+			r = out ? write(fd, first + done, size_t(n - done)) : read(fd, first, size_t(n));
+		}
+
+		if (r < 0 && (EINTR == errno || EAGAIN == errno || EWOULDBLOCK == errno))
+			continue;
+		if (r < 0)
+		{
+			ret = -errno;
+			break;
+		}
+		if (out && (done += r) < n)
+			continue;
+		ret = out ? n : Int(r);
+		break;
+	}
+	heap.removeRoot (&buffer);
+
+	result = Reg::FromInt(ret);
+	return RunError::None;
+#endif
+}
+
+//======================================================================
+
+Scheduler::Scheduler (Module const & module, unsigned threads, SchedulerConfig const & config)
+	: m_module (module)
+	, m_config (config)
+	, m_workers ()
+	, m_globals (nullptr)
+	, m_tasks_mutex ()
+	, m_tasks ()
+	, m_live (0)
+	, m_fresh (0)
+	, m_mutex ()
+	, m_start ()
+	, m_generation (0)
+	, m_stopping (false)
+	, m_busy (0)
+{
+#if UPL_FIBERS_AVAILABLE
+	if (0 == threads)
+		threads = UPL_MAX(1U, std::thread::hardware_concurrency());
+#else
+	threads = 1;
+#endif
+
+	for (unsigned i = 0; i < threads; ++i)
+	{
+		std::unique_ptr<Worker> w (new Worker);
+		w->index = i;
+		w->heap.reset (new Heap(module.types(), config.worker_heap));
+		w->sleeping.store (false);
+		w->any_woken.store (false);
+#if UPL_FIBERS_AVAILABLE
+		w->epoll = epoll_create1(EPOLL_CLOEXEC);
+		w->wake = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+		epoll_event ev;
+		ev.events = EPOLLIN;
+		ev.data.ptr = nullptr;
+		epoll_ctl (w->epoll, EPOLL_CTL_ADD, w->wake, &ev);
+#endif
+		m_workers.push_back (std::move(w));
+	}
+	for (unsigned i = 1; i < threads; ++i)
+		m_workers[i]->thread = std::thread ([this, i] {workerMain (i);});
+}
+
+//----------------------------------------------------------------------
+
+Scheduler::~Scheduler ()
+{
+	{
+		std::lock_guard<std::mutex> lock (m_mutex);
+		m_stopping = true;
+	}
+	m_start.notify_all ();
+	for (size_t i = 1; i < m_workers.size(); ++i)
+		m_workers[i]->thread.join ();
+
+#if UPL_FIBERS_AVAILABLE
+	for (auto & w : m_workers)
+	{
+		close (w->wake);
+		close (w->epoll);
+	}
+#endif
+}
+
+//----------------------------------------------------------------------
+
+bool Scheduler::accepts (uint32_t function, int arg_count) const
+{
+	if (function >= m_module.functionCount())
+		return false;
+	auto const & f = m_module.function(function);
+	auto const & types = m_module.types();
+	if (f.param_count != arg_count || types.tag(f.type) != Type::Tag::Function)
+		return false;
+
+	auto const result = types.getFunctionReturnType(f.type);
+	if (!Parallel::IsScalar(types, result) && types.tag(result) != Type::Tag::Nil)
+		return false;
+	for (auto p : types.getFunctionParamTypes(f.type))
+		if (!Parallel::IsScalar(types, p))
+			return false;
+	return true;
+}
+
+//----------------------------------------------------------------------
+
+bool Scheduler::spawn (uint32_t function, Reg const * args, int arg_count, uint32_t * out_task)
+{
+	if (!accepts(function, arg_count))
+		return false;
+	auto const task = spawnOn(*m_workers[0], function, args, arg_count);
+	if (nullptr != out_task)
+		*out_task = task->id;
+	return true;
+}
+
+//----------------------------------------------------------------------
+
+void Scheduler::run ()
+{
+	if (0 == m_live.load())
+		return;
+
+	{
+		std::lock_guard<std::mutex> lock (m_mutex);
+		m_busy.store (unsigned(m_workers.size() - 1));
+		m_generation += 1;
+	}
+	m_start.notify_all ();
+
+	work (*m_workers[0]);
+
+	// Nobody may still be looking at this run when the next one starts.
+	while (0 != m_busy.load())
+		std::this_thread::yield ();
+}
+
+//----------------------------------------------------------------------
+
+uint32_t Scheduler::taskCount () const
+{
+	std::lock_guard<std::mutex> lock (m_tasks_mutex);
+	return uint32_t(m_tasks.size());
+}
+
+//----------------------------------------------------------------------
+
+bool Scheduler::taskResult (uint32_t task, Reg & out_result, RunError & out_error) const
+{
+	std::lock_guard<std::mutex> lock (m_tasks_mutex);
+	out_result = Reg::Nil();
+	out_error = RunError::None;
+	if (task >= m_tasks.size() || !m_tasks[task]->finished)
+		return false;
+	auto const & t = *m_tasks[task];
+	out_result = t.result;
+	out_error = t.error;
+	return RunError::None == t.error;
+}
+
+//----------------------------------------------------------------------
+
+SchedulerStats Scheduler::stats () const
+{
+	SchedulerStats ret;
+	ret.spawned = taskCount();
+	for (auto const & w : m_workers)
+	{
+		auto const & s = w->stats;
+		ret.finished += s.finished;
+		ret.failed += s.failed;
+		ret.switches += s.switches;
+		ret.steals += s.steals;
+		ret.yields += s.yields;
+		ret.io_waits += s.io_waits;
+		ret.sleeps += s.sleeps;
+		ret.global_waits += s.global_waits;
+		ret.polls += s.polls;
+		ret.contexts += s.contexts;
+		ret.max_started = UPL_MAX(ret.max_started, s.max_started);
+	}
+	return ret;
+}
+
+//----------------------------------------------------------------------
+// The tasks are kept (with their results), and so are the contexts.
+
+void Scheduler::resetStats ()
+{
+	for (auto & w : m_workers)
+		w->stats = SchedulerStats();
+}
+
+//----------------------------------------------------------------------
+
+void Scheduler::TaskMain (void * task)
+{
+	auto & t = *static_cast<Task *>(task);
+	auto & vm = *t.context->interpreter;
+	Reg result;
+	if (vm.call(t.function, t.args.data(), int(t.args.size()), result))
+		t.result = result;
+	t.error = vm.lastError();
+	std::vector<Reg>().swap (t.args);
+}
+
+//----------------------------------------------------------------------
+// On "w", so that it doesn't go far from whatever spawned it, unless
+// another worker has nothing better to do.
+
+Task * Scheduler::spawnOn (Worker & w, uint32_t function, Reg const * args, int arg_count)
+{
+	Task * task;
+	{
+		std::lock_guard<std::mutex> lock (m_tasks_mutex);
+		task = new Task(uint32_t(m_tasks.size()), function, args, arg_count);
+		task->scheduler = this;
+		m_tasks.emplace_back (task);
+	}
+	m_live.fetch_add (1);
+	{
+		std::lock_guard<std::mutex> lock (w.mutex);
+		w.fresh.push_back (task);
+	}
+	m_fresh.fetch_add (1);
+	wakeOne ();
+	return task;
+}
+
+//----------------------------------------------------------------------
+
+void Scheduler::workerMain (unsigned index)
+{
+	uint64_t seen = 0;
+	for (;;)
+	{
+		{
+			std::unique_lock<std::mutex> lock (m_mutex);
+			m_start.wait (lock, [this, seen] {return m_stopping || m_generation != seen;});
+			if (m_stopping)
+				return;
+			seen = m_generation;
+		}
+		work (*m_workers[index]);
+		m_busy.fetch_sub (1);
+	}
+}
+
+//----------------------------------------------------------------------
+// Runs what there is, polling for events every so often; with nothing
+// to run, sleeps in the event loop until there's an event, a timer is
+// due, or another worker wakes it (having spawned something, or finished
+// the last task.)
+
+void Scheduler::work (Worker & w)
+{
+	static uint32_t const sc_PollInterval = 64;		// Tasks resumed between polls
+
+	while (0 != m_live.load())
+	{
+		auto const task = next(w);
+		if (nullptr != task)
+		{
+			resume (w, task);
+			if (++w.since_poll >= sc_PollInterval)
+				poll (w, 0);
+			continue;
+		}
+
+		w.sleeping.store (true);
+		if (0 == m_live.load() || w.any_woken.load() || (0 != m_fresh.load() && w.started < m_config.max_started))
+		{
+			w.sleeping.store (false);
+			continue;
+		}
+		int timeout = -1;
+		if (!w.timers.empty())
+		{
+			auto const now = Now();
+			auto const due = w.timers.front().deadline;
+			timeout = (due <= now) ? 0 : int(UPL_MIN(uint64_t(1000000), (due - now + 999999) / 1000000));
+		}
+		poll (w, timeout);
+		w.sleeping.store (false);
+	}
+}
+
+//----------------------------------------------------------------------
+// The first of this worker's ready tasks (those woken from elsewhere
+// joining them first); or, if there's none (or it's the fresh tasks'
+// turn), the first of those not started yet; or else one not started yet
+// of another worker's.
+
+Task * Scheduler::next (Worker & w)
+{
+	static uint32_t const sc_FreshTurn = 61;		// Picks between turns of the fresh tasks
+
+	if (w.any_woken.load())
+	{
+		std::lock_guard<std::mutex> lock (w.mutex);
+		w.any_woken.store (false);
+		for (auto t : w.woken)
+			makeReady (w, t);
+		w.woken.clear ();
+	}
+
+	bool const may_start = w.started < m_config.max_started;
+	bool const fresh_turn = 0 == ++w.picks % sc_FreshTurn;
+	if (may_start && 0 != m_fresh.load() && (w.ready.empty() || fresh_turn))
+	{
+		std::lock_guard<std::mutex> lock (w.mutex);
+		if (!w.fresh.empty())
+		{
+			auto const ret = w.fresh.front();
+			w.fresh.pop_front ();
+			m_fresh.fetch_sub (1);
+			return ret;
+		}
+	}
+
+	if (!w.ready.empty())
+	{
+		auto const ret = w.ready.front();
+		w.ready.pop_front ();
+		return ret;
+	}
+
+	if (!may_start || 0 == m_fresh.load())
+		return nullptr;
+	auto const n = m_workers.size();
+	for (size_t i = 1; i < n; ++i)
+	{
+		auto & victim = *m_workers[(w.index + i) % n];
+		std::lock_guard<std::mutex> lock (victim.mutex);
+		if (!victim.fresh.empty())
+		{
+			auto const ret = victim.fresh.front();
+			victim.fresh.pop_front ();
+			m_fresh.fetch_sub (1);
+			w.stats.steals += 1;
+			return ret;
+		}
+	}
+	return nullptr;
+}
+
+//----------------------------------------------------------------------
+
+void Scheduler::resume (Worker & w, Task * task)
+{
+	if (nullptr == task->context)
+	{
+		Context * c;
+		if (!w.idle.empty())
+		{
+			c = w.idle.back();
+			w.idle.pop_back ();
+		}
+		else
+		{
+			std::unique_ptr<Context> made (new Context);
+#if UPL_FIBERS_AVAILABLE
+			made->fiber.reset (new Fiber(m_config.stack_size));
+			if (!made->fiber->valid())
+			{
+				task->error = RunError::OutOfMemory;
+				task->worker = &w;
+				w.started += 1;
+				finish (w, task);
+				return;
+			}
+#endif
+			made->interpreter.reset (new Interpreter(m_module, w.reporter, *w.heap, m_config.task_registers, m_config.task_frames));
+			c = made.get();
+			w.contexts.push_back (std::move(made));
+			w.stats.contexts += 1;
+		}
+
+		c->interpreter->setTask (task);
+		c->interpreter->setGlobals (m_globals);
+		task->context = c;
+		task->worker = &w;
+		w.started += 1;
+		w.stats.max_started = UPL_MAX(w.stats.max_started, uint64_t(w.started));
+#if UPL_FIBERS_AVAILABLE
+		c->fiber->start (&Scheduler::TaskMain, task);
+#else
+		TaskMain (task);
+		finish (w, task);
+		return;
+#endif
+	}
+
+	w.stats.switches += 1;
+	if (task->context->fiber->resume())
+		finish (w, task);
+}
+
+//----------------------------------------------------------------------
+
+void Scheduler::finish (Worker & w, Task * task)
+{
+	if (nullptr != task->context)
+	{
+		task->context->interpreter->setTask (nullptr);
+		w.idle.push_back (task->context);
+		task->context = nullptr;
+	}
+	w.started -= 1;
+	w.stats.finished += 1;
+	w.stats.failed += (RunError::None != task->error) ? 1 : 0;
+	{
+		// taskResult may be looking.
+		std::lock_guard<std::mutex> lock (m_tasks_mutex);
+		task->finished = true;
+	}
+
+	if (1 == m_live.fetch_sub(1))
+		wakeAll ();
+}
+
+//----------------------------------------------------------------------
+
+void Scheduler::makeReady (Worker & w, Task * task)
+{
+	w.ready.push_back (task);
+}
+
+//----------------------------------------------------------------------
+
+void Scheduler::poll (Worker & w, int timeout_ms)
+{
+	w.since_poll = 0;
+	w.stats.polls += 1;
+
+#if UPL_FIBERS_AVAILABLE
+	epoll_event events [64];
+	int const n = epoll_wait(w.epoll, events, 64, timeout_ms);
+	for (int i = 0; i < n; ++i)
+		if (nullptr == events[i].data.ptr)
+		{
+			uint64_t count;
+			while (read(w.wake, &count, sizeof(count)) > 0)
+				;
+		}
+		else
+			makeReady (w, static_cast<Task *>(events[i].data.ptr));
+
+	if (!w.timers.empty())
+	{
+		auto const now = Now();
+		while (!w.timers.empty() && w.timers.front().deadline <= now)
+		{
+			auto const task = w.timers.front().task;
+			std::pop_heap (w.timers.begin(), w.timers.end(), std::greater<Scheduler::Timer>());
+			w.timers.pop_back ();
+			makeReady (w, task);
+		}
+	}
+#else
+	(void)timeout_ms;
+#endif
+}
+
+//----------------------------------------------------------------------
+
+void Scheduler::wakeOne ()
+{
+#if UPL_FIBERS_AVAILABLE
+	for (auto & w : m_workers)
+		if (w->sleeping.exchange(false))
+		{
+			uint64_t const one = 1;
+			ssize_t const written = write(w->wake, &one, sizeof(one));
+			(void)written;
+			return;
+		}
+#endif
+}
+
+//----------------------------------------------------------------------
+
+void Scheduler::wakeAll ()
+{
+#if UPL_FIBERS_AVAILABLE
+	for (auto & w : m_workers)
+		if (w->sleeping.exchange(false))
+		{
+			uint64_t const one = 1;
+			ssize_t const written = write(w->wake, &one, sizeof(one));
+			(void)written;
+		}
+#endif
+}
+
+//----------------------------------------------------------------------
+
+void Scheduler::yield (Task * task)
+{
+	auto & w = *task->worker;
+	w.stats.yields += 1;
+	makeReady (w, task);
+	task->context->fiber->suspend ();
+}
+
+//----------------------------------------------------------------------
+
+void Scheduler::sleep (Task * task, Int ms)
+{
+	auto & w = *task->worker;
+	w.stats.sleeps += 1;
+	w.timers.push_back ({Now() + uint64_t(UPL_MAX(ms, Int(0))) * 1000000, task});
+	std::push_heap (w.timers.begin(), w.timers.end(), std::greater<Scheduler::Timer>());
+	task->context->fiber->suspend ();
+}
+
+//----------------------------------------------------------------------
+// Another task of this worker may be waiting on the same descriptor
+// already (epoll has one registration for each); then this one just
+// yields, and tries again.
+
+int Scheduler::waitFor (Task * task, int fd, bool out)
+{
+#if UPL_FIBERS_AVAILABLE
+	auto & w = *task->worker;
+	epoll_event ev;
+	ev.events = (out ? EPOLLOUT : EPOLLIN) | EPOLLONESHOT;
+	ev.data.ptr = task;
+	if (0 != epoll_ctl(w.epoll, EPOLL_CTL_ADD, fd, &ev))
+	{
+		if (EEXIST != errno)
+			return -errno;
+		yield (task);
+		return 0;
+	}
+
+	w.stats.io_waits += 1;
+	task->context->fiber->suspend ();
+	epoll_ctl (w.epoll, EPOLL_CTL_DEL, fd, &ev);
+	return 0;
+#else
+	(void)task;
+	(void)fd;
+	(void)out;
+	return -ENOSYS;
+#endif
+}
+
+//----------------------------------------------------------------------
+// Whoever wakes it can't have done so yet: that's only once this has
+// suspended, or it's on another worker, where the task is only put on
+// "woken", not resumed.
+
+void Scheduler::waitForGlobal (Task * task)
+{
+	task->worker->stats.global_waits += 1;
+	task->context->fiber->suspend ();
+}
+
+//----------------------------------------------------------------------
+
+void Scheduler::wakeFromGlobal (Task * task)
+{
+	auto & w = *task->worker;
+	{
+		std::lock_guard<std::mutex> lock (w.mutex);
+		w.woken.push_back (task);
+	}
+	w.any_woken.store (true);
+#if UPL_FIBERS_AVAILABLE
+	if (w.sleeping.exchange(false))
+	{
+		uint64_t const one = 1;
+		ssize_t const written = write(w.wake, &one, sizeof(one));
+		(void)written;
+	}
+#endif
+}
+
+//======================================================================
+
+	}	// namespace VM
+}	// namespace UPL
+
+//======================================================================
@@ -2,6 +2,8 @@
 
 #include <upl/st_code.hpp>
 
+#include <algorithm>
+
 //======================================================================
 
 namespace UPL {
@@ -32,25 +34,48 @@ TagInfo_t TagInfo (Tag tag)
 
 PackedST Unpacked::pack () const
 {
-	switch (tag)
+	STBuilder builder;
+	return builder.build(*this);
+}
+
+//======================================================================
+
+PackedST const & STBuilder::makeVariant (bool is_const, std::vector<ID> const & allowed_types)
+{
+	m_scratch.assign (allowed_types.begin(), allowed_types.end());
+	std::sort (m_scratch.begin(), m_scratch.end());
+	m_scratch.erase (std::unique(m_scratch.begin(), m_scratch.end()), m_scratch.end());
+
+	begin (Tag::Variant, is_const);
+	addIntList (m_scratch);
+	return finish ();
+}
+
+//----------------------------------------------------------------------
+
+PackedST const & STBuilder::build (Unpacked const & unpacked)
+{
+	auto const c = unpacked.is_const;
+
+	switch (unpacked.tag)
 	{
-	case Tag::INVALID:	return {};
-	case Tag::Nil:		return STCode::Pack(STCode::MakeNil());
-	case Tag::Bool:		return STCode::Pack(STCode::MakeBool(is_const));
-	case Tag::Byte:		return STCode::Pack(STCode::MakeByte(is_const));
-	case Tag::Char:		return STCode::Pack(STCode::MakeChar(is_const));
-	case Tag::Int:		return STCode::Pack(STCode::MakeInt(is_const));
-	case Tag::Real:		return STCode::Pack(STCode::MakeReal(is_const));
-	case Tag::String:	return STCode::Pack(STCode::MakeString(is_const));
-	case Tag::Any:		return STCode::Pack(STCode::MakeAny(is_const));
-	case Tag::Variant:	return STCode::Pack(STCode::MakeVariant(is_const, {type_list.begin(), type_list.end()}));
-	case Tag::Array:	return STCode::Pack(STCode::MakeArray(is_const, size, type1));
-	case Tag::Vector:	return STCode::Pack(STCode::MakeVector(is_const, type1));
-	case Tag::Map:		return STCode::Pack(STCode::MakeMap(is_const, type1, type2));
-	case Tag::Tuple:	return STCode::Pack(STCode::MakeTuple(is_const, type_list));
-	case Tag::Package:	return STCode::Pack(STCode::MakePackage(is_const, type_list));
-	case Tag::Function:	return STCode::Pack(STCode::MakeFuction(is_const, type1, type_list));
-	default:			assert(false); return {};
+	case Tag::INVALID:	m_buf.clear(); m_half = false; return m_buf;
+	case Tag::Nil:		return makeBasic(false, Tag::Nil);
+	case Tag::Bool:
+	case Tag::Byte:
+	case Tag::Char:
+	case Tag::Int:
+	case Tag::Real:
+	case Tag::String:
+	case Tag::Any:		return makeBasic(c, unpacked.tag);
+	case Tag::Variant:	return makeVariant(c, unpacked.type_list);
+	case Tag::Array:	return makeArray(c, unpacked.size, unpacked.type1);
+	case Tag::Vector:	return makeVector(c, unpacked.type1);
+	case Tag::Map:		return makeMap(c, unpacked.type1, unpacked.type2);
+	case Tag::Tuple:	return makeTuple(c, unpacked.type_list);
+	case Tag::Package:	return makePackage(c, unpacked.type_list);
+	case Tag::Function:	return makeFunction(c, unpacked.type1, unpacked.type_list);
+	default:			assert(false); m_buf.clear(); m_half = false; return m_buf;
 	}
 }
 
@@ -58,10 +83,13 @@ PackedST Unpacked::pack () const
 
 STContainer::STContainer ()
 	: m_types ()
+	, m_keys ()
 	, m_stash ()
-	, m_lookup ()
+	, m_slots ()
+	, m_builder ()
 {
 	m_stash.reserve (10000);
+	reserveLookup (64);
 
 	// Make the invalid entry
 	m_types.push_back ({});
@@ -69,6 +97,7 @@ STContainer::STContainer ()
 	m_types.back().bytes[1] = 0;
 	m_types.back().bytes[2] = 0;
 	m_types.back().bytes[3] = 0;
+	m_keys.push_back ({0, 0});
 
 	// Make the rest of the default entries
 	auto t01 = createType(STCode::Pack(STCode::MakeNil()));			assert ( 1 == t01);
@@ -101,16 +130,24 @@ ID STContainer::createType (PackedST const & packed_st)
 	if (!STCode::IsValid(packed_st))
 		return InvalidID;
 
-	auto id = lookupType(packed_st);
-	if (InvalidID != id)
-		return id;
+	auto const hash = HashOf(packed_st);
+	auto slot = findSlot(packed_st, hash);
+	if (InvalidID != m_slots[slot])
+		return m_slots[slot];
+
+	if (2 * m_types.size() >= m_slots.size())
+	{
+		reserveLookup (2 * m_types.size());
+		slot = findSlot(packed_st, hash);
+	}
 
 	m_types.push_back ({});
+	m_keys.push_back ({hash, uint32_t(packed_st.size())});
 
 	ID cur_id = ID(m_types.size()) - 1;
 	auto & cur = m_types.back();
 
-	m_lookup[packed_st] = cur_id;
+	m_slots[slot] = cur_id;
 
 	if (packed_st.size() <= sizeof(Entry))	// Put it in-line
 	{
@@ -134,29 +171,98 @@ ID STContainer::createType (PackedST const & packed_st)
 
 ID STContainer::createType (Unpacked const & unpacked)
 {
-	return createType(unpacked.pack());
+	return createType(m_builder.build(unpacked));
+}
+
+//----------------------------------------------------------------------
+
+void STContainer::createTypes (Unpacked const * unpackeds, size_t count, ID * out_ids)
+{
+	m_types.reserve (m_types.size() + count);
+	m_keys.reserve (m_keys.size() + count);
+	reserveLookup (m_types.size() + count);
+
+	for (size_t i = 0; i < count; ++i)
+		out_ids[i] = createType(m_builder.build(unpackeds[i]));
+}
+
+//----------------------------------------------------------------------
+
+std::vector<ID> STContainer::createTypes (std::vector<Unpacked> const & unpackeds)
+{
+	std::vector<ID> ret (unpackeds.size());
+	if (!unpackeds.empty())
+		createTypes (unpackeds.data(), unpackeds.size(), ret.data());
+	return ret;
 }
 
 //----------------------------------------------------------------------
 
 ID STContainer::lookupType (PackedST const & packed_st) const
 {
-	auto i = m_lookup.find(packed_st);
-	if (m_lookup.end() != i)
-		return i->second;
-	else
-		return InvalidID;
+	return m_slots[findSlot(packed_st, HashOf(packed_st))];
+}
+
+//----------------------------------------------------------------------
+
+uint32_t STContainer::HashOf (PackedST const & packed_st)
+{
+	uint32_t ret = 2166136261U;		// FNV-1a
+	for (auto b : packed_st)
+		ret = (ret ^ b) * 16777619U;
+	return ret;
+}
+
+//----------------------------------------------------------------------
+
+bool STContainer::isCode (ID id, PackedST const & packed_st, uint32_t hash) const
+{
+	if (m_keys[id].hash != hash || m_keys[id].size != packed_st.size())
+		return false;
+	for (size_t i = 0; i < packed_st.size(); ++i)
+		if (getByte(id, int(i)) != packed_st[i])
+			return false;
+	return true;
+}
+
+//----------------------------------------------------------------------
+
+size_t STContainer::findSlot (PackedST const & packed_st, uint32_t hash) const
+{
+	auto const mask = m_slots.size() - 1;
+	for (size_t i = hash & mask; ; i = (i + 1) & mask)
+		if (InvalidID == m_slots[i] || isCode(m_slots[i], packed_st, hash))
+			return i;
+}
+
+//----------------------------------------------------------------------
+// Enough slots for "count" types, at most half full.
+
+void STContainer::reserveLookup (size_t count)
+{
+	size_t size = 64;
+	while (size < 2 * count)
+		size *= 2;
+	if (size <= m_slots.size())
+		return;
+
+	std::vector<ID> slots (size, InvalidID);
+	auto const mask = size - 1;
+	for (ID id = 1; id < ID(m_types.size()); ++id)
+	{
+		auto i = m_keys[id].hash & mask;
+		while (InvalidID != slots[i])
+			i = (i + 1) & mask;
+		slots[i] = id;
+	}
+	m_slots.swap (slots);
 }
 
 //----------------------------------------------------------------------
 
 ID STContainer::byTag (Tag tag) const
 {
-	auto const i = TagToInt(tag);
-	if (i > 0 && i < TagToInt(Tag::Variant))
-		return ID(i);
-	else
-		return InvalidID;
+	return DefaultID(tag, false);
 }
 
 //----------------------------------------------------------------------
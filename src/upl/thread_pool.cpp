@@ -0,0 +1,210 @@
+//======================================================================
+
+#include <upl/thread_pool.hpp>
+
+//======================================================================
+
+namespace UPL {
+	namespace VM {
+
+//======================================================================
+
+ThreadPool::ThreadPool (unsigned threads)
+	: m_workers ()
+	, m_mutex ()
+	, m_wake ()
+	, m_generation (0)
+	, m_stopping (false)
+	, m_body (nullptr)
+	, m_grain (1)
+	, m_remaining (0)
+	, m_busy (0)
+	, m_loops (0)
+{
+	if (0 == threads)
+		threads = UPL_MAX(1U, std::thread::hardware_concurrency());
+
+	for (unsigned i = 0; i < threads; ++i)
+		m_workers.emplace_back (new Worker);
+	for (unsigned i = 1; i < threads; ++i)
+		m_workers[i]->thread = std::thread ([this, i] {workerMain (i);});
+}
+
+//----------------------------------------------------------------------
+
+ThreadPool::~ThreadPool ()
+{
+	{
+		std::lock_guard<std::mutex> lock (m_mutex);
+		m_stopping = true;
+	}
+	m_wake.notify_all ();
+	for (size_t i = 1; i < m_workers.size(); ++i)
+		m_workers[i]->thread.join ();
+}
+
+//----------------------------------------------------------------------
+
+void ThreadPool::parallelFor (size_t n, size_t grain, Body const & body)
+{
+	if (0 == n)
+		return;
+	grain = UPL_MAX(size_t(1), grain);
+	m_loops += 1;
+
+	if (1 == m_workers.size() || n <= grain)
+	{
+		body (0, n, 0);
+		m_workers[0]->ranges += 1;
+		return;
+	}
+
+	m_body = &body;
+	m_grain = grain;
+	m_remaining.store (n);
+	m_workers[0]->deque.push_back ({0, n});
+	{
+		std::lock_guard<std::mutex> lock (m_mutex);
+		m_busy.store (unsigned(m_workers.size() - 1));
+		m_generation += 1;
+	}
+	m_wake.notify_all ();
+
+	work (0);
+
+	// Nobody may still be looking at this loop when the next one starts.
+	while (0 != m_busy.load())
+		std::this_thread::yield ();
+	m_body = nullptr;
+}
+
+//----------------------------------------------------------------------
+
+ThreadPoolStats ThreadPool::stats () const
+{
+	ThreadPoolStats ret;
+	ret.loops = m_loops;
+	for (auto const & w : m_workers)
+	{
+		ret.ranges += w->ranges;
+		ret.splits += w->splits;
+		ret.steals += w->steals;
+	}
+	return ret;
+}
+
+//----------------------------------------------------------------------
+
+void ThreadPool::resetStats ()
+{
+	m_loops = 0;
+	for (auto & w : m_workers)
+		w->ranges = w->splits = w->steals = 0;
+}
+
+//----------------------------------------------------------------------
+
+void ThreadPool::workerMain (unsigned index)
+{
+	uint64_t seen = 0;
+	for (;;)
+	{
+		{
+			std::unique_lock<std::mutex> lock (m_mutex);
+			m_wake.wait (lock, [this, seen] {return m_stopping || m_generation != seen;});
+			if (m_stopping)
+				return;
+			seen = m_generation;
+		}
+		work (index);
+		m_busy.fetch_sub (1);
+	}
+}
+
+//----------------------------------------------------------------------
+
+void ThreadPool::work (unsigned index)
+{
+	Range range;
+	while (0 != m_remaining.load())
+		if (take(index, range))
+			run (index, range);
+		else
+			std::this_thread::yield ();
+}
+
+//----------------------------------------------------------------------
+// The back of our own deque (the piece split off last, and the smallest),
+// or else the front of someone else's, starting from the next worker.
+
+bool ThreadPool::take (unsigned index, Range & out_range)
+{
+	{
+		auto & own = *m_workers[index];
+		std::lock_guard<std::mutex> lock (own.mutex);
+		if (!own.deque.empty())
+		{
+			out_range = own.deque.back();
+			own.deque.pop_back ();
+			return true;
+		}
+	}
+
+	auto const n = unsigned(m_workers.size());
+	for (unsigned i = 1; i < n; ++i)
+	{
+		auto & victim = *m_workers[(index + i) % n];
+		std::lock_guard<std::mutex> lock (victim.mutex);
+		if (!victim.deque.empty())
+		{
+			out_range = victim.deque.front();
+			victim.deque.pop_front ();
+			m_workers[index]->steals += 1;
+			return true;
+		}
+	}
+	return false;
+}
+
+//----------------------------------------------------------------------
+// A grain at a time, splitting off the second half of what's left
+// whenever there's nothing in our deque for others to steal. What's left
+// at the end (less than two grains) is run all at once.
+
+void ThreadPool::run (unsigned index, Range range)
+{
+	auto & own = *m_workers[index];
+	auto const & body = *m_body;
+	size_t done = 0;
+	while (range.end - range.begin >= 2 * m_grain)
+	{
+		{
+			std::lock_guard<std::mutex> lock (own.mutex);
+			if (own.deque.empty())
+			{
+				auto const middle = range.begin + (range.end - range.begin) / 2;
+				own.deque.push_back ({middle, range.end});
+				range.end = middle;
+				own.splits += 1;
+				continue;
+			}
+		}
+
+		body (range.begin, range.begin + m_grain, index);
+		range.begin += m_grain;
+		done += m_grain;
+		own.ranges += 1;
+	}
+
+	body (range.begin, range.end, index);
+	done += range.end - range.begin;
+	own.ranges += 1;
+	m_remaining.fetch_sub (done);
+}
+
+//======================================================================
+
+	}	// namespace VM
+}	// namespace UPL
+
+//======================================================================
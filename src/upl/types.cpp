@@ -51,6 +51,77 @@ ID ScopedRegistry::findByName (String const & name) const
 		return InvalidID;
 }
 
+//======================================================================
+
+FlatScopedRegistry::FlatScopedRegistry (STContainer * root_st_container)
+	: m_st_container (root_st_container)
+	, m_table ()
+	, m_undo_log ()
+	, m_scope_marks ()
+{
+	assert (nullptr != m_st_container);
+	openScope ();
+}
+
+//----------------------------------------------------------------------
+
+FlatScopedRegistry::~FlatScopedRegistry ()
+{
+}
+
+//----------------------------------------------------------------------
+
+void FlatScopedRegistry::openScope ()
+{
+	m_scope_marks.push_back (m_undo_log.size());
+}
+
+//----------------------------------------------------------------------
+
+void FlatScopedRegistry::closeScope ()
+{
+	assert (!m_scope_marks.empty());
+
+	// Emptied stacks are left in the table, so their memory gets reused
+	// the next time the same name is bound.
+	auto const mark = m_scope_marks.back();
+	while (m_undo_log.size() > mark)
+	{
+		m_undo_log.back()->pop_back ();
+		m_undo_log.pop_back ();
+	}
+	m_scope_marks.pop_back ();
+}
+
+//----------------------------------------------------------------------
+
+bool FlatScopedRegistry::createName (String const & new_name, ID existing_type)
+{
+	if (!m_st_container->isValid(existing_type))
+		return false;
+
+	auto & stack = m_table[new_name];
+	if (!stack.empty() && stack.back().depth == depth())
+		return false;
+
+	stack.push_back ({existing_type, depth()});
+	m_undo_log.push_back (&stack);	// unordered_map never moves its values
+
+	return true;
+}
+
+//----------------------------------------------------------------------
+
+ID FlatScopedRegistry::findByName (String const & name) const
+{
+	auto i = m_table.find(name);
+
+	if (m_table.end() != i && !i->second.empty())
+		return i->second.back().type;
+	else
+		return InvalidID;
+}
+
 //----------------------------------------------------------------------
 //======================================================================
 
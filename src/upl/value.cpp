@@ -0,0 +1,46 @@
+//======================================================================
+
+#include <upl/value.hpp>
+
+//======================================================================
+
+namespace UPL {
+	namespace VM {
+
+//======================================================================
+
+String Printable (Value v)
+{
+	switch (v.kind())
+	{
+	case Value::Kind::Object:
+		return L"<object of type " + ToString(v.asObject()->type) + L">";
+	case Value::Kind::Nil:
+		return L"nil";
+	case Value::Kind::Bool:
+		return ToString(v.asBool());
+	case Value::Kind::Byte:
+		return ToString(v.asByte());
+	case Value::Kind::Char:
+		return String(1, v.asChar());
+	case Value::Kind::Int:
+		return ToString(v.asInt());
+	case Value::Kind::Real:
+		return ToString(v.asReal());
+	case Value::Kind::SmallString:
+	{
+		char buf [Value::msc_SmallStringMax + 1] = {};
+		v.smallStringCopy (buf);
+		return L"\"" + ToString<char const *>(buf) + L"\"";
+	}
+	}
+
+	UPL_UNREACHABLE;
+}
+
+//======================================================================
+
+	}	// namespace VM
+}	// namespace UPL
+
+//======================================================================
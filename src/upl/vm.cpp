@@ -1,15 +1,1664 @@
 //======================================================================
 
 #include <upl/vm.hpp>
+#include <upl/bulk.hpp>
+#include <upl/globals.hpp>
+#include <upl/jit.hpp>
+#include <upl/memo.hpp>
+#include <upl/parallel.hpp>
+#include <upl/scheduler.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
 
 //======================================================================
 
 namespace UPL {
+	namespace VM {
+
+//======================================================================
+
+#define OPCODE_INFO(e,s,f)				{s, #e, Format::f, 1, {Op::e, Op::e, Op::e}},
+#define FUSED_PAIR_INFO(e,s,x,y)		{s, #e, Format::None, 2, {Op::x, Op::y, Op::y}},
+#define FUSED_TRIPLE_INFO(e,s,x,y,z)	{s, #e, Format::None, 3, {Op::x, Op::y, Op::z}},
+static struct {
+	char const * name;
+	char const * identifier;
+	Format format;			// Of the first part, for superinstructions
+	int part_count;
+	Op parts [3];
+} const gsc_OpInfo [OpCount] = {
+	UPL_PRIVATE__VM_OPCODES(OPCODE_INFO)
+	UPL_PRIVATE__VM_FUSED_PAIRS(FUSED_PAIR_INFO)
+	UPL_PRIVATE__VM_FUSED_TRIPLES(FUSED_TRIPLE_INFO)
+};
+#undef  FUSED_TRIPLE_INFO
+#undef  FUSED_PAIR_INFO
+#undef  OPCODE_INFO
+
+//----------------------------------------------------------------------
+
+char const * OpName (Op op)
+{
+	return (int(op) < OpCount) ? gsc_OpInfo[int(op)].name : "???";
+}
+
+//----------------------------------------------------------------------
+
+char const * OpIdentifier (Op op)
+{
+	return (int(op) < OpCount) ? gsc_OpInfo[int(op)].identifier : "???";
+}
+
+//----------------------------------------------------------------------
+
+Format OpFormat (Op op)
+{
+	if (int(op) >= OpCount)
+		return Format::None;
+	return gsc_OpInfo[int(gsc_OpInfo[int(op)].parts[0])].format;
+}
+
+//----------------------------------------------------------------------
+
+bool FindOp (char const * name, Op & out_op)
+{
+	for (int i = 0; i < OpCount; ++i)
+		if (0 == strcmp(name, gsc_OpInfo[i].name))
+		{
+			out_op = Op(i);
+			return true;
+		}
+	return false;
+}
+
+//----------------------------------------------------------------------
+
+bool IsSafepoint (Op op)
+{
+	switch (op)
+	{
+	case Op::BoxI:
+	case Op::New:
+	case Op::NewN:
+	case Op::PMap:
+	case Op::PReduce:
+	case Op::Io:
+	case Op::Call:
+	case Op::GetG:
+		return true;
+	default:
+		return false;
+	}
+}
+
+//----------------------------------------------------------------------
+// These have bodies (VM_BODY_...) that a superinstruction can be made of.
+
+bool IsFusable (Op op)
+{
+	switch (op)
+	{
+	case Op::Nop: case Op::Move: case Op::LoadK: case Op::LoadI: case Op::LoadNil: case Op::LoadF:
+	case Op::AddI: case Op::SubI: case Op::MulI: case Op::DivI: case Op::ModI: case Op::NegI:
+	case Op::AddR: case Op::SubR: case Op::MulR: case Op::DivR: case Op::NegR:
+	case Op::EqI: case Op::LtI: case Op::LeI: case Op::EqR: case Op::LtR: case Op::LeR: case Op::Not:
+	case Op::IToR: case Op::RToI:
+	case Op::BoxB: case Op::BoxR: case Op::BoxY: case Op::BoxC:
+	case Op::UnboxB: case Op::UnboxI: case Op::UnboxR: case Op::UnboxY: case Op::UnboxC: case Op::TypeOf:
+	case Op::Jmp: case Op::JmpT: case Op::JmpF:
+		return true;
+	default:
+		return false;
+	}
+}
+
+//----------------------------------------------------------------------
+
+int FusedParts (Op op, Op out_parts [3])
+{
+	if (int(op) >= OpCount)
+	{
+		out_parts[0] = op;
+		return 1;
+	}
+
+	auto const & info = gsc_OpInfo[int(op)];
+	for (int i = 0; i < info.part_count; ++i)
+		out_parts[i] = info.parts[i];
+	return info.part_count;
+}
+
+//----------------------------------------------------------------------
+
+Instruction Unfused (Instruction ins)
+{
+	auto const op = GetOp(ins);
+	if (int(op) < BaseOpCount || int(op) >= OpCount)
+		return ins;
+	return (ins & ~Instruction(0xFF)) | Instruction(gsc_OpInfo[int(op)].parts[0]);
+}
+
+//----------------------------------------------------------------------
+// Greedily, at each instruction: the longest run that has one. (Runs
+// overlap: the second part of one superinstruction may well start the
+// next one.)
+uint32_t FuseSuperinstructions (Instruction * code, size_t size)
+{
+	uint32_t ret = 0;
+	for (size_t i = 0; i + 1 < size; ++i)
+	{
+		Op ops [3] = {GetOp(Unfused(code[i])), GetOp(Unfused(code[i + 1])), Op::Nop};
+		if (i + 2 < size)
+			ops[2] = GetOp(Unfused(code[i + 2]));
+
+		int best = 0, best_parts = 1;
+		for (int o = BaseOpCount; o < OpCount; ++o)
+		{
+			auto const & info = gsc_OpInfo[o];
+			if (info.part_count <= best_parts || size_t(info.part_count) > size - i)
+				continue;
+			if (info.parts[0] == ops[0] && info.parts[1] == ops[1] && (info.part_count < 3 || info.parts[2] == ops[2]))
+			{
+				best = o;
+				best_parts = info.part_count;
+			}
+		}
+		if (0 != best)
+		{
+			code[i] = (code[i] & ~Instruction(0xFF)) | Instruction(best);
+			ret += 1;
+		}
+	}
+	return ret;
+}
+
+//----------------------------------------------------------------------
+// Of the mnemonics, in order; the same in builds with the same opcodes.
+uint32_t OpcodeSetID ()
+{
+	uint32_t h = 2166136261U;
+	for (int i = 0; i < OpCount; ++i)
+		for (char const * p = gsc_OpInfo[i].name; ; ++p)
+		{
+			h = (h ^ uint8_t(*p)) * 16777619U;
+			if ('\0' == *p)
+				break;
+		}
+	return h;
+}
+
+//======================================================================
+
+OpcodeProfile::OpcodeProfile ()
+	: m_pairs (size_t(BaseOpCount) * BaseOpCount)
+	, m_triples (size_t(BaseOpCount) * BaseOpCount * BaseOpCount)
+	, m_total (0)
+	, m_next (nullptr)
+	, m_last ()
+	, m_chain (0)
+{
+}
+
+//----------------------------------------------------------------------
+
+void OpcodeProfile::clear ()
+{
+	std::fill (m_pairs.begin(), m_pairs.end(), 0);
+	std::fill (m_triples.begin(), m_triples.end(), 0);
+	m_total = 0;
+	m_next = nullptr;
+	m_chain = 0;
+}
+
+//----------------------------------------------------------------------
+
+bool OpcodeProfile::save (char const * path) const
+{
+	FILE * f = fopen(path, "w");
+	if (nullptr == f)
+		return false;
+
+	fprintf (f, "%llu\n", (unsigned long long)m_total);
+	for (int a = 0; a < BaseOpCount; ++a)
+		for (int b = 0; b < BaseOpCount; ++b)
+		{
+			if (0 != pair(Op(a), Op(b)))
+				fprintf (f, "%llu %s %s\n", (unsigned long long)pair(Op(a), Op(b)), OpName(Op(a)), OpName(Op(b)));
+			for (int c = 0; c < BaseOpCount; ++c)
+				if (0 != triple(Op(a), Op(b), Op(c)))
+					fprintf (f, "%llu %s %s %s\n", (unsigned long long)triple(Op(a), Op(b), Op(c)), OpName(Op(a)), OpName(Op(b)), OpName(Op(c)));
+		}
+
+	bool const ok = (0 == ferror(f));
+	return (0 == fclose(f)) && ok;
+}
+
+//----------------------------------------------------------------------
+
+bool OpcodeProfile::load (char const * path)
+{
+	FILE * f = fopen(path, "r");
+	if (nullptr == f)
+		return false;
+
+	bool ok = true;
+	char line [256];
+	for (bool first = true; ok && nullptr != fgets(line, sizeof(line), f); first = false)
+	{
+		unsigned long long count = 0;
+		char names [3][32];
+		int const n = sscanf(line, "%llu %31s %31s %31s", &count, names[0], names[1], names[2]);
+		Op ops [3];
+		for (int i = 1; ok && i < n; ++i)
+			ok = FindOp(names[i - 1], ops[i - 1]) && int(ops[i - 1]) < BaseOpCount;
+
+		if (!ok || n <= 0)
+			ok = false;
+		else if (1 == n && first)
+			m_total += count;
+		else if (3 == n)
+			m_pairs[Index(ops[0], ops[1])] += count;
+		else if (4 == n)
+			m_triples[Index(ops[0], ops[1], ops[2])] += count;
+		else
+			ok = false;
+	}
+
+	fclose (f);
+	return ok;
+}
+
+//======================================================================
+
+Module::Module ()
+	: m_types ()
+	, m_tables ()
+	, m_image ()
+	, m_functions ()
+	, m_names ()
+	, m_code ()
+	, m_constants ()
+	, m_stack_maps ()
+	, m_constant_lookup ()
+{
+}
+
+//----------------------------------------------------------------------
+// Out of line, so that whatever owns the image is released here.
+Module::~Module ()
+{
+}
+
+//----------------------------------------------------------------------
+
+uint32_t Module::findFunction (char const * name) const
+{
+	for (uint32_t i = 0; i < functionCount(); ++i)
+		if (0 == strcmp(functionName(i), name))
+			return i;
+	return functionCount();
+}
+
+//----------------------------------------------------------------------
+
+uint32_t Module::findGlobal (char const * name) const
+{
+	for (uint32_t i = 0; i < globalCount(); ++i)
+		if (0 == strcmp(globalName(i), name))
+			return i;
+	return globalCount();
+}
+
+//----------------------------------------------------------------------
+
+void Module::attachImage (std::shared_ptr<void const> image, Tables const & tables)
+{
+	assert (!isImage() && m_functions.empty() && m_code.empty() && m_constants.empty());
+	m_image = std::move(image);
+	m_tables = tables;
+}
+
+//----------------------------------------------------------------------
+
+void Module::refreshTables ()
+{
+	m_tables.functions = m_functions.data();
+	m_tables.function_count = uint32_t(m_functions.size());
+	m_tables.globals = m_globals.data();
+	m_tables.global_count = uint32_t(m_globals.size());
+	m_tables.code = m_code.data();
+	m_tables.code_size = uint32_t(m_code.size());
+	m_tables.constants = m_constants.data();
+	m_tables.constant_count = uint32_t(m_constants.size());
+	m_tables.stack_maps = m_stack_maps.data();
+	m_tables.stack_map_count = uint32_t(m_stack_maps.size());
+	m_tables.names = m_names.data();
+	m_tables.names_size = uint32_t(m_names.size());
+}
+
+//----------------------------------------------------------------------
+
+StackMap const * Module::findStackMap (Function const & f, uint32_t pc) const
+{
+	auto const first = m_tables.stack_maps + f.stack_map_offset;
+	auto const last = first + f.stack_map_count;
+	auto const i = std::lower_bound (first, last, pc,
+		[](StackMap const & m, uint32_t pc){return m.pc < pc;});
+	return (i != last && i->pc == pc) ? i : nullptr;
+}
+
+//----------------------------------------------------------------------
+
+uint32_t Module::addConstant (Reg value)
+{
+	assert (!isImage());
+
+	auto i = m_constant_lookup.find(value.u);
+	if (m_constant_lookup.end() != i)
+		return i->second;
+
+	auto const ret = uint32_t(m_constants.size());
+	m_constants.push_back (value);
+	m_constant_lookup[value.u] = ret;
+	refreshTables ();
+	return ret;
+}
+
+//----------------------------------------------------------------------
+
+uint32_t Module::addFunction (std::string const & name, Type::ID type, uint16_t param_count, uint16_t register_count,
+	std::vector<Instruction> const & code, std::vector<StackMap> const & stack_maps)
+{
+	auto const ret = declareFunction(name, type, param_count);
+	defineFunction (ret, register_count, code, stack_maps);
+	return ret;
+}
+
+//----------------------------------------------------------------------
+
+uint32_t Module::declareFunction (std::string const & name, Type::ID type, uint16_t param_count)
+{
+	assert (!isImage());
+
+	Function f;
+	f.code_offset = 0;
+	f.code_size = 0;
+	f.name = uint32_t(m_names.size());
+	f.type = type;
+	f.param_count = param_count;
+	f.register_count = param_count;
+	f.stack_map_offset = 0;
+	f.stack_map_count = 0;
+	f.flags = 0;
+	f.reserved = 0;
+
+	m_names.insert (m_names.end(), name.c_str(), name.c_str() + name.size() + 1);
+	m_functions.push_back (f);
+	refreshTables ();
+	return uint32_t(m_functions.size() - 1);
+}
+
+//----------------------------------------------------------------------
+
+void Module::defineFunction (uint32_t index, uint16_t register_count,
+	std::vector<Instruction> const & code, std::vector<StackMap> const & stack_maps)
+{
+	assert (!isImage());
+	assert (index < m_functions.size());
+	assert (register_count >= m_functions[index].param_count);
+
+	auto & f = m_functions[index];
+	f.code_offset = uint32_t(m_code.size());
+	f.code_size = uint32_t(code.size());
+	f.register_count = register_count;
+	f.stack_map_offset = uint32_t(m_stack_maps.size());
+	f.stack_map_count = uint32_t(stack_maps.size());
+	m_code.insert (m_code.end(), code.begin(), code.end());
+	m_stack_maps.insert (m_stack_maps.end(), stack_maps.begin(), stack_maps.end());
+	assert (std::is_sorted(m_stack_maps.begin() + f.stack_map_offset, m_stack_maps.end(),
+		[](StackMap const & a, StackMap const & b){return a.pc < b.pc;}));
+	refreshTables ();
+}
+
+//----------------------------------------------------------------------
+
+void Module::setFunctionFlags (uint32_t index, uint16_t flags)
+{
+	assert (!isImage());
+	assert (index < m_functions.size());
+
+	m_functions[index].flags = flags;
+	refreshTables ();
+}
+
+//----------------------------------------------------------------------
+
+uint32_t Module::addGlobal (std::string const & name, Type::ID type, uint32_t initializer)
+{
+	assert (!isImage());
+	assert (initializer < m_functions.size() && 0 == m_functions[initializer].param_count);
+
+	Global g;
+	g.name = uint32_t(m_names.size());
+	g.type = type;
+	g.initializer = initializer;
+	g.reserved = 0;
+
+	m_names.insert (m_names.end(), name.c_str(), name.c_str() + name.size() + 1);
+	m_globals.push_back (g);
+	refreshTables ();
+	return uint32_t(m_globals.size() - 1);
+}
+
+//----------------------------------------------------------------------
+
+String Module::disassemble (uint32_t function_index) const
+{
+	auto const & f = function(function_index);
+	char line [128];
+
+	snprintf (line, sizeof(line), "function %s (%u params, %u registers%s%s)\n",
+		functionName(function_index), unsigned(f.param_count), unsigned(f.register_count),
+		(f.flags & Function::msc_Pure) ? ", pure" : "", (f.flags & Function::msc_Memoize) ? ", memoize" : "");
+	String ret = ToString<char const *>(line);
+
+	auto const c = code(f);
+	for (uint32_t i = 0; i < f.code_size; ++i)
+	{
+		auto const ins = c[i];
+		auto const op = GetOp(ins);
+		// A superinstruction shows as its first part, marked; the other
+		// parts are still there in the following instructions.
+		Op parts [3];
+		bool const fused = FusedParts(op, parts) > 1;
+		int n = snprintf (line, sizeof(line), "  %04u  %-8s", unsigned(i), fused ? (std::string(OpName(parts[0])) + "+").c_str() : OpName(op));
+
+		switch (OpFormat(op))
+		{
+		case Format::None:	break;
+		case Format::A:		snprintf (line + n, sizeof(line) - n, "r%u", GetA(ins)); break;
+		case Format::AB:	snprintf (line + n, sizeof(line) - n, "r%u, r%u", GetA(ins), GetB(ins)); break;
+		case Format::AN:	snprintf (line + n, sizeof(line) - n, "r%u, %u", GetA(ins), GetB(ins)); break;
+		case Format::ANN:	snprintf (line + n, sizeof(line) - n, "r%u, %u, %u", GetA(ins), GetB(ins), GetC(ins)); break;
+		case Format::ABC:	snprintf (line + n, sizeof(line) - n, "r%u, r%u, r%u", GetA(ins), GetB(ins), GetC(ins)); break;
+		case Format::ABN:	snprintf (line + n, sizeof(line) - n, "r%u, r%u, %u", GetA(ins), GetB(ins), GetC(ins)); break;
+		case Format::ABx:	snprintf (line + n, sizeof(line) - n, "r%u, #%u", GetA(ins), GetBx(ins)); break;
+		case Format::AsBx:	snprintf (line + n, sizeof(line) - n, "r%u, %d", GetA(ins), GetSBx(ins)); break;
+		case Format::sBx:	snprintf (line + n, sizeof(line) - n, "%d  (-> %04d)", GetSBx(ins), int(i) + 1 + GetSBx(ins)); break;
+		}
+
+		ret += ToString<char const *>(line);
+		if (Op::Bulk == op)
+		{
+			ret += L"\t; ";
+			ret += ToString<char const *>(IsValidBulk(uint8_t(GetC(ins))) ? BulkName(uint8_t(GetC(ins))) : "?");
+		}
+		else if (Op::Io == op)
+		{
+			ret += L"\t; ";
+			ret += ToString<char const *>(IoName(uint8_t(GetC(ins))));
+		}
+
+		auto const map = IsSafepoint(op) ? findStackMap(f, i) : nullptr;
+		if (nullptr != map)
+		{
+			ret += L"\t; live:";
+			for (unsigned r = 0; r < f.register_count; ++r)
+				if (map->isLive(r))
+					ret += L" r" + ToString(r);
+		}
+		ret += L"\n";
+	}
+
+	return ret;
+}
 
 //======================================================================
+
+void Assembler::emitLoadInt (uint8_t a, Int v, Module & module)
+{
+	if (v >= -0x8000 && v <= 0x7FFF)
+		emit (EncodeSBx(Op::LoadI, a, int16_t(v)));
+	else
+		emitBx (Op::LoadK, a, module.addConstant(Reg::FromInt(v)));
+}
+
 //----------------------------------------------------------------------
+
+void Assembler::emitLoadReal (uint8_t a, Real v, Module & module)
+{
+	emitBx (Op::LoadK, a, module.addConstant(Reg::FromReal(v)));
+}
+
+//----------------------------------------------------------------------
+
+void Assembler::setLive (uint8_t reg, bool holds_value)
+{
+	auto const bit = uint64_t(1) << (reg % 64);
+	if (holds_value)
+		m_live[reg / 64] |= bit;
+	else
+		m_live[reg / 64] &= ~bit;
+}
+
+//----------------------------------------------------------------------
+
+Assembler::Label Assembler::newLabel ()
+{
+	m_labels.push_back (-1);
+	return Label(m_labels.size() - 1);
+}
+
+//----------------------------------------------------------------------
+
+void Assembler::bind (Label label)
+{
+	assert (m_labels[label] < 0);
+	m_labels[label] = int(m_code.size());
+}
+
+//----------------------------------------------------------------------
+
+void Assembler::emitJump (Op op, uint8_t a, Label target)
+{
+	assert (op == Op::Jmp || op == Op::JmpT || op == Op::JmpF);
+	m_fixups.push_back ({m_code.size(), target});
+	emit (EncodeSBx(op, a, 0));
+}
+
+//----------------------------------------------------------------------
+
+bool Assembler::finish (std::vector<Instruction> & out_code, std::vector<StackMap> * out_stack_maps)
+{
+	if (m_bx_out_of_range)
+		return false;
+
+	for (auto const & f : m_fixups)
+	{
+		auto const target = m_labels[f.target];
+		if (target < 0)
+			return false;
+
+		auto const offset = target - int(f.at + 1);
+		if (offset < -0x8000 || offset > 0x7FFF)
+			return false;
+
+		auto const ins = m_code[f.at];
+		m_code[f.at] = EncodeSBx(GetOp(ins), uint8_t(GetA(ins)), int16_t(offset));
+	}
+
+	out_code = std::move(m_code);
+	if (nullptr != out_stack_maps)
+		*out_stack_maps = std::move(m_stack_maps);
+	m_code.clear ();
+	m_stack_maps.clear ();
+	clearLive ();
+	m_labels.clear ();
+	m_fixups.clear ();
+	m_bx_out_of_range = false;
+	return true;
+}
+
+//======================================================================
+
+Interpreter::Interpreter (Module const & module, Error::Reporter & reporter, Heap & heap, size_t register_file_size, size_t max_frames)
+	: m_module (module)
+	, m_reporter (reporter)
+	, m_heap (heap)
+	, m_registers (register_file_size)
+	, m_frames ()
+	, m_max_frames (max_frames)
+	, m_last_error (RunError::None)
+	, m_stats ()
+	, m_pc (nullptr)
+	, m_jit (nullptr)
+	, m_profile (nullptr)
+	, m_parallel (nullptr)
+	, m_memo (nullptr)
+	, m_globals (nullptr)
+	, m_task (nullptr)
+{
+	assert (&heap.types() == &module.types());
+	m_frames.reserve (UPL_MIN(max_frames, size_t(4096)));
+	m_heap.addRootSource (this);
+}
+
+//----------------------------------------------------------------------
+
+Interpreter::~Interpreter ()
+{
+	m_heap.removeRootSource (this);
+}
+
+//----------------------------------------------------------------------
+
+bool Interpreter::call (uint32_t function_index, Reg const * args, int arg_count, Reg & out_result)
+{
+	m_last_error = RunError::None;
+
+	if (function_index >= m_module.functionCount())
+		return fail(RunError::BadFunction, nullptr);
+
+	auto const & f = m_module.function(function_index);
+	if (arg_count != f.param_count)
+		return fail(RunError::BadArgCount, &f);
+
+	// Nested calls (e.g. from a host function) go above whatever is running.
+	uint32_t const base = m_frames.empty() ? 0 : (m_frames.back().base + m_frames.back().function->register_count);
+	if (base + f.register_count > m_registers.size() || m_frames.size() >= m_max_frames)
+		return fail(RunError::StackOverflow, &f);
+
+	for (int i = 0; i < arg_count; ++i)
+		m_registers[base + i] = args[i];
+
+	prepareCaches ();
+	m_frames.push_back ({&f, nullptr, base, 0, nullptr, {0, 0, 0}});
+	return run(m_frames.size(), out_result);
+}
+
+//----------------------------------------------------------------------
+
+bool Interpreter::readGlobal (uint32_t index, Reg & out_value)
+{
+	m_last_error = RunError::None;
+	if (nullptr != m_globals && m_globals->get(index, out_value) &&
+			(&m_globals->heap() == &m_heap || !m_globals->isHeapBound(index)))
+		return true;
+
+	RunError err;
+	if (forceGlobal(nullptr, index, out_value, err))
+		return true;
+	return (RunError::None == err) ? false : fail(err, nullptr);
+}
+
+//----------------------------------------------------------------------
+
+bool Interpreter::fail (RunError err, Function const * where)
+{
+	static wchar_t const * const sc_Messages [] = {
+		L"No error.",
+		L"Stack overflow.",
+		L"Integer division by zero.",
+		L"Wrong number of arguments in call.",
+		L"Invalid opcode.",
+		L"Call to an invalid function.",
+		L"Out of memory.",
+		L"Not an object.",
+		L"No such field, or a field of a type the instruction can't handle.",
+		L"Index out of range.",
+		L"No such global, or no Globals to read it from (or not on this heap.)",
+		L"Global needed to compute its own value.",
+	};
+
+	m_last_error = err;
+
+	String msg = sc_Messages[int(err)];
+	if (nullptr != where)
+		msg += L" (in " + ToString<char const *>(m_module.functionName(m_module.functionIndex(where))) + L")";
+
+	m_reporter.newRuntimeError (Location(), int(err), std::move(msg));
+	return false;
+}
+
+//----------------------------------------------------------------------
+// Each frame but the innermost is stopped at the call to the next one
+// (whose return_pc is just past it); the innermost is at m_pc. Frames
+// entered from the host have no caller pc, and hold no references the
+// host didn't root itself.
+void Interpreter::visitRoots (RootVisitor & visitor)
+{
+	for (size_t i = 0; i < m_frames.size(); ++i)
+	{
+		auto const & frame = m_frames[i];
+		auto const at = (i + 1 < m_frames.size()) ? m_frames[i + 1].return_pc : m_pc;
+		if (nullptr == at)
+			continue;
+
+		auto const pc = uint32_t(at - 1 - m_module.code(*frame.function));
+		auto const map = m_module.findStackMap(*frame.function, pc);
+		if (nullptr == map)
+			continue;
+
+		for (unsigned r = 0; r < frame.function->register_count; ++r)
+			if (map->isLive(r))
+			{
+				auto & reg = m_registers[frame.base + r];
+				auto v = reg.value();
+				visitor.visit (v);
+				reg = Reg::FromValue(v);
+			}
+	}
+}
+
+//----------------------------------------------------------------------
+// Fields and elements are stored at their layout's size; references are
+// plain Object pointers, and become Values in registers.
+Interpreter::Access Interpreter::accessOf (Type::ID type) const
+{
+	using Type::Tag;
+
+	switch (m_module.types().tag(type))
+	{
+	case Tag::Nil:	return Access::Nil;
+	case Tag::Bool:	return Access::Bool;
+	case Tag::Byte:	return Access::Byte;
+	case Tag::Char:	return Access::Char;
+	case Tag::Int:	return Access::Int;
+	case Tag::Real:	return Access::Real;
+	default:
+		return m_heap.layouts().isBoxed(type) ? Access::Ref : Access::Bad;
+	}
+}
+
+//----------------------------------------------------------------------
+
+inline void Interpreter::Load (uint8_t const * at, Access access, Reg & out)
+{
+	switch (access)
+	{
+	case Access::Bad:
+	case Access::Nil:	out = Reg::Nil(); return;
+	case Access::Bool:	out = Reg::FromBool(0 != *at); return;
+	case Access::Byte:	out = Reg::FromInt(*at); return;
+	case Access::Char:	{Char c; memcpy (&c, at, sizeof(c)); out = Reg::FromInt(Int(uint32_t(c))); return;}
+	case Access::Int:	memcpy (&out.i, at, sizeof(Int)); return;
+	case Access::Real:	memcpy (&out.r, at, sizeof(Real)); return;
+	case Access::Ref:
+		{
+			Object * obj;
+			memcpy (&obj, at, sizeof(obj));
+			out = Reg::FromValue(nullptr == obj ? Value::Nil() : Value::FromObject(obj));
+		}
+		return;
+	}
+}
+
+//----------------------------------------------------------------------
+
+inline bool Interpreter::store (Object const * holder, uint8_t * at, Access access, Reg v)
+{
+	switch (access)
+	{
+	case Access::Bad:	return false;
+	case Access::Nil:	return true;
+	case Access::Bool:	*at = (0 != v.i) ? 1 : 0; return true;
+	case Access::Byte:	*at = uint8_t(v.i); return true;
+	case Access::Char:	{Char c = Char(v.i); memcpy (at, &c, sizeof(c)); return true;}
+	case Access::Int:	memcpy (at, &v.i, sizeof(Int)); return true;
+	case Access::Real:	memcpy (at, &v.r, sizeof(Real)); return true;
+	case Access::Ref:
+		{
+			auto const value = v.value();
+			if (!value.isObject() && !value.isNil())
+				return false;
+			Object * obj = value.isObject() ? value.asObject() : nullptr;
+			memcpy (at, &obj, sizeof(obj));
+			m_heap.writeBarrier (holder, at, obj);
+		}
+		return true;
+	}
+	return false;
+}
+
+//----------------------------------------------------------------------
+
+namespace {
+
+inline bool Refuse (RunError err, RunError & out_error)
+{
+	out_error = err;
+	return false;
+}
+
+}	// namespace
+
+//----------------------------------------------------------------------
+// A call made by an instruction, rather than by the host: the caller's
+// frame stays stopped at "pc", so its references are found (and updated)
+// if the callee collects garbage.
+
+bool Interpreter::callFrom (Instruction const * pc, Function const & f, Reg const * args, Reg & out_result)
+{
+	auto const & top = m_frames.back();
+	uint32_t const base = top.base + top.function->register_count;
+	if (base + f.register_count > m_registers.size() || m_frames.size() >= m_max_frames)
+		return fail(RunError::StackOverflow, &f);
+
+	for (unsigned i = 0; i < f.param_count; ++i)
+		m_registers[base + i] = args[i];
+	m_frames.push_back ({&f, pc, base, 0, nullptr, {0, 0, 0}});
+	m_stats.calls += 1;
+	if (m_frames.size() > m_stats.max_frame_depth)
+		m_stats.max_frame_depth = m_frames.size();
+
+	bool const ok = run(m_frames.size(), out_result);
+	m_pc = pc;
+	return ok;
+}
+
+//----------------------------------------------------------------------
+// From the host (with no "pc"), the initializer is called as the host
+// would call it.
+
+bool Interpreter::forceGlobal (Instruction const * pc, uint32_t index, Reg & out_value, RunError & out_error)
+{
+	out_error = RunError::None;
+	if (nullptr == m_globals || &m_globals->module() != &m_module || index >= m_globals->count() ||
+			(m_globals->isHeapBound(index) && &m_globals->heap() != &m_heap))
+		return Refuse(RunError::BadGlobal, out_error);
+
+	// Under a Scheduler, the task (not the thread) forces it, and waits
+	auto const waiter = GlobalsWaiterOf(m_task);
+	switch (m_globals->claim(index, out_value, waiter))
+	{
+	case Globals::Claim::Forced:	return true;
+	case Globals::Claim::Cycle:		return Refuse(RunError::CyclicGlobal, out_error);
+	case Globals::Claim::Mine:		break;
+	}
+
+	auto const initializer = m_module.global(index).initializer;
+	bool const ok = (nullptr == pc)
+		? call(initializer, nullptr, 0, out_value)
+		: callFrom(pc, m_module.function(initializer), nullptr, out_value);
+	if (ok)
+		m_globals->settle (index, out_value, waiter);
+	else
+		m_globals->abandon (index, waiter);
+	return ok;
+}
+
+//----------------------------------------------------------------------
+// Objects may move with every call, so the elements are found again from
+// rooted Values each time round.
+
+bool Interpreter::mapElements (Instruction const * pc, Reg * args, bool parallel, RunError & out_error)
+{
+	out_error = RunError::None;
+	auto const f = args[2].f;
+	if (nullptr == f)
+		return Refuse(RunError::BadFunction, out_error);
+	if (1 != f->param_count)
+		return Refuse(RunError::BadArgCount, out_error);
+	auto in = args[3].value();
+	if (!in.isObject())
+		return Refuse(RunError::NotAnObject, out_error);
+
+	uint8_t * first;
+	Type::ID in_type;
+	Type::Size in_stride;
+	uint32_t count;
+	if (!m_heap.packedElements(in.asObject(), first, in_type, in_stride, count) || Access::Bad == accessOf(in_type))
+		return Refuse(RunError::BadField, out_error);
+	auto const in_access = accessOf(in_type);
+	auto const in_offset = first - static_cast<uint8_t *>(m_heap.payload(in.asObject()));
+
+	m_heap.addRoot (&in);
+	auto const obj = m_heap.allocate(Type::ID(args[1].i), count);
+	m_heap.removeRoot (&in);
+	if (nullptr == obj)
+		return Refuse(RunError::OutOfMemory, out_error);
+
+	Type::ID out_type;
+	Type::Size out_stride;
+	uint32_t out_count;
+	if (!m_heap.packedElements(obj, first, out_type, out_stride, out_count) || Access::Bad == accessOf(out_type))
+		return Refuse(RunError::BadField, out_error);
+	if (out_count < count)
+		return Refuse(RunError::IndexOutOfRange, out_error);
+	auto const out_access = accessOf(out_type);
+	auto const out_offset = first - static_cast<uint8_t *>(m_heap.payload(obj));
+
+	if (parallel && nullptr != m_parallel && m_parallel->accepts(f, 1, in_type) && Parallel::IsScalar(m_module.types(), out_type))
+	{
+		out_error = m_parallel->map(m_heap, f, in.asObject(), obj, m_stats.parallel_elements);
+		args[0] = Reg::FromValue(Value::FromObject(obj));
+		return RunError::None == out_error;
+	}
+
+	auto out = Value::FromObject(obj);
+	m_heap.addRoot (&in);
+	m_heap.addRoot (&out);
+	bool ok = true;
+	for (uint32_t i = 0; ok && i < count; ++i)
+	{
+		Reg arg, result;
+		Load (static_cast<uint8_t *>(m_heap.payload(in.asObject())) + in_offset + size_t(i) * in_stride, in_access, arg);
+		ok = callFrom(pc, *f, &arg, result);
+		if (ok && !store(out.asObject(), static_cast<uint8_t *>(m_heap.payload(out.asObject())) + out_offset + size_t(i) * out_stride, out_access, result))
+		{
+			out_error = RunError::BadField;
+			ok = false;
+		}
+	}
+	m_heap.removeRoot (&out);
+	m_heap.removeRoot (&in);
+
+	args[0] = Reg::FromValue(out);
+	return ok;
+}
+
+//----------------------------------------------------------------------
+
+bool Interpreter::reduceElements (Instruction const * pc, Reg * args, bool parallel, RunError & out_error)
+{
+	auto const & types = m_module.types();
+	out_error = RunError::None;
+	auto const f = args[1].f;
+	if (nullptr == f || types.tag(f->type) != Type::Tag::Function)
+		return Refuse(RunError::BadFunction, out_error);
+	if (2 != f->param_count)
+		return Refuse(RunError::BadArgCount, out_error);
+	auto in = args[3].value();
+	if (!in.isObject())
+		return Refuse(RunError::NotAnObject, out_error);
+
+	uint8_t * first;
+	Type::ID in_type;
+	Type::Size stride;
+	uint32_t count;
+	if (!m_heap.packedElements(in.asObject(), first, in_type, stride, count) || Access::Bad == accessOf(in_type))
+		return Refuse(RunError::BadField, out_error);
+	auto const in_access = accessOf(in_type);
+	auto const offset = first - static_cast<uint8_t *>(m_heap.payload(in.asObject()));
+
+	if (parallel && nullptr != m_parallel && m_parallel->accepts(f, 2, in_type))
+	{
+		Reg result;
+		out_error = m_parallel->reduce(m_heap, f, args[2], in.asObject(), result, m_stats.parallel_elements);
+		if (RunError::None != out_error)
+			return false;
+		args[0] = result;
+		return true;
+	}
+
+	// The accumulator is rooted too, if it's a reference.
+	bool const is_ref = Access::Ref == accessOf(types.getFunctionReturnType(f->type));
+	Reg call_args [2] = {args[2], Reg::Nil()};
+	auto acc = call_args[0].value();
+	m_heap.addRoot (&in);
+	if (is_ref)
+		m_heap.addRoot (&acc);
+	bool ok = true;
+	for (uint32_t i = 0; ok && i < count; ++i)
+	{
+		if (is_ref)
+			call_args[0] = Reg::FromValue(acc);
+		Load (static_cast<uint8_t *>(m_heap.payload(in.asObject())) + offset + size_t(i) * stride, in_access, call_args[1]);
+		ok = callFrom(pc, *f, call_args, call_args[0]);
+		acc = call_args[0].value();
+	}
+	if (is_ref)
+		m_heap.removeRoot (&acc);
+	m_heap.removeRoot (&in);
+
+	args[0] = call_args[0];
+	return ok;
+}
+
+//----------------------------------------------------------------------
+// The caches live beside the code (which may be a read-only image), one
+// for each instruction that has any; they are laid out again whenever
+// the module has grown.
+void Interpreter::prepareCaches ()
+{
+	if (m_cache_slots.size() == m_module.codeSize())
+		return;
+
+	auto const code = m_module.code();
+	m_cache_slots.assign (m_module.codeSize(), 0);
+	size_t count = 0;
+	for (size_t i = 0; i < m_cache_slots.size(); ++i)
+		switch (GetOp(code[i]))
+		{
+		case Op::Call: case Op::TailCall:
+		case Op::GetF: case Op::SetF: case Op::GetE: case Op::SetE:
+			m_cache_slots[i] = uint32_t(count++);
+			break;
+		default:
+			break;
+		}
+
+	InlineCache empty;
+	memset (&empty, 0, sizeof(empty));
+	m_caches.assign (UPL_MAX(count, size_t(1)), empty);
+}
+
+//----------------------------------------------------------------------
+
+inline Interpreter::CacheEntry const * Interpreter::cached (InlineCache const & cache, uintptr_t key)
+{
+	for (uint32_t i = 0; i < cache.count; ++i)
+		if (cache.entries[i].key == key)
+		{
+			m_stats.cache_hits += 1;
+			return &cache.entries[i];
+		}
+	return nullptr;
+}
+
+//----------------------------------------------------------------------
+// Once a cache is full, it stays as it is (the instruction is
+// megamorphic), and "entry" is only good for this one execution.
+Interpreter::CacheEntry const * Interpreter::remember (InlineCache & cache, CacheEntry const & entry, CacheEntry & scratch)
+{
+	m_stats.cache_misses += 1;
+	if (cache.count < msc_CacheWays)
+		return &(cache.entries[cache.count++] = entry);
+
+	m_stats.cache_megamorphic += 1;
+	scratch = entry;
+	return &scratch;
+}
+
+//----------------------------------------------------------------------
+
+bool Interpreter::run (size_t entry_depth, Reg & out_result)
+{
+	Reg * const regs = m_registers.data();
+	Reg const * const K = m_module.constants();
+	Instruction const * const code = m_module.code();
+	Function const * const functions = m_module.functions();
+	uint32_t const * const cache_slots = m_cache_slots.data();
+	InlineCache * const caches = m_caches.data();
+	CacheEntry scratch;
+
+	Function const * fn = m_frames.back().function;
+	Reg * R = regs + m_frames.back().base;
+	Instruction const * pc = code + fn->code_offset;
+	Instruction ins = 0;
+	Reg ret_value;
+	uint64_t executed = 0;
+	RunError error = RunError::None;
+
+	#define RA		R[GetA(ins)]
+	#define RB		R[GetB(ins)]
+	#define RC		R[GetC(ins)]
+	#define VM_FAIL(err)	do { error = (err); goto L_Fail; } while (false)
+	#define VM_CACHE()		caches[cache_slots[pc - 1 - code]]
+	#define VM_JUMP()		do { auto const d = GetSBx(ins); pc += d; if (d < 0 && nullptr != m_jit) goto L_Native; } while (false)
+
+	// The simple instructions (see IsFusable), which superinstructions are
+	// made of
+	#define VM_BODY_Nop
+	#define VM_BODY_Move	RA = RB;
+	#define VM_BODY_LoadK	RA = K[GetBx(ins)];
+	#define VM_BODY_LoadI	RA.i = GetSBx(ins);
+	#define VM_BODY_LoadNil	RA.u = 0;
+	#define VM_BODY_LoadF	RA.f = functions + GetBx(ins);
+	#define VM_BODY_AddI	RA.i = WrapAdd(RB.i, RC.i);
+	#define VM_BODY_SubI	RA.i = WrapSub(RB.i, RC.i);
+	#define VM_BODY_MulI	RA.i = WrapMul(RB.i, RC.i);
+	#define VM_BODY_DivI	if (0 == RC.i) VM_FAIL(RunError::DivisionByZero); RA.i = WrapDiv(RB.i, RC.i);
+	#define VM_BODY_ModI	if (0 == RC.i) VM_FAIL(RunError::DivisionByZero); RA.i = WrapMod(RB.i, RC.i);
+	#define VM_BODY_NegI	RA.i = WrapNeg(RB.i);
+	#define VM_BODY_AddR	RA.r = RB.r + RC.r;
+	#define VM_BODY_SubR	RA.r = RB.r - RC.r;
+	#define VM_BODY_MulR	RA.r = RB.r * RC.r;
+	#define VM_BODY_DivR	RA.r = RB.r / RC.r;
+	#define VM_BODY_NegR	RA.r = -RB.r;
+	#define VM_BODY_EqI		RA.i = (RB.i == RC.i);
+	#define VM_BODY_LtI		RA.i = (RB.i < RC.i);
+	#define VM_BODY_LeI		RA.i = (RB.i <= RC.i);
+	#define VM_BODY_EqR		RA.i = (RB.r == RC.r);
+	#define VM_BODY_LtR		RA.i = (RB.r < RC.r);
+	#define VM_BODY_LeR		RA.i = (RB.r <= RC.r);
+	#define VM_BODY_Not		RA.i = (0 == RB.i);
+	#define VM_BODY_IToR	RA.r = Real(RB.i);
+	#define VM_BODY_RToI	RA.i = RealToInt(RB.r);
+	#define VM_BODY_BoxB	RA = Reg::FromValue(Value::FromBool(0 != RB.i));
+	#define VM_BODY_BoxR	RA = Reg::FromValue(Value::FromReal(RB.r));
+	#define VM_BODY_BoxY	RA = Reg::FromValue(Value::FromByte(uint8_t(RB.i)));
+	#define VM_BODY_BoxC	RA = Reg::FromValue(Value::FromChar(Char(RB.i)));
+	#define VM_BODY_UnboxB	RA.i = RB.value().asBool() ? 1 : 0;
+	#define VM_BODY_UnboxI	RA.i = RB.value().asInt();
+	#define VM_BODY_UnboxR	RA.r = RB.value().asReal();
+	#define VM_BODY_UnboxY	RA.i = RB.value().asByte();
+	#define VM_BODY_UnboxC	RA.i = Int(RB.value().asChar());
+	#define VM_BODY_TypeOf	RA.i = RB.value().typeID();
+	#define VM_BODY_Jmp		VM_JUMP();
+	#define VM_BODY_JmpT	if (0 != RA.i) VM_JUMP();
+	#define VM_BODY_JmpF	if (0 == RA.i) VM_JUMP();
+
+	// The parts after the first are read from the instructions that follow
+	#define VM_PART(x)		ins = *pc++; ++executed; VM_BODY_##x
+	#define VM_FUSED_PAIR_CASE(e,s,x,y)		VM_CASE(e) VM_BODY_##x VM_PART(y) VM_NEXT();
+	#define VM_FUSED_TRIPLE_CASE(e,s,x,y,z)	VM_CASE(e) VM_BODY_##x VM_PART(y) VM_PART(z) VM_NEXT();
+
+	OpcodeProfile * const profile = m_profile;
+
+#if UPL_VM_COMPUTED_GOTO
+	#define OPCODE_LABEL(e,s,f)				&&L_##e,
+	#define FUSED_PAIR_LABEL(e,s,x,y)		&&L_##e,
+	#define FUSED_TRIPLE_LABEL(e,s,x,y,z)	&&L_##e,
+	static void * const sc_Dispatch [OpCount] = {
+		UPL_PRIVATE__VM_OPCODES(OPCODE_LABEL)
+		UPL_PRIVATE__VM_FUSED_PAIRS(FUSED_PAIR_LABEL)
+		UPL_PRIVATE__VM_FUSED_TRIPLES(FUSED_TRIPLE_LABEL)
+	};
+	#undef  FUSED_TRIPLE_LABEL
+	#undef  FUSED_PAIR_LABEL
+	#undef  OPCODE_LABEL
+
+	// Profiling goes through L_Profile first, so it costs nothing when off
+	#define PROFILE_LABEL(...)				&&L_Profile,
+	static void * const sc_Profiling [OpCount] = {
+		UPL_PRIVATE__VM_OPCODES(PROFILE_LABEL)
+		UPL_PRIVATE__VM_FUSED_PAIRS(PROFILE_LABEL)
+		UPL_PRIVATE__VM_FUSED_TRIPLES(PROFILE_LABEL)
+	};
+	#undef  PROFILE_LABEL
+	void * const * const dispatch = (nullptr == profile) ? sc_Dispatch : sc_Profiling;
+
+	#define VM_CASE(op)		L_##op:
+	#define VM_NEXT()		do { ins = *pc++; ++executed; goto *dispatch[ins & 0xFF]; } while (false)
+
+	if (nullptr != m_jit)
+		goto L_Native;
+	VM_NEXT();
+	{
+		L_Profile:
+			profile->record (pc - 1);
+			goto *sc_Dispatch[ins & 0xFF];
+#else
+	#define VM_CASE(op)		case Op::op:
+	#define VM_NEXT()		continue
+
+	if (nullptr != m_jit)
+		goto L_Native;
+	for (;;)
+	{
+		ins = *pc++;
+		++executed;
+		if (nullptr != profile)
+			profile->record (pc - 1);
+		switch (GetOp(ins))
+		{
+		default:
+			VM_FAIL(RunError::BadOpcode);
+#endif
+
+		VM_CASE(Nop)	VM_BODY_Nop VM_NEXT();
+		VM_CASE(Move)	VM_BODY_Move VM_NEXT();
+		VM_CASE(LoadK)	VM_BODY_LoadK VM_NEXT();
+		VM_CASE(LoadI)	VM_BODY_LoadI VM_NEXT();
+		VM_CASE(LoadNil)	VM_BODY_LoadNil VM_NEXT();
+		VM_CASE(LoadF)	VM_BODY_LoadF VM_NEXT();
+
+		// Forced globals are read without locking, or leaving the loop
+		VM_CASE(GetG)
+		{
+			auto const index = GetBx(ins);
+			Reg value;
+			if (nullptr != m_globals && m_globals->get(index, value) &&
+				(&m_globals->heap() == &m_heap || !m_globals->isHeapBound(index)))
+			{
+				RA = value;
+				VM_NEXT();
+			}
+
+			m_pc = pc;
+			RunError err;
+			if (!forceGlobal(pc, index, value, err))
+			{
+				if (RunError::None == err)
+					goto L_Unwind;
+				VM_FAIL(err);
+			}
+			RA = value;
+			VM_NEXT();
+		}
+
+		VM_CASE(AddI)	VM_BODY_AddI VM_NEXT();
+		VM_CASE(SubI)	VM_BODY_SubI VM_NEXT();
+		VM_CASE(MulI)	VM_BODY_MulI VM_NEXT();
+		VM_CASE(DivI)	VM_BODY_DivI VM_NEXT();
+		VM_CASE(ModI)	VM_BODY_ModI VM_NEXT();
+		VM_CASE(NegI)	VM_BODY_NegI VM_NEXT();
+
+		VM_CASE(AddR)	VM_BODY_AddR VM_NEXT();
+		VM_CASE(SubR)	VM_BODY_SubR VM_NEXT();
+		VM_CASE(MulR)	VM_BODY_MulR VM_NEXT();
+		VM_CASE(DivR)	VM_BODY_DivR VM_NEXT();
+		VM_CASE(NegR)	VM_BODY_NegR VM_NEXT();
+
+		VM_CASE(EqI)	VM_BODY_EqI VM_NEXT();
+		VM_CASE(LtI)	VM_BODY_LtI VM_NEXT();
+		VM_CASE(LeI)	VM_BODY_LeI VM_NEXT();
+		VM_CASE(EqR)	VM_BODY_EqR VM_NEXT();
+		VM_CASE(LtR)	VM_BODY_LtR VM_NEXT();
+		VM_CASE(LeR)	VM_BODY_LeR VM_NEXT();
+		VM_CASE(Not)	VM_BODY_Not VM_NEXT();
+
+		VM_CASE(IToR)	VM_BODY_IToR VM_NEXT();
+		VM_CASE(RToI)	VM_BODY_RToI VM_NEXT();
+
+		VM_CASE(BoxB)	VM_BODY_BoxB VM_NEXT();
+		VM_CASE(BoxI)
+		{
+			auto const v = RB.i;
+			if (Value::IntFitsInline(v))
+			{
+				RA = Reg::FromValue(Value::FromInlineInt(v));
+				VM_NEXT();
+			}
+
+			m_pc = pc;
+			auto const box = static_cast<BoxedInt *>(m_heap.allocate(Type::STContainer::DefaultID(Type::Tag::Int)));
+			if (nullptr == box)
+				VM_FAIL(RunError::OutOfMemory);
+			box->value = v;
+			RA = Reg::FromValue(Value::FromObject(box));
+			VM_NEXT();
+		}
+		VM_CASE(BoxR)	VM_BODY_BoxR VM_NEXT();
+		VM_CASE(BoxY)	VM_BODY_BoxY VM_NEXT();
+		VM_CASE(BoxC)	VM_BODY_BoxC VM_NEXT();
+		VM_CASE(UnboxB)	VM_BODY_UnboxB VM_NEXT();
+		VM_CASE(UnboxI)	VM_BODY_UnboxI VM_NEXT();
+		VM_CASE(UnboxR)	VM_BODY_UnboxR VM_NEXT();
+		VM_CASE(UnboxY)	VM_BODY_UnboxY VM_NEXT();
+		VM_CASE(UnboxC)	VM_BODY_UnboxC VM_NEXT();
+		VM_CASE(TypeOf)	VM_BODY_TypeOf VM_NEXT();
+
+		VM_CASE(New)
+		{
+			m_pc = pc;
+			auto const obj = m_heap.allocate(Type::ID(K[GetBx(ins)].i));
+			if (nullptr == obj)
+				VM_FAIL(RunError::OutOfMemory);
+			RA = Reg::FromValue(Value::FromObject(obj));
+			VM_NEXT();
+		}
+
+		VM_CASE(NewN)
+		{
+			if (RC.i < 0 || RC.i > 0xFFFFFFFF)
+				VM_FAIL(RunError::IndexOutOfRange);
+			m_pc = pc;
+			auto const obj = m_heap.allocate(Type::ID(RB.i), uint32_t(RC.i));
+			if (nullptr == obj)
+				VM_FAIL(RunError::OutOfMemory);
+			RA = Reg::FromValue(Value::FromObject(obj));
+			VM_NEXT();
+		}
+
+		VM_CASE(GetF)
+		{
+			auto const v = RB.value();
+			if (!v.isObject())
+				VM_FAIL(RunError::NotAnObject);
+			auto const obj = v.asObject();
+			auto & cache = VM_CACHE();
+			auto e = cached(cache, obj->type);
+			if (nullptr == e)
+			{
+				CacheEntry entry = {obj->type, 0, 0, 0, Access::Bad};
+				Type::ID type;
+				if (!m_heap.fieldInfo(obj, GetC(ins), entry.offset, type) || Access::Bad == (entry.access = accessOf(type)))
+					VM_FAIL(RunError::BadField);
+				e = remember(cache, entry, scratch);
+			}
+			Load (static_cast<uint8_t *>(m_heap.payload(obj)) + e->offset, e->access, RA);
+			VM_NEXT();
+		}
+
+		VM_CASE(SetF)
+		{
+			auto const v = RA.value();
+			if (!v.isObject())
+				VM_FAIL(RunError::NotAnObject);
+			auto const obj = v.asObject();
+			auto & cache = VM_CACHE();
+			auto e = cached(cache, obj->type);
+			if (nullptr == e)
+			{
+				CacheEntry entry = {obj->type, 0, 0, 0, Access::Bad};
+				Type::ID type;
+				if (!m_heap.fieldInfo(obj, GetC(ins), entry.offset, type) || Access::Bad == (entry.access = accessOf(type)))
+					VM_FAIL(RunError::BadField);
+				e = remember(cache, entry, scratch);
+			}
+			if (!store(obj, static_cast<uint8_t *>(m_heap.payload(obj)) + e->offset, e->access, RB))
+				VM_FAIL(RunError::BadField);
+			VM_NEXT();
+		}
+
+		VM_CASE(GetE)
+		{
+			auto const v = RB.value();
+			if (!v.isObject())
+				VM_FAIL(RunError::NotAnObject);
+			auto const obj = v.asObject();
+			auto & cache = VM_CACHE();
+			auto e = cached(cache, obj->type);
+			if (nullptr == e)
+			{
+				CacheEntry entry = {obj->type, 0, 0, 0, Access::Bad};
+				Type::ID type;
+				if (!m_heap.elementInfo(obj, entry.offset, type, entry.stride, &entry.count_offset) || Access::Bad == (entry.access = accessOf(type)))
+					VM_FAIL(RunError::BadField);
+				e = remember(cache, entry, scratch);
+			}
+			auto const payload = static_cast<uint8_t *>(m_heap.payload(obj));
+			uint32_t count;
+			memcpy (&count, payload + e->count_offset, sizeof(count));
+			if (RC.i < 0 || uint64_t(RC.i) >= count)
+				VM_FAIL(RunError::IndexOutOfRange);
+			Load (payload + e->offset + size_t(RC.i) * e->stride, e->access, RA);
+			VM_NEXT();
+		}
+
+		VM_CASE(SetE)
+		{
+			auto const v = RA.value();
+			if (!v.isObject())
+				VM_FAIL(RunError::NotAnObject);
+			auto const obj = v.asObject();
+			auto & cache = VM_CACHE();
+			auto e = cached(cache, obj->type);
+			if (nullptr == e)
+			{
+				CacheEntry entry = {obj->type, 0, 0, 0, Access::Bad};
+				Type::ID type;
+				if (!m_heap.elementInfo(obj, entry.offset, type, entry.stride, &entry.count_offset) || Access::Bad == (entry.access = accessOf(type)))
+					VM_FAIL(RunError::BadField);
+				e = remember(cache, entry, scratch);
+			}
+			auto const payload = static_cast<uint8_t *>(m_heap.payload(obj));
+			uint32_t count;
+			memcpy (&count, payload + e->count_offset, sizeof(count));
+			if (RB.i < 0 || uint64_t(RB.i) >= count)
+				VM_FAIL(RunError::IndexOutOfRange);
+			if (!store(obj, payload + e->offset + size_t(RB.i) * e->stride, e->access, RC))
+				VM_FAIL(RunError::BadField);
+			VM_NEXT();
+		}
+
+		VM_CASE(Len)
+		{
+			auto const v = RB.value();
+			if (!v.isObject())
+				VM_FAIL(RunError::NotAnObject);
+			RA.i = m_heap.countOf(v.asObject());
+			VM_NEXT();
+		}
+
+		// Doesn't allocate, so it isn't a safepoint.
+		VM_CASE(Bulk)
+		{
+			auto const err = RunBulk(m_heap, uint8_t(GetC(ins)), GetB(ins), R + GetA(ins), m_stats.bulk_elements);
+			if (RunError::None != err)
+				VM_FAIL(err);
+			VM_NEXT();
+		}
+
+		// Call a function for each element (and PMap allocates), so both are
+		// safepoints. A failure in the function has been reported already.
+		VM_CASE(PMap)
+		{
+			m_pc = pc;
+			RunError err;
+			if (!mapElements(pc, R + GetA(ins), 0 != GetC(ins), err))
+			{
+				if (RunError::None == err)
+					goto L_Unwind;
+				VM_FAIL(err);
+			}
+			VM_NEXT();
+		}
+
+		VM_CASE(PReduce)
+		{
+			m_pc = pc;
+			RunError err;
+			if (!reduceElements(pc, R + GetA(ins), 0 != GetC(ins), err))
+			{
+				if (RunError::None == err)
+					goto L_Unwind;
+				VM_FAIL(err);
+			}
+			VM_NEXT();
+		}
+
+		// May suspend the green thread this runs (and the others may collect
+		// garbage meanwhile), so it's a safepoint.
+		VM_CASE(Io)
+		{
+			m_pc = pc;
+			auto const err = RunIo(*this, m_task, uint8_t(GetC(ins)), GetB(ins), R + GetA(ins));
+			if (RunError::None != err)
+				VM_FAIL(err);
+			VM_NEXT();
+		}
+
+		VM_CASE(Jmp)	VM_BODY_Jmp VM_NEXT();
+		VM_CASE(JmpT)	VM_BODY_JmpT VM_NEXT();
+		VM_CASE(JmpF)	VM_BODY_JmpF VM_NEXT();
+
+		UPL_PRIVATE__VM_FUSED_PAIRS(VM_FUSED_PAIR_CASE)
+		UPL_PRIVATE__VM_FUSED_TRIPLES(VM_FUSED_TRIPLE_CASE)
+
+		VM_CASE(Call)
+		{
+			auto const a = GetA(ins);
+			Function const * callee = R[a].f;
+			auto & cache = VM_CACHE();
+			if (nullptr == cached(cache, uintptr_t(callee)))
+			{
+				if (nullptr == callee)
+					VM_FAIL(RunError::BadFunction);
+				if (GetB(ins) != callee->param_count)
+					VM_FAIL(RunError::BadArgCount);
+				remember (cache, {uintptr_t(callee), 0, 0, 0, Access::Bad}, scratch);
+			}
+
+			// A pure callee's result may be known already; if it isn't, it
+			// will be once the callee returns.
+			MemoTable * memo = nullptr;
+			MemoReservation reservation = {0, 0, 0};
+			if (0 != (callee->flags & Function::msc_Pure) && nullptr != m_memo &&
+				nullptr != (memo = m_memo->tableFor(callee)))
+			{
+				if (memo->find(R + a + 1, R[a], &reservation))
+				{
+					m_stats.memo_hits += 1;
+					VM_NEXT();
+				}
+				m_stats.memo_misses += 1;
+				reservation.calls = m_stats.calls;
+			}
+
+			// The arguments are already in place: they become R[0], R[1], ...
+			uint32_t const new_base = uint32_t(R - regs) + a + 1;
+			if (new_base + callee->register_count > m_registers.size() || m_frames.size() >= m_max_frames)
+				VM_FAIL(RunError::StackOverflow);
+
+			m_frames.push_back ({callee, pc, new_base, a, memo, reservation});
+			m_stats.calls += 1;
+			if (m_frames.size() > m_stats.max_frame_depth)
+				m_stats.max_frame_depth = m_frames.size();
+
+			fn = callee;
+			R = regs + new_base;
+			pc = code + callee->code_offset;
+			if (nullptr != m_jit)
+				goto L_Native;
+			VM_NEXT();
+		}
+
+		// The callee takes over this frame (and returns straight to our
+		// caller), so a chain of tail calls runs in constant space.
+		VM_CASE(TailCall)
+		{
+			auto const a = GetA(ins);
+			auto const n = GetB(ins);
+			Function const * callee = R[a].f;
+			auto & cache = VM_CACHE();
+			if (nullptr == cached(cache, uintptr_t(callee)))
+			{
+				if (nullptr == callee)
+					VM_FAIL(RunError::BadFunction);
+				if (n != callee->param_count)
+					VM_FAIL(RunError::BadArgCount);
+				remember (cache, {uintptr_t(callee), 0, 0, 0, Access::Bad}, scratch);
+			}
+
+			// The callee's result is this frame's, so a known one is returned
+			// straight away. The frame remembers one result at most: if it's
+			// already to remember its own, that will be the callee's anyway.
+			MemoTable * memo = nullptr;
+			if (0 != (callee->flags & Function::msc_Pure) && nullptr != m_memo &&
+				nullptr != (memo = m_memo->tableFor(callee)))
+			{
+				auto & frame = m_frames.back();
+				bool const reserve = (nullptr == frame.memo);
+				if (memo->find(R + a + 1, ret_value, reserve ? &frame.reservation : nullptr))
+				{
+					m_stats.memo_hits += 1;
+					goto L_Return;
+				}
+				m_stats.memo_misses += 1;
+				if (reserve)
+				{
+					frame.memo = memo;
+					frame.reservation.calls = m_stats.calls;
+				}
+			}
+
+			uint32_t const base = uint32_t(R - regs);
+			if (base + callee->register_count > m_registers.size())
+				VM_FAIL(RunError::StackOverflow);
+
+			for (unsigned i = 0; i < n; ++i)
+				R[i] = R[a + 1 + i];
+
+			m_frames.back().function = callee;
+			m_stats.calls += 1;
+			m_stats.tail_calls += 1;
+
+			fn = callee;
+			pc = code + callee->code_offset;
+			if (nullptr != m_jit)
+				goto L_Native;
+			VM_NEXT();
+		}
+
+		VM_CASE(Ret)	ret_value = RA; goto L_Return;
+		VM_CASE(RetNil)	ret_value.u = 0; goto L_Return;
+
+		L_Return:
+		{
+			Frame const done = m_frames.back();
+			m_frames.pop_back ();
+			if (nullptr != done.memo)
+				done.memo->fill (done.reservation, ret_value, m_stats.calls);
+
+			if (m_frames.size() < entry_depth)
+			{
+				out_result = ret_value;
+				m_stats.instructions += executed;
+				return true;
+			}
+
+			auto const & caller = m_frames.back();
+			fn = caller.function;
+			R = regs + caller.base;
+			R[done.return_reg] = ret_value;
+			pc = done.return_pc;
+			VM_NEXT();
+		}
+
+		// On entering a function, and going back round a loop: into native
+		// code from "pc", if the function has (or now gets) any. It comes
+		// back with the result, or where the interpreter is to go on.
+		L_Native:
+		{
+			auto const native = m_jit->enter(uint32_t(fn - functions));
+			if (nullptr == native)
+				VM_NEXT();
+
+			auto const start = code + fn->code_offset;
+			m_stats.native_entries += 1;
+			auto const at = native(R, uint32_t(pc - start), &ret_value);
+			if (Jit::msc_Returned == at)
+				goto L_Return;
+			m_stats.native_exits += 1;
+			pc = start + at;
+			VM_NEXT();
+		}
+
+#if !UPL_VM_COMPUTED_GOTO
+		}
+#endif
+	}
+
+L_Fail:
+	m_frames.resize (entry_depth - 1);
+	m_stats.instructions += executed;
+	return fail(error, fn);
+
+L_Unwind:
+	m_frames.resize (entry_depth - 1);
+	m_stats.instructions += executed;
+	return false;
+
+	#undef VM_NEXT
+	#undef VM_CASE
+	#undef VM_FUSED_TRIPLE_CASE
+	#undef VM_FUSED_PAIR_CASE
+	#undef VM_PART
+	#undef VM_BODY_Nop
+	#undef VM_BODY_Move
+	#undef VM_BODY_LoadK
+	#undef VM_BODY_LoadI
+	#undef VM_BODY_LoadNil
+	#undef VM_BODY_LoadF
+	#undef VM_BODY_AddI
+	#undef VM_BODY_SubI
+	#undef VM_BODY_MulI
+	#undef VM_BODY_DivI
+	#undef VM_BODY_ModI
+	#undef VM_BODY_NegI
+	#undef VM_BODY_AddR
+	#undef VM_BODY_SubR
+	#undef VM_BODY_MulR
+	#undef VM_BODY_DivR
+	#undef VM_BODY_NegR
+	#undef VM_BODY_EqI
+	#undef VM_BODY_LtI
+	#undef VM_BODY_LeI
+	#undef VM_BODY_EqR
+	#undef VM_BODY_LtR
+	#undef VM_BODY_LeR
+	#undef VM_BODY_Not
+	#undef VM_BODY_IToR
+	#undef VM_BODY_RToI
+	#undef VM_BODY_BoxB
+	#undef VM_BODY_BoxR
+	#undef VM_BODY_BoxY
+	#undef VM_BODY_BoxC
+	#undef VM_BODY_UnboxB
+	#undef VM_BODY_UnboxI
+	#undef VM_BODY_UnboxR
+	#undef VM_BODY_UnboxY
+	#undef VM_BODY_UnboxC
+	#undef VM_BODY_TypeOf
+	#undef VM_BODY_Jmp
+	#undef VM_BODY_JmpT
+	#undef VM_BODY_JmpF
+	#undef VM_JUMP
+	#undef VM_CACHE
+	#undef VM_FAIL
+	#undef RC
+	#undef RB
+	#undef RA
+}
+
 //======================================================================
 
+	}	// namespace VM
 }	// namespace UPL
 
 //======================================================================
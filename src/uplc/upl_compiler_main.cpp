@@ -1,17 +1,232 @@
 //======================================================================
 
+#include <upl/error_sinks.hpp>
+#include <upl/errors.hpp>
+#include <upl/heap.hpp>
+#include <upl/input.hpp>
+#include <upl/jit.hpp>
+#include <upl/lexer.hpp>
+#include <upl/module_file.hpp>
+#include <upl/vm.hpp>
+
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
 #include <iostream>
+#include <memory>
+#include <vector>
 
 //======================================================================
-//======================================================================
+
+static int Usage ()
+{
+	std::cerr
+		<< "Usage:\n"
+		<< "  uplc <source.upl> [-o <module.uplm>]   compile a source file into a module\n"
+		<< "  uplc --dump <module.uplm>              load a module and disassemble it\n"
+		<< "  uplc --run <module.uplm> <function> [<int arg>...] [--jit=off|baseline] [--profile=<file>]\n"
+		<< "                                         load a module and call a function (adding\n"
+		<< "                                         the opcodes it ran to an opcode profile)\n";
+	return 2;
+}
+
 //----------------------------------------------------------------------
-//======================================================================
+// There's no code generation from the AST yet, so for now this checks
+// the source and writes out a module with just the types.
+static int Compile (char const * source, std::string output)
+{
+	if (output.empty())
+	{
+		output = source;
+		auto const dot = output.find_last_of('.');
+		auto const slash = output.find_last_of("/\\");
+		if (std::string::npos != dot && (std::string::npos == slash || dot > slash))
+			output.resize (dot);
+		output += ".uplm";
+	}
+
+	UPL::Error::Reporter err;
+	UPL::Error::TextSink sink (stderr);
+	err.setSink (&sink, false);
+
+	UPL::UTF8FileStream inp (source, err);
+	UPL::Lexer lex (inp, err);
+	if (!lex.eoi() && !lex.error())
+		while (lex.pop())
+			err.poll ();
+	sink.flush ();
+	if (inp.error() || lex.error())
+		return 1;
+
+	UPL::VM::Module module;
+	auto const res = UPL::VM::SaveModule(module, output.c_str());
+	if (UPL::VM::ModuleFileError::None != res)
+	{
+		std::cerr << output << ": " << UPL::VM::ModuleFileErrorName(res) << "\n";
+		return 1;
+	}
 
-int main (int /*argc*/, char * /*argv*/[])
+	std::cout << "Wrote " << output << "\n";
+	return 0;
+}
+
+//----------------------------------------------------------------------
+
+static int Dump (char const * path)
 {
-	std::cout << "This is going to be the UPL compiler...\n";
-	
+	UPL::VM::Module module;
+
+	auto const start = std::chrono::steady_clock::now();
+	auto const res = UPL::VM::LoadModule(path, module, true);
+	auto const usecs = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+
+	if (UPL::VM::ModuleFileError::None != res)
+	{
+		std::cerr << path << ": " << UPL::VM::ModuleFileErrorName(res) << "\n";
+		return 1;
+	}
+
+	std::wcout
+		<< path << ": loaded in " << usecs << "us; "
+		<< module.types().size() << " types, " << module.functionCount() << " functions, " << module.globalCount() << " globals, "
+		<< module.codeSize() << " instructions, " << module.constantCount() << " constants\n";
+	for (uint32_t i = 0; i < module.functionCount(); ++i)
+		std::wcout << module.disassemble(i);
+
 	return 0;
 }
 
+//----------------------------------------------------------------------
+
+static int Run (char const * path, char const * function, std::vector<UPL::Int> const & args, UPL::VM::JitMode jit_mode,
+	char const * profile_path)
+{
+	using UPL::VM::Reg;
+
+	UPL::VM::Module module;
+	auto const res = UPL::VM::LoadModule(path, module, true);
+	if (UPL::VM::ModuleFileError::None != res)
+	{
+		std::cerr << path << ": " << UPL::VM::ModuleFileErrorName(res) << "\n";
+		return 1;
+	}
+
+	auto const index = module.findFunction(function);
+	if (index >= module.functionCount())
+	{
+		std::cerr << path << ": no function \"" << function << "\"\n";
+		return 1;
+	}
+	if (module.function(index).param_count != args.size())
+	{
+		std::cerr << function << " takes " << module.function(index).param_count << " arguments\n";
+		return 1;
+	}
+
+	UPL::Error::Reporter err;
+	UPL::Error::TextSink sink (stderr);
+	err.setSink (&sink, false);
+	UPL::VM::Heap heap (module.types());
+	UPL::VM::Interpreter vm (module, err, heap);
+	UPL::VM::JitOptions options;
+	options.mode = jit_mode;
+	std::unique_ptr<UPL::VM::Jit> jit;
+	if (UPL::VM::JitMode::Off != jit_mode)
+	{
+		jit.reset (new UPL::VM::Jit (module, options));
+		vm.setJit (jit.get());
+	}
+
+	// Added to what's in the file, if there is one
+	UPL::VM::OpcodeProfile profile;
+	if (nullptr != profile_path)
+	{
+		FILE * f = fopen(profile_path, "r");
+		if (nullptr != f)
+		{
+			fclose (f);
+			if (!profile.load(profile_path))
+			{
+				std::cerr << profile_path << ": not an opcode profile\n";
+				return 1;
+			}
+		}
+		vm.setProfile (&profile);
+	}
+
+	std::vector<Reg> regs;
+	for (auto a : args)
+		regs.push_back (Reg::FromInt(a));
+	Reg result;
+	auto const start = std::chrono::steady_clock::now();
+	bool ok = vm.call(index, regs.data(), int(regs.size()), result);
+	auto const ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+	sink.flush ();
+	if (!ok)
+		return 1;
+	if (nullptr != profile_path && !profile.save(profile_path))
+	{
+		std::cerr << profile_path << ": can't write\n";
+		return 1;
+	}
+
+	auto const type = module.types().unpack(module.function(index).type);
+	auto const tag = UPL::Type::Tag::Function == type.tag ? module.types().unpack(type.type1).tag : UPL::Type::Tag::INVALID;
+	std::cout << function << " = ";
+	if (UPL::Type::Tag::Real == tag)
+		std::cout << result.r;
+	else if (UPL::Type::Tag::Bool == tag)
+		std::cout << (result.i ? "true" : "false");
+	else
+		std::cout << result.i;
+	std::cout
+		<< "\n" << ms << "ms (jit: " << UPL::VM::JitModeName(jit_mode) << "); "
+		<< vm.stats().instructions << " instructions interpreted, " << vm.stats().native_entries << " native entries\n";
+	if (jit)
+		std::cout << jit->stats().compiled << " functions compiled, " << jit->stats().code_bytes << " bytes of code\n";
+	return 0;
+}
+
+//======================================================================
+
+int main (int argc, char * argv[])
+{
+	if (argc == 3 && 0 == strcmp(argv[1], "--dump"))
+		return Dump(argv[2]);
+
+	if (argc >= 4 && 0 == strcmp(argv[1], "--run"))
+	{
+		auto jit_mode = UPL::VM::JitOptions().mode;
+		char const * profile_path = nullptr;
+		std::vector<UPL::Int> args;
+		for (int i = 4; i < argc; ++i)
+		{
+			if (0 == strncmp(argv[i], "--jit=", 6))
+			{
+				if (!UPL::VM::ParseJitMode(argv[i] + 6, jit_mode))
+					return Usage();
+				continue;
+			}
+			if (0 == strncmp(argv[i], "--profile=", 10))
+			{
+				profile_path = argv[i] + 10;
+				continue;
+			}
+			char * end = nullptr;
+			args.push_back (strtoll(argv[i], &end, 10));
+			if (end == argv[i] || '\0' != *end)
+				return Usage();
+		}
+		return Run(argv[2], argv[3], args, jit_mode, profile_path);
+	}
+
+	if (argc == 2 && argv[1][0] != '-')
+		return Compile(argv[1], std::string());
+
+	if (argc == 4 && argv[1][0] != '-' && 0 == strcmp(argv[2], "-o"))
+		return Compile(argv[1], argv[3]);
+
+	return Usage();
+}
+
 //======================================================================